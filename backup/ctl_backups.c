@@ -47,15 +47,20 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 
+#include <sys/mman.h>
+
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "lib/cyrusdb.h"
 #include "lib/exitcodes.h"
+#include "lib/gzuncat.h"
 #include "lib/util.h"
 
 #include "imap/global.h"
@@ -96,6 +101,8 @@ static void usage(void)
             "    -C alt_config       # alternate config file\n"
             "    -F                  # force (run command even if not needed)\n"
             "    -S                  # stop on error\n"
+            "    -T rate             # limit aggregate read rate (bytes/sec, K/M/G suffix)\n"
+            "    -j n                # process n backups in parallel (compact/reindex/verify)\n"
             "    -v                  # verbose (repeat for more verbosity)\n"
             "    -w                  # wait for locks (don't skip locked backups)\n"
     );
@@ -173,6 +180,177 @@ enum ctlbu_cmd {
 
 static int ctlbu_skips_fails = 0;
 
+/* Global I/O token bucket (-T), kept in shared memory so that the
+ * aggregate read rate stays capped no matter how many worker processes
+ * are running.  Charged from the gzuncat read hook, i.e. for compressed
+ * bytes as they come off disk.
+ */
+struct io_bucket {
+    pthread_mutex_t lock;
+    struct timespec last;
+    double tokens;          /* bytes currently available */
+    double rate;            /* bytes per second */
+};
+static struct io_bucket *io_bucket = NULL;
+
+static void io_bucket_init(double rate)
+{
+    pthread_mutexattr_t attr;
+
+    io_bucket = mmap(NULL, sizeof(*io_bucket), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (io_bucket == MAP_FAILED)
+        fatal("can't mmap shared I/O bucket", EC_OSERR);
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&io_bucket->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    clock_gettime(CLOCK_MONOTONIC, &io_bucket->last);
+    io_bucket->tokens = rate;   /* allow an initial one second burst */
+    io_bucket->rate = rate;
+}
+
+static void io_bucket_charge(size_t bytes)
+{
+    struct timespec now;
+    double deficit = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&io_bucket->lock);
+    io_bucket->tokens += io_bucket->rate
+                         * ((now.tv_sec - io_bucket->last.tv_sec)
+                            + (now.tv_nsec - io_bucket->last.tv_nsec) / 1e9);
+    if (io_bucket->tokens > io_bucket->rate)
+        io_bucket->tokens = io_bucket->rate;
+    io_bucket->last = now;
+
+    /* let the balance go negative and sleep off the deficit, so the
+     * cap holds on average without busy-waiting */
+    io_bucket->tokens -= bytes;
+    if (io_bucket->tokens < 0)
+        deficit = -io_bucket->tokens;
+    pthread_mutex_unlock(&io_bucket->lock);
+
+    if (deficit > 0) {
+        double wait = deficit / io_bucket->rate;
+        struct timespec ts;
+        ts.tv_sec = (time_t) wait;
+        ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* Multi-process mode (-j): backups are handed out to up to n child
+ * processes, each of which handles one backup and exits.  Children
+ * report back through their exit status.
+ */
+enum {
+    CTLBU_CHILD_OK = 0,
+    CTLBU_CHILD_SKIPPED = 1,
+    CTLBU_CHILD_FAILED = 2,
+};
+
+static int ctlbu_n_workers = 0;         /* -j; 0 or 1 means in-process */
+static int ctlbu_running = 0;           /* children currently forked */
+static foreach_cb *ctlbu_worker_func = NULL;
+
+/* wait for one child and account for its result.  returns nonzero if
+ * the child failed (not merely skipped) */
+static int ctlbu_reap_one(void)
+{
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+
+    if (pid < 0) {
+        if (errno != ECHILD)
+            syslog(LOG_ERR, "IOERROR: %s: waitpid: %m", __func__);
+        ctlbu_running = 0;
+        return 0;
+    }
+
+    ctlbu_running--;
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == CTLBU_CHILD_OK)
+        return 0;
+
+    ctlbu_skips_fails++;
+
+    return !(WIFEXITED(status) && WEXITSTATUS(status) == CTLBU_CHILD_SKIPPED);
+}
+
+/* same signature as foreach_cb.  fork a child to run the real command
+ * callback, first reaping until we're under the worker limit */
+static int cmd_parallel_one(void *rock,
+                            const char *key, size_t key_len,
+                            const char *data, size_t data_len)
+{
+    struct ctlbu_cmd_options *options = (struct ctlbu_cmd_options *) rock;
+    int failed = 0;
+    pid_t pid;
+
+    while (ctlbu_running >= ctlbu_n_workers) {
+        if (ctlbu_reap_one())
+            failed = 1;
+    }
+
+    if (failed && options->stop_on_error)
+        return -1;
+
+    fflush(stdout);
+    pid = fork();
+
+    if (pid < 0) {
+        syslog(LOG_ERR, "IOERROR: %s: fork: %m", __func__);
+        fatal("can't fork worker process", EC_OSERR);
+    }
+
+    if (pid == 0) {
+        /* child: handle this one backup and report via exit status.
+         * force stop_on_error so the callback returns the real result
+         * rather than swallowing it */
+        struct ctlbu_cmd_options child_options = *options;
+        int r;
+
+        child_options.stop_on_error = 1;
+        ctlbu_skips_fails = 0;
+
+        r = ctlbu_worker_func(&child_options, key, key_len, data, data_len);
+
+        fflush(NULL);
+        if (!r && !ctlbu_skips_fails)
+            _exit(CTLBU_CHILD_OK);
+        else if (!r || r == IMAP_MAILBOX_LOCKED)
+            _exit(CTLBU_CHILD_SKIPPED);
+        else
+            _exit(CTLBU_CHILD_FAILED);
+    }
+
+    ctlbu_running++;
+    return 0;
+}
+
+/* parse a -T argument: bytes per second with optional K/M/G suffix */
+static double parse_io_rate(const char *str)
+{
+    char *end = NULL;
+    double rate = strtod(str, &end);
+
+    if (end == str) return 0;
+
+    switch (*end) {
+    case 'k': case 'K': rate *= 1024; end++; break;
+    case 'm': case 'M': rate *= 1024 * 1024; end++; break;
+    case 'g': case 'G': rate *= 1024 * 1024 * 1024; end++; break;
+    default: break;
+    }
+
+    if (*end) return 0;
+    return rate;
+}
+
 /* same signature as foreach_cb */
 static int cmd_compact_one(void *rock,
                            const char *userid, size_t userid_len,
@@ -323,13 +501,14 @@ int main(int argc, char **argv)
     const char *alt_config = NULL;
     enum ctlbu_cmd cmd = CTLBU_CMD_UNSPECIFIED;
     struct ctlbu_cmd_options options = {0};
+    double io_rate = 0;
     options.wait = BACKUP_OPEN_NONBLOCK;
 
     if ((geteuid()) == 0 && (become_cyrus(/*is_master*/0) != 0)) {
         fatal("must run as the Cyrus user", EC_USAGE);
     }
 
-    while ((opt = getopt(argc, argv, ":AC:DFPScfmpst:x:uvw")) != EOF) {
+    while ((opt = getopt(argc, argv, ":AC:DFPScfj:mpsT:t:x:uvw")) != EOF) {
         switch (opt) {
         case 'A':
             if (options.mode != CTLBU_MODE_UNSPECIFIED) usage();
@@ -359,6 +538,10 @@ int main(int argc, char **argv)
             if (options.mode != CTLBU_MODE_UNSPECIFIED) usage();
             options.mode = CTLBU_MODE_FILENAME;
             break;
+        case 'j':
+            ctlbu_n_workers = atoi(optarg);
+            if (ctlbu_n_workers < 1) usage();
+            break;
         case 'm':
             if (options.mode != CTLBU_MODE_UNSPECIFIED) usage();
             options.mode = CTLBU_MODE_MBOXNAME;
@@ -371,6 +554,10 @@ int main(int argc, char **argv)
             if (options.lock_mode != CTLBU_LOCK_MODE_UNSPECIFIED) usage();
             options.lock_mode = CTLBU_LOCK_MODE_SQL;
             break;
+        case 'T':
+            io_rate = parse_io_rate(optarg);
+            if (io_rate <= 0) usage();
+            break;
         case 't':
             options.list_stale = atoi(optarg);
             if (!options.list_stale) usage();
@@ -409,6 +596,18 @@ int main(int argc, char **argv)
         && cmd != CTLBU_CMD_LOCK)
         usage();
 
+    /* parallel mode only makes sense for the batch commands */
+    if (ctlbu_n_workers > 1) {
+        switch (cmd) {
+        case CTLBU_CMD_COMPACT:
+        case CTLBU_CMD_REINDEX:
+        case CTLBU_CMD_VERIFY:
+            break;
+        default:
+            usage();
+        }
+    }
+
     switch (cmd) {
     /* list defaults to all */
     case CTLBU_CMD_LIST:
@@ -445,6 +644,18 @@ int main(int argc, char **argv)
 
     cyrus_init(alt_config, "ctl_backups", 0, 0);
 
+    if (io_rate > 0) {
+        io_bucket_init(io_rate);
+        gzuc_set_read_hook(&io_bucket_charge);
+    }
+
+    /* in parallel mode, hand each backup off to a worker process */
+    foreach_cb *one_cb = cmd_func[cmd];
+    if (ctlbu_n_workers > 1 && one_cb) {
+        ctlbu_worker_func = one_cb;
+        one_cb = cmd_parallel_one;
+    }
+
     if (cmd == CTLBU_CMD_RECONSTRUCT) {
         /* special handling for reconstruct */
         // FIXME
@@ -457,7 +668,7 @@ int main(int argc, char **argv)
 
         if (!r)
             r = cyrusdb_foreach(backups_db, NULL, 0, NULL,
-                                cmd_func[cmd], &options,
+                                one_cb, &options,
                                 NULL);
 
         if (backups_db)
@@ -475,7 +686,7 @@ int main(int argc, char **argv)
 
             r = cyrusdb_foreach(backups_db, NULL, 0,
                                 domain_filter,
-                                cmd_func[cmd], &options,
+                                one_cb, &options,
                                 NULL);
         }
 
@@ -493,7 +704,7 @@ int main(int argc, char **argv)
             r = cyrusdb_foreach(backups_db,
                                 argv[i], strlen(argv[i]),
                                 NULL,
-                                cmd_func[cmd], &options,
+                                one_cb, &options,
                                 NULL);
         }
 
@@ -531,8 +742,8 @@ int main(int argc, char **argv)
             else
                 buf_setcstr(&fname, argv[i]);
 
-            if (!r && cmd_func[cmd])
-                r = cmd_func[cmd](&options,
+            if (!r && one_cb)
+                r = one_cb(&options,
                                   buf_cstring(&userid),
                                   buf_len(&userid),
                                   buf_cstring(&fname),
@@ -547,6 +758,10 @@ int main(int argc, char **argv)
         buf_free(&fname);
     }
 
+    /* wait for any workers still running */
+    while (ctlbu_running)
+        ctlbu_reap_one();
+
     backup_cleanup_staging_path();
     cyrus_done();
     exit(r || ctlbu_skips_fails ? EC_TEMPFAIL : EC_OK);
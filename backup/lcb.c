@@ -448,6 +448,7 @@ EXPORTED int backup_close(struct backup **backupp)
     *backupp = NULL;
 
     gzFile gzfile = NULL;
+    struct backup_pgz *pgz = NULL;
     int r1 = 0, r2 = 0;
 
     if (backup->append_state) {
@@ -455,6 +456,7 @@ EXPORTED int backup_close(struct backup **backupp)
             r1 = backup_append_end(backup, NULL);
 
         gzfile = backup->append_state->gzfile;
+        pgz = backup->append_state->pgz;
 
         free(backup->append_state);
         backup->append_state = NULL;
@@ -474,6 +476,9 @@ EXPORTED int backup_close(struct backup **backupp)
         }
     }
 
+    /* the parallel writer doesn't own the fd, so still close it below */
+    if (pgz) backup_pgz_free(&pgz);
+
     if (backup->fd >= 0) {
         /* closing the file will also release the lock on the fd */
         if (gzfile)
@@ -42,9 +42,12 @@
  */
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <syslog.h>
 
 #include "lib/exitcodes.h"
+#include "lib/libconfig.h"
+#include "lib/retry.h"
 #include "lib/sqldb.h"
 #include "lib/xmalloc.h"
 #include "lib/xsha1.h"
@@ -90,6 +93,339 @@ static int retry_gzwrite(gzFile gzfile, const char *str, size_t len, const char
     return 0;
 }
 
+/* Parallel compression, pigz-style.
+ *
+ * When backup_compress_workers is nonzero, chunk data is carved into
+ * fixed-size blocks which worker threads deflate independently as raw
+ * deflate streams.  Each block ends with a sync flush, which byte-aligns
+ * it and leaves it non-final, so the blocks simply concatenate into one
+ * valid deflate stream.  The main thread writes out a gzip header, the
+ * finished blocks in order, an empty final block and the gzip trailer
+ * (combined crc32 plus length), producing exactly one standard gzip
+ * member per chunk - the same shape the inline gzFile path produces, so
+ * the read side (lcb_read.c, gzuncat) needs no changes.
+ */
+
+#define PGZ_BLOCK_SIZE (128 * 1024)
+
+enum pgz_block_state {
+    PGZ_QUEUED = 0,     /* waiting for a worker */
+    PGZ_BUSY,           /* a worker is compressing it */
+    PGZ_DONE,           /* compressed, waiting to be written out */
+};
+
+struct pgz_block {
+    struct pgz_block *next;
+    struct buf in;
+    struct buf out;
+    uint32_t crc;
+    enum pgz_block_state state;
+    int error;
+};
+
+struct backup_pgz {
+    int fd;
+    char *fname;                /* for error reporting only */
+
+    pthread_mutex_t lock;
+    pthread_cond_t avail;       /* work queued, or shutting down */
+    pthread_cond_t done;        /* a block finished compressing */
+    struct pgz_block *head;     /* blocks in stream order */
+    struct pgz_block **tail;
+    unsigned n_blocks;          /* length of the block list */
+    int shutdown;
+
+    pthread_t *workers;
+    unsigned n_workers;
+
+    struct buf cur;             /* input still being accumulated */
+    uint32_t crc;               /* combined crc32 of written blocks */
+    unsigned long total_in;     /* uncompressed length of this member */
+};
+
+static void pgz_block_free(struct pgz_block **blockp)
+{
+    struct pgz_block *block = *blockp;
+    *blockp = NULL;
+
+    buf_free(&block->in);
+    buf_free(&block->out);
+    free(block);
+}
+
+/* deflate one block, independently of every other block */
+static int pgz_compress_block(struct pgz_block *block)
+{
+    z_stream zs;
+    size_t bound;
+    int r;
+
+    memset(&zs, 0, sizeof(zs));
+    r = deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                     -MAX_WBITS, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+    if (r != Z_OK) return r;
+
+    bound = deflateBound(&zs, buf_len(&block->in)) + 16;
+    buf_ensure(&block->out, bound);
+
+    zs.next_in = (unsigned char *) block->in.s;
+    zs.avail_in = buf_len(&block->in);
+    zs.next_out = (unsigned char *) block->out.s;
+    zs.avail_out = bound;
+
+    r = deflate(&zs, Z_SYNC_FLUSH);
+    if (r == Z_OK && !zs.avail_in) {
+        buf_truncate(&block->out, zs.total_out);
+        block->crc = crc32(crc32(0L, Z_NULL, 0),
+                           (unsigned char *) block->in.s,
+                           buf_len(&block->in));
+        r = Z_OK;
+    }
+    else if (r == Z_OK) {
+        /* can't happen - the output buffer was sized with deflateBound */
+        r = Z_BUF_ERROR;
+    }
+
+    deflateEnd(&zs);
+    return r;
+}
+
+static void *pgz_worker(void *rock)
+{
+    struct backup_pgz *pgz = (struct backup_pgz *) rock;
+
+    pthread_mutex_lock(&pgz->lock);
+    for (;;) {
+        struct pgz_block *block;
+
+        for (block = pgz->head; block; block = block->next) {
+            if (block->state == PGZ_QUEUED) break;
+        }
+
+        if (!block) {
+            if (pgz->shutdown) break;
+            pthread_cond_wait(&pgz->avail, &pgz->lock);
+            continue;
+        }
+
+        block->state = PGZ_BUSY;
+        pthread_mutex_unlock(&pgz->lock);
+
+        int r = pgz_compress_block(block);
+
+        pthread_mutex_lock(&pgz->lock);
+        block->error = r;
+        block->state = PGZ_DONE;
+        pthread_cond_signal(&pgz->done);
+    }
+    pthread_mutex_unlock(&pgz->lock);
+
+    return NULL;
+}
+
+/* pop the head block once it's compressed and write it out.
+ * call with the lock held; returns with the lock held */
+static int pgz_write_head_block(struct backup_pgz *pgz)
+{
+    struct pgz_block *block;
+    int r;
+
+    while (pgz->head->state != PGZ_DONE)
+        pthread_cond_wait(&pgz->done, &pgz->lock);
+
+    block = pgz->head;
+    pgz->head = block->next;
+    if (!pgz->head) pgz->tail = &pgz->head;
+    pgz->n_blocks--;
+
+    pthread_mutex_unlock(&pgz->lock);
+
+    r = block->error;
+    if (r) {
+        syslog(LOG_ERR, "IOERROR: %s deflate %s: %i",
+                        __func__, pgz->fname, r);
+        if (r == Z_MEM_ERROR)
+            fatal("deflate: out of memory", EC_TEMPFAIL);
+    }
+    else if (retry_write(pgz->fd, block->out.s, buf_len(&block->out)) < 0) {
+        syslog(LOG_ERR, "IOERROR: %s write %s: %m", __func__, pgz->fname);
+        r = Z_ERRNO;
+    }
+    else {
+        pgz->crc = crc32_combine(pgz->crc, block->crc, buf_len(&block->in));
+        pgz->total_in += buf_len(&block->in);
+    }
+
+    pgz_block_free(&block);
+
+    pthread_mutex_lock(&pgz->lock);
+    return r;
+}
+
+/* queue the accumulated input as a block for the workers */
+static int pgz_queue_cur(struct backup_pgz *pgz)
+{
+    struct pgz_block *block;
+    int r = 0;
+
+    if (!buf_len(&pgz->cur)) return 0;
+
+    block = xzmalloc(sizeof(*block));
+    buf_move(&block->in, &pgz->cur);
+
+    pthread_mutex_lock(&pgz->lock);
+    *pgz->tail = block;
+    pgz->tail = &block->next;
+    pgz->n_blocks++;
+    pthread_cond_signal(&pgz->avail);
+
+    /* bound the queue so a slow disk can't buffer the whole stream */
+    while (!r && pgz->n_blocks > 2 * pgz->n_workers)
+        r = pgz_write_head_block(pgz);
+    pthread_mutex_unlock(&pgz->lock);
+
+    return r;
+}
+
+static struct backup_pgz *pgz_new(int fd, const char *fname, int n_workers)
+{
+    struct backup_pgz *pgz = xzmalloc(sizeof(*pgz));
+    int i;
+
+    pgz->fd = fd;
+    pgz->fname = xstrdup(fname);
+    pgz->tail = &pgz->head;
+
+    pthread_mutex_init(&pgz->lock, NULL);
+    pthread_cond_init(&pgz->avail, NULL);
+    pthread_cond_init(&pgz->done, NULL);
+
+    pgz->n_workers = n_workers;
+    pgz->workers = xzmalloc(n_workers * sizeof(pthread_t));
+    for (i = 0; i < n_workers; i++) {
+        int r = pthread_create(&pgz->workers[i], NULL, pgz_worker, pgz);
+        if (r) {
+            syslog(LOG_ERR, "%s: pthread_create: %s", __func__, strerror(r));
+            fatal("can't create compression workers", EC_TEMPFAIL);
+        }
+    }
+
+    return pgz;
+}
+
+/* begin a new gzip member.  mtime zero and OS unix, like gzdopen writes */
+static int pgz_member_start(struct backup_pgz *pgz)
+{
+    static const unsigned char gz_header[10] =
+        { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3 };
+
+    pgz->crc = crc32(0L, Z_NULL, 0);
+    pgz->total_in = 0;
+
+    if (retry_write(pgz->fd, (const char *) gz_header, sizeof(gz_header)) < 0) {
+        syslog(LOG_ERR, "IOERROR: %s write %s: %m", __func__, pgz->fname);
+        return Z_ERRNO;
+    }
+
+    return 0;
+}
+
+static int pgz_write(struct backup_pgz *pgz, const char *str, size_t len)
+{
+    buf_appendmap(&pgz->cur, str, len);
+
+    if (buf_len(&pgz->cur) < PGZ_BLOCK_SIZE) return 0;
+
+    return pgz_queue_cur(pgz);
+}
+
+/* push all buffered input through the workers and out to disk,
+ * the equivalent of a gzflush */
+static int pgz_drain(struct backup_pgz *pgz)
+{
+    int r = pgz_queue_cur(pgz);
+
+    pthread_mutex_lock(&pgz->lock);
+    while (!r && pgz->head)
+        r = pgz_write_head_block(pgz);
+    pthread_mutex_unlock(&pgz->lock);
+
+    return r;
+}
+
+/* finish the current gzip member: drain, write an empty final deflate
+ * block to terminate the stream, then the crc32/length trailer */
+static int pgz_member_end(struct backup_pgz *pgz)
+{
+    static const unsigned char final_block[2] = { 0x03, 0x00 };
+    unsigned char trailer[8];
+    int i;
+
+    int r = pgz_drain(pgz);
+    if (r) return r;
+
+    for (i = 0; i < 4; i++) {
+        trailer[i] = (pgz->crc >> (8 * i)) & 0xff;
+        trailer[i + 4] = (pgz->total_in >> (8 * i)) & 0xff;
+    }
+
+    if (retry_write(pgz->fd, (const char *) final_block, sizeof(final_block)) < 0
+        || retry_write(pgz->fd, (const char *) trailer, sizeof(trailer)) < 0) {
+        syslog(LOG_ERR, "IOERROR: %s write %s: %m", __func__, pgz->fname);
+        return Z_ERRNO;
+    }
+
+    return 0;
+}
+
+HIDDEN void backup_pgz_free(struct backup_pgz **pgzp)
+{
+    struct backup_pgz *pgz = *pgzp;
+    unsigned i;
+    *pgzp = NULL;
+
+    pthread_mutex_lock(&pgz->lock);
+    pgz->shutdown = 1;
+    pthread_cond_broadcast(&pgz->avail);
+    pthread_mutex_unlock(&pgz->lock);
+
+    for (i = 0; i < pgz->n_workers; i++)
+        pthread_join(pgz->workers[i], NULL);
+
+    while (pgz->head) {
+        struct pgz_block *block = pgz->head;
+        pgz->head = block->next;
+        pgz_block_free(&block);
+    }
+
+    pthread_mutex_destroy(&pgz->lock);
+    pthread_cond_destroy(&pgz->avail);
+    pthread_cond_destroy(&pgz->done);
+
+    buf_free(&pgz->cur);
+    free(pgz->workers);
+    free(pgz->fname);
+    free(pgz);
+}
+
+/* dispatch a write to whichever compressor this append is using */
+static int append_write(struct backup_append_state *append_state,
+                        const char *str, size_t len, const char *fname)
+{
+    if (append_state->pgz)
+        return pgz_write(append_state->pgz, str, len);
+
+    return retry_gzwrite(append_state->gzfile, str, len, fname);
+}
+
+static int append_flush(struct backup_append_state *append_state)
+{
+    if (append_state->pgz)
+        return pgz_drain(append_state->pgz);
+
+    return gzflush(append_state->gzfile, Z_FULL_FLUSH);
+}
+
 HIDDEN int backup_real_append_start(struct backup *backup,
                                     time_t ts, off_t offset,
                                     const char *file_sha1,
@@ -115,7 +451,18 @@ HIDDEN int backup_real_append_start(struct backup *backup,
     snprintf(header, sizeof(header), "# cyrus backup: chunk start\r\n");
 
     if (!index_only) {
-        if (!backup->append_state->gzfile) {
+        int n_workers = config_getint(IMAPOPT_BACKUP_COMPRESS_WORKERS);
+
+        if (n_workers > 0) {
+            if (!backup->append_state->pgz) {
+                backup->append_state->pgz = pgz_new(backup->fd,
+                                                    backup->data_fname,
+                                                    n_workers);
+            }
+            r = pgz_member_start(backup->append_state->pgz);
+            if (r) goto error;
+        }
+        else if (!backup->append_state->gzfile) {
             backup->append_state->gzfile = gzdopen(backup->fd, "ab");
             if (!backup->append_state->gzfile) {
                 fprintf(stderr, "%s: gzdopen fd %i failed: %s\n",
@@ -124,10 +471,10 @@ HIDDEN int backup_real_append_start(struct backup *backup,
             }
         }
 
-        r = retry_gzwrite(backup->append_state->gzfile,
-                          header, strlen(header), backup->data_fname);
+        r = append_write(backup->append_state,
+                         header, strlen(header), backup->data_fname);
         if (!r && flush)
-            r = gzflush(backup->append_state->gzfile, Z_FULL_FLUSH);
+            r = append_flush(backup->append_state);
 
         if (r) goto error;
     }
@@ -202,9 +549,9 @@ EXPORTED int backup_append(struct backup *backup,
 
         /* if we're not in index-only mode, write the data out */
         if (!index_only) {
-            r = retry_gzwrite(backup->append_state->gzfile,
-                              buf_cstring(&buf), buf_len(&buf),
-                              backup->data_fname);
+            r = append_write(backup->append_state,
+                             buf_cstring(&buf), buf_len(&buf),
+                             backup->data_fname);
             if (r) goto error;
         }
 
@@ -218,9 +565,9 @@ EXPORTED int backup_append(struct backup *backup,
     buf_setcstr(&buf, "\r\n");
     SHA1_Update(&backup->append_state->sha_ctx, buf_cstring(&buf), buf_len(&buf));
     if (!index_only) {
-        r = retry_gzwrite(backup->append_state->gzfile,
-                          buf_cstring(&buf), buf_len(&buf),
-                          backup->data_fname);
+        r = append_write(backup->append_state,
+                         buf_cstring(&buf), buf_len(&buf),
+                         backup->data_fname);
         if (r) goto error;
     }
     len += buf_len(&buf);
@@ -228,9 +575,9 @@ EXPORTED int backup_append(struct backup *backup,
 
     /* flush if necessary */
     if (flush && !index_only) {
-        r = gzflush(backup->append_state->gzfile, Z_FULL_FLUSH);
+        r = append_flush(backup->append_state);
         if (r != Z_OK) {
-            syslog(LOG_ERR, "IOERROR: %s gzflush %s: %i %i", __func__, backup->data_fname, r, errno);
+            syslog(LOG_ERR, "IOERROR: %s flush %s: %i %i", __func__, backup->data_fname, r, errno);
             goto error;
         }
     }
@@ -255,9 +602,12 @@ HIDDEN int backup_real_append_end(struct backup *backup, time_t ts)
         fatal("backup append not started", EC_SOFTWARE);
 
     if (!(backup->append_state->mode & BACKUP_APPEND_INDEXONLY)) {
-        r = gzflush(backup->append_state->gzfile, Z_FINISH);
+        if (backup->append_state->pgz)
+            r = pgz_member_end(backup->append_state->pgz);
+        else
+            r = gzflush(backup->append_state->gzfile, Z_FINISH);
         if (r != Z_OK) {
-            syslog(LOG_ERR, "IOERROR: gzflush %s failed: %i\n",
+            syslog(LOG_ERR, "IOERROR: finishing %s failed: %i\n",
                             backup->data_fname, r);
             sqldb_rollback(backup->db, "backup_append");
             goto done;
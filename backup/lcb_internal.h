@@ -58,9 +58,14 @@ enum {
     BACKUP_APPEND_INDEXONLY = 0x0002,
 };
 
+/* parallel gzip writer (lcb_append.c), used instead of gzfile when
+ * backup_compress_workers is nonzero */
+struct backup_pgz;
+
 struct backup_append_state {
     unsigned mode;
     gzFile gzfile;
+    struct backup_pgz *pgz;
     int chunk_id;
     size_t wrote;
     SHA_CTX sha_ctx;
@@ -94,6 +99,10 @@ int backup_real_append_start(struct backup *backup,
 
 int backup_real_append_end(struct backup *backup, time_t ts);
 
+/* shut down a parallel gzip writer (joins its worker threads).  Does
+ * not close the underlying fd, which remains owned by the caller */
+HIDDEN void backup_pgz_free(struct backup_pgz **pgzp);
+
 
 HIDDEN int backup_index(struct backup *backup, struct dlist *dlist,
                         time_t ts, off_t start, size_t len);
@@ -41,6 +41,7 @@
  *
  */
 #include <assert.h>
+#include <stdlib.h>
 #include <syslog.h>
 
 #include "lib/gzuncat.h"
@@ -117,7 +118,8 @@ EXPORTED int backup_read_message_data(struct backup *backup,
     r = parse_backup_line(ps, NULL, NULL, &dl);
     prot_free(ps);
 
-    gzuc_member_end(gzuc, NULL);
+    /* don't decompress the rest of the chunk just to find its end */
+    gzuc_member_abort(gzuc);
     gzuc_free(&gzuc);
 
     for (di = dl->head; di; di = di->next) {
@@ -154,6 +156,24 @@ EXPORTED int backup_read_message_data(struct backup *backup,
     return r;
 }
 
+/* for ordering message uploads by their position in the backup data */
+struct message_upload_rec {
+    struct sync_msgid *msgid;
+    struct backup_message *message;
+};
+
+static int message_upload_rec_cmp(const void *a, const void *b)
+{
+    const struct message_upload_rec *ra = (const struct message_upload_rec *) a;
+    const struct message_upload_rec *rb = (const struct message_upload_rec *) b;
+
+    if (ra->message->chunk_id < rb->message->chunk_id) return -1;
+    if (ra->message->chunk_id > rb->message->chunk_id) return 1;
+    if (ra->message->offset < rb->message->offset) return -1;
+    if (ra->message->offset > rb->message->offset) return 1;
+    return 0;
+}
+
 /* we can't link against imap/sync_support.c within the backup library,
  * so we need this nasty workaround where the caller provides a
  * pointer to sync_msgid_lookup for us to use.
@@ -167,6 +187,10 @@ EXPORTED int backup_prepare_message_upload(struct backup *backup,
     struct dlist *upload = NULL;
     struct sync_msgid *msgid = NULL;
     struct gzuncat *gzuc = NULL;
+    struct backup_chunk *chunk = NULL;
+    struct message_upload_rec *recs = NULL;
+    int n_recs = 0;
+    int i;
     int r;
 
     /* nothing to do */
@@ -174,13 +198,15 @@ EXPORTED int backup_prepare_message_upload(struct backup *backup,
 
     upload = dlist_newlist(NULL, "MESSAGE");
 
-    gzuc = gzuc_new(backup->fd);
-
+    /* look up the index record for each message we need, then sort the
+     * lot by position in the backup data.  each chunk is then
+     * decompressed at most once, and only as far as its last wanted
+     * message, instead of being restarted (and read to the end) for
+     * every message in it
+     */
+    recs = xzmalloc(msgid_list->count * sizeof(*recs));
     for (msgid = msgid_list->head; msgid; msgid = msgid->next) {
         struct backup_message *message = NULL;
-        struct backup_chunk *chunk = NULL;
-        struct dlist *dl = NULL;
-        struct dlist *di, *next;
 
         /* already uploaded */
         if (!msgid->need_upload) continue;
@@ -191,14 +217,44 @@ EXPORTED int backup_prepare_message_upload(struct backup *backup,
                    __func__,
                    message_guid_encode(&msgid->guid),
                    backup->data_fname);
-            goto next_msgid;
+            continue;
         }
 
-        chunk = backup_get_chunk(backup, message->chunk_id);
-        if (!chunk) goto next_msgid;
+        recs[n_recs].msgid = msgid;
+        recs[n_recs].message = message;
+        n_recs++;
+    }
+    qsort(recs, n_recs, sizeof(*recs), message_upload_rec_cmp);
 
-        /* read message contents from backup */
-        gzuc_member_start_from(gzuc, chunk->offset);
+    gzuc = gzuc_new(backup->fd);
+
+    for (i = 0; i < n_recs; i++) {
+        struct backup_message *message = recs[i].message;
+        struct dlist *dl = NULL;
+        struct dlist *di, *next;
+
+        /* picked up from a line we already parsed */
+        if (!recs[i].msgid->need_upload) continue;
+
+        /* move to the message's chunk, unless we're in it already */
+        if (!chunk || chunk->id != message->chunk_id) {
+            if (chunk) {
+                gzuc_member_abort(gzuc);
+                backup_chunk_free(&chunk);
+            }
+
+            chunk = backup_get_chunk(backup, message->chunk_id);
+            if (!chunk) continue;
+
+            r = gzuc_member_start_from(gzuc, chunk->offset);
+            if (r) {
+                backup_chunk_free(&chunk);
+                continue;
+            }
+        }
+
+        /* read message contents from backup.  the records are sorted,
+         * so this only ever seeks forward */
         r = gzuc_seekto(gzuc, message->offset);
         if (!r) {
             struct protstream *ps = prot_readcb(_prot_fill_cb, gzuc);
@@ -209,13 +265,12 @@ EXPORTED int backup_prepare_message_upload(struct backup *backup,
             ps = NULL;
             if (c == EOF) {
                 syslog(LOG_ERR, "IOERROR: couldn't parse message %s from chunk %d of backup %s",
-                       message_guid_encode(&msgid->guid),
+                       message_guid_encode(&recs[i].msgid->guid),
                        chunk->id,
                        backup->data_fname);
                 r = IMAP_IOERROR;
             }
         }
-        gzuc_member_end(gzuc, NULL);
         if (r) goto next_msgid;
 
         /* A single backup line contains many messages, so process
@@ -254,11 +309,13 @@ next_msgid:
             dlist_unlink_files(dl);
             dlist_free(&dl);
         }
-
-        if (chunk) backup_chunk_free(&chunk);
-        if (message) backup_message_free(&message);
     }
 
+    if (chunk) backup_chunk_free(&chunk);
+    for (i = 0; i < n_recs; i++)
+        backup_message_free(&recs[i].message);
+    free(recs);
+
     if (gzuc) gzuc_free(&gzuc);
 
     *uploadp = upload;
@@ -0,0 +1,407 @@
+/* appendbench.c -- append/delivery throughput benchmark
+ *
+ * Copyright (c) 1994-2017 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "exitcodes.h"
+#include "retry.h"
+#include "times.h"
+#include "util.h"
+#include "xmalloc.h"
+#include "imap/append.h"
+#include "imap/global.h"
+#include "imap/imap_err.h"
+#include "imap/mboxevent.h"
+#include "imap/mboxlist.h"
+#include "imap/message.h"
+#include "imap/quota.h"
+#include "imap/sync_log.h"
+
+/* The harness drives the same staging path lmtpd's deliver and imapd's
+ * APPEND use - append_newstage, append_fromstage, append_commit - with
+ * synthetic messages, once per durability mode.  Each mode runs in its
+ * own forked child against a fresh config and spool, so the fsync
+ * behaviour of one run cannot leak into the next and the numbers stay
+ * comparable from release to release. */
+
+static int nmsgs = 2000;
+static int msgsize = 10000;
+static int nparts = 1;
+static int batch = 1;
+static const char *modes = "sync,nosync";
+
+static char scratch[PATH_MAX];
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "usage: appendbench [-n nmessages] [-s messagesize] [-p mimeparts]\n"
+        "                   [-b msgs-per-commit] [-d mode,...]\n"
+        "modes: sync (full fsync), nosync (mailbox_unsafe_sync)\n"
+        "defaults: -n %d -s %d -p %d -b %d -d %s\n",
+        nmsgs, msgsize, nparts, batch, modes);
+    exit(EC_USAGE);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int lat_compar(const void *va, const void *vb)
+{
+    uint64_t a = *(const uint64_t *)va;
+    uint64_t b = *(const uint64_t *)vb;
+
+    if (a < b) return -1;
+    if (a > b) return 1;
+    return 0;
+}
+
+static uint64_t percentile(const uint64_t *lats, int n, int pct)
+{
+    int idx = (n * pct) / 100;
+
+    if (idx >= n) idx = n - 1;
+    return lats[idx];
+}
+
+static void report(const char *mode, const char *phase,
+                   int n, uint64_t elapsed_ns, uint64_t *lats)
+{
+    qsort(lats, n, sizeof(uint64_t), lat_compar);
+
+    printf("%-8s %-6s %7d ops %8.2fs %8.0f ops/sec"
+           "  p50 %8.1fus p99 %8.1fus max %10.1fus\n",
+           mode, phase, n,
+           elapsed_ns / 1e9,
+           n / (elapsed_ns / 1e9),
+           percentile(lats, n, 50) / 1e3,
+           percentile(lats, n, 99) / 1e3,
+           lats[n-1] / 1e3);
+    fflush(stdout);
+}
+
+/* pad 'msg' with text lines until it reaches 'want' bytes */
+static void fill_body(struct buf *msg, size_t want)
+{
+    static const char line[] =
+        "The quick brown fox jumps over the lazy dog 0123456789"
+        " lorem ipsum.\r\n";
+
+    while (msg->len + sizeof(line) - 1 <= want)
+        buf_appendcstr(msg, line);
+}
+
+static void make_message(struct buf *msg, int n)
+{
+    char datestr[RFC822_DATETIME_MAX+1];
+    size_t persize;
+    int i;
+
+    time_to_rfc822(time(NULL), datestr, sizeof(datestr));
+
+    buf_reset(msg);
+    buf_printf(msg,
+        "Return-Path: <bench@example.com>\r\n"
+        "From: Append Bench <bench@example.com>\r\n"
+        "To: bench@example.com\r\n"
+        "Date: %s\r\n"
+        "Subject: appendbench message %d\r\n"
+        "Message-ID: <appendbench.%d.%d@example.com>\r\n"
+        "MIME-Version: 1.0\r\n",
+        datestr, n, (int)getpid(), n);
+
+    if (nparts <= 1) {
+        buf_appendcstr(msg, "Content-Type: text/plain\r\n\r\n");
+        fill_body(msg, msgsize);
+        return;
+    }
+
+    buf_appendcstr(msg,
+        "Content-Type: multipart/mixed; boundary=\"=-appendbench-=\"\r\n"
+        "\r\n");
+    persize = msgsize / nparts;
+    for (i = 0; i < nparts; i++) {
+        buf_printf(msg,
+            "--=-appendbench-=\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Disposition: %s\r\n\r\n",
+            (i % 2) ? "application/octet-stream" : "text/plain",
+            (i % 2) ? "attachment; filename=\"bench.bin\"" : "inline");
+        fill_body(msg, msg->len + persize);
+    }
+    buf_appendcstr(msg, "--=-appendbench-=--\r\n");
+}
+
+/* runs in a child with the mode's config already initialized */
+static int bench_mode(const char *mode)
+{
+    const char *mboxname = "user.bench";
+    struct buf msg = BUF_INITIALIZER;
+    int ncommits = (nmsgs + batch - 1) / batch;
+    uint64_t *alats = xmalloc((size_t)nmsgs * sizeof(uint64_t));
+    uint64_t *clats = xmalloc((size_t)ncommits * sizeof(uint64_t));
+    uint64_t start, elapsed;
+    int msgnum = 0, commitnum = 0;
+    int r;
+
+    r = mboxlist_createmailbox(mboxname, /*mbtype*/0, /*partition*/NULL,
+                               /*isadmin*/1, "bench", /*auth_state*/NULL,
+                               /*localonly*/0, /*forceuser*/1, /*dbonly*/0,
+                               /*notify*/0, NULL);
+    if (r) {
+        fprintf(stderr, "appendbench: can't create %s: %s\n",
+                mboxname, error_message(r));
+        goto done;
+    }
+
+    start = now_ns();
+    while (msgnum < nmsgs) {
+        struct appendstate as;
+        int thisbatch = nmsgs - msgnum < batch ? nmsgs - msgnum : batch;
+        uint64_t t0;
+        int j;
+
+        r = append_setup(&as, mboxname, /*userid*/NULL,
+                         /*auth_state*/NULL, /*aclcheck*/0,
+                         /*quotacheck*/NULL, /*namespace*/NULL,
+                         /*isadmin*/1, EVENT_MESSAGE_APPEND);
+        if (r) break;
+
+        for (j = 0; j < thisbatch; j++, msgnum++) {
+            struct stagemsg *stage = NULL;
+            struct body *body = NULL;
+            FILE *f;
+
+            t0 = now_ns();
+            make_message(&msg, msgnum);
+
+            f = append_newstage(mboxname, time(NULL), msgnum, &stage);
+            if (!f) {
+                r = IMAP_IOERROR;
+                break;
+            }
+            fwrite(msg.s, 1, msg.len, f);
+            fclose(f);
+
+            r = append_fromstage(&as, &body, stage, /*internaldate*/0,
+                                 /*flags*/NULL, /*nolink*/0,
+                                 /*annotations*/NULL);
+            if (body) {
+                message_free_body(body);
+                free(body);
+            }
+            append_removestage(stage);
+            alats[msgnum] = now_ns() - t0;
+            if (r) break;
+        }
+        if (r) {
+            append_abort(&as);
+            break;
+        }
+
+        t0 = now_ns();
+        r = append_commit(&as);
+        clats[commitnum++] = now_ns() - t0;
+        if (r) break;
+    }
+    elapsed = now_ns() - start;
+
+    if (r) {
+        fprintf(stderr, "appendbench: %s: append %d failed: %s\n",
+                mode, msgnum, error_message(r));
+        goto done;
+    }
+
+    report(mode, "append", nmsgs, elapsed, alats);
+    report(mode, "commit", commitnum, elapsed, clats);
+
+done:
+    buf_free(&msg);
+    free(alats);
+    free(clats);
+    return r;
+}
+
+/* fork a child for 'mode': fresh configdirectory and spool, its own
+ * cyrus_init, so durability settings can't leak between runs */
+static int run_mode(const char *mode)
+{
+    int unsafe_sync = !strcmp(mode, "nosync");
+    char dir[PATH_MAX], confname[PATH_MAX];
+    struct buf conf = BUF_INITIALIZER;
+    pid_t pid;
+    int fd, status;
+
+    if (!unsafe_sync && strcmp(mode, "sync")) {
+        fprintf(stderr, "appendbench: unknown mode '%s'\n", mode);
+        return -1;
+    }
+
+    snprintf(dir, sizeof(dir), "%s/%s", scratch, mode);
+    snprintf(confname, sizeof(confname), "%s/imapd.conf", dir);
+    if (mkdir(dir, 0700) == -1) {
+        perror(dir);
+        return -1;
+    }
+
+    fd = open(confname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd < 0) {
+        perror(confname);
+        return -1;
+    }
+    buf_printf(&conf, "configdirectory: %s\n", dir);
+    buf_printf(&conf, "partition-default: %s/spool\n", dir);
+    buf_printf(&conf, "mailbox_unsafe_sync: %d\n", unsafe_sync);
+    retry_write(fd, conf.s, conf.len);
+    buf_free(&conf);
+    close(fd);
+
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (!pid) {
+        int r;
+
+        cyrus_init(confname, "appendbench", 0, CONFIG_NEED_PARTITION_DATA);
+        mboxlist_init(0);
+        mboxlist_open(NULL);
+        quotadb_init(0);
+        quotadb_open(NULL);
+        sync_log_init();
+
+        r = bench_mode(mode);
+
+        quotadb_close();
+        quotadb_done();
+        mboxlist_close();
+        mboxlist_done();
+        sync_log_done();
+        cyrus_done();
+        _exit(r ? 1 : 0);
+    }
+
+    if (waitpid(pid, &status, 0) < 0 ||
+        !WIFEXITED(status) || WEXITSTATUS(status))
+        return -1;
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char *mlist, *mode, *next;
+    int opt, r = 0;
+
+    while ((opt = getopt(argc, argv, "n:s:p:b:d:")) != EOF) {
+        switch (opt) {
+        case 'n':
+            nmsgs = atoi(optarg);
+            if (nmsgs < 1) usage();
+            break;
+        case 's':
+            msgsize = atoi(optarg);
+            if (msgsize < 256) usage();
+            break;
+        case 'p':
+            nparts = atoi(optarg);
+            if (nparts < 1) usage();
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            if (batch < 1) usage();
+            break;
+        case 'd':
+            modes = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc) usage();
+
+    snprintf(scratch, sizeof(scratch), "%s/appendbench.XXXXXX",
+             getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+    if (!mkdtemp(scratch)) {
+        perror("mkdtemp");
+        return EC_OSERR;
+    }
+
+    printf("append bench: %d messages of %d bytes, %d part%s, "
+           "%d per commit\n",
+           nmsgs, msgsize, nparts, nparts == 1 ? "" : "s", batch);
+
+    mlist = xstrdup(modes);
+    for (mode = mlist; mode; mode = next) {
+        next = strchr(mode, ',');
+        if (next) *next++ = '\0';
+        if (run_mode(mode)) r = 1;
+    }
+    free(mlist);
+
+    return r;
+}
+
+EXPORTED void fatal(const char *s, int code)
+{
+    fprintf(stderr, "appendbench: fatal error: %s\n", s);
+    exit(code);
+}
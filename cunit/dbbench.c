@@ -0,0 +1,392 @@
+/* dbbench.c -- microbenchmark harness for the cyrusdb backends
+ *
+ * Copyright (c) 1994-2017 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "cyrusdb.h"
+#include "exitcodes.h"
+#include "retry.h"
+#include "util.h"
+#include "xmalloc.h"
+#include "imap/global.h"
+
+/* The harness runs, per backend: a sequential load phase writing every
+ * key, then a mixed phase of nops random fetches/stores in the
+ * requested read/write ratio, optionally split over several worker
+ * processes banging on the same file.  Per-op latencies are collected
+ * and the percentiles reported, so numbers are comparable from release
+ * to release. */
+
+static int nkeys = 100000;
+static int nops = 100000;
+static int vsize = 128;
+static int read_pct = 80;
+static int nworkers = 1;
+static const char *backends = "twoskip,skiplist";
+
+static char scratch[PATH_MAX];
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "usage: dbbench [-b backend,...] [-n nkeys] [-o nops]\n"
+        "               [-s valuesize] [-r readpercent] [-j nworkers]\n"
+        "defaults: -b %s -n %d -o %d -s %d -r %d -j %d\n",
+        backends, nkeys, nops, vsize, read_pct, nworkers);
+    exit(EC_USAGE);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift keeps the key sequence identical across runs and backends */
+static uint32_t prng_state;
+
+static uint32_t prng(void)
+{
+    uint32_t x = prng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return prng_state = x;
+}
+
+static int lat_compar(const void *va, const void *vb)
+{
+    uint64_t a = *(const uint64_t *)va;
+    uint64_t b = *(const uint64_t *)vb;
+
+    if (a < b) return -1;
+    if (a > b) return 1;
+    return 0;
+}
+
+static uint64_t percentile(const uint64_t *lats, int n, int pct)
+{
+    int idx = (n * pct) / 100;
+
+    if (idx >= n) idx = n - 1;
+    return lats[idx];
+}
+
+static void report(const char *backend, const char *phase,
+                   int n, uint64_t elapsed_ns, uint64_t *lats)
+{
+    qsort(lats, n, sizeof(uint64_t), lat_compar);
+
+    printf("%-10s %-6s %9d ops %8.2fs %9.0f ops/sec"
+           "  p50 %6.1fus p90 %6.1fus p99 %6.1fus max %8.1fus\n",
+           backend, phase, n,
+           elapsed_ns / 1e9,
+           n / (elapsed_ns / 1e9),
+           percentile(lats, n, 50) / 1e3,
+           percentile(lats, n, 90) / 1e3,
+           percentile(lats, n, 99) / 1e3,
+           lats[n-1] / 1e3);
+    fflush(stdout);
+}
+
+static void makekey(char *buf, size_t size, uint32_t n)
+{
+    snprintf(buf, size, "key%08u", n);
+}
+
+/* run 'count' mixed ops against an open db, recording latencies */
+static int run_mixed(struct db *db, int count, char *value, uint64_t *lats)
+{
+    char keybuf[32];
+    int i, r;
+
+    for (i = 0; i < count; i++) {
+        uint64_t t0;
+
+        makekey(keybuf, sizeof(keybuf), prng() % nkeys);
+
+        t0 = now_ns();
+        if ((int)(prng() % 100) < read_pct) {
+            const char *data = NULL;
+            size_t datalen = 0;
+
+            r = cyrusdb_fetch(db, keybuf, strlen(keybuf),
+                              &data, &datalen, NULL);
+            if (r == CYRUSDB_NOTFOUND) r = 0;
+        }
+        else {
+            r = cyrusdb_store(db, keybuf, strlen(keybuf),
+                              value, vsize, NULL);
+        }
+        lats[i] = now_ns() - t0;
+
+        if (r) {
+            fprintf(stderr, "dbbench: op %d failed: %s\n",
+                    i, cyrusdb_strerror(r));
+            return r;
+        }
+    }
+
+    return 0;
+}
+
+static int bench_backend(const char *backend)
+{
+    struct db *db = NULL;
+    char fname[PATH_MAX];
+    char keybuf[32];
+    char *value = xmalloc(vsize);
+    int latcap = nkeys > nops ? nkeys : nops;
+    uint64_t *lats = xmalloc((size_t)latcap * sizeof(uint64_t));
+    uint64_t start;
+    int i, r;
+
+    for (i = 0; i < vsize; i++)
+        value[i] = 'a' + (i % 26);
+
+    snprintf(fname, sizeof(fname), "%s/bench.%s.db", scratch, backend);
+    unlink(fname);
+
+    r = cyrusdb_open(backend, fname, CYRUSDB_CREATE, &db);
+    if (r) {
+        fprintf(stderr, "%-10s skipped (%s)\n",
+                backend, cyrusdb_strerror(r));
+        goto done;
+    }
+
+    /* load phase: every key once, sequential */
+    prng_state = 2463534242U;
+    start = now_ns();
+    for (i = 0; i < nkeys; i++) {
+        uint64_t t0;
+
+        makekey(keybuf, sizeof(keybuf), i);
+        t0 = now_ns();
+        r = cyrusdb_store(db, keybuf, strlen(keybuf), value, vsize, NULL);
+        lats[i] = now_ns() - t0;
+        if (r) {
+            fprintf(stderr, "dbbench: load of %s failed: %s\n",
+                    keybuf, cyrusdb_strerror(r));
+            goto done;
+        }
+    }
+    report(backend, "load", nkeys, now_ns() - start, lats);
+
+    if (nworkers < 2) {
+        start = now_ns();
+        r = run_mixed(db, nops, value, lats);
+        if (r) goto done;
+        report(backend, "mixed", nops, now_ns() - start, lats);
+    }
+    else {
+        /* each worker reopens the db and writes its latencies to a
+         * scratch file for the parent to merge */
+        int per = nops / nworkers;
+        int status;
+        int failed = 0;
+
+        cyrusdb_close(db);
+        db = NULL;
+
+        start = now_ns();
+        for (i = 0; i < nworkers; i++) {
+            pid_t pid = fork();
+
+            if (pid < 0) fatal("unable to fork worker", EC_OSERR);
+            if (!pid) {
+                char wname[PATH_MAX];
+                int fd;
+
+                prng_state = 2463534242U + i;
+                r = cyrusdb_open(backend, fname, 0, &db);
+                if (!r) r = run_mixed(db, per, value, lats);
+                if (db) cyrusdb_close(db);
+                if (r) _exit(1);
+
+                snprintf(wname, sizeof(wname), "%s/lat.%d", scratch, i);
+                fd = open(wname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+                if (fd < 0) _exit(1);
+                retry_write(fd, (char *)lats, per * sizeof(uint64_t));
+                close(fd);
+                _exit(0);
+            }
+        }
+
+        while (waitpid(-1, &status, 0) > 0) {
+            if (!WIFEXITED(status) || WEXITSTATUS(status)) failed = 1;
+        }
+        uint64_t elapsed = now_ns() - start;
+
+        if (failed) {
+            fprintf(stderr, "dbbench: %s: worker failed\n", backend);
+            r = CYRUSDB_INTERNAL;
+            goto done;
+        }
+
+        for (i = 0; i < nworkers; i++) {
+            char wname[PATH_MAX];
+            int fd;
+
+            snprintf(wname, sizeof(wname), "%s/lat.%d", scratch, i);
+            fd = open(wname, O_RDONLY);
+            if (fd < 0 ||
+                retry_read(fd, (char *)(lats + (size_t)i * per),
+                           per * sizeof(uint64_t)) < 0) {
+                fprintf(stderr, "dbbench: can't read %s\n", wname);
+                if (fd >= 0) close(fd);
+                r = CYRUSDB_IOERROR;
+                goto done;
+            }
+            close(fd);
+            unlink(wname);
+        }
+        report(backend, "mixed", per * nworkers, elapsed, lats);
+    }
+
+done:
+    if (db) cyrusdb_close(db);
+    unlink(fname);
+    free(value);
+    free(lats);
+    return r;
+}
+
+int main(int argc, char **argv)
+{
+    char confname[PATH_MAX];
+    char *blist, *backend, *next;
+    int opt, fd, r = 0;
+
+    while ((opt = getopt(argc, argv, "b:n:o:s:r:j:")) != EOF) {
+        switch (opt) {
+        case 'b':
+            backends = optarg;
+            break;
+        case 'n':
+            nkeys = atoi(optarg);
+            if (nkeys < 1) usage();
+            break;
+        case 'o':
+            nops = atoi(optarg);
+            if (nops < 1) usage();
+            break;
+        case 's':
+            vsize = atoi(optarg);
+            if (vsize < 1) usage();
+            break;
+        case 'r':
+            read_pct = atoi(optarg);
+            if (read_pct < 0 || read_pct > 100) usage();
+            break;
+        case 'j':
+            nworkers = atoi(optarg);
+            if (nworkers < 1) usage();
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc) usage();
+
+    /* hermetic environment: scratch dir doubles as configdirectory */
+    snprintf(scratch, sizeof(scratch), "%s/dbbench.XXXXXX",
+             getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+    if (!mkdtemp(scratch)) {
+        perror("mkdtemp");
+        return EC_OSERR;
+    }
+
+    snprintf(confname, sizeof(confname), "%s/imapd.conf", scratch);
+    fd = open(confname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd < 0) {
+        perror(confname);
+        return EC_OSERR;
+    }
+    struct buf conf = BUF_INITIALIZER;
+    buf_printf(&conf, "configdirectory: %s\n", scratch);
+    retry_write(fd, conf.s, conf.len);
+    buf_free(&conf);
+    close(fd);
+
+    cyrus_init(confname, "dbbench", 0, 0);
+
+    printf("cyrusdb bench: %d keys, %d byte values, %d ops, "
+           "%d%% reads, %d worker%s\n",
+           nkeys, vsize, nops, read_pct,
+           nworkers, nworkers == 1 ? "" : "s");
+
+    blist = xstrdup(backends);
+    for (backend = blist; backend; backend = next) {
+        next = strchr(backend, ',');
+        if (next) *next++ = '\0';
+        if (bench_backend(backend)) r = 1;
+    }
+    free(blist);
+
+    cyrus_done();
+
+    unlink(confname);
+    rmdir(scratch);
+
+    return r;
+}
+
+EXPORTED void fatal(const char *s, int code)
+{
+    fprintf(stderr, "dbbench: fatal error: %s\n", s);
+    exit(code);
+}
@@ -709,6 +709,101 @@ HIDDEN void annotate_putdb(annotate_db_t **dbp)
     *dbp = NULL;
 }
 
+/*
+ * In-process annotation read cache.
+ *
+ * GETMETADATA and mailbox opens (specialuse and colour lookups) fetch
+ * the same handful of annotations over and over, and most of those
+ * fetches find nothing.  When the "annotation_cache" option is
+ * enabled, annotatemore_msg_lookup() remembers both the values it
+ * found and the lookups that found nothing, so the hot "no
+ * annotation" answer is a hash probe instead of a cyrusdb fetch.
+ * Each entry records the generation it was filled at; beginning,
+ * committing or aborting an annotate transaction bumps the
+ * generation, which invalidates every entry in O(1) without walking
+ * the table.
+ *
+ * The cache only sees this process's writes - an annotation stored by
+ * another process can be served stale for the life of the connection,
+ * which is why the option defaults to off.
+ */
+
+#define ANNOTATE_CACHE_BUCKETS          256
+#define ANNOTATE_CACHE_MAXENTRIES       4096
+
+struct annotate_cache_entry {
+    unsigned gen;
+    struct buf value;           /* empty = negative entry */
+};
+
+static struct hash_table annotate_cache_table;
+static unsigned annotate_cache_gen = 1;
+static unsigned annotate_cache_nentries = 0;
+
+static void annotate_cache_freeentry(void *data)
+{
+    struct annotate_cache_entry *ace = data;
+
+    buf_free(&ace->value);
+    free(ace);
+}
+
+static void annotate_cache_invalidate(void)
+{
+    annotate_cache_gen++;
+}
+
+static void annotate_cache_done(void)
+{
+    if (annotate_cache_table.size)
+        free_hash_table(&annotate_cache_table, annotate_cache_freeentry);
+    annotate_cache_nentries = 0;
+}
+
+/* Build a printable cache key: db keys can contain embedded NULs,
+ * and a NULL userid must not collide with an empty one */
+static void annotate_cache_key(struct buf *key, const char *mboxname,
+                               unsigned int uid, const char *entry,
+                               const char *userid)
+{
+    buf_reset(key);
+    buf_printf(key, "%s\n%u\n%s\n%d%s", mboxname ? mboxname : "", uid,
+               entry, userid ? 1 : 0, userid ? userid : "");
+}
+
+static struct annotate_cache_entry *annotate_cache_get(const char *key)
+{
+    struct annotate_cache_entry *ace;
+
+    if (!annotate_cache_table.size) return NULL;
+    ace = hash_lookup(key, &annotate_cache_table);
+    if (ace && ace->gen != annotate_cache_gen) return NULL;
+    return ace;
+}
+
+static void annotate_cache_put(const char *key, const struct buf *value)
+{
+    struct annotate_cache_entry *ace;
+    void *old;
+
+    /* mostly stale entries by now; cheaper to dump the whole table
+     * than to hunt down replaceable ones */
+    if (annotate_cache_nentries >= ANNOTATE_CACHE_MAXENTRIES)
+        annotate_cache_done();
+
+    if (!annotate_cache_table.size)
+        construct_hash_table(&annotate_cache_table,
+                             ANNOTATE_CACHE_BUCKETS, 0);
+
+    ace = xzmalloc(sizeof(*ace));
+    ace->gen = annotate_cache_gen;
+    if (value) buf_copy(&ace->value, value);
+
+    old = hash_insert(key, ace, &annotate_cache_table);
+    if (old == ace) annotate_cache_nentries++;
+    else annotate_cache_freeentry(old);
+}
+
 EXPORTED void annotatemore_open(void)
 {
     int r;
@@ -725,14 +820,20 @@ EXPORTED void annotatemore_close(void)
     /* close all the open databases */
     while (all_dbs_head)
         annotate_closedb(all_dbs_head);
+
+    annotate_cache_done();
 }
 
 /* Begin a txn if one is not already started.  Can be called multiple
  * times */
 static void annotate_begin(annotate_db_t *d)
 {
-    if (d)
+    if (d) {
         d->in_txn = 1;
+        /* called again before each write, so this also keeps the
+         * cache coherent with uncommitted changes mid-transaction */
+        annotate_cache_invalidate();
+    }
 }
 
 static void annotate_abort(annotate_db_t *d)
@@ -748,6 +849,8 @@ static void annotate_abort(annotate_db_t *d)
     }
     d->txn = NULL;
     d->in_txn = 0;
+
+    annotate_cache_invalidate();
 }
 
 static int annotate_commit(annotate_db_t *d)
@@ -768,6 +871,8 @@ static int annotate_commit(annotate_db_t *d)
     }
     d->in_txn = 0;
 
+    annotate_cache_invalidate();
+
     return r;
 }
 
@@ -2375,10 +2480,34 @@ EXPORTED int annotatemore_msg_lookup(const char *mboxname, uint32_t uid, const c
     int r;
     const char *data;
     annotate_db_t *d = NULL;
+    struct buf cachekey = BUF_INITIALIZER;
+    int use_cache = config_getswitch(IMAPOPT_ANNOTATION_CACHE);
+
+    if (use_cache) {
+        struct annotate_cache_entry *ace;
+
+        annotate_cache_key(&cachekey, mboxname, uid, entry, userid);
+        ace = annotate_cache_get(buf_cstring(&cachekey));
+        if (ace) {
+            /* a cached miss leaves @value untouched, just like
+             * CYRUSDB_NOTFOUND below */
+            if (ace->value.len) buf_copy(value, &ace->value);
+            buf_free(&cachekey);
+            return 0;
+        }
+    }
 
     r = _annotate_getdb(mboxname, uid, 0, &d);
-    if (r)
-        return (r == CYRUSDB_NOTFOUND ? 0 : r);
+    if (r) {
+        if (r == CYRUSDB_NOTFOUND) {
+            /* no db at all means no annotations: cache the miss */
+            if (use_cache)
+                annotate_cache_put(buf_cstring(&cachekey), NULL);
+            r = 0;
+        }
+        buf_free(&cachekey);
+        return r;
+    }
 
     keylen = make_key(mboxname, uid, entry, userid, key, sizeof(key));
 
@@ -2392,10 +2521,17 @@ EXPORTED int annotatemore_msg_lookup(const char *mboxname, uint32_t uid, const c
             /* Force a copy, in case the putdb() call destroys
              * the per-db data area that @data points to.  */
             buf_cstring(value);
+            if (use_cache)
+                annotate_cache_put(buf_cstring(&cachekey), value);
         }
     }
-    else if (r == CYRUSDB_NOTFOUND) r = 0;
+    else if (r == CYRUSDB_NOTFOUND) {
+        if (use_cache)
+            annotate_cache_put(buf_cstring(&cachekey), NULL);
+        r = 0;
+    }
 
+    buf_free(&cachekey);
     annotate_putdb(&d);
     return r;
 }
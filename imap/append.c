@@ -65,6 +65,7 @@
 #include "prot.h"
 #include "sync_log.h"
 #include "xmalloc.h"
+#include "xstats.h"
 #include "xstrlcpy.h"
 #include "xstrlcat.h"
 #include "mboxlist.h"
@@ -78,6 +79,7 @@
 
 #include "annotate.h"
 #include "message_guid.h"
+#include "search_bloom.h"
 #include "strarray.h"
 #include "conversations.h"
 
@@ -89,9 +91,15 @@ struct stagemsg {
     char fname[1024];
 
     strarray_t parts; /* buffer of current stage parts */
+    strarray_t sisparts; /* GUID-named links we published for sharing */
     struct message_guid guid;
+    int synced; /* the first stage part has been fsynced */
+    struct buf spool; /* in-memory copy of the spooled message */
 };
 
+/* largest message we'll keep a parse copy of in memory while spooling */
+#define APPEND_STAGE_RETAIN_MAX (8*1024*1024)
+
 static int append_addseen(struct mailbox *mailbox, const char *userid,
                           struct seqset *newseen);
 static void append_setseen(struct appendstate *as, struct index_record *record);
@@ -259,10 +267,13 @@ static void append_free(struct appendstate *as)
  and the mailbox is probably in an inconsistent state. */
 EXPORTED int append_commit(struct appendstate *as)
 {
+    struct xstats_timer timer;
     int r = 0;
 
     if (as->s == APPEND_DONE) return 0;
 
+    xstats_timer_start(&timer);
+
     if (as->nummsg) {
         /* Calculate new index header information */
         as->mailbox->i.last_appenddate = time(0);
@@ -278,6 +289,7 @@ EXPORTED int append_commit(struct appendstate *as)
     /* We want to commit here to guarantee mailbox on disk vs
      * duplicate DB consistency */
     r = mailbox_commit(as->mailbox);
+    xstats_timer_end(&timer, APPEND_COMMIT);
     if (r) {
         syslog(LOG_ERR, "IOERROR: commiting mailbox append %s: %s",
                as->mailbox->name, error_message(r));
@@ -321,6 +333,9 @@ EXPORTED FILE *append_newstage(const char *mailboxname, time_t internaldate,
 
     stage = xmalloc(sizeof(struct stagemsg));
     strarray_init(&stage->parts);
+    strarray_init(&stage->sisparts);
+    buf_init(&stage->spool);
+    stage->synced = 0;
 
     snprintf(stage->fname, sizeof(stage->fname), "%d-%d-%d",
              (int) getpid(), (int) internaldate, msgnum);
@@ -362,6 +377,28 @@ EXPORTED FILE *append_newstage(const char *mailboxname, time_t internaldate,
     return f;
 }
 
+/*
+ * Spool a message literal from 'in' to the stage file 'f', keeping a
+ * copy of the bytes in memory as they stream past so append_fromstage()
+ * can parse the message without reading the spool file back in.  Binary
+ * literals are excluded (they get re-encoded in the stage file later),
+ * as are messages too large to be worth holding in memory.
+ */
+EXPORTED int append_stage_copy(struct protstream *in, FILE *f, unsigned size,
+                               int allow_null, struct stagemsg *stage)
+{
+    struct buf *retain = NULL;
+    int r;
+
+    if (!allow_null && size <= APPEND_STAGE_RETAIN_MAX)
+        retain = &stage->spool;
+
+    r = message_copy_strict_retain(in, f, size, allow_null, retain);
+    if (r && retain) buf_reset(retain);
+
+    return r;
+}
+
 /*
  * Send the args down a socket.  We use a counted encoding
  * similar in concept to HTTP chunked encoding, with a decimal
@@ -860,15 +897,23 @@ EXPORTED int append_fromstage(struct appendstate *as, struct body **body,
 
     assert(stage != NULL && stage->parts.count);
 
-    /* parse the first file */
+    /* parse the first file - from the retained spool copy if we have
+     * one, so the message is only ever read once */
     if (!*body) {
-        FILE *file = fopen(stage->parts.data[0], "r");
-        if (file) {
-            r = message_parse_file(file, NULL, NULL, body);
-            fclose(file);
+        if (stage->spool.len) {
+            *body = (struct body *) xzmalloc(sizeof(struct body));
+            r = message_parse_mapped(buf_base(&stage->spool),
+                                     stage->spool.len, *body);
+        }
+        else {
+            FILE *file = fopen(stage->parts.data[0], "r");
+            if (file) {
+                r = message_parse_file(file, NULL, NULL, body);
+                fclose(file);
+            }
+            else
+                r = IMAP_IOERROR;
         }
-        else
-            r = IMAP_IOERROR;
         if (r) goto out;
     }
 
@@ -886,38 +931,64 @@ EXPORTED int append_fromstage(struct appendstate *as, struct body **body,
         }
     }
 
+    /* single-instance handoff across transactions: each finished
+     * per-partition stage copy is also published under a GUID-keyed
+     * name, so a concurrent transaction delivering the same message
+     * (a mailing list blast fanned out over several connections) can
+     * pin the existing copy instead of writing another one.  link()
+     * is atomic, so a published file is always complete. */
+    char sisfile[MAX_MAILBOX_PATH+1];
+    sisfile[0] = '\0';
+    if (!nolink && !message_guid_isnull(&(*body)->guid)) {
+        mboxlist_findstage(mailbox->name, sisfile, sizeof(sisfile));
+        strlcat(sisfile, message_guid_encode(&(*body)->guid),
+                sizeof(sisfile));
+        strlcat(sisfile, ".sis", sizeof(sisfile));
+    }
+
     if (i == stage->parts.count) {
         /* ok, create this file, and copy the name of it into stage->parts. */
 
-        /* create the new staging file from the first stage part */
-        r = mailbox_copyfile(stage->parts.data[0], stagefile, 0);
-        if (r) {
-            /* maybe the directory doesn't exist? */
-            char stagedir[MAX_MAILBOX_PATH+1];
-
-            /* xxx check errors */
-            mboxlist_findstage(mailbox->name, stagedir, sizeof(stagedir));
-            if (mkdir(stagedir, 0755) != 0) {
-                syslog(LOG_ERR, "couldn't create stage directory: %s: %m",
-                       stagedir);
-            } else {
-                syslog(LOG_NOTICE, "created stage directory %s",
-                       stagedir);
-                r = mailbox_copyfile(stage->parts.data[0], stagefile, 0);
-            }
+        if (sisfile[0] && link(sisfile, stagefile) == 0) {
+            /* pinned another transaction's copy of this message */
+            r = 0;
         }
-        if (r) {
-            /* oh well, we tried */
+        else {
+            /* create the new staging file from the first stage part */
+            r = mailbox_copyfile(stage->parts.data[0], stagefile, 0);
+            if (r) {
+                /* maybe the directory doesn't exist? */
+                char stagedir[MAX_MAILBOX_PATH+1];
+
+                /* xxx check errors */
+                mboxlist_findstage(mailbox->name, stagedir, sizeof(stagedir));
+                if (mkdir(stagedir, 0755) != 0) {
+                    syslog(LOG_ERR, "couldn't create stage directory: %s: %m",
+                           stagedir);
+                } else {
+                    syslog(LOG_NOTICE, "created stage directory %s",
+                           stagedir);
+                    r = mailbox_copyfile(stage->parts.data[0], stagefile, 0);
+                }
+            }
+            if (r) {
+                /* oh well, we tried */
 
-            syslog(LOG_ERR, "IOERROR: creating message file %s: %m",
-                   stagefile);
-            unlink(stagefile);
-            goto out;
+                syslog(LOG_ERR, "IOERROR: creating message file %s: %m",
+                       stagefile);
+                unlink(stagefile);
+                goto out;
+            }
         }
 
         strarray_append(&stage->parts, stagefile);
     }
 
+    /* publish our copy for other transactions; EEXIST just means
+     * someone beat us to it.  The link is removed with the stage. */
+    if (sisfile[0] && link(stagefile, sisfile) == 0)
+        strarray_append(&stage->sisparts, sisfile);
+
     /* 'stagefile' contains the message and is on the same partition
        as the mailbox we're looking at */
 
@@ -950,18 +1021,47 @@ EXPORTED int append_fromstage(struct appendstate *as, struct body **body,
     r = mailbox_copyfile(stagefile, fname, nolink);
     if (r) goto out;
 
-    FILE *destfile = fopen(fname, "r");
-    if (destfile) {
-        /* this will hopefully ensure that the link() actually happened
-           and makes sure that the file actually hits disk */
-        fsync(fileno(destfile));
-        fclose(destfile);
-    }
-    else {
+    struct stat stagesbuf, destsbuf;
+    if (stat(fname, &destsbuf) == -1) {
         r = IMAP_IOERROR;
         goto out;
     }
 
+    /* If the copy was made by hard link, every destination shares one
+     * inode with the staged message, so syncing the stage file once
+     * makes all the links durable together.  That collapses the
+     * per-destination fsyncs of a multi-mailbox delivery into a
+     * single flush; only a real copy (cross-partition, or nolink)
+     * still needs its own sync. */
+    if (!nolink &&
+        stat(stage->parts.data[0], &stagesbuf) != -1 &&
+        stagesbuf.st_ino == destsbuf.st_ino &&
+        stagesbuf.st_dev == destsbuf.st_dev) {
+        if (!stage->synced) {
+            int stagefd = open(stage->parts.data[0], O_RDONLY, 0);
+            if (stagefd == -1 || fsync(stagefd)) {
+                if (stagefd != -1) close(stagefd);
+                r = IMAP_IOERROR;
+                goto out;
+            }
+            close(stagefd);
+            stage->synced = 1;
+        }
+    }
+    else {
+        FILE *destfile = fopen(fname, "r");
+        if (destfile) {
+            /* this will hopefully ensure that the link() actually happened
+               and makes sure that the file actually hits disk */
+            fsync(fileno(destfile));
+            fclose(destfile);
+        }
+        else {
+            r = IMAP_IOERROR;
+            goto out;
+        }
+    }
+
     if (config_getstring(IMAPOPT_ANNOTATION_CALLOUT)) {
         if (flags)
             newflags = strarray_dup(flags);
@@ -1012,6 +1112,9 @@ EXPORTED int append_fromstage(struct appendstate *as, struct body **body,
     r = mailbox_append_index_record(mailbox, &record);
     if (r) goto out;
 
+    /* Sketch the message text for unindexed search (advisory) */
+    search_bloom_add(mailbox, &record);
+
     if (in_object_storage) {  // must delete local file
         if (unlink(fname) != 0) // unlink should do it.
             if (!remove (fname))  // we must insist
@@ -1077,7 +1180,17 @@ EXPORTED int append_removestage(struct stagemsg *stage)
         free(p);
     }
 
+    while ((p = strarray_pop(&stage->sisparts))) {
+        /* retract the published single-instance link */
+        if (unlink(p) != 0) {
+            syslog(LOG_ERR, "IOERROR: error unlinking file %s: %m", p);
+        }
+        free(p);
+    }
+
     strarray_fini(&stage->parts);
+    strarray_fini(&stage->sisparts);
+    buf_free(&stage->spool);
     free(stage);
     return 0;
 }
@@ -1159,6 +1272,10 @@ EXPORTED int append_fromstream(struct appendstate *as, struct body **body,
     /* Write out index file entry; if we abort later, it's not
        important */
     r = mailbox_append_index_record(mailbox, &record);
+    if (r) goto out;
+
+    /* Sketch the message text for unindexed search (advisory) */
+    search_bloom_add(mailbox, &record);
 
 out:
     if (r) {
@@ -1378,6 +1495,9 @@ EXPORTED int append_copy(struct mailbox *mailbox, struct appendstate *as,
         r = mailbox_append_index_record(as->mailbox, &record);
         if (r) goto out;
 
+        /* Sketch the message text for unindexed search (advisory) */
+        search_bloom_add(as->mailbox, &record);
+
         /* ensure we have an astate connected to the destination
          * mailbox, so that the annotation txn will be committed
          * when we close the mailbox */
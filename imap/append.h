@@ -116,6 +116,11 @@ extern int append_abort(struct appendstate *as);
 extern FILE *append_newstage(const char *mailboxname, time_t internaldate,
                              int msgnum, struct stagemsg **stagep);
 
+/* spools a message literal to the stage file, retaining an in-memory
+ * copy for parsing where possible */
+extern int append_stage_copy(struct protstream *in, FILE *f, unsigned size,
+                             int allow_null, struct stagemsg *stage);
+
 /* adds a new mailbox to the stage initially created by append_newstage() */
 extern int append_fromstage(struct appendstate *mailbox, struct body **body,
                             struct stagemsg *stage, time_t internaldate,
@@ -61,6 +61,7 @@
 #include "mpool.h"
 #include "mboxlist.h"
 #include "seen.h"
+#include "sync_log.h"
 #include "util.h"
 #include "xmalloc.h"
 #include "xstrlcpy.h"
@@ -71,6 +72,9 @@
 #define DB (config_seenstate_db)
 #define SUBDB (config_subscription_db)
 
+/* aggregate of access events, maintained by incremental mode */
+#define FNAME_ARBITRONDB "/arbitron.db"
+
 extern int optind;
 extern char *optarg;
 
@@ -95,6 +99,7 @@ static time_t report_start_time = -1, report_end_time, prune_time = 0;
 static int dosubs = 1;
 static int dousers = 0;
 static int long_report = 0;
+static int incremental = 0;
 
 /* current namespace */
 static struct namespace arb_namespace;
@@ -102,6 +107,7 @@ static struct namespace arb_namespace;
 /* forward declarations */
 static void usage(void) __attribute__((noreturn));
 static void run_users(void);
+static void run_events(void);
 static void make_report(const char *key, void *data, void *rock);
 static void process_seen(const char *path, const char *user);
 static void process_subs(const char *path, const char *user);
@@ -124,7 +130,7 @@ int main(int argc,char **argv)
 
     report_end_time = now;
 
-    while ((opt = getopt(argc, argv, "C:oud:D:p:l")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:ioud:D:p:l")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -164,6 +170,10 @@ int main(int argc,char **argv)
             break;
         }
 
+        case 'i':
+            incremental = 1;
+            break;
+
         case 'o':
             dosubs = 0;
             break;
@@ -186,6 +196,10 @@ int main(int argc,char **argv)
         }
     }
 
+    /* subscriptions aren't event-logged, so the incremental mode can
+       only report readers */
+    if (incremental) dosubs = 0;
+
     /* Init Cyrus Backend Foo */
     cyrus_init(alt_config, "arbitron", 0, 0);
 
@@ -217,10 +231,18 @@ int main(int argc,char **argv)
     mboxlist_findall(&arb_namespace, pattern, 1, 0, 0,
                      do_mailbox, NULL);
 
-    fprintf(stderr, "Done\nLoading Users");
+    if (incremental) {
+        /* Fold the pending access events into the aggregate and
+           report from that instead of scanning every seen database */
+        fprintf(stderr, "Done\nAggregating access events...");
+        run_events();
+    }
+    else {
+        fprintf(stderr, "Done\nLoading Users");
 
-    /* Now do all the users */
-    run_users();
+        /* Now do all the users */
+        run_users();
+    }
 
     fprintf(stderr, "Done\n");
 
@@ -242,7 +264,7 @@ int main(int argc,char **argv)
 static void usage(void)
 {
     fprintf(stderr,
-            "usage: arbitron [-o] [-u] [-l] [-C alt_config] "
+            "usage: arbitron [-i] [-o] [-u] [-l] [-C alt_config] "
             "[-d days | -D mmddyyy[:mmddyyyy]]\n"
             "                [-p months] [mboxpattern]\n");
     exit(EC_USAGE);
@@ -254,9 +276,15 @@ static int do_mailbox(struct findall_data *data, void *rock __attribute__((unuse
     int r;
     struct mailbox *mailbox = NULL;
     const char *name = mbname_intname(data->mbname);
-
-    r = mailbox_open_irl(name, &mailbox);
-    if (r) return 0;
+    const char *uniqueid = data->mbentry ? data->mbentry->uniqueid : NULL;
+
+    /* only open the mailbox if the mailboxes.db entry predates
+       uniqueids being kept there */
+    if (!uniqueid) {
+        r = mailbox_open_irl(name, &mailbox);
+        if (r) return 0;
+        uniqueid = mailbox->uniqueid;
+    }
 
     struct arb_mailbox_data *d = mpool_malloc(arb_pool,
                                               sizeof(struct arb_mailbox_data));
@@ -266,7 +294,7 @@ static int do_mailbox(struct findall_data *data, void *rock __attribute__((unuse
     d->readers = NULL;
     d->subscribers = NULL;
 
-    hash_insert(mailbox->uniqueid, d, &mailbox_table);
+    hash_insert(uniqueid, d, &mailbox_table);
     hash_insert(name, d, &mboxname_table);
 
     mailbox_close(&mailbox);
@@ -474,6 +502,112 @@ static void process_subs(const char *path, const char *user)
     if(tmp) cyrusdb_close(tmp);
 }
 
+static int process_event_cb(void *rockp,
+                            const char *key, size_t keylen,
+                            const char *tmpdata __attribute__((unused)),
+                            size_t tmpdatalen __attribute__((unused)))
+{
+    /* Only called to do deletes */
+    cyrusdb_delete((struct db *)rockp, key, keylen, NULL, 0);
+
+    return 0;
+}
+
+static int process_event_p(void *rockp __attribute__((unused)),
+                           const char *key,
+                           size_t keylen,
+                           const char *data,
+                           size_t datalen __attribute__((unused)))
+{
+    int ret = 0;
+    long lastread;
+    char buf[MAX_MAILBOX_BUFFER];
+    char *user;
+    struct arb_mailbox_data *mbox;
+
+    /* remember that 'data' may not be null terminated ! */
+    lastread = strtol(data, NULL, 10);
+
+    if (keylen >= sizeof(buf)) return 0;
+    memcpy(buf, key, keylen);
+    buf[keylen] = '\0';
+
+    /* key is uniqueid, tab, user */
+    user = strchr(buf, '\t');
+    if (!user) return 0;
+    *user++ = '\0';
+
+    mbox = hash_lookup(buf, &mailbox_table);
+
+    if (mbox && lastread >= report_start_time &&
+        lastread <= report_end_time) {
+        mbox->nreaders++;
+        if (dousers) {
+            struct user_list *u = mpool_malloc(arb_pool,
+                                               sizeof(struct user_list));
+
+            u->user = mpool_strdup(arb_pool, user);
+            u->next = mbox->readers;
+            mbox->readers = u;
+        }
+    }
+
+    /* Check for pruning even if mailbox isn't valid */
+    if (lastread < prune_time) {
+        ret = 1;
+    }
+
+    /* Only return true if we need to prune this guy */
+    return ret;
+}
+
+static void run_events(void)
+{
+    char path[MAX_MAILBOX_PATH+1];
+    char key[MAX_MAILBOX_BUFFER];
+    char val[32];
+    struct db *eventdb = NULL;
+    sync_log_reader_t *slr;
+    const char *args[3];
+    int r;
+
+    snprintf(path, sizeof(path), "%s%s", config_dir, FNAME_ARBITRONDB);
+
+    r = cyrusdb_open(DB, path, CYRUSDB_CREATE, &eventdb);
+    if (r) {
+        fatal("can't open arbitron event database", EC_SOFTWARE);
+    }
+
+    /* The events don't carry timestamps, so record the time we folded
+       them in - close enough to the access time as long as this runs
+       reasonably often */
+    snprintf(val, sizeof(val), "%lu", (unsigned long) time(0));
+
+    /* Fold any pending access events into the aggregate.  The reader
+       rename()s the log file out of the way, so writers just start a
+       fresh one. */
+    slr = sync_log_reader_create_with_channel(SYNC_LOG_ARBITRON_CHANNEL);
+    while ((r = sync_log_reader_begin(slr)) == 0) {
+        while (sync_log_reader_getitem(slr, args) == 0) {
+            if (strcmp(args[0], "SEEN") || !args[2]) continue;
+
+            /* args are user, uniqueid */
+            snprintf(key, sizeof(key), "%s\t%s", args[2], args[1]);
+            cyrusdb_store(eventdb, key, strlen(key),
+                          val, strlen(val), NULL);
+        }
+        sync_log_reader_end(slr);
+    }
+    sync_log_reader_free(slr);
+
+    /* Now count the aggregated readers, pruning stale entries as we
+       go */
+    cyrusdb_foreach(eventdb, "", 0, process_event_p, process_event_cb,
+                    eventdb, NULL);
+
+    cyrusdb_close(eventdb);
+}
+
 static void report_users(struct user_list *u)
 {
     char sep = ':';
@@ -567,8 +567,10 @@ int autocreate_user(struct namespace *namespace,
     int autocreatequotamessage = config_getint(IMAPOPT_AUTOCREATE_QUOTA_MESSAGES);
     int n;
     struct auth_state *auth_state = NULL;
+    struct txn *tid = NULL;
     strarray_t *create = NULL;
     strarray_t *subscribe = NULL;
+    strarray_t created = STRARRAY_INITIALIZER;
     int numcrt = 0;
     int numsub = 0;
 #ifdef USE_SIEVE
@@ -631,13 +633,63 @@ int autocreate_user(struct namespace *namespace,
         goto done;
     }
 
-    r = mboxlist_createmailbox(inboxname, /*mbtype*/0, /*partition*/NULL,
-                               /*isadmin*/1, userid, auth_state,
-                               /*localonly*/0, /*forceuser*/0,
-                               /*dbonly*/0, /*notify*/1,
-                               /*mailboxptr*/NULL);
+    /* create INBOX and the whole folder template under a single
+     * mailboxes.db transaction, then do the subscription, quota and
+     * annotation writes once everything is committed.  This keeps a
+     * provisioning storm from serializing on per-folder transactions */
+    r = mboxlist_createmailbox_txn(inboxname, /*mbtype*/0, /*partition*/NULL,
+                                   /*isadmin*/1, userid, auth_state,
+                                   /*localonly*/0, /*forceuser*/0,
+                                   /*dbonly*/0, /*notify*/1, &tid,
+                                   /*mailboxptr*/NULL);
 
-    if (!r) r = mboxlist_changesub(inboxname, userid, auth_state, 1, 1, 1);
+    if (r) {
+        syslog(LOG_ERR, "autocreateinbox: User %s, INBOX failed. %s",
+               userid, error_message(r));
+        if (tid) mboxlist_abort(tid);
+        tid = NULL;
+        goto done;
+    }
+
+    create = strarray_split(config_getstring(IMAPOPT_AUTOCREATE_INBOX_FOLDERS), SEP, STRARRAY_TRIM);
+    subscribe = strarray_split(config_getstring(IMAPOPT_AUTOCREATE_SUBSCRIBE_FOLDERS), SEP, STRARRAY_TRIM);
+
+    for (n = 0; n < create->count; n++) {
+        const char *name = strarray_nth(create, n);
+        char *foldername = mboxname_user_mbox(userid, name);
+
+        r = mboxlist_createmailbox_txn(foldername, /*mbtype*/0, /*partition*/NULL,
+                                       /*isadmin*/1, userid, auth_state,
+                                       /*localonly*/0, /*forceuser*/0,
+                                       /*dbonly*/0, /*notify*/1, &tid,
+                                       /*mailboxptr*/NULL);
+
+        if (!r) {
+            numcrt++;
+            strarray_append(&created, name);
+            syslog(LOG_NOTICE, "autocreateinbox: User %s, subfolder %s creation succeeded.",
+                   userid, name);
+        } else {
+            syslog(LOG_WARNING, "autocreateinbox: User %s, subfolder %s creation failed. %s",
+                   userid, name, error_message(r));
+            r = 0;
+        }
+
+        free(foldername);
+    }
+
+    if (tid) {
+        r = mboxlist_commit(tid);
+        tid = NULL;
+        if (r) {
+            syslog(LOG_ERR, "autocreateinbox: User %s, commit failed. %s",
+                   userid, error_message(r));
+            goto done;
+        }
+    }
+
+    /* deferred writes - the mailboxes exist from here on */
+    r = mboxlist_changesub(inboxname, userid, auth_state, 1, 1, 1);
     if (r) {
         syslog(LOG_ERR, "autocreateinbox: User %s, INBOX failed. %s",
                userid, error_message(r));
@@ -668,31 +720,11 @@ int autocreate_user(struct namespace *namespace,
     syslog(LOG_NOTICE, "autocreateinbox: User %s, INBOX was successfully created",
            userid);
 
-    create = strarray_split(config_getstring(IMAPOPT_AUTOCREATE_INBOX_FOLDERS), SEP, STRARRAY_TRIM);
-    subscribe = strarray_split(config_getstring(IMAPOPT_AUTOCREATE_SUBSCRIBE_FOLDERS), SEP, STRARRAY_TRIM);
-
-    for (n = 0; n < create->count; n++) {
-        const char *name = strarray_nth(create, n);
+    for (n = 0; n < created.count; n++) {
+        const char *name = strarray_nth(&created, n);
         char *foldername = mboxname_user_mbox(userid, name);
         struct autocreate_specialuse_rock specialrock = { userid, foldername, name };
 
-        r = mboxlist_createmailbox(foldername, /*mbtype*/0, /*partition*/NULL,
-                                   /*isadmin*/1, userid, auth_state,
-                                   /*localonly*/0, /*forceuser*/0,
-                                   /*dbonly*/0, /*notify*/1,
-                                   /*mailboxptr*/NULL);
-
-        if (!r) {
-            numcrt++;
-            syslog(LOG_NOTICE, "autocreateinbox: User %s, subfolder %s creation succeeded.",
-                   userid, name);
-        } else {
-            syslog(LOG_WARNING, "autocreateinbox: User %s, subfolder %s creation failed. %s",
-                   userid, name, error_message(r));
-            r = 0;
-            continue;
-        }
-
         /* subscribe if requested */
         if (strarray_find(subscribe, name, 0) >= 0) {
             r = mboxlist_changesub(foldername, userid, auth_state, 1, 1, 1);
@@ -709,6 +741,8 @@ int autocreate_user(struct namespace *namespace,
 
         /* set specialuse if requested */
         config_foreachoverflowstring(autocreate_specialuse_cb, &specialrock);
+
+        free(foldername);
     }
 
     if (numcrt)
@@ -738,6 +772,7 @@ int autocreate_user(struct namespace *namespace,
     free(inboxname);
     strarray_free(create);
     strarray_free(subscribe);
+    strarray_fini(&created);
     auth_freestate(auth_state);
 
     return r;
@@ -57,8 +57,10 @@
 #include "ical_support.h"
 #include "libconfig.h"
 #include "mboxname.h"
+#include "strarray.h"
 #include "util.h"
 #include "xstrlcat.h"
+#include "xstrlcpy.h"
 #include "xmalloc.h"
 
 
@@ -75,8 +77,19 @@ struct caldav_db {
     struct buf dtstart;
     struct buf dtend;
     struct buf sched_tag;
+    struct buf expand_until;
 };
 
+/* Occurrence cache: at write time the recurrence set of a recurring
+ * resource is expanded into the ical_occurs table, out to a fixed
+ * horizon recorded in the resource's expand_until column, so
+ * time-range queries can be answered without re-parsing unchanged
+ * resources.  Expansions that would exceed CALDAV_MAX_OCCURRENCES
+ * aren't cached at all, and queries past the horizon fall back to
+ * parsing. */
+#define CALDAV_EXPAND_SECS (10 * 366 * 24 * 3600)       /* ~10 years */
+#define CALDAV_MAX_OCCURRENCES 4096
+
 
 static struct namespace caldav_namespace;
 time_t caldav_epoch = -1;
@@ -174,6 +187,7 @@ EXPORTED int caldav_close(struct caldav_db *caldavdb)
     buf_free(&caldavdb->dtstart);
     buf_free(&caldavdb->dtend);
     buf_free(&caldavdb->sched_tag);
+    buf_free(&caldavdb->expand_until);
 
     r = sqldb_close(&caldavdb->db);
 
@@ -223,6 +237,7 @@ static void _num_to_comp_flags(struct comp_flags *flags, unsigned num)
     flags->status = (num >> 2) & 3;
     flags->tzbyref = (num >> 4) & 1;
     flags->mattach = (num >> 5) & 1;
+    flags->fb_uniform = (num >> 6) & 1;
 }
 
 static unsigned _comp_flags_to_num(struct comp_flags *flags)
@@ -231,14 +246,15 @@ static unsigned _comp_flags_to_num(struct comp_flags *flags)
        + ((flags->transp & 1) << 1)
        + ((flags->status & 3) << 2)
        + ((flags->tzbyref & 1) << 4)
-       + ((flags->mattach & 1) << 5);
+       + ((flags->mattach & 1) << 5)
+       + ((flags->fb_uniform & 1) << 6);
 }
 
 #define CMD_READFIELDS                                                  \
     "SELECT rowid, creationdate, mailbox, resource, imap_uid,"          \
     "  lock_token, lock_owner, lock_ownerid, lock_expire,"              \
     "  comp_type, ical_uid, organizer, dtstart, dtend,"                 \
-    "  comp_flags, sched_tag, alive, modseq"                            \
+    "  comp_flags, sched_tag, alive, modseq, expand_until"              \
     " FROM ical_objs"                                                   \
 
 static int read_cb(sqlite3_stmt *stmt, void *rock)
@@ -274,6 +290,7 @@ static int read_cb(sqlite3_stmt *stmt, void *rock)
         cdata->dtstart = (const char *) sqlite3_column_text(stmt, 12);
         cdata->dtend = (const char *) sqlite3_column_text(stmt, 13);
         cdata->sched_tag = (const char *) sqlite3_column_text(stmt, 15);
+        cdata->expand_until = (const char *) sqlite3_column_text(stmt, 18);
         r = rrock->cb(rrock->rock, cdata);
     }
     else {
@@ -310,6 +327,9 @@ static int read_cb(sqlite3_stmt *stmt, void *rock)
         cdata->sched_tag =
             column_text_to_buf((const char *) sqlite3_column_text(stmt, 15),
                                &db->sched_tag);
+        cdata->expand_until =
+            column_text_to_buf((const char *) sqlite3_column_text(stmt, 18),
+                               &db->expand_until);
     }
 
     return r;
@@ -422,6 +442,25 @@ EXPORTED int caldav_foreach(struct caldav_db *caldavdb, const char *mailbox,
     }
 }
 
+#define CMD_SELCHANGED_MBOX CMD_READFIELDS \
+    " WHERE mailbox = :mailbox AND modseq > :modseq ORDER BY modseq;"
+
+EXPORTED int caldav_foreach_changed(struct caldav_db *caldavdb,
+                                    const char *mailbox, modseq_t oldmodseq,
+                                    caldav_cb_t *cb, void *rock)
+{
+    struct sqldb_bindval bval[] = {
+        { ":mailbox", SQLITE_TEXT,    { .s = mailbox   } },
+        { ":modseq",  SQLITE_INTEGER, { .i = oldmodseq } },
+        { NULL,       SQLITE_NULL,    { .s = NULL      } } };
+    struct caldav_data cdata;
+    struct read_rock rrock = { caldavdb, &cdata, RROCK_FLAG_TOMBSTONES,
+                               cb, rock };
+
+    return sqldb_exec(caldavdb->db, CMD_SELCHANGED_MBOX, bval,
+                      &read_cb, &rrock);
+}
+
 #define CMD_SELRANGE_MBOX CMD_READFIELDS \
     " WHERE dtend > :after AND dtstart < :before " \
     " AND mailbox = :mailbox AND alive = 1;"
@@ -470,12 +509,12 @@ EXPORTED int caldav_foreach_timerange(struct caldav_db *caldavdb,
     "  alive, mailbox, resource, creationdate, imap_uid, modseq,"       \
     "  lock_token, lock_owner, lock_ownerid, lock_expire,"              \
     "  comp_type, ical_uid, organizer, dtstart, dtend,"                 \
-    "  comp_flags, sched_tag )"                                         \
+    "  comp_flags, sched_tag, expand_until )"                           \
     " VALUES ("                                                         \
     "  :alive, :mailbox, :resource, :creationdate, :imap_uid, :modseq," \
     "  :lock_token, :lock_owner, :lock_ownerid, :lock_expire,"          \
     "  :comp_type, :ical_uid, :organizer, :dtstart, :dtend,"            \
-    "  :comp_flags, :sched_tag );"
+    "  :comp_flags, :sched_tag, :expand_until );"
 
 #define CMD_UPDATE                      \
     "UPDATE ical_objs SET"              \
@@ -493,7 +532,8 @@ EXPORTED int caldav_foreach_timerange(struct caldav_db *caldavdb,
     "  dtstart      = :dtstart,"        \
     "  dtend        = :dtend,"          \
     "  comp_flags   = :comp_flags,"     \
-    "  sched_tag    = :sched_tag"       \
+    "  sched_tag    = :sched_tag,"      \
+    "  expand_until = :expand_until"    \
     " WHERE rowid = :rowid;"
 
 EXPORTED int caldav_write(struct caldav_db *caldavdb, struct caldav_data *cdata)
@@ -518,6 +558,7 @@ EXPORTED int caldav_write(struct caldav_db *caldavdb, struct caldav_data *cdata)
         { ":dtend",        SQLITE_TEXT,    { .s = cdata->dtend            } },
         { ":sched_tag",    SQLITE_TEXT,    { .s = cdata->sched_tag        } },
         { ":comp_flags",   SQLITE_INTEGER, { .i = comp_flags              } },
+        { ":expand_until", SQLITE_TEXT,    { .s = cdata->expand_until     } },
         { NULL,            SQLITE_NULL,    { .s = NULL                    } } };
 
     if (cdata->dav.rowid) {
@@ -618,6 +659,196 @@ static void check_mattach_cb(icalcomponent *comp, void *rock)
     }
 }
 
+#define ICAL_TIME_BUF 21        /* YYYYMMDDTHHMMSSZ + slop */
+
+struct occur_rock {
+    strarray_t starts;
+    strarray_t ends;
+    char until[ICAL_TIME_BUF];
+    int truncated;
+};
+
+static void occur_append(struct occur_rock *orock, time_t start, time_t end)
+{
+    icaltimezone *utc = icaltimezone_get_utc_timezone();
+    icaltimetype t;
+
+    if (orock->starts.count >= CALDAV_MAX_OCCURRENCES) {
+        orock->truncated = 1;
+        return;
+    }
+
+    t = icaltime_from_timet_with_zone(start, 0, utc);
+    strarray_append(&orock->starts, icaltime_as_ical_string(t));
+    t = icaltime_from_timet_with_zone(end, 0, utc);
+    strarray_append(&orock->ends, icaltime_as_ical_string(t));
+}
+
+/* icalcomponent_foreach_recurrence() callback to collect occurrences */
+static void occur_span_cb(icalcomponent *comp __attribute__((unused)),
+                          struct icaltime_span *span, void *rock)
+{
+    occur_append((struct occur_rock *) rock, span->start, span->end);
+}
+
+/* expand the recurrence set of all components of 'kind' out to a
+ * fixed horizon, collecting the UTC occurrence spans */
+static void caldav_expand_occurrences(icalcomponent *ical,
+                                      icalcomponent_kind kind,
+                                      struct occur_rock *orock)
+{
+    icaltimezone *utc = icaltimezone_get_utc_timezone();
+    icaltimetype estart = icaltime_from_timet_with_zone(caldav_epoch, 0, utc);
+    icaltimetype eend =
+        icaltime_from_timet_with_zone(time(0) + CALDAV_EXPAND_SECS, 0, utc);
+    icalcomponent *comp = icalcomponent_get_first_component(ical, kind);
+
+    strlcpy(orock->until, icaltime_as_ical_string(eend),
+            sizeof(orock->until));
+
+    do {
+        if (icalcomponent_get_first_property(comp, ICAL_RRULE_PROPERTY) ||
+            icalcomponent_get_first_property(comp, ICAL_RDATE_PROPERTY) ||
+            icalcomponent_get_first_property(comp, ICAL_EXDATE_PROPERTY)) {
+            icalcomponent_foreach_recurrence(comp, estart, eend,
+                                             &occur_span_cb, orock);
+        }
+        else {
+            /* single instance (e.g. an overridden recurrence) */
+            struct icalperiodtype period =
+                icalcomponent_get_utc_timespan(comp, kind);
+
+            occur_append(orock,
+                         icaltime_as_timet_with_zone(period.start, utc),
+                         icaltime_as_timet_with_zone(period.end, utc));
+        }
+    } while ((comp = icalcomponent_get_next_component(ical, kind)));
+}
+
+#define CMD_DELOCCUR "DELETE FROM ical_occurs WHERE objid = :objid;"
+
+#define CMD_INSOCCUR                                    \
+    "INSERT INTO ical_occurs ( objid, dtstart, dtend )" \
+    " VALUES ( :objid, :dtstart, :dtend );"
+
+static int caldav_write_occurrences(struct caldav_db *caldavdb,
+                                    struct caldav_data *cdata,
+                                    struct occur_rock *orock)
+{
+    struct sqldb_bindval bval[] = {
+        { ":objid",   SQLITE_INTEGER, { .i = cdata->dav.rowid } },
+        { ":dtstart", SQLITE_TEXT,    { .s = NULL             } },
+        { ":dtend",   SQLITE_TEXT,    { .s = NULL             } },
+        { NULL,       SQLITE_NULL,    { .s = NULL             } } };
+    int i;
+    int r;
+
+    /* drop the previous version's occurrences */
+    r = sqldb_exec(caldavdb->db, CMD_DELOCCUR, bval, NULL, NULL);
+    if (r) return r;
+
+    if (!cdata->expand_until) return 0;
+
+    for (i = 0; i < orock->starts.count; i++) {
+        bval[1].val.s = strarray_nth(&orock->starts, i);
+        bval[2].val.s = strarray_nth(&orock->ends, i);
+        r = sqldb_exec(caldavdb->db, CMD_INSOCCUR, bval, NULL, NULL);
+        if (r) return r;
+    }
+
+    return 0;
+}
+
+#define CMD_SELOCCUR                                                    \
+    "SELECT COUNT(*) FROM ical_occurs"                                  \
+    " WHERE objid = :objid AND dtend > :after AND dtstart < :before;"
+
+static int occur_count_cb(sqlite3_stmt *stmt, void *rock)
+{
+    *((int *) rock) = sqlite3_column_int(stmt, 0);
+
+    return 0;
+}
+
+#define CMD_GETOCCUR                                                    \
+    "SELECT dtstart, dtend FROM ical_occurs"                            \
+    " WHERE objid = :objid AND dtend > :after AND dtstart < :before"    \
+    " ORDER BY dtstart;"
+
+struct occur_read_rock {
+    caldav_occur_cb_t *cb;
+    void *rock;
+};
+
+static int occur_read_cb(sqlite3_stmt *stmt, void *rock)
+{
+    struct occur_read_rock *orock = (struct occur_read_rock *) rock;
+    struct icaltimetype start =
+        icaltime_from_string((const char *) sqlite3_column_text(stmt, 0));
+    struct icaltimetype end =
+        icaltime_from_string((const char *) sqlite3_column_text(stmt, 1));
+
+    return orock->cb(orock->rock, start, end);
+}
+
+EXPORTED int caldav_foreach_occurrence(struct caldav_db *caldavdb,
+                                       struct caldav_data *cdata,
+                                       struct icaltimetype after,
+                                       struct icaltimetype before,
+                                       caldav_occur_cb_t *cb, void *rock)
+{
+    struct sqldb_bindval bval[] = {
+        { ":objid",  SQLITE_INTEGER, { .i = cdata->dav.rowid } },
+        { ":after",  SQLITE_TEXT,    { .s = NULL             } },
+        { ":before", SQLITE_TEXT,    { .s = NULL             } },
+        { NULL,      SQLITE_NULL,    { .s = NULL             } } };
+    struct occur_read_rock orock = { cb, rock };
+
+    if (!cdata->dav.rowid) return CYRUSDB_NOTFOUND;
+
+    /* only authoritative if the expansion horizon covers the range */
+    if (!cdata->expand_until || !*cdata->expand_until ||
+        strcmp(icaltime_as_ical_string(before), cdata->expand_until) > 0)
+        return CYRUSDB_NOTFOUND;
+
+    bval[1].val.s = icaltime_as_ical_string(after);
+    bval[2].val.s = icaltime_as_ical_string(before);
+
+    return sqldb_exec(caldavdb->db, CMD_GETOCCUR, bval,
+                      &occur_read_cb, &orock);
+}
+
+EXPORTED int caldav_check_occurrences(struct caldav_db *caldavdb,
+                                      struct caldav_data *cdata,
+                                      struct icaltimetype after,
+                                      struct icaltimetype before,
+                                      int *overlaps)
+{
+    struct sqldb_bindval bval[] = {
+        { ":objid",  SQLITE_INTEGER, { .i = cdata->dav.rowid } },
+        { ":after",  SQLITE_TEXT,    { .s = NULL             } },
+        { ":before", SQLITE_TEXT,    { .s = NULL             } },
+        { NULL,      SQLITE_NULL,    { .s = NULL             } } };
+    int count = 0;
+    int r;
+
+    if (!cdata->dav.rowid) return CYRUSDB_NOTFOUND;
+
+    /* only authoritative if the expansion horizon covers the range */
+    if (!cdata->expand_until || !*cdata->expand_until ||
+        strcmp(icaltime_as_ical_string(before), cdata->expand_until) > 0)
+        return CYRUSDB_NOTFOUND;
+
+    bval[1].val.s = icaltime_as_ical_string(after);
+    bval[2].val.s = icaltime_as_ical_string(before);
+
+    r = sqldb_exec(caldavdb->db, CMD_SELOCCUR, bval, &occur_count_cb, &count);
+    if (r) return r;
+
+    *overlaps = (count > 0);
+    return 0;
+}
+
 EXPORTED int caldav_writeentry(struct caldav_db *caldavdb, struct caldav_data *cdata,
                                icalcomponent *ical)
 {
@@ -626,6 +857,10 @@ EXPORTED int caldav_writeentry(struct caldav_db *caldavdb, struct caldav_data *c
     icalproperty *prop;
     unsigned mykind = 0, recurring = 0, transp = 0, status = 0, mattach = 0;
     struct icalperiodtype span;
+    struct occur_rock orock;
+    int r;
+
+    memset(&orock, 0, sizeof(orock));
 
     /* Get iCalendar UID */
     cdata->ical_uid = icalcomponent_get_uid(comp);
@@ -700,8 +935,30 @@ EXPORTED int caldav_writeentry(struct caldav_db *caldavdb, struct caldav_data *c
     cdata->dtend = icaltime_as_ical_string(span.end);
     cdata->comp_flags.recurring = recurring;
     cdata->comp_flags.mattach = mattach;
-    
-    return caldav_write(caldavdb, cdata);
+
+    /* Expand recurring components into the occurrence cache, so
+     * time-range queries don't have to re-parse unchanged resources.
+     * Non-recurring resources are fully described by dtstart/dtend */
+    cdata->expand_until = NULL;
+    cdata->comp_flags.fb_uniform = 0;
+    if (recurring) {
+        caldav_expand_occurrences(ical, kind, &orock);
+        if (!orock.truncated) cdata->expand_until = orock.until;
+
+        /* With no overridden instances, every occurrence shares the
+         * master component's TRANSP and STATUS, so the occurrence
+         * cache can answer freebusy queries without parsing */
+        cdata->comp_flags.fb_uniform =
+            (icalcomponent_count_components(ical, kind) == 1);
+    }
+
+    r = caldav_write(caldavdb, cdata);
+    if (!r) r = caldav_write_occurrences(caldavdb, cdata, &orock);
+
+    strarray_fini(&orock.starts);
+    strarray_fini(&orock.ends);
+
+    return r;
 }
 
 
@@ -759,5 +1016,71 @@ EXPORTED int caldav_get_events(struct caldav_db *caldavdb,
     }
 
 
+    return r;
+}
+
+EXPORTED int caldav_multiget(struct caldav_db *caldavdb,
+                             const char *mailbox,
+                             const strarray_t *ical_uids,
+                             caldav_cb_t *cb, void *rock)
+{
+    struct caldav_data cdata;
+    struct read_rock rrock = { caldavdb, &cdata, 0, cb, rock };
+    struct buf sqlbuf = BUF_INITIALIZER;
+    int first, r = 0;
+
+    /* batched so we stay well below SQLITE_MAX_VARIABLE_NUMBER */
+    for (first = 0; !r && first < strarray_size(ical_uids);
+         first += SQL_MAXVAL) {
+        int n = strarray_size(ical_uids) - first;
+        int i, nval = 0;
+
+        if (n > SQL_MAXVAL) n = SQL_MAXVAL;
+
+        struct sqldb_bindval *bval =
+            xzmalloc((n + 2) * sizeof(struct sqldb_bindval));
+
+        if (mailbox) {
+            bval[nval].name = ":mailbox";
+            bval[nval].type = SQLITE_TEXT;
+            bval[nval].val.s = mailbox;
+            nval++;
+        }
+
+        buf_setcstr(&sqlbuf, CMD_READFIELDS);
+        buf_appendcstr(&sqlbuf, " WHERE alive = 1");
+        if (mailbox)
+            buf_appendcstr(&sqlbuf, " AND mailbox = :mailbox");
+        buf_appendcstr(&sqlbuf, " AND ical_uid IN (");
+        for (i = 0; i < n; i++) {
+            char name[16];
+            snprintf(name, sizeof(name), ":uid%d", i);
+            if (i) buf_putc(&sqlbuf, ',');
+            buf_appendcstr(&sqlbuf, name);
+            bval[nval].name = xstrdup(name);
+            bval[nval].type = SQLITE_TEXT;
+            bval[nval].val.s = strarray_nth(ical_uids, first + i);
+            nval++;
+        }
+        /* walk the index in mailbox/uid order, so readers which open
+           the underlying messages do sequential I/O on the spool */
+        buf_appendcstr(&sqlbuf, ") ORDER BY mailbox, imap_uid;");
+
+        r = sqldb_exec(caldavdb->db, buf_cstring(&sqlbuf), bval,
+                       &read_cb, &rrock);
+
+        for (i = 0; i < nval; i++) {
+            if (!strncmp(bval[i].name, ":uid", 4))
+                free((char *) bval[i].name);
+        }
+        free(bval);
+    }
+    buf_free(&sqlbuf);
+
+    if (r) {
+        syslog(LOG_ERR, "carddav error %s", error_message(r));
+        /* XXX - free memory */
+    }
+
     return r;
 }
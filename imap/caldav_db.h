@@ -95,6 +95,8 @@ struct comp_flags {
     unsigned status       : 2;          /* STATUS property value (see below) */
     unsigned tzbyref      : 1;          /* VTIMEZONEs by reference */
     unsigned mattach      : 1;          /* Has managed ATTACHment(s) */
+    unsigned fb_uniform   : 1;          /* Single component - all instances
+                                           share its TRANSP and STATUS */
 };
 
 /* Status values */
@@ -114,6 +116,7 @@ struct caldav_data {
     const char *dtend;
     struct comp_flags comp_flags;
     const char *sched_tag;
+    const char *expand_until;   /* horizon of the occurrence cache */
 };
 
 typedef int caldav_cb_t(void *rock, struct caldav_data *cdata);
@@ -154,6 +157,12 @@ int caldav_lookup_uid(struct caldav_db *caldavdb, const char *ical_uid,
 int caldav_foreach(struct caldav_db *caldavdb, const char *mailbox,
                    caldav_cb_t *cb, void *rock);
 
+/* process each entry for 'mailbox' in 'caldavdb' with a modseq higher
+ * than 'oldmodseq' with cb(), in ascending order of modseq,
+ * tombstones included (used by the sync-collection REPORT) */
+int caldav_foreach_changed(struct caldav_db *caldavdb, const char *mailbox,
+                           modseq_t oldmodseq, caldav_cb_t *cb, void *rock);
+
 /* process each entry for 'mailbox' in 'caldavdb' with cb()
  * which last recurrence ends after 'after' and first
  * recurrence starts before 'before'. The largest possible
@@ -162,6 +171,30 @@ int caldav_foreach_timerange(struct caldav_db *caldavdb, const char *mailbox,
                              time_t after, time_t before,
                              caldav_cb_t *cb, void *rock);
 
+/* process each cached occurrence of 'cdata' overlapping the given UTC
+ * time range with cb(), in ascending order of start time.  Returns
+ * CYRUSDB_NOTFOUND if the occurrence cache doesn't cover the range
+ * and the caller must expand the resource itself. */
+typedef int caldav_occur_cb_t(void *rock, struct icaltimetype start,
+                              struct icaltimetype end);
+
+int caldav_foreach_occurrence(struct caldav_db *caldavdb,
+                              struct caldav_data *cdata,
+                              struct icaltimetype after,
+                              struct icaltimetype before,
+                              caldav_occur_cb_t *cb, void *rock);
+
+/* check the occurrence cache (built at PUT time by caldav_writeentry())
+ * to see whether any occurrence of the recurring resource 'cdata'
+ * overlaps the given UTC time range.  Returns 0 and sets *overlaps if
+ * the cache covers the range, CYRUSDB_NOTFOUND if the caller must
+ * expand the resource itself. */
+int caldav_check_occurrences(struct caldav_db *caldavdb,
+                             struct caldav_data *cdata,
+                             struct icaltimetype after,
+                             struct icaltimetype before,
+                             int *overlaps);
+
 /* write an entry to 'caldavdb' */
 int caldav_write(struct caldav_db *caldavdb, struct caldav_data *cdata);
 int caldav_writeentry(struct caldav_db *caldavdb, struct caldav_data *cdata,
@@ -188,6 +221,14 @@ int caldav_get_events(struct caldav_db *caldavdb,
                       const char *mailbox, const char *ical_uid,
                       caldav_cb_t *cb, void *rock);
 
+/* process each entry whose iCal UID is in 'ical_uids' with cb(),
+   batched into IN queries and ordered by mailbox/imap_uid so a large
+   multiget reads the spool sequentially */
+int caldav_multiget(struct caldav_db *caldavdb,
+                    const char *mailbox,
+                    const strarray_t *ical_uids,
+                    caldav_cb_t *cb, void *rock);
+
 /* Process each entry for 'caldavdb' with a modseq higher than oldmodseq,
  * in ascending order of modseq.
  * If mailbox is not NULL, only process entries of this mailbox.
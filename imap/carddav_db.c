@@ -59,7 +59,7 @@
 #include "xmalloc.h"
 
 
-#define NUM_BUFS 10
+#define NUM_BUFS 12
 
 struct carddav_db {
     sqldb_t *db;                        /* DB handle */
@@ -170,7 +170,8 @@ static const char *column_text_to_buf(const char *text, struct buf *buf)
 #define CMD_GETFIELDS                                                   \
     "SELECT rowid, creationdate, mailbox, resource, imap_uid,"          \
     "  lock_token, lock_owner, lock_ownerid, lock_expire,"              \
-    "  version, vcard_uid, kind, fullname, name, nickname, alive"       \
+    "  version, vcard_uid, kind, fullname, name, nickname, alive,"      \
+    "  email, phone, modseq"                                            \
     " FROM vcard_objs"
 
 static int read_cb(sqlite3_stmt *stmt, void *rock)
@@ -183,6 +184,7 @@ static int read_cb(sqlite3_stmt *stmt, void *rock)
     memset(cdata, 0, sizeof(struct carddav_data));
 
     cdata->dav.alive = sqlite3_column_int(stmt, 15);
+    cdata->dav.modseq = sqlite3_column_int(stmt, 18);
     if (!rrock->tombstones && !cdata->dav.alive)
         return 0;
 
@@ -204,6 +206,8 @@ static int read_cb(sqlite3_stmt *stmt, void *rock)
         cdata->fullname = (const char *) sqlite3_column_text(stmt, 12);
         cdata->name = (const char *) sqlite3_column_text(stmt, 13);
         cdata->nickname = (const char *) sqlite3_column_text(stmt, 14);
+        cdata->email = (const char *) sqlite3_column_text(stmt, 16);
+        cdata->phone = (const char *) sqlite3_column_text(stmt, 17);
         r = rrock->cb(rrock->rock, cdata);
     }
     else {
@@ -237,6 +241,12 @@ static int read_cb(sqlite3_stmt *stmt, void *rock)
         cdata->nickname =
             column_text_to_buf((const char *) sqlite3_column_text(stmt, 14),
                                &db->bufs[8]);
+        cdata->email =
+            column_text_to_buf((const char *) sqlite3_column_text(stmt, 16),
+                               &db->bufs[10]);
+        cdata->phone =
+            column_text_to_buf((const char *) sqlite3_column_text(stmt, 17),
+                               &db->bufs[11]);
     }
 
     return r;
@@ -316,6 +326,27 @@ EXPORTED int carddav_foreach(struct carddav_db *carddavdb, const char *mailbox,
     }
 }
 
+#define CMD_SELCHANGED_MBOX CMD_GETFIELDS \
+    " WHERE mailbox = :mailbox AND modseq > :modseq ORDER BY modseq;"
+
+EXPORTED int carddav_foreach_changed(struct carddav_db *carddavdb,
+                                     const char *mailbox, modseq_t oldmodseq,
+                                     int (*cb)(void *rock,
+                                               struct carddav_data *data),
+                                     void *rock)
+{
+    struct sqldb_bindval bval[] = {
+        { ":mailbox", SQLITE_TEXT,    { .s = mailbox   } },
+        { ":modseq",  SQLITE_INTEGER, { .i = oldmodseq } },
+        { NULL,       SQLITE_NULL,    { .s = NULL      } } };
+    struct carddav_data cdata;
+    struct read_rock rrock = { carddavdb, &cdata, 1 /* tombstones */,
+                               cb, rock };
+
+    return sqldb_exec(carddavdb->db, CMD_SELCHANGED_MBOX, bval,
+                      &read_cb, &rrock);
+}
+
 #define CMD_GETUID_GROUPS \
     "SELECT GO.vcard_uid FROM vcard_objs GO" \
     " JOIN vcard_groups G" \
@@ -581,11 +612,13 @@ static int carddav_write_groups(struct carddav_db *carddavdb, int rowid, const s
     "INSERT INTO vcard_objs ("                                          \
     "  alive, creationdate, mailbox, resource, imap_uid, modseq,"       \
     "  lock_token, lock_owner, lock_ownerid, lock_expire,"              \
-    "  version, vcard_uid, kind, fullname, name, nickname)"             \
+    "  version, vcard_uid, kind, fullname, name, nickname,"             \
+    "  email, phone)"                                                   \
     " VALUES ("                                                         \
     "  :alive, :creationdate, :mailbox, :resource, :imap_uid, :modseq," \
     "  :lock_token, :lock_owner, :lock_ownerid, :lock_expire,"          \
-    "  :version, :vcard_uid, :kind, :fullname, :name, :nickname );"
+    "  :version, :vcard_uid, :kind, :fullname, :name, :nickname,"       \
+    "  :email, :phone );"
 
 #define CMD_UPDATE                      \
     "UPDATE vcard_objs SET"             \
@@ -602,7 +635,9 @@ static int carddav_write_groups(struct carddav_db *carddavdb, int rowid, const s
     "  kind         = :kind,"           \
     "  fullname     = :fullname,"       \
     "  name         = :name,"           \
-    "  nickname     = :nickname"        \
+    "  nickname     = :nickname,"       \
+    "  email        = :email,"          \
+    "  phone        = :phone"           \
     " WHERE rowid = :rowid;"
 
 
@@ -626,6 +661,8 @@ EXPORTED int carddav_write(struct carddav_db *carddavdb, struct carddav_data *cd
         { ":fullname",     SQLITE_TEXT,    { .s = cdata->fullname         } },
         { ":name",         SQLITE_TEXT,    { .s = cdata->name             } },
         { ":nickname",     SQLITE_TEXT,    { .s = cdata->nickname         } },
+        { ":email",        SQLITE_TEXT,    { .s = cdata->email            } },
+        { ":phone",        SQLITE_TEXT,    { .s = cdata->phone            } },
         { NULL,            SQLITE_NULL,    { .s = NULL                    } } };
 
     if (cdata->dav.rowid) {
@@ -708,6 +745,77 @@ EXPORTED int carddav_get_cards(struct carddav_db *carddavdb,
     return r;
 }
 
+EXPORTED int carddav_multiget(struct carddav_db *carddavdb,
+                              const char *abookname,
+                              const strarray_t *vcard_uids, int kind,
+                              int (*cb)(void *rock,
+                                        struct carddav_data *cdata),
+                              void *rock)
+{
+    static struct carddav_data cdata;
+    struct read_rock rrock = { carddavdb, &cdata, 0, cb, rock };
+    struct buf sqlbuf = BUF_INITIALIZER;
+    int first, r = 0;
+
+    /* batched so we stay well below SQLITE_MAX_VARIABLE_NUMBER */
+    for (first = 0; !r && first < strarray_size(vcard_uids);
+         first += SQL_MAXVAL) {
+        int n = strarray_size(vcard_uids) - first;
+        int i, nval = 0;
+
+        if (n > SQL_MAXVAL) n = SQL_MAXVAL;
+
+        struct sqldb_bindval *bval =
+            xzmalloc((n + 3) * sizeof(struct sqldb_bindval));
+
+        bval[nval].name = ":kind";
+        bval[nval].type = SQLITE_INTEGER;
+        bval[nval].val.i = kind;
+        nval++;
+        if (abookname) {
+            bval[nval].name = ":mailbox";
+            bval[nval].type = SQLITE_TEXT;
+            bval[nval].val.s = abookname;
+            nval++;
+        }
+
+        buf_setcstr(&sqlbuf, CMD_GETFIELDS);
+        buf_appendcstr(&sqlbuf, " WHERE alive = 1 AND kind = :kind");
+        if (abookname)
+            buf_appendcstr(&sqlbuf, " AND mailbox = :mailbox");
+        buf_appendcstr(&sqlbuf, " AND vcard_uid IN (");
+        for (i = 0; i < n; i++) {
+            char name[16];
+            snprintf(name, sizeof(name), ":uid%d", i);
+            if (i) buf_putc(&sqlbuf, ',');
+            buf_appendcstr(&sqlbuf, name);
+            bval[nval].name = xstrdup(name);
+            bval[nval].type = SQLITE_TEXT;
+            bval[nval].val.s = strarray_nth(vcard_uids, first + i);
+            nval++;
+        }
+        /* walk the index in mailbox/uid order, so readers which open
+           the underlying messages do sequential I/O on the spool */
+        buf_appendcstr(&sqlbuf, ") ORDER BY mailbox, imap_uid;");
+
+        r = sqldb_exec(carddavdb->db, buf_cstring(&sqlbuf), bval,
+                       &read_cb, &rrock);
+
+        for (i = 0; i < nval; i++) {
+            if (!strncmp(bval[i].name, ":uid", 4))
+                free((char *) bval[i].name);
+        }
+        free(bval);
+    }
+    buf_free(&sqlbuf);
+    if (r) {
+        syslog(LOG_ERR, "caldav error %s", error_message(r));
+        /* XXX - free memory */
+    }
+
+    return r;
+}
+
 #define CMD_GETUPDATES CMD_GETFIELDS \
   " WHERE kind = :kind AND modseq > :modseq;"
 
@@ -749,6 +857,9 @@ EXPORTED int carddav_writecard(struct carddav_db *carddavdb, struct carddav_data
 
     strarray_t emails = STRARRAY_INITIALIZER;
     strarray_t member_uids = STRARRAY_INITIALIZER;
+    strarray_t emailvals = STRARRAY_INITIALIZER;
+    strarray_t phonevals = STRARRAY_INITIALIZER;
+    char *emailcol = NULL, *phonecol = NULL;
 
     for (ventry = vcard->properties; ventry; ventry = ventry->next) {
         const char *name = ventry->name;
@@ -780,6 +891,10 @@ EXPORTED int carddav_writecard(struct carddav_db *carddavdb, struct carddav_data
             }
             strarray_append(&emails, propval);
             strarray_append(&emails, ispref ? "1" : "");
+            strarray_append(&emailvals, propval);
+        }
+        else if (!strcasecmp(name, "tel")) {
+            strarray_append(&phonevals, propval);
         }
         else if (!strcasecmp(name, "member") ||
                  !strcasecmp(name, "x-addressbookserver-member")) {
@@ -802,12 +917,23 @@ EXPORTED int carddav_writecard(struct carddav_db *carddavdb, struct carddav_data
         }
     }
 
+    /* Dump the filterable multi-valued properties into their columns,
+     * so addressbook-query needn't parse the vCard ("" if none) */
+    emailcol = strarray_join(&emailvals, CARDDAV_SEP);
+    cdata->email = emailcol ? emailcol : "";
+    phonecol = strarray_join(&phonevals, CARDDAV_SEP);
+    cdata->phone = phonecol ? phonecol : "";
+
     int r = carddav_write(carddavdb, cdata);
     if (!r) r = carddav_write_emails(carddavdb, cdata->dav.rowid, &emails);
     if (!r) r = carddav_write_groups(carddavdb, cdata->dav.rowid, &member_uids);
 
+    free(emailcol);
+    free(phonecol);
     strarray_fini(&emails);
     strarray_fini(&member_uids);
+    strarray_fini(&emailvals);
+    strarray_fini(&phonevals);
 
     return r;
 }
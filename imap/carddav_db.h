@@ -64,10 +64,16 @@ struct carddav_data {
     const char *fullname;
     const char *name;
     const char *nickname;
+    const char *email;    /* all EMAIL values, CARDDAV_SEP-joined;  */
+    const char *phone;    /* ditto for TEL; NULL = not extracted yet */
     strarray_t *emails;
     strarray_t *member_uids;
 };
 
+/* Separator for the email/phone column values.  US (unit separator)
+ * can't appear in legitimate property values, unlike a comma */
+#define CARDDAV_SEP "\x1f"
+
 typedef int carddav_cb_t(void *rock, struct carddav_data *cdata);
 
 
@@ -116,6 +122,14 @@ int carddav_get_cards(struct carddav_db *carddavdb,
                       const char *mailbox, const char *vcard_uid, int kind,
                       carddav_cb_t *cb, void *rock);
 
+/* process each entry of type 'kind' whose uid is in 'vcard_uids' with
+   cb(), batched into IN queries and ordered by mailbox/imap_uid so a
+   large multiget reads the spool sequentially */
+int carddav_multiget(struct carddav_db *carddavdb,
+                     const char *mailbox,
+                     const strarray_t *vcard_uids, int kind,
+                     carddav_cb_t *cb, void *rock);
+
 /* process each entry of type 'kind' and updated since 'oldmodseq'
    in 'carddavdb' with cb() */
 int carddav_get_updates(struct carddav_db *carddavdb,
@@ -126,6 +140,12 @@ int carddav_get_updates(struct carddav_db *carddavdb,
 int carddav_foreach(struct carddav_db *carddavdb, const char *mailbox,
                     carddav_cb_t *cb, void *rock);
 
+/* process each entry for 'mailbox' in 'carddavdb' with a modseq higher
+   than 'oldmodseq' with cb(), in ascending order of modseq,
+   tombstones included (used by the sync-collection REPORT) */
+int carddav_foreach_changed(struct carddav_db *carddavdb, const char *mailbox,
+                            modseq_t oldmodseq, carddav_cb_t *cb, void *rock);
+
 /* write an entry to 'carddavdb' */
 int carddav_write(struct carddav_db *carddavdb, struct carddav_data *cdata);
 
@@ -55,21 +55,121 @@
 #include <unistd.h>
 #endif
 
+#include "cyrusdb.h"
 #include "exitcodes.h"
 #include "index.h"
 #include "global.h"
 #include "mboxlist.h"
 #include "mailbox.h"
 #include "map.h"
+#include "message_guid.h"
+#include "ptrarray.h"
+#include "util.h"
 #include "xmalloc.h"
 
+/* verification cursor: mailbox name -> decimal time of last check */
+#define FNAME_CHKCYRUSDB "/chk_cyrus.db"
+
 static void usage(void)
 {
-    fprintf(stderr, "chk_cyrus [-C <altconfig>] partition\n");
+    fprintf(stderr, "chk_cyrus [-C <altconfig>] [-P partition | -M mailbox]\n");
+    fprintf(stderr, "          [-i nmailboxes] [-s percent]\n");
+    fprintf(stderr, "\t-i\tincremental: check the n least-recently-verified\n");
+    fprintf(stderr, "\t\tmailboxes plus any modified since their last check\n");
+    fprintf(stderr, "\t-s\tspot-check the GUIDs of this percentage of spool files\n");
     exit(-1);
 }
 
 static const char *check_part = NULL; /* partition we are checking */
+static struct db *cursordb = NULL;
+static int sample_pct = 0;
+
+static int cursor_read(const char *name, time_t *lastp)
+{
+    const char *data = NULL;
+    size_t datalen = 0;
+    char buf[32];
+    int r;
+
+    if (!cursordb) return CYRUSDB_NOTFOUND;
+
+    r = cyrusdb_fetch(cursordb, name, strlen(name),
+                      &data, &datalen, NULL);
+    if (r) return r;
+
+    if (datalen >= sizeof(buf)) return CYRUSDB_IOERROR;
+    memcpy(buf, data, datalen);
+    buf[datalen] = '\0';
+    *lastp = (time_t)strtoul(buf, NULL, 10);
+
+    return 0;
+}
+
+static void cursor_write(const char *name)
+{
+    char buf[32];
+    int len;
+
+    if (!cursordb) return;
+
+    len = snprintf(buf, sizeof(buf), "%llu",
+                   (unsigned long long)time(NULL));
+    cyrusdb_store(cursordb, name, strlen(name), buf, len, NULL);
+}
+
+/* verify that a sample of the messages on disk still match the GUIDs
+ * recorded in the index */
+static void spotcheck_guids(const char *name)
+{
+    struct mailbox *mailbox = NULL;
+    const message_t *msg;
+    int r;
+
+    r = mailbox_open_irl(name, &mailbox);
+    if (r) {
+        fprintf(stderr, "spotcheck: can't open %s: %s\n",
+                name, error_message(r));
+        return;
+    }
+
+    struct mailbox_iter *iter =
+        mailbox_iter_init(mailbox, 0, ITER_SKIP_EXPUNGED);
+    while ((msg = mailbox_iter_step(iter))) {
+        const struct index_record *record = msg_record(msg);
+        struct buf buf = BUF_INITIALIZER;
+        struct message_guid guid;
+
+        if (rand() % 100 >= sample_pct)
+            continue;
+
+        if (mailbox_map_record(mailbox, record, &buf)) {
+            fprintf(stderr, "%s uid %u: missing message file\n",
+                    name, record->uid);
+            continue;
+        }
+        message_guid_generate(&guid, buf.s, buf.len);
+        if (!message_guid_equal(&guid, &record->guid)) {
+            fprintf(stderr, "%s uid %u: GUID mismatch on disk\n",
+                    name, record->uid);
+        }
+        buf_free(&buf);
+    }
+    mailbox_iter_done(&iter);
+
+    mailbox_close(&mailbox);
+}
+
+static void chkmbox_one(const char *name)
+{
+    fprintf(stderr, "checking: %s\n", name);
+
+    mailbox_reconstruct(name, 0); /* no changes allowed */
+
+    if (sample_pct)
+        spotcheck_guids(name);
+
+    cursor_write(name);
+}
 
 static int chkmbox(struct findall_data *data, void *rock __attribute__((unused)))
 {
@@ -93,25 +193,94 @@ static int chkmbox(struct findall_data *data, void *rock __attribute__((unused))
         return 0;
     }
 
-    fprintf(stderr, "checking: %s\n", name);
-
-    mailbox_reconstruct(name, 0); /* no changes allowed */
+    chkmbox_one(name);
 
     mboxlist_entry_free(&mbentry);
 
     return 0;
 }
 
+struct chk_candidate {
+    char *name;
+    time_t lastverified;    /* 0 = never verified or modified since */
+};
+
+static int collect_cb(const mbentry_t *mbentry, void *rock)
+{
+    ptrarray_t *cands = (ptrarray_t *)rock;
+    struct chk_candidate *cand;
+    time_t last = 0;
+
+    if (mbentry->mbtype & MBTYPE_REMOTE) return 0;
+    if (check_part && strcmp(mbentry->partition, check_part)) return 0;
+
+    if (cursor_read(mbentry->name, &last)) last = 0;
+
+    if (last) {
+        /* modified since the last verification?  the index mtime is a
+         * cheap conservative signal */
+        const char *fname = mbentry_metapath(mbentry, META_INDEX, 0);
+        struct stat sbuf;
+
+        if (fname && !stat(fname, &sbuf) && sbuf.st_mtime > last)
+            last = 0;
+    }
+
+    cand = xzmalloc(sizeof(struct chk_candidate));
+    cand->name = xstrdup(mbentry->name);
+    cand->lastverified = last;
+    ptrarray_append(cands, cand);
+
+    return 0;
+}
+
+static int cand_compar(const void *va, const void *vb)
+{
+    const struct chk_candidate *a = *(const struct chk_candidate **)va;
+    const struct chk_candidate *b = *(const struct chk_candidate **)vb;
+
+    if (a->lastverified < b->lastverified) return -1;
+    if (a->lastverified > b->lastverified) return 1;
+    return strcmp(a->name, b->name);
+}
+
+/* check every mailbox not verified since it was last modified, plus
+ * enough of the least-recently-verified others to make up 'budget' */
+static void chk_incremental(int budget)
+{
+    ptrarray_t cands = PTRARRAY_INITIALIZER;
+    int i;
+
+    mboxlist_allmbox("", collect_cb, &cands, /*incdel*/0);
+
+    qsort(cands.data, cands.count, sizeof(void *), cand_compar);
+
+    for (i = 0; i < cands.count; i++) {
+        struct chk_candidate *cand = ptrarray_nth(&cands, i);
+
+        if (cand->lastverified == 0 || budget-- > 0)
+            chkmbox_one(cand->name);
+
+        free(cand->name);
+        free(cand);
+    }
+
+    ptrarray_fini(&cands);
+}
+
 int main(int argc, char **argv)
 {
     char *alt_config = NULL;
     char pattern[2] = { '*', '\0' };
     const char *mailbox = NULL;
+    int incremental = 0;
+    char *fname;
+    int r;
 
     extern char *optarg;
     int opt;
 
-    while ((opt = getopt(argc, argv, "C:P:M:")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:P:M:i:s:")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -133,21 +302,54 @@ int main(int argc, char **argv)
             mailbox = optarg;
             break;
 
+        case 'i':
+            incremental = atoi(optarg);
+            if (incremental < 1) usage();
+            break;
+
+        case 's':
+            sample_pct = atoi(optarg);
+            if (sample_pct < 1 || sample_pct > 100) usage();
+            break;
+
         default:
             usage();
             /* NOTREACHED */
         }
     }
 
+    if (incremental && mailbox) {
+        usage();
+        exit(EC_USAGE);
+    }
+
+    if (sample_pct) srand(time(NULL) ^ getpid());
+
     cyrus_init(alt_config, "chk_cyrus", 0, CONFIG_NEED_PARTITION_DATA);
 
     mboxlist_init(0);
     mboxlist_open(NULL);
 
-    if(mailbox) {
+    /* the verification cursor feeds incremental runs, and full runs
+     * keep it fresh too */
+    fname = strconcat(config_dir, FNAME_CHKCYRUSDB, (char *)NULL);
+    r = cyrusdb_open(config_getstring(IMAPOPT_CHK_CYRUS_DB), fname,
+                     CYRUSDB_CREATE, &cursordb);
+    if (r) {
+        fprintf(stderr, "can't open %s (%s), not recording progress\n",
+                fname, cyrusdb_strerror(r));
+        cursordb = NULL;
+    }
+    free(fname);
+
+    if (mailbox) {
         fprintf(stderr, "Examining mailbox: %s\n", mailbox);
         mboxlist_findone(NULL, mailbox, 1, NULL,
                          NULL, chkmbox, NULL);
+    } else if (incremental) {
+        fprintf(stderr, "Examining partition: %s (incremental)\n",
+                (check_part ? check_part : "ALL PARTITIONS"));
+        chk_incremental(incremental);
     } else {
         fprintf(stderr, "Examining partition: %s\n",
                 (check_part ? check_part : "ALL PARTITIONS"));
@@ -157,6 +359,8 @@ int main(int argc, char **argv)
                          NULL, chkmbox, NULL);
     }
 
+    if (cursordb) cyrusdb_close(cursordb);
+
     mboxlist_close();
     mboxlist_done();
 
@@ -57,6 +57,7 @@
 #include "append.h"
 #include "assert.h"
 #include "bsearch.h"
+#include "byteorder64.h"
 #include "charset.h"
 #include "crc32.h"
 #include "dlist.h"
@@ -98,13 +99,27 @@
 
 #define DB config_conversations_db
 
-#define CONVERSATIONS_VERSION 0
+/* Version 0 encoded B and F records as dlist text, which costs an
+ * allocation per field to parse.  Version 1 packs them as fixed-width
+ * network byte order vectors with a section table, so readers can
+ * decode just the sections they need.  Version 0 records are still
+ * readable, and are upgraded in place whenever they are rewritten. */
+#define CONVERSATIONS_VERSION 1
 
 static conv_status_t NULLSTATUS = { 0, 0, 0};
 
 static char *convdir = NULL;
 static char *suffix = NULL;
 
+/* Recently closed databases, kept open with no lock or transaction
+ * held (up to the conversations_keep_open limit, most recent first).
+ * A delivery burst to the same user reopens the same database once per
+ * message; reviving a parked handle takes a fresh lock and re-reads
+ * the shared records, but skips the file open and mmap setup. */
+static struct conversations_open *parked_conversations = NULL;
+static int nparked = 0;
+
+static void _conv_free(struct conversations_open *open);
 static int check_msgid(const char *msgid, size_t len, size_t *lenp);
 static int _conversations_parse(const char *data, size_t datalen,
                                 arrayu64_t *cids, time_t *stampp);
@@ -203,24 +218,56 @@ EXPORTED int conversations_open_path(const char *fname, const char *userid, stru
             return IMAP_CONVERSATIONS_ALREADY_OPEN;
     }
 
-    open = xzmalloc(sizeof(struct conversations_open));
+    /* revive a parked database if we have one for this path */
+    struct conversations_open **prevp = &parked_conversations;
+    for (open = parked_conversations; open; open = open->next) {
+        if (!strcmp(open->s.path, fname)) {
+            *prevp = open->next;
+            nparked--;
+            break;
+        }
+        prevp = &open->next;
+    }
+
+    if (open) {
+        /* take a fresh lock on the kept handle; if the file has gone
+         * away or the relock can't follow it, fall back to a plain
+         * open below */
+        r = cyrusdb_fetchlock(open->s.db, CFKEY, strlen(CFKEY),
+                              &val, &vallen, &open->s.txn);
+        if (r && r != CYRUSDB_NOTFOUND) {
+            _conv_free(open);
+            open = NULL;
+            val = NULL;
+            vallen = 0;
+        }
+    }
 
-    r = cyrusdb_open(DB, fname, CYRUSDB_CREATE | CYRUSDB_CONVERT, &open->s.db);
-    if (r || open->s.db == NULL) {
-        free(open);
-        return IMAP_IOERROR;
+    if (!open) {
+        open = xzmalloc(sizeof(struct conversations_open));
+
+        r = cyrusdb_open(DB, fname, CYRUSDB_CREATE | CYRUSDB_CONVERT, &open->s.db);
+        if (r || open->s.db == NULL) {
+            free(open);
+            return IMAP_IOERROR;
+        }
+
+        open->s.path = xstrdup(fname);
+
+        /* ensure a write lock immediately, and also load the counted flags */
+        cyrusdb_fetchlock(open->s.db, CFKEY, strlen(CFKEY),
+                          &val, &vallen, &open->s.txn);
     }
 
-    open->s.path = xstrdup(fname);
     open->next = open_conversations;
     open_conversations = open;
 
-    /* ensure a write lock immediately, and also load the counted flags */
-    cyrusdb_fetchlock(open->s.db, CFKEY, strlen(CFKEY),
-                      &val, &vallen, &open->s.txn);
     _init_counted(&open->s, val, vallen);
 
-    /* we should just read the folder names up front too */
+    /* we should just read the folder names up front too - they may
+     * have changed since the handle was parked */
+    if (open->s.folder_names)
+        strarray_free(open->s.folder_names);
     open->s.folder_names = strarray_new();
 
     /* if there's a value, parse as a dlist */
@@ -235,6 +282,7 @@ EXPORTED int conversations_open_path(const char *fname, const char *userid, stru
         dlist_free(&dl);
     }
 
+    free(open->s.annotmboxname);
     if (userid)
         open->s.annotmboxname = mboxname_user_mbox(userid, CONVSPLITFOLDER);
     else
@@ -304,6 +352,37 @@ EXPORTED struct conversations_state *conversations_get_mbox(const char *mboxname
 }
 
 
+static void _conv_free(struct conversations_open *open)
+{
+    if (open->s.db)
+        cyrusdb_close(open->s.db);
+    free(open->s.annotmboxname);
+    free(open->s.path);
+    if (open->s.counted_flags)
+        strarray_free(open->s.counted_flags);
+    if (open->s.folder_names)
+        strarray_free(open->s.folder_names);
+    free(open);
+}
+
+static void _conv_park(struct conversations_open *open)
+{
+    int keep = config_getint(IMAPOPT_CONVERSATIONS_KEEP_OPEN);
+
+    open->s.txn = NULL;
+    open->next = parked_conversations;
+    parked_conversations = open;
+
+    if (++nparked > keep) {
+        /* drop the least recently used handle */
+        struct conversations_open **prevp = &parked_conversations;
+        while ((*prevp)->next) prevp = &(*prevp)->next;
+        _conv_free(*prevp);
+        *prevp = NULL;
+        nparked--;
+    }
+}
+
 static void _conv_remove(struct conversations_state *state)
 {
     struct conversations_open **prevp = &open_conversations;
@@ -313,13 +392,11 @@ static void _conv_remove(struct conversations_state *state)
         if (state == &cur->s) {
             /* found it! */
             *prevp = cur->next;
-            free(cur->s.annotmboxname);
-            free(cur->s.path);
-            if (cur->s.counted_flags)
-                strarray_free(cur->s.counted_flags);
-            if (cur->s.folder_names)
-                strarray_free(cur->s.folder_names);
-            free(cur);
+            if (cur->s.db &&
+                config_getint(IMAPOPT_CONVERSATIONS_KEEP_OPEN) > 0)
+                _conv_park(cur);
+            else
+                _conv_free(cur);
             return;
         }
         prevp = &cur->next;
@@ -363,11 +440,9 @@ EXPORTED int conversations_abort(struct conversations_state **statep)
     /* clean up hashes */
     conversations_abortcache(state);
 
-    if (state->db) {
-        if (state->txn)
-            cyrusdb_abort(state->db, state->txn);
-        cyrusdb_close(state->db);
-    }
+    if (state->db && state->txn)
+        cyrusdb_abort(state->db, state->txn);
+    state->txn = NULL;
 
     _conv_remove(state);
 
@@ -387,11 +462,9 @@ EXPORTED int conversations_commit(struct conversations_state **statep)
     conversations_commitcache(state);
 
     /* finally it's safe to commit the DB itself */
-    if (state->db) {
-        if (state->txn)
-            r = cyrusdb_commit(state->db, state->txn);
-        cyrusdb_close(state->db);
-    }
+    if (state->db && state->txn)
+        r = cyrusdb_commit(state->db, state->txn);
+    state->txn = NULL;
 
     _conv_remove(state);
 
@@ -705,6 +778,76 @@ static int folder_number_rename(struct conversations_state *state,
     return write_folders(state);
 }
 
+/* Helpers for the version 1 packed record format.  All integers are
+ * fixed-width in network byte order; strings are a 32 bit length
+ * followed by the bytes, with UINT32_MAX meaning NULL.  The readers
+ * take a cursor and fail cleanly on truncated records. */
+
+struct convpackcursor {
+    const char *base;
+    const char *end;
+};
+
+static void _pack_string(struct buf *buf, const char *s)
+{
+    if (s) {
+        size_t len = strlen(s);
+        buf_appendbit32(buf, len);
+        buf_appendmap(buf, s, len);
+    }
+    else {
+        buf_appendbit32(buf, UINT32_MAX);
+    }
+}
+
+static int _unpack32(struct convpackcursor *c, uint32_t *valp)
+{
+    uint32_t tmp;
+
+    if (c->end - c->base < 4)
+        return IMAP_MAILBOX_BADFORMAT;
+    memcpy(&tmp, c->base, 4);
+    *valp = ntohl(tmp);
+    c->base += 4;
+    return 0;
+}
+
+static int _unpack64(struct convpackcursor *c, bit64 *valp)
+{
+    if (c->end - c->base < 8)
+        return IMAP_MAILBOX_BADFORMAT;
+    *valp = align_ntohll(c->base);
+    c->base += 8;
+    return 0;
+}
+
+static int _unpack_skip(struct convpackcursor *c, uint64_t len)
+{
+    if ((uint64_t)(c->end - c->base) < len)
+        return IMAP_MAILBOX_BADFORMAT;
+    c->base += len;
+    return 0;
+}
+
+static int _unpack_string(struct convpackcursor *c, char **valp)
+{
+    uint32_t len;
+    int r;
+
+    r = _unpack32(c, &len);
+    if (r) return r;
+
+    if (len == UINT32_MAX) {
+        *valp = NULL;
+        return 0;
+    }
+    if ((size_t)(c->end - c->base) < len)
+        return IMAP_MAILBOX_BADFORMAT;
+    *valp = xstrndup(c->base, len);
+    c->base += len;
+    return 0;
+}
+
 EXPORTED int conversation_storestatus(struct conversations_state *state,
                                       const char *key, size_t keylen,
                                       const conv_status_t *status)
@@ -715,15 +858,11 @@ EXPORTED int conversation_storestatus(struct conversations_state *state,
                               &state->txn, /*force*/1);
     }
 
-    struct dlist *dl = dlist_newlist(NULL, NULL);
-    dlist_setnum64(dl, "MODSEQ", status->modseq);
-    dlist_setnum32(dl, "EXISTS", status->exists);
-    dlist_setnum32(dl, "UNSEEN", status->unseen);
-
     struct buf buf = BUF_INITIALIZER;
     buf_printf(&buf, "%d ", CONVERSATIONS_VERSION);
-    dlist_printbuf(dl, 0, &buf);
-    dlist_free(&dl);
+    buf_appendbit64(&buf, status->modseq);
+    buf_appendbit32(&buf, status->exists);
+    buf_appendbit32(&buf, status->unseen);
 
     int r = cyrusdb_store(state->db,
                           key, keylen,
@@ -760,80 +899,95 @@ EXPORTED int conversation_store(struct conversations_state *state,
                        const char *key, int keylen,
                        conversation_t *conv)
 {
-    struct dlist *dl, *n, *nn;
     struct buf buf = BUF_INITIALIZER;
+    struct buf sbuf = BUF_INITIALIZER;
+    char guidbuf[MESSAGE_GUID_SIZE];
     const conv_folder_t *folder;
     const conv_sender_t *sender;
     const conv_thread_t *thread;
-    int version = CONVERSATIONS_VERSION;
+    uint32_t ncounts = 0;
+    uint32_t nfolders = 0;
+    uint32_t nsenders = 0;
+    uint32_t nthreads = 0;
     int i;
     int r;
 
-    dl = dlist_newlist(NULL, NULL);
-    dlist_setnum64(dl, "MODSEQ", conv->modseq);
-    dlist_setnum32(dl, "NUMRECORDS", conv->num_records);
-    dlist_setnum32(dl, "EXISTS", conv->exists);
-    dlist_setnum32(dl, "UNSEEN", conv->unseen);
-    n = dlist_newlist(dl, "COUNTS");
-    if (state->counted_flags) {
-        for (i = 0; i < state->counted_flags->count; i++) {
-            const char *flag = strarray_nth(state->counted_flags, i);
-            dlist_setnum32(n, flag, conv->counts[i]);
-        }
-    }
+    if (state->counted_flags)
+        ncounts = state->counted_flags->count;
 
-    n = dlist_newlist(dl, "FOLDER");
     for (folder = conv->folders ; folder ; folder = folder->next) {
-        if (!folder->num_records)
-            continue;
-        nn = dlist_newlist(n, "FOLDER");
-        dlist_setnum32(nn, "FOLDERNUM", folder->number);
-        dlist_setnum64(nn, "MODSEQ", folder->modseq);
-        dlist_setnum32(nn, "NUMRECORDS", folder->num_records);
-        dlist_setnum32(nn, "EXISTS", folder->exists);
-        dlist_setnum32(nn, "UNSEEN", folder->unseen);
+        if (folder->num_records)
+            nfolders++;
     }
 
-    n = dlist_newlist(dl, "SENDER");
+    /* build the senders section separately, so the header can record
+     * its size for readers that want to skip straight past it */
     i = 0;
     for (sender = conv->senders ; sender ; sender = sender->next) {
         if (!sender->exists)
             continue;
         /* don't ever store more than 100 senders */
         if (++i >= 100) break;
-        nn = dlist_newlist(n, "SENDER");
-        /* envelope form */
-        dlist_setatom(nn, "NAME", sender->name);
-        dlist_setatom(nn, "ROUTE", sender->route);
-        dlist_setatom(nn, "MAILBOX", sender->mailbox);
-        dlist_setatom(nn, "DOMAIN", sender->domain);
-        dlist_setnum32(nn, "LASTSEEN", sender->lastseen);
-        dlist_setnum32(nn, "EXISTS", sender->exists);
+        nsenders++;
+        _pack_string(&sbuf, sender->name);
+        _pack_string(&sbuf, sender->route);
+        _pack_string(&sbuf, sender->mailbox);
+        _pack_string(&sbuf, sender->domain);
+        buf_appendbit32(&sbuf, sender->lastseen);
+        buf_appendbit32(&sbuf, sender->exists);
+    }
+
+    for (thread = conv->thread; thread; thread = thread->next) {
+        if (thread->exists)
+            nthreads++;
+    }
+
+    buf_printf(&buf, "%d ", CONVERSATIONS_VERSION);
+    buf_appendbit64(&buf, conv->modseq);
+    buf_appendbit32(&buf, conv->num_records);
+    buf_appendbit32(&buf, conv->exists);
+    buf_appendbit32(&buf, conv->unseen);
+    buf_appendbit32(&buf, conv->size);
+    buf_appendbit32(&buf, ncounts);
+    buf_appendbit32(&buf, nfolders);
+    buf_appendbit32(&buf, nsenders);
+    buf_appendbit32(&buf, nthreads);
+    buf_appendbit32(&buf, conv->subject ? strlen(conv->subject) : UINT32_MAX);
+    buf_appendbit32(&buf, sbuf.len);
+
+    for (i = 0; i < (int)ncounts; i++)
+        buf_appendbit32(&buf, conv->counts[i]);
+
+    for (folder = conv->folders ; folder ; folder = folder->next) {
+        if (!folder->num_records)
+            continue;
+        buf_appendbit32(&buf, folder->number);
+        buf_appendbit64(&buf, folder->modseq);
+        buf_appendbit32(&buf, folder->num_records);
+        buf_appendbit32(&buf, folder->exists);
+        buf_appendbit32(&buf, folder->unseen);
     }
 
-    dlist_setatom(dl, "SUBJECT", conv->subject);
+    if (conv->subject)
+        buf_appendmap(&buf, conv->subject, strlen(conv->subject));
 
-    dlist_setnum32(dl, "SIZE", conv->size);
+    if (sbuf.len) buf_appendmap(&buf, sbuf.s, sbuf.len);
+    buf_free(&sbuf);
 
-    n = dlist_newlist(dl, "THREAD");
     for (thread = conv->thread; thread; thread = thread->next) {
         if (!thread->exists)
             continue;
-        nn = dlist_newlist(n, "THREAD");
-        dlist_setguid(nn, "GUID", &thread->guid);
-        dlist_setnum32(nn, "EXISTS", thread->exists);
-        dlist_setnum32(nn, "INTERNALDATE", thread->internaldate);
-        dlist_setnum32(nn, "MSGID", thread->msgid);
-        if (thread->inreplyto) dlist_setnum32(nn, "INREPLYTO", thread->inreplyto);
+        message_guid_export(&thread->guid, guidbuf);
+        buf_appendmap(&buf, guidbuf, MESSAGE_GUID_SIZE);
+        buf_appendbit32(&buf, thread->exists);
+        buf_appendbit32(&buf, thread->internaldate);
+        buf_appendbit32(&buf, thread->msgid);
+        buf_appendbit32(&buf, thread->inreplyto);
     }
 
-    buf_printf(&buf, "%d ", version);
-    dlist_printbuf(dl, 0, &buf);
-    dlist_free(&dl);
-
     if (_sanity_check_counts(conv)) {
-        syslog(LOG_ERR, "IOERROR: conversations_audit on store: %s %.*s %.*s",
-               state->path, keylen, key, (int)buf.len, buf.s);
+        syslog(LOG_ERR, "IOERROR: conversations_audit on store: %s %.*s",
+               state->path, keylen, key);
     }
 
     r = cyrusdb_store(state->db, key, keylen, buf.s, buf.len, &state->txn);
@@ -917,12 +1071,18 @@ EXPORTED int conversation_save(struct conversations_state *state,
                       conversation_t *conv)
 {
     char bkey[CONVERSATION_ID_STRMAX+2];
+    struct xstats_timer timer;
+    int r;
 
     if (!conv)
         return IMAP_INTERNAL;
     if (!conv->dirty)
         return 0;
 
+    /* a partially decoded conversation is read-only: writing it back
+     * would lose the sections that were never decoded */
+    assert(conv->wantfields == CONV_WANT_ALL);
+
     /* old pre-conversations message, nothing to do */
     if (!cid)
         return 0;
@@ -930,7 +1090,11 @@ EXPORTED int conversation_save(struct conversations_state *state,
 
     snprintf(bkey, sizeof(bkey), "B" CONV_FMT, cid);
 
-    return _conversation_save(state, bkey, strlen(bkey), conv);
+    xstats_timer_start(&timer);
+    r = _conversation_save(state, bkey, strlen(bkey), conv);
+    xstats_timer_end(&timer, CONV_DB_STORE);
+
+    return r;
 }
 
 EXPORTED int conversation_parsestatus(const char *data, size_t datalen,
@@ -955,11 +1119,25 @@ EXPORTED int conversation_parsestatus(const char *data, size_t datalen,
     rest++; /* skip space */
     restlen = datalen - (rest - data);
 
-    if (version != CONVERSATIONS_VERSION) {
+    if (version == CONVERSATIONS_VERSION) {
+        struct convpackcursor c = { rest, rest + restlen };
+        bit64 modseq = 0;
+
+        r = _unpack64(&c, &modseq);
+        if (!r) r = _unpack32(&c, &status->exists);
+        if (!r) r = _unpack32(&c, &status->unseen);
+        if (r) return r;
+
+        status->modseq = modseq;
+        return 0;
+    }
+
+    if (version != 0) {
         /* XXX - an error code for "incorrect version"? */
         return IMAP_MAILBOX_BADFORMAT;
     }
 
+    /* version 0: dlist text */
     r = dlist_parsemap(&dl, 0, rest, restlen);
     if (r) return r;
 
@@ -1086,31 +1264,19 @@ static conv_thread_t *parse_thread(struct dlist *dl)
     return res;
 }
 
-EXPORTED int conversation_parse(struct conversations_state *state,
-                       const char *data, size_t datalen,
-                       conversation_t **convp)
+/* Decode a version 0 dlist record.  The text format gives no way to
+ * skip a section without parsing it, so these always decode in full. */
+static int _conversation_parse_v0(struct conversations_state *state,
+                                  const char *rest, size_t restlen,
+                                  conversation_t **convp)
 {
-    const char *rest;
     int i;
-    int restlen;
-    bit64 version;
     struct dlist *dl = NULL;
     struct dlist *n, *nn;
     conversation_t *conv;
     conv_folder_t *folder;
     int r;
 
-    *convp = NULL;
-
-    r = parsenum(data, &rest, datalen, &version);
-    if (r) return IMAP_MAILBOX_BADFORMAT;
-
-    if (rest[0] != ' ') return IMAP_MAILBOX_BADFORMAT;
-    rest++; /* skip space */
-    restlen = datalen - (rest - data);
-
-    if (version != CONVERSATIONS_VERSION) return IMAP_MAILBOX_BADFORMAT;
-
     r = dlist_parsemap(&dl, 0, rest, restlen);
     if (r) return r;
 
@@ -1198,25 +1364,218 @@ EXPORTED int conversation_parse(struct conversations_state *state,
     conv->prev_unseen = conv->unseen;
 
     dlist_free(&dl);
+    conv->wantfields = CONV_WANT_ALL;
     conv->dirty = 0;
     *convp = conv;
     return 0;
 }
 
-EXPORTED int conversation_load(struct conversations_state *state,
-                      conversation_id_t cid,
-                      conversation_t **convp)
+/* Decode a version 1 packed record, decoding only the sections asked
+ * for in 'wantfields' and stepping over the rest using the lengths in
+ * the header. */
+static int _conversation_parse_packed(struct conversations_state *state,
+                                      const char *rest, size_t restlen,
+                                      conversation_t **convp,
+                                      unsigned wantfields)
+{
+    struct convpackcursor c = { rest, rest + restlen };
+    conversation_t *conv;
+    conv_folder_t *folder;
+    bit64 modseq = 0;
+    uint32_t ncounts = 0;
+    uint32_t nfolders = 0;
+    uint32_t nsenders = 0;
+    uint32_t nthreads = 0;
+    uint32_t subjectlen = 0;
+    uint32_t senderslen = 0;
+    uint32_t num32 = 0;
+    uint32_t i;
+    int r;
+
+    conv = conversation_new(state);
+
+    r = _unpack64(&c, &modseq);
+    if (!r) r = _unpack32(&c, &conv->num_records);
+    if (!r) r = _unpack32(&c, &conv->exists);
+    if (!r) r = _unpack32(&c, &conv->unseen);
+    if (!r) r = _unpack32(&c, &conv->size);
+    if (!r) r = _unpack32(&c, &ncounts);
+    if (!r) r = _unpack32(&c, &nfolders);
+    if (!r) r = _unpack32(&c, &nsenders);
+    if (!r) r = _unpack32(&c, &nthreads);
+    if (!r) r = _unpack32(&c, &subjectlen);
+    if (!r) r = _unpack32(&c, &senderslen);
+    if (r) goto err;
+    conv->modseq = modseq;
+
+    if ((wantfields & CONV_WANT_COUNTS) && state->counted_flags) {
+        for (i = 0; i < ncounts; i++) {
+            r = _unpack32(&c, &num32);
+            if (r) goto err;
+            /* any counts beyond the configured flags stay zero, just
+             * like a short COUNTS list in a version 0 record */
+            if (i < (uint32_t)state->counted_flags->count)
+                conv->counts[i] = num32;
+        }
+    }
+    else {
+        r = _unpack_skip(&c, (uint64_t)ncounts * 4);
+        if (r) goto err;
+    }
+
+    if (wantfields & CONV_WANT_FOLDERS) {
+        for (i = 0; i < nfolders; i++) {
+            bit64 fmodseq = 0;
+
+            r = _unpack32(&c, &num32);
+            if (r) goto err;
+            folder = conversation_get_folder(conv, num32, 1);
+            r = _unpack64(&c, &fmodseq);
+            if (!r) r = _unpack32(&c, &folder->num_records);
+            if (!r) r = _unpack32(&c, &folder->exists);
+            if (!r) r = _unpack32(&c, &folder->unseen);
+            if (r) goto err;
+            folder->modseq = fmodseq;
+            folder->prev_exists = folder->exists;
+        }
+    }
+    else {
+        r = _unpack_skip(&c, (uint64_t)nfolders * 24);
+        if (r) goto err;
+    }
+
+    if (subjectlen != UINT32_MAX) {
+        if (wantfields & CONV_WANT_SUBJECT) {
+            if ((size_t)(c.end - c.base) < subjectlen) {
+                r = IMAP_MAILBOX_BADFORMAT;
+                goto err;
+            }
+            conv->subject = xstrndup(c.base, subjectlen);
+            c.base += subjectlen;
+        }
+        else {
+            r = _unpack_skip(&c, subjectlen);
+            if (r) goto err;
+        }
+    }
+
+    if (wantfields & CONV_WANT_SENDERS) {
+        conv_sender_t **tailp = &conv->senders;
+        for (i = 0; i < nsenders; i++) {
+            /* stored in list order, so just rebuild the list */
+            conv_sender_t *sender = xzmalloc(sizeof(conv_sender_t));
+            *tailp = sender;
+            tailp = &sender->next;
+            r = _unpack_string(&c, &sender->name);
+            if (!r) r = _unpack_string(&c, &sender->route);
+            if (!r) r = _unpack_string(&c, &sender->mailbox);
+            if (!r) r = _unpack_string(&c, &sender->domain);
+            if (!r) {
+                r = _unpack32(&c, &num32);
+                sender->lastseen = num32;
+            }
+            if (!r) r = _unpack32(&c, &sender->exists);
+            if (r) goto err;
+        }
+    }
+    else {
+        r = _unpack_skip(&c, senderslen);
+        if (r) goto err;
+    }
+
+    if (wantfields & CONV_WANT_THREAD) {
+        conv_thread_t **tailp = &conv->thread;
+        for (i = 0; i < nthreads; i++) {
+            conv_thread_t *thread = xzmalloc(sizeof(conv_thread_t));
+            *tailp = thread;
+            tailp = &thread->next;
+            if ((size_t)(c.end - c.base) < MESSAGE_GUID_SIZE) {
+                r = IMAP_MAILBOX_BADFORMAT;
+                goto err;
+            }
+            message_guid_import(&thread->guid, c.base);
+            c.base += MESSAGE_GUID_SIZE;
+            r = _unpack32(&c, &num32);
+            thread->exists = num32;
+            if (!r) {
+                r = _unpack32(&c, &num32);
+                thread->internaldate = num32;
+            }
+            if (!r) {
+                r = _unpack32(&c, &num32);
+                thread->msgid = num32;
+            }
+            if (!r) {
+                r = _unpack32(&c, &num32);
+                thread->inreplyto = num32;
+            }
+            if (r) goto err;
+        }
+    }
+
+    conv->prev_unseen = conv->unseen;
+    conv->wantfields = wantfields;
+    conv->dirty = 0;
+    *convp = conv;
+    return 0;
+
+err:
+    conversation_free(conv);
+    return r;
+}
+
+static int _conversation_parse(struct conversations_state *state,
+                               const char *data, size_t datalen,
+                               conversation_t **convp, unsigned wantfields)
+{
+    const char *rest;
+    size_t restlen;
+    bit64 version;
+    int r;
+
+    *convp = NULL;
+
+    r = parsenum(data, &rest, datalen, &version);
+    if (r) return IMAP_MAILBOX_BADFORMAT;
+
+    if (rest[0] != ' ') return IMAP_MAILBOX_BADFORMAT;
+    rest++; /* skip space */
+    restlen = datalen - (rest - data);
+
+    if (version == CONVERSATIONS_VERSION)
+        return _conversation_parse_packed(state, rest, restlen, convp,
+                                          wantfields);
+
+    if (version != 0) return IMAP_MAILBOX_BADFORMAT;
+
+    return _conversation_parse_v0(state, rest, restlen, convp);
+}
+
+EXPORTED int conversation_parse(struct conversations_state *state,
+                       const char *data, size_t datalen,
+                       conversation_t **convp)
+{
+    return _conversation_parse(state, data, datalen, convp, CONV_WANT_ALL);
+}
+
+EXPORTED int conversation_load_advanced(struct conversations_state *state,
+                                        conversation_id_t cid,
+                                        conversation_t **convp,
+                                        unsigned wantfields)
 {
     const char *data;
     size_t datalen;
     char bkey[CONVERSATION_ID_STRMAX+2];
+    struct xstats_timer timer;
     int r;
 
     snprintf(bkey, sizeof(bkey), "B" CONV_FMT, cid);
+    xstats_timer_start(&timer);
     r = cyrusdb_fetch(state->db,
                   bkey, strlen(bkey),
                   &data, &datalen,
                   &state->txn);
+    xstats_timer_end(&timer, CONV_DB_FETCH);
 
     if (r == CYRUSDB_NOTFOUND) {
         *convp = NULL;
@@ -1226,25 +1585,36 @@ EXPORTED int conversation_load(struct conversations_state *state,
     }
     xstats_inc(CONV_LOAD);
 
-    r = conversation_parse(state, data, datalen, convp);
+    r = _conversation_parse(state, data, datalen, convp, wantfields);
     if (r) {
         syslog(LOG_ERR, "IOERROR: conversations invalid conversation "
                CONV_FMT, cid);
         *convp = NULL;
     }
 
-    if (_sanity_check_counts(*convp)) {
-        syslog(LOG_ERR, "IOERROR: conversations_audit on load: %s %s %.*s",
-               state->path, bkey, (int)datalen, data);
+    /* the audit needs the folder counts, so it can only run on a
+     * fully decoded conversation */
+    if (*convp && (*convp)->wantfields == CONV_WANT_ALL &&
+        _sanity_check_counts(*convp)) {
+        syslog(LOG_ERR, "IOERROR: conversations_audit on load: %s %s",
+               state->path, bkey);
     }
 
     return 0;
 }
 
+EXPORTED int conversation_load(struct conversations_state *state,
+                      conversation_id_t cid,
+                      conversation_t **convp)
+{
+    return conversation_load_advanced(state, cid, convp, CONV_WANT_ALL);
+}
+
 /* Parse just enough of the B record to retrieve the modseq.
  * Fortunately the modseq is the first field after the record version
- * number, given the way that _conversation_save() and dlist works.  See
- * _conversation_load() for the full shebang. */
+ * number in both formats: a fixed offset in a packed record, and the
+ * first number in a version 0 dlist.  See _conversation_parse() for
+ * the full shebang. */
 static int _conversation_load_modseq(const char *data, int datalen,
                                      modseq_t *modseqp)
 {
@@ -1254,7 +1624,16 @@ static int _conversation_load_modseq(const char *data, int datalen,
     int r;
 
     r = parsenum(p, &p, (end-p), &version);
-    if (r || version != CONVERSATIONS_VERSION)
+    if (r) return IMAP_MAILBOX_BADFORMAT;
+
+    if (version == CONVERSATIONS_VERSION) {
+        if ((end - p) < 9 || p[0] != ' ')
+            return IMAP_MAILBOX_BADFORMAT;
+        *modseqp = align_ntohll(p+1);
+        return 0;
+    }
+
+    if (version != 0)
         return IMAP_MAILBOX_BADFORMAT;
 
     if ((end - p) < 4 || p[0] != ' ' || p[1] != '(')
@@ -1600,6 +1979,7 @@ struct guid_foreach_rock {
     struct conversations_state *state;
     int(*cb)(const conv_guidrec_t *, void *);
     void *cbrock;
+    const char *guidrep;
 };
 
 static int _guid_one(const char *s, struct guid_foreach_rock *frock, conversation_id_t cid)
@@ -1611,6 +1991,9 @@ static int _guid_one(const char *s, struct guid_foreach_rock *frock, conversatio
     p = strchr(s, ':');
     if (!p) return IMAP_INTERNAL;
 
+    /* guid we were looking up */
+    rec.guidrep = frock->guidrep;
+
     /* cid */
     rec.cid = cid;
 
@@ -1693,6 +2076,7 @@ EXPORTED int conversations_guid_foreach(struct conversations_state *state,
     rock.state = state;
     rock.cb = cb;
     rock.cbrock = cbrock;
+    rock.guidrep = guidrep;
 
     char *key = strconcat("G", guidrep, (char *)NULL);
     int r = cyrusdb_foreach(state->db, key, strlen(key), NULL, _guid_cb, &rock, NULL);
@@ -1701,6 +2085,51 @@ EXPORTED int conversations_guid_foreach(struct conversations_state *state,
     return r;
 }
 
+EXPORTED int conversations_guid_foreach_batch(struct conversations_state *state,
+                                              const strarray_t *guidreps,
+                                              int(*cb)(const conv_guidrec_t *, void *),
+                                              void *cbrock)
+{
+    struct guid_foreach_rock rock;
+    struct buf key = BUF_INITIALIZER;
+    strarray_t *sorted;
+    int i;
+    int r = 0;
+
+    if (!guidreps->count) return 0;
+
+    rock.state = state;
+    rock.cb = cb;
+    rock.cbrock = cbrock;
+
+    /* visit the G records in key order, so each prefix scan descends
+     * into pages the scan before it has already touched */
+    sorted = strarray_dup(guidreps);
+    strarray_sort(sorted, cmpstringp_raw);
+
+    for (i = 0; i < sorted->count; i++) {
+        const char *guidrep = strarray_nth(sorted, i);
+
+        /* only look up duplicates once */
+        if (i && !strcmp(guidrep, strarray_nth(sorted, i-1)))
+            continue;
+
+        buf_setcstr(&key, "G");
+        buf_appendcstr(&key, guidrep);
+        rock.guidrep = guidrep;
+        r = cyrusdb_foreach(state->db, key.s, key.len, NULL,
+                            _guid_cb, &rock, NULL);
+        /* CYRUSDB_DONE just means the callback is finished with this
+         * guid; carry on with the rest of the batch */
+        if (r == CYRUSDB_DONE) r = 0;
+        if (r) break;
+    }
+
+    buf_free(&key);
+    strarray_free(sorted);
+    return r;
+}
+
 static int _getcid(const conv_guidrec_t *rec, void *rock)
 {
     conversation_id_t *cidp = (conversation_id_t *)rock;
@@ -2075,6 +2504,7 @@ EXPORTED conversation_t *conversation_new(struct conversations_state *state)
     conv = xzmalloc(sizeof(conversation_t));
     if (state->counted_flags)
         conv->counts = xzmalloc(sizeof(uint32_t) * state->counted_flags->count);
+    conv->wantfields = CONV_WANT_ALL;
     conv->dirty = 1;
     xstats_inc(CONV_NEW);
 
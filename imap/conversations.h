@@ -109,6 +109,8 @@ struct conv_folder {
 };
 
 struct conv_guidrec {
+    const char      *guidrep;   /* the guid (or prefix) this record
+                                 * was looked up by */
     const char      *mboxname;
     uint32_t        uid;
     const char      *part;
@@ -144,9 +146,21 @@ struct conversation {
     conv_sender_t   *senders;
     conv_thread_t   *thread;
     char            *subject;
+    unsigned        wantfields;
     int             dirty;
 };
 
+/* Which sections of a B record to decode.  The scalar counters
+ * (modseq, num_records, exists, unseen, size) are always decoded. */
+#define CONV_WANT_COUNTS        (1<<0)  /* per-flag counted_flags counts */
+#define CONV_WANT_FOLDERS       (1<<1)
+#define CONV_WANT_SENDERS       (1<<2)
+#define CONV_WANT_SUBJECT       (1<<3)
+#define CONV_WANT_THREAD        (1<<4)
+#define CONV_WANT_ALL           (CONV_WANT_COUNTS|CONV_WANT_FOLDERS|\
+                                 CONV_WANT_SENDERS|CONV_WANT_SUBJECT|\
+                                 CONV_WANT_THREAD)
+
 #include "mailbox.h"
 
 /* Sets the suffix used for conversations db filenames.  Only needed
@@ -190,6 +204,15 @@ extern int conversations_guid_foreach(struct conversations_state *state,
                                       const char *guidrep,
                                       int(*cb)(const conv_guidrec_t*,void*),
                                       void *rock);
+/* Look up many guids (or prefixes) in one pass, visiting their G
+ * records in key order so each scan descends into pages the previous
+ * one already touched.  Duplicates are looked up once.  The callback
+ * demultiplexes on rec->guidrep; returning CYRUSDB_DONE skips the
+ * rest of that guid's records, any other nonzero aborts the batch. */
+extern int conversations_guid_foreach_batch(struct conversations_state *state,
+                                            const strarray_t *guidreps,
+                                            int(*cb)(const conv_guidrec_t*,void*),
+                                            void *rock);
 extern conversation_id_t conversations_guid_cid_lookup(struct conversations_state *state,
                                                        const char *guidrep);
 
@@ -216,6 +239,13 @@ extern int conversation_save(struct conversations_state *state,
 extern int conversation_load(struct conversations_state *state,
                              conversation_id_t cid,
                              conversation_t **convp);
+/* Like conversation_load(), but only decodes the CONV_WANT_* sections
+ * named in 'wantfields'.  A partially decoded conversation is read-only
+ * and must never be passed to conversation_save(). */
+extern int conversation_load_advanced(struct conversations_state *state,
+                                      conversation_id_t cid,
+                                      conversation_t **convp,
+                                      unsigned wantfields);
 extern int conversation_parse(struct conversations_state *state,
                               const char *data, size_t datalen,
                               conversation_t **convp);
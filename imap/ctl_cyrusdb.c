@@ -75,6 +75,7 @@
 #include "duplicate.h"
 #include "global.h"
 #include "exitcodes.h"
+#include "index.h"
 #include "libcyr_cfg.h"
 #include "mboxlist.h"
 #include "seen.h"
@@ -122,6 +123,8 @@ static void usage(void)
 {
     fprintf(stderr, "ctl_cyrusdb [-C <altconfig>] -c\n");
     fprintf(stderr, "ctl_cyrusdb [-C <altconfig>] -r [-x]\n");
+    fprintf(stderr, "ctl_cyrusdb [-C <altconfig>] -d <interval>\n");
+    fprintf(stderr, "ctl_cyrusdb [-C <altconfig>] -w\n");
     exit(-1);
 }
 
@@ -257,13 +260,145 @@ static void check_convert(struct cyrusdb *db, const char *fname)
         syslog(LOG_NOTICE, "conversion failed %s", fname);
 }
 
+/* watch the configured databases and checkpoint any that have grown
+ * enough, so the workers never have to do recovery or compaction work
+ * inline.  Runs until killed (i.e. forever, under master). */
+static void daemon_mode(int interval)
+{
+    size_t lastsize[N(dblist)];
+    struct stat sbuf;
+    struct db *db = NULL;
+    const char *fname;
+    int i, r;
+
+    memset(lastsize, 0, sizeof(lastsize));
+
+    for (;;) {
+        for (i = 0; dblist[i].name; i++) {
+            fname = dbfname(&dblist[i]);
+
+            if (stat(fname, &sbuf) < 0) continue;
+
+            /* take a baseline the first time we see the file */
+            if (!lastsize[i]) {
+                lastsize[i] = sbuf.st_size;
+                continue;
+            }
+
+            /* mirror the backends' own repack policy: only checkpoint
+             * once the file has doubled, and never bother while it's
+             * small enough that a rewrite is cheap anyway */
+            if (sbuf.st_size < 65536) continue;
+            if ((size_t)sbuf.st_size < 2 * lastsize[i]) continue;
+
+            /* opening the database also runs any pending recovery,
+             * taking that work off the hot path too */
+            r = cyrusdb_open(*dblist[i].configptr, fname, 0, &db);
+            if (r) {
+                syslog(LOG_ERR, "DBERROR: opening %s for checkpoint: %s",
+                       fname, cyrusdb_strerror(r));
+                continue;
+            }
+
+            r = cyrusdb_repack(db);
+            if (r)
+                syslog(LOG_ERR, "DBERROR: repacking %s: %s",
+                       fname, cyrusdb_strerror(r));
+            else
+                syslog(LOG_INFO, "checkpointed %s", fname);
+
+            cyrusdb_close(db);
+            db = NULL;
+
+            if (stat(fname, &sbuf) >= 0)
+                lastsize[i] = sbuf.st_size;
+        }
+
+        sleep(interval);
+    }
+}
+
+/* Callback for warmup_mode: adjacent statuscache keys for the same
+ * mailbox only differ by userid, so a one-entry memory deduplicates */
+static int warmup_cb(void *rock, const char *key, size_t keylen,
+                     const char *data __attribute__((unused)),
+                     size_t datalen __attribute__((unused)))
+{
+    struct buf *lastname = (struct buf *) rock;
+    const char *p = memchr(key, '%', keylen);
+    mbentry_t *mbentry = NULL;
+    char *mboxname;
+    int r;
+
+    if (!p) return 0;
+    mboxname = xstrndup(key, p - key);
+
+    if (!strcmp(buf_cstring(lastname), mboxname)) {
+        free(mboxname);
+        return 0;
+    }
+    buf_setcstr(lastname, mboxname);
+
+    r = mboxlist_lookup(mboxname, &mbentry, NULL);
+    if (!r)
+        index_warmup(mbentry, WARMUP_INDEX | WARMUP_ANNOTATIONS, NULL);
+
+    mboxlist_entry_free(&mbentry);
+    free(mboxname);
+
+    /* warmup is purely advisory, ignore errors */
+    return 0;
+}
+
+/* Warm the page cache before the services accept traffic: pull the
+ * configured databases in, then issue readahead for the index and
+ * annotation files of the mailboxes that were recently active
+ * according to statuscache.  Meant to run from the START section of
+ * cyrus.conf, where cold caches after a reboot hurt the most. */
+static void warmup_mode(void)
+{
+    struct buf lastname = BUF_INITIALIZER;
+    struct db *db = NULL;
+    const char *fname;
+    int i, r;
+
+    for (i = 0; dblist[i].name; i++)
+        warmup_file(dbfname(&dblist[i]), 0, 0);
+
+    /* statuscache holds an entry per recently-STATUSed mailbox, which
+     * makes it a handy list of the mailboxes clients are most likely
+     * to open first */
+    if (!config_getswitch(IMAPOPT_STATUSCACHE)) return;
+
+    for (i = 0; dblist[i].name; i++) {
+        if (!strcmp(dblist[i].name, FNAME_STATUSCACHEDB)) break;
+    }
+    if (!dblist[i].name) return;
+
+    fname = dbfname(&dblist[i]);
+    r = cyrusdb_open(*dblist[i].configptr, fname, 0, &db);
+    if (r) return;      /* may simply not exist yet */
+
+    mboxlist_init(0);
+    mboxlist_open(NULL);
+
+    cyrusdb_foreach(db, "", 0, NULL, warmup_cb, &lastname, NULL);
+
+    mboxlist_close();
+    mboxlist_done();
+
+    cyrusdb_close(db);
+    buf_free(&lastname);
+}
+
 int main(int argc, char *argv[])
 {
     extern char *optarg;
     int opt, r, r2;
     char *alt_config = NULL;
     int reserve_flag = 1;
-    enum { RECOVER, CHECKPOINT, NONE } op = NONE;
+    int daemon_interval = 0;
+    enum { RECOVER, CHECKPOINT, DAEMON, WARMUP, NONE } op = NONE;
     char *dirname = NULL, *backup1 = NULL, *backup2 = NULL;
     strarray_t files = STRARRAY_INITIALIZER;
     char *msg = "";
@@ -274,7 +409,7 @@ int main(int argc, char *argv[])
     }
     r = r2 = 0;
 
-    while ((opt = getopt(argc, argv, "C:rxc")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:rxcwd:")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -293,6 +428,20 @@ int main(int argc, char *argv[])
             else usage();
             break;
 
+        case 'd':
+            daemon_interval = atoi(optarg);
+            if (daemon_interval <= 0) usage();
+            msg = "checkpointing cyrus databases continuously";
+            if (op == NONE) op = DAEMON;
+            else usage();
+            break;
+
+        case 'w':
+            msg = "warming cyrus databases";
+            if (op == NONE) op = WARMUP;
+            else usage();
+            break;
+
         case 'x':
             reserve_flag = 0;
             break;
@@ -320,6 +469,23 @@ int main(int argc, char *argv[])
 
     syslog(LOG_NOTICE, "%s", msg);
 
+    if (op == DAEMON) {
+        /* never returns */
+        daemon_mode(daemon_interval);
+    }
+
+    if (op == WARMUP) {
+        warmup_mode();
+
+        free(dirname);
+        free(backup1);
+        free(backup2);
+        cyrus_done();
+
+        syslog(LOG_NOTICE, "done %s", msg);
+        exit(0);
+    }
+
     /* detect backends */
     for (i = 0; dblist[i].name != NULL; i++)
         dblist[i].archiver = cyrusdb_getarchiver(*dblist[i].configptr);
@@ -62,6 +62,7 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/wait.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -78,6 +79,8 @@
 #include "libcyr_cfg.h"
 #include "mboxlist.h"
 #include "mupdate.h"
+#include "prot.h"
+#include "strhash.h"
 #include "util.h"
 #include "xmalloc.h"
 #include "xstrlcpy.h"
@@ -97,12 +100,23 @@ enum mboxop { DUMP,
               VERIFY,
               NONE };
 
+/* first line of a binary dump file */
+#define BINARY_DUMP_HEADER "CYRUS-MBOXLIST-DUMP 1"
+
 struct dumprock {
     enum mboxop op;
 
     const char *partition;
     int purge;
 
+    /* dump output and format */
+    FILE *out;
+    struct protstream *pout;    /* non-NULL for binary dumps */
+
+    /* parallel dumps: this worker's slice of the key space */
+    int nworkers;
+    int worker;
+
     mupdate_handle *h;
 };
 
@@ -177,10 +191,26 @@ static int dump_cb(const mbentry_t *mbentry, void *rockp)
 
     switch (d->op) {
     case DUMP:
+        /* parallel dump: only our slice of the key space */
+        if (d->nworkers > 1 &&
+            (int)(strhash(mbentry->name) % d->nworkers) != d->worker)
+            break;
         if (!d->partition || !strcmpsafe(d->partition, mbentry->partition)) {
-            printf("%s\t%d ", mbentry->name, mbentry->mbtype);
-            if (mbentry->server) printf("%s!", mbentry->server);
-            printf("%s %s\n", mbentry->partition, mbentry->acl);
+            if (d->pout) {
+                /* binary: the database entry itself, no text conversion
+                 * and no fields dropped */
+                struct dlist *dl = mboxlist_entry_dlist(mbentry);
+                if (mbentry->mtime)
+                    dlist_updatedate(dl, "M", mbentry->mtime);
+                dlist_printbin(dl, 1, d->pout);
+                prot_puts(d->pout, "\r\n");
+                dlist_free(&dl);
+            }
+            else {
+                fprintf(d->out, "%s\t%d ", mbentry->name, mbentry->mbtype);
+                if (mbentry->server) fprintf(d->out, "%s!", mbentry->server);
+                fprintf(d->out, "%s %s\n", mbentry->partition, mbentry->acl);
+            }
             if (d->purge) {
                 mboxlist_delete(mbentry->name);
             }
@@ -406,7 +436,96 @@ static int yes(void)
  *    mupdate.
  */
 
-static void do_dump(enum mboxop op, const char *part, int purge)
+/*
+ * Fork 'nworkers' children; each reopens the mailboxes db (so no file
+ * descriptors or locks are shared with the parent), runs 'proc' for its
+ * worker number, and exits.  Any worker failing fails the whole run.
+ */
+static void run_workers(int nworkers, const char *mboxdb_fname,
+                        void (*proc)(int worker, void *rock), void *rock)
+{
+    pid_t *pids = xmalloc(nworkers * sizeof(pid_t));
+    int i, status;
+    int nfailed = 0;
+
+    for (i = 0; i < nworkers; i++) {
+        pids[i] = fork();
+        if (pids[i] < 0) fatal("can't fork worker", EC_OSERR);
+        if (!pids[i]) {
+            mboxlist_close();
+            mboxlist_open(mboxdb_fname);
+            proc(i, rock);
+            mboxlist_close();
+            _exit(0);
+        }
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        if (waitpid(pids[i], &status, 0) < 0 ||
+            !WIFEXITED(status) || WEXITSTATUS(status))
+            nfailed++;
+    }
+    free(pids);
+
+    if (nfailed) {
+        fprintf(stderr, "%d of %d workers failed\n", nfailed, nworkers);
+        exit(1);
+    }
+}
+
+/* open this worker's output file and dump its slice of the key space */
+static void dump_slice(struct dumprock *d, const char *outfile, int binary)
+{
+    struct buf fname = BUF_INITIALIZER;
+
+    d->out = stdout;
+    d->pout = NULL;
+
+    if (outfile) {
+        if (d->nworkers > 1)
+            buf_printf(&fname, "%s.%d", outfile, d->worker);
+        else
+            buf_setcstr(&fname, outfile);
+        d->out = fopen(buf_cstring(&fname), "w");
+        if (!d->out) {
+            fprintf(stderr, "can't create %s\n", buf_cstring(&fname));
+            exit(1);
+        }
+    }
+
+    if (binary) {
+        d->pout = prot_new(fileno(d->out), /*write*/1);
+        prot_puts(d->pout, BINARY_DUMP_HEADER "\r\n");
+    }
+
+    mboxlist_allmbox("", &dump_cb, d, /*incdel*/1);
+
+    if (d->pout) {
+        prot_flush(d->pout);
+        prot_free(d->pout);
+        d->pout = NULL;
+    }
+    if (d->out != stdout) fclose(d->out);
+    buf_free(&fname);
+}
+
+struct dump_worker_rock {
+    struct dumprock *d;
+    const char *outfile;
+    int binary;
+};
+
+static void dump_worker(int worker, void *rock)
+{
+    struct dump_worker_rock *wr = (struct dump_worker_rock *) rock;
+
+    wr->d->worker = worker;
+    dump_slice(wr->d, wr->outfile, wr->binary);
+}
+
+static void do_dump(enum mboxop op, const char *part, int purge,
+                    const char *mboxdb_fname, const char *outfile,
+                    int binary, int nworkers)
 {
     struct dumprock d;
     int ret;
@@ -419,6 +538,10 @@ static void do_dump(enum mboxop op, const char *part, int purge)
     d.op = op;
     d.partition = part;
     d.purge = purge;
+    d.out = stdout;
+    d.pout = NULL;
+    d.nworkers = nworkers;
+    d.worker = 0;
 
     if (op == M_POPULATE) {
         ret = mupdate_connect(NULL, NULL, &(d.h), NULL);
@@ -460,7 +583,16 @@ static void do_dump(enum mboxop op, const char *part, int purge)
     }
 
     /* Dump Database */
-    mboxlist_allmbox("", &dump_cb, &d, /*incdel*/1);
+    if (op == DUMP && nworkers > 1) {
+        struct dump_worker_rock wr = { &d, outfile, binary };
+        run_workers(nworkers, mboxdb_fname, dump_worker, &wr);
+    }
+    else if (op == DUMP) {
+        dump_slice(&d, outfile, binary);
+    }
+    else {
+        mboxlist_allmbox("", &dump_cb, &d, /*incdel*/1);
+    }
 
     if (op == M_POPULATE) {
         /* Remove MBTYPE_MOVING flags (unflag_head) */
@@ -549,7 +681,59 @@ static void do_dump(enum mboxop op, const char *part, int purge)
     return;
 }
 
-static void do_undump(void)
+/*
+ * Load records from a binary dump stream: one binary dlist per record,
+ * CRLF terminated, exactly the database form - so nothing is lost in a
+ * text conversion and nothing needs quoting.
+ */
+static int undump_binary(struct protstream *pin, const char *src)
+{
+    struct buf entry = BUF_INITIALIZER;
+    unsigned long record = 1;
+    int r = 0;
+    int c;
+
+    for (;;) {
+        struct dlist *dl = NULL;
+        mbentry_t *newmbentry = NULL;
+
+        c = prot_getc(pin);
+        if (c == EOF) break;        /* clean end of dump */
+        prot_ungetc(c, pin);
+
+        c = dlist_parsebin(&dl, /*parsekey*/1, pin, NULL);
+        if (!dl || c != '\r' || prot_getc(pin) != '\n') {
+            fprintf(stderr, "%s: truncated or corrupt record %lu\n",
+                    src, record);
+            dlist_free(&dl);
+            r = IMAP_IOERROR;
+            break;
+        }
+
+        /* render the value in database form and hand it to the
+         * canonical parser */
+        buf_reset(&entry);
+        dlist_printbuf(dl, 0, &entry);
+        r = mboxlist_parse_entry(&newmbentry, dl->name, strlen(dl->name),
+                                 buf_base(&entry), buf_len(&entry));
+        if (!r) r = mboxlist_update(newmbentry, /*localonly*/1);
+
+        mboxlist_entry_free(&newmbentry);
+        dlist_free(&dl);
+
+        if (r) {
+            fprintf(stderr, "%s: failed to load record %lu: %s\n",
+                    src, record, error_message(r));
+            break;
+        }
+        record++;
+    }
+
+    buf_free(&entry);
+    return r;
+}
+
+static int undump_text(FILE *in)
 {
     int r = 0;
     char buf[16384];
@@ -558,7 +742,7 @@ static void do_undump(void)
     int mbtype;
     char *p;
 
-    while (fgets(buf, sizeof(buf), stdin)) {
+    while (fgets(buf, sizeof(buf), in)) {
         mbentry_t *newmbentry = NULL;
         const char *server = NULL;
 
@@ -621,7 +805,76 @@ static void do_undump(void)
         if (r) break;
     }
 
-    return;
+    return r;
+}
+
+/* open this worker's input file and load everything in it */
+static void undump_slice(const char *infile, int binary,
+                         int nworkers, int worker)
+{
+    struct buf fname = BUF_INITIALIZER;
+    const char *src = "<stdin>";
+    FILE *in = stdin;
+    int r;
+
+    if (infile) {
+        if (nworkers > 1)
+            buf_printf(&fname, "%s.%d", infile, worker);
+        else
+            buf_setcstr(&fname, infile);
+        src = buf_cstring(&fname);
+        in = fopen(src, "r");
+        if (!in) {
+            fprintf(stderr, "can't open %s\n", src);
+            exit(1);
+        }
+    }
+
+    if (binary) {
+        struct protstream *pin = prot_new(fileno(in), /*write*/0);
+        char hdr[64];
+
+        if (!prot_fgets(hdr, sizeof(hdr), pin) ||
+            strncmp(hdr, BINARY_DUMP_HEADER, strlen(BINARY_DUMP_HEADER))) {
+            fprintf(stderr, "%s: not a binary mboxlist dump\n", src);
+            exit(1);
+        }
+        r = undump_binary(pin, src);
+        prot_free(pin);
+    }
+    else {
+        r = undump_text(in);
+    }
+
+    if (in != stdin) fclose(in);
+    buf_free(&fname);
+
+    if (r) exit(1);
+}
+
+struct undump_worker_rock {
+    const char *infile;
+    int binary;
+    int nworkers;
+};
+
+static void undump_worker(int worker, void *rock)
+{
+    struct undump_worker_rock *wr = (struct undump_worker_rock *) rock;
+
+    undump_slice(wr->infile, wr->binary, wr->nworkers, worker);
+}
+
+static void do_undump(const char *mboxdb_fname, const char *infile,
+                      int binary, int nworkers)
+{
+    if (nworkers > 1) {
+        struct undump_worker_rock wr = { infile, binary, nworkers };
+        run_workers(nworkers, mboxdb_fname, undump_worker, &wr);
+    }
+    else {
+        undump_slice(infile, binary, /*nworkers*/1, /*worker*/0);
+    }
 }
 
 enum {
@@ -874,10 +1127,12 @@ static void usage(void)
 {
     fprintf(stderr, "DUMP:\n");
     fprintf(stderr, "  ctl_mboxlist [-C <alt_config>] -d [-x] [-p partition] [-f filename]\n");
+    fprintf(stderr, "               [-B] [-o outfile [-j nworkers]]\n");
     fprintf(stderr, "UNDUMP:\n");
     fprintf(stderr,
             "  ctl_mboxlist [-C <alt_config>] -u [-f filename]"
             "    [< mboxlist.dump]\n");
+    fprintf(stderr, "               [-B] [-o infile [-j nworkers]]\n");
     fprintf(stderr, "MUPDATE populate:\n");
     fprintf(stderr, "  ctl_mboxlist [-C <alt_config>] -m [-a] [-w] [-i] [-f filename]\n");
     fprintf(stderr, "VERIFY:\n");
@@ -889,6 +1144,9 @@ int main(int argc, char *argv[])
 {
     const char *partition = NULL;
     char *mboxdb_fname = NULL;
+    const char *outfile = NULL;
+    int binary = 0;
+    int nworkers = 1;
     int dopurge = 0;
     int opt;
     enum mboxop op = NONE;
@@ -898,7 +1156,7 @@ int main(int argc, char *argv[])
         fatal("must run as the Cyrus user", EC_USAGE);
     }
 
-    while ((opt = getopt(argc, argv, "C:awmdurcxf:p:vi")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:awmdurcxf:p:viBj:o:")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -972,6 +1230,19 @@ int main(int argc, char *argv[])
             interactive = 1;
             break;
 
+        case 'B':
+            binary = 1;
+            break;
+
+        case 'j':
+            nworkers = atoi(optarg);
+            if (nworkers < 1) usage();
+            break;
+
+        case 'o':
+            outfile = optarg;
+            break;
+
         default:
             usage();
             break;
@@ -981,6 +1252,11 @@ int main(int argc, char *argv[])
     if (op != M_POPULATE && (local_authoritative || warn_only)) usage();
     if (op != DUMP && partition) usage();
     if (op != DUMP && dopurge) usage();
+    if ((binary || outfile || nworkers > 1) && op != DUMP && op != UNDUMP)
+        usage();
+    /* workers need per-worker files, and mustn't write the db they scan */
+    if (nworkers > 1 && !outfile) usage();
+    if (nworkers > 1 && dopurge) usage();
 
     if (op == RECOVER) {
         syslog(LOG_NOTICE, "running mboxlist recovery");
@@ -1016,7 +1292,8 @@ int main(int argc, char *argv[])
         annotate_init(NULL, NULL);
         annotatemore_open();
 
-        do_dump(op, partition, dopurge);
+        do_dump(op, partition, dopurge, mboxdb_fname, outfile,
+                binary, nworkers);
 
         annotatemore_close();
         annotate_done();
@@ -1043,7 +1320,7 @@ int main(int argc, char *argv[])
         annotate_init(NULL, NULL);
         annotatemore_open();
 
-        do_undump();
+        do_undump(mboxdb_fname, outfile, binary, nworkers);
 
         annotatemore_close();
         annotate_done();
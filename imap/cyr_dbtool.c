@@ -141,7 +141,7 @@ static int aprinter_cb(void *rock,
     return 0;
 }
 
-static void batch_commands(struct db *db)
+static void batch_commands(struct db *db, int commit_interval, int verbose)
 {
     struct buf cmd = BUF_INITIALIZER;
     struct buf key = BUF_INITIALIZER;
@@ -150,6 +150,11 @@ static void batch_commands(struct db *db)
     struct txn **tidp = NULL;
     struct protstream *in = prot_new(0, 0); // stdin
     struct protstream *out = prot_new(1, 1); // stdout
+    time_t start = time(NULL);
+    unsigned long long nchanges = 0;
+    unsigned long long ncommits = 0;
+    int auto_txn = 0;       /* our transaction, not the stream's */
+    int pending = 0;        /* changes since the last commit */
     int line = 0;
     int c = '-';
     int r = 0;
@@ -169,8 +174,18 @@ static void batch_commands(struct db *db)
             /* got a command! */
             if (!strcmp(cmd.s, "BEGIN")) {
                 if (tidp) {
-                    r = IMAP_MAILBOX_LOCKED;
-                    goto done;
+                    if (!auto_txn) {
+                        r = IMAP_MAILBOX_LOCKED;
+                        goto done;
+                    }
+                    /* close out the automatic transaction; the stream
+                     * is taking over transaction control */
+                    r = cyrusdb_commit(db, tid);
+                    tid = NULL;
+                    if (r) goto done;
+                    ncommits++;
+                    auto_txn = 0;
+                    pending = 0;
                 }
                 tidp = &tid;
             }
@@ -180,8 +195,14 @@ static void batch_commands(struct db *db)
                 prot_flush(out);
             }
             else if (!strcmp(cmd.s, "SET")) {
+                if (commit_interval && !tidp) {
+                    tidp = &tid;
+                    auto_txn = 1;
+                }
                 r = cyrusdb_store(db, key.s, key.len, val.s, val.len, tidp);
                 if (r) goto done;
+                nchanges++;
+                pending++;
             }
             else if (!strcmp(cmd.s, "GET")) {
                 const char *res;
@@ -192,8 +213,14 @@ static void batch_commands(struct db *db)
                 prot_flush(out);
             }
             else if (!strcmp(cmd.s, "DELETE")) {
+                if (commit_interval && !tidp) {
+                    tidp = &tid;
+                    auto_txn = 1;
+                }
                 r = cyrusdb_delete(db, key.s, key.len, tidp, 1);
                 if (r) goto done;
+                nchanges++;
+                pending++;
             }
             else if (!strcmp(cmd.s, "COMMIT")) {
                 if (!tidp) {
@@ -204,6 +231,9 @@ static void batch_commands(struct db *db)
                 if (r) goto done;
                 tid = NULL;
                 tidp = NULL;
+                ncommits++;
+                auto_txn = 0;
+                pending = 0;
             }
             else if (!strcmp(cmd.s, "ABORT")) {
                 if (!tidp) {
@@ -214,12 +244,30 @@ static void batch_commands(struct db *db)
                 if (r) goto done;
                 tid = NULL;
                 tidp = NULL;
+                auto_txn = 0;
+                pending = 0;
             }
             else {
                 r = IMAP_MAILBOX_NONEXISTENT;
                 goto done;
             }
         }
+
+        /* checkpoint the automatic transaction at the commit interval */
+        if (auto_txn && pending >= commit_interval) {
+            r = cyrusdb_commit(db, tid);
+            tid = NULL;
+            if (r) goto done;
+            tidp = NULL;
+            auto_txn = 0;
+            pending = 0;
+            ncommits++;
+            if (verbose)
+                fprintf(stderr, "%llu changes in %llu transactions (%lus)\n",
+                        nchanges, ncommits,
+                        (unsigned long)(time(NULL) - start));
+        }
+
         if (c != '\n') break;
     }
 
@@ -229,6 +277,19 @@ done:
         fprintf(stderr, "FAILED: line %d at cmd %.*s with error %s\n",
                 line, (int)cmd.len, cmd.s, error_message(r));
     }
+    else if (auto_txn && tid) {
+        /* final partial batch */
+        r = cyrusdb_commit(db, tid);
+        if (r)
+            fprintf(stderr, "FAILED: final commit with error %s\n",
+                    error_message(r));
+        else
+            ncommits++;
+    }
+
+    if (verbose)
+        fprintf(stderr, "done: %llu changes in %llu transactions (%lus)\n",
+                nchanges, ncommits, (unsigned long)(time(NULL) - start));
 }
 
 int main(int argc, char *argv[])
@@ -247,10 +308,12 @@ int main(int argc, char *argv[])
     int is_delete = 0;
     int use_stdin = 0;
     int db_flags = 0;
+    int batch_interval = 0;
+    int verbose = 0;
     struct txn *tid = NULL;
     struct txn **tidp = NULL;
 
-    while ((opt = getopt(argc, argv, "C:MntTc")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:Mni:tTvc")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -258,6 +321,13 @@ int main(int argc, char *argv[])
         case 'c':
             db_flags |= CYRUSDB_CONVERT;
             break;
+        case 'i': /* batch mode: commit every <n> changes */
+            batch_interval = atoi(optarg);
+            if (batch_interval < 0) batch_interval = 0;
+            break;
+        case 'v':
+            verbose++;
+            break;
         case 'M': /* use "improved_mboxlist_sort" */
             db_flags |= CYRUSDB_MBOXSORT;
             break;
@@ -300,6 +370,8 @@ int main(int argc, char *argv[])
         fprintf(stderr, "* batch - read from stdin and execute commands\n");
         fprintf(stderr, "You may omit key or key/value and specify one per line on stdin\n");
         fprintf(stderr, "keys are terminated by tab or newline, values are terminated by newline\n");
+        fprintf(stderr, "In batch mode, -i <n> commits automatically every <n> changes\n");
+        fprintf(stderr, "(for bulk imports) and -v reports progress on stderr\n");
         exit(-1);
     }
 
@@ -352,7 +424,7 @@ int main(int argc, char *argv[])
           }
         }
     } else if (!strcmp(action, "batch")) {
-        batch_commands(db);
+        batch_commands(db, batch_interval, verbose);
     } else if (!strcmp(action, "show")) {
         if ((argc - optind) < 4) {
             cyrusdb_foreach(db, "", 0, NULL, printer_cb, NULL, tidp);
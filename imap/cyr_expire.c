@@ -56,6 +56,7 @@
 #include <sasl/sasl.h>
 
 #include "annotate.h"
+#include "bsearch.h"
 #include "duplicate.h"
 #include "exitcodes.h"
 #include "global.h"
@@ -64,6 +65,7 @@
 #include "mboxevent.h"
 #include "mboxlist.h"
 #include "conversations.h"
+#include "sync_log.h"
 #include "util.h"
 #include "xmalloc.h"
 #include "strarray.h"
@@ -82,7 +84,7 @@ static struct namespace expire_namespace;
 static void usage(void)
 {
     fprintf(stderr,
-            "cyr_expire [-C <altconfig>] [-E <expire-duration>] [-D <delete-duration] [-X <expunge-duration>] [-p prefix] [-a] [-v] [-x]\n");
+            "cyr_expire [-C <altconfig>] [-E <expire-duration>] [-D <delete-duration] [-X <expunge-duration>] [-I <channel>] [-p prefix] [-a] [-v] [-x] [-R]\n");
     exit(-1);
 }
 
@@ -97,6 +99,7 @@ struct expire_rock {
     int skip_annotate;
     bit32 userflags[MAX_USER_FLAGS/32];
     int do_userflags;
+    int do_repack;
     unsigned long userflags_expunged;
 };
 
@@ -113,6 +116,60 @@ struct delete_rock {
     strarray_t to_delete;
 };
 
+static int addmbox_cb(const mbentry_t *mbentry, void *rock)
+{
+    strarray_t *list = (strarray_t *) rock;
+    strarray_add(list, mbentry->name);
+    return 0;
+}
+
+/*
+ * Read candidate mailbox names for incremental mode from a sync log
+ * channel: anything with delivery or expunge activity since the last
+ * run logged an APPEND or MAILBOX entry there.  The reader's
+ * rename-to-work-file is our persistent cursor - entries stay in the
+ * work file until sync_log_reader_end(), so a run that dies partway
+ * leaves everything unprocessed for the next run to pick up.
+ */
+static strarray_t *read_incremental_candidates(sync_log_reader_t *slr)
+{
+    const char *args[3];
+    strarray_t *cands = strarray_new();
+
+    while (sync_log_reader_getitem(slr, args) == 0) {
+        if (!strcmp(args[0], "APPEND") || !strcmp(args[0], "MAILBOX"))
+            strarray_add(cands, args[1]);
+        else if (!strcmp(args[0], "USER"))
+            mboxlist_usermboxtree(args[1], addmbox_cb, cands, MBOXTREE_DELETED);
+    }
+
+    /* sort for locality of reference across the passes */
+    strarray_sort(cands, cmpstringp_raw);
+
+    return cands;
+}
+
+/* run one pass over the incremental candidate list */
+static void run_candidates(const strarray_t *cands,
+                           int (*proc)(const mbentry_t *, void *),
+                           void *rock)
+{
+    int i;
+
+    for (i = 0; i < cands->count; i++) {
+        mbentry_t *mbentry = NULL;
+        int stop;
+
+        /* skip anything deleted since it was logged */
+        if (mboxlist_lookup_allow_all(strarray_nth(cands, i), &mbentry, NULL))
+            continue;
+
+        stop = proc(mbentry, rock);
+        mboxlist_entry_free(&mbentry);
+        if (stop) break;
+    }
+}
+
 /*
  * Parse a non-negative duration string as seconds.
  *
@@ -365,6 +422,16 @@ static int expire(const mbentry_t *mbentry, void *rock)
         syslog(LOG_WARNING, "failure expiring %s: %s", mbentry->name, error_message(r));
         annotate_state_abort(&mailbox->annot_state);
     }
+    else if (erock->do_repack && numexpunged) {
+        /* compact the index/cache in the same pass rather than leaving
+         * the tombstones for an opportunistic repack at some later close */
+        if (verbose)
+            fprintf(stderr, "repacking %s\n", mbentry->name);
+        r = mailbox_repack(mailbox);
+        if (r)
+            syslog(LOG_WARNING, "failure repacking %s: %s",
+                   mbentry->name, error_message(r));
+    }
 
 done:
     mailbox_close(&mailbox);
@@ -466,6 +533,9 @@ int main(int argc, char *argv[])
     char *alt_config = NULL;
     const char *find_prefix = NULL;
     const char *do_user = NULL;
+    const char *incremental_channel = NULL;
+    sync_log_reader_t *slr = NULL;
+    strarray_t *candidates = NULL;
     struct expire_rock erock;
     struct delete_rock drock;
     struct conversations_rock crock;
@@ -483,7 +553,7 @@ int main(int argc, char *argv[])
     memset(&crock, 0, sizeof(crock));
     construct_hash_table(&crock.seen, 100, 1);
 
-    while ((opt = getopt(argc, argv, "C:D:E:X:A:p:u:vaxtcFS:")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:D:E:X:A:I:p:u:vaxtcFRS:")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -513,6 +583,12 @@ int main(int argc, char *argv[])
             keep_flagged = 0;
             break;
 
+        case 'I':
+            /* incremental: only visit mailboxes logged to this
+             * sync log channel since the last run */
+            incremental_channel = optarg;
+            break;
+
         case 'p':
             find_prefix = optarg;
             break;
@@ -538,6 +614,10 @@ int main(int argc, char *argv[])
             erock.do_userflags = 1;
             break;
 
+        case 'R':
+            erock.do_repack = 1;
+            break;
+
         case 'c':
             if (!do_cid_expire) usage();
             do_cid_expire = 0;
@@ -556,6 +636,10 @@ int main(int argc, char *argv[])
         !erock.do_userflags)
         usage();
 
+    /* incremental mode is already a mailbox selection */
+    if (incremental_channel && (find_prefix || do_user))
+        usage();
+
     sigemptyset(&action.sa_mask);
     action.sa_flags = 0;
     action.sa_handler = sighandler;
@@ -599,10 +683,35 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    if (incremental_channel) {
+        slr = sync_log_reader_create_with_channel(incremental_channel);
+        r = sync_log_reader_begin(slr);
+        if (r == IMAP_AGAIN) {
+            /* nothing has been logged since the last run */
+            r = 0;
+            candidates = strarray_new();
+        }
+        else if (r) {
+            syslog(LOG_ERR, "cyr_expire: failed to read sync log channel %s: %s",
+                   incremental_channel, error_message(r));
+            goto finish;
+        }
+        else {
+            candidates = read_incremental_candidates(slr);
+            if (verbose)
+                fprintf(stderr, "Incremental run over %d logged mailboxes\n",
+                        candidates->count);
+        }
+        /* the work file must survive until every pass is done, so
+         * sync_log_reader_end() only happens at finish */
+    }
+
     if (archive_seconds >= 0) {
         time_t archive_mark = time(0) - archive_seconds;
         /* XXX - add syslog? */
-        if (do_user)
+        if (incremental_channel)
+            run_candidates(candidates, archive, &archive_mark);
+        else if (do_user)
             mboxlist_usermboxtree(do_user, archive, &archive_mark, MBOXTREE_DELETED);
         else
             mboxlist_allmbox(find_prefix, archive, &archive_mark, 0);
@@ -627,7 +736,9 @@ int main(int argc, char *argv[])
             }
         }
 
-        if (do_user)
+        if (incremental_channel)
+            run_candidates(candidates, expire, &erock);
+        else if (do_user)
             mboxlist_usermboxtree(do_user, expire, &erock, MBOXTREE_DELETED);
         else
             mboxlist_allmbox(find_prefix, expire, &erock, 0);
@@ -666,7 +777,9 @@ int main(int argc, char *argv[])
                     "Removing conversation entries older than %0.2f days\n",
                     (double)(cid_expire_seconds/86400));
 
-        if (do_user)
+        if (incremental_channel)
+            run_candidates(candidates, expire_conversations, &crock);
+        else if (do_user)
             mboxlist_usermboxtree(do_user, expire_conversations, &crock, MBOXTREE_DELETED);
         else
             mboxlist_allmbox(find_prefix, expire_conversations, &crock, 0);
@@ -701,7 +814,9 @@ int main(int argc, char *argv[])
 
         drock.delete_mark = time(0) - delete_seconds;
 
-        if (do_user)
+        if (incremental_channel)
+            run_candidates(candidates, delete, &drock);
+        else if (do_user)
             mboxlist_usermboxtree(do_user, delete, &drock, MBOXTREE_DELETED);
         else
             mboxlist_allmbox(find_prefix, delete, &drock, 0);
@@ -737,6 +852,15 @@ int main(int argc, char *argv[])
         r = duplicate_prune(expire_seconds, &erock.table);
 
 finish:
+    if (slr) {
+        /* if the run completed, unlink the work file and so advance
+         * the cursor past everything we just processed; if we were
+         * interrupted, leave it for the next run to reprocess */
+        if (!sigquit) sync_log_reader_end(slr);
+        sync_log_reader_free(slr);
+    }
+    strarray_free(candidates);
+
     free_hash_table(&erock.table, free);
     free_hash_table(&crock.seen, NULL);
     strarray_fini(&drock.to_delete);
@@ -45,11 +45,14 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <fcntl.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 
 #include "global.h"
 #include "exitcodes.h"
@@ -81,6 +84,7 @@ static void usage(void)
     fprintf(stderr, "  * conf-default  - listing of all default config values\n");
     fprintf(stderr, "  * conf-lint     - unknown config keys\n");
     fprintf(stderr, "  * proc          - listing of all open processes\n");
+    fprintf(stderr, "  * master-stats  - per-service resource usage from master\n");
     cyrus_done();
     exit(-1);
 }
@@ -104,6 +108,38 @@ static void do_proc(void)
     proc_foreach(print_procinfo, NULL);
 }
 
+static void do_masterstats(void)
+{
+    struct sockaddr_un srvaddr;
+    char buf[4096];
+    int s;
+    ssize_t n;
+
+    memset(&srvaddr, 0, sizeof(srvaddr));
+    srvaddr.sun_family = AF_UNIX;
+    strlcpy(srvaddr.sun_path, config_dir, sizeof(srvaddr.sun_path));
+    strlcat(srvaddr.sun_path, FNAME_MASTER_STATS_SOCK,
+            sizeof(srvaddr.sun_path));
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1) {
+        perror("socket");
+        return;
+    }
+
+    if (connect(s, (struct sockaddr *)&srvaddr, sizeof(srvaddr)) == -1) {
+        fprintf(stderr, "can't connect to %s (is master running?): %s\n",
+                srvaddr.sun_path, strerror(errno));
+        close(s);
+        return;
+    }
+
+    while ((n = read(s, buf, sizeof(buf))) > 0)
+        fwrite(buf, 1, n, stdout);
+
+    close(s);
+}
+
 static void print_overflow(const char *key, const char *val,
                           void *rock __attribute__((unused)))
 {
@@ -384,6 +420,8 @@ int main(int argc, char *argv[])
 
     if (!strcmp(argv[optind], "proc"))
         do_proc();
+    else if (!strcmp(argv[optind], "master-stats"))
+        do_masterstats();
     else if (!strcmp(argv[optind], "conf-all"))
         do_conf(0);
     else if (!strcmp(argv[optind], "conf"))
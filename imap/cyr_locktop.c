@@ -0,0 +1,181 @@
+/* cyr_locktop.c -- report lock contention statistics
+ *
+ * Copyright (c) 1994-2016 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <config.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "exitcodes.h"
+#include "global.h"
+#include "lockstat.h"
+#include "util.h"
+
+extern int optind;
+extern char *optarg;
+
+/* forward declarations */
+static void usage(void);
+static int slot_cmp(const void *pa, const void *pb);
+static void print_slot(const struct lockstat_slot *slot, int verbose);
+
+int main(int argc, char *argv[])
+{
+    const struct lockstat_map *map;
+    const struct lockstat_slot *slots[LOCKSTAT_NSLOTS];
+    unsigned i, n = 0;
+    int opt;
+    char *alt_config = NULL;
+    int verbose = 0;
+
+    if ((geteuid()) == 0 && (become_cyrus(/*is_master*/0) != 0)) {
+        fatal("must run as the Cyrus user", EC_USAGE);
+    }
+
+    while ((opt = getopt(argc, argv, "C:v")) != EOF) {
+        switch (opt) {
+        case 'C': /* alt config file */
+            alt_config = optarg;
+            break;
+
+        case 'v': /* wait histograms and current holders */
+            verbose = 1;
+            break;
+
+        default:
+            usage();
+        }
+    }
+
+    cyrus_init(alt_config, "cyr_locktop", 0, 0);
+
+    map = lockstat_map_readonly();
+    if (!map) {
+        fprintf(stderr, "cyr_locktop: no lock statistics found "
+                "(is lock_profiling enabled?)\n");
+        cyrus_done();
+        exit(EC_UNAVAILABLE);
+    }
+
+    for (i = 0; i < map->nslots; i++) {
+        if (map->slots[i].class[0])
+            slots[n++] = &map->slots[i];
+    }
+    qsort(slots, n, sizeof(slots[0]), slot_cmp);
+
+    printf("%-24s %10s %10s %10s %9s %10s %8s\n", "Lock class",
+           "Acquires", "Contended", "Failures", "Avg(us)", "Max(us)",
+           "Holders");
+    for (i = 0; i < n; i++) {
+        print_slot(slots[i], verbose);
+    }
+
+    cyrus_done();
+
+    exit(0);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: cyr_locktop [-C <alt_config>] [-v]\n");
+    exit(EC_USAGE);
+}
+
+/* busiest classes first */
+static int slot_cmp(const void *pa, const void *pb)
+{
+    const struct lockstat_slot *a = *(const struct lockstat_slot **) pa;
+    const struct lockstat_slot *b = *(const struct lockstat_slot **) pb;
+
+    if (a->wait_usec != b->wait_usec)
+        return (a->wait_usec < b->wait_usec) ? 1 : -1;
+    return strcmp(a->class, b->class);
+}
+
+static void print_slot(const struct lockstat_slot *slot, int verbose)
+{
+    unsigned holders = 0;
+    int i;
+
+    for (i = 0; i < LOCKSTAT_NHOLDERS; i++) {
+        if (slot->holders[i].pid) holders++;
+    }
+
+    printf("%-24s %10llu %10llu %10llu %9.1f %10llu %8u\n",
+           slot->class,
+           (unsigned long long) slot->acquisitions,
+           (unsigned long long) slot->contended,
+           (unsigned long long) slot->failures,
+           slot->acquisitions ?
+               (double) slot->wait_usec / slot->acquisitions : 0.0,
+           (unsigned long long) slot->max_wait_usec,
+           holders);
+
+    if (!verbose) return;
+
+    for (i = 0; i < LOCKSTAT_NBUCKETS; i++) {
+        if (!slot->hist[i]) continue;
+        printf("    waited ~%lluus: %llu\n",
+               (unsigned long long) 1 << i,
+               (unsigned long long) slot->hist[i]);
+    }
+
+    for (i = 0; i < LOCKSTAT_NHOLDERS; i++) {
+        const struct lockstat_holder *h = &slot->holders[i];
+        char timebuf[32];
+        time_t since;
+
+        if (!h->pid) continue;
+        since = (time_t) h->since;
+        strftime(timebuf, sizeof(timebuf), "%H:%M:%S", localtime(&since));
+        printf("    held %s by pid %u since %s\n",
+               h->exclusive ? "exclusively" : "shared", (unsigned) h->pid,
+               timebuf);
+    }
+}
@@ -0,0 +1,168 @@
+/* cyr_provision.c -- offline pre-provisioning of autocreate mailboxes
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "annotate.h"
+#include "autocreate.h"
+#include "exitcodes.h"
+#include "global.h"
+#include "mboxlist.h"
+#include "mboxname.h"
+#include "quota.h"
+#include "util.h"
+
+/* current namespace */
+static struct namespace provision_namespace;
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "cyr_provision [-C <altconfig>] [-f <file>] [userid ...]\n"
+            "\n"
+            "Create the autocreate folder template for each named user\n"
+            "ahead of their first login.  With -f, userids are read one\n"
+            "per line from <file> ('-' means stdin) in addition to any\n"
+            "given on the command line.\n");
+    exit(EC_USAGE);
+}
+
+static int provision_one(const char *userid)
+{
+    int r = autocreate_user(&provision_namespace, userid);
+
+    if (r) {
+        fprintf(stderr, "cyr_provision: %s: %s\n", userid, error_message(r));
+        return 1;
+    }
+
+    printf("provisioned %s\n", userid);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    extern char *optarg;
+    int opt, i, r;
+    char *alt_config = NULL;
+    const char *fname = NULL;
+    int nfail = 0;
+
+    if ((geteuid()) == 0 && (become_cyrus(/*is_master*/0) != 0)) {
+        fatal("must run as the Cyrus user", EC_USAGE);
+    }
+
+    while ((opt = getopt(argc, argv, "C:f:")) != EOF) {
+        switch (opt) {
+        case 'C': /* alt config file */
+            alt_config = optarg;
+            break;
+
+        case 'f': /* file of userids, one per line */
+            fname = optarg;
+            break;
+
+        default:
+            usage();
+            break;
+        }
+    }
+
+    if (!fname && optind == argc) usage();
+
+    cyrus_init(alt_config, "cyr_provision", 0, CONFIG_NEED_PARTITION_DATA);
+
+    if ((r = mboxname_init_namespace(&provision_namespace, /*isadmin*/1))) {
+        fatal(error_message(r), EC_CONFIG);
+    }
+
+    mboxlist_init(0);
+    mboxlist_open(NULL);
+
+    quotadb_init(0);
+    quotadb_open(NULL);
+
+    annotate_init(NULL, NULL);
+    annotatemore_open();
+
+    for (i = optind; i < argc; i++) {
+        nfail += provision_one(argv[i]);
+    }
+
+    if (fname) {
+        FILE *f = strcmp(fname, "-") ? fopen(fname, "r") : stdin;
+        char buf[1024];
+
+        if (!f) {
+            fprintf(stderr, "cyr_provision: can't open %s\n", fname);
+            nfail++;
+        }
+        else {
+            while (fgets(buf, sizeof(buf), f)) {
+                buf[strcspn(buf, " \t\r\n")] = '\0';
+                if (!buf[0]) continue;
+                nfail += provision_one(buf);
+            }
+            if (f != stdin) fclose(f);
+        }
+    }
+
+    annotatemore_close();
+    annotate_done();
+
+    quotadb_close();
+    quotadb_done();
+
+    mboxlist_close();
+    mboxlist_done();
+
+    cyrus_done();
+
+    return nfail ? EC_TEMPFAIL : EC_OK;
+}
@@ -71,6 +71,7 @@ static void usage(const char *name)
     fprintf(stderr, " - compress             => dump a compressed list\n");
     fprintf(stderr, " - ismember [num...]    => is num in the list for each num\n");
     fprintf(stderr, " - members              => all list members in order\n");
+    fprintf(stderr, " - ranges               => all list runs as low:high, in order\n");
     fprintf(stderr, " - create [-s] [items]  => generate a new list from the items\n");
     fprintf(stderr, "                           - prefix numbers with '~' for remove\n");
     exit(-1);
@@ -161,6 +162,14 @@ int main(int argc, char *argv[])
             printf("%u\n", num);
         }
     }
+    else if (!strcmp(argv[optind], "ranges")) {
+        size_t iter = 0;
+        unsigned low, high;
+        seq = seqset_parse(argv[optind+1], NULL, maxval);
+        while (seqset_getrange(seq, &iter, &low, &high)) {
+            printf("%u:%u\n", low, high);
+        }
+    }
     else if (!strcmp(argv[optind], "join")) {
         struct seqset *seq2;
         seq = seqset_parse(argv[optind+1], NULL, maxval);
@@ -48,15 +48,21 @@
 #include <stdio.h>
 #include <syslog.h>
 #include <string.h>
+#include <fcntl.h>
 
 /* cyrus includes */
 #include "assert.h"
 #include "exitcodes.h"
 #include "global.h"
+#include "imapparse.h"
 #include "index.h"
 #include "imapurl.h"
 #include "mailbox.h"
+#include "mbdump.h"
 #include "mboxlist.h"
+#include "prot.h"
+#include "quota.h"
+#include "sync_log.h"
 #include "util.h"
 #include "xmalloc.h"
 #include "xstrlcpy.h"
@@ -64,9 +70,17 @@
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
 
+/* binary archive framing: a header line, then for each mailbox a
+ * "MAILBOX <name>" line followed by the index+cache+spool stream that
+ * dump_mailbox()/undump_mailbox() already speak for XFER */
+#define ARCHIVE_HEADER "CYRUS-MAILBOX-ARCHIVE 1"
+
 static int verbose = 0;
+static int compress = 0;
 
 static int dump_me(struct findall_data *data, void *rock);
+static int archive_me(struct findall_data *data, void *rock);
+static int restore_archive(struct protstream *pin);
 static void print_seq(const char *tag, const char *attrib,
                       unsigned *seq, int n);
 static int usage(const char *name);
@@ -79,14 +93,17 @@ int main(int argc, char *argv[])
 {
     int option;
     int i;
+    int r = 0;
     char *alt_config = NULL;
+    const char *archive_file = NULL;
+    int do_restore = 0;
     struct incremental_record irec;
 
     if ((geteuid()) == 0 && (become_cyrus(/*is_master*/0) != 0)) {
         fatal("must run as the Cyrus user", EC_USAGE);
     }
 
-    while ((option = getopt(argc, argv, "vC:")) != EOF) {
+    while ((option = getopt(argc, argv, "vC:A:u:z")) != EOF) {
         switch (option) {
         case 'v':
             verbose++;
@@ -96,13 +113,34 @@ int main(int argc, char *argv[])
             alt_config = optarg;
             break;
 
+        case 'A': /* write binary archive */
+            archive_file = optarg;
+            break;
+
+        case 'u': /* restore binary archive */
+            archive_file = optarg;
+            do_restore = 1;
+            break;
+
+        case 'z':
+            compress = 1;
+            break;
+
         default:
             usage(argv[0]);
             break;
         }
     }
 
-    if (optind == argc) {
+#ifndef HAVE_ZLIB
+    if (compress) {
+        fprintf(stderr, "%s: not built with zlib support\n", argv[0]);
+        exit(EC_USAGE);
+    }
+#endif
+
+    /* restore reads the mailbox list from the archive itself */
+    if (!do_restore && optind == argc) {
         usage(argv[0]);
     }
 
@@ -110,31 +148,215 @@ int main(int argc, char *argv[])
     mboxlist_init(0);
     mboxlist_open(NULL);
 
-    irec.incruid = 0;
-    strarray_t *array = strarray_new();
-    for (i = optind; i < argc; i++) {
-        strarray_append(array, argv[i]);
+    /* the mailbox streams carry quota information */
+    quotadb_init(0);
+    quotadb_open(NULL);
+
+    sync_log_init();
+
+    if (do_restore) {
+        int fd = 0;   /* stdin */
+        struct protstream *pin;
+        char buf[1024];
+
+        if (strcmp(archive_file, "-")) {
+            fd = open(archive_file, O_RDONLY);
+            if (fd == -1) {
+                fprintf(stderr, "can't open %s: %s\n",
+                        archive_file, strerror(errno));
+                exit(EC_NOINPUT);
+            }
+        }
+        pin = prot_new(fd, 0);
+
+        if (!prot_fgets(buf, sizeof(buf), pin) ||
+            strncmp(buf, ARCHIVE_HEADER, strlen(ARCHIVE_HEADER))) {
+            fprintf(stderr, "%s: not a mailbox archive\n", archive_file);
+            exit(EC_DATAERR);
+        }
+#ifdef HAVE_ZLIB
+        if (compress) prot_setcompress(pin);
+#endif
+
+        r = restore_archive(pin);
+
+        prot_free(pin);
+        if (fd) close(fd);
+    }
+    else {
+        struct protstream *pout = NULL;
+        int fd = 1;   /* stdout */
+
+        if (archive_file) {
+            if (strcmp(archive_file, "-")) {
+                fd = open(archive_file, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+                if (fd == -1) {
+                    fprintf(stderr, "can't create %s: %s\n",
+                            archive_file, strerror(errno));
+                    exit(EC_CANTCREAT);
+                }
+            }
+            pout = prot_new(fd, 1);
+            prot_puts(pout, ARCHIVE_HEADER "\r\n");
+#ifdef HAVE_ZLIB
+            if (compress) prot_setcompress(pout);
+#endif
+        }
+
+        irec.incruid = 0;
+        strarray_t *array = strarray_new();
+        for (i = optind; i < argc; i++) {
+            strarray_append(array, argv[i]);
+        }
+        if (array->count) {
+            if (pout)
+                r = mboxlist_findallmulti(NULL, array, 1, 0, 0,
+                                          archive_me, pout);
+            else
+                r = mboxlist_findallmulti(NULL, array, 1, 0, 0,
+                                          dump_me, &irec);
+        }
+
+        strarray_free(array);
+
+        if (pout) {
+            prot_flush(pout);
+            prot_free(pout);
+            if (fd != 1) close(fd);
+        }
     }
-    if (array->count)
-        mboxlist_findallmulti(NULL, array, 1, 0, 0, dump_me, &irec);
 
-    strarray_free(array);
+    sync_log_done();
+
+    quotadb_close();
+    quotadb_done();
 
     mboxlist_close();
     mboxlist_done();
 
     cyrus_done();
 
-    return 0;
+    return r ? 1 : 0;
 }
 
 static int usage(const char *name)
 {
-    fprintf(stderr, "usage: %s [-v] [mboxpattern ...]\n", name);
+    fprintf(stderr, "usage: %s [-v] [-A archive [-z]] [mboxpattern ...]\n", name);
+    fprintf(stderr, "       %s [-v] -u archive [-z]\n", name);
+    fprintf(stderr, "With no -A or -u, a text dump is written to stdout.\n");
+    fprintf(stderr, "-A writes a binary archive of the matching mailboxes\n");
+    fprintf(stderr, "   (index, cache and message data), -u restores one;\n");
+    fprintf(stderr, "   \"-\" means stdout/stdin, -z (de)compresses with zlib.\n");
 
     exit(EC_USAGE);
 }
 
+static int archive_me(struct findall_data *data, void *rock)
+{
+    struct protstream *pout = (struct protstream *)rock;
+    struct mailbox *mailbox = NULL;
+    struct protstream *pin;
+    int r;
+
+    if (!data) return 0;
+    const char *name = mbname_intname(data->mbname);
+
+    r = mailbox_open_irl(name, &mailbox);
+    if (r) {
+        fprintf(stderr, "error opening %s: %s\n", name, error_message(r));
+        return 0;
+    }
+
+    if (verbose) {
+        fprintf(stderr, "archiving %s\n", name);
+    }
+
+    prot_puts(pout, "MAILBOX ");
+    prot_printastring(pout, name);
+    prot_puts(pout, "\r\n");
+
+    /* dump_mailbox synchronizes on its first literal; feed it the
+     * continuation it is waiting for */
+    pin = prot_readmap("+ go\r\n", 6);
+    r = dump_mailbox(NULL, mailbox, 0, MAILBOX_MINOR_VERSION,
+                     pin, pout, NULL);
+    prot_free(pin);
+
+    mailbox_close(&mailbox);
+
+    if (r) {
+        fprintf(stderr, "error archiving %s: %s\n", name, error_message(r));
+    }
+
+    return r;
+}
+
+static int restore_archive(struct protstream *pin)
+{
+    struct buf sinkbuf = BUF_INITIALIZER;
+    /* continuation prompts for synchronized literals go nowhere */
+    struct protstream *pout = prot_writebuf(&sinkbuf);
+    static struct buf cmd, mboxname;
+    int r = 0;
+    int c;
+
+    for (;;) {
+        c = getword(pin, &cmd);
+        if (c == EOF && !cmd.s[0]) break;   /* clean end of archive */
+        if (strcmp(cmd.s, "MAILBOX") || c != ' ') {
+            r = IMAP_PROTOCOL_ERROR;
+            break;
+        }
+        c = getastring(pin, pout, &mboxname);
+        if (c == '\r') c = prot_getc(pin);
+        if (c != '\n') {
+            r = IMAP_PROTOCOL_ERROR;
+            break;
+        }
+
+        if (verbose) {
+            fprintf(stderr, "restoring %s\n", mboxname.s);
+        }
+
+        /* undump_mailbox needs the mailboxes db to know the name */
+        r = mboxlist_lookup(mboxname.s, NULL, NULL);
+        if (r == IMAP_MAILBOX_NONEXISTENT) {
+            r = mboxlist_createmailbox(mboxname.s, /*mbtype*/0,
+                                       /*partition*/NULL,
+                                       /*isadmin*/1, /*userid*/NULL,
+                                       /*auth_state*/NULL,
+                                       /*localonly*/0, /*forceuser*/1,
+                                       /*dbonly*/0, /*notify*/0,
+                                       /*mailboxptr*/NULL);
+        }
+        if (r) {
+            fprintf(stderr, "error creating %s: %s\n",
+                    mboxname.s, error_message(r));
+            break;
+        }
+
+        r = undump_mailbox(mboxname.s, pin, pout, NULL);
+        if (r) {
+            fprintf(stderr, "error restoring %s: %s\n",
+                    mboxname.s, error_message(r));
+            break;
+        }
+
+        /* eat the line end after the closing paren */
+        c = prot_getc(pin);
+        eatline(pin, c);
+    }
+
+    if (r == IMAP_PROTOCOL_ERROR) {
+        fprintf(stderr, "archive is truncated or corrupt\n");
+    }
+
+    prot_free(pout);
+    buf_free(&sinkbuf);
+
+    return r;
+}
+
 static void generate_boundary(char *boundary, size_t size)
 {
     assert(size >= 100);
@@ -82,8 +82,20 @@
     " comp_flags INTEGER,"                                              \
     " sched_tag TEXT,"                                                  \
     " alive INTEGER,"                                                   \
+    " expand_until TEXT,"                                               \
     " UNIQUE( mailbox, resource ) );"                                   \
-    "CREATE INDEX IF NOT EXISTS idx_ical_uid ON ical_objs ( ical_uid );"
+    "CREATE INDEX IF NOT EXISTS idx_ical_uid ON ical_objs ( ical_uid );" \
+    "CREATE INDEX IF NOT EXISTS idx_ical_span ON ical_objs ( mailbox, dtend, dtstart );" \
+    "CREATE INDEX IF NOT EXISTS idx_ical_modseq ON ical_objs ( mailbox, modseq );"
+
+#define CMD_CREATE_OCC                                                  \
+    "CREATE TABLE IF NOT EXISTS ical_occurs ("                          \
+    " rowid INTEGER PRIMARY KEY,"                                       \
+    " objid INTEGER,"                                                   \
+    " dtstart TEXT,"                                                    \
+    " dtend TEXT,"                                                      \
+    " FOREIGN KEY (objid) REFERENCES ical_objs (rowid) ON DELETE CASCADE );" \
+    "CREATE INDEX IF NOT EXISTS idx_ical_occur ON ical_occurs ( objid, dtend, dtstart );"
 
 #define CMD_CREATE_CARD                                                 \
     "CREATE TABLE IF NOT EXISTS vcard_objs ("                           \
@@ -103,10 +115,13 @@
     " fullname TEXT,"                                                   \
     " name TEXT,"                                                       \
     " nickname TEXT,"                                                   \
+    " email TEXT,"                                                      \
+    " phone TEXT,"                                                      \
     " alive INTEGER,"                                                   \
     " UNIQUE( mailbox, resource ) );"                                   \
     "CREATE INDEX IF NOT EXISTS idx_vcard_fn ON vcard_objs ( fullname );" \
-    "CREATE INDEX IF NOT EXISTS idx_vcard_uid ON vcard_objs ( vcard_uid );"
+    "CREATE INDEX IF NOT EXISTS idx_vcard_uid ON vcard_objs ( vcard_uid );" \
+    "CREATE INDEX IF NOT EXISTS idx_vcard_modseq ON vcard_objs ( mailbox, modseq );"
 
 #define CMD_CREATE_EM                                                   \
     "CREATE TABLE IF NOT EXISTS vcard_emails ("                         \
@@ -149,8 +164,8 @@
     "CREATE INDEX IF NOT EXISTS idx_res_uid ON dav_objs ( res_uid );"
 
 
-#define CMD_CREATE CMD_CREATE_CAL CMD_CREATE_CARD CMD_CREATE_EM CMD_CREATE_GR \
-                   CMD_CREATE_OBJS
+#define CMD_CREATE CMD_CREATE_CAL CMD_CREATE_OCC CMD_CREATE_CARD \
+                   CMD_CREATE_EM CMD_CREATE_GR CMD_CREATE_OBJS
 
 /* leaves these unused columns around, but that's life.  A dav_reconstruct
  * will fix them */
@@ -176,16 +191,44 @@
 
 #define CMD_DBUPGRADEv6 CMD_CREATE_OBJS
 
+/* existing rows get a NULL expansion horizon, so their occurrence
+ * caches are rebuilt on the next write of each resource */
+#define CMD_DBUPGRADEv7                                         \
+    "ALTER TABLE ical_objs ADD COLUMN expand_until TEXT;"       \
+    CMD_CREATE_OCC
+
+#define CMD_DBUPGRADEv8                                         \
+    "CREATE INDEX IF NOT EXISTS idx_ical_span"                  \
+    " ON ical_objs ( mailbox, dtend, dtstart );"
+
+/* Existing rows are left with NULL email/phone columns, which tells
+ * the addressbook-query filter to fall back to parsing the vCard;
+ * the columns are filled in whenever the card is next written */
+#define CMD_DBUPGRADEv9                                         \
+    "ALTER TABLE vcard_objs ADD COLUMN email TEXT;"             \
+    "ALTER TABLE vcard_objs ADD COLUMN phone TEXT;"
+
+/* modseq-ordered scans for the sync-collection REPORT */
+#define CMD_DBUPGRADEv10                                        \
+    "CREATE INDEX IF NOT EXISTS idx_ical_modseq"                \
+    " ON ical_objs ( mailbox, modseq );"                        \
+    "CREATE INDEX IF NOT EXISTS idx_vcard_modseq"               \
+    " ON vcard_objs ( mailbox, modseq );"
+
 struct sqldb_upgrade davdb_upgrade[] = {
   { 2, CMD_DBUPGRADEv2, NULL },
   { 3, CMD_DBUPGRADEv3, NULL },
   { 4, CMD_DBUPGRADEv4, NULL },
   { 5, CMD_DBUPGRADEv5, NULL },
   { 6, CMD_DBUPGRADEv6, NULL },
+  { 7, CMD_DBUPGRADEv7, NULL },
+  { 8, CMD_DBUPGRADEv8, NULL },
+  { 9, CMD_DBUPGRADEv9, NULL },
+  { 10, CMD_DBUPGRADEv10, NULL },
   { 0, NULL, NULL }
 };
 
-#define DB_VERSION 6
+#define DB_VERSION 10
 
 static int in_reconstruct = 0;
 
@@ -225,6 +225,13 @@ int dlist_parse_asatomlist(struct dlist **dlp, int parsekey,
 int dlist_parsemap(struct dlist **dlp, int parsekeys,
                    const char *base, unsigned len);
 
+/* length-prefixed binary encoding - same trees, no quoting or literal
+ * synchronisation (negotiated via the SYNC-BINARY sync capability) */
+void dlist_printbin(const struct dlist *dl, int printkeys,
+                    struct protstream *out);
+int dlist_parsebin(struct dlist **dlp, int parsekeys,
+                   struct protstream *in, const char *alt_reserve_base);
+
 typedef int dlistsax_cb_t(int type, struct dlistsax_data *data);
 
 int dlist_parsesax(const char *base, size_t len, int parsekey,
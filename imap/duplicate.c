@@ -46,6 +46,8 @@
 #include <string.h>
 #include <syslog.h>
 #include <ctype.h>
+#include <errno.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
@@ -68,9 +70,13 @@
 #endif
 
 #include "assert.h"
+#include "bloom.h"
+#include "cyr_lock.h"
+#include "hash.h"
 #include "xmalloc.h"
 #include "global.h"
 #include "exitcodes.h"
+#include "retry.h"
 #include "util.h"
 #include "cyrusdb.h"
 
@@ -86,6 +92,399 @@
 static struct db *dupdb = NULL;
 static int duplicate_dbopen = 0;
 
+/*
+ * Positive lookup cache (duplicate_cache).  Vacation tracking and
+ * sieve duplicate tests re-check the same keys on every message of a
+ * burst; marks are written through, so redeliveries hitting this
+ * process skip the db fetch entirely.  Entries are only trusted for
+ * DUPCACHE_TTL seconds, bounding how long a newer mark written by
+ * another process can go unseen.  Only positive answers are cached -
+ * the bloom filter already short-circuits misses.
+ */
+#define DUPCACHE_BUCKETS 64
+#define DUPCACHE_MAXENTRIES 1024
+#define DUPCACHE_TTL 60
+
+struct dupcache_entry {
+    time_t mark;
+    time_t stamp;       /* when this entry was cached */
+};
+
+static struct hash_table dupcache;
+static unsigned dupcache_nentries = 0;
+
+/* db keys have embedded NULs, so build a separate printable key */
+static void dupcache_key(struct buf *ckey, const duplicate_key_t *dkey)
+{
+    buf_reset(ckey);
+    buf_printf(ckey, "%s\037%s\037%s", dkey->id, dkey->to, dkey->date);
+}
+
+static struct dupcache_entry *dupcache_get(const char *ckey)
+{
+    struct dupcache_entry *ent;
+
+    if (!dupcache.size) return NULL;
+
+    ent = hash_lookup(ckey, &dupcache);
+    if (!ent) return NULL;
+    if (time(NULL) - ent->stamp >= DUPCACHE_TTL) return NULL;
+
+    return ent;
+}
+
+static void dupcache_put(const char *ckey, time_t mark)
+{
+    struct dupcache_entry *ent, *old;
+
+    if (!dupcache.size) {
+        construct_hash_table(&dupcache, DUPCACHE_BUCKETS, 0);
+    }
+    else if (dupcache_nentries >= DUPCACHE_MAXENTRIES) {
+        /* dump and rebuild rather than tracking LRU order */
+        free_hash_table(&dupcache, free);
+        construct_hash_table(&dupcache, DUPCACHE_BUCKETS, 0);
+        dupcache_nentries = 0;
+    }
+
+    ent = xmalloc(sizeof(struct dupcache_entry));
+    ent->mark = mark;
+    ent->stamp = time(NULL);
+
+    old = hash_insert(ckey, ent, &dupcache);
+    if (old == ent) dupcache_nentries++;
+    else free(old);
+}
+
+/*
+ * Optional time-partitioned segments (duplicate_db_segment_hours).
+ * Writes always go to the segment covering the current time, lookups
+ * walk the live segments newest first, and expiry in duplicate_prune()
+ * is whole-file deletion - no foreach over the full history, and no
+ * long-held lock while cyr_expire works.
+ */
+struct dupseg {
+    time_t bucket;              /* start time divided by segment width */
+    char *path;
+    struct db *db;
+    struct dupseg *next;        /* newest first */
+};
+
+static int dupseg_width = 0;    /* segment width in seconds, 0 = one db */
+static char *dupseg_base = NULL;
+static struct dupseg *dupsegs = NULL;
+
+static struct dupseg *dupseg_open(time_t bucket, int create)
+{
+    struct dupseg *seg, **tail = &dupsegs;
+    struct buf path = BUF_INITIALIZER;
+    struct db *db = NULL;
+    int r;
+
+    for (seg = dupsegs; seg; seg = seg->next) {
+        if (seg->bucket == bucket) return seg;
+        if (seg->bucket < bucket) break;
+        tail = &seg->next;
+    }
+
+    buf_printf(&path, "%s.%llu", dupseg_base, (unsigned long long) bucket);
+    r = cyrusdb_open(DB, buf_cstring(&path), create ? CYRUSDB_CREATE : 0, &db);
+    if (r) {
+        if (create) {
+            syslog(LOG_ERR, "DBERROR: opening %s: %s", buf_cstring(&path),
+                   cyrusdb_strerror(r));
+        }
+        buf_free(&path);
+        return NULL;
+    }
+
+    seg = xzmalloc(sizeof(struct dupseg));
+    seg->bucket = bucket;
+    seg->path = buf_release(&path);
+    seg->db = db;
+    seg->next = *tail;
+    *tail = seg;
+
+    return seg;
+}
+
+static void dupseg_close(struct dupseg **prevp)
+{
+    struct dupseg *seg = *prevp;
+
+    *prevp = seg->next;
+    if (seg->db) cyrusdb_close(seg->db);
+    free(seg->path);
+    free(seg);
+}
+
+/* pick up the segments already on disk */
+static void dupseg_scan(void)
+{
+    char *dirpath = xstrdup(dupseg_base);
+    char *slash = strrchr(dirpath, '/');
+    const char *base = dupseg_base;
+    size_t baselen;
+    DIR *dirp;
+    struct dirent *dirent;
+
+    if (slash) {
+        *slash = '\0';
+        base = slash + 1;
+    }
+    else {
+        free(dirpath);
+        dirpath = xstrdup(".");
+    }
+    baselen = strlen(base);
+
+    dirp = opendir(dirpath);
+    if (dirp) {
+        while ((dirent = readdir(dirp)) != NULL) {
+            const char *name = dirent->d_name;
+            char *end = NULL;
+            unsigned long long bucket;
+
+            if (strncmp(name, base, baselen)) continue;
+            if (name[baselen] != '.') continue;
+            bucket = strtoull(name + baselen + 1, &end, 10);
+            if (!end || *end || end == name + baselen + 1) continue;
+            dupseg_open((time_t) bucket, 0);
+        }
+        closedir(dirp);
+    }
+
+    free(dirpath);
+}
+
+/* the segment new entries belong in, created on first use; on
+ * rollover, drop handles whose files cyr_expire has removed */
+static struct dupseg *dupseg_current(void)
+{
+    time_t bucket = time(NULL) / dupseg_width;
+
+    if (!dupsegs || dupsegs->bucket != bucket) {
+        struct dupseg **prevp = &dupsegs;
+        struct stat sbuf;
+
+        while (*prevp) {
+            if (stat((*prevp)->path, &sbuf) < 0)
+                dupseg_close(prevp);
+            else
+                prevp = &(*prevp)->next;
+        }
+    }
+
+    return dupseg_open(bucket, 1);
+}
+
+/* negative cache over the database keys - in our workload the vast
+ * majority of duplicate_check calls are misses, so a bloom filter
+ * answers them without touching the db at all.  False positives just
+ * fall through to the real fetch.
+ *
+ * The db is written concurrently by every lmtpd, so a private
+ * per-process filter would miss sibling marks and return false
+ * negatives - exactly the cross-process redeliveries this db exists
+ * to suppress.  Instead the filter lives in a file beside the db
+ * which every process maps MAP_SHARED and ORs its own marks into, so
+ * an add by one process is immediately visible to all of them (the
+ * same scheme the mupdate name filter uses).  A periodic rebuild only
+ * exists to shed keys removed by duplicate_prune(); while a rebuild
+ * is seeding, the filter is flagged not ready and checks fall back to
+ * the db. */
+#define DUPBLOOM_ENTRIES   (1024*1024)
+#define DUPBLOOM_ERROR     0.01
+#define DUPBLOOM_LIFETIME  3600  /* seconds before a rebuild */
+#define DUPBLOOM_RECHECK   60    /* seconds between file re-stats */
+#define DUPBLOOM_MAGIC     0x44555042  /* "DUPB" */
+#define DUPBLOOM_VERSION   1
+
+struct dupbloom_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entries;
+    uint32_t bytes;
+    uint32_t ready;     /* seeding finished; misses can be trusted */
+    uint32_t pad;
+    uint64_t built;
+};
+
+static struct bloom dupbloom_params;    /* supplies parameters only */
+static char *dupbloom_fname = NULL;
+static unsigned char *dupbloom_map = NULL;
+static size_t dupbloom_maplen = 0;
+static ino_t dupbloom_ino = 0;
+static time_t dupbloom_checked = 0;
+
+#define dupbloom_hdr() ((struct dupbloom_header *) dupbloom_map)
+#define dupbloom_bits() (dupbloom_map + sizeof(struct dupbloom_header))
+
+static void dupbloom_unmap(void)
+{
+    if (dupbloom_map) {
+        munmap(dupbloom_map, dupbloom_maplen);
+        dupbloom_map = NULL;
+        dupbloom_maplen = 0;
+    }
+    dupbloom_ino = 0;
+}
+
+/* map the file currently at dupbloom_fname, if it is usable */
+static void dupbloom_map_file(void)
+{
+    struct stat sbuf;
+    size_t want = sizeof(struct dupbloom_header) + dupbloom_params.bytes;
+    int fd;
+
+    if (stat(dupbloom_fname, &sbuf) < 0 || sbuf.st_size != (off_t) want) {
+        dupbloom_unmap();
+        return;
+    }
+    if (sbuf.st_ino == dupbloom_ino) return;
+
+    dupbloom_unmap();
+
+    fd = open(dupbloom_fname, O_RDWR);
+    if (fd < 0) return;
+    dupbloom_map = mmap(NULL, want, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (dupbloom_map == MAP_FAILED) {
+        dupbloom_map = NULL;
+        return;
+    }
+    dupbloom_maplen = want;
+
+    if (dupbloom_hdr()->magic != DUPBLOOM_MAGIC ||
+        dupbloom_hdr()->version != DUPBLOOM_VERSION ||
+        dupbloom_hdr()->entries != DUPBLOOM_ENTRIES ||
+        dupbloom_hdr()->bytes != (uint32_t) dupbloom_params.bytes) {
+        dupbloom_unmap();
+        return;
+    }
+
+    dupbloom_ino = sbuf.st_ino;
+}
+
+static int dupbloom_seed_cb(void *rock __attribute__((unused)),
+                            const char *key, size_t keylen,
+                            const char *data __attribute__((unused)),
+                            size_t datalen __attribute__((unused)))
+{
+    bloom_add_raw(&dupbloom_params, dupbloom_bits(), key, keylen);
+    return 0;
+}
+
+/* Publish a fresh filter.  An empty not-ready filter is renamed into
+ * place FIRST and then seeded through the shared mapping: a sibling
+ * marking during the seed either committed its store before our
+ * foreach (so we read it) or has already picked up the new file and
+ * ORed the key in itself, so nothing can be missed.  Checks just fall
+ * back to the db until the seed finishes and the ready flag is set. */
+static void dupbloom_rebuild(void)
+{
+    struct dupbloom_header header;
+    struct stat sbuffd, sbuffile;
+    char *newfname;
+    size_t want = sizeof(struct dupbloom_header) + dupbloom_params.bytes;
+    int fd;
+
+    /* only one process rebuilds; the lock rides on the old file's
+     * inode, and holders of a freshly published file won't get here */
+    fd = open(dupbloom_fname, O_RDWR|O_CREAT, 0666);
+    if (fd < 0 || lock_nonblocking(fd, dupbloom_fname) < 0) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    /* somebody else may have published while we waited to notice */
+    if (fstat(fd, &sbuffd) < 0 ||
+        stat(dupbloom_fname, &sbuffile) < 0 ||
+        sbuffd.st_ino != sbuffile.st_ino) {
+        close(fd);
+        return;
+    }
+    if (sbuffd.st_size == (off_t) want &&
+        pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+        header.magic == DUPBLOOM_MAGIC &&
+        header.version == DUPBLOOM_VERSION &&
+        time(NULL) - (time_t) header.built < DUPBLOOM_LIFETIME) {
+        close(fd);
+        return;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = DUPBLOOM_MAGIC;
+    header.version = DUPBLOOM_VERSION;
+    header.entries = DUPBLOOM_ENTRIES;
+    header.bytes = dupbloom_params.bytes;
+    header.built = (uint64_t) time(NULL);
+
+    newfname = strconcat(dupbloom_fname, ".NEW", (char *)NULL);
+    {
+        int newfd = open(newfname, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+        int r = (newfd >= 0 &&
+                 retry_write(newfd, &header, sizeof(header))
+                    == sizeof(header) &&
+                 ftruncate(newfd, want) >= 0 &&      /* zeroed bits */
+                 fsync(newfd) >= 0);
+        if (newfd >= 0) close(newfd);
+        if (!r || rename(newfname, dupbloom_fname) < 0) {
+            syslog(LOG_ERR, "IOERROR: writing %s: %m", newfname);
+            unlink(newfname);
+            free(newfname);
+            close(fd);
+            return;
+        }
+        free(newfname);
+    }
+
+    /* seed the published file through the shared mapping */
+    dupbloom_map_file();
+    if (dupbloom_map) {
+        if (dupseg_width) {
+            struct dupseg *seg;
+            for (seg = dupsegs; seg; seg = seg->next)
+                cyrusdb_foreach(seg->db, "", 0, NULL, dupbloom_seed_cb,
+                                NULL, NULL);
+        }
+        else {
+            cyrusdb_foreach(dupdb, "", 0, NULL, dupbloom_seed_cb,
+                            NULL, NULL);
+        }
+        dupbloom_hdr()->ready = 1;
+    }
+
+    close(fd);      /* drops the lock */
+}
+
+/* (re)map the shared filter, creating or rebuilding it as needed.
+ * 'force' skips the stat throttle - marks use it so an add can never
+ * land in a file a rebuild has already renamed away */
+static void dupbloom_refresh(int force)
+{
+    time_t now = time(NULL);
+
+    if (!dupbloom_fname) return;
+    if (!force && dupbloom_checked && now - dupbloom_checked < DUPBLOOM_RECHECK)
+        return;
+    dupbloom_checked = now;
+
+    if (!dupbloom_params.ready &&
+        bloom_init(&dupbloom_params, DUPBLOOM_ENTRIES, DUPBLOOM_ERROR))
+        return;
+
+    dupbloom_map_file();
+
+    /* missing/unusable, or due to shed pruned keys?  Rebuild and pick
+     * up whatever the winning process published */
+    if (!dupbloom_map ||
+        now - (time_t) dupbloom_hdr()->built >= DUPBLOOM_LIFETIME) {
+        dupbloom_rebuild();
+        dupbloom_map_file();
+    }
+}
+
 /* must be called after cyrus_init */
 EXPORTED int duplicate_init(const char *fname)
 {
@@ -101,6 +500,18 @@ EXPORTED int duplicate_init(const char *fname)
         fname = tofree;
     }
 
+    if (!dupbloom_fname)
+        dupbloom_fname = strconcat(fname, ".bloom", (char *)NULL);
+
+    dupseg_width = config_getint(IMAPOPT_DUPLICATE_DB_SEGMENT_HOURS) * 3600;
+    if (dupseg_width > 0) {
+        /* segments are opened on demand; just find the live ones */
+        dupseg_base = xstrdup(fname);
+        dupseg_scan();
+        duplicate_dbopen = 1;
+        goto out;
+    }
+
     r = cyrusdb_open(DB, fname, CYRUSDB_CREATE, &dupdb);
     if (r != 0) {
         syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
@@ -173,10 +584,61 @@ EXPORTED time_t duplicate_check(const duplicate_key_t *dkey)
     r = make_key(&key, dkey);
     if (r) return 0;
 
-    do {
-        r = cyrusdb_fetch(dupdb, key.s, key.len,
-                      &data, &len, NULL);
-    } while (r == CYRUSDB_AGAIN);
+    int use_cache = config_getswitch(IMAPOPT_DUPLICATE_CACHE);
+    struct buf ckey = BUF_INITIALIZER;
+
+    if (use_cache) {
+        struct dupcache_entry *ent;
+
+        dupcache_key(&ckey, dkey);
+        ent = dupcache_get(buf_cstring(&ckey));
+        if (ent) {
+#if DEBUG
+            syslog(LOG_DEBUG, "duplicate_check: %-40s %-20s %-40s cache hit",
+                   dkey->id, dkey->to, dkey->date);
+#endif
+            buf_free(&ckey);
+            buf_free(&key);
+            return ent->mark;
+        }
+    }
+
+    if (config_getswitch(IMAPOPT_DUPLICATE_BLOOM)) {
+        dupbloom_refresh(0);
+        if (dupbloom_map && dupbloom_hdr()->ready &&
+            !bloom_check_raw(&dupbloom_params, dupbloom_bits(),
+                             key.s, key.len)) {
+            /* definitely not in the database */
+#if DEBUG
+            syslog(LOG_DEBUG, "duplicate_check: %-40s %-20s %-40s bloom miss",
+                   dkey->id, dkey->to, dkey->date);
+#endif
+            buf_free(&ckey);
+            buf_free(&key);
+            return 0;
+        }
+    }
+
+    if (dupseg_width) {
+        /* walk the live segments, newest first; open the current one
+         * first so we see marks other processes made since we rolled */
+        struct dupseg *seg;
+        dupseg_current();
+        r = CYRUSDB_NOTFOUND;
+        for (seg = dupsegs; seg; seg = seg->next) {
+            do {
+                r = cyrusdb_fetch(seg->db, key.s, key.len,
+                              &data, &len, NULL);
+            } while (r == CYRUSDB_AGAIN);
+            if (r != CYRUSDB_NOTFOUND) break;
+        }
+    }
+    else {
+        do {
+            r = cyrusdb_fetch(dupdb, key.s, key.len,
+                          &data, &len, NULL);
+        } while (r == CYRUSDB_AGAIN);
+    }
 
     if (!r && data) {
         assert((len == sizeof(time_t)) ||
@@ -193,11 +655,15 @@ EXPORTED time_t duplicate_check(const duplicate_key_t *dkey)
         mark = 0;
     }
 
+    if (use_cache && mark)
+        dupcache_put(buf_cstring(&ckey), mark);
+
 #if DEBUG
     syslog(LOG_DEBUG, "duplicate_check: %-40s %-20s %-40s %ld",
            dkey->id, dkey->to, dkey->date, mark);
 #endif
 
+    buf_free(&ckey);
     buf_free(&key);
     return mark;
 }
@@ -226,10 +692,41 @@ EXPORTED void duplicate_mark(const duplicate_key_t *dkey, time_t mark, unsigned
     memcpy(data, &mark, sizeof(mark));
     memcpy(data + sizeof(mark), &uid, sizeof(uid));
 
-    do {
-        r = cyrusdb_store(dupdb, key.s, key.len,
-                      data, sizeof(mark)+sizeof(uid), NULL);
-    } while (r == CYRUSDB_AGAIN);
+    if (dupseg_width) {
+        struct dupseg *seg = dupseg_current();
+        if (!seg) {
+            buf_free(&key);
+            return;
+        }
+        do {
+            r = cyrusdb_store(seg->db, key.s, key.len,
+                          data, sizeof(mark)+sizeof(uid), NULL);
+        } while (r == CYRUSDB_AGAIN);
+    }
+    else {
+        do {
+            r = cyrusdb_store(dupdb, key.s, key.len,
+                          data, sizeof(mark)+sizeof(uid), NULL);
+        } while (r == CYRUSDB_AGAIN);
+    }
+
+    if (!r && config_getswitch(IMAPOPT_DUPLICATE_BLOOM)) {
+        /* re-stat unconditionally: a rebuild may just have renamed a
+         * fresh filter into place, and this add must not land in the
+         * old file where nobody would ever see it */
+        dupbloom_refresh(1);
+        if (dupbloom_map)
+            bloom_add_raw(&dupbloom_params, dupbloom_bits(),
+                          key.s, key.len);
+    }
+
+    if (!r && config_getswitch(IMAPOPT_DUPLICATE_CACHE)) {
+        /* write through, so a redelivery burst never refetches */
+        struct buf ckey = BUF_INITIALIZER;
+        dupcache_key(&ckey, dkey);
+        dupcache_put(buf_cstring(&ckey), mark);
+        buf_free(&ckey);
+    }
 
 #if DEBUG
     syslog(LOG_DEBUG, "duplicate_mark: %-40s %-20s %-40s %ld %lu",
@@ -280,7 +777,17 @@ EXPORTED int duplicate_find(const char *msgid,
     frock.rock = rock;
 
     /* check each entry in our database */
-    cyrusdb_foreach(dupdb, msgid, strlen(msgid), NULL, find_cb, &frock, NULL);
+    if (dupseg_width) {
+        struct dupseg *seg;
+        for (seg = dupsegs; seg; seg = seg->next) {
+            if (cyrusdb_foreach(seg->db, msgid, strlen(msgid), NULL,
+                                find_cb, &frock, NULL))
+                break;
+        }
+    }
+    else {
+        cyrusdb_foreach(dupdb, msgid, strlen(msgid), NULL, find_cb, &frock, NULL);
+    }
 
     return 0;
 }
@@ -348,6 +855,36 @@ EXPORTED int duplicate_prune(int seconds, struct hash_table *expire_table)
     syslog(LOG_NOTICE, "duplicate_prune: pruning back %0.2f days",
            ((double)seconds/86400));
 
+    if (dupseg_width) {
+        /* expiry is file deletion: the newest entry a segment can hold
+         * is the end of its time bucket, so once that's past the
+         * cutoff the whole file has expired */
+        struct dupseg **prevp = &dupsegs;
+        int count = 0, deletions = 0;
+
+        while (*prevp) {
+            struct dupseg *seg = *prevp;
+
+            count++;
+            if ((seg->bucket + 1) * dupseg_width < prock.expmark) {
+                if (unlink(seg->path) < 0 && errno != ENOENT) {
+                    syslog(LOG_ERR, "IOERROR: unlinking %s: %m", seg->path);
+                    prevp = &seg->next;
+                    continue;
+                }
+                deletions++;
+                dupseg_close(prevp);
+            }
+            else {
+                prevp = &seg->next;
+            }
+        }
+
+        syslog(LOG_NOTICE, "duplicate_prune: removed %d out of %d segments",
+               deletions, count);
+        return 0;
+    }
+
     /* check each entry in our database */
     prock.db = dupdb;
     cyrusdb_foreach(dupdb, "", 0, &prune_p, &prune_cb, &prock, NULL);
@@ -416,7 +953,14 @@ EXPORTED int duplicate_dump(FILE *f)
     drock.count = 0;
 
     /* check each entry in our database */
-    cyrusdb_foreach(dupdb, "", 0, NULL, &dump_cb, &drock, NULL);
+    if (dupseg_width) {
+        struct dupseg *seg;
+        for (seg = dupsegs; seg; seg = seg->next)
+            cyrusdb_foreach(seg->db, "", 0, NULL, &dump_cb, &drock, NULL);
+    }
+    else {
+        cyrusdb_foreach(dupdb, "", 0, NULL, &dump_cb, &drock, NULL);
+    }
 
     return drock.count;
 }
@@ -425,11 +969,32 @@ EXPORTED int duplicate_done(void)
 {
     int r = 0;
 
+    dupbloom_unmap();
+    if (dupbloom_params.ready)
+        bloom_free(&dupbloom_params);
+    free(dupbloom_fname);
+    dupbloom_fname = NULL;
+    dupbloom_checked = 0;
+
+    if (dupcache.size) {
+        free_hash_table(&dupcache, free);
+        dupcache_nentries = 0;
+    }
+
     if (duplicate_dbopen) {
-        r = cyrusdb_close(dupdb);
-        if (r) {
-            syslog(LOG_ERR, "DBERROR: error closing deliverdb: %s",
-                   cyrusdb_strerror(r));
+        if (dupseg_width) {
+            while (dupsegs)
+                dupseg_close(&dupsegs);
+            free(dupseg_base);
+            dupseg_base = NULL;
+            dupseg_width = 0;
+        }
+        else {
+            r = cyrusdb_close(dupdb);
+            if (r) {
+                syslog(LOG_ERR, "DBERROR: error closing deliverdb: %s",
+                       cyrusdb_strerror(r));
+            }
         }
         duplicate_dbopen = 0;
     }
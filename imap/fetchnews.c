@@ -127,7 +127,7 @@ static void usage(void)
 {
     fprintf(stderr,
             "fetchnews [-C <altconfig>] [-s <server>] [-n] [-y] [-w <wildmat>] [-f <tstamp file>]\n"
-            "          [-a <authname> [-p <password>]] <peer>\n");
+            "          [-a <authname> [-p <password>]] [-W <window>] <peer>\n");
     exit(-1);
 }
 
@@ -168,6 +168,46 @@ int init_net(const char *host, char *port,
     return sock;
 }
 
+/* relay a dot-stuffed article from the peer to the server,
+ * including the terminating "." line */
+static int relay_article(struct protstream *pin, struct protstream *sout)
+{
+    char buf[4096];
+
+    buf[0] = '\0';
+    while (prot_fgets(buf, sizeof(buf), pin)) {
+        if (buf[0] == '.') {
+            if (buf[1] == '\r' && buf[2] == '\n') {
+                /* End of message */
+                prot_printf(sout, ".\r\n");
+                break;
+            }
+            else if (buf[1] != '.') {
+                /* Add missing dot-stuffing */
+                prot_putc('.', sout);
+            }
+        }
+
+        do {
+            /* look for malformed lines with NUL CR LF */
+            if (buf[strlen(buf)-1] != '\n' &&
+                strlen(buf)+2 < sizeof(buf)-1 &&
+                buf[strlen(buf)+2] == '\n') {
+                strlcat(buf, "\r\n", sizeof(buf));
+            }
+            prot_printf(sout, "%s", buf);
+        } while (buf[strlen(buf)-1] != '\n' &&
+                 prot_fgets(buf, sizeof(buf), pin));
+    }
+
+    if (buf[0] != '.') {
+        syslog(LOG_ERR, "ARTICLE terminated abnormally");
+        return -1;
+    }
+
+    return 0;
+}
+
 static int fetch(char *msgid, int bymsgid,
           struct protstream *pin, struct protstream *pout,
           struct protstream *sin, struct protstream *sout,
@@ -203,35 +243,7 @@ static int fetch(char *msgid, int bymsgid,
     }
     else {
         /* store the article */
-        while (prot_fgets(buf, sizeof(buf), pin)) {
-            if (buf[0] == '.') {
-                if (buf[1] == '\r' && buf[2] == '\n') {
-                    /* End of message */
-                    prot_printf(sout, ".\r\n");
-                    break;
-                }
-                else if (buf[1] != '.') {
-                    /* Add missing dot-stuffing */
-                    prot_putc('.', sout);
-                }
-            }
-
-            do {
-                /* look for malformed lines with NUL CR LF */
-                if (buf[strlen(buf)-1] != '\n' &&
-                    strlen(buf)+2 < sizeof(buf)-1 &&
-                    buf[strlen(buf)+2] == '\n') {
-                    strlcat(buf, "\r\n", sizeof(buf));
-                }
-                prot_printf(sout, "%s", buf);
-            } while (buf[strlen(buf)-1] != '\n' &&
-                     prot_fgets(buf, sizeof(buf), pin));
-        }
-
-        if (buf[0] != '.') {
-            syslog(LOG_ERR, "ARTICLE terminated abnormally");
-            return -1;
-        }
+        if (relay_article(pin, sout)) return -1;
     }
 
     /* see how we did */
@@ -247,6 +259,97 @@ static int fetch(char *msgid, int bymsgid,
     return 0;
 }
 
+#define FETCH_WINDOW_DEFAULT 32
+#define FETCH_WINDOW_MAX 512
+
+/* fetch a window of articles with CHECK/TAKETHIS (RFC 4644) rather than
+ * lockstep IHAVE/ARTICLE round trips: offer the whole window at once,
+ * request every wanted article from the peer in one burst, and relay the
+ * articles into TAKETHIS commands as they stream in, only pausing for the
+ * verdicts once the entire window has been delivered */
+static int fetch_batch(strarray_t *batch,
+                       struct protstream *pin, struct protstream *pout,
+                       struct protstream *sin, struct protstream *sout,
+                       int *rejected, int *accepted, int *failed)
+{
+    char buf[4096];
+    char wanted[FETCH_WINDOW_MAX];
+    int i, ntakethis = 0;
+
+    if (!batch->count) return 0;
+
+    /* offer the whole window */
+    for (i = 0; i < batch->count; i++)
+        prot_printf(sout, "CHECK %s\r\n", batch->data[i]);
+    prot_flush(sout);
+
+    memset(wanted, 0, sizeof(wanted));
+    for (i = 0; i < batch->count; i++) {
+        char *msgid, *p;
+        int j = i;
+
+        if (!prot_fgets(buf, sizeof(buf), sin)) {
+            syslog(LOG_ERR, "CHECK terminated abnormally");
+            return -1;
+        }
+
+        /* CHECK responses may come back in any order,
+           so match on the echoed msgid when we can */
+        if ((msgid = strchr(buf, '<')) && (p = strchr(msgid, '>'))) {
+            *++p = '\0';
+            for (j = 0; j < batch->count; j++) {
+                if (!strcmp(batch->data[j], msgid)) break;
+            }
+            if (j == batch->count) j = i;
+        }
+
+        if (!strncmp("238", buf, 3))
+            wanted[j] = 1;
+        else
+            (*rejected)++;
+    }
+
+    /* request every wanted article in a single burst */
+    for (i = 0; i < batch->count; i++) {
+        if (wanted[i]) prot_printf(pout, "ARTICLE %s\r\n", batch->data[i]);
+    }
+    prot_flush(pout);
+
+    /* relay each article into a TAKETHIS as it streams in */
+    for (i = 0; i < batch->count; i++) {
+        if (!wanted[i]) continue;
+
+        if (!prot_fgets(buf, sizeof(buf), pin)) {
+            syslog(LOG_ERR, "ARTICLE terminated abnormally");
+            return -1;
+        }
+        if (strncmp("220", buf, 3)) {
+            /* doh! the article doesn't exist */
+            (*failed)++;
+            continue;
+        }
+
+        prot_printf(sout, "TAKETHIS %s\r\n", batch->data[i]);
+        if (relay_article(pin, sout)) return -1;
+        ntakethis++;
+    }
+    prot_flush(sout);
+
+    /* see how we did */
+    for (i = 0; i < ntakethis; i++) {
+        if (!prot_fgets(buf, sizeof(buf), sin)) {
+            syslog(LOG_ERR, "TAKETHIS terminated abnormally");
+            return -1;
+        }
+        if (!strncmp("239", buf, 3))
+            (*accepted)++;
+        else
+            (*failed)++;
+    }
+
+    return 0;
+}
+
 #define BUFFERSIZE 4096
 
 int main(int argc, char *argv[])
@@ -264,13 +367,14 @@ int main(int argc, char *argv[])
     time_t stamp;
     strarray_t resp = STRARRAY_INITIALIZER;
     int newnews = 1;
+    int window = FETCH_WINDOW_DEFAULT, streaming = 0;
     char *datefmt = "%y%m%d %H%M%S";
 
     if ((geteuid()) == 0 && (become_cyrus(/*is_master*/0) != 0)) {
         fatal("must run as the Cyrus user", EC_USAGE);
     }
 
-    while ((opt = getopt(argc, argv, "C:s:w:f:a:p:ny")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:s:w:f:a:p:nyW:")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -308,6 +412,12 @@ int main(int argc, char *argv[])
             datefmt = "%Y%m%d %H%M%S";
             break;
 
+        case 'W': /* streaming window size */
+            window = atoi(optarg);
+            if (window < 1) window = 1;
+            else if (window > FETCH_WINDOW_MAX) window = FETCH_WINDOW_MAX;
+            break;
+
         default:
             usage();
             /* NOTREACHED */
@@ -477,20 +587,49 @@ int main(int argc, char *argv[])
         goto quit;
     }
 
+    /* switch to streaming mode so offers can be pipelined,
+       falling back to lockstep IHAVE if the server refuses */
+    if (window > 1) {
+        prot_printf(sout, "MODE STREAM\r\n");
+        if (!prot_fgets(buf, sizeof(buf), sin)) {
+            syslog(LOG_ERR, "MODE STREAM terminated abnormally");
+            goto quit;
+        }
+        if (!strncmp("203", buf, 3))
+            streaming = 1;
+        else
+            syslog(LOG_NOTICE, "server doesn't support streaming,"
+                   " offering articles serially");
+    }
+
     /* fetch and store articles */
     offered = rejected = accepted = failed = 0;
     if (newnews) {
+        strarray_t batch = STRARRAY_INITIALIZER;
+
         /* response is a list of msgids */
         for (i = 0; i < resp.count; i++) {
             /* find the end of the msgid */
             *(strrchr(resp.data[i], '>') + 1) = '\0';
 
             offered++;
-            if (fetch(resp.data[i], 1, pin, pout, sin, sout,
+            if (streaming) {
+                strarray_append(&batch, resp.data[i]);
+                if (batch.count < window && i + 1 < resp.count) continue;
+
+                if (fetch_batch(&batch, pin, pout, sin, sout,
+                                &rejected, &accepted, &failed)) {
+                    strarray_fini(&batch);
+                    goto quit;
+                }
+                strarray_truncate(&batch, 0);
+            }
+            else if (fetch(resp.data[i], 1, pin, pout, sin, sout,
                       &rejected, &accepted, &failed)) {
                 goto quit;
             }
         }
+        strarray_fini(&batch);
 
         /* write the current timestamp */
         lseek(fd, 0, SEEK_SET);
@@ -502,10 +641,11 @@ int main(int argc, char *argv[])
     else {
         char group[BUFFERSIZE], msgid[BUFFERSIZE], lastbuf[50];
         const char *data;
-        unsigned long low, high, last, cur;
+        unsigned long low, high, last, cur, batchstart = 0;
         int start;
         size_t datalen;
         struct txn *tid = NULL;
+        strarray_t batch = STRARRAY_INITIALIZER;
 
         newsrc_init(NULL, 0);
 
@@ -553,7 +693,21 @@ int main(int argc, char *argv[])
                     /* find the end of the msgid */
                     *(strrchr(msgid, '>') + 1) = '\0';
 
-                    if (fetch(msgid, 0, pin, pout, sin, sout,
+                    if (streaming) {
+                        if (!batch.count) batchstart = cur;
+                        strarray_append(&batch, msgid);
+                        if (batch.count >= window) {
+                            if (fetch_batch(&batch, pin, pout, sin, sout,
+                                            &rejected, &accepted, &failed)) {
+                                /* retry the whole window next run */
+                                strarray_truncate(&batch, 0);
+                                cur = batchstart - 1;
+                                break;
+                            }
+                            strarray_truncate(&batch, 0);
+                        }
+                    }
+                    else if (fetch(msgid, 0, pin, pout, sin, sout,
                               &rejected, &accepted, &failed)) {
                         cur--;
                         break;
@@ -566,6 +720,16 @@ int main(int argc, char *argv[])
                 if (cur >= high) break;
             }
 
+            /* drain the tail of the window */
+            if (batch.count) {
+                if (fetch_batch(&batch, pin, pout, sin, sout,
+                                &rejected, &accepted, &failed)) {
+                    /* retry the whole window next run */
+                    cur = batchstart - 1;
+                }
+                strarray_truncate(&batch, 0);
+            }
+
             snprintf(lastbuf, sizeof(lastbuf), "%lu", cur);
             cyrusdb_store(newsrc_db, group, strlen(group),
                       lastbuf, strlen(lastbuf)+1, &tid);
@@ -573,6 +737,7 @@ int main(int argc, char *argv[])
 
         if (tid) cyrusdb_commit(newsrc_db, tid);
         newsrc_done();
+        strarray_fini(&batch);
     }
 
     syslog(LOG_NOTICE,
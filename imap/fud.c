@@ -58,17 +58,21 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pwd.h>
 
 #include "acl.h"
 #include "mboxlist.h"
 #include "global.h"
+#include "eventio.h"
 #include "exitcodes.h"
+#include "hash.h"
 #include "mailbox.h"
 #include "map.h"
 #include "mboxname.h"
 #include "proc.h"
 #include "seen.h"
+#include "statuscache.h"
 #include "xmalloc.h"
 
 /* generated headers are not necessarily in current directory */
@@ -99,6 +103,25 @@ static int soc = 0; /* inetd (master) has handed us the port as stdin */
 #define MAXLOGNAME 16           /* should find out for real */
 #define MAXDOMNAME 20           /* should find out for real */
 
+/* Replies already computed for a user/mailbox pair, stamped with the
+ * shared statuscache generation counter they were read at.  While the
+ * counter holds still, a repeat query (webmail presence polling sends
+ * the same ones over and over) is answered from here without opening
+ * the mailbox or the seen db. */
+struct fud_memo {
+    uint32_t gen;
+    unsigned numrecent;
+    time_t lastread;
+    time_t lastarrived;
+};
+
+static hash_table memo_table;
+static unsigned nmemos = 0;
+
+/* keep the memory for a misbehaving client flood bounded; starting
+ * over just costs each active pair one recomputation */
+#define FUD_MEMO_MAX 65536
+
 static int begin_handling(void)
 {
     struct sockaddr_storage sfrom_storage;
@@ -106,28 +129,60 @@ static int begin_handling(void)
     socklen_t sfromsiz;
     char buf[MAXLOGNAME + MAXDOMNAME + MAX_MAILBOX_BUFFER];
     char *mbox;
-    int r;
+    struct eventio *io;
+    struct eventio_event event;
+    int r, fdflags;
+
+    /* a non-blocking socket lets us drain a whole burst of queued
+     * datagrams per wakeup rather than sleeping between each one */
+    fdflags = fcntl(soc, F_GETFL, 0);
+    if (fdflags != -1)
+        fdflags = fcntl(soc, F_SETFL, O_NONBLOCK | fdflags);
+    if (fdflags == -1) {
+        syslog(LOG_ERR, "unable to set nonblocking: %m");
+        return errno;
+    }
+
+    io = eventio_new();
+    eventio_add(io, soc, NULL);
 
     while(1) {
         if (signals_poll() == SIGHUP) {
             /* caught a SIGHUP, return */
+            eventio_free(&io);
             return 0;
         }
 
-        memset(buf, 0, sizeof(buf));
+        r = eventio_wait(io, &event, 1, NULL);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            eventio_free(&io);
+            return errno;
+        }
+        if (r == 0) continue;
+
+        /* drain the burst */
+        while(1) {
+            memset(buf, 0, sizeof(buf));
+
+            sfromsiz = sizeof(struct sockaddr_storage);
+            r = recvfrom(soc, buf, 511, 0, sfrom, &sfromsiz);
+            if (r < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                if (errno == EINTR) continue;
+                eventio_free(&io);
+                return errno;
+            }
 
-        sfromsiz = sizeof(struct sockaddr_storage);
-        r = recvfrom(soc, buf, 511, 0, sfrom, &sfromsiz);
-        if (r < 0) return errno;
+            mbox = strchr(buf, '|');
+            if (mbox) {
+                *mbox++ = 0;
+            } else {
+                continue;
+            }
 
-        mbox = strchr(buf, '|');
-        if (mbox) {
-            *mbox++ = 0;
-        } else {
-            continue;
+            handle_request(buf, mbox, sfrom, sfromsiz);
         }
-
-        handle_request(buf, mbox, sfrom, sfromsiz);
     }
 
     /* never reached */
@@ -162,6 +217,8 @@ int service_init(int argc, char **argv, char **envp)
     mboxlist_init(0);
     mboxlist_open(NULL);
 
+    construct_hash_table(&memo_table, 1024, 0);
+
     return 0;
 }
 
@@ -352,6 +409,28 @@ static int handle_request(const char *who, const char *name,
 
     char *intname = mboxname_from_external(name, &fud_namespace, who);
 
+    struct fud_memo *memo = NULL;
+    uint32_t gen = 0;
+    int havegen = 0;
+    char memokey[MAX_MAILBOX_BUFFER + MAXLOGNAME + MAXDOMNAME + 2];
+
+    /* the common case: we've answered for this pair before and the
+     * mailbox's generation counter hasn't moved since, so the reply is
+     * still good - no mailbox open, no seen db.  the counter is only
+     * maintained while the statuscache is enabled */
+    if (config_getswitch(IMAPOPT_STATUSCACHE))
+        havegen = statuscache_generation(intname, &gen);
+    if (havegen) {
+        snprintf(memokey, sizeof(memokey), "%s%%%s", intname, who);
+        memo = (struct fud_memo *)hash_lookup(memokey, &memo_table);
+        if (memo && memo->gen == gen) {
+            send_reply(sfrom, sfromsiz, REQ_OK, who, name,
+                       memo->numrecent, memo->lastread, memo->lastarrived);
+            free(intname);
+            return 0;
+        }
+    }
+
     r = mboxlist_lookup(intname, &mbentry, NULL);
     if (r || mbentry->mbtype & MBTYPE_RESERVE) {
         send_reply(sfrom, sfromsiz, REQ_UNK, who, name, 0, 0, 0);
@@ -439,6 +518,26 @@ static int handle_request(const char *who, const char *name,
     }
 
     mailbox_close(&mailbox);
+
+    if (havegen) {
+        /* stamp the reply with the counter read before the open, so a
+         * change which raced the computation leaves it already stale */
+        if (!memo) {
+            if (nmemos >= FUD_MEMO_MAX) {
+                free_hash_table(&memo_table, free);
+                construct_hash_table(&memo_table, 1024, 0);
+                nmemos = 0;
+            }
+            memo = xzmalloc(sizeof(struct fud_memo));
+            hash_insert(memokey, memo, &memo_table);
+            nmemos++;
+        }
+        memo->gen = gen;
+        memo->numrecent = numrecent;
+        memo->lastread = lastread;
+        memo->lastarrived = lastarrived;
+    }
+
     free(intname);
 
     send_reply(sfrom, sfromsiz, REQ_OK, who, name, numrecent,
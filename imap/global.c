@@ -65,11 +65,13 @@
 #include "charset.h"
 #include "exitcodes.h"
 #include "gmtoff.h"
+#include "hash.h"
 #include "iptostring.h"
 #include "global.h"
 #include "libconfig.h"
 #include "libcyr_cfg.h"
 #include "mboxlist.h"
+#include "md5.h"
 #include "mutex.h"
 #include "prot.h" /* for PROT_BUFSIZE */
 #include "strarray.h"
@@ -107,6 +109,7 @@ EXPORTED const char *config_ptscache_db;
 EXPORTED const char *config_statuscache_db;
 HIDDEN const char *config_userdeny_db;
 EXPORTED const char *config_zoneinfo_db;
+EXPORTED const char *config_tzcache_db;
 EXPORTED const char *config_conversations_db;
 EXPORTED const char *config_backup_db;
 EXPORTED const char *config_jmapauth_db;
@@ -293,6 +296,7 @@ EXPORTED int cyrus_init(const char *alt_config, const char *ident, unsigned flag
         config_statuscache_db = config_getstring(IMAPOPT_STATUSCACHE_DB);
         config_userdeny_db = config_getstring(IMAPOPT_USERDENY_DB);
         config_zoneinfo_db = config_getstring(IMAPOPT_ZONEINFO_DB);
+        config_tzcache_db = config_getstring(IMAPOPT_TZCACHE_DB);
         config_conversations_db = config_getstring(IMAPOPT_CONVERSATIONS_DB);
         config_backup_db = config_getstring(IMAPOPT_BACKUP_DB);
         config_jmapauth_db = config_getstring(IMAPOPT_JMAPAUTH_DB);
@@ -309,6 +313,10 @@ EXPORTED int cyrus_init(const char *alt_config, const char *ident, unsigned flag
                                   config_getstring(IMAPOPT_TEMP_PATH));
         libcyrus_config_setint(CYRUSOPT_PTS_CACHE_TIMEOUT,
                                config_getint(IMAPOPT_PTSCACHE_TIMEOUT));
+        libcyrus_config_setint(CYRUSOPT_PTS_CACHE_NEGATIVE_TIMEOUT,
+                               config_getint(IMAPOPT_PTSCACHE_NEGATIVE_TIMEOUT));
+        libcyrus_config_setint(CYRUSOPT_PTS_CACHE_REFRESH_WINDOW,
+                               config_getint(IMAPOPT_PTSCACHE_REFRESH_WINDOW));
         libcyrus_config_setswitch(CYRUSOPT_FULLDIRHASH,
                                   config_getswitch(IMAPOPT_FULLDIRHASH));
         libcyrus_config_setstring(CYRUSOPT_PTSCACHE_DB,
@@ -337,6 +345,16 @@ EXPORTED int cyrus_init(const char *alt_config, const char *ident, unsigned flag
                                   config_getswitch(IMAPOPT_SQL_USESSL));
         libcyrus_config_setswitch(CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
                                   config_getswitch(IMAPOPT_SKIPLIST_ALWAYS_CHECKPOINT));
+        libcyrus_config_setswitch(CYRUSOPT_TWOSKIP_LOCKLESS_READS,
+                                  config_getswitch(IMAPOPT_TWOSKIP_LOCKLESS_READS));
+        libcyrus_config_setint(CYRUSOPT_SHARDED_DB_SHARDS,
+                               config_getint(IMAPOPT_SHARDED_DB_SHARDS));
+        libcyrus_config_setswitch(CYRUSOPT_FLAT_INDEX,
+                                  config_getswitch(IMAPOPT_FLAT_INDEX));
+        libcyrus_config_setswitch(CYRUSOPT_TWOSKIP_PREFIX_COMPRESSION,
+                                  config_getswitch(IMAPOPT_TWOSKIP_PREFIX_COMPRESSION));
+        libcyrus_config_setswitch(CYRUSOPT_TWOSKIP_CRC32C,
+                                  config_getswitch(IMAPOPT_TWOSKIP_CRC32C));
 
         /* Not until all configuration parameters are set! */
         libcyrus_init();
@@ -717,6 +735,113 @@ EXPORTED int mysasl_proxy_policy(sasl_conn_t *conn,
     return SASL_OK;
 }
 
+/*
+ * Opt-in cache of successful plaintext authentications, so that clients
+ * which reconnect frequently with the same credentials don't pay for a
+ * password verifier round trip (e.g. to saslauthd or an LDAP server) on
+ * every connection.  Only positive results are cached, for at most
+ * authcache_ttl seconds, and only a salted digest of the credentials is
+ * kept in memory.  Policy decisions (userdeny, loginrealms, admin
+ * status) are NOT cached; on a hit we re-run mysasl_proxy_policy() so
+ * those checks, and their side effects on the caller's proxy_context,
+ * behave exactly as they do when libsasl invokes the callback itself.
+ */
+
+struct authcache_entry {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    char *canon_user;
+    time_t expiry;
+};
+
+static struct hash_table authcache = HASH_TABLE_INITIALIZER;
+static int authcache_built = 0;
+static unsigned char authcache_salt[16];
+
+static void authcache_digest(const char *user, const char *pass,
+                             unsigned char digest[MD5_DIGEST_LENGTH])
+{
+    MD5_CTX ctx;
+
+    MD5Init(&ctx);
+    MD5Update(&ctx, authcache_salt, sizeof(authcache_salt));
+    MD5Update(&ctx, user, strlen(user)+1);  /* include NUL as separator */
+    MD5Update(&ctx, pass, strlen(pass));
+    MD5Final(digest, &ctx);
+}
+
+EXPORTED int global_sasl_checkpass(sasl_conn_t *conn,
+                                   struct proxy_context *ctx,
+                                   const char *user,
+                                   const char *pass,
+                                   const char **canon_user)
+{
+    int ttl = config_getint(IMAPOPT_AUTHCACHE_TTL);
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    struct authcache_entry *entry = NULL;
+    const void *val;
+    int r;
+
+    if (ttl > 0) {
+        if (!authcache_built) {
+            construct_hash_table(&authcache, 128, 0);
+#ifdef HAVE_SSL
+            RAND_bytes(authcache_salt, sizeof(authcache_salt));
+#else
+            {
+                /* no strong entropy without OpenSSL; the salt only has
+                   to be unpredictable to other processes */
+                unsigned int seed = time(NULL) ^ getpid();
+                size_t i;
+                for (i = 0; i < sizeof(authcache_salt); i++)
+                    authcache_salt[i] = rand_r(&seed) & 0xff;
+            }
+#endif
+            authcache_built = 1;
+        }
+
+        authcache_digest(user, pass, digest);
+
+        entry = hash_lookup(user, &authcache);
+        if (entry && entry->expiry > time(NULL) &&
+            !memcmp(entry->digest, digest, MD5_DIGEST_LENGTH)) {
+            /* verified recently enough: skip the verifier round trip,
+               but still apply local policy */
+            r = mysasl_proxy_policy(conn, ctx, user, strlen(user),
+                                    user, strlen(user), NULL, 0, NULL);
+            if (r != SASL_OK) return r;
+
+            if (canon_user) *canon_user = entry->canon_user;
+            return SASL_OK;
+        }
+    }
+
+    r = sasl_checkpass(conn, user, strlen(user), pass, strlen(pass));
+    if (r != SASL_OK) return r;
+
+    /* get the canonical userid from SASL ---
+       set by mysasl_canon_user()/mysasl_proxy_policy() */
+    r = sasl_getprop(conn, SASL_USERNAME, &val);
+    if (r != SASL_OK) {
+        /* auth succeeded; only fail if the caller needed the name */
+        return canon_user ? r : SASL_OK;
+    }
+
+    if (ttl > 0) {
+        if (!entry) {
+            entry = xzmalloc(sizeof(struct authcache_entry));
+            hash_insert(user, entry, &authcache);
+        }
+        memcpy(entry->digest, digest, MD5_DIGEST_LENGTH);
+        free(entry->canon_user);
+        entry->canon_user = xstrdup((const char *) val);
+        entry->expiry = time(NULL) + ttl;
+    }
+
+    if (canon_user) *canon_user = (const char *) val;
+
+    return SASL_OK;
+}
+
 
 /* call before a cyrus application exits */
 EXPORTED void cyrus_done(void)
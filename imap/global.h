@@ -122,6 +122,21 @@ struct proxy_context {
     int *userisproxyadmin;
 };
 
+/* Plaintext login (IMAP LOGIN, POP3 USER/PASS, NNTP AUTHINFO) wrapper
+ * around sasl_checkpass().  If authcache_ttl is set, successful
+ * verifications are cached per-process so that reconnections with the
+ * same credentials skip the verifier round trip; mysasl_proxy_policy()
+ * is still run (with 'ctx') on every call.  'user' must already be
+ * canonicalized.  On success the canonical userid is returned in
+ * *canon_user (may be NULL if the caller doesn't want it); it points
+ * at storage owned by the cache or the SASL connection and must be
+ * duplicated before the next call. */
+extern int global_sasl_checkpass(sasl_conn_t *conn,
+                                 struct proxy_context *ctx,
+                                 const char *user,
+                                 const char *pass,
+                                 const char **canon_user);
+
 /* Misc utils */
 extern int shutdown_file(char *buf, int size);
 extern char *find_msgid(char *, char **);
@@ -146,6 +161,7 @@ extern const char *config_ptscache_db;
 extern const char *config_statuscache_db;
 extern const char *config_userdeny_db;
 extern const char *config_zoneinfo_db;
+extern const char *config_tzcache_db;
 extern const char *config_conversations_db;
 extern const char *config_backup_db;
 extern const char *config_jmapauth_db;
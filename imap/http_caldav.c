@@ -501,6 +501,7 @@ static struct meth_params caldav_params = {
       (db_proc_t) &caldav_abort,
       (db_lookup_proc_t) &caldav_lookup_resource,
       (db_foreach_proc_t) &caldav_foreach,
+      (db_changes_proc_t) &caldav_foreach_changed,
       (db_write_proc_t) &caldav_write,
       (db_delete_proc_t) &caldav_delete },
     &caldav_acl,
@@ -4670,12 +4671,23 @@ static int apply_comp_timerange(struct comp_filter *compfilter,
             return 1;
         }
         if (cdata->comp_flags.recurring) {
-            if (!(compfilter->prop || compfilter->comp) &&
-                (icaltime_compare(dtstart, range->start) >= 0 ||
-                 icaltime_compare(dtend, range->end) <= 0)) {
-                /* An occurrence (possibly override) starts or ends within range
-                   and we don't need to do further filtering of the comp */
-                return 1;
+            if (!(compfilter->prop || compfilter->comp)) {
+                if (icaltime_compare(dtstart, range->start) >= 0 ||
+                    icaltime_compare(dtend, range->end) <= 0) {
+                    /* An occurrence (possibly override) starts or ends within
+                       range and we don't need to do further filtering of the
+                       comp */
+                    return 1;
+                }
+
+                /* Next try the occurrence cache built at PUT time, which
+                   answers the query without parsing the resource */
+                if (fctx->davdb &&
+                    !caldav_check_occurrences(fctx->davdb, cdata,
+                                              range->start, range->end,
+                                              &pass)) {
+                    return pass;
+                }
             }
 
             /* Load message containing the resource and parse iCal data */
@@ -4690,8 +4702,19 @@ static int apply_comp_timerange(struct comp_filter *compfilter,
                                                 fctx->record->header_size);
                 }
                 if (!fctx->obj) return 0;
-                comp = icalcomponent_get_first_component(fctx->obj,
-                                                         compfilter->kind);
+
+                /* Test each instance of this component (logical OR) */
+                for (comp = icalcomponent_get_first_component(fctx->obj,
+                                                              compfilter->kind);
+                     comp && !pass;
+                     comp = icalcomponent_get_next_component(fctx->obj,
+                                                             compfilter->kind)) {
+                    icalcomponent_foreach_recurrence(comp, range->start,
+                                                     range->end,
+                                                     in_range, &pass);
+                }
+
+                return pass;
             }
         }
         else {
@@ -4787,7 +4810,11 @@ static int apply_calfilter(struct propfind_ctx *fctx, void *data)
         }
     }
 
-    if ((calfilter->flags & PARSE_ICAL) || cdata->comp_flags.recurring) {
+    /* Recurring resources are NOT parsed eagerly here - when the only
+       criterion is a depth-1 time-range, apply_comp_timerange() can
+       usually answer from the dtstart/dtend columns or the occurrence
+       cache, and only parses as a last resort */
+    if (calfilter->flags & PARSE_ICAL) {
         /* Load message containing the resource and parse iCal data */
         if (!ical) {
             if (!fctx->msg_buf.len)
@@ -6479,6 +6506,38 @@ static int propfind_sharingmodes(const xmlChar *name, xmlNsPtr ns,
 }
 
 
+/* dav_foreach() proxy which restricts iteration to resources whose
+ * aggregate span overlaps the query's time-range, when the filter
+ * shape guarantees that nothing else can match.  Matching rows still
+ * go through apply_calfilter() - this just keeps "this week's events"
+ * queries from reading every row in the collection */
+static int caldav_foreach_byfilter(void *davdb, const char *mailbox,
+                                   int (*cb)(void *rock, void *data),
+                                   void *rock)
+{
+    struct propfind_ctx *fctx = (struct propfind_ctx *) rock;
+    struct calquery_filter *calfilter =
+        (struct calquery_filter *) fctx->filter_crit;
+    struct comp_filter *top = calfilter ? calfilter->comp : NULL;
+    struct comp_filter *sub = top ? top->comp : NULL;
+
+    /* a single depth-1 comp-filter whose criteria include a
+     * time-range (and nothing at the VCALENDAR level) means rows
+     * outside the range can never match */
+    if (sub && !sub->next && sub->range &&
+        !sub->not_defined && (sub->allof || !(sub->prop || sub->comp)) &&
+        !top->range && !top->prop && !top->not_defined) {
+        icaltimezone *utc = icaltimezone_get_utc_timezone();
+
+        return caldav_foreach_timerange(davdb, mailbox,
+                                        icaltime_as_timet_with_zone(sub->range->start, utc),
+                                        icaltime_as_timet_with_zone(sub->range->end, utc),
+                                        cb, rock);
+    }
+
+    return caldav_foreach(davdb, mailbox, cb, rock);
+}
+
 static int report_cal_query(struct transaction_t *txn,
                             struct meth_params *rparams __attribute__((unused)),
                             xmlNodePtr inroot, struct propfind_ctx *fctx)
@@ -6493,7 +6552,7 @@ static int report_cal_query(struct transaction_t *txn,
     fctx->open_db = (db_open_proc_t) &caldav_open_mailbox;
     fctx->close_db = (db_close_proc_t) &caldav_close;
     fctx->lookup_resource = (db_lookup_proc_t) &caldav_lookup_resource;
-    fctx->foreach_resource = (db_foreach_proc_t) &caldav_foreach;
+    fctx->foreach_resource = (db_foreach_proc_t) &caldav_foreach_byfilter;
     fctx->proc_by_resource = &propfind_by_resource;
     fctx->davdb = NULL;
 
@@ -6783,6 +6842,22 @@ add_vavailability(struct vavailability_array *vavail, icalcomponent *ical)
 }
 
 
+struct occur_fb_rock {
+    struct freebusy_filter *fbfilter;
+    icalparameter_fbtype fbtype;
+};
+
+/* caldav_foreach_occurrence() callback to add a busytime period */
+static int add_occur_freebusy(void *rock, struct icaltimetype start,
+                              struct icaltimetype end)
+{
+    struct occur_fb_rock *orock = (struct occur_fb_rock *) rock;
+
+    add_freebusy(&start, &start, &end, orock->fbtype, orock->fbfilter);
+
+    return 0;
+}
+
 /* caldav_foreach() callback to find busytime of a resource */
 static int busytime_by_resource(void *rock, void *data)
 {
@@ -6814,6 +6889,41 @@ static int busytime_by_resource(void *rock, void *data)
         return 0;
     }
 
+    if (cdata->comp_flags.recurring && cdata->comp_flags.fb_uniform) {
+        /* Every instance shares the master component's TRANSP and
+           STATUS, so the occurrence cache rolled up at PUT time can
+           answer for the whole recurrence set without parsing */
+        struct occur_fb_rock orock = { fbfilter, ICAL_FBTYPE_BUSY };
+
+        if (cdata->comp_flags.transp) {
+            /* Don't include transparent events in freebusy */
+            return 0;
+        }
+
+        switch (cdata->comp_flags.status) {
+        case CAL_STATUS_CANCELED:
+            /* Don't include canceled events in freebusy */
+            return 0;
+
+        case CAL_STATUS_UNAVAILABLE:
+            orock.fbtype = ICAL_FBTYPE_BUSYUNAVAILABLE; break;
+
+        case CAL_STATUS_TENTATIVE:
+            orock.fbtype = ICAL_FBTYPE_BUSYTENTATIVE; break;
+
+        default:
+            orock.fbtype = ICAL_FBTYPE_BUSY; break;
+        }
+
+        if (!caldav_foreach_occurrence(fctx->davdb, cdata,
+                                       fbfilter->start, fbfilter->end,
+                                       &add_occur_freebusy, &orock)) {
+            return 0;
+        }
+
+        /* Cache doesn't cover the range - fall back to expanding */
+    }
+
     if (cdata->comp_flags.recurring ||
         cdata->comp_type == CAL_COMP_VAVAILABILITY) {
         /* Need to mmap() and parse iCalendar object */
@@ -7081,6 +7191,24 @@ static void combine_vavailability(struct freebusy_filter *fbfilter)
 
 
 /* Create an iCalendar object containing busytime of all specified resources */
+/* dav_foreach() proxy which only iterates resources whose aggregate
+ * span overlaps the freebusy range - busytime_by_resource() rejects
+ * everything outside it anyway */
+static int busytime_foreach(void *davdb, const char *mailbox,
+                            int (*cb)(void *rock, void *data),
+                            void *rock)
+{
+    struct propfind_ctx *fctx = (struct propfind_ctx *) rock;
+    struct freebusy_filter *fbfilter =
+        (struct freebusy_filter *) fctx->filter_crit;
+    icaltimezone *utc = icaltimezone_get_utc_timezone();
+
+    return caldav_foreach_timerange(davdb, mailbox,
+                                    icaltime_as_timet_with_zone(fbfilter->start, utc),
+                                    icaltime_as_timet_with_zone(fbfilter->end, utc),
+                                    cb, rock);
+}
+
 icalcomponent *busytime_query_local(struct transaction_t *txn,
                                     struct propfind_ctx *fctx,
                                     char mailboxname[],
@@ -7101,7 +7229,7 @@ icalcomponent *busytime_query_local(struct transaction_t *txn,
     fctx->open_db = (db_open_proc_t) &caldav_open_mailbox;
     fctx->close_db = (db_close_proc_t) &caldav_close;
     fctx->lookup_resource = (db_lookup_proc_t) &caldav_lookup_resource;
-    fctx->foreach_resource = (db_foreach_proc_t) &caldav_foreach;
+    fctx->foreach_resource = (db_foreach_proc_t) &busytime_foreach;
     fctx->proc_by_resource = &busytime_by_resource;
 
     /* Gather up all of the busytime and VAVAILABILITY periods */
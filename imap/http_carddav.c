@@ -287,6 +287,7 @@ static struct meth_params carddav_params = {
       (db_proc_t) &carddav_abort,
       (db_lookup_proc_t) &carddav_lookup_resource,
       (db_foreach_proc_t) &carddav_foreach,
+      (db_changes_proc_t) &carddav_foreach_changed,
       (db_write_proc_t) &carddav_write,
       (db_delete_proc_t) &carddav_delete },
     NULL,                                       /* No ACL extensions */
@@ -1382,6 +1383,8 @@ typedef enum vcardproperty_kind {
     VCARD_N_PROPERTY = 2,
     VCARD_NICKNAME_PROPERTY = 3,
     VCARD_UID_PROPERTY = 4,
+    VCARD_EMAIL_PROPERTY = 5,
+    VCARD_TEL_PROPERTY = 6,
     VCARD_NO_PROPERTY = 1000
 } vcardproperty_kind;
 
@@ -1396,6 +1399,8 @@ static unsigned vcardproperty_string_to_kind(const char *str)
     else if (!strcasecmp(str, "N")) return VCARD_N_PROPERTY;
     else if (!strcasecmp(str, "NICKNAME")) return VCARD_NICKNAME_PROPERTY;
     else if (!strcasecmp(str, "UID")) return VCARD_UID_PROPERTY;
+    else if (!strcasecmp(str, "EMAIL")) return VCARD_EMAIL_PROPERTY;
+    else if (!strcasecmp(str, "TEL")) return VCARD_TEL_PROPERTY;
     else return VCARD_ANY_PROPERTY;
 }
 
@@ -1463,7 +1468,7 @@ static int apply_propfilter(struct prop_filter *propfilter,
                             struct carddav_data *cdata,
                             struct propfind_ctx *fctx)
 {
-    int pass = 1;
+    int pass = 1, need_parse = 0;
     struct vparse_card *vcard = fctx->obj;
     struct vparse_entry myprop, *prop = NULL;
 
@@ -1494,6 +1499,31 @@ static int apply_propfilter(struct prop_filter *propfilter,
             if (cdata->vcard_uid) myprop.v.value = (char *) cdata->vcard_uid;
             break;
 
+        case VCARD_EMAIL_PROPERTY:
+            /* NULL column means the row predates the extraction */
+            if (!cdata->email) need_parse = 1;
+            else if (*cdata->email) {
+                if (propfilter->match) {
+                    myprop.multivaluesep = *CARDDAV_SEP;
+                    myprop.v.values =
+                        strarray_split(cdata->email, CARDDAV_SEP, 0);
+                }
+                else myprop.v.value = (char *) cdata->email;
+            }
+            break;
+
+        case VCARD_TEL_PROPERTY:
+            if (!cdata->phone) need_parse = 1;
+            else if (*cdata->phone) {
+                if (propfilter->match) {
+                    myprop.multivaluesep = *CARDDAV_SEP;
+                    myprop.v.values =
+                        strarray_split(cdata->phone, CARDDAV_SEP, 0);
+                }
+                else myprop.v.value = (char *) cdata->phone;
+            }
+            break;
+
         default:
             break;
         }
@@ -1501,7 +1531,8 @@ static int apply_propfilter(struct prop_filter *propfilter,
         if (myprop.v.value) prop = &myprop;
     }
 
-    if (propfilter->param || (propfilter->kind == VCARD_ANY_PROPERTY)) {
+    if (propfilter->param || (propfilter->kind == VCARD_ANY_PROPERTY) ||
+        need_parse) {
         /* Load message containing the resource and parse vcard data */
         if (!vcard) {
             if (!fctx->msg_buf.len) {
@@ -73,6 +73,7 @@
 #include "http_proxy.h"
 #include "index.h"
 #include "proxy.h"
+#include "ptrarray.h"
 #include "times.h"
 #include "syslog.h"
 #include "strhash.h"
@@ -1304,6 +1305,83 @@ xmlNodePtr xml_add_prop(long status, xmlNsPtr davns,
 }
 
 
+/* Stream a multistatus response one element at a time.
+ *
+ * The first call (passing the childless root element) sends the
+ * response headers and the opening tag of the root; each subsequent
+ * call dumps one child element as its own chunk; a final call with
+ * node == NULL sends the closing tag and ends the chunked body.
+ * The caller must set TE_CHUNKED on the transaction before the first
+ * call, and owns '*buf' (allocated on first use, freed by the final
+ * call). */
+void xml_partial_response(struct transaction_t *txn,
+                          xmlDocPtr doc, xmlNodePtr node,
+                          unsigned level, xmlBufferPtr *buf)
+{
+    const char *eol = config_httpprettytelemetry ? "\n" : "";
+    unsigned n;
+
+    if (!*buf) {
+        /* First call - dump the (childless) document and re-open the
+           empty-element tag of the root so children can follow */
+        xmlChar *dump = NULL;
+        int dumpsiz = 0;
+
+        *buf = xmlBufferCreate();
+
+        xmlDocDumpFormatMemoryEnc(doc, &dump, &dumpsiz, "utf-8",
+                                  config_httpprettytelemetry);
+        if (dump) {
+            int origsiz = dumpsiz;
+
+            while (dumpsiz && isspace(dump[dumpsiz-1])) dumpsiz--;
+            if (dumpsiz >= 2 && dump[dumpsiz-2] == '/') {
+                dump[dumpsiz-2] = '>';
+                dumpsiz--;
+            }
+            if (*eol && dumpsiz < origsiz) dump[dumpsiz++] = '\n';
+
+            txn->resp_body.type = "application/xml; charset=utf-8";
+            write_body(HTTP_MULTI_STATUS, txn, (char *) dump, dumpsiz);
+            xmlFree(dump);
+        }
+
+        if (!node || node == xmlDocGetRootElement(doc)) return;
+    }
+
+    xmlBufferEmpty(*buf);
+
+    if (node) {
+        /* Dump one child element */
+        for (n = 0; n < MARKUP_INDENT * level; n++) xmlBufferCCat(*buf, " ");
+        xmlNodeDump(*buf, doc, node, level, config_httpprettytelemetry);
+        xmlBufferCCat(*buf, eol);
+
+        write_body(0, txn, (char *) xmlBufferContent(*buf),
+                   xmlBufferLength(*buf));
+    }
+    else {
+        /* Final call - close the root element and end the body */
+        xmlNodePtr root = xmlDocGetRootElement(doc);
+
+        xmlBufferCCat(*buf, "</");
+        if (root->ns && root->ns->prefix) {
+            xmlBufferCat(*buf, root->ns->prefix);
+            xmlBufferCCat(*buf, ":");
+        }
+        xmlBufferCat(*buf, root->name);
+        xmlBufferCCat(*buf, ">");
+        xmlBufferCCat(*buf, eol);
+
+        write_body(0, txn, (char *) xmlBufferContent(*buf),
+                   xmlBufferLength(*buf));
+        write_body(0, txn, NULL, 0);
+
+        xmlBufferFree(*buf);
+        *buf = NULL;
+    }
+}
+
 struct allprop_rock {
     struct propfind_ctx *fctx;
     struct propstat *propstat;
@@ -5367,6 +5445,129 @@ static size_t make_collection_url(struct buf *buf, const char  *urlprefix,
 }
 
 
+/* In-process cache of rendered collection PROPFIND rows.
+ *
+ * Polling clients re-issue the same depth:1 PROPFIND against their
+ * collections every minute or so, and the vast majority of those polls
+ * see no changes.  Rendering the collection's <DAV:response> element
+ * requires opening the mailbox and reading its index header, so once a
+ * row has been rendered we keep a copy of the finished element, keyed
+ * by mailbox name and validated against the owner's highest modseq
+ * (read cheaply from the per-user counters file - any change under the
+ * user bumps it and forces a re-render on the next poll).  The row also
+ * depends on the shape of the request (mode, prop list, preferences)
+ * and on who is asking, so those are folded into a signature which must
+ * also match for a hit.  Sized by the httppropfindcache option; when
+ * the table fills we dump it wholesale and let the collections that are
+ * actually being polled repopulate it. */
+struct propfind_cache_entry {
+    modseq_t modseq;            /* owner's highestmodseq when rendered */
+    char *sig;                  /* request signature the row answers */
+    xmlDocPtr doc;              /* holds the cached response element */
+};
+
+static struct hash_table propfind_cache;
+static unsigned propfind_cache_count = 0;
+
+static void propfind_cache_entry_free(void *data)
+{
+    struct propfind_cache_entry *entry = data;
+
+    xmlFreeDoc(entry->doc);
+    free(entry->sig);
+    free(entry);
+}
+
+static char *propfind_cache_sig(struct propfind_ctx *fctx)
+{
+    struct buf buf = BUF_INITIALIZER;
+    struct propfind_entry_list *e;
+
+    buf_printf(&buf, "%u:%u:%s:%s", fctx->mode, fctx->prefer,
+               fctx->userid ? fctx->userid : "",
+               fctx->req_tgt->userid ? fctx->req_tgt->userid : "");
+
+    for (e = fctx->elist; e; e = e->next) {
+        buf_putc(&buf, ';');
+        if (e->ns && e->ns->href)
+            buf_appendcstr(&buf, (const char *) e->ns->href);
+        buf_putc(&buf, ':');
+        buf_appendcstr(&buf, (const char *) e->name);
+    }
+
+    return buf_release(&buf);
+}
+
+/* If we have a row for this collection rendered at the current modseq
+ * for an identical request, copy it into the response in progress */
+static int propfind_cache_fetch(struct propfind_ctx *fctx,
+                                const char *mboxname, modseq_t modseq,
+                                const char *sig)
+{
+    struct propfind_cache_entry *entry;
+    xmlNodePtr copy;
+
+    if (!propfind_cache.size) return 0;
+
+    entry = hash_lookup(mboxname, &propfind_cache);
+    if (!entry || entry->modseq != modseq || strcmp(entry->sig, sig))
+        return 0;
+
+    /* xmlDocCopyNode() reconciles namespaces, so the copy carries any
+     * declarations it needs from the cached document */
+    copy = xmlDocCopyNode(xmlDocGetRootElement(entry->doc),
+                          fctx->root->doc, 1);
+    if (!copy) return 0;
+
+    xmlAddChild(fctx->root, copy);
+    return 1;
+}
+
+/* Cache the freshly rendered row for this collection.  Takes ownership
+ * of 'sig' */
+static void propfind_cache_store(const char *mboxname, modseq_t modseq,
+                                 char *sig, xmlNodePtr resp)
+{
+    struct propfind_cache_entry *entry;
+    int max = config_getint(IMAPOPT_HTTPPROPFINDCACHE);
+    xmlDocPtr doc;
+    xmlNodePtr copy;
+
+    doc = xmlNewDoc(BAD_CAST "1.0");
+    copy = xmlDocCopyNode(resp, doc, 1);
+    if (!copy) {
+        xmlFreeDoc(doc);
+        free(sig);
+        return;
+    }
+    xmlDocSetRootElement(doc, copy);
+
+    if (!propfind_cache.size) construct_hash_table(&propfind_cache, max, 0);
+
+    entry = hash_lookup(mboxname, &propfind_cache);
+    if (entry) {
+        /* Replace the stale row in place */
+        xmlFreeDoc(entry->doc);
+        free(entry->sig);
+    }
+    else {
+        if (propfind_cache_count >= (unsigned) max) {
+            /* Full: dump the lot and let the hot rows repopulate */
+            free_hash_table(&propfind_cache, &propfind_cache_entry_free);
+            construct_hash_table(&propfind_cache, max, 0);
+            propfind_cache_count = 0;
+        }
+        entry = xzmalloc(sizeof(struct propfind_cache_entry));
+        hash_insert(mboxname, entry, &propfind_cache);
+        propfind_cache_count++;
+    }
+
+    entry->modseq = modseq;
+    entry->sig = sig;
+    entry->doc = doc;
+}
+
+
 /* mboxlist_findall() callback to find props on a collection */
 int propfind_by_collection(const mbentry_t *mbentry, void *rock)
 {
@@ -5374,9 +5575,10 @@ int propfind_by_collection(const mbentry_t *mbentry, void *rock)
     const char *mboxname = mbentry->name;
     struct buf writebuf = BUF_INITIALIZER;
     struct mailbox *mailbox = NULL;
-    char *p;
+    char *p, *sig = NULL;
+    modseq_t modseq = 0;
     size_t len;
-    int r = 0, rights = 0;
+    int r = 0, rights = 0, addroot = 0;
 
     /* skip deleted items */
     if (mboxname_isdeletedmailbox(mbentry->name, 0) || mbentry->mbtype == MBTYPE_DELETED)
@@ -5425,17 +5627,7 @@ int propfind_by_collection(const mbentry_t *mbentry, void *rock)
         goto done;
 
 
-    /* Open mailbox for reading */
-    if ((r = mailbox_open_irl(mboxname, &mailbox))) {
-        syslog(LOG_INFO, "mailbox_open_irl(%s) failed: %s",
-               mboxname, error_message(r));
-        fctx->txn->error.desc = error_message(r);
-        *fctx->ret = HTTP_SERVER_ERROR;
-        goto done;
-    }
-
     fctx->mbentry = mbentry;
-    fctx->mailbox = mailbox;
     fctx->record = NULL;
 
     if (!fctx->req_tgt->resource) {
@@ -5452,8 +5644,46 @@ int propfind_by_collection(const mbentry_t *mbentry, void *rock)
 
         /* If not filtering by calendar resource, and not excluding root,
            add response for collection */
-        if (!fctx->filter_crit && !(fctx->prefer & PREFER_NOROOT) &&
-            (r = xml_add_response(fctx, 0, 0))) goto done;
+        if (!fctx->filter_crit && !(fctx->prefer & PREFER_NOROOT)) {
+            addroot = 1;
+
+            /* A cached row lets us skip opening the mailbox entirely
+               (only when the collection row is all we need from it) */
+            if (config_getint(IMAPOPT_HTTPPROPFINDCACHE) > 0 &&
+                !(fctx->depth > 1 && fctx->open_db)) {
+                struct mboxname_counters counters;
+
+                if (!mboxname_read_counters(mboxname, &counters) &&
+                    counters.highestmodseq) {
+                    modseq = counters.highestmodseq;
+                    sig = propfind_cache_sig(fctx);
+                    if (propfind_cache_fetch(fctx, mboxname, modseq, sig)) {
+                        fctx->mailbox = NULL;
+                        goto done;
+                    }
+                }
+            }
+        }
+    }
+
+    /* Open mailbox for reading */
+    if ((r = mailbox_open_irl(mboxname, &mailbox))) {
+        syslog(LOG_INFO, "mailbox_open_irl(%s) failed: %s",
+               mboxname, error_message(r));
+        fctx->txn->error.desc = error_message(r);
+        *fctx->ret = HTTP_SERVER_ERROR;
+        goto done;
+    }
+
+    fctx->mailbox = mailbox;
+
+    if (addroot) {
+        if ((r = xml_add_response(fctx, 0, 0))) goto done;
+
+        if (sig && fctx->root->last) {
+            propfind_cache_store(mboxname, modseq, sig, fctx->root->last);
+            sig = NULL;  /* ownership passed to the cache */
+        }
     }
 
     if (fctx->depth > 1 && fctx->open_db) { // can't do davdb searches if no dav db
@@ -5463,6 +5693,7 @@ int propfind_by_collection(const mbentry_t *mbentry, void *rock)
 
   done:
     buf_free(&writebuf);
+    free(sig);
     if (mailbox) mailbox_close(&mailbox);
 
     return r;
@@ -7081,18 +7312,20 @@ static int map_modseq_cmp(const struct index_map *m1,
 int report_multiget(struct transaction_t *txn, struct meth_params *rparams,
                     xmlNodePtr inroot, struct propfind_ctx *fctx)
 {
-    int r, ret = 0;
+    int r, ret = 0, i;
     struct mailbox *mailbox = NULL;
     xmlNodePtr node;
+    ptrarray_t tgts = PTRARRAY_INITIALIZER;
+    struct request_target_t *tgt;
+    xmlBufferPtr xmlbuf = NULL;
 
-    /* Get props for each href */
+    /* Parse and validate all hrefs up front, so that no protocol error
+       can occur once we've started streaming the multistatus response */
     for (node = inroot->children; node; node = node->next) {
         if ((node->type == XML_ELEMENT_NODE) &&
             !xmlStrcmp(node->name, BAD_CAST "href")) {
             xmlChar *href = xmlNodeListGetString(inroot->doc, node->children, 1);
             xmlURIPtr uri;
-            struct request_target_t tgt;
-            struct dav_data *ddata;
 
             /* Parse the URI */
             uri = parse_uri(METH_REPORT, (const char *) href,
@@ -7104,67 +7337,269 @@ int report_multiget(struct transaction_t *txn, struct meth_params *rparams,
             }
 
             /* Parse the path */
-            memset(&tgt, 0, sizeof(struct request_target_t));
-            tgt.namespace = txn->req_tgt.namespace;
+            tgt = xzmalloc(sizeof(struct request_target_t));
+            tgt->namespace = txn->req_tgt.namespace;
 
-            r = rparams->parse_path(uri->path, &tgt, &fctx->txn->error.desc);
+            r = rparams->parse_path(uri->path, tgt, &fctx->txn->error.desc);
             xmlFreeURI(uri);
+            ptrarray_append(&tgts, tgt);
             if (r) {
                 ret = r;
                 goto done;
             }
+        }
+    }
 
-            fctx->req_tgt = &tgt;
-            fctx->mbentry = tgt.mbentry;
+    /* Setup for chunked response - each response element is written
+       out as its resource is fetched, so memory stays flat no matter
+       how many hrefs the client sent */
+    txn->flags.te |= TE_CHUNKED;
+    /* iCalendar/vCard data in response should not be transformed */
+    txn->flags.cc |= CC_NOTRANSFORM;
 
-            /* Check if we already have this mailbox open */
-            if (!mailbox || strcmp(mailbox->name, tgt.mbentry->name)) {
-                if (mailbox) mailbox_close(&mailbox);
+    xml_partial_response(txn, fctx->root->doc, fctx->root, 0, &xmlbuf);
 
-                /* Open mailbox for reading */
-                r = mailbox_open_irl(tgt.mbentry->name, &mailbox);
-                if (r && r != IMAP_MAILBOX_NONEXISTENT) {
-                    syslog(LOG_ERR, "http_mailbox_open(%s) failed: %s",
-                           tgt.mbentry->name, error_message(r));
-                    txn->error.desc = error_message(r);
-                    ret = HTTP_SERVER_ERROR;
-                    goto done;
-                }
+    /* Get props for each href */
+    for (i = 0; i < tgts.count; i++) {
+        struct dav_data *ddata;
+        xmlNodePtr resp;
 
-                fctx->mailbox = mailbox;
-            }
+        tgt = ptrarray_nth(&tgts, i);
+        fctx->req_tgt = tgt;
+        fctx->mbentry = tgt->mbentry;
 
-            if (!fctx->mailbox || !tgt.resource) {
-                /* Add response for missing target */
-                xml_add_response(fctx, HTTP_NOT_FOUND, 0);
-                continue;
+        /* Check if we already have this mailbox open */
+        r = 0;
+        if (!mailbox || strcmp(mailbox->name, tgt->mbentry->name)) {
+            if (mailbox) mailbox_close(&mailbox);
+
+            /* Open mailbox for reading */
+            r = mailbox_open_irl(tgt->mbentry->name, &mailbox);
+            if (r && r != IMAP_MAILBOX_NONEXISTENT) {
+                syslog(LOG_ERR, "http_mailbox_open(%s) failed: %s",
+                       tgt->mbentry->name, error_message(r));
+                mailbox = NULL;
             }
 
+            fctx->mailbox = mailbox;
+        }
+
+        if (r && r != IMAP_MAILBOX_NONEXISTENT) {
+            /* Headers are already on the wire - report it per-resource */
+            xml_add_response(fctx, HTTP_SERVER_ERROR, 0);
+        }
+        else if (!fctx->mailbox || !tgt->resource) {
+            /* Add response for missing target */
+            xml_add_response(fctx, HTTP_NOT_FOUND, 0);
+        }
+        else {
             /* Open the DAV DB corresponding to the mailbox */
             fctx->davdb = rparams->davdb.open_db(fctx->mailbox);
 
             /* Find message UID for the resource */
-            rparams->davdb.lookup_resource(fctx->davdb, tgt.mbentry->name,
-                                           tgt.resource, (void **) &ddata, 0);
-            ddata->resource = tgt.resource;
+            rparams->davdb.lookup_resource(fctx->davdb, tgt->mbentry->name,
+                                           tgt->resource, (void **) &ddata, 0);
+            ddata->resource = tgt->resource;
             /* XXX  Check errors */
 
             fctx->proc_by_resource(fctx, ddata);
 
-            /* XXX - split this into a req_tgt cleanup */
-            free(tgt.userid);
-            mboxlist_entry_free(&tgt.mbentry);
-
             rparams->davdb.close_db(fctx->davdb);
         }
+
+        /* Stream out the response(s) added for this href */
+        while ((resp = fctx->root->children)) {
+            xml_partial_response(txn, fctx->root->doc, resp, 1, &xmlbuf);
+            xmlUnlinkNode(resp);
+            xmlFreeNode(resp);
+        }
     }
 
+    /* End the multistatus response */
+    xml_partial_response(txn, fctx->root->doc, NULL, 0, &xmlbuf);
+
+    /* Response has already been sent */
+    ret = 0;
+
   done:
+    for (i = 0; i < tgts.count; i++) {
+        tgt = ptrarray_nth(&tgts, i);
+        /* XXX - split this into a req_tgt cleanup */
+        free(tgt->userid);
+        mboxlist_entry_free(&tgt->mbentry);
+        free(tgt);
+    }
+    ptrarray_fini(&tgts);
+
     mailbox_close(&mailbox);
 
-    return (ret ? ret : HTTP_MULTI_STATUS);
+    return ret;
+}
+
+
+/* Changed resource as harvested from the per-mailbox DAV DB */
+struct sync_change_row {
+    char *resource;
+    uint32_t uid;
+    modseq_t modseq;
+    int alive;
+    struct index_record record;  /* filled in later for live rows */
+};
+
+static int sync_changes_cb(void *rock, void *data)
+{
+    ptrarray_t *rows = (ptrarray_t *) rock;
+    struct dav_data *ddata = (struct dav_data *) data;
+    struct sync_change_row *row = xzmalloc(sizeof(struct sync_change_row));
+
+    row->resource = xstrdup(ddata->resource);
+    row->uid = ddata->imap_uid;
+    row->modseq = ddata->modseq;
+    row->alive = ddata->alive;
+    ptrarray_append(rows, row);
+
+    return 0;
 }
 
+/* Report the resources changed since 'syncmodseq' using a modseq-ordered
+   scan of the DAV DB, rather than walking every index record in the
+   collection.  Requires rparams->davdb.foreach_changed. */
+static int report_sync_changes(struct meth_params *rparams,
+                               struct propfind_ctx *fctx,
+                               modseq_t syncmodseq, modseq_t basemodseq,
+                               uint32_t limit, modseq_t *respmodseq,
+                               int unbind_flag, int unchanged_flag)
+{
+    struct mailbox *mailbox = fctx->mailbox;
+    struct transaction_t *txn = fctx->txn;
+    ptrarray_t rows = PTRARRAY_INITIALIZER;
+    struct sync_change_row *row;
+    uint32_t nresp;
+    int i, r, ret = 0;
+
+    /* Open the DAV DB corresponding to the mailbox */
+    fctx->davdb = rparams->davdb.open_db(mailbox);
+
+    /* Find which resources we need to report -
+       only rows changed since the client's token are read */
+    r = rparams->davdb.foreach_changed(fctx->davdb, mailbox->name,
+                                       syncmodseq, &sync_changes_cb, &rows);
+    if (r) {
+        txn->error.desc = error_message(r);
+        ret = HTTP_SERVER_ERROR;
+        goto done;
+    }
+
+    /* Weed out rows the client shouldn't see, fetching the index
+       record we will need for the report as we go */
+    for (i = 0; i < ptrarray_size(&rows); i++) {
+        int skip = 0;
+
+        row = ptrarray_nth(&rows, i);
+
+        if (!row->alive) {
+            if (row->modseq <= basemodseq) {
+                /* Initial sync - ignore unmapped resources */
+                skip = 1;
+            }
+        }
+        else if (mailbox_find_index_record(mailbox, row->uid, &row->record)) {
+            /* Stale DAV DB row */
+            skip = 1;
+        }
+        else if ((unbind_flag >= 0) &&
+                 (row->record.user_flags[unbind_flag / 32] &
+                  (1 << (unbind_flag & 31)))) {
+            /* Resource replaced by a PUT, COPY, or MOVE - ignore it */
+            skip = 1;
+        }
+        else if ((row->record.modseq - syncmodseq == 1) &&
+                 (unchanged_flag >= 0) &&
+                 (row->record.user_flags[unchanged_flag / 32] &
+                  (1 << (unchanged_flag & 31)))) {
+            /* Resource has just had VTIMEZONEs stripped - ignore it */
+            skip = 1;
+        }
+
+        if (skip) {
+            free(row->resource);
+            free(row);
+            ptrarray_remove(&rows, i--);
+        }
+    }
+
+    nresp = ptrarray_size(&rows);
+
+    if (limit < nresp) {
+        /* Need to truncate the responses -
+           rows arrive in ascending modseq order, so no sort is needed */
+
+        /* Our last response MUST be the last record with its modseq */
+        for (nresp = limit;
+             nresp &&
+                 ((struct sync_change_row *)
+                  ptrarray_nth(&rows, nresp-1))->modseq ==
+                 ((struct sync_change_row *)
+                  ptrarray_nth(&rows, nresp))->modseq;
+             nresp--);
+
+        if (!nresp) {
+            /* DAV:number-of-matches-within-limits */
+            txn->error.desc = "Unable to truncate results";
+            txn->error.precond = DAV_OVER_LIMIT;
+            ret = HTTP_NO_STORAGE;
+            goto done;
+        }
+
+        /* respmodseq will be modseq of last record we return */
+        row = ptrarray_nth(&rows, nresp-1);
+        *respmodseq = row->modseq;
+
+        /* Tell client we truncated the responses */
+        xml_add_response(fctx, HTTP_NO_STORAGE, DAV_OVER_LIMIT);
+    }
+    else {
+        /* Full response - respmodseq will be highestmodseq of mailbox */
+        *respmodseq = mailbox->i.highestmodseq;
+    }
+
+    /* Report the resources within the client requested limit (if any) */
+    for (i = 0; i < (int) nresp; i++) {
+        row = ptrarray_nth(&rows, i);
+
+        if (!row->alive) {
+            /* report as NOT FOUND
+               IMAP UID of 0 will cause index record to be ignored
+               propfind_by_resource() will append our resource name */
+            struct dav_data ddata;
+
+            memset(&ddata, 0, sizeof(struct dav_data));
+            ddata.resource = row->resource;
+            fctx->proc_by_resource(fctx, &ddata);
+        }
+        else {
+            struct dav_data *ddata;
+
+            rparams->davdb.lookup_resource(fctx->davdb, mailbox->name,
+                                           row->resource, (void **) &ddata, 0);
+            ddata->resource = row->resource;
+            fctx->record = &row->record;
+            fctx->proc_by_resource(fctx, ddata);
+        }
+
+        fctx->record = NULL;
+    }
+
+  done:
+    for (i = 0; i < ptrarray_size(&rows); i++) {
+        row = ptrarray_nth(&rows, i);
+        free(row->resource);
+        free(row);
+    }
+    ptrarray_fini(&rows);
+
+    return ret;
+}
 
 /* DAV:sync-collection REPORT */
 int report_sync_col(struct transaction_t *txn,
@@ -7293,6 +7728,16 @@ int report_sync_col(struct transaction_t *txn,
         basemodseq = highestmodseq;
     }
 
+    if (rparams->davdb.foreach_changed) {
+        /* Serve the delta from a modseq-ordered scan of the DAV DB */
+        ret = report_sync_changes(rparams, fctx, syncmodseq, basemodseq,
+                                  limit, &respmodseq,
+                                  unbind_flag, unchanged_flag);
+        if (ret) goto done;
+
+        goto resptoken;
+    }
+
     /* Construct array of records for sorting and/or fetching cached header */
     istate.mailbox = mailbox;
     istate.map = xzmalloc(mailbox->i.num_records *
@@ -7417,7 +7862,11 @@ int report_sync_col(struct transaction_t *txn,
         fctx->record = NULL;
     }
 
-    if (fctx->davdb) rparams->davdb.close_db(fctx->davdb);
+  resptoken:
+    if (fctx->davdb) {
+        rparams->davdb.close_db(fctx->davdb);
+        fctx->davdb = NULL;
+    }
 
     /* Add sync-token element */
     if (respmodseq < basemodseq) {
@@ -7434,6 +7883,10 @@ int report_sync_col(struct transaction_t *txn,
     xmlNewChild(fctx->root, NULL, BAD_CAST "sync-token", BAD_CAST tokenuri);
 
   done:
+    if (fctx->davdb) {
+        rparams->davdb.close_db(fctx->davdb);
+        fctx->davdb = NULL;
+    }
     if (istate.map) free(istate.map);
     mailbox_close(&mailbox);
 
@@ -8879,6 +9332,7 @@ struct meth_params notify_params = {
       (db_proc_t) &webdav_abort,
       (db_lookup_proc_t) &webdav_lookup_resource,
       (db_foreach_proc_t) &webdav_foreach,
+      NULL,                                     /* No modseq-ordered scan */
       (db_write_proc_t) &webdav_write,
       (db_delete_proc_t) &webdav_delete },
     NULL,                                       /* No ACL extensions */
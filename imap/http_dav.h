@@ -420,6 +420,14 @@ typedef int (*db_delete_proc_t)(void *davdb, unsigned rowid);
 
 typedef int (*db_proc_t)(void *davdb);
 
+/* Function to process each resource in 'mailbox' with a modseq higher
+   than 'oldmodseq' with cb(), in ascending order of modseq,
+   tombstones included */
+typedef int (*db_changes_proc_t)(void *davdb, const char *mailbox,
+                                 modseq_t oldmodseq,
+                                 int (*cb)(void *rock, void *data),
+                                 void *rock);
+
 struct davdb_params {
     db_open_proc_t open_db;             /* open DAV DB for a given mailbox */
     db_close_proc_t close_db;           /* close DAV DB for a given mailbox */
@@ -428,6 +436,9 @@ struct davdb_params {
     db_proc_t abort_transaction;
     db_lookup_proc_t lookup_resource;   /* lookup a specific resource */
     db_foreach_proc_t foreach_resource; /* process all resources in a mailbox */
+    db_changes_proc_t foreach_changed;  /* process resources changed since a
+                                           given modseq (NULL = do a full
+                                           index walk instead) */
     /* XXX - convert these to lock management only.  For everything else,
      * we need to go via mailbox.c for replication support */
     db_write_proc_t write_resourceLOCKONLY;     /* write a specific resource */
@@ -678,6 +689,9 @@ int ensure_ns(xmlNsPtr *respNs, int ns, xmlNodePtr node,
               const char *url, const char *prefix);
 
 int xml_add_response(struct propfind_ctx *fctx, long code, unsigned precond);
+void xml_partial_response(struct transaction_t *txn,
+                          xmlDocPtr doc, xmlNodePtr node,
+                          unsigned level, xmlBufferPtr *buf);
 int propfind_by_resource(void *rock, void *data);
 int propfind_by_collection(const mbentry_t *mbentry, void *rock);
 int expand_property(xmlNodePtr inroot, struct propfind_ctx *fctx,
@@ -669,6 +669,35 @@ EXPORTED int jmap_download(struct transaction_t *txn)
         goto done;
     }
 
+    /* Blobs are immutable and addressed by GUID, so they make ideal
+       candidates for conditional and ranged requests */
+    txn->flags.ranges = 1;
+
+    /* the ETag has to outlive this function - error_response() emits
+       it for the 304 case after we've freed blobid - so keep it in
+       txn->buf like the other handlers do */
+    buf_setcstr(&txn->buf, blobid);
+    time_t lastmod = record->internaldate;
+    int precond = check_precond(txn, buf_cstring(&txn->buf), lastmod);
+
+    switch (precond) {
+    case HTTP_OK:
+    case HTTP_PARTIAL:
+    case HTTP_NOT_MODIFIED:
+        /* Fill in ETag, Last-Modified, and Expires */
+        txn->resp_body.etag = buf_cstring(&txn->buf);
+        txn->resp_body.lastmod = lastmod;
+        txn->resp_body.maxage = 31536000;  /* 1 year */
+        txn->flags.cc |= CC_MAXAGE;
+
+        if (precond != HTTP_NOT_MODIFIED) break;
+
+    default:
+        /* We failed a precondition - don't perform the request */
+        res = precond;
+        goto done;
+    }
+
     // default with no part is the whole message
     const char *base = msg_buf.s;
     size_t len = msg_buf.len;
@@ -706,7 +735,10 @@ EXPORTED int jmap_download(struct transaction_t *txn)
     txn->resp_body.len = len;
     txn->resp_body.fname = name;
 
-    write_body(HTTP_OK, txn, base, len);
+    /* base either points straight into the zero-copy mmap of the spool
+       file (identity encoding) or at the decoded copy; write_body()
+       handles single and multipart byte ranges from there */
+    write_body(precond, txn, base, len);
 
  done:
     free(decbuf);
@@ -486,7 +486,8 @@ EXPORTED int http_mlookup(const char *name, mbentry_t **mbentryp, void *tid)
     int r;
 
     r = mboxlist_lookup(name, &mbentry, tid);
-    if (r == IMAP_MAILBOX_NONEXISTENT && config_mupdate_server) {
+    if (r == IMAP_MAILBOX_NONEXISTENT && config_mupdate_server &&
+        mupdate_bloom_check(name)) {
         kick_mupdate();
         r = mboxlist_lookup(name, &mbentry, tid);
     }
@@ -58,6 +58,7 @@
 #include <assert.h>
 #include <errno.h>
 
+#include "cyrusdb.h"
 #include "global.h"
 #include "hash.h"
 #include "httpd.h"
@@ -81,6 +82,10 @@
 
 #define TZDIST_WELLKNOWN_URI "/.well-known/timezone"
 
+/* name and record version of the shared timezone expansion cache */
+#define FNAME_TZCACHEDB "/tzcache.db"
+#define TZCACHE_VERSION 1
+
 static time_t compile_time;
 static unsigned synctoken_prefix;
 static ptrarray_t *leap_seconds = NULL;
@@ -93,6 +98,7 @@ static int action_leap(struct transaction_t *txn);
 static int action_list(struct transaction_t *txn);
 static int action_get(struct transaction_t *txn);
 static int action_expand(struct transaction_t *txn);
+static void tzcache_close(void);
 static int json_response(int code, struct transaction_t *txn, json_t *root,
                          char **resp);
 static int json_error_response(struct transaction_t *txn, long tz_code,
@@ -677,6 +683,8 @@ static void tzdist_shutdown(void)
 {
     struct leapsec *leap;
 
+    tzcache_close();
+
     zoneinfo_close(NULL);
 
     close_shape_file();
@@ -1930,6 +1938,156 @@ static const char *mon[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
     tt.day, tt.hour, tt.minute, tt.second, tt.year
 
 
+/* Process-shared cache of expanded transition tables, keyed by
+ * (tzid, start, end) and validated against the zoneinfo dtstamp.
+ * Expanding observances (parse + recurrence expansion) dominates the
+ * cost of an expand request, so every httpd process reuses tables
+ * computed by any of them */
+static struct db *tzcachedb = NULL;
+static int tzcachedb_tried = 0;
+
+static int tzcache_open(void)
+{
+    if (tzcachedb) return 1;
+    if (tzcachedb_tried) return 0;
+    tzcachedb_tried = 1;
+
+    const char *fname = config_getstring(IMAPOPT_TZCACHE_DB_PATH);
+    char *tofree = NULL;
+
+    /* create db file name */
+    if (!fname) {
+        tofree = strconcat(config_dir, FNAME_TZCACHEDB, (char *)NULL);
+        fname = tofree;
+    }
+
+    int r = cyrusdb_open(config_tzcache_db, fname, CYRUSDB_CREATE, &tzcachedb);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
+               cyrusdb_strerror(r));
+        tzcachedb = NULL;
+    }
+
+    free(tofree);
+
+    return (tzcachedb != NULL);
+}
+
+static void tzcache_close(void)
+{
+    if (tzcachedb) {
+        int r = cyrusdb_close(tzcachedb);
+        if (r) {
+            syslog(LOG_ERR, "DBERROR: error closing tzcache: %s",
+                   cyrusdb_strerror(r));
+        }
+        tzcachedb = NULL;
+    }
+}
+
+static void tzcache_makekey(struct buf *key, const char *tzid,
+                            icaltimetype *start, icaltimetype *end)
+{
+    buf_reset(key);
+    buf_printf(key, "%s\n%s\n%s", tzid,
+               icaltime_as_ical_string(*start),
+               icaltime_as_ical_string(*end));
+}
+
+/* Return the cached observances as a JSON array, or NULL on a miss.
+ * A record whose dtstamp no longer matches the zoneinfo record is
+ * dropped - the zone changed since it was expanded */
+static json_t *tzcache_fetch(const char *tzid,
+                             icaltimetype *start, icaltimetype *end,
+                             time_t dtstamp)
+{
+    struct buf key = BUF_INITIALIZER;
+    const char *data = NULL;
+    size_t datalen = 0;
+    json_t *jobsarray = NULL;
+    unsigned vers;
+    long stamp;
+    int r, n;
+
+    if (!tzcache_open()) return NULL;
+
+    tzcache_makekey(&key, tzid, start, end);
+
+    r = cyrusdb_fetch(tzcachedb, buf_cstring(&key), buf_len(&key),
+                      &data, &datalen, NULL);
+    if (r || !data) goto done;
+
+    char *copy = xstrndup(data, datalen);
+    char *line = copy;
+    char *eol = strchr(line, '\n');
+
+    if (!eol || sscanf(line, "%u %ld", &vers, &stamp) != 2 ||
+        vers != TZCACHE_VERSION || stamp != (long) dtstamp) {
+        /* stale or unparsable - remove it */
+        cyrusdb_delete(tzcachedb, buf_cstring(&key), buf_len(&key), NULL, 1);
+        free(copy);
+        goto done;
+    }
+
+    jobsarray = json_array();
+
+    for (line = eol + 1; (eol = strchr(line, '\n')); line = eol + 1) {
+        char onset[33];
+        int from, to;
+
+        *eol = '\0';
+        if (sscanf(line, "%32s %d %d %n", onset, &from, &to, &n) < 3) continue;
+
+        json_array_append_new(jobsarray,
+                              json_pack("{s:s s:s s:i s:i}",
+                                        "name", line + n,
+                                        "onset", onset,
+                                        "utc-offset-from", from,
+                                        "utc-offset-to", to));
+    }
+
+    free(copy);
+
+  done:
+    buf_free(&key);
+    return jobsarray;
+}
+
+static void tzcache_store(const char *tzid,
+                          icaltimetype *start, icaltimetype *end,
+                          time_t dtstamp, icalarray *obsarray)
+{
+    struct buf key = BUF_INITIALIZER, val = BUF_INITIALIZER;
+    unsigned n;
+    int r;
+
+    if (!tzcache_open()) return;
+
+    tzcache_makekey(&key, tzid, start, end);
+
+    buf_printf(&val, "%u %ld\n", TZCACHE_VERSION, (long) dtstamp);
+
+    for (n = 0; n < obsarray->num_elements; n++) {
+        struct observance *obs = icalarray_element_at(obsarray, n);
+
+        /* onset is stored in the ISO form the JSON response uses */
+        buf_printf(&val, "%s %d %d %s\n",
+                   icaltime_as_iso_string(obs->onset),
+                   obs->offset_from, obs->offset_to, obs->name);
+    }
+
+    r = cyrusdb_store(tzcachedb, buf_cstring(&key), buf_len(&key),
+                      buf_cstring(&val), buf_len(&val), NULL);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: error storing tzcache entry for %s: %s",
+               tzid, cyrusdb_strerror(r));
+    }
+
+    buf_free(&key);
+    buf_free(&val);
+}
+
+
 /* Perform an expand action */
 static int action_expand(struct transaction_t *txn)
 {
@@ -2020,33 +2178,39 @@ static int action_expand(struct transaction_t *txn)
         static struct buf pathbuf = BUF_INITIALIZER;
         const char *path, *msg_base = NULL;
         size_t msg_size = 0;
-        icalcomponent *ical, *vtz;
+        icalcomponent *ical = NULL, *vtz;
         struct observance *proleptic;
-        icalarray *obsarray;
-        json_t *jobsarray;
+        icalarray *obsarray = NULL;
+        json_t *jobsarray = NULL;
         unsigned n;
         int fd;
 
-        /* Open, mmap, and parse the file */
-        buf_reset(&pathbuf);
-        buf_printf(&pathbuf, "%s%s/%s.ics",
-                   config_dir, FNAME_ZONEINFODIR, tzid);
-        path = buf_cstring(&pathbuf);
-        if ((fd = open(path, O_RDONLY)) == -1) return HTTP_SERVER_ERROR;
+        /* zdump is for debugging - it always re-expands */
+        if (!zdump) jobsarray = tzcache_fetch(tzid, &start, &end, lastmod);
 
-        map_refresh(fd, 1, &msg_base, &msg_size, MAP_UNKNOWN_LEN, path, NULL);
-        if (!msg_base) return HTTP_SERVER_ERROR;
+        if (!jobsarray) {
+            /* Open, mmap, and parse the file */
+            buf_reset(&pathbuf);
+            buf_printf(&pathbuf, "%s%s/%s.ics",
+                       config_dir, FNAME_ZONEINFODIR, tzid);
+            path = buf_cstring(&pathbuf);
+            if ((fd = open(path, O_RDONLY)) == -1) return HTTP_SERVER_ERROR;
 
-        ical = icalparser_parse_string(msg_base);
-        map_free(&msg_base, &msg_size);
-        close(fd);
+            map_refresh(fd, 1, &msg_base, &msg_size, MAP_UNKNOWN_LEN, path, NULL);
+            if (!msg_base) return HTTP_SERVER_ERROR;
 
+            ical = icalparser_parse_string(msg_base);
+            map_free(&msg_base, &msg_size);
+            close(fd);
 
-        /* Create an array of observances */
-        obsarray = icalarray_new(sizeof(struct observance), 20);
-        vtz = icalcomponent_get_first_component(ical, ICAL_VTIMEZONE_COMPONENT);
-        truncate_vtimezone(vtz, &start, &end, obsarray, &proleptic,
-                           NULL, NULL, NULL);
+
+            /* Create an array of observances */
+            obsarray = icalarray_new(sizeof(struct observance), 20);
+            vtz = icalcomponent_get_first_component(ical,
+                                                    ICAL_VTIMEZONE_COMPONENT);
+            truncate_vtimezone(vtz, &start, &end, obsarray, &proleptic,
+                               NULL, NULL, NULL);
+        }
 
         if (zdump) {
             struct buf *body = &txn->resp_body.payload;
@@ -2105,25 +2269,30 @@ static int action_expand(struct transaction_t *txn)
             json_object_set_new(root, "end",
                                 json_string(icaltime_as_iso_string(end)));
 
-            /* Add observances to JSON array */
-            jobsarray = json_array();
-            for (n = 0; n < obsarray->num_elements; n++) {
-                struct observance *obs = icalarray_element_at(obsarray, n);
+            if (!jobsarray) {
+                /* Add observances to JSON array */
+                jobsarray = json_array();
+                for (n = 0; n < obsarray->num_elements; n++) {
+                    struct observance *obs = icalarray_element_at(obsarray, n);
+
+                    json_array_append_new(jobsarray,
+                                          json_pack(
+                                              "{s:s s:s s:i s:i}",
+                                              "name", obs->name,
+                                              "onset",
+                                              icaltime_as_iso_string(obs->onset),
+                                              "utc-offset-from", obs->offset_from,
+                                              "utc-offset-to", obs->offset_to));
+                }
 
-                json_array_append_new(jobsarray,
-                                      json_pack(
-                                          "{s:s s:s s:i s:i}",
-                                          "name", obs->name,
-                                          "onset",
-                                          icaltime_as_iso_string(obs->onset),
-                                          "utc-offset-from", obs->offset_from,
-                                          "utc-offset-to", obs->offset_to));
+                /* share the expansion with the other httpd processes */
+                tzcache_store(tzid, &start, &end, lastmod, obsarray);
             }
             json_object_set_new(root, "observances", jobsarray);
         }
-        icalarray_free(obsarray);
+        if (obsarray) icalarray_free(obsarray);
 
-        icalcomponent_free(ical);
+        if (ical) icalcomponent_free(ical);
     }
 
     if (zdump) {
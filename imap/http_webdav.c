@@ -212,6 +212,7 @@ struct meth_params webdav_params = {
       (db_proc_t) &webdav_abort,
       (db_lookup_proc_t) &webdav_lookup_resource,
       (db_foreach_proc_t) &webdav_foreach,
+      NULL,                                     /* No modseq-ordered scan */
       (db_write_proc_t) &webdav_write,
       (db_delete_proc_t) &webdav_delete },
     NULL,                                       /* No ACL extensions */
@@ -1932,24 +1932,43 @@ static void cmdloop(struct http_connection *conn)
 
         /* Check for input from client */
         do {
-            /* Flush any buffered output */
+            size_t npeek = 0;
+
+            /* A pipelined request may already be sitting in our input
+             * buffer: go straight back to parsing rather than flushing
+             * and select()ing per request.  The responses accumulate in
+             * the output buffer and are written in bulk as soon as we
+             * next have to wait for the socket (prot flushes the output
+             * side before any blocking read), so a sync client's burst
+             * of requests turns into a few large writes instead of one
+             * small packet per response. */
+            if (!backend_current
 #ifdef HAVE_NGHTTP2
-            if (conn->http2_session &&
-                nghttp2_session_want_write(conn->http2_session)) {
-                /* Send queued frame(s) */
-                int r = nghttp2_session_send(conn->http2_session);
-                if (r) {
-                    syslog(LOG_ERR,
-                           "nghttp2_session_send: %s", nghttp2_strerror(r));
-                    /* XXX  can we do anything else here? */
-                    transaction_free(&txn);
-                    return;
+                && !conn->http2_session
+#endif
+                )
+                (void) prot_peek(httpd_in, &npeek);
+
+            if (!npeek) {
+                /* Flush any buffered output */
+#ifdef HAVE_NGHTTP2
+                if (conn->http2_session &&
+                    nghttp2_session_want_write(conn->http2_session)) {
+                    /* Send queued frame(s) */
+                    int r = nghttp2_session_send(conn->http2_session);
+                    if (r) {
+                        syslog(LOG_ERR,
+                               "nghttp2_session_send: %s", nghttp2_strerror(r));
+                        /* XXX  can we do anything else here? */
+                        transaction_free(&txn);
+                        return;
+                    }
                 }
-            }
 #endif /* HAVE_NGHTTP2 */
 
-            prot_flush(httpd_out);
-            if (backend_current) prot_flush(backend_current->out);
+                prot_flush(httpd_out);
+                if (backend_current) prot_flush(backend_current->out);
+            }
 
             /* Check for shutdown file */
             if (shutdown_file(txn.buf.s, txn.buf.alloc) ||
@@ -1962,6 +1981,8 @@ static void cmdloop(struct http_connection *conn)
 
             signals_poll();
 
+            if (npeek) break;
+
         } while (!proxy_check_input(protin, httpd_in, httpd_out,
                                     backend_current ? backend_current->in : NULL,
                                     NULL, 0));
@@ -3247,6 +3268,84 @@ static void multipart_byteranges(struct transaction_t *txn,
 }
 
 
+/* Cache of compressed response payloads.
+ *
+ * The same representations get served over and over - tzdist data,
+ * well-known static content, frequently polled resources - and each
+ * time we deflated the identical bytes again.  Self-contained (non
+ * chunked) responses that carry an entity tag are content-addressed
+ * here by encoding, ETag, path and query, so the next request for an
+ * unchanged resource reuses the compressed bytes.  A new ETag simply
+ * misses and gets compressed as before.  The httpcompresscache option
+ * bounds the total compressed bytes kept per process; when the budget
+ * is exceeded the cache is dumped wholesale and the representations
+ * still being served repopulate it. */
+struct zcache_entry {
+    struct buf data;
+};
+
+static struct hash_table zcache;
+static size_t zcache_size = 0;
+
+static void zcache_entry_free(void *data)
+{
+    struct zcache_entry *entry = data;
+
+    buf_free(&entry->data);
+    free(entry);
+}
+
+static void zcache_key(struct transaction_t *txn, struct buf *key)
+{
+    buf_printf(key, "%u:%s:%s:%s", txn->resp_body.enc,
+               txn->resp_body.etag,
+               txn->req_uri && txn->req_uri->path ?
+               (const char *) txn->req_uri->path : "",
+               txn->req_uri && txn->req_uri->query ?
+               (const char *) txn->req_uri->query : "");
+}
+
+static struct buf *zcache_fetch(struct transaction_t *txn)
+{
+    struct zcache_entry *entry;
+    struct buf key = BUF_INITIALIZER;
+
+    if (!zcache.size) return NULL;
+
+    zcache_key(txn, &key);
+    entry = hash_lookup(buf_cstring(&key), &zcache);
+    buf_free(&key);
+
+    return entry ? &entry->data : NULL;
+}
+
+static void zcache_store(struct transaction_t *txn,
+                         const char *data, unsigned len)
+{
+    struct zcache_entry *entry;
+    struct buf key = BUF_INITIALIZER;
+    size_t max = (size_t) config_getint(IMAPOPT_HTTPCOMPRESSCACHE) * 1024;
+
+    if (len > max) return;
+
+    if (zcache_size + len > max) {
+        /* Over budget: dump the lot and let the hot payloads repopulate */
+        free_hash_table(&zcache, &zcache_entry_free);
+        zcache_size = 0;
+    }
+
+    if (!zcache.size) construct_hash_table(&zcache, 1024, 0);
+
+    entry = xzmalloc(sizeof(struct zcache_entry));
+    buf_appendmap(&entry->data, data, len);
+
+    zcache_key(txn, &key);
+    hash_insert(buf_cstring(&key), entry, &zcache);
+    zcache_size += len;
+    buf_free(&key);
+}
+
+
 /*
  * Output an HTTP response with body data, compressed as necessary.
  *
@@ -3264,6 +3363,8 @@ EXPORTED void write_body(long code, struct transaction_t *txn,
     unsigned outlen = len, offset = 0, last_chunk;
     int do_md5 = (txn->meth == METH_HEAD) ? 0 :
         config_getswitch(IMAPOPT_HTTPCONTENTMD5);
+    int cacheable = 0;
+    struct buf *zcached = NULL;
     static MD5_CTX ctx;
     static unsigned char md5[MD5_DIGEST_LENGTH];
 
@@ -3282,8 +3383,22 @@ EXPORTED void write_body(long code, struct transaction_t *txn,
         }
     }
 
+    /* A self-contained response with an entity tag may reuse (or feed)
+       the compressed payload cache */
+    if (code && last_chunk && !(txn->flags.te & TE_CHUNKED) &&
+        txn->resp_body.enc && txn->resp_body.etag &&
+        config_getint(IMAPOPT_HTTPCOMPRESSCACHE) > 0) {
+        cacheable = 1;
+        zcached = zcache_fetch(txn);
+    }
+
     /* Compress data */
-    if (txn->resp_body.enc == CE_BR) {
+    if (zcached) {
+        /* Same representation, same encoding: skip the compressor */
+        buf = buf_base(zcached);
+        outlen = buf_len(zcached);
+    }
+    else if (txn->resp_body.enc == CE_BR) {
 #ifdef HAVE_BROTLI
         /* Only flush for static content or on last (zero-length) chunk */
         unsigned op = last_chunk ?
@@ -3373,6 +3488,8 @@ EXPORTED void write_body(long code, struct transaction_t *txn,
 #endif /* HAVE_ZLIB */
     }
 
+    if (cacheable && !zcached) zcache_store(txn, buf, outlen);
+
     if (code) {
         /* Initial call - prepare response header based on CE, TE and version */
         if (do_md5) MD5Init(&ctx);
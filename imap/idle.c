@@ -59,6 +59,7 @@
 #include "idlemsg.h"
 #include "global.h"
 #include "util.h"
+#include "xmalloc.h"
 
 HIDDEN const char *idle_method_desc = "no";
 
@@ -69,6 +70,13 @@ static struct sockaddr_un idle_remote;
  * that we want to be notified of changes */
 static int idle_started;
 
+/* mailbox we are idling on, and the event counter we last saw for it */
+static char *idle_mboxname = NULL;
+static uint32_t idle_counter_seen;
+
+/* true if idled owes us no notification until we re-arm (see idled.c) */
+static int idle_rearm_needed;
+
 /* Send the message 'which' about the mailbox 'mboxname' to the idled.
  * Returns 0 on success or an IMAP error code on failure */
 static int idle_send_msg(int which, const char *mboxname)
@@ -93,6 +101,10 @@ static void idle_notify(const char *mboxname)
 {
     int r;
 
+    /* publish the event where every watcher can see it - this is O(1)
+     * however many sessions are idling on the mailbox */
+    idle_counter_bump(mboxname);
+
     /* We should try to determine if we need to send this
      * (ie, is an imapd is IDLE on 'mailbox'?).
      */
@@ -127,6 +139,11 @@ EXPORTED void idle_init(void)
     /* set the mailbox update notifier */
     mailbox_set_updatenotifier(idle_notify);
 
+    /* map the shared event counter table (no-op unless enabled).
+     * Useful even if idled can't be contacted: the poll fallback
+     * then only rechecks the mailbox when a counter has moved */
+    idle_counters_init();
+
     if (!idle_init_sock(&local))
         return;
 
@@ -158,6 +175,11 @@ EXPORTED void idle_start(const char *mboxname)
 
     if (!idle_enabled()) return;
 
+    free(idle_mboxname);
+    idle_mboxname = xstrdupnull(mboxname);
+    idle_counter_seen = idle_counter_read(idle_mboxname);
+    idle_rearm_needed = 0;
+
     /* Tell idled that we're idling.  It doesn't
      * matter if it fails, we'll still poll */
     r = idle_send_msg(IDLE_MSG_INIT, mboxname);
@@ -173,9 +195,9 @@ EXPORTED void idle_start(const char *mboxname)
     idle_started = 1;
 }
 
-EXPORTED int idle_wait(int otherfd)
+EXPORTED int idle_wait(int otherfd, int writefd)
 {
-    fd_set rfds;
+    fd_set rfds, wfds;
     int maxfd = -1;
     int s = -1;
     struct timeval timeout;
@@ -185,12 +207,22 @@ EXPORTED int idle_wait(int otherfd)
 
     if (!idle_enabled()) return 0;
 
+    /* tell idled we've processed its last notification, so it will
+     * wake us for the next one (it collapses events while we're
+     * busy - see idled.c).  If the re-arm is lost we fall back to
+     * polling, same as for a lost notification */
+    if (idle_rearm_needed && idle_started) {
+        (void)idle_send_msg(IDLE_MSG_REARM, idle_mboxname);
+        idle_rearm_needed = 0;
+    }
+
     /* If idled was not contacted, we still listen on the socket,
      * because we might get ALERTs, but we won't get mailbox
      * notifications.  The poll timeout controls how quickly
      * we will notice new mail arriving. */
 
     FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
     s = idle_get_sock();
     if (s >= 0) {
         FD_SET(s, &rfds);
@@ -200,6 +232,10 @@ EXPORTED int idle_wait(int otherfd)
         FD_SET(otherfd, &rfds);
         maxfd = MAX(maxfd, otherfd);
     }
+    if (writefd >= 0) {
+        FD_SET(writefd, &wfds);
+        maxfd = MAX(maxfd, writefd);
+    }
 
     /* Note: it's technically valid for there to be no fds to listen
      * to, in the case where @otherfd is passed as -1 and we failed
@@ -211,7 +247,8 @@ EXPORTED int idle_wait(int otherfd)
     timeout.tv_usec = 0;
 
     do {
-        r = signals_select(maxfd+1, &rfds, NULL, NULL, &timeout);
+        r = signals_select(maxfd+1, &rfds, writefd >= 0 ? &wfds : NULL,
+                           NULL, &timeout);
 
         if (r < 0) {
             if (errno == EAGAIN || errno == EINTR) continue;
@@ -220,7 +257,20 @@ EXPORTED int idle_wait(int otherfd)
         }
         if (r == 0) {
             /* timeout */
-            flags |= IDLE_MAILBOX|IDLE_ALERT;
+            flags |= IDLE_ALERT;
+            if (idle_counters_active() && idle_mboxname) {
+                /* the counter table tells us whether the mailbox has
+                 * actually changed, so an unchanged mailbox costs a
+                 * word read instead of a full recheck */
+                uint32_t counter = idle_counter_read(idle_mboxname);
+                if (counter != idle_counter_seen) {
+                    idle_counter_seen = counter;
+                    flags |= IDLE_MAILBOX;
+                }
+            }
+            else {
+                flags |= IDLE_MAILBOX;
+            }
         }
         if (r > 0 && s >= 0 && FD_ISSET(s, &rfds)) {
             struct sockaddr_un from;
@@ -230,6 +280,9 @@ EXPORTED int idle_wait(int otherfd)
                 switch (msg.which) {
                 case IDLE_MSG_NOTIFY:
                     flags |= IDLE_MAILBOX;
+                    idle_counter_seen = idle_counter_read(idle_mboxname);
+                    if (idle_counters_active())
+                        idle_rearm_needed = 1;
                     break;
                 case IDLE_MSG_ALERT:
                     flags |= IDLE_ALERT;
@@ -239,6 +292,8 @@ EXPORTED int idle_wait(int otherfd)
         }
         if (r > 0 && otherfd >= 0 && FD_ISSET(otherfd, &rfds))
             flags |= IDLE_INPUT;
+        if (r > 0 && writefd >= 0 && FD_ISSET(writefd, &wfds))
+            flags |= IDLE_OUTPUT;
     } while (!flags);
 
     return flags;
@@ -259,11 +314,17 @@ EXPORTED void idle_stop(const char *mboxname)
                         mboxname, error_message(r));
     }
 
+    free(idle_mboxname);
+    idle_mboxname = NULL;
+    idle_rearm_needed = 0;
+
     idle_started = 0;
 }
 
 EXPORTED void idle_done(void)
 {
+    idle_counters_done();
+
     /* close the local socket */
     idle_done_sock();
 }
@@ -55,7 +55,10 @@ typedef enum {
     IDLE_ALERT =        0x2,
     /* input was detected on the @otherfd, probably because the IMAP
      * client cancelled the IDLE */
-    IDLE_INPUT =        0x4
+    IDLE_INPUT =        0x4,
+    /* the @writefd became writable again, so previously queued
+     * output can be flushed to the client */
+    IDLE_OUTPUT =       0x8
 } idle_flags_t;
 
 typedef void idle_updateproc_t(idle_flags_t flags);
@@ -71,13 +74,15 @@ void idle_start(const char *mboxname);
 
 /* Wait for something to happen while IDLEing.  @otherfd is a file
  * descriptor on which to wait for input; presumably this will be the
- * fd of the main protstream from the IMAP client.  Returns a mask of
- * flags indicating what if anything happened, see idle_flags_t, or 0
- * on error.  If idled is disabled or was not contacted, we fall back
- * to polling mode and return the flags IDLE_MAILBOX and IDLE_INPUT
- * periodically.
+ * fd of the main protstream from the IMAP client.  @writefd is a file
+ * descriptor on which to wait for writability, or -1; pass the fd of
+ * the output protstream when a nonblocking flush has left output
+ * queued for a slow client.  Returns a mask of flags indicating what
+ * if anything happened, see idle_flags_t, or 0 on error.  If idled is
+ * disabled or was not contacted, we fall back to polling mode and
+ * return the flags IDLE_MAILBOX and IDLE_INPUT periodically.
  */
-int idle_wait(int otherfd);
+int idle_wait(int otherfd, int writefd);
 
 /* Stop IDLEing on 'mailbox'. */
 void idle_stop(const char *mboxname);
@@ -72,10 +72,18 @@ static time_t idle_timeout;
 struct ientry {
     struct sockaddr_un remote;
     time_t itime;
+    int pending;        /* notified, waiting for the client to re-arm */
+    int suppressed;     /* events arrived while waiting */
     struct ientry *next;
 };
 static struct hash_table itable;
 
+/* collapse notifications per client until it re-arms (IDLE_MSG_REARM),
+ * so a busy shared folder costs one datagram per watcher per
+ * processing cycle instead of one per event.  Needs all services to
+ * understand the scheme, hence the config switch */
+static int event_counters = 0;
+
 EXPORTED void fatal(const char *msg, int err)
 {
     if (debugmode) fprintf(stderr, "dying with %s %d\n",msg,err);
@@ -164,12 +172,23 @@ static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
 
                 remove_ientry(msg->mboxname, &t->remote);
             }
+            else if (event_counters && t->pending) {
+                /* this client hasn't processed our last notification
+                 * yet; it re-checks the mailbox when it re-arms, so
+                 * there's no point waking it again before then */
+                if (verbose || debugmode)
+                    syslog(LOG_DEBUG, "    collapse NOTIFY %s\n", idle_id_from_addr(&t->remote));
+
+                t->suppressed = 1;
+            }
             else { /* signal process to update */
                 if (verbose || debugmode)
                     syslog(LOG_DEBUG, "    fwd NOTIFY %s\n", idle_id_from_addr(&t->remote));
 
                 /* forward the received msg onto our clients */
                 r = idle_send(&t->remote, msg);
+                if (!r && event_counters)
+                    t->pending = 1;
                 if (r) {
                     /* ENOENT can happen as result of a race between delivering
                      * messages and shutting down imapd.  It indicates that the
@@ -198,6 +217,33 @@ static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
         remove_ientry(msg->mboxname, remote);
         break;
 
+    case IDLE_MSG_REARM:
+        if (verbose || debugmode)
+            syslog(LOG_DEBUG, "imapd[%s]: IDLE_MSG_REARM '%s'\n",
+                   idle_id_from_addr(remote), msg->mboxname);
+
+        /* the client has processed our last notification */
+        t = (struct ientry *) hash_lookup(msg->mboxname, &itable);
+        while (t && memcmp(&t->remote, remote, sizeof(*remote)))
+            t = t->next;
+        if (t) {
+            t->pending = 0;
+            t->itime = time(NULL);
+            if (t->suppressed) {
+                /* events were collapsed while the client was busy -
+                 * wake it once more so it re-checks the mailbox */
+                idle_message_t notify;
+
+                notify.which = IDLE_MSG_NOTIFY;
+                xstrncpy(notify.mboxname, msg->mboxname,
+                         sizeof(notify.mboxname));
+                t->suppressed = 0;
+                if (!idle_send(&t->remote, &notify))
+                    t->pending = 1;
+            }
+        }
+        break;
+
     case IDLE_MSG_NOOP:
         break;
 
@@ -293,6 +339,8 @@ int main(int argc, char **argv)
 
     cyrus_init(alt_config, "idled", 0, 0);
 
+    event_counters = config_getswitch(IMAPOPT_IDLE_EVENT_COUNTERS);
+
     /* Set inactivity timer (convert from minutes to seconds) */
     idle_timeout = config_getint(IMAPOPT_TIMEOUT);
     if (idle_timeout < 30) idle_timeout = 30;
@@ -46,6 +46,8 @@
 #include <sys/un.h>
 #include <syslog.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
 #include <fcntl.h>
 #include <errno.h>
 #ifdef HAVE_UNISTD_H
@@ -59,6 +61,7 @@
 #include "xstrlcat.h"
 #include "idlemsg.h"
 #include "global.h"
+#include "strhash.h"
 
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
@@ -212,3 +215,117 @@ EXPORTED int idle_recv(struct sockaddr_un *remote, idle_message_t *msg)
     return 1;
 }
 
+/*
+ * Shared event counter table.
+ *
+ * A small mmap'd table of per-mailbox generation counters in
+ * {configdirectory}/idle.counters.  A process changing a mailbox bumps
+ * the counter in that mailbox's hash slot, which costs the same no
+ * matter how many sessions are watching the mailbox; idling processes
+ * remember the value they last saw and compare it on their poll
+ * timeout, and idled uses it to collapse notification storms on busy
+ * shared folders.
+ *
+ * Increments are plain stores - two writers hitting the same slot at
+ * the same instant can lose a count, which merely delays the
+ * notification until the next poll interval, exactly as a lost
+ * datagram does today.  Hash collisions cause the occasional spurious
+ * mailbox check, never a missed one.  Only used when the
+ * "idle_event_counters" option is enabled.
+ */
+
+#define IDLE_COUNTERS_MAGIC   ((uint32_t)0x49444c43)   /* "IDLC" */
+#define IDLE_COUNTERS_VERSION ((uint32_t)1)
+#define IDLE_COUNTERS_SLOTS   4096
+#define IDLE_COUNTERS_HEADER  (4 * (int)sizeof(uint32_t))
+#define IDLE_COUNTERS_SIZE \
+    (IDLE_COUNTERS_HEADER + IDLE_COUNTERS_SLOTS * (int)sizeof(uint32_t))
+
+/* slot array within the mapping, or NULL if not (successfully) mapped */
+static uint32_t *idle_counters = NULL;
+
+EXPORTED int idle_counters_init(void)
+{
+    char fname[MAX_MAILBOX_PATH+1];
+    uint32_t header[4];
+    struct stat sbuf;
+    void *base;
+    int fd;
+
+    if (idle_counters) return 1;
+
+    if (!config_getswitch(IMAPOPT_IDLE_EVENT_COUNTERS)) return 0;
+
+    snprintf(fname, sizeof(fname), "%s%s", config_dir, FNAME_IDLE_COUNTERS);
+
+    fd = open(fname, O_RDWR|O_CREAT, 0644);
+    if (fd == -1) {
+        syslog(LOG_ERR, "IDLE: creating %s: %m", fname);
+        return 0;
+    }
+
+    if (fstat(fd, &sbuf) == -1) {
+        syslog(LOG_ERR, "IDLE: fstat %s: %m", fname);
+        close(fd);
+        return 0;
+    }
+
+    if (sbuf.st_size < IDLE_COUNTERS_SIZE) {
+        /* new or truncated file - initialise it.  Concurrent creators
+         * all write the same constant header, so the race is harmless */
+        header[0] = IDLE_COUNTERS_MAGIC;
+        header[1] = IDLE_COUNTERS_VERSION;
+        header[2] = IDLE_COUNTERS_SLOTS;
+        header[3] = 0;
+        if (ftruncate(fd, IDLE_COUNTERS_SIZE) == -1 ||
+            pwrite(fd, header, sizeof(header), 0) != sizeof(header)) {
+            syslog(LOG_ERR, "IDLE: initialising %s: %m", fname);
+            close(fd);
+            return 0;
+        }
+    }
+
+    base = mmap(NULL, IDLE_COUNTERS_SIZE, PROT_READ|PROT_WRITE,
+                MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        syslog(LOG_ERR, "IDLE: mmap %s: %m", fname);
+        return 0;
+    }
+
+    if (((uint32_t *)base)[0] != IDLE_COUNTERS_MAGIC ||
+        ((uint32_t *)base)[1] != IDLE_COUNTERS_VERSION ||
+        ((uint32_t *)base)[2] != IDLE_COUNTERS_SLOTS) {
+        syslog(LOG_ERR, "IDLE: %s has unexpected format, ignoring", fname);
+        munmap(base, IDLE_COUNTERS_SIZE);
+        return 0;
+    }
+
+    idle_counters = (uint32_t *)base + 4;
+
+    return 1;
+}
+
+EXPORTED void idle_counters_done(void)
+{
+    if (idle_counters)
+        munmap(idle_counters - 4, IDLE_COUNTERS_SIZE);
+    idle_counters = NULL;
+}
+
+EXPORTED int idle_counters_active(void)
+{
+    return idle_counters != NULL;
+}
+
+EXPORTED uint32_t idle_counter_read(const char *mboxname)
+{
+    if (!idle_counters || !mboxname) return 0;
+    return idle_counters[strhash(mboxname) % IDLE_COUNTERS_SLOTS];
+}
+
+EXPORTED void idle_counter_bump(const char *mboxname)
+{
+    if (!idle_counters || !mboxname) return;
+    idle_counters[strhash(mboxname) % IDLE_COUNTERS_SLOTS]++;
+}
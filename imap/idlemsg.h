@@ -51,6 +51,9 @@
 #define FNAME_IDLE_SOCK_DIR "/socket"
 #define FNAME_IDLE_SOCK FNAME_IDLE_SOCK_DIR"/idle"
 
+/* shared per-mailbox event counter table, see idlemsg.c */
+#define FNAME_IDLE_COUNTERS "/idle.counters"
+
 typedef struct idle_message_s idle_message_t;
 
 struct idle_message_s
@@ -68,7 +71,8 @@ enum {
     IDLE_MSG_DONE,
     IDLE_MSG_NOTIFY,
     IDLE_MSG_NOOP,
-    IDLE_MSG_ALERT
+    IDLE_MSG_ALERT,
+    IDLE_MSG_REARM
 };
 
 int idle_make_server_address(struct sockaddr_un *);
@@ -81,5 +85,11 @@ int idle_send(const struct sockaddr_un *remote,
               const idle_message_t *msg);
 int idle_recv(struct sockaddr_un *remote, idle_message_t *msg);
 
+int idle_counters_init(void);
+void idle_counters_done(void);
+int idle_counters_active(void);
+uint32_t idle_counter_read(const char *mboxname);
+void idle_counter_bump(const char *mboxname);
+
 
 #endif
@@ -51,6 +51,7 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/param.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <syslog.h>
 #include <netdb.h>
@@ -85,6 +86,7 @@
 #include "exitcodes.h"
 #include "idle.h"
 #include "global.h"
+#include "lockstat.h"
 #include "times.h"
 #include "proxy.h"
 #include "imap_proxy.h"
@@ -340,6 +342,7 @@ static struct capa_struct base_capabilities[] = {
     { "CREATE-SPECIAL-USE",    2 },
     { "DIGEST=SHA1",           2 }, /* not standard */
     { "X-REPLICATION",         2 }, /* not standard */
+    { "X-SYNC-DELTA",          2 }, /* not standard */
 
 #ifdef HAVE_SSL
     { "URLAUTH",               2 },
@@ -411,6 +414,7 @@ static int do_xconvfetch(struct dlist *cidlist,
                          struct fetchargs *fetchargs);
 static void cmd_xsnippets(char *tag);
 static void cmd_xstats(char *tag, int c);
+static void cmdusage_report(void);
 
 static void cmd_xapplepushservice(const char *tag,
                                   struct applepushserviceargs *applepushserviceargs);
@@ -487,6 +491,7 @@ static void canonical_list_patterns(const char *reference,
 static int list_cb(struct findall_data *data, void *rock);
 static int subscribed_cb(struct findall_data *data, void *rock);
 static void list_data(struct listargs *listargs);
+static void list_data_cached(struct listargs *listargs);
 static int list_data_remote(struct backend *be, char *tag,
                             struct listargs *listargs, strarray_t *subs);
 
@@ -535,9 +540,9 @@ static int imapd_canon_user(sasl_conn_t *conn, void *context,
             n = config_virtdomains ? strcspn(p, "@") : strlen(p);
 
             if (flags & SASL_CU_AUTHZID) {
-                /* make a copy of the magic plus */
-                if (imapd_magicplus) free(imapd_magicplus);
-                imapd_magicplus = xstrndup(p, n);
+                /* make a copy of the magic plus (in the connection
+                 * arena - a stale earlier copy just waits for reset) */
+                imapd_magicplus = xarena_strndup(p, n);
             }
 
             /* strip the magic plus from the auth[z]id */
@@ -674,7 +679,8 @@ static int mlookup(const char *tag, const char *ext_name,
 
     r = mboxlist_lookup(name, &mbentry, NULL);
     if ((r == IMAP_MAILBOX_NONEXISTENT || (!r && (mbentry->mbtype & MBTYPE_RESERVE))) &&
-        config_mupdate_server) {
+        config_mupdate_server &&
+        (r != IMAP_MAILBOX_NONEXISTENT || mupdate_bloom_check(name))) {
         /* It is not currently active, make sure we have the most recent
          * copy of the database */
         kick_mupdate();
@@ -747,22 +753,21 @@ static void imapd_reset(void)
         prot_NONBLOCK(imapd_in);
         prot_fill(imapd_in);
         bytes_in = prot_bytes_in(imapd_in);
-        prot_free(imapd_in);
+        /* keep the stream (and its buffer) for the next connection */
+        prot_reuse(imapd_in, 0, 0);
     }
 
     if (imapd_out) {
         /* Flush the outgoing buffer */
         prot_flush(imapd_out);
         bytes_out = prot_bytes_out(imapd_out);
-        prot_free(imapd_out);
+        prot_reuse(imapd_out, 1, 1);
     }
 
     if (config_auditlog)
         syslog(LOG_NOTICE, "auditlog: traffic sessionid=<%s> bytes_in=<%d> bytes_out=<%d>",
                            session_id(), bytes_in, bytes_out);
 
-    imapd_in = imapd_out = NULL;
-
     if (protin) protgroup_reset(protin);
 
 #ifdef HAVE_SSL
@@ -781,18 +786,19 @@ static void imapd_reset(void)
         close(imapd_logfd);
         imapd_logfd = -1;
     }
-    if (imapd_userid != NULL) {
-        free(imapd_userid);
-        imapd_userid = NULL;
-    }
-    if (proxy_userid != NULL) {
-        free(proxy_userid);
-        proxy_userid = NULL;
-    }
-    if (imapd_magicplus != NULL) {
-        free(imapd_magicplus);
-        imapd_magicplus = NULL;
-    }
+    /* these live in the connection arena, so no individual frees -
+     * the whole arena goes back in one hit.  Record the memory
+     * high-water marks for XSTATS first */
+    xstats_set(ARENA_HIGHWATER, xarena_highwater());
+    {
+        struct rusage ru;
+        if (!getrusage(RUSAGE_SELF, &ru))
+            xstats_set(RSS_HIGHWATER, ru.ru_maxrss);
+    }
+    imapd_userid = NULL;
+    proxy_userid = NULL;
+    imapd_magicplus = NULL;
+    xarena_reset();
     if (imapd_authstate) {
         auth_freestate(imapd_authstate);
         imapd_authstate = NULL;
@@ -947,8 +953,10 @@ int service_main(int argc __attribute__((unused)),
 
     sync_log_init();
 
-    imapd_in = prot_new(0, 0);
-    imapd_out = prot_new(1, 1);
+    /* the streams survive from the previous connection unless this is
+     * the first one (or shut_down tore them down) */
+    if (!imapd_in) imapd_in = prot_new(0, 0);
+    if (!imapd_out) imapd_out = prot_new(1, 1);
     protgroup_insert(protin, imapd_in);
 
     /* Find out name of client host */
@@ -1078,6 +1086,8 @@ void shut_down(int code)
 
     in_shutdown = 1;
 
+    cmdusage_report();
+
     proc_cleanup();
 
     i = 0;
@@ -1208,6 +1218,125 @@ static void imapd_check(struct backend *be, int usinguid)
     }
 }
 
+/*
+ * Per-command resource accounting: deltas of cheap process-wide
+ * counters are taken around each dispatched command and aggregated by
+ * command name.  A command that burns at least commandmincpu seconds
+ * of CPU is logged immediately; when commandusagereport is enabled a
+ * per-command summary for the whole connection is logged at shutdown.
+ */
+struct cmdusage {
+    uint64_t count;
+    uint64_t wall_usec;
+    uint64_t cpu_usec;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t db_ops;
+    uint64_t lock_usec;
+};
+
+struct cmdusage_marker {
+    struct timespec wall;
+    uint64_t cpu_usec;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t db_ops;
+    uint64_t lock_usec;
+};
+
+static struct hash_table cmdusage_table;
+
+static uint64_t cmdusage_cpu_usec(void)
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru)) return 0;
+
+    return (uint64_t)ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec
+         + (uint64_t)ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec;
+}
+
+static void cmdusage_start(struct cmdusage_marker *m)
+{
+    clock_gettime(CLOCK_MONOTONIC, &m->wall);
+    m->cpu_usec = cmdusage_cpu_usec();
+    m->bytes_in = prot_bytes_in(imapd_in);
+    m->bytes_out = prot_bytes_out(imapd_out);
+    m->db_ops = cyrusdb_ops;
+    m->lock_usec = lockstat_process_wait_usec();
+}
+
+static void cmdusage_end(struct cmdusage_marker *m, const char *cmdname,
+                         double mincpu)
+{
+    struct cmdusage *usage;
+    struct timespec now;
+    uint64_t wall_usec, cpu_usec, in, out, ops, lock_usec;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    wall_usec = (uint64_t)(now.tv_sec - m->wall.tv_sec) * 1000000
+              + (now.tv_nsec - m->wall.tv_nsec) / 1000;
+    cpu_usec = cmdusage_cpu_usec() - m->cpu_usec;
+    in = prot_bytes_in(imapd_in) - m->bytes_in;
+    out = prot_bytes_out(imapd_out) - m->bytes_out;
+    ops = cyrusdb_ops - m->db_ops;
+    lock_usec = lockstat_process_wait_usec() - m->lock_usec;
+
+    if (!cmdusage_table.size)
+        construct_hash_table(&cmdusage_table, 64, 0);
+
+    usage = hash_lookup(cmdname, &cmdusage_table);
+    if (!usage) {
+        usage = xzmalloc(sizeof(struct cmdusage));
+        hash_insert(cmdname, usage, &cmdusage_table);
+    }
+    usage->count++;
+    usage->wall_usec += wall_usec;
+    usage->cpu_usec += cpu_usec;
+    usage->bytes_in += in;
+    usage->bytes_out += out;
+    usage->db_ops += ops;
+    usage->lock_usec += lock_usec;
+
+    if (mincpu && cpu_usec >= (uint64_t)(mincpu * 1000000)) {
+        syslog(LOG_NOTICE, "cmdusage: '%s' '%s' cpu_ms %.3f wall_ms %.3f "
+               "bytes_in %llu bytes_out %llu db_ops %llu lock_ms %.3f",
+               imapd_userid ? imapd_userid : "<none>", cmdname,
+               cpu_usec / 1e3, wall_usec / 1e3,
+               (unsigned long long)in, (unsigned long long)out,
+               (unsigned long long)ops, lock_usec / 1e3);
+    }
+}
+
+/* callback for hash_enumerate */
+static void cmdusage_report_cb(const char *cmdname, void *data, void *rock)
+{
+    struct cmdusage *usage = (struct cmdusage *)data;
+    const char *userid = (const char *)rock;
+
+    syslog(LOG_NOTICE, "cmdusage total: '%s' '%s' count %llu cpu_ms %.3f "
+           "wall_ms %.3f bytes_in %llu bytes_out %llu db_ops %llu "
+           "lock_ms %.3f",
+           userid, cmdname,
+           (unsigned long long)usage->count,
+           usage->cpu_usec / 1e3, usage->wall_usec / 1e3,
+           (unsigned long long)usage->bytes_in,
+           (unsigned long long)usage->bytes_out,
+           (unsigned long long)usage->db_ops,
+           usage->lock_usec / 1e3);
+}
+
+static void cmdusage_report(void)
+{
+    if (!cmdusage_table.size) return;
+
+    if (config_getswitch(IMAPOPT_COMMANDUSAGEREPORT))
+        hash_enumerate(&cmdusage_table, cmdusage_report_cb,
+                       imapd_userid ? (void *)imapd_userid : (void *)"<none>");
+
+    free_hash_table(&cmdusage_table, free);
+}
+
 /*
  * Top-level command loop parsing
  */
@@ -1220,6 +1349,9 @@ static void cmdloop(void)
     const char *err;
     const char * commandmintimer;
     double commandmintimerd = 0.0;
+    const char * commandmincpu;
+    double commandmincpud = 0.0;
+    struct cmdusage_marker usage_marker;
     struct sync_reserve_list *reserve_list =
         sync_reserve_list_create(SYNC_MESSAGE_LIST_HASH_SIZE);
     struct applepushserviceargs applepushserviceargs;
@@ -1247,6 +1379,12 @@ static void cmdloop(void)
       commandmintimerd = atof(commandmintimer);
     }
 
+    /* and the CPU threshold for resource usage logging */
+    commandmincpu = config_getstring(IMAPOPT_COMMANDMINCPU);
+    if (commandmincpu) {
+      commandmincpud = atof(commandmincpu);
+    }
+
     for (;;) {
         /* Release any held index */
         index_release(imapd_index);
@@ -1325,8 +1463,9 @@ static void cmdloop(void)
            allowed when not logged in */
         if (!imapd_userid && !strchr("AELNCIS", cmd.s[0])) goto nologin;
 
-        /* Start command timer */
+        /* Start command timer and resource accounting */
         cmdtime_starttimer();
+        cmdusage_start(&usage_marker);
 
         /* note that about half the commands (the common ones that don't
            hit the mailboxes file) now close the mailboxes file just in
@@ -2420,6 +2559,10 @@ static void cmdloop(void)
             eatline(imapd_in, c);
         }
 
+        /* Account the command's resource usage - "idle" is all wait */
+        if (strcmp("idle", cmdname))
+            cmdusage_end(&usage_marker, cmdname, commandmincpud);
+
         /* End command timer - don't log "idle" commands */
         if (commandmintimer && strcmp("idle", cmdname)) {
             double cmdtime, nettime;
@@ -2528,7 +2671,7 @@ static void authentication_success(void)
     }
 
     /* Make a copy of the external userid for use in proxying */
-    proxy_userid = xstrdup(imapd_userid);
+    proxy_userid = xarena_strdup(imapd_userid);
 
     /* send a Login event notification */
     if ((mboxevent = mboxevent_new(EVENT_LOGIN))) {
@@ -2565,8 +2708,7 @@ static int checklimits(const char *tag)
                         limits.user, limits.maxuser, imapd_userid);
         }
         prot_printf(imapd_out, ")\r\n");
-        free(imapd_userid);
-        imapd_userid = NULL;
+        imapd_userid = NULL;  /* arena-allocated */
         auth_freestate(imapd_authstate);
         imapd_authstate = NULL;
         return 1;
@@ -2583,7 +2725,7 @@ static void cmd_login(char *tag, char *user)
     char replybuf[MAX_MAILBOX_BUFFER];
     unsigned userlen;
     const char *canon_user = userbuf;
-    const void *val;
+    const char *sasluser = NULL;
     int c;
     struct buf passwdbuf;
     char *passwd;
@@ -2643,7 +2785,7 @@ static void cmd_login(char *tag, char *user)
             syslog(LOG_NOTICE, "login: %s anonymous %s",
                    imapd_clienthost, passwd);
             reply = "Anonymous access granted";
-            imapd_userid = xstrdup("anonymous");
+            imapd_userid = xarena_strdup("anonymous");
         }
         else {
             syslog(LOG_NOTICE, "badlogin: %s anonymous login refused",
@@ -2658,17 +2800,17 @@ static void cmd_login(char *tag, char *user)
         snprintf(replybuf, sizeof(replybuf),
             "User logged in SESSIONID=<%s>", session_id());
         reply = replybuf;
-        imapd_userid = xstrdup(canon_user);
+        imapd_userid = xarena_strdup(canon_user);
         imapd_authstate = auth_newstate(canon_user);
         syslog(LOG_NOTICE, "login: %s %s%s nopassword%s %s", imapd_clienthost,
                imapd_userid, imapd_magicplus ? imapd_magicplus : "",
                imapd_starttls_done ? "+TLS" : "", reply);
     }
-    else if ((r = sasl_checkpass(imapd_saslconn,
-                                 canon_user,
-                                 strlen(canon_user),
-                                 passwd,
-                                 strlen(passwd))) != SASL_OK) {
+    else if ((r = global_sasl_checkpass(imapd_saslconn,
+                                        &imapd_proxyctx,
+                                        canon_user,
+                                        passwd,
+                                        &sasluser)) != SASL_OK) {
         syslog(LOG_NOTICE, "badlogin: %s plaintext %s %s",
                imapd_clienthost, canon_user, sasl_errdetail(imapd_saslconn));
 
@@ -2693,27 +2835,10 @@ static void cmd_login(char *tag, char *user)
         return;
     }
     else {
-        r = sasl_getprop(imapd_saslconn, SASL_USERNAME, &val);
-
-        if(r != SASL_OK) {
-            if ((reply = sasl_errstring(r, NULL, NULL)) != NULL) {
-                prot_printf(imapd_out, "%s NO Login failed: %s\r\n",
-                            tag, reply);
-            } else {
-                prot_printf(imapd_out, "%s NO Login failed: %d\r\n", tag, r);
-            }
-
-            snmp_increment_args(AUTHENTICATION_NO, 1,
-                                VARIABLE_AUTH, 0 /* hash_simple("LOGIN") */,
-                                VARIABLE_LISTEND);
-            buf_free(&passwdbuf);
-            return;
-        }
-
         snprintf(replybuf, sizeof(replybuf),
             "User logged in SESSIONID=<%s>", session_id());
         reply = replybuf;
-        imapd_userid = xstrdup((const char *) val);
+        imapd_userid = xarena_strdup(sasluser);
         snmp_increment_args(AUTHENTICATION_YES, 1,
                             VARIABLE_AUTH, 0 /*hash_simple("LOGIN") */,
                             VARIABLE_LISTEND);
@@ -2847,9 +2972,9 @@ static void cmd_authenticate(char *tag, char *authtype, char *resp)
             return;
         }
 
-        imapd_userid = xstrdup(userbuf);
+        imapd_userid = xarena_strdup(userbuf);
     } else {
-        imapd_userid = xstrdup(canon_user);
+        imapd_userid = xarena_strdup(canon_user);
     }
 
     snprintf(replybuf, sizeof(replybuf),
@@ -3133,6 +3258,11 @@ static void cmd_idle(char *tag)
         prot_printf(imapd_out, "+ idling\r\n");
         prot_flush(imapd_out);
 
+        /* Don't let a slow client hold us hostage in prot_flush():
+         * queue updates nonblocking and let idle_wait() tell us when
+         * the socket will take more */
+        prot_NONBLOCK(imapd_out);
+
         /* Start doing mailbox updates */
         index_check(imapd_index, 1, 0);
         idle_start(index_mboxname(imapd_index));
@@ -3141,7 +3271,9 @@ static void cmd_idle(char *tag)
         idling = 1;
 
         index_release(imapd_index);
-        while ((flags = idle_wait(imapd_in->fd))) {
+        while ((flags = idle_wait(imapd_in->fd,
+                                  prot_outputpending(imapd_out) ?
+                                  imapd_out->fd : -1))) {
             if (deadline_exceeded(&deadline)) {
                 syslog(LOG_DEBUG, "timeout for user '%s' while idling",
                        imapd_userid);
@@ -3173,12 +3305,16 @@ static void cmd_idle(char *tag)
             }
 
             index_release(imapd_index);
-            prot_flush(imapd_out);
+            prot_flush_nb(imapd_out);
         }
 
         /* Stop updates and do any necessary cleanup */
         idling = 0;
         idle_stop(index_mboxname(imapd_index));
+
+        /* Back to blocking output; push out anything still queued */
+        prot_BLOCK(imapd_out);
+        prot_flush(imapd_out);
     }
     else {  /* Remote mailbox */
         int done = 0;
@@ -3882,7 +4018,8 @@ static void cmd_append(char *tag, char *name, const char *cur_name)
             if (r) goto done;
 
             /* Copy message to stage */
-            r = message_copy_strict(imapd_in, curstage->f, size, curstage->binary);
+            r = append_stage_copy(imapd_in, curstage->f, size,
+                                  curstage->binary, curstage->stage);
         }
         qdiffs[QUOTA_STORAGE] += size;
         /* If this is a non-BINARY message, close the stage file.
@@ -6261,6 +6398,19 @@ static void cmd_xstats(char *tag, int c)
     prot_printf(imapd_out, "* XSTATS");
     for (metric = 0 ; metric < XSTATS_NUM_METRICS ; metric++)
         prot_printf(imapd_out, " %s %u", xstats_names[metric], xstats[metric]);
+    /* the latency histograms are host-wide aggregates, unlike the
+     * per-process counters above */
+    for (metric = 0 ; metric < XSTATS_NUM_TIMERS ; metric++) {
+        const struct xstats_timing *tm = xstats_timing_get(metric);
+        if (!tm) break;
+        prot_printf(imapd_out, " %s_COUNT %llu %s_USEC %llu %s_MAXUSEC %llu",
+                    xstats_timer_names[metric],
+                    (unsigned long long)tm->count,
+                    xstats_timer_names[metric],
+                    (unsigned long long)tm->total_usec,
+                    xstats_timer_names[metric],
+                    (unsigned long long)tm->max_usec);
+    }
     prot_printf(imapd_out, "\r\n");
 
     prot_printf(imapd_out, "%s OK %s\r\n", tag,
@@ -7799,7 +7949,7 @@ static void cmd_list(char *tag, struct listargs *listargs)
         if (list_data_remote(backend_inbox, tag, listargs, NULL))
             return;
     } else {
-        list_data(listargs);
+        list_data_cached(listargs);
     }
 
     strarray_fini(&listargs->pat);
@@ -13084,6 +13234,97 @@ static void list_data(struct listargs *listargs)
     }
 }
 
+/*
+ * Cache of the most recent rendered LIST response on this connection,
+ * keyed by the query and the mboxlist generation counter.  Webmail
+ * clients tend to issue an identical LIST before every operation;
+ * while nothing in the mailboxes list has changed the response is
+ * replayed verbatim instead of walking mboxlist and recomputing ACL
+ * visibility for every entry.
+ */
+static struct {
+    uint64_t gen;
+    struct buf key;
+    struct buf data;
+} list_cache = { 0, BUF_INITIALIZER, BUF_INITIALIZER };
+
+static int list_is_cacheable(const struct listargs *listargs)
+{
+    /* SCAN reads message content */
+    if (listargs->scan) return 0;
+
+    /* XLIST and special-use derive attributes from annotations, and
+     * STATUS/METADATA carry per-mailbox state, none of which bump
+     * the generation counter */
+    if (listargs->cmd == LIST_CMD_XLIST) return 0;
+    if (listargs->sel &
+        (LIST_SEL_REMOTE | LIST_SEL_METADATA | LIST_SEL_SPECIALUSE))
+        return 0;
+    if (listargs->ret &
+        (LIST_RET_STATUS | LIST_RET_METADATA | LIST_RET_SPECIALUSE))
+        return 0;
+    if (config_getswitch(IMAPOPT_SPECIALUSEALWAYS)) return 0;
+
+    /* in a murder the response may be pieced together from backends */
+    if (config_mupdate_server) return 0;
+    if (backend_inbox) return 0;
+
+    return 1;
+}
+
+static void list_data_cached(struct listargs *listargs)
+{
+    struct buf key = BUF_INITIALIZER;
+    struct protstream *real_out;
+    uint64_t gen;
+    int i;
+
+    if (!config_getswitch(IMAPOPT_LIST_RESPONSE_CACHE) ||
+        !list_is_cacheable(listargs)) {
+        list_data(listargs);
+        return;
+    }
+
+    gen = mboxlist_generation();
+    if (!gen) {
+        /* can't tell whether anything changed */
+        list_data(listargs);
+        return;
+    }
+
+    /* everything which selects what gets rendered.  The raw reference
+     * and patterns are enough: canonicalisation is deterministic */
+    buf_printf(&key, "%u %u %u %s", listargs->cmd, listargs->sel,
+               listargs->ret, listargs->ref);
+    for (i = 0; i < listargs->pat.count; i++) {
+        buf_putc(&key, ' ');
+        buf_appendcstr(&key, strarray_nth(&listargs->pat, i));
+    }
+
+    if (gen == list_cache.gen && !buf_cmp(&key, &list_cache.key)) {
+        /* nothing has changed since we last answered this - replay */
+        prot_putbuf(imapd_out, &list_cache.data);
+        buf_free(&key);
+        return;
+    }
+
+    /* render into the cache, then send it */
+    buf_reset(&list_cache.data);
+    real_out = imapd_out;
+    imapd_out = prot_writebuf(&list_cache.data);
+    list_data(listargs);
+    prot_flush(imapd_out);
+    prot_free(imapd_out);
+    imapd_out = real_out;
+
+    prot_putbuf(imapd_out, &list_cache.data);
+
+    list_cache.gen = gen;
+    buf_reset(&list_cache.key);
+    buf_append(&list_cache.key, &key);
+    buf_free(&key);
+}
+
 /*
  * Retrieves the data and prints the untagged responses for a LIST command in
  * the case of a remote inbox.
@@ -67,6 +67,27 @@ EXPORTED int getword(struct protstream *in, struct buf *buf)
 
     buf_reset(buf);
     for (;;) {
+        /* take the run of word characters that's already buffered in
+         * one go rather than a getc at a time; the common short atom
+         * never leaves the stream buffer until the single copy-out */
+        const char *peek;
+        size_t navail, i;
+
+        peek = prot_peek(in, &navail);
+        for (i = 0; i < navail; i++) {
+            c = (unsigned char) peek[i];
+            if (isspace(c) || c == '(' || c == ')' || c == '\"') break;
+        }
+        if (i) {
+            buf_appendmap(buf, peek, i);
+            prot_skip(in, i);
+            if (config_maxword && buf_len(buf) > config_maxword) {
+                fatal("word too long", EC_IOERR);
+            }
+        }
+
+        /* the delimiter, or a refill when the run hit the end of
+         * the buffered data */
         c = prot_getc(in);
         if (c == EOF || isspace(c) || c == '(' || c == ')' || c == '\"') {
             buf_cstring(buf); /* appends a '\0' */
@@ -118,6 +139,24 @@ EXPORTED int getxstring(struct protstream *pin, struct protstream *pout,
          * other than double-quote, CR, and LF.
          */
         for (;;) {
+            /* bulk-copy the buffered run up to the next special;
+             * unescaping only ever happens a character at a time */
+            const char *peek;
+            size_t navail, i;
+
+            peek = prot_peek(pin, &navail);
+            for (i = 0; i < navail; i++) {
+                c = (unsigned char) peek[i];
+                if (c == '\\' || c == '\"' || c == '\r' || c == '\n') break;
+            }
+            if (i) {
+                buf_appendmap(buf, peek, i);
+                prot_skip(pin, i);
+                if (config_maxquoted && buf_len(buf) > config_maxquoted) {
+                    fatal("quoted value too long", EC_IOERR);
+                }
+            }
+
             c = prot_getc(pin);
             if (c == '\\') {
                 c = prot_getc(pin);
@@ -173,13 +212,27 @@ EXPORTED int getxstring(struct protstream *pin, struct protstream *pout,
             prot_printf(pout, "+ go ahead\r\n");
             prot_flush(pout);
         }
-        for (i = 0; i < len; i++) {
-            c = prot_getc(pin);
+        /* we know exactly how much is coming - read it in bulk */
+        prot_setreadahead(pin, len);
+        while (len > 0) {
+            const char *peek;
+            size_t navail;
+
+            peek = prot_peek(pin, &navail);
+            if (navail) {
+                if (navail > (size_t) len) navail = len;
+                buf_appendmap(buf, peek, navail);
+                prot_skip(pin, navail);
+                len -= navail;
+                continue;
+            }
+            c = prot_getc(pin); /* refill */
             if (c == EOF) {
                 buf_cstring(buf);
                 return EOF;
             }
             buf_putc(buf, c);
+            len--;
         }
         buf_cstring(buf);
         if (!(flags & GXS_BINARY) && strlen(buf_cstring(buf)) != (unsigned)buf_len(buf))
@@ -193,6 +246,9 @@ EXPORTED int getxstring(struct protstream *pin, struct protstream *pout,
              * than whitespace, parens, or double quotes
              */
             for (;;) {
+                const char *peek;
+                size_t navail;
+
                 if (c == EOF || isspace(c) || c == '(' ||
                           c == ')' || c == '\"') {
                     /* gotta handle NIL here too */
@@ -203,6 +259,17 @@ EXPORTED int getxstring(struct protstream *pin, struct protstream *pout,
                     return c;
                 }
                 buf_putc(buf, c);
+
+                /* grab the rest of the buffered run in one go */
+                peek = prot_peek(pin, &navail);
+                for (i = 0; i < (int) navail; i++) {
+                    c = (unsigned char) peek[i];
+                    if (isspace(c) || c == '(' || c == ')' || c == '\"') break;
+                }
+                if (i) {
+                    buf_appendmap(buf, peek, i);
+                    prot_skip(pin, i);
+                }
                 c = prot_getc(pin);
             }
             /* never gets here */
@@ -52,6 +52,7 @@
 #include <syslog.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #ifdef USE_HTTPD
 /* For iCalendar indexing */
@@ -76,6 +77,7 @@
 #include "map.h"
 #include "message.h"
 #include "parseaddr.h"
+#include "retry.h"
 #include "search_engines.h"
 #include "search_query.h"
 #include "seen.h"
@@ -101,6 +103,9 @@ static void index_refresh_locked(struct index_state *state);
 static void index_tellexists(struct index_state *state);
 static int index_lock(struct index_state *state);
 static void index_unlock(struct index_state *state);
+static uint32_t index_nextinseq(struct index_state *state,
+                                struct seqset *seq,
+                                uint32_t msgno, int usinguid);
 
 struct index_modified_flags {
     int added_flags;
@@ -151,10 +156,8 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
                             const struct fetchargs *fetchargs);
 static void index_printflags(struct index_state *state, uint32_t msgno,
                              int usinguid, int printmodseq);
-static char *get_localpart_addr(const char *header);
-static char *get_displayname(const char *header);
-static char *index_extract_subject(const char *subj, size_t len, int *is_refwd);
-static char *_index_extract_subject(char *s, int *is_refwd);
+static char *index_cached_sortkey(const struct index_record *record,
+                                  int field, int *is_refwd);
 static void index_get_ids(MsgData *msgdata,
                           char *envtokens[], const char *headers, unsigned size);
 
@@ -178,6 +181,10 @@ static void index_thread_references(struct index_state *state,
 static void index_thread_refs(struct index_state *state,
                               unsigned *msgno_list, unsigned int nmsg,
                               int usinguid);
+static int index_thread_snapshot(struct index_state *state, int algorithm,
+                                 int usinguid);
+static void thread_snapshot_store(struct index_state *state, int algorithm,
+                                  Thread *root);
 
 static struct seqset *_parse_sequence(struct index_state *state,
                                       const char *sequence, int usinguid);
@@ -191,6 +198,10 @@ static const struct thread_algorithm thread_algs[] = {
     { NULL, NULL }
 };
 
+/* algorithm whose freshly built thread tree _index_thread_ref() should
+ * flatten into the persistent snapshot, or -1 (set by index_thread()) */
+static int thread_snapshot_capture = -1;
+
 EXPORTED int index_reload_record(struct index_state *state,
                                  uint32_t msgno,
                                  struct index_record *record)
@@ -286,6 +297,8 @@ EXPORTED void index_close(struct index_state **stateptr)
     free(state->map);
     free(state->mboxname);
     free(state->userid);
+    free(state->seenuids);
+    bv_free(&state->seenbv);
     for (i = 0; i < MAX_USER_FLAGS; i++)
         free(state->flagname[i]);
     free(state);
@@ -308,6 +321,8 @@ EXPORTED int index_open_mailbox(struct mailbox *mailbox, struct index_init *init
     if (init) {
         state->authstate = init->authstate;
         state->examining = init->examine_mode;
+        if (state->examining)
+            state->snapshot = config_getswitch(IMAPOPT_EXAMINE_SNAPSHOT);
         state->mboxname = xstrdup(mailbox->name);
         state->out = init->out;
         state->userid = xstrdupnull(init->userid);
@@ -463,39 +478,43 @@ EXPORTED int index_expunge(struct index_state *state, char *sequence,
     return r;
 }
 
-static char *index_buildseen(struct index_state *state, const char *oldseenuids)
+static void index_buildseen(struct index_state *state,
+                            const bitvector_t *oldbv,
+                            bitvector_t *bv)
 {
-    struct seqset *outlist;
     uint32_t msgno;
-    unsigned oldmax;
     struct index_map *im;
-    char *out;
+    int uid;
 
-    outlist = seqset_init(0, SEQ_MERGE);
+    bv_prealloc(bv, state->last_uid + 1);
     for (msgno = 1; msgno <= state->exists; msgno++) {
         im = &state->map[msgno-1];
-        seqset_add(outlist, im->uid, im->isseen);
+        if (im->isseen)
+            bv_set(bv, im->uid);
     }
 
     /* there may be future already seen UIDs that this process isn't
      * allowed to know about, but we can't blat them either!  This is
      * a massive pain... */
-    oldmax = seq_lastnum(oldseenuids, NULL);
-    if (oldmax > state->last_uid) {
-        struct seqset *seq = seqset_parse(oldseenuids, NULL, oldmax);
-        uint32_t uid;
-
-        /* for each future UID, copy the state in the old seenuids */
-        for (uid = state->last_uid + 1; uid <= oldmax; uid++)
-            seqset_add(outlist, uid, seqset_ismember(seq, uid));
+    for (uid = bv_next_set(oldbv, state->last_uid + 1);
+         uid >= 0;
+         uid = bv_next_set(oldbv, uid + 1))
+        bv_set(bv, uid);
+}
 
-        seqset_free(seq);
-    }
+/* do two seen bitmaps have identical membership? */
+static int _seenbv_equal(const bitvector_t *a, const bitvector_t *b)
+{
+    int i = -1;
+    int j = -1;
 
-    out = seqset_cstring(outlist);
-    seqset_free(outlist);
+    do {
+        i = bv_next_set(a, i+1);
+        j = bv_next_set(b, j+1);
+        if (i != j) return 0;
+    } while (i >= 0);
 
-    return out;
+    return 1;
 }
 
 static int index_writeseen(struct index_state *state)
@@ -504,6 +523,9 @@ static int index_writeseen(struct index_state *state)
     struct seen *seendb = NULL;
     struct seendata oldsd = SEENDATA_INITIALIZER;
     struct seendata sd = SEENDATA_INITIALIZER;
+    bitvector_t oldbv = BV_INITIALIZER;
+    bitvector_t newbv = BV_INITIALIZER;
+    struct seqset *seq;
     struct mailbox *mailbox = state->mailbox;
     const char *userid = (mailbox->i.options & OPT_IMAP_SHAREDSEEN) ? "anyone" : state->userid;
 
@@ -536,21 +558,28 @@ static int index_writeseen(struct index_state *state)
         oldsd.seenuids = xstrdup("");
     }
 
+    /* parse the old state once, then work on bitmaps from here on */
+    seq = seqset_parse(oldsd.seenuids, NULL,
+                       seq_lastnum(oldsd.seenuids, NULL));
+    seqset_tobitvector(seq, &oldbv);
+    seqset_free(seq);
+
+    index_buildseen(state, &oldbv, &newbv);
+
     /* fields of interest... */
     sd.lastuid = oldsd.lastuid;
-    sd.seenuids = index_buildseen(state, oldsd.seenuids);
-    if (!sd.seenuids) sd.seenuids = xstrdup("");
-
-    /* make comparison only catch some changes */
-    sd.lastread = oldsd.lastread;
-    sd.lastchange = oldsd.lastchange;
 
     /* update \Recent lowmark */
     if (sd.lastuid < state->last_uid)
         sd.lastuid = state->last_uid;
 
-    /* only commit if interesting fields have changed */
-    if (!seen_compare(&sd, &oldsd)) {
+    /* only commit if interesting fields have changed - the sequence
+     * string is only rendered once we know there's a write to do */
+    if (sd.lastuid != oldsd.lastuid || !_seenbv_equal(&newbv, &oldbv)) {
+        seq = seqset_frombitvector(&newbv);
+        sd.seenuids = seqset_cstring(seq);
+        seqset_free(seq);
+        if (!sd.seenuids) sd.seenuids = xstrdup("");
         sd.lastread = time(NULL);
         sd.lastchange = mailbox->i.last_appenddate;
         r = seen_write(seendb, mailbox->uniqueid, &sd);
@@ -558,17 +587,19 @@ static int index_writeseen(struct index_state *state)
 
     seen_close(&seendb);
 
+    bv_free(&oldbv);
+    bv_free(&newbv);
     seen_freedata(&oldsd);
     seen_freedata(&sd);
 
     return r;
 }
 
-/* caller must free the list with seqset_free() when done */
-static struct seqset *_readseen(struct index_state *state, unsigned *recentuid)
+/* returns the cached seen bitmap, which is owned by the index_state */
+static const bitvector_t *_readseen(struct index_state *state, unsigned *recentuid)
 {
     struct mailbox *mailbox = state->mailbox;
-    struct seqset *seenlist = NULL;
+    const bitvector_t *seenbv = NULL;
 
     /* Obtain seen information */
     if (state->internalseen) {
@@ -594,7 +625,22 @@ static struct seqset *_readseen(struct index_state *state, unsigned *recentuid)
         }
         else {
             *recentuid = sd.lastuid;
-            seenlist = seqset_parse(sd.seenuids, NULL, *recentuid);
+            /* only re-parse the seen sequence when it has actually
+             * changed - this runs on every refresh, and half of all
+             * sessions just sit in IDLE or NOOP polling where the
+             * sequence is almost always identical to last time */
+            if (!state->seenuids || *recentuid != state->seen_lastuid ||
+                strcmp(sd.seenuids, state->seenuids)) {
+                struct seqset *seq =
+                    seqset_parse(sd.seenuids, NULL, *recentuid);
+                bv_clearall(&state->seenbv);
+                seqset_tobitvector(seq, &state->seenbv);
+                seqset_free(seq);
+                free(state->seenuids);
+                state->seenuids = xstrdup(sd.seenuids);
+                state->seen_lastuid = *recentuid;
+            }
+            seenbv = &state->seenbv;
             seen_freedata(&sd);
         }
     }
@@ -602,7 +648,7 @@ static struct seqset *_readseen(struct index_state *state, unsigned *recentuid)
         *recentuid = mailbox->i.last_uid; /* nothing is recent! */
     }
 
-    return seenlist;
+    return seenbv;
 }
 
 static void index_refresh_locked(struct index_state *state)
@@ -618,7 +664,7 @@ static void index_refresh_locked(struct index_state *state)
     modseq_t delayed_modseq = 0;
     struct index_map *im;
     uint32_t need_records;
-    struct seqset *seenlist;
+    const bitvector_t *seenbv;
     int i;
 
     /* need to start by having enough space for the entire index state
@@ -647,7 +693,7 @@ static void index_refresh_locked(struct index_state *state)
                               state->mapsize * sizeof(struct index_map));
     }
 
-    seenlist = _readseen(state, &recentuid);
+    seenbv = _readseen(state, &recentuid);
 
     /* walk through all records */
     struct mailbox_iter *iter = mailbox_iter_init(mailbox, 0, ITER_SKIP_UNLINKED);
@@ -719,7 +765,7 @@ static void index_refresh_locked(struct index_state *state)
             if (state->internalseen)
                 im->isseen = (im->system_flags & FLAG_SEEN) ? 1 : 0;
             else
-                im->isseen = seqset_ismember(seenlist, im->uid) ? 1 : 0;
+                im->isseen = (seenbv && bv_isset(seenbv, im->uid)) ? 1 : 0;
 
             if (msgno > state->exists) {
                 /* don't auto-tell new records */
@@ -776,7 +822,7 @@ static void index_refresh_locked(struct index_state *state)
         num_expunged++;
     }
 
-    seqset_free(seenlist);
+    /* NOTE: seenbv is owned by the state's seen cache, don't free */
 
     /* update the header tracking data */
     state->oldexists = state->exists; /* we last knew about this many */
@@ -912,6 +958,18 @@ EXPORTED int index_check(struct index_state *state, int usinguid, int printuid)
     return r;
 }
 
+/* qsort comparator so modseq log results can be fed to seqset_add in
+ * ascending UID order */
+static int compare_uid(const void *a, const void *b)
+{
+    uint32_t ua = *(const uint32_t *)a;
+    uint32_t ub = *(const uint32_t *)b;
+
+    if (ua > ub) return 1;
+    if (ua < ub) return -1;
+    return 0;
+}
+
 /*
  * Perform UID FETCH (VANISHED) on a sequence.
  */
@@ -939,18 +997,44 @@ struct seqset *index_vanished(struct index_state *state,
     /* XXX - use match_seq and match_uid */
 
     if (params->modseq >= mailbox->i.deletedmodseq) {
-        const message_t *msg;
+        uint32_t *uids = NULL;
+        unsigned nuids = 0;
         /* all records are significant */
         /* List only expunged UIDs with MODSEQ > requested */
-        struct mailbox_iter *iter = mailbox_iter_init(mailbox, params->modseq, 0);
-        while ((msg = mailbox_iter_step(iter))) {
-            const struct index_record *record = msg_record(msg);
-            if (!(record->system_flags & FLAG_EXPUNGED))
-                continue;
-            if (!params->sequence || seqset_ismember(seq, record->uid))
-                seqset_add(outlist, record->uid, 1);
+        if (!mailbox_modseqlog_since(mailbox, params->modseq, &uids, &nuids)) {
+            /* the modseq log tells us which records changed, so we
+             * only have to look at those instead of walking the whole
+             * index - on a mostly unchanged mailbox that's the common
+             * resync case */
+            unsigned i;
+            qsort(uids, nuids, sizeof(uint32_t), compare_uid);
+            for (i = 0; i < nuids; i++) {
+                struct index_record record;
+                if (i && uids[i] == uids[i-1])
+                    continue;   /* changed more than once */
+                if (mailbox_find_index_record(mailbox, uids[i], &record))
+                    continue;
+                if (record.modseq <= params->modseq)
+                    continue;
+                if (!(record.system_flags & FLAG_EXPUNGED))
+                    continue;
+                if (!params->sequence || seqset_ismember(seq, record.uid))
+                    seqset_add(outlist, record.uid, 1);
+            }
+            free(uids);
+        }
+        else {
+            const message_t *msg;
+            struct mailbox_iter *iter = mailbox_iter_init(mailbox, params->modseq, 0);
+            while ((msg = mailbox_iter_step(iter))) {
+                const struct index_record *record = msg_record(msg);
+                if (!(record->system_flags & FLAG_EXPUNGED))
+                    continue;
+                if (!params->sequence || seqset_ismember(seq, record->uid))
+                    seqset_add(outlist, record->uid, 1);
+            }
+            mailbox_iter_done(&iter);
         }
-        mailbox_iter_done(&iter);
     }
     else {
         unsigned prevuid = 0;
@@ -1067,52 +1151,97 @@ EXPORTED void index_fetchresponses(struct index_state *state,
                           const struct fetchargs *fetchargs,
                           int *fetchedsomething)
 {
-    uint32_t msgno, start, end;
+    uint32_t msgno;
     struct index_map *im;
     int fetched = 0;
     annotate_db_t *annot_db = NULL;
+    struct seq_range *spans;
+    struct seq_range onespan;
+    size_t s, nspans = 0;
 
     /* Keep an open reference on the per-mailbox db to avoid
      * doing too many slow database opens during the fetch */
     if ((fetchargs->fetchitems & FETCH_ANNOTATION))
         annotate_getdb(state->mboxname, &annot_db);
 
-    start = 1;
-    end = state->exists;
-
-    /* compress the search range down if a sequence was given */
+    /* Convert the sequence to spans of msgnos up front: a run of UIDs
+     * maps to a contiguous stretch of the (UID-sorted) map, so the
+     * fetch loops below walk whole runs with no per-message
+     * membership test and never visit the gaps between them */
     if (seq) {
-        unsigned first = seqset_first(seq);
-        unsigned last = seqset_last(seq);
+        size_t iter = 0;
+        unsigned low, high;
+
+        spans = xmalloc(seq->len * sizeof(struct seq_range));
+        while (seqset_getrange(seq, &iter, &low, &high)) {
+            uint32_t first, last;
 
-        if (usinguid) {
-            if (first > 1)
-                start = index_finduid(state, first);
-            if (first == last)
-                end = start;
-            else if (last < state->last_uid)
-                end = index_finduid(state, last);
+            if (usinguid) {
+                first = index_finduid(state, low - 1) + 1;
+                last = (high >= state->last_uid) ?
+                    state->exists : index_finduid(state, high);
+            }
+            else {
+                first = low;
+                last = high;
+            }
+            if (first < 1) first = 1;
+            if (last > state->exists) last = state->exists;
+            if (first > last) continue;
+            spans[nspans].low = first;
+            spans[nspans].high = last;
+            nspans++;
         }
-        else {
-            start = first;
-            end = last;
+    }
+    else {
+        onespan.low = 1;
+        onespan.high = state->exists;
+        spans = &onespan;
+        nspans = state->exists ? 1 : 0;
+    }
+
+    /* if we're going to be pulling cache records, tell the kernel up
+     * front which byte ranges of the cache files the message set
+     * covers, so a cold FETCH streams rather than faulting page by
+     * page */
+    if (fetchargs->fetchitems & (FETCH_ENVELOPE|FETCH_BODYSTRUCTURE|
+                                 FETCH_BODY|FETCH_HEADER|FETCH_TEXT|
+                                 FETCH_RFC822) ||
+        fetchargs->cache_atleast) {
+        size_t first_offset[2] = { 0, 0 };
+        size_t last_offset[2] = { 0, 0 };
+        for (s = 0; s < nspans; s++) {
+            for (msgno = spans[s].low; msgno <= spans[s].high; msgno++) {
+                im = &state->map[msgno-1];
+                if (!im->cache_offset)
+                    continue;
+                int archived = (im->system_flags & FLAG_ARCHIVED) ? 1 : 0;
+                if (!last_offset[archived] || im->cache_offset < first_offset[archived])
+                    first_offset[archived] = im->cache_offset;
+                if (im->cache_offset > last_offset[archived])
+                    last_offset[archived] = im->cache_offset;
+            }
         }
+        if (last_offset[0])
+            mailbox_cacherecord_range(state->mailbox, 0,
+                                      first_offset[0], last_offset[0]);
+        if (last_offset[1])
+            mailbox_cacherecord_range(state->mailbox, FLAG_ARCHIVED,
+                                      first_offset[1], last_offset[1]);
     }
 
-    /* make sure we didn't go outside the range! */
-    if (start < 1) start = 1;
-    if (end > state->exists) end = state->exists;
-
-    for (msgno = start; msgno <= end; msgno++) {
-        im = &state->map[msgno-1];
-        if (seq && !seqset_ismember(seq, usinguid ? im->uid : msgno))
-            continue;
-        if (index_fetchreply(state, msgno, fetchargs))
-            break;
-        fetched = 1;
+    for (s = 0; s < nspans; s++) {
+        for (msgno = spans[s].low; msgno <= spans[s].high; msgno++) {
+            if (index_fetchreply(state, msgno, fetchargs)) {
+                s = nspans;
+                break;
+            }
+            fetched = 1;
+        }
     }
 
     if (fetchedsomething) *fetchedsomething = fetched;
+    if (seq) free(spans);
     annotate_putdb(&annot_db);
 }
 
@@ -1144,10 +1273,9 @@ EXPORTED int index_fetch(struct index_state *state,
     if (fetchargs->fetchitems & FETCH_SETSEEN && !state->examining && state->myrights & ACL_SETSEEN) {
         mboxevent = mboxevent_new(EVENT_MESSAGE_READ);
 
-        for (msgno = 1; msgno <= state->exists; msgno++) {
-            im = &state->map[msgno-1];
-            if (!seqset_ismember(seq, usinguid ? im->uid : msgno))
-                continue;
+        for (msgno = index_nextinseq(state, seq, 1, usinguid);
+             msgno;
+             msgno = index_nextinseq(state, seq, msgno + 1, usinguid)) {
             r = _fetch_setseen(state, mboxevent, msgno);
             if (r) break;
         }
@@ -1197,12 +1325,21 @@ EXPORTED int index_fetch(struct index_state *state,
 /*
  * Perform a STORE command on a sequence
  */
+/* How many records to process before cooperatively releasing the
+ * index lock so that delivery and expunge can interleave with a
+ * greedy client.  Flag stores are cheap in-memory updates, so the
+ * chunks can be large; annotator callouts go out over the network
+ * per message, so they yield much more often. */
+#define STORE_YIELD_RECORDS     4096
+#define ANNOTATOR_YIELD_RECORDS 256
+
 EXPORTED int index_store(struct index_state *state, char *sequence,
                          struct storeargs *storeargs)
 {
     struct mailbox *mailbox;
     int i, r = 0;
     uint32_t msgno;
+    uint32_t nstored = 0;
     int userflag;
     struct seqset *seq;
     struct index_map *im;
@@ -1236,10 +1373,30 @@ EXPORTED int index_store(struct index_state *state, char *sequence,
 
     storeargs->update_time = time((time_t *)0);
 
-    for (msgno = 1; msgno <= state->exists; msgno++) {
+    for (msgno = index_nextinseq(state, seq, 1, storeargs->usinguid);
+         msgno;
+         msgno = index_nextinseq(state, seq, msgno + 1, storeargs->usinguid)) {
+        /* Periodically drop the index lock so writers can interleave.
+         * Unlocking commits the changes so far, and relocking refreshes
+         * the map, so anything an interleaved writer touched is caught
+         * by the modseq check below when we come back around.
+         * Annotation stores keep the lock so the whole sequence stays
+         * in one annotate transaction. */
+        if (nstored >= STORE_YIELD_RECORDS &&
+            storeargs->operation != STORE_ANNOTATION) {
+            nstored = 0;
+            index_unlock(state);
+            r = index_lock(state);
+            if (r) {
+                /* mailbox has gone away, nothing left to unlock */
+                mboxevent_freequeue(&mboxevents);
+                seqset_free(seq);
+                return r;
+            }
+            mailbox = state->mailbox;
+        }
+
         im = &state->map[msgno-1];
-        if (!seqset_ismember(seq, storeargs->usinguid ? im->uid : msgno))
-            continue;
 
         /* if it's expunged already, skip it now */
         if ((im->system_flags & FLAG_EXPUNGED))
@@ -1261,6 +1418,8 @@ EXPORTED int index_store(struct index_state *state, char *sequence,
         r = index_reload_record(state, msgno, &record);
         if (r) goto out;
 
+        nstored++;
+
         switch (storeargs->operation) {
         case STORE_ADD_FLAGS:
         case STORE_REMOVE_FLAGS:
@@ -1367,6 +1526,7 @@ EXPORTED int index_run_annotator(struct index_state *state,
     struct index_map *im;
     uint32_t msgno;
     struct appendstate as;
+    int nprocessed = 0;
     int r = 0;
 
     /* We do the acl check here rather than in append_setup_mbox()
@@ -1392,6 +1552,27 @@ EXPORTED int index_run_annotator(struct index_state *state,
     prefetch_messages(state, seq, usinguid);
 
     for (msgno = 1; msgno <= state->exists; msgno++) {
+        /* The annotator callout goes out over the network for each
+         * message, so don't sit on the index lock for the whole
+         * sequence: commit what we have so far and let writers in
+         * before carrying on. */
+        if (nprocessed >= ANNOTATOR_YIELD_RECORDS) {
+            nprocessed = 0;
+            r = append_commit(&as);
+            if (r) goto out;
+            index_unlock(state);
+            r = index_lock(state);
+            if (r) {
+                /* mailbox has gone away, nothing left to unlock */
+                seqset_free(seq);
+                return r;
+            }
+            r = append_setup_mbox(&as, state->mailbox,
+                                  state->userid, state->authstate,
+                                  0, NULL, namespace, isadmin, 0);
+            if (r) goto out;
+        }
+
         im = &state->map[msgno-1];
         if (!seqset_ismember(seq, usinguid ? im->uid : msgno))
             continue;
@@ -1408,6 +1589,8 @@ EXPORTED int index_run_annotator(struct index_state *state,
 
         r = index_rewrite_record(state, msgno, &record);
         if (r) goto out;
+
+        nprocessed++;
     }
 
 out:
@@ -1684,6 +1867,11 @@ static int index_lock(struct index_state *state)
     int r;
 
     if (state->mailbox) {
+        /* snapshot sessions serve every read from the state pinned at
+         * open: no lock, no stat, no revalidation.  Record reads are
+         * already safe unlocked under the name lock we still hold -
+         * see the comment in index_reload_record() */
+        if (state->snapshot) return 0;
         if (state->examining) {
             r = mailbox_lock_index(state->mailbox, LOCK_SHARED);
             if (r) return r;
@@ -1753,6 +1941,11 @@ static void index_unlock(struct index_state *state)
     /* grab the latest modseq */
     state->highestmodseq = state->mailbox->i.highestmodseq;
 
+    /* a snapshot session only ever holds the lock it was opened with;
+     * after that first unlock there is nothing to release */
+    if (state->snapshot && !mailbox_index_islocked(state->mailbox, 0))
+        return;
+
     mailbox_unlock_index(state->mailbox, NULL);
 }
 
@@ -1790,6 +1983,7 @@ EXPORTED int index_search(struct index_state *state,
 {
     search_query_t *query = NULL;
     search_folder_t *folder;
+    struct xstats_timer timer;
     int nmsg = 0;
     int i;
     modseq_t highestmodseq = 0;
@@ -1802,7 +1996,9 @@ EXPORTED int index_search(struct index_state *state,
     highestmodseq = needs_modseq(searchargs, NULL);
 
     query = search_query_new(state, searchargs);
+    xstats_timer_start(&timer);
     r = search_query_run(query);
+    xstats_timer_end(&timer, INDEX_SEARCH);
     if (r) goto out;        /* search failed */
     folder = search_query_find_folder(query, index_mboxname(state));
 
@@ -2744,8 +2940,23 @@ EXPORTED int index_thread(struct index_state *state, int algorithm,
     }
 
     if (nmsg) {
+        int threaded = 0;
+
+        /* If we're threading the whole mailbox with REFERENCES or REFS,
+         * try to answer from the stored snapshot; if we can't, have the
+         * threader save its result so the next THREAD can */
+        if ((unsigned) nmsg == state->exists &&
+            (thread_algs[algorithm].threader == index_thread_references ||
+             thread_algs[algorithm].threader == index_thread_refs)) {
+            threaded = index_thread_snapshot(state, algorithm, usinguid);
+            if (!threaded) thread_snapshot_capture = algorithm;
+        }
+
         /* Thread messages using given algorithm */
-        (*thread_algs[algorithm].threader)(state, msgno_list, nmsg, usinguid);
+        if (!threaded)
+            (*thread_algs[algorithm].threader)(state, msgno_list, nmsg,
+                                               usinguid);
+        thread_snapshot_capture = -1;
 
         free(msgno_list);
 
@@ -3033,6 +3244,50 @@ EXPORTED uint32_t index_finduid(struct index_state *state, uint32_t uid)
     return high;
 }
 
+/*
+ * Return the first msgno at or after 'msgno' whose UID (or msgno, if
+ * not 'usinguid') is a member of 'seq', or 0 if there are no more.
+ * Rather than testing every message, whole gaps between ranges are
+ * skipped with a binary search on the (UID-sorted) map, so walking a
+ * sparse sequence over a million-message mailbox only touches the
+ * members.
+ */
+static uint32_t index_nextinseq(struct index_state *state,
+                                struct seqset *seq,
+                                uint32_t msgno, int usinguid)
+{
+    if (!seq) return 0;
+
+    while (msgno && msgno <= state->exists) {
+        unsigned val = usinguid ? state->map[msgno-1].uid : msgno;
+
+        if (seqset_ismember(seq, val))
+            return msgno;
+
+        /* find the first range past this value */
+        size_t low = 0;
+        size_t high = seq->len;
+        while (low < high) {
+            size_t mid = low + (high - low)/2;
+            if (seq->set[mid].high < val)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        if (low == seq->len)
+            return 0; /* no more ranges */
+
+        /* jump to the start of that range (it begins above 'val',
+         * else ismember would have matched) */
+        if (usinguid)
+            msgno = index_finduid(state, seq->set[low].low - 1) + 1;
+        else
+            msgno = seq->set[low].low;
+    }
+
+    return 0;
+}
+
 /* Helper function to determine domain of data */
 enum {
     DOMAIN_7BIT = 0,
@@ -3119,7 +3374,7 @@ void index_fetchmsg(struct index_state *state, const struct buf *msg,
     /* Non-text literal -- tell the protstream about it */
     if (domain != DOMAIN_7BIT) prot_data_boundary(state->out);
 
-    prot_write(state->out, msg->s + offset, n);
+    prot_writemap(state->out, msg->s + offset, n);
     while (n++ < size) {
         /* File too short, resynch client.
          *
@@ -3609,10 +3864,15 @@ static void index_tellexpunge(struct index_state *state)
             if (msgno > state->oldexists)
                 continue;
             state->oldexists--;
-            if ((client_capa & CAPA_QRESYNC))
+            if ((client_capa & CAPA_QRESYNC)) {
                 seqset_add(vanishedlist, im->uid, 1);
-            else
-                prot_printf(state->out, "* %u EXPUNGE\r\n", msgno);
+            }
+            else {
+                /* one per expunged message, so skip the printf */
+                prot_puts(state->out, "* ");
+                prot_putuint32(state->out, msgno);
+                prot_puts(state->out, " EXPUNGE\r\n");
+            }
             continue;
         }
 
@@ -3740,30 +4000,40 @@ static void index_fetchflags(struct index_state *state,
     bit32 flagmask = 0;
     struct index_map *im = &state->map[msgno-1];
 
-    prot_printf(state->out, "* %u FETCH (FLAGS ", msgno);
+    /* this runs once per message of a bulk FETCH - constant fragments
+     * and prot_putuint32 keep the printf machinery out of the loop */
+    prot_puts(state->out, "* ");
+    prot_putuint32(state->out, msgno);
+    prot_puts(state->out, " FETCH (FLAGS ");
 
     if (im->isrecent) {
-        prot_printf(state->out, "%c\\Recent", sepchar);
+        (void)prot_putc(sepchar, state->out);
+        prot_puts(state->out, "\\Recent");
         sepchar = ' ';
     }
     if (im->system_flags & FLAG_ANSWERED) {
-        prot_printf(state->out, "%c\\Answered", sepchar);
+        (void)prot_putc(sepchar, state->out);
+        prot_puts(state->out, "\\Answered");
         sepchar = ' ';
     }
     if (im->system_flags & FLAG_FLAGGED) {
-        prot_printf(state->out, "%c\\Flagged", sepchar);
+        (void)prot_putc(sepchar, state->out);
+        prot_puts(state->out, "\\Flagged");
         sepchar = ' ';
     }
     if (im->system_flags & FLAG_DRAFT) {
-        prot_printf(state->out, "%c\\Draft", sepchar);
+        (void)prot_putc(sepchar, state->out);
+        prot_puts(state->out, "\\Draft");
         sepchar = ' ';
     }
     if (im->system_flags & FLAG_DELETED) {
-        prot_printf(state->out, "%c\\Deleted", sepchar);
+        (void)prot_putc(sepchar, state->out);
+        prot_puts(state->out, "\\Deleted");
         sepchar = ' ';
     }
     if (im->isseen) {
-        prot_printf(state->out, "%c\\Seen", sepchar);
+        (void)prot_putc(sepchar, state->out);
+        prot_puts(state->out, "\\Seen");
         sepchar = ' ';
     }
     for (flag = 0; flag < VECTOR_SIZE(state->flagname); flag++) {
@@ -3771,7 +4041,8 @@ static void index_fetchflags(struct index_state *state,
             flagmask = im->user_flags[flag/32];
         }
         if (state->flagname[flag] && (flagmask & (1<<(flag & 31)))) {
-            prot_printf(state->out, "%c%s", sepchar, state->flagname[flag]);
+            (void)prot_putc(sepchar, state->out);
+            prot_puts(state->out, state->flagname[flag]);
             sepchar = ' ';
         }
     }
@@ -3790,11 +4061,16 @@ static void index_printflags(struct index_state *state,
     /* http://www.rfc-editor.org/errata_search.php?rfc=5162
      * Errata ID: 1807 - MUST send UID and MODSEQ to all
      * untagged FETCH unsolicited responses */
-    if (usinguid || (client_capa & CAPA_QRESYNC))
-        prot_printf(state->out, " UID %u", im->uid);
-    if (printmodseq || (client_capa & CAPA_CONDSTORE))
-        prot_printf(state->out, " MODSEQ (" MODSEQ_FMT ")", im->modseq);
-    prot_printf(state->out, ")\r\n");
+    if (usinguid || (client_capa & CAPA_QRESYNC)) {
+        prot_puts(state->out, " UID ");
+        prot_putuint32(state->out, im->uid);
+    }
+    if (printmodseq || (client_capa & CAPA_CONDSTORE)) {
+        prot_puts(state->out, " MODSEQ (");
+        prot_putuint64(state->out, im->modseq);
+        (void)prot_putc(')', state->out);
+    }
+    prot_puts(state->out, ")\r\n");
 }
 
 /* interface message_read_bodystructure which makes sure the cache record
@@ -3816,6 +4092,28 @@ static void loadbody(struct mailbox *mailbox, struct index_record *record,
     *bodyp = body;
 }
 
+/* as loadbody(), but only parses enough of the cached bodystructure to
+ * resolve body sections: part types, nesting and the section offsets.
+ * Clients fetching a single attachment of a large multipart message
+ * otherwise pay to materialize the envelopes and parameters of every
+ * part just to look up one pair of offsets */
+static void loadsectionbody(struct mailbox *mailbox,
+                            struct index_record *record,
+                            struct body **bodyp)
+{
+    if (*bodyp) return;
+    if (mailbox_cacherecord(mailbox, record)) return;
+    struct body *body = xzmalloc(sizeof(struct body));
+    message_read_bodystructure_sections(record, &body->subpart);
+    body->type = xstrdup("MESSAGE");
+    body->subtype = xstrdup("RFC822");
+    body->header_offset = 0;
+    body->header_size = 0;
+    body->content_offset = 0;
+    body->content_offset = record->size;
+    *bodyp = body;
+}
+
 /*
  * Helper function to send requested * FETCH data for a message
  */
@@ -3881,11 +4179,15 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
     else if ((fetchitems & ~FETCH_SETSEEN) || fetchargs->fsections ||
              fetchargs->headers.count || fetchargs->headers_not.count) {
         /* these fetch items will always succeed, so start the response */
-        prot_printf(state->out, "* %u FETCH ", msgno);
+        prot_puts(state->out, "* ");
+        prot_putuint32(state->out, msgno);
+        prot_puts(state->out, " FETCH ");
         started = 1;
     }
     if (fetchitems & FETCH_UID || (ischanged && (client_capa & CAPA_QRESYNC))) {
-        prot_printf(state->out, "%cUID %u", sepchar, record.uid);
+        (void)prot_putc(sepchar, state->out);
+        prot_puts(state->out, "UID ");
+        prot_putuint32(state->out, record.uid);
         sepchar = ' ';
     }
     if (fetchitems & FETCH_GUID) {
@@ -3900,18 +4202,23 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
 
         time_to_rfc3501(msgdate, datebuf, sizeof(datebuf));
 
-        prot_printf(state->out, "%cINTERNALDATE \"%s\"",
-                    sepchar, datebuf);
+        (void)prot_putc(sepchar, state->out);
+        prot_puts(state->out, "INTERNALDATE \"");
+        prot_puts(state->out, datebuf);
+        (void)prot_putc('\"', state->out);
         sepchar = ' ';
     }
     if (fetchitems & FETCH_MODSEQ || (ischanged && (client_capa & CAPA_CONDSTORE))) {
-        prot_printf(state->out, "%cMODSEQ (" MODSEQ_FMT ")",
-                    sepchar, record.modseq);
+        (void)prot_putc(sepchar, state->out);
+        prot_puts(state->out, "MODSEQ (");
+        prot_putuint64(state->out, record.modseq);
+        (void)prot_putc(')', state->out);
         sepchar = ' ';
     }
     if (fetchitems & FETCH_SIZE) {
-        prot_printf(state->out, "%cRFC822.SIZE %u",
-                    sepchar, record.size);
+        (void)prot_putc(sepchar, state->out);
+        prot_puts(state->out, "RFC822.SIZE ");
+        prot_putuint32(state->out, record.size);
         sepchar = ' ';
     }
     if ((fetchitems & FETCH_ANNOTATION)) {
@@ -4058,7 +4365,7 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
         prot_printf(state->out, "%s ", fsection->trail);
 
         if (fetchargs->cache_atleast > record.cache_version) {
-            loadbody(mailbox, &record, &body);
+            loadsectionbody(mailbox, &record, &body);
             if (body) {
                 index_fetchfsection(state, buf.s, buf.len,
                                     fsection,
@@ -4091,7 +4398,7 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
 
         oi = &section->octetinfo;
 
-        loadbody(mailbox, &record, &body);
+        loadsectionbody(mailbox, &record, &body);
         if (body) {
             r = index_fetchsection(state, respbuf, &buf,
                     section->name, body, record.size,
@@ -4111,7 +4418,7 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
         snprintf(respbuf+strlen(respbuf), sizeof(respbuf)-strlen(respbuf),
                  "%cBINARY[%s ", sepchar, section->name);
 
-        loadbody(mailbox, &record, &body);
+        loadsectionbody(mailbox, &record, &body);
         if (body) {
             oi = &section->octetinfo;
             r = index_fetchsection(state, respbuf, &buf,
@@ -4132,7 +4439,7 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
         snprintf(respbuf+strlen(respbuf), sizeof(respbuf)-strlen(respbuf),
                  "%cBINARY.SIZE[%s ", sepchar, section->name);
 
-        loadbody(mailbox, &record, &body);
+        loadsectionbody(mailbox, &record, &body);
         if (body) {
             r = index_fetchsection(state, respbuf, &buf,
                                    section->name, body, record.size,
@@ -4201,7 +4508,12 @@ EXPORTED int index_urlfetch(struct index_state *state, uint32_t msgno,
     r = index_reload_record(state, msgno, &record);
     if (r) goto done;
 
-    loadbody(mailbox, &record, &body);
+    /* BODYPARTSTRUCTURE needs the full part tree; plain section
+     * fetches only need types, nesting and offsets */
+    if (params & URLFETCH_BODYPARTSTRUCTURE)
+        loadbody(mailbox, &record, &body);
+    else
+        loadsectionbody(mailbox, &record, &body);
     if (!body) goto done;
     top = body;
 
@@ -5021,7 +5333,9 @@ MsgData **index_msgdata_load(struct index_state *state,
                 label == SORT_CONVEXISTS || label == SORT_CONVSIZE) && !did_conv) {
                 if (!cstate) cstate = conversations_get_mbox(index_mboxname(state));
                 assert(cstate);
-                if (conversation_load(cstate, record.cid, &conv))
+                /* the sort keys only need the counts */
+                if (conversation_load_advanced(cstate, record.cid, &conv,
+                                               CONV_WANT_COUNTS))
                     continue;
                 if (!conv) conv = conversation_new(cstate);
                 did_conv++;
@@ -5029,7 +5343,10 @@ MsgData **index_msgdata_load(struct index_state *state,
 
             switch (label) {
             case SORT_CC:
-                cur->cc = get_localpart_addr(cacheitem_base(&record, CACHE_CC));
+                cur->cc = index_cached_sortkey(&record, SORTKEY_CC, NULL);
+                if (!cur->cc)
+                    cur->cc = message_extract_localpart(
+                              cacheitem_base(&record, CACHE_CC));
                 break;
             case SORT_DATE:
                 cur->sentdate = record.gmtime;
@@ -5038,7 +5355,10 @@ MsgData **index_msgdata_load(struct index_state *state,
                 cur->internaldate = record.internaldate;
                 break;
             case SORT_FROM:
-                cur->from = get_localpart_addr(cacheitem_base(&record, CACHE_FROM));
+                cur->from = index_cached_sortkey(&record, SORTKEY_FROM, NULL);
+                if (!cur->from)
+                    cur->from = message_extract_localpart(
+                                cacheitem_base(&record, CACHE_FROM));
                 break;
             case SORT_MODSEQ:
                 /* already copied above */
@@ -5047,13 +5367,20 @@ MsgData **index_msgdata_load(struct index_state *state,
                 cur->size = record.size;
                 break;
             case SORT_SUBJECT:
-                cur->xsubj = index_extract_subject(cacheitem_base(&record, CACHE_SUBJECT),
-                                                   cacheitem_size(&record, CACHE_SUBJECT),
-                                                   &cur->is_refwd);
+                cur->xsubj = index_cached_sortkey(&record, SORTKEY_SUBJECT,
+                                                  &cur->is_refwd);
+                if (!cur->xsubj)
+                    cur->xsubj = message_extract_subject(
+                                 cacheitem_base(&record, CACHE_SUBJECT),
+                                 cacheitem_size(&record, CACHE_SUBJECT),
+                                 &cur->is_refwd);
                 cur->xsubj_hash = strhash(cur->xsubj);
                 break;
             case SORT_TO:
-                cur->to = get_localpart_addr(cacheitem_base(&record, CACHE_TO));
+                cur->to = index_cached_sortkey(&record, SORTKEY_TO, NULL);
+                if (!cur->to)
+                    cur->to = message_extract_localpart(
+                              cacheitem_base(&record, CACHE_TO));
                 break;
             case SORT_ANNOTATION: {
                 struct buf value = BUF_INITIALIZER;
@@ -5074,12 +5401,20 @@ MsgData **index_msgdata_load(struct index_state *state,
                                               cacheitem_size(&record, CACHE_HEADERS));
                 break;
             case SORT_DISPLAYFROM:
-                cur->displayfrom = get_displayname(
-                                   cacheitem_base(&record, CACHE_FROM));
+                cur->displayfrom = index_cached_sortkey(&record,
+                                                        SORTKEY_DISPLAYFROM,
+                                                        NULL);
+                if (!cur->displayfrom)
+                    cur->displayfrom = message_extract_displayname(
+                                       cacheitem_base(&record, CACHE_FROM));
                 break;
             case SORT_DISPLAYTO:
-                cur->displayto = get_displayname(
-                                 cacheitem_base(&record, CACHE_TO));
+                cur->displayto = index_cached_sortkey(&record,
+                                                      SORTKEY_DISPLAYTO,
+                                                      NULL);
+                if (!cur->displayto)
+                    cur->displayto = message_extract_displayname(
+                                     cacheitem_base(&record, CACHE_TO));
                 break;
             case SORT_SPAMSCORE: {
                 const char *score = index_getheader(state, cur->msgno, "X-Spam-score");
@@ -5123,234 +5458,48 @@ MsgData **index_msgdata_load(struct index_state *state,
     return ptrs;
 }
 
-static char *get_localpart_addr(const char *header)
-{
-    struct address *addr = NULL;
-    char *ret = NULL;
-
-    parseaddr_list(header, &addr);
-    if (!addr) return NULL;
-
-    if (addr->mailbox)
-        ret = xstrdup(addr->mailbox);
-
-    parseaddr_free(addr);
-
-    return ret;
-}
-
 /*
- * Get the 'display-name' of an address from a header
+ * Pull one precomputed sort key out of the CACHE_SORTKEYS item.
+ * Returns NULL if the record predates cache version 8 (or the item
+ * is malformed), in which case the caller falls back to extracting
+ * the key from the other cache items the old, slow way.
  */
-static char *get_displayname(const char *header)
+static char *index_cached_sortkey(const struct index_record *record,
+                                  int field, int *is_refwd)
 {
-    struct address *addr = NULL;
-    char *ret = NULL;
-    char *p;
-
-    parseaddr_list(header, &addr);
-    if (!addr) return NULL;
-
-    if (addr->name && addr->name[0]) {
-        /* pure RFC5255 compatible "searchform" conversion */
-        ret = charset_utf8_to_searchform(addr->name, /*flags*/0);
-    }
-    else if (addr->domain && addr->mailbox) {
-        ret = strconcat(addr->mailbox, "@", addr->domain, (char *)NULL);
-        /* gotta uppercase mailbox/domain */
-        for (p = ret; *p; p++)
-            *p = toupper(*p);
-    }
-    else if (addr->mailbox) {
-        ret = xstrdup(addr->mailbox);
-        /* gotta uppercase mailbox/domain */
-        for (p = ret; *p; p++)
-            *p = toupper(*p);
-    }
-
-    parseaddr_free(addr);
-
-    return ret;
-}
-
-/*
- * Extract base subject from subject header
- *
- * This is a wrapper around _index_extract_subject() which preps the
- * subj NSTRING and checks for Netscape "[Fwd: ]".
- */
-static char *index_extract_subject(const char *subj, size_t len, int *is_refwd)
-{
-    char *rawbuf, *buf, *s, *base;
-
-    /* parse the subj NSTRING and make a working copy */
-    if (!strcmp(subj, "NIL")) {                 /* NIL? */
-        return xstrdup("");                     /* yes, return empty */
-    } else if (*subj == '"') {                  /* quoted? */
-        rawbuf = xstrndup(subj + 1, len - 2);   /* yes, strip quotes */
-    } else {
-        s = strchr(subj, '}') + 3;              /* literal, skip { }\r\n */
-        rawbuf = xstrndup(s, len - (s - subj));
-    }
-
-    buf = charset_parse_mimeheader(rawbuf, charset_flags);
-    free(rawbuf);
-
-    for (s = buf;;) {
-        base = _index_extract_subject(s, is_refwd);
+    const char *base, *end;
+    uint32_t len;
+    int i;
 
-        /* If we have a Netscape "[Fwd: ...]", extract the contents */
-        if (!strncasecmp(base, "[fwd:", 5) &&
-            base[strlen(base) - 1]  == ']') {
+    if (record->cache_version < MAILBOX_CACHE_SORTKEY_VERSION)
+        return NULL;
+    if (cacheitem_size(record, CACHE_SORTKEYS) < CACHE_ITEM_SIZE_SKIP)
+        return NULL;
 
-            /* inc refwd counter */
-            *is_refwd += 1;
+    base = cacheitem_base(record, CACHE_SORTKEYS);
+    end = base + cacheitem_size(record, CACHE_SORTKEYS);
 
-            /* trim "]" */
-            base[strlen(base) - 1] = '\0';
+    /* skip the leading ref/fwd counter; it's only reported once the
+     * requested key has actually been found */
+    base += CACHE_ITEM_SIZE_SKIP;
 
-            /* trim "[fwd:" */
-            s = base + 5;
+    for (i = 0; i <= field; i++) {
+        if (base + CACHE_ITEM_SIZE_SKIP > end) return NULL;
+        len = CACHE_ITEM_BIT32(base);
+        base += CACHE_ITEM_SIZE_SKIP;
+        if (base + len > end) return NULL;
+        if (i == field) {
+            if (is_refwd)
+                *is_refwd =
+                    CACHE_ITEM_BIT32(cacheitem_base(record, CACHE_SORTKEYS));
+            return xstrndup(base, len);
         }
-        else /* otherwise, we're done */
-            break;
-    }
-
-    base = xstrdup(base);
-
-    free(buf);
-
-    for (s = base; *s; s++) {
-        *s = toupper(*s);
+        base += (len + 3) & ~3;         /* xdrstrings are padded */
     }
 
-    return base;
+    return NULL;
 }
 
-/*
- * Guts of subject extraction.
- *
- * Takes a subject string and returns a pointer to the base.
- */
-static char *_index_extract_subject(char *s, int *is_refwd)
-{
-    char *base, *x;
-
-    /* trim trailer
-     *
-     * start at the end of the string and work towards the front,
-     * resetting the end of the string as we go.
-     */
-    for (x = s + strlen(s) - 1; x >= s;) {
-        if (Uisspace(*x)) {                             /* whitespace? */
-            *x = '\0';                                  /* yes, trim it */
-            x--;                                        /* skip past it */
-        }
-        else if (x - s >= 4 &&
-                 !strncasecmp(x-4, "(fwd)", 5)) {       /* "(fwd)"? */
-            *(x-4) = '\0';                              /* yes, trim it */
-            x -= 5;                                     /* skip past it */
-            *is_refwd += 1;                             /* inc refwd counter */
-        }
-        else
-            break;                                      /* we're done */
-    }
-
-    /* trim leader
-     *
-     * start at the head of the string and work towards the end,
-     * skipping over stuff we don't care about.
-     */
-    for (base = s; base;) {
-        if (Uisspace(*base)) base++;                    /* whitespace? */
-
-        /* possible refwd */
-        else if ((!strncasecmp(base, "re", 2) &&        /* "re"? */
-                  (x = base + 2)) ||                    /* yes, skip past it */
-                 (!strncasecmp(base, "fwd", 3) &&       /* "fwd"? */
-                  (x = base + 3)) ||                    /* yes, skip past it */
-                 (!strncasecmp(base, "fw", 2) &&        /* "fw"? */
-                  (x = base + 2))) {                    /* yes, skip past it */
-            int count = 0;                              /* init counter */
-
-            while (Uisspace(*x)) x++;                   /* skip whitespace */
-
-            if (*x == '[') {                            /* start of blob? */
-                for (x++; x;) {                         /* yes, get count */
-                    if (!*x) {                          /* end of subj, quit */
-                        x = NULL;
-                        break;
-                    }
-                    else if (*x == ']') {               /* end of blob, done */
-                        break;
-                                        /* if we have a digit, and we're still
-                                           counting, keep building the count */
-                    } else if (cyrus_isdigit((int) *x) && count != -1) {
-                        count = count * 10 + *x - '0';
-                        if (count < 0) {                /* overflow */
-                            count = -1; /* abort counting */
-                        }
-                    } else {                            /* no digit, */
-                        count = -1;                     /*  abort counting */
-                    }
-                    x++;
-                }
-
-                if (x)                                  /* end of blob? */
-                    x++;                                /* yes, skip past it */
-                else
-                    break;                              /* no, we're done */
-            }
-
-            while (Uisspace(*x)) x++;                   /* skip whitespace */
-
-            if (*x == ':') {                            /* ending colon? */
-                base = x + 1;                           /* yes, skip past it */
-                *is_refwd += (count > 0 ? count : 1);   /* inc refwd counter
-                                                           by count or 1 */
-            }
-            else
-                break;                                  /* no, we're done */
-        }
-
-#if 0 /* do nested blobs - wait for decision on this */
-        else if (*base == '[') {                        /* start of blob? */
-            int count = 1;                              /* yes, */
-            x = base + 1;                               /*  find end of blob */
-            while (count) {                             /* find matching ']' */
-                if (!*x) {                              /* end of subj, quit */
-                    x = NULL;
-                    break;
-                }
-                else if (*x == '[')                     /* new open */
-                    count++;                            /* inc counter */
-                else if (*x == ']')                     /* close */
-                    count--;                            /* dec counter */
-                x++;
-            }
-
-            if (!x)                                     /* blob didn't close */
-                break;                                  /*  so quit */
-
-            else if (*x)                                /* end of subj? */
-                base = x;                               /* no, skip blob */
-#else
-        else if (*base == '[' &&                        /* start of blob? */
-                 (x = strpbrk(base+1, "[]")) &&         /* yes, end of blob */
-                 *x == ']') {                           /*  (w/o nesting)? */
-
-            if (*(x+1))                                 /* yes, end of subj? */
-                base = x + 1;                           /* no, skip blob */
-#endif
-            else
-                break;                                  /* yes, return blob */
-        }
-        else
-            break;                                      /* we're done */
-    }
-
-    return base;
-}
 
 /* Get message-id, and references/in-reply-to */
 
@@ -6258,6 +6407,332 @@ static void index_thread_search(struct index_state *state,
     }
 }
 
+/*
+ * Persistent thread snapshot.
+ *
+ * Threading a large mailbox is dominated by loading and parsing the
+ * cached headers of every message, and clients tend to re-issue THREAD
+ * on every folder view even though nothing (or very little) changed.
+ * So whenever we thread the whole mailbox with REFERENCES or REFS we
+ * flatten the finished tree to cyrus.thread, keyed by the algorithm,
+ * uidvalidity, last_uid and highestmodseq.  If the key still matches on
+ * the next THREAD we answer straight from the snapshot without loading
+ * any message data.  If only flags changed or messages were expunged
+ * (modseq moved but last_uid didn't), we patch the expunged messages
+ * out of the stored tree instead of rethreading, falling back to a
+ * full rebuild whenever a removal might change the ordering mandated
+ * by RFC 5256.  Appends always rethread (and refresh the snapshot).
+ *
+ * Like cyrus.squat, the snapshot is a disposable by-product - it is
+ * never transferred by sync or dump and is simply rebuilt if missing,
+ * stale or unparsable.
+ */
+#define THREAD_SNAPSHOT_VERSION 1
+#define THREAD_SNAPSHOT_MAGIC 0x54485244   /* "THRD" */
+
+struct thread_snapnode {
+    uint32_t depth;             /* 0 = a root of the thread forest */
+    uint32_t uid;               /* 0 = an empty (dummy) container */
+};
+
+/*
+ * Flatten a sibling list (and everything below it) into 'buf' in
+ * preorder as (depth, uid) pairs.  Returns the number of nodes written.
+ */
+static unsigned int thread_snapshot_flatten(struct buf *buf, Thread *thread,
+                                            uint32_t depth)
+{
+    unsigned int n = 0;
+
+    while (thread) {
+        buf_appendbit32(buf, depth);
+        buf_appendbit32(buf, thread->msgdata ? thread->msgdata->uid : 0);
+        n++;
+        if (thread->child)
+            n += thread_snapshot_flatten(buf, thread->child, depth + 1);
+        thread = thread->next;
+    }
+
+    return n;
+}
+
+/*
+ * Write the tree below the dummy 'root' to cyrus.thread, replacing any
+ * previous snapshot atomically.  Failure to store is not an error, the
+ * worst case is just another full rethread later.
+ */
+static void thread_snapshot_store(struct index_state *state, int algorithm,
+                                  Thread *root)
+{
+    struct mailbox *mailbox = state->mailbox;
+    const char *fname = mailbox_meta_newfname(mailbox, META_THREAD);
+    struct buf buf = BUF_INITIALIZER;
+    struct buf nodes = BUF_INITIALIZER;
+    unsigned int nnodes;
+    int fd;
+
+    nnodes = thread_snapshot_flatten(&nodes, root->child, 0);
+
+    buf_appendbit32(&buf, THREAD_SNAPSHOT_MAGIC);
+    buf_appendbit32(&buf, THREAD_SNAPSHOT_VERSION);
+    buf_appendbit32(&buf, algorithm);
+    buf_appendbit32(&buf, mailbox->i.uidvalidity);
+    buf_appendbit32(&buf, mailbox->i.last_uid);
+    buf_appendbit64(&buf, mailbox->i.highestmodseq);
+    buf_appendbit32(&buf, nnodes);
+    buf_appendmap(&buf, nodes.s, nodes.len);
+
+    fd = open(fname, O_WRONLY|O_TRUNC|O_CREAT, 0666);
+    if (fd == -1) {
+        syslog(LOG_ERR, "IOERROR: creating %s: %m", fname);
+        goto done;
+    }
+
+    if (retry_write(fd, buf.s, buf.len) == -1 || fsync(fd) == -1) {
+        syslog(LOG_ERR, "IOERROR: writing %s: %m", fname);
+        close(fd);
+        unlink(fname);
+        goto done;
+    }
+    close(fd);
+
+    mailbox_meta_rename(mailbox, META_THREAD);
+
+ done:
+    buf_free(&nodes);
+    buf_free(&buf);
+}
+
+/*
+ * Read the stored snapshot for 'algorithm', if any.  Returns nonzero
+ * and fills in the node array (caller frees) and the last_uid and
+ * highestmodseq it was taken at; returns zero if there is no usable
+ * snapshot for this mailbox incarnation.
+ */
+static int thread_snapshot_load(struct index_state *state, int algorithm,
+                                uint32_t *lastuidp, modseq_t *modseqp,
+                                struct thread_snapnode **nodesp,
+                                unsigned int *nnodesp)
+{
+    const char *fname = mailbox_meta_fname(state->mailbox, META_THREAD);
+    struct thread_snapnode *nodes = NULL;
+    uint32_t *body = NULL;
+    bit32 hdr[8];
+    unsigned int nnodes, i;
+    struct stat sbuf;
+    int fd;
+
+    fd = open(fname, O_RDONLY);
+    if (fd == -1) return 0;
+
+    if (fstat(fd, &sbuf) == -1) goto fail;
+    if ((size_t) sbuf.st_size < sizeof(hdr)) goto fail;
+    if (retry_read(fd, hdr, sizeof(hdr)) != sizeof(hdr)) goto fail;
+
+    if (ntohl(hdr[0]) != THREAD_SNAPSHOT_MAGIC ||
+        ntohl(hdr[1]) != THREAD_SNAPSHOT_VERSION ||
+        ntohl(hdr[2]) != (uint32_t) algorithm ||
+        ntohl(hdr[3]) != state->mailbox->i.uidvalidity)
+        goto fail;
+
+    nnodes = ntohl(hdr[7]);
+    if (!nnodes ||
+        (size_t) sbuf.st_size != sizeof(hdr) + nnodes * 2 * sizeof(uint32_t))
+        goto fail;
+
+    body = xmalloc(nnodes * 2 * sizeof(uint32_t));
+    if (retry_read(fd, body, nnodes * 2 * sizeof(uint32_t)) !=
+        (ssize_t) (nnodes * 2 * sizeof(uint32_t)))
+        goto fail;
+    close(fd);
+
+    nodes = xmalloc(nnodes * sizeof(struct thread_snapnode));
+    for (i = 0; i < nnodes; i++) {
+        nodes[i].depth = ntohl(body[2*i]);
+        nodes[i].uid = ntohl(body[2*i+1]);
+    }
+    free(body);
+
+    *lastuidp = ntohl(hdr[4]);
+    *modseqp = ((modseq_t) ntohl(hdr[5]) << 32) | ntohl(hdr[6]);
+    *nodesp = nodes;
+    *nnodesp = nnodes;
+    return 1;
+
+ fail:
+    free(body);
+    close(fd);
+    return 0;
+}
+
+/*
+ * Rebuild a Thread tree (under a dummy root, like the threaders make)
+ * from a flattened snapshot, looking up the current msgno of every
+ * message as we go.  Messages that have since been expunged get
+ * msgno 0 and are counted in *nmissingp; *nmsgp counts the messages
+ * still present.  Returns NULL (and nothing to free) if the node list
+ * is structurally invalid.
+ */
+static Thread *thread_snapshot_tree(struct index_state *state,
+                                    const struct thread_snapnode *nodes,
+                                    unsigned int nnodes,
+                                    unsigned int *nmsgp,
+                                    unsigned int *nmissingp)
+{
+    Thread *threads, *node, **last;
+    MsgData *md;
+    uint32_t prevdepth = 0, d, msgno;
+    unsigned int i, nmsg = 0, nmissing = 0;
+
+    /* one allocation: dummy root plus a node and MsgData per entry */
+    threads = xzmalloc((nnodes + 1) * sizeof(Thread) +
+                       nnodes * sizeof(MsgData));
+    md = (MsgData *)(threads + nnodes + 1);
+    last = xzmalloc((nnodes + 1) * sizeof(Thread *));
+
+    for (i = 0; i < nnodes; i++) {
+        Thread *parent;
+
+        node = threads + 1 + i;
+        d = nodes[i].depth;
+
+        /* preorder: depth can only grow one level at a time, and
+         * dummies only ever appear at the root level */
+        if (d > prevdepth + 1 || (!i && d) || (!nodes[i].uid && d))
+            goto fail;
+
+        parent = d ? last[d - 1] : threads;
+        node->parent = parent;
+        if (last[d] && last[d]->parent == parent)
+            last[d]->next = node;
+        else
+            parent->child = node;
+        last[d] = node;
+        prevdepth = d;
+
+        node->msgdata = &md[i];
+        md[i].uid = nodes[i].uid;
+        if (nodes[i].uid) {
+            msgno = index_finduid(state, nodes[i].uid);
+            if (msgno && index_getuid(state, msgno) == nodes[i].uid) {
+                md[i].msgno = msgno;
+                nmsg++;
+            }
+            else nmissing++;
+        }
+    }
+
+    free(last);
+    *nmsgp = nmsg;
+    *nmissingp = nmissing;
+    return threads;
+
+ fail:
+    free(last);
+    free(threads);
+    return NULL;
+}
+
+/*
+ * Unlink expunged messages (uid set, msgno 0) from the sibling list at
+ * *headp, applying the same promotion rule ref_prune_tree() uses for
+ * empty containers.  Returns zero if a removal might change the
+ * ordering of the remaining messages - sibling lists are date-sorted,
+ * and root-level dummies sort by their first child - in which case the
+ * caller falls back to a full rethread.
+ */
+static int thread_snapshot_patch(Thread *parent, Thread **headp, int atroot)
+{
+    Thread **tail = headp;
+
+    while (*tail) {
+        Thread *cur = *tail;
+
+        if (cur->msgdata->uid && !cur->msgdata->msgno) {
+            /* leaves just drop out; their siblings keep their order.
+             * But a dummy's sort position came from its first child,
+             * so removing under one may reorder the root set */
+            if (!cur->child) {
+                if (!atroot && !parent->msgdata->uid) return 0;
+                *tail = cur->next;
+                continue;
+            }
+
+            /* the children of an inner node take its place, exactly
+             * like pruning an empty container - but only when there
+             * are no siblings to interleave with by date, and no
+             * date-sorted root position riding on this node */
+            if (atroot) return 0;
+            if (cur->next || tail != headp) return 0;
+            if (!parent->msgdata->uid) return 0;
+
+            for (cur = cur->child; cur; cur = cur->next)
+                cur->parent = parent;
+            cur = *tail;
+            *tail = cur->child;
+            continue;           /* rescan the promoted children */
+        }
+
+        if (!thread_snapshot_patch(cur, &cur->child, 0)) return 0;
+
+        tail = &cur->next;
+    }
+
+    return 1;
+}
+
+/*
+ * Try to answer a whole-mailbox THREAD command from the stored
+ * snapshot.  Returns nonzero once the untagged THREAD response has
+ * been printed; zero means the caller must thread from scratch (which
+ * stores a fresh snapshot).
+ */
+static int index_thread_snapshot(struct index_state *state, int algorithm,
+                                 int usinguid)
+{
+    struct mailbox *mailbox = state->mailbox;
+    struct thread_snapnode *nodes = NULL;
+    Thread *head = NULL;
+    uint32_t lastuid;
+    modseq_t modseq;
+    unsigned int nnodes, nmsg, nmissing;
+    int r = 0;
+
+    if (!thread_snapshot_load(state, algorithm, &lastuid, &modseq,
+                              &nodes, &nnodes))
+        return 0;
+
+    /* appended messages need real threading; start over */
+    if (lastuid != mailbox->i.last_uid) goto out;
+
+    head = thread_snapshot_tree(state, nodes, nnodes, &nmsg, &nmissing);
+    if (!head) goto out;
+
+    /* every message currently in the mailbox must be in the snapshot */
+    if (nmsg != state->exists) goto out;
+
+    if (modseq != mailbox->i.highestmodseq) {
+        /* flag updates and/or expunges happened since the snapshot.
+         * Flags don't show in THREAD output; expunges are patched out
+         * of the tree - except for REFS, whose root order depends on
+         * internaldates of the very messages that went away */
+        if (nmissing &&
+            thread_algs[algorithm].threader != index_thread_references)
+            goto out;
+        if (!thread_snapshot_patch(head, &head->child, 1)) goto out;
+        thread_snapshot_store(state, algorithm, head);
+    }
+    else if (nmissing) goto out;    /* can't happen, but be safe */
+
+    index_thread_print(state, head, usinguid);
+    r = 1;
+
+ out:
+    free(head);
+    free(nodes);
+    return r;
+}
+
 /*
  * Guts of the REFERENCES algorithms.  Behavior is tweaked with loadcrit[],
  * threadproc(), searchproc() and sortcrit[].
@@ -6334,6 +6809,12 @@ static void _index_thread_ref(struct index_state *state, unsigned *msgno_list,
     /* Step 6: sort threads */
     if (sortcrit) index_thread_sort(rootset.root, sortcrit);
 
+    /* Save the finished tree for future THREAD commands if requested */
+    if (thread_snapshot_capture >= 0) {
+        thread_snapshot_store(state, thread_snapshot_capture, rootset.root);
+        thread_snapshot_capture = -1;
+    }
+
     /* Output the threaded messages */
     index_thread_print(state, rootset.root, usinguid);
 
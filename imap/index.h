@@ -56,6 +56,7 @@
 #include <netinet/in.h>
 
 #include "annotate.h" /* for strlist functionality */
+#include "bitvector.h"
 #include "search_engines.h"
 #include "message_guid.h"
 #include "sequence.h"
@@ -120,7 +121,18 @@ struct index_state {
     int internalseen;
     int skipped_expunge;
     int seen_dirty;
+    /* cached per-user seen state, so steady-state refreshes (IDLE
+     * wakeups, NOOP polling) don't re-parse an unchanged seen
+     * sequence on every pass.  The bitmap is the working
+     * representation; the sequence-set string is only kept for
+     * change detection */
+    char *seenuids;
+    bitvector_t seenbv;
+    unsigned seen_lastuid;
     int examining;
+    /* EXAMINE with the examine_snapshot option: the state pinned at
+     * open is served for the whole session, no relock/revalidation */
+    int snapshot;
     int myrights;
     unsigned numrecent;
     unsigned numunseen;
@@ -230,6 +230,66 @@ static int usage(const char *name)
   exit(0);
 }
 
+/* Cheap header-only test: can any record in this mailbox possibly match
+ * the predicates?  Uses only conservative bounds from the index header,
+ * so when in doubt we still walk the records as before. */
+static int purge_possible(struct mailbox *mailbox)
+{
+    time_t now = time(0);
+
+    /* no live records, nothing to purge */
+    if (!mailbox->i.exists)
+        return 0;
+
+    if (days >= 0) {
+        /* date tests compare sentdate by default, which the header
+         * doesn't bound.  With -X we compare internaldate, and
+         * last_appenddate is an upper bound on that. */
+        time_t newest = mailbox->i.last_appenddate;
+        if (use_sentdate || newest <= 0)
+            return 1;
+        if (exact == 1) {
+            /* matching records lie in a single day-wide window */
+            time_t window_start = now - ((days/86400) + 1) * 86400;
+            if (invertmatch || newest > window_start)
+                return 1;
+            /* even the newest record predates the window */
+        }
+        else if (invertmatch) {
+            /* purging newer-than: possible unless even the newest
+             * record is too old */
+            if (now - newest < days)
+                return 1;
+        }
+        else {
+            /* purging older-than: no oldest-internaldate in the
+             * header, so we can't rule it out */
+            return 1;
+        }
+    }
+
+    if (size >= 0) {
+        /* quota usage is the sum of live record sizes, so it bounds
+         * the largest single record */
+        quota_t used = mailbox->i.quota_mailbox_used;
+        if (exact == 1) {
+            if (invertmatch || used >= (quota_t)size)
+                return 1;
+        }
+        else if (!invertmatch) {
+            /* purging larger-than: the whole mailbox isn't big enough */
+            if (used > (quota_t)size)
+                return 1;
+        }
+        else {
+            /* purging smaller-than: can't rule out */
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
 /* we don't check what comes in on matchlen and category, should we? */
 static int purge_me(struct findall_data *data, void *rock __attribute__((unused)))
 {
@@ -257,6 +317,20 @@ static int purge_me(struct findall_data *data, void *rock __attribute__((unused)
     return r;
   }
 
+  /* skip the record walk entirely if the header stats say nothing
+   * in here can match */
+  if (!purge_possible(mailbox)) {
+      if (verbose) {
+          printf("Skipping %s (header rules out a match)\n", name);
+      }
+      /* keep the report consistent with a full walk */
+      stats.total = mailbox->i.exists;
+      stats.total_bytes = mailbox->i.quota_mailbox_used;
+      mailbox_close(&mailbox);
+      print_stats(&stats);
+      return 0;
+  }
+
   mailbox_expunge(mailbox, purge_check, &stats, NULL, EVENT_MESSAGE_EXPUNGE);
 
   mailbox_close(&mailbox);
@@ -1376,6 +1376,23 @@ done:
     return r;
 }
 
+struct eventsmultiget_rock {
+    struct calendars_rock *rock;
+    hash_table found;   /* uids with at least one result row */
+};
+
+static int eventsmultiget_cb(void *vrock, struct caldav_data *cdata)
+{
+    struct eventsmultiget_rock *mrock = (struct eventsmultiget_rock *) vrock;
+
+    /* an id which fails to fetch is simply reported in notFound, just
+       as it was when each id got its own lookup */
+    if (getcalendarevents_cb(mrock->rock, cdata)) return 0;
+
+    hash_insert(cdata->ical_uid, (void *) 1, &mrock->found);
+    return 0;
+}
+
 static int getCalendarEvents(struct jmap_req *req)
 {
     struct calendars_rock rock;
@@ -1420,20 +1437,32 @@ static int getCalendarEvents(struct jmap_req *req)
     json_t *want = json_object_get(req->args, "ids");
     json_t *notfound = json_array();
     if (want) {
+        strarray_t uids = STRARRAY_INITIALIZER;
+        struct eventsmultiget_rock mrock = { &rock, HASH_TABLE_INITIALIZER };
         int i;
         int size = json_array_size(want);
         for (i = 0; i < size; i++) {
-            rock.rows = 0;
             const char *id = json_string_value(json_array_get(want, i));
             if (id && id[0] == '#') {
                 id = hash_lookup(id + 1, &req->idmap->calendarevents);
             }
             if (!id) continue;
-            r = caldav_get_events(db, NULL, id, &getcalendarevents_cb, &rock);
-            if (r || !rock.rows) {
+            strarray_append(&uids, id);
+        }
+
+        /* one IN-batched query, walking the index in mailbox/uid
+           order, instead of a separate lookup per requested id */
+        construct_hash_table(&mrock.found, strarray_size(&uids) + 1, 0);
+        rock.rows = 0;
+        r = caldav_multiget(db, NULL, &uids, &eventsmultiget_cb, &mrock);
+        for (i = 0; i < strarray_size(&uids); i++) {
+            const char *id = strarray_nth(&uids, i);
+            if (r || !hash_lookup(id, &mrock.found)) {
                 json_array_append_new(notfound, json_string(id));
             }
         }
+        free_hash_table(&mrock.found, NULL);
+        strarray_fini(&uids);
     } else {
         rock.rows = 0;
         r = caldav_get_events(db, NULL, NULL, &getcalendarevents_cb, &rock);
@@ -482,6 +482,24 @@ static int getgroups_cb(void *rock, struct carddav_data *cdata)
     return 0;
 }
 
+struct multiget_rock {
+    carddav_cb_t *cb;
+    void *rock;
+    hash_table found;   /* uids with at least one result row */
+};
+
+static int multiget_cb(void *vrock, struct carddav_data *cdata)
+{
+    struct multiget_rock *mrock = (struct multiget_rock *) vrock;
+
+    /* an id which fails to fetch is simply reported in notFound, just
+       as it was when each id got its own lookup */
+    if (mrock->cb(mrock->rock, cdata)) return 0;
+
+    hash_insert(cdata->vcard_uid, (void *) 1, &mrock->found);
+    return 0;
+}
+
 static int jmap_contacts_get(struct jmap_req *req, carddav_cb_t *cb,
                              int kind, const char *resname)
 {
@@ -524,10 +542,11 @@ static int jmap_contacts_get(struct jmap_req *req, carddav_cb_t *cb,
     json_t *want = json_object_get(req->args, "ids");
     json_t *notFound = json_array();
     if (want) {
+        strarray_t uids = STRARRAY_INITIALIZER;
+        struct multiget_rock mrock = { cb, &rock, HASH_TABLE_INITIALIZER };
         int i;
         int size = json_array_size(want);
         for (i = 0; i < size; i++) {
-            rock.rows = 0;
             const char *id = json_string_value(json_array_get(want, i));
             if (!id) continue;
             if (id[0] == '#') {
@@ -540,11 +559,22 @@ static int jmap_contacts_get(struct jmap_req *req, carddav_cb_t *cb,
                 }
                 if (newid) id = newid;
             }
-            r = carddav_get_cards(db, mboxname, id, kind, cb, &rock);
-            if (r || !rock.rows) {
+            strarray_append(&uids, id);
+        }
+
+        /* one IN-batched query, walking the index in mailbox/uid
+           order, instead of a separate lookup per requested id */
+        construct_hash_table(&mrock.found, strarray_size(&uids) + 1, 0);
+        rock.rows = 0;
+        r = carddav_multiget(db, mboxname, &uids, kind, &multiget_cb, &mrock);
+        for (i = 0; i < strarray_size(&uids); i++) {
+            const char *id = strarray_nth(&uids, i);
+            if (r || !hash_lookup(id, &mrock.found)) {
                 json_array_append_new(notFound, json_string(id));
             }
         }
+        free_hash_table(&mrock.found, NULL);
+        strarray_fini(&uids);
     }
     else {
         rock.rows = 0;
@@ -67,6 +67,7 @@
 #include "proxy.h"
 #include "search_query.h"
 #include "statuscache.h"
+#include "strhash.h"
 #include "stristr.h"
 #include "sync_log.h"
 #include "times.h"
@@ -81,6 +82,7 @@ static int getMailboxes(jmap_req_t *req);
 static int setMailboxes(jmap_req_t *req);
 static int getMailboxUpdates(jmap_req_t *req);
 static int getMessageList(jmap_req_t *req);
+static int getMessageListUpdates(jmap_req_t *req);
 static int getMessages(jmap_req_t *req);
 static int setMessages(jmap_req_t *req);
 static int getMessageUpdates(jmap_req_t *req);
@@ -104,6 +106,7 @@ jmap_msg_t jmap_mail_messages[] = {
     { "setMailboxes",           &setMailboxes },
     { "getMailboxUpdates",      &getMailboxUpdates },
     { "getMessageList",         &getMessageList },
+    { "getMessageListUpdates",  &getMessageListUpdates },
     { "getMessages",            &getMessages },
     { "setMessages",            &setMessages },
     { "getMessageUpdates",      &getMessageUpdates },
@@ -2634,6 +2637,68 @@ static int jmapmsg_find(jmap_req_t *req, const char *msgid,
     return r;
 }
 
+struct jmapmsg_find_batch_data {
+    jmap_req_t *req;
+    hash_table *found; /* guid prefix -> struct jmapmsg_find_data */
+};
+
+static int jmapmsg_find_batch_cb(const conv_guidrec_t *rec, void *rock)
+{
+    struct jmapmsg_find_batch_data *b = (struct jmapmsg_find_batch_data*) rock;
+    struct jmapmsg_find_data *d;
+    int r;
+
+    if (rec->part) return 0;
+
+    d = hash_lookup(rec->guidrep, b->found);
+    if (!d) {
+        d = xzmalloc(sizeof(struct jmapmsg_find_data));
+        d->req = b->req;
+        hash_insert(rec->guidrep, d, b->found);
+    }
+
+    r = jmapmsg_find_cb(rec, d);
+    /* the single-guid callback stops with IMAP_OK_COMPLETED once it
+     * has settled on a record; in a batch that only ends this guid */
+    if (r == IMAP_OK_COMPLETED) r = CYRUSDB_DONE;
+    return r;
+}
+
+static void jmapmsg_find_data_free(void *data)
+{
+    struct jmapmsg_find_data *d = (struct jmapmsg_find_data*) data;
+    free(d->mboxname);
+    free(d);
+}
+
+/* Resolve all of 'ids' against the G records in one sorted pass,
+ * filling 'found' with guid prefix -> jmapmsg_find_data.  Ids which
+ * are invalid or unknown simply end up absent from 'found'. */
+static int jmapmsg_find_batch(jmap_req_t *req, json_t *ids, hash_table *found)
+{
+    strarray_t guids = STRARRAY_INITIALIZER;
+    struct jmapmsg_find_batch_data data = { req, found };
+    size_t i;
+    json_t *val;
+    int r;
+
+    json_array_foreach(ids, i, val) {
+        const char *msgid = json_string_value(val);
+        if (!msgid) continue;
+        if (msgid[0] == '#') {
+            msgid = hash_lookup(msgid + 1, &req->idmap->messages);
+            if (!msgid) continue;
+        }
+        if (msgid[0] != 'M' || strlen(msgid) != 25) continue;
+        strarray_append(&guids, msgid + 1);
+    }
+
+    r = conversations_guid_foreach_batch(req->cstate, &guids,
+                                         jmapmsg_find_batch_cb, &data);
+    strarray_fini(&guids);
+    return r;
+}
+
 struct jmapmsg_count_data {
     jmap_req_t *req;
     size_t count;
@@ -3213,6 +3278,167 @@ struct getmsglist_window {
     size_t anchor_pos;
 };
 
+/* Cache of complete getMessageList result vectors.
+ *
+ * Scroll pagination re-issues the same query (filter, sort,
+ * collapseThreads) with a shifting position window, and each request
+ * recomputed the full search and sort just to report a different
+ * slice.  Instead, each process keeps the unwindowed message and
+ * thread id vectors per user and query, validated against mailmodseq
+ * (the same counter the reported list state is built from), and
+ * slices the requested window out of the cached arrays.  The
+ * generation an entry replaces is kept alongside it, so that
+ * getMessageListUpdates can diff two generations instead of
+ * re-running the search.  Sized by the jmap_querycache option; when
+ * the table fills we dump it wholesale and let the queries actually
+ * being paged repopulate it. */
+
+struct msglist_generation {
+    modseq_t modseq;          /* mailmodseq the vectors were built at */
+    json_t *messageids;       /* full, unwindowed result vector */
+    json_t *threadids;        /* thread ids, parallel to messageids */
+    size_t total;
+    size_t total_threads;
+};
+
+struct msglist_cache_entry {
+    struct msglist_generation cur;
+    struct msglist_generation prev;   /* modseq == 0 if absent */
+};
+
+static struct hash_table msglist_cache;
+static unsigned msglist_cache_count = 0;
+
+static void msglist_generation_fini(struct msglist_generation *gen)
+{
+    if (gen->messageids) json_decref(gen->messageids);
+    if (gen->threadids) json_decref(gen->threadids);
+    memset(gen, 0, sizeof(struct msglist_generation));
+}
+
+static void msglist_cache_entry_free(void *data)
+{
+    struct msglist_cache_entry *entry = data;
+
+    msglist_generation_fini(&entry->cur);
+    msglist_generation_fini(&entry->prev);
+    free(entry);
+}
+
+static char *msglist_cache_key(jmap_req_t *req, json_t *filter, json_t *sort,
+                               int collapse)
+{
+    struct buf buf = BUF_INITIALIZER;
+    char *s;
+
+    buf_printf(&buf, "%s:%d:", req->userid, collapse ? 1 : 0);
+    if (JNOTNULL(filter)) {
+        s = json_dumps(filter, JSON_COMPACT|JSON_SORT_KEYS);
+        buf_appendcstr(&buf, s);
+        free(s);
+    }
+    buf_putc(&buf, ':');
+    if (JNOTNULL(sort)) {
+        s = json_dumps(sort, JSON_COMPACT);
+        buf_appendcstr(&buf, s);
+        free(s);
+    }
+
+    return buf_release(&buf);
+}
+
+static struct msglist_cache_entry *msglist_cache_get(const char *key)
+{
+    if (!msglist_cache.size) return NULL;
+    return hash_lookup(key, &msglist_cache);
+}
+
+/* Cache freshly built full vectors (takes references on the arrays).
+ * The generation they replace is kept for getMessageListUpdates */
+static struct msglist_cache_entry *msglist_cache_put(const char *key,
+                                                     modseq_t modseq,
+                                                     json_t *messageids,
+                                                     json_t *threadids,
+                                                     size_t total,
+                                                     size_t total_threads)
+{
+    struct msglist_cache_entry *entry;
+    int max = config_getint(IMAPOPT_JMAP_QUERYCACHE);
+
+    if (!msglist_cache.size) construct_hash_table(&msglist_cache, max, 0);
+
+    entry = hash_lookup(key, &msglist_cache);
+    if (!entry) {
+        if (msglist_cache_count >= (unsigned) max) {
+            /* Full: dump the lot and let the hot queries repopulate */
+            free_hash_table(&msglist_cache, &msglist_cache_entry_free);
+            construct_hash_table(&msglist_cache, max, 0);
+            msglist_cache_count = 0;
+        }
+        entry = xzmalloc(sizeof(struct msglist_cache_entry));
+        hash_insert(key, entry, &msglist_cache);
+        msglist_cache_count++;
+    }
+    else if (entry->cur.modseq && entry->cur.modseq != modseq) {
+        /* Keep the superseded generation for getMessageListUpdates */
+        msglist_generation_fini(&entry->prev);
+        entry->prev = entry->cur;
+        memset(&entry->cur, 0, sizeof(struct msglist_generation));
+    }
+    else {
+        msglist_generation_fini(&entry->cur);
+    }
+
+    entry->cur.modseq = modseq;
+    entry->cur.messageids = json_incref(messageids);
+    entry->cur.threadids = json_incref(threadids);
+    entry->cur.total = total;
+    entry->cur.total_threads = total_threads;
+
+    return entry;
+}
+
+/* Slice the requested window out of a cached generation, reproducing
+ * the windowing rules of jmapmsg_search */
+static void msglist_cache_window(struct msglist_generation *gen,
+                                 struct getmsglist_window *window,
+                                 size_t *total, size_t *total_threads,
+                                 json_t **messageids, json_t **threadids)
+{
+    size_t n = json_array_size(gen->messageids);
+    size_t start = 0, count, j;
+
+    if (window->anchor) {
+        /* Find the anchor; an unknown anchor serves from the start,
+         * just as the search itself does */
+        for (start = 0; start < n; start++) {
+            const char *id =
+                json_string_value(json_array_get(gen->messageids, start));
+            if (id && !strcmp(id, window->anchor)) break;
+        }
+        if (start == n)
+            start = 0;
+        else if (window->anchor_off < 0)
+            start += (size_t) -window->anchor_off;
+        else if ((size_t) window->anchor_off <= start)
+            start -= (size_t) window->anchor_off;
+    }
+    else start = window->position;
+
+    count = start < n ? n - start : 0;
+    if (window->limit && window->limit < count) count = window->limit;
+
+    *messageids = json_pack("[]");
+    *threadids = json_pack("[]");
+    for (j = 0; j < count; j++) {
+        json_array_append(*messageids, json_array_get(gen->messageids, start + j));
+        json_array_append(*threadids, json_array_get(gen->threadids, start + j));
+    }
+
+    *total = gen->total;
+    *total_threads = gen->total_threads;
+}
+
 static int jmapmsg_search(jmap_req_t *req, json_t *filter, json_t *sort,
                           struct getmsglist_window *window, int want_expunged,
                           size_t *total, size_t *total_threads,
@@ -3256,6 +3482,18 @@ static int jmapmsg_search(jmap_req_t *req, json_t *filter, json_t *sort,
     query->need_ids = 1;
     query->verbose = 1;
     query->want_expunged = want_expunged;
+    /* A limited window can be satisfied as soon as enough messages
+     * have matched, but only if nothing downstream needs the full
+     * match set: anchors and collapsed threads both do, and an
+     * explicit sort selects its window from the full set.  When the
+     * client left the ordering to us we serve matches in scan order
+     * and stop scanning once the window is full; total then reports
+     * a lower bound, which is all a limited query could see anyway.
+     * (If a message is duplicated across folders the page may come up
+     * one short; the next page picks it up.) */
+    if (window->limit && !window->anchor && !window->collapse &&
+        !want_expunged && !json_array_size(sort))
+        query->terminate_after = window->position + window->limit;
     r = search_query_run(query);
     if (r) goto done;
 
@@ -3397,10 +3635,37 @@ done:
     return r;
 }
 
+/* Build the full, unwindowed result for this query and cache it */
+static int msglist_cache_refresh(jmap_req_t *req, json_t *filter, json_t *sort,
+                                 int collapse, const char *key,
+                                 struct msglist_cache_entry **entryp)
+{
+    struct getmsglist_window full;
+    json_t *messageids = NULL, *threadids = NULL;
+    size_t total = 0, total_threads = 0;
+    int r;
+
+    memset(&full, 0, sizeof(struct getmsglist_window));
+    full.collapse = collapse;
+
+    r = jmapmsg_search(req, filter, sort, &full, 0, &total, &total_threads,
+                       &messageids, /*expungedids*/NULL, &threadids);
+    if (r) return r;
+
+    *entryp = msglist_cache_put(key, req->counters.mailmodseq,
+                                messageids, threadids, total, total_threads);
+    json_decref(messageids);
+    json_decref(threadids);
+
+    return 0;
+}
+
 static int getMessageList(jmap_req_t *req)
 {
     int r;
     int fetchthreads = 0, fetchmsgs = 0, fetchsnippets = 0;
+    int usecache, cached = 0;
+    char *cachekey = NULL;
     json_t *filter, *sort;
     json_t *messageids = NULL, *threadids = NULL, *item, *res;
     struct getmsglist_window window;
@@ -3461,16 +3726,36 @@ static int getMessageList(jmap_req_t *req)
     }
     json_decref(unsupported);
 
-    r = jmapmsg_search(req, filter, sort, &window, 0, &total, &total_threads,
-                       &messageids, /*expungedids*/NULL, &threadids);
-    if (r) goto done;
+    /* Try to serve the window from the query cache */
+    usecache = config_getint(IMAPOPT_JMAP_QUERYCACHE) > 0;
+    if (usecache) {
+        struct msglist_cache_entry *entry;
+
+        cachekey = msglist_cache_key(req, filter, sort, window.collapse);
+        entry = msglist_cache_get(cachekey);
+        if (!entry || entry->cur.modseq != req->counters.mailmodseq) {
+            /* Miss: build the full result once, then slice from it */
+            r = msglist_cache_refresh(req, filter, sort, window.collapse,
+                                      cachekey, &entry);
+            if (r) goto done;
+        }
+        msglist_cache_window(&entry->cur, &window, &total, &total_threads,
+                             &messageids, &threadids);
+        cached = 1;
+    }
+
+    if (!cached) {
+        r = jmapmsg_search(req, filter, sort, &window, 0, &total, &total_threads,
+                           &messageids, /*expungedids*/NULL, &threadids);
+        if (r) goto done;
+    }
 
     /* Prepare response. */
     res = json_pack("{}");
     json_object_set_new(res, "accountId", json_string(req->userid));
     json_object_set_new(res, "collapseThreads", json_boolean(window.collapse));
     json_object_set_new(res, "state", jmapmsg_getstate(req));
-    json_object_set_new(res, "canCalculateUpdates", json_false()); /* TODO getMessageListUpdates */
+    json_object_set_new(res, "canCalculateUpdates", json_boolean(usecache));
     json_object_set_new(res, "position", json_integer(window.position));
     json_object_set_new(res, "total", json_integer(total));
     json_object_set(res, "filter", filter);
@@ -3524,11 +3809,206 @@ static int getMessageList(jmap_req_t *req)
     }
 
 done:
+    free(cachekey);
     if (messageids) json_decref(messageids);
     if (threadids) json_decref(threadids);
     return r;
 }
 
+static int getMessageListUpdates(jmap_req_t *req)
+{
+    int r = 0, pe, collapse = 0;
+    json_t *filter, *sort, *item, *res;
+    json_t *added = NULL, *removed = NULL;
+    json_int_t max = 0;
+    modseq_t sincemodseq;
+    const char *since = NULL;
+    char *cachekey = NULL;
+    struct msglist_cache_entry *entry = NULL;
+    struct msglist_generation *oldgen = NULL;
+    size_t i, n, nold, oldpos;
+    hash_table oldids = HASH_TABLE_INITIALIZER;
+    hash_table newids = HASH_TABLE_INITIALIZER;
+
+    /* Parse and validate arguments. */
+    json_t *invalid = json_pack("[]");
+    json_t *unsupported = json_pack("[]");
+
+    /* filter */
+    filter = json_object_get(req->args, "filter");
+    if (JNOTNULL(filter)) {
+        validatefilter(filter, "filter", invalid);
+    }
+
+    /* sort */
+    sort = json_object_get(req->args, "sort");
+    if (JNOTNULL(sort)) {
+        validatesort(sort, invalid, unsupported);
+    }
+
+    readprop(req->args, "collapseThreads", 0, invalid, "b", &collapse);
+
+    /* sinceState */
+    pe = readprop(req->args, "sinceState", 1, invalid, "s", &since);
+    if (pe > 0 && !atomodseq_t(since)) {
+        json_array_append_new(invalid, json_string("sinceState"));
+    }
+
+    /* maxChanges */
+    readprop(req->args, "maxChanges", 0, invalid, "i", &max);
+    if (max < 0) json_array_append_new(invalid, json_string("maxChanges"));
+
+    /* Bail out for argument errors */
+    if (json_array_size(invalid)) {
+        json_t *err = json_pack("{s:s, s:o}", "type", "invalidArguments", "arguments", invalid);
+        json_array_append_new(req->response, json_pack("[s,o,s]", "error", err, req->tag));
+        json_decref(unsupported);
+        r = 0;
+        goto done;
+    }
+    json_decref(invalid);
+
+    if (json_array_size(unsupported)) {
+        json_t *err = json_pack("{s:s, s:o}", "type", "unsupportedSort", "sort", unsupported);
+        json_array_append_new(req->response, json_pack("[s,o,s]", "error", err, req->tag));
+        r = 0;
+        goto done;
+    }
+    json_decref(unsupported);
+
+    sincemodseq = atomodseq_t(since);
+
+    /* We diff two cached generations of this query rather than
+     * re-running the search, so we can only calculate changes if the
+     * cache is enabled and holds the generation the client saw */
+    if (config_getint(IMAPOPT_JMAP_QUERYCACHE) <= 0) goto cannotcalc;
+
+    cachekey = msglist_cache_key(req, filter, sort, collapse);
+    entry = msglist_cache_get(cachekey);
+    if (!entry || entry->cur.modseq != req->counters.mailmodseq) {
+        r = msglist_cache_refresh(req, filter, sort, collapse, cachekey, &entry);
+        if (r) goto done;
+    }
+
+    added = json_pack("[]");
+    removed = json_pack("[]");
+
+    if (sincemodseq == req->counters.mailmodseq) {
+        /* Client is already up to date */
+        goto response;
+    }
+    else if (entry->prev.modseq == sincemodseq) {
+        oldgen = &entry->prev;
+    }
+    else goto cannotcalc;
+
+    /* Index both generations by message id */
+    nold = json_array_size(oldgen->messageids);
+    construct_hash_table(&oldids, nold + 1, 0);
+    for (i = 0; i < nold; i++) {
+        const char *id =
+            json_string_value(json_array_get(oldgen->messageids, i));
+        if (id) hash_insert(id, (void*)1, &oldids);
+    }
+
+    n = json_array_size(entry->cur.messageids);
+    construct_hash_table(&newids, n + 1, 0);
+    for (i = 0; i < n; i++) {
+        const char *id =
+            json_string_value(json_array_get(entry->cur.messageids, i));
+        if (id) hash_insert(id, (void*)1, &newids);
+    }
+
+    /* Walk the new list: report newcomers with their index, and check
+     * that the surviving messages kept their old relative order - a
+     * plain added/removed diff can't describe a reorder, so bail out
+     * and let the client refetch the list */
+    oldpos = 0;
+    for (i = 0; i < n; i++) {
+        json_t *jid = json_array_get(entry->cur.messageids, i);
+        const char *id = json_string_value(jid);
+
+        if (!id) continue;
+
+        if (!hash_lookup(id, &oldids)) {
+            item = json_pack("{s:O, s:O, s:I}",
+                             "messageId", jid,
+                             "threadId", json_array_get(entry->cur.threadids, i),
+                             "index", (json_int_t) i);
+            json_array_append_new(added, item);
+        }
+        else {
+            /* Advance past old entries which are gone from the list */
+            const char *oldid;
+            for (;;) {
+                oldid = json_string_value(json_array_get(oldgen->messageids,
+                                                         oldpos));
+                if (!oldid || hash_lookup(oldid, &newids)) break;
+                oldpos++;
+            }
+            if (!oldid || strcmp(oldid, id)) goto cannotcalc;
+            oldpos++;
+        }
+    }
+
+    /* Report the messages which fell out of the list */
+    for (i = 0; i < nold; i++) {
+        json_t *jid = json_array_get(oldgen->messageids, i);
+        const char *id = json_string_value(jid);
+
+        if (!id || hash_lookup(id, &newids)) continue;
+
+        item = json_pack("{s:O, s:O}",
+                         "messageId", jid,
+                         "threadId", json_array_get(oldgen->threadids, i));
+        json_array_append_new(removed, item);
+    }
+
+    if (max && json_array_size(added) + json_array_size(removed) > (size_t) max) {
+        json_t *err = json_pack("{s:s}", "type", "tooManyChanges");
+        json_array_append_new(req->response, json_pack("[s,o,s]", "error", err, req->tag));
+        r = 0;
+        goto done;
+    }
+
+response:
+    /* Prepare response. */
+    res = json_pack("{}");
+    json_object_set_new(res, "accountId", json_string(req->userid));
+    json_object_set(res, "filter", filter);
+    json_object_set(res, "sort", sort);
+    json_object_set_new(res, "collapseThreads", json_boolean(collapse));
+    json_object_set_new(res, "oldState", json_string(since));
+    json_object_set_new(res, "newState", jmapmsg_getstate(req));
+    json_object_set_new(res, "total", json_integer(entry->cur.total));
+    json_object_set(res, "added", added);
+    json_object_set(res, "removed", removed);
+
+    item = json_pack("[]");
+    json_array_append_new(item, json_string("messageListUpdates"));
+    json_array_append_new(item, res);
+    json_array_append_new(item, json_string(req->tag));
+    json_array_append_new(req->response, item);
+
+    r = 0;
+    goto done;
+
+cannotcalc:
+    {
+        json_t *err = json_pack("{s:s}", "type", "cannotCalculateChanges");
+        json_array_append_new(req->response, json_pack("[s,o,s]", "error", err, req->tag));
+        r = 0;
+    }
+
+done:
+    free_hash_table(&oldids, NULL);
+    free_hash_table(&newids, NULL);
+    free(cachekey);
+    if (added) json_decref(added);
+    if (removed) json_decref(removed);
+    return r;
+}
+
 static int getMessageUpdates(jmap_req_t *req)
 {
     int r = 0, pe;
@@ -3682,7 +4162,8 @@ static int getThreadUpdates(jmap_req_t *req)
         conversation_id_t cid = jmap_decode_thrid(threadid);
         if (!cid) continue;
 
-        r = conversation_load(req->cstate, cid, &conv);
+        r = conversation_load_advanced(req->cstate, cid, &conv,
+                                       CONV_WANT_THREAD);
         if (!conv) continue;
         if (r) {
             if (r == CYRUSDB_NOTFOUND) {
@@ -3745,6 +4226,62 @@ done:
     return r;
 }
 
+/*
+ * Bounded cache of rendered snippets.  Clients page back and forth over
+ * the same search results, asking for the same (message, query)
+ * snippets over and over; the text behind a guid never changes, so a
+ * rendered snippet stays valid for as long as the query is the same.
+ * Direct-mapped: a new entry just replaces whatever hashed to the same
+ * slot.
+ */
+#define SNIPPET_CACHE_SIZE 256
+
+struct snippet_cache_entry {
+    char *guid;
+    char *query;
+    char *subject;              /* NULL when the part didn't match */
+    char *preview;
+};
+
+static struct snippet_cache_entry snippet_cache[SNIPPET_CACHE_SIZE];
+
+static struct snippet_cache_entry *snippet_cache_slot(const char *guid,
+                                                      const char *query)
+{
+    return &snippet_cache[(strhash(guid) ^ strhash(query)) %
+                          SNIPPET_CACHE_SIZE];
+}
+
+static const struct snippet_cache_entry *snippet_cache_lookup(const char *guid,
+                                                              const char *query)
+{
+    struct snippet_cache_entry *entry = snippet_cache_slot(guid, query);
+
+    if (!entry->guid) return NULL;
+    if (strcmp(entry->guid, guid)) return NULL;
+    if (strcmp(entry->query, query)) return NULL;
+    return entry;
+}
+
+static void snippet_cache_store(const char *guid, const char *query,
+                                json_t *snippet)
+{
+    struct snippet_cache_entry *entry = snippet_cache_slot(guid, query);
+    const char *s;
+
+    free(entry->guid);
+    free(entry->query);
+    free(entry->subject);
+    free(entry->preview);
+
+    entry->guid = xstrdup(guid);
+    entry->query = xstrdup(query);
+    s = json_string_value(json_object_get(snippet, "subject"));
+    entry->subject = s ? xstrdup(s) : NULL;
+    s = json_string_value(json_object_get(snippet, "preview"));
+    entry->preview = s ? xstrdup(s) : NULL;
+}
+
 static int makesnippet(struct mailbox *mbox __attribute__((unused)),
                        uint32_t uid __attribute__((unused)),
                        int part, const char *s, void *rock)
@@ -3783,11 +4320,16 @@ static int jmapmsg_snippets(jmap_req_t *req, json_t *filter, json_t *messageids,
     json_t *val;
     size_t i;
     char *mboxname = NULL;
+    char *qstr = NULL;
     static search_snippet_markup_t markup = { "<mark>", "</mark>", "..." };
 
     *snippets = json_pack("[]");
     *notfound = json_pack("[]");
 
+    /* Key the snippet cache on the canonicalised filter */
+    qstr = filter ? json_dumps(filter, JSON_COMPACT|JSON_SORT_KEYS) : NULL;
+    if (!qstr) qstr = xstrdup("");
+
     /* Build searchargs */
     searchargs = new_searchargs(NULL/*tag*/, GETSEARCH_CHARSET_FIRST,
                                 &jmap_namespace, req->userid, req->authstate, 0);
@@ -3829,7 +4371,9 @@ static int jmapmsg_snippets(jmap_req_t *req, json_t *filter, json_t *messageids,
 
     /* Convert the snippets */
     json_array_foreach(messageids, i, val) {
+        const struct snippet_cache_entry *cached;
         struct index_record record;
+        const char *guid;
         message_t *msg;
         uint32_t uid;
 
@@ -3847,24 +4391,41 @@ static int jmapmsg_snippets(jmap_req_t *req, json_t *filter, json_t *messageids,
         r = jmap_openmbox(req, mboxname, &mbox, 0);
         if (r) goto done;
 
-        r = rx->begin_mailbox(rx, mbox, /*incremental*/0);
-
         r = mailbox_find_index_record(mbox, uid, &record);
         if (r) continue;
 
-        msg = message_new_from_record(mbox, &record);
+        guid = message_guid_isnull(&record.guid) ? NULL :
+               message_guid_encode(&record.guid);
 
         json_object_set_new(snippet, "messageId", json_string(msgid));
         json_object_set_new(snippet, "subject", json_null());
         json_object_set_new(snippet, "preview", json_null());
-        index_getsearchtext(msg, rx, /*snippet*/1);
-        json_array_append_new(*snippets, json_deep_copy(snippet));
-        json_object_clear(snippet);
 
-        message_unref(&msg);
+        cached = guid ? snippet_cache_lookup(guid, qstr) : NULL;
+        if (cached) {
+            /* same message, same query: reuse the rendered snippet */
+            if (cached->subject)
+                json_object_set_new(snippet, "subject",
+                                    json_string(cached->subject));
+            if (cached->preview)
+                json_object_set_new(snippet, "preview",
+                                    json_string(cached->preview));
+        }
+        else {
+            r = rx->begin_mailbox(rx, mbox, /*incremental*/0);
 
-        r = rx->end_mailbox(rx, mbox);
-        if (r) goto done;
+            msg = message_new_from_record(mbox, &record);
+            index_getsearchtext(msg, rx, /*snippet*/1);
+            message_unref(&msg);
+
+            r = rx->end_mailbox(rx, mbox);
+            if (r) goto done;
+
+            if (guid) snippet_cache_store(guid, qstr, snippet);
+        }
+
+        json_array_append_new(*snippets, json_deep_copy(snippet));
+        json_object_clear(snippet);
 
         jmap_closembox(req, &mbox);
         free(mboxname);
@@ -3881,6 +4442,7 @@ done:
     if (snippet) json_decref(snippet);
     if (intquery) search_free_internalised(intquery);
     if (mboxname) free(mboxname);
+    free(qstr);
     if (mbox) jmap_closembox(req, &mbox);
     if (searchargs) freesearchargs(searchargs);
     if (state) {
@@ -4025,7 +4587,8 @@ static int jmapmsg_threads(jmap_req_t *req, json_t *threadids,
         const char *threadid = json_string_value(val);
         cid = jmap_decode_thrid(threadid);
 
-        if (cid) r = conversation_load(req->cstate, cid, &conv);
+        if (cid) r = conversation_load_advanced(req->cstate, cid, &conv,
+                                                CONV_WANT_THREAD);
         if (r) goto done;
         if (!conv) {
             json_array_append_new(*notfound, json_string(threadid));
@@ -4152,6 +4715,7 @@ static int getMessages(jmap_req_t *req)
     size_t i;
     json_t *ids, *val, *properties, *res, *item;
     hash_table *props = NULL;
+    hash_table found = HASH_TABLE_INITIALIZER;
 
     /* ids */
     ids = json_object_get(req->args, "ids");
@@ -4190,6 +4754,12 @@ static int getMessages(jmap_req_t *req)
     }
     json_decref(invalid);
 
+    /* Resolve all the ids against the G records in one sorted pass,
+     * rather than one tree descent per id */
+    construct_hash_table(&found, json_array_size(ids) + 1, 0);
+    r = jmapmsg_find_batch(req, ids, &found);
+    if (r) goto done;
+
     /* Lookup and convert ids */
     json_array_foreach(ids, i, val) {
         const char *id = json_string_value(val);
@@ -4198,6 +4768,7 @@ static int getMessages(jmap_req_t *req)
         uint32_t uid;
         json_t *msg = NULL;
         struct mailbox *mbox = NULL;
+        struct jmapmsg_find_data *fd = NULL;
 
         if (id[0] == '#') {
             const char *newid = hash_lookup(id + 1, &req->idmap->messages);
@@ -4208,8 +4779,14 @@ static int getMessages(jmap_req_t *req)
             id = newid;
         }
 
-        r = jmapmsg_find(req, id, &mboxname, &uid);
-        if (r) goto doneloop;
+        if (id[0] == 'M' && strlen(id) == 25)
+            fd = hash_lookup(id + 1, &found);
+        if (!fd || !fd->mboxname) {
+            r = IMAP_NOTFOUND;
+            goto doneloop;
+        }
+        mboxname = xstrdup(fd->mboxname);
+        uid = fd->uid;
 
         r = jmap_openmbox(req, mboxname, &mbox, 0);
         if (r) goto done;
@@ -4253,6 +4830,7 @@ doneloop:
     json_array_append_new(req->response, item);
 
 done:
+    if (found.table) free_hash_table(&found, jmapmsg_find_data_free);
     if (props) {
         free_hash_table(props, NULL);
         free(props);
@@ -589,7 +589,15 @@ static int sieve_redirect(void *ac, void *ic,
         else m = mdata->m;
     }
 
-    res = send_forward(rc, ctx, m->return_path, m->data);
+    /* a configured smarthost takes the redirect over a cached
+     * connection; external list expansion still needs sendmail */
+    int smarthost = !rc->is_ext_list &&
+        config_getstring(IMAPOPT_SIEVE_REDIRECT_SMARTHOST) != NULL;
+
+    if (smarthost)
+        res = deliver_smarthost(m->return_path, rc->addr, m->data);
+    else
+        res = send_forward(rc, ctx, m->return_path, m->data);
 
     if (sd->edited_header) cleanup_special_delivery(mdata);
 
@@ -606,7 +614,9 @@ static int sieve_redirect(void *ac, void *ic,
                    session_id(), m->id ? m->id : "<nomsgid>", rc->addr);
         return SIEVE_OK;
     } else {
-        if (res == -1) {
+        if (smarthost) {
+            *errmsg = error_message(res);
+        } else if (res == -1) {
             *errmsg = "Could not spawn sendmail process";
         } else {
             *errmsg = sendmail_errstr(res);
@@ -1324,7 +1334,7 @@ int run_sieve(const mbname_t *mbname, sieve_interp_t *interp, deliver_data_t *ms
 
     if (sieve_find_script(mbname_localpart(mbname), mbname_domain(mbname),
                           script, fname, sizeof(fname)) != 0 ||
-        sieve_script_load(fname, &bc) != SIEVE_OK) {
+        sieve_script_load_cached(fname, &bc) != SIEVE_OK) {
         buf_free(&attrib);
         /* no sieve script */
         return 1; /* do normal delivery actions */
@@ -1357,7 +1367,7 @@ int run_sieve(const mbname_t *mbname, sieve_interp_t *interp, deliver_data_t *ms
 
     /* free everything */
     if (freeauthstate) auth_freestate(freeauthstate);
-    sieve_script_unload(&bc);
+    sieve_script_release(&bc);
 
     /* if there was an error, r is non-zero and
        we'll do normal delivery */
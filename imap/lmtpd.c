@@ -126,6 +126,7 @@ void shut_down(int code);
 
 static FILE *spoolfile(message_data_t *msgdata);
 static void removespool(message_data_t *msgdata);
+static void deliver_finish(void);
 
 #ifdef USE_AUTOCREATE
 static int autocreate_inbox(const mbname_t *mbname);
@@ -135,8 +136,8 @@ static int autocreate_inbox(const mbname_t *mbname);
 static struct namespace lmtpd_namespace;
 
 static struct lmtp_func mylmtp = { &deliver, &verify_user, &shut_down,
-                            &spoolfile, &removespool, &lmtpd_namespace,
-                            0, 1, 0 };
+                            &spoolfile, &removespool, &deliver_finish,
+                            &lmtpd_namespace, 0, 1, 0 };
 
 static void usage(void);
 
@@ -457,7 +458,8 @@ static int mlookup(const char *name, mbentry_t **mbentryptr)
 
     /* do a local lookup and kick the slave if necessary */
     r = mboxlist_lookup(name, &mbentry, NULL);
-    if (r == IMAP_MAILBOX_NONEXISTENT && config_mupdate_server) {
+    if (r == IMAP_MAILBOX_NONEXISTENT && config_mupdate_server &&
+        mupdate_bloom_check(name)) {
         kick_mupdate();
         mboxlist_entry_free(&mbentry);
         r = mboxlist_lookup(name, &mbentry, NULL);
@@ -483,6 +485,60 @@ static int mlookup(const char *name, mbentry_t **mbentryptr)
  * if you want to force delivery (to force delivery to INBOX, for instance)
  * pass acloverride
  */
+/*
+ * Notifications queued during delivery, sent from deliver_finish() once
+ * lmtpengine has flushed the transaction's replies.  Talking to notifyd
+ * doesn't have to happen before the client gets its answer, and a
+ * pipelining client can be reading its next message into the spool
+ * while we catch up here.
+ */
+struct delayed_notify {
+    struct delayed_notify *next;
+    char *user;
+    char *extname;
+    char *notifyheader;
+};
+
+static struct delayed_notify *delayed_notify_head = NULL;
+static struct delayed_notify **delayed_notify_tail = &delayed_notify_head;
+
+static void delay_notify(const char *user, char *extname,
+                         const char *notifyheader)
+{
+    struct delayed_notify *dn = xzmalloc(sizeof(struct delayed_notify));
+
+    dn->user = xstrdup(user);
+    dn->extname = extname;      /* takes ownership */
+    dn->notifyheader = xstrdupnull(notifyheader);
+
+    *delayed_notify_tail = dn;
+    delayed_notify_tail = &dn->next;
+}
+
+static void deliver_finish(void)
+{
+    struct delayed_notify *dn = delayed_notify_head;
+    const char *notifier = config_getstring(IMAPOPT_MAILNOTIFIER);
+
+    while (dn) {
+        struct delayed_notify *next = dn->next;
+
+        if (notifier) {
+            notify(notifier, "MAIL", NULL, dn->user, dn->extname, 0, NULL,
+                   dn->notifyheader ? dn->notifyheader : "", /*fname*/NULL);
+        }
+
+        free(dn->user);
+        free(dn->extname);
+        free(dn->notifyheader);
+        free(dn);
+        dn = next;
+    }
+
+    delayed_notify_head = NULL;
+    delayed_notify_tail = &delayed_notify_head;
+}
+
 int deliver_mailbox(FILE *f,
                     struct message_content *content,
                     struct stagemsg *stage,
@@ -586,10 +642,9 @@ int deliver_mailbox(FILE *f,
             extname = mboxname_to_external(mailboxname, &lmtpd_namespace, user);
         }
 
-        /* translate mailboxname */
-        notify(notifier, "MAIL", NULL, user, extname, 0, NULL,
-               notifyheader ? notifyheader : "", /*fname*/NULL);
-        free(extname);
+        /* deferred until the replies are on the wire -
+         * see deliver_finish() */
+        delay_notify(user, extname, notifyheader);
     }
 
     free(uuid);
@@ -684,6 +739,47 @@ static void deliver_remote(message_data_t *msgdata,
     }
 }
 
+/*
+ * Forward a redirected message to the sieve_redirect_smarthost over a
+ * connection from the backend cache, instead of forking a sendmail per
+ * redirect.  proxy_findserver() pings a cached connection before
+ * handing it back and reconnects if it has gone stale, so a redirect
+ * storm reuses one session.  Returns 0 on success, an error code the
+ * caller can report otherwise.
+ */
+EXPORTED int deliver_smarthost(const char *return_path, const char *addr,
+                               struct protstream *data)
+{
+    const char *host = config_getstring(IMAPOPT_SIEVE_REDIRECT_SMARTHOST);
+    struct backend *remote;
+    struct lmtp_txn *lt;
+    int r;
+
+    remote = proxy_findserver(host, &lmtp_protocol, "",
+                              &backend_cached, NULL, NULL, NULL);
+    if (!remote) return IMAP_SERVER_UNAVAILABLE;
+
+    lt = LMTP_TXN_ALLOC(1);
+    lt->from = return_path;
+    lt->auth = NULL;
+    lt->isdotstuffed = 0;
+    lt->tempfail_unknown_mailbox = 0;
+    prot_rewind(data);
+    lt->data = data;
+    lt->rcpt_num = 1;
+    lt->rcpt[0].addr = (char *) addr;
+    lt->rcpt[0].ignorequota = 1;
+
+    r = lmtp_runtxn(remote, lt);
+    if (!r && lt->rcpt[0].result != RCPT_GOOD)
+        r = lt->rcpt[0].r ? lt->rcpt[0].r : IMAP_IOERROR;
+
+    if (lt->rcpt[0].resp) strarray_free(lt->rcpt[0].resp);
+    free(lt);
+
+    return r;
+}
+
 EXPORTED int deliver_local(deliver_data_t *mydata, const strarray_t *flags,
                            const mbname_t *origmbname)
 {
@@ -769,6 +865,14 @@ int deliver(message_data_t *msgdata, char *authuser,
     mydata.authuser = authuser;
     mydata.authstate = authstate;
 
+#ifdef USE_SIEVE
+    /* build the sieve interpreter once per message: the registered
+     * callbacks only look at the interp context at execution time, so
+     * we just repoint it at each recipient in turn */
+    struct sieve_interp_ctx ctx = { NULL, NULL };
+    sieve_interp_t *interp = setup_sieve(&ctx);
+#endif
+
     /* loop through each recipient, attempting delivery for each */
     for (n = 0; n < nrcpts; n++) {
         const mbname_t *mbname = msg_getrcpt(msgdata, n);
@@ -791,13 +895,15 @@ int deliver(message_data_t *msgdata, char *authuser,
             /* local mailbox */
             mydata.cur_rcpt = n;
 #ifdef USE_SIEVE
-            struct sieve_interp_ctx ctx = { mbname_userid(mbname), NULL };
-            sieve_interp_t *interp = setup_sieve(&ctx);
+            ctx.userid = mbname_userid(mbname);
             r = run_sieve(mbname, interp, &mydata);
 #ifdef WITH_DAV
-            if (ctx.carddavdb) carddav_close(ctx.carddavdb);
+            /* the DAV db is per-user, so it can't outlive this recipient */
+            if (ctx.carddavdb) {
+                carddav_close(ctx.carddavdb);
+                ctx.carddavdb = NULL;
+            }
 #endif
-            sieve_interp_free(&interp);
             /* if there was no sieve script, or an error during execution,
                r is non-zero and we'll do normal delivery */
 #else
@@ -818,6 +924,10 @@ int deliver(message_data_t *msgdata, char *authuser,
         mboxlist_entry_free(&mbentry);
     }
 
+#ifdef USE_SIEVE
+    sieve_interp_free(&interp);
+#endif
+
     if (dlist) {
         struct dest *d;
 
@@ -72,6 +72,9 @@ extern int deliver_local(deliver_data_t *mydata,
                          const strarray_t *flags,
                          const mbname_t *mbname);
 
+extern int deliver_smarthost(const char *return_path, const char *addr,
+                             struct protstream *data);
+
 extern int deliver_mailbox(FILE *f,
                            struct message_content *content,
                            struct stagemsg *stage,
@@ -704,11 +704,13 @@ static int savemsg(struct clientdata *cd,
     /* now, using our header cache, fill in the data that we want */
 
     /* first check x-me-message-id, then resent-message-id */
-    if ((body = msg_getheader(m, "x-me-message-id")) && body[0][0]) {
+    if ((body = spool_getheader_byid(m->hdrcache, RFC822_X_ME_MESSAGE_ID)) &&
+        body[0][0]) {
         m->id = xstrdup(body[0]);
     } else if ((body = msg_getheader(m, "resent-message-id")) && body[0][0]) {
         m->id = xstrdup(body[0]);
-    } else if ((body = msg_getheader(m, "message-id")) && body[0][0]) {
+    } else if ((body = spool_getheader_byid(m->hdrcache, RFC822_MESSAGE_ID)) &&
+               body[0][0]) {
         m->id = xstrdup(body[0]);
     } else if (body) {
         r = IMAP_MESSAGE_BADHEADER;  /* empty message-id */
@@ -724,7 +726,7 @@ static int savemsg(struct clientdata *cd,
     }
 
     /* get date */
-    if (!(body = spool_getheader(m->hdrcache, "date"))) {
+    if (!(body = spool_getheader_byid(m->hdrcache, RFC822_DATE))) {
         /* no date, create one */
         addbody = xstrdup(datestr);
         m->date = xstrdup(datestr);
@@ -1211,6 +1213,14 @@ void lmtpmode(struct lmtp_func *func,
                 snmp_increment(mtaTransmittedMessages, delivered);
                 snmp_increment(mtaTransmittedVolume,
                                roundToK(delivered * msg->size));
+
+                if (func->finish) {
+                    /* get the replies onto the wire first: a pipelining
+                       client can start its next transaction while we do
+                       the deferred post-delivery work */
+                    prot_flush(pout);
+                    func->finish();
+                }
                 goto rset;
             }
             goto syntaxerr;
@@ -119,6 +119,10 @@ struct lmtp_func {
     void (*shutdown)(int code);
     FILE *(*spoolfile)(message_data_t *m);
     void (*removespool)(message_data_t *m);
+    void (*finish)(void);       /* optional: called once the replies for a
+                                   transaction have been flushed to the
+                                   client; do deferred work that doesn't
+                                   have to happen before the replies here */
     struct namespace *namespace; /* mailbox namespace that we're working in */
     struct addheader *addheaders; /* add these headers to all messages */
     int addretpath;             /* should i add a return-path header? */
@@ -54,9 +54,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <syslog.h>
 #include <utime.h>
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
 #ifdef HAVE_DIRENT_H
 # include <dirent.h>
 # define NAMLEN(dirent) strlen((dirent)->d_name)
@@ -143,6 +148,7 @@ struct mailbox_repack {
     ptrarray_t caches;
 };
 
+static void mailbox_discard_listitem(struct mailboxlist *listitem);
 static int mailbox_index_unlink(struct mailbox *mailbox);
 static int mailbox_index_repack(struct mailbox *mailbox, int version);
 static void mailbox_repack_abort(struct mailbox_repack **repackptr);
@@ -437,6 +443,199 @@ HIDDEN unsigned mailbox_cached_header_inline(const char *text)
     return BIT32_MAX;
 }
 
+/* first word of a compressed version 8+ record - no real envelope
+ * item can be 4G-1 bytes long, so this cannot collide with the
+ * leading length word of a raw item stream */
+#define CACHE_COMPRESSED_MAGIC 0xffffffffU
+
+#ifdef HAVE_ZLIB
+
+/* The preset dictionary for compressed cache records: bits of
+ * envelope, bodystructure and section data that turn up in nearly
+ * every record.  deflate favours matches near the end of the
+ * dictionary, so the most common strings come last.  These bytes are
+ * part of the version 7 on-disk format - never edit them; bump the
+ * cache version and add a new dictionary instead. */
+static const char cache_deflate_dict[] =
+    "(\"ATTACHMENT\" (\"FILENAME\" (\"INLINE\" (\"BOUNDARY\" "
+    "\"IMAGE\" \"JPEG\" \"PNG\" \"APPLICATION\" \"OCTET-STREAM\" \"PDF\" "
+    "\"MULTIPART\" \"MIXED\" \"RELATED\" \"ALTERNATIVE\" \"SIGNED\" "
+    "\"ISO-8859-1\" \"WINDOWS-1252\" \"8BIT\" \"BASE64\" "
+    "\"QUOTED-PRINTABLE\" \"MESSAGE\" \"RFC822\" "
+    "(\"TEXT\" \"HTML\" (\"CHARSET\" \"UTF-8\") NIL NIL \"7BIT\" "
+    "(\"TEXT\" \"PLAIN\" (\"CHARSET\" \"US-ASCII\") "
+    "NIL NIL NIL NIL NIL NIL NIL NIL NIL NIL ";
+static const unsigned cache_deflate_dict_len = sizeof(cache_deflate_dict) - 1;
+
+/*
+ * Per-process LRU of decoded cache records.  cacheitem_base() hands
+ * out pointers straight into these buffers, so a slot is only ever
+ * recycled on an LRU basis: a decoded record stays addressable until
+ * CACHE_DECODED_SLOTS further compressed records have been loaded,
+ * which covers how consumers use the pointers (immediately after
+ * mailbox_cacherecord).  A record whose entry has been recycled is
+ * spotted by the seq check in mailbox_cacherecord and decoded afresh.
+ */
+#define CACHE_DECODED_SLOTS 64
+
+struct cache_decoded {
+    char *fname;                /* cache file the record came from */
+    uint32_t offset;            /* record offset within that file */
+    unsigned seq;               /* bumped each time the slot is recycled */
+    uint64_t lastused;
+    struct buf data;            /* the decoded item stream */
+};
+
+static struct cache_decoded cache_decoded[CACHE_DECODED_SLOTS];
+static uint64_t cache_decoded_clock = 0;
+
+static struct cache_decoded *cache_decoded_find(const char *fname,
+                                                uint32_t offset)
+{
+    int i;
+
+    for (i = 0; i < CACHE_DECODED_SLOTS; i++) {
+        struct cache_decoded *slot = &cache_decoded[i];
+        if (slot->fname && slot->offset == offset
+            && !strcmp(slot->fname, fname))
+            return slot;
+    }
+
+    return NULL;
+}
+
+static struct cache_decoded *cache_decoded_evict(void)
+{
+    struct cache_decoded *slot = &cache_decoded[0];
+    int i;
+
+    for (i = 1; i < CACHE_DECODED_SLOTS; i++) {
+        if (cache_decoded[i].lastused < slot->lastused)
+            slot = &cache_decoded[i];
+    }
+
+    free(slot->fname);
+    slot->fname = NULL;
+    buf_reset(&slot->data);
+    slot->seq++;
+
+    return slot;
+}
+
+/* is the decoded entry this crec points into still there? */
+static int cache_decoded_valid(struct cacherecord *crec)
+{
+    struct cache_decoded *slot;
+
+    if (!crec->decode_seq)
+        return 1;       /* not from the decoded cache */
+    if (crec->decode_slot >= CACHE_DECODED_SLOTS)
+        return 0;
+
+    slot = &cache_decoded[crec->decode_slot];
+    if (slot->seq != crec->decode_seq)
+        return 0;
+
+    slot->lastused = ++cache_decoded_clock;
+    return 1;
+}
+
+static int cache_uncompress(const char *src, size_t srclen,
+                            size_t destlen, struct buf *dest)
+{
+    z_stream zstrm;
+    int zr;
+
+    buf_reset(dest);
+    buf_ensure(dest, destlen);
+
+    memset(&zstrm, 0, sizeof(zstrm));
+    zr = inflateInit2(&zstrm, -MAX_WBITS);      /* raw inflate */
+    if (zr != Z_OK)
+        return IMAP_IOERROR;
+
+    zr = inflateSetDictionary(&zstrm, (const Bytef *)cache_deflate_dict,
+                              cache_deflate_dict_len);
+    if (zr == Z_OK) {
+        zstrm.next_in = (Bytef *)src;
+        zstrm.avail_in = srclen;
+        zstrm.next_out = (Bytef *)dest->s;
+        zstrm.avail_out = destlen;
+        zr = inflate(&zstrm, Z_FINISH);
+    }
+
+    if (zr == Z_STREAM_END && zstrm.total_out == destlen) {
+        dest->len = destlen;
+        zr = Z_OK;
+    }
+    else if (zr == Z_OK) zr = Z_DATA_ERROR;
+
+    inflateEnd(&zstrm);
+
+    return (zr == Z_OK) ? 0 : IMAP_IOERROR;
+}
+
+/* compress a raw item stream into a compressed record: magic word
+ * (version 8 up only), uncompressed length, compressed length,
+ * deflate data, zero-padded to a 4 byte boundary like any other
+ * cache item */
+static int cache_compress(const struct buf *src, int withmagic,
+                          struct buf *dest)
+{
+    z_stream zstrm;
+    size_t hdrlen = (withmagic ? 3 : 2) * CACHE_ITEM_SIZE_SKIP;
+    size_t bound;
+    uint32_t clen;
+    int zr;
+
+    memset(&zstrm, 0, sizeof(zstrm));
+    zr = deflateInit2(&zstrm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                      -MAX_WBITS,               /* raw deflate */
+                      MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+    if (zr != Z_OK)
+        return IMAP_IOERROR;
+
+    zr = deflateSetDictionary(&zstrm, (const Bytef *)cache_deflate_dict,
+                              cache_deflate_dict_len);
+    if (zr == Z_OK) {
+        bound = deflateBound(&zstrm, src->len);
+        buf_reset(dest);
+        buf_ensure(dest, hdrlen + bound + 3);
+
+        zstrm.next_in = (Bytef *)src->s;
+        zstrm.avail_in = src->len;
+        zstrm.next_out = (Bytef *)dest->s + hdrlen;
+        zstrm.avail_out = bound;
+        zr = deflate(&zstrm, Z_FINISH);
+    }
+
+    if (zr == Z_STREAM_END) {
+        char *hdr = dest->s;
+        clen = zstrm.total_out;
+        if (withmagic) {
+            *((bit32 *)hdr) = htonl(CACHE_COMPRESSED_MAGIC);
+            hdr += CACHE_ITEM_SIZE_SKIP;
+        }
+        *((bit32 *)hdr) = htonl(src->len);
+        *((bit32 *)(hdr + CACHE_ITEM_SIZE_SKIP)) = htonl(clen);
+        dest->len = hdrlen + clen;
+        while (dest->len & 3)
+            dest->s[dest->len++] = '\0';
+        zr = Z_OK;
+    }
+    else if (zr == Z_OK) zr = Z_BUF_ERROR;
+
+    deflateEnd(&zstrm);
+
+    return (zr == Z_OK) ? 0 : IMAP_IOERROR;
+}
+
+#else /* !HAVE_ZLIB */
+
+#define cache_decoded_valid(crec) (1)
+
+#endif /* HAVE_ZLIB */
+
 static const char *cache_base(const struct index_record *record)
 {
     const char *base = record->crec.buf->s;
@@ -481,21 +680,25 @@ EXPORTED struct buf *cacheitem_buf(const struct index_record *record, int field)
     return &staticbuf;
 }
 
-/* parse a single cache record from the mapped file - creates buf
- * records which point into the map, so you can't free it while
- * you still have them around! */
-static int cache_parserecord(struct mappedfile *cachefile, size_t cache_offset,
-                             struct cacherecord *crec)
+/* walk the raw item stream in 'buf' starting at 'cache_offset' -
+ * creates buf records which point into it, so you can't free it
+ * while you still have them around! */
+static int cache_parseitems(const struct buf *buf, size_t cache_offset,
+                            unsigned cache_version, struct cacherecord *crec)
 {
-    const struct buf *buf = mappedfile_buf(cachefile);
-    size_t buf_size = mappedfile_size(cachefile);
+    size_t buf_size = buf->len;
     const char *cacheitem, *next;
     size_t offset;
+    int numfields = NUM_CACHE_FIELDS;
     int cache_ent;
 
+    /* CACHE_SORTKEYS only arrived in version 8 */
+    if (cache_version < MAILBOX_CACHE_SORTKEY_VERSION)
+        numfields--;
+
     offset = cache_offset;
 
-    for (cache_ent = 0; cache_ent < NUM_CACHE_FIELDS; cache_ent++) {
+    for (cache_ent = 0; cache_ent < numfields; cache_ent++) {
         cacheitem = buf->s + offset;
 
         /* bounds checking */
@@ -528,13 +731,122 @@ static int cache_parserecord(struct mappedfile *cachefile, size_t cache_offset,
         offset = next - buf->s;
     }
 
+    /* items this version doesn't have yet read back as empty */
+    for (; cache_ent < NUM_CACHE_FIELDS; cache_ent++) {
+        crec->item[cache_ent].len = 0;
+        crec->item[cache_ent].offset = 0;
+    }
+
     /* all fit within the cache, it's gold as far as we can tell */
     crec->buf = buf;
     crec->len = offset - cache_offset;
     crec->offset = cache_offset;
+    crec->decode_slot = 0;
+    crec->decode_seq = 0;
+
+    return 0;
+}
+
+#ifdef HAVE_ZLIB
+/* parse a compressed cache record: find or create the decoded copy
+ * in the per-process cache, then walk the items there.  'hdr_offset'
+ * skips the magic word on version 8+ records; version 7 records are
+ * compressed unconditionally and have no magic */
+static int cache_parserecord_compressed(struct mappedfile *cachefile,
+                                        size_t cache_offset,
+                                        unsigned cache_version,
+                                        size_t hdr_offset,
+                                        struct cacherecord *crec)
+{
+    const struct buf *buf = mappedfile_buf(cachefile);
+    size_t buf_size = mappedfile_size(cachefile);
+    const char *fname = mappedfile_fname(cachefile);
+    struct cache_decoded *slot;
+    int r;
+
+    cache_offset += hdr_offset;
+
+    slot = cache_decoded_find(fname, cache_offset);
+    if (!slot) {
+        uint32_t ulen, clen;
+
+        if (cache_offset + 2 * CACHE_ITEM_SIZE_SKIP > buf_size) {
+            syslog(LOG_ERR, "IOERROR: offset greater than cache size "
+                   SIZE_T_FMT " " SIZE_T_FMT,
+                   cache_offset, buf_size);
+            return IMAP_IOERROR;
+        }
+
+        ulen = CACHE_ITEM_BIT32(buf->s + cache_offset);
+        clen = CACHE_ITEM_BIT32(buf->s + cache_offset + CACHE_ITEM_SIZE_SKIP);
+
+        if (cache_offset + 2 * CACHE_ITEM_SIZE_SKIP + clen > buf_size) {
+            syslog(LOG_ERR, "IOERROR: cache entry truncated "
+                   SIZE_T_FMT " %u " SIZE_T_FMT,
+                   cache_offset, clen, buf_size);
+            return IMAP_IOERROR;
+        }
+
+        slot = cache_decoded_evict();
+        r = cache_uncompress(buf->s + cache_offset + 2 * CACHE_ITEM_SIZE_SKIP,
+                             clen, ulen, &slot->data);
+        if (r) {
+            syslog(LOG_ERR, "IOERROR: cache entry failed to uncompress "
+                   SIZE_T_FMT " %u %u", cache_offset, clen, ulen);
+            return r;
+        }
+
+        slot->fname = xstrdup(fname);
+        slot->offset = cache_offset;
+    }
+
+    slot->lastused = ++cache_decoded_clock;
+
+    r = cache_parseitems(&slot->data, 0, cache_version, crec);
+    if (r) return r;
+
+    crec->decode_slot = slot - cache_decoded;
+    crec->decode_seq = slot->seq;
 
     return 0;
 }
+#endif
+
+/* parse a single cache record from the mapped file */
+static int cache_parserecord(struct mappedfile *cachefile, size_t cache_offset,
+                             unsigned cache_version, struct cacherecord *crec)
+{
+    const struct buf *buf = mappedfile_buf(cachefile);
+    size_t hdr_offset = 0;
+    int compressed = 0;
+
+    if (cache_version >= MAILBOX_CACHE_SORTKEY_VERSION) {
+        /* self-describing: only compressed when flagged by the magic */
+        if (cache_offset + CACHE_ITEM_SIZE_SKIP <= buf->len &&
+            CACHE_ITEM_BIT32(buf->s + cache_offset) == CACHE_COMPRESSED_MAGIC) {
+            compressed = 1;
+            hdr_offset = CACHE_ITEM_SIZE_SKIP;
+        }
+    }
+    else if (cache_version >= MAILBOX_CACHE_COMPRESS_VERSION) {
+        compressed = 1;
+    }
+
+    if (compressed) {
+#ifdef HAVE_ZLIB
+        return cache_parserecord_compressed(cachefile, cache_offset,
+                                            cache_version, hdr_offset, crec);
+#else
+        /* can't read it - the caller will reparse the message */
+        (void)hdr_offset;
+        syslog(LOG_ERR, "IOERROR: compressed cache record without zlib "
+               SIZE_T_FMT, cache_offset);
+        return IMAP_MAILBOX_BADFORMAT;
+#endif
+    }
+
+    return cache_parseitems(buf, cache_offset, cache_version, crec);
+}
 
 EXPORTED char *mailbox_cache_get_env(struct mailbox *mailbox,
                                      const struct index_record *record,
@@ -579,26 +891,57 @@ static int cache_append_record(struct mappedfile *mf, struct index_record *recor
 {
     const struct buf *buf = cache_buf(record);
     size_t offset = mappedfile_size(mf);
+#ifdef HAVE_ZLIB
+    struct buf zbuf = BUF_INITIALIZER;
+#endif
+    int r = 0;
     int n;
 
+#ifdef HAVE_ZLIB
+    /* crec always holds the raw item stream; compress on the way out.
+     * version 8 records are self-describing, so only compress those
+     * when configured to; version 7 records are always compressed */
+    if ((record->cache_version >= MAILBOX_CACHE_SORTKEY_VERSION)
+        ? config_getswitch(IMAPOPT_CACHE_COMPRESS)
+        : record->cache_version >= MAILBOX_CACHE_COMPRESS_VERSION) {
+        int withmagic =
+            record->cache_version >= MAILBOX_CACHE_SORTKEY_VERSION;
+        r = cache_compress(buf, withmagic, &zbuf);
+        if (r) {
+            syslog(LOG_ERR, "failed to compress cache record for %u",
+                   record->uid);
+            goto done;
+        }
+        buf = &zbuf;
+    }
+#endif
+
     n = mappedfile_pwritebuf(mf, buf, offset);
     if (n < 0) {
         syslog(LOG_ERR, "failed to append " SIZE_T_FMT " bytes to cache", buf->len);
-        return IMAP_IOERROR;
+        r = IMAP_IOERROR;
+        goto done;
     }
 
     record->cache_offset = offset;
 
-    return 0;
+done:
+#ifdef HAVE_ZLIB
+    buf_free(&zbuf);
+#endif
+    return r;
 }
 
 static struct mappedfile *cache_getfile(ptrarray_t *list, const char *fname,
-                                        int readonly, uint32_t generation)
+                                        int readonly, uint32_t generation,
+                                        int extraflags)
 {
     struct mappedfile *cachefile = NULL;
     int openflags = readonly ? 0 : MAPPEDFILE_CREATE | MAPPEDFILE_RW;
     int i;
 
+    openflags |= extraflags;
+
     for (i = 0; i < list->count; i++) {
         cachefile = ptrarray_nth(list, i);
         if (!strcmp(fname, mappedfile_fname(cachefile)))
@@ -624,17 +967,62 @@ static struct mappedfile *cache_getfile(ptrarray_t *list, const char *fname,
     return cachefile;
 }
 
-static struct mappedfile *mailbox_cachefile(struct mailbox *mailbox,
-                                            const struct index_record *record)
+static struct mappedfile *mailbox_cachefile_byflags(struct mailbox *mailbox,
+                                                    uint32_t system_flags)
 {
     const char *fname;
 
-    if (record->system_flags & FLAG_ARCHIVED)
+    if (system_flags & FLAG_ARCHIVED)
         fname = mailbox_meta_fname(mailbox, META_ARCHIVECACHE);
     else
         fname = mailbox_meta_fname(mailbox, META_CACHE);
 
-    return cache_getfile(&mailbox->caches, fname, mailbox->is_readonly, mailbox->i.generation_no);
+    return cache_getfile(&mailbox->caches, fname, mailbox->is_readonly,
+                         mailbox->i.generation_no, /*extraflags*/0);
+}
+
+static struct mappedfile *mailbox_cachefile(struct mailbox *mailbox,
+                                            const struct index_record *record)
+{
+    return mailbox_cachefile_byflags(mailbox, record->system_flags);
+}
+
+/*
+ * Tell the kernel we're about to read the cache records covering
+ * [first_offset, last_offset] so it can start readahead now rather
+ * than faulting in one page at a time as mailbox_cacherecord walks a
+ * message set.  'system_flags' just selects cyrus.cache vs the archive
+ * cache.  Purely advisory - all failures are ignored.
+ */
+EXPORTED void mailbox_cacherecord_range(struct mailbox *mailbox,
+                                        uint32_t system_flags,
+                                        size_t first_offset,
+                                        size_t last_offset)
+{
+    struct mappedfile *cachefile;
+    const char *base;
+    size_t size, pagemask;
+
+    cachefile = mailbox_cachefile_byflags(mailbox, system_flags);
+    if (!cachefile) return;
+
+    base = mappedfile_base(cachefile);
+    size = mappedfile_size(cachefile);
+    if (!base || !size) return;
+
+    if (first_offset >= size) return;
+    /* cache records are variable length and we only know where they
+     * start, so read ahead a chunk past the last start offset */
+    last_offset += 65536;
+    if (last_offset > size) last_offset = size;
+    if (last_offset <= first_offset) return;
+
+    /* madvise wants a page-aligned address */
+    pagemask = ((size_t)getpagesize()) - 1;
+    first_offset &= ~pagemask;
+
+    (void)madvise((void *)(base + first_offset),
+                  last_offset - first_offset, MADV_WILLNEED);
 }
 
 static struct mappedfile *repack_cachefile(struct mailbox_repack *repack,
@@ -647,7 +1035,8 @@ static struct mappedfile *repack_cachefile(struct mailbox_repack *repack,
     else
         fname = mailbox_meta_newfname(repack->mailbox, META_CACHE);
 
-    return cache_getfile(&repack->caches, fname, /*readonly*/0, repack->i.generation_no);
+    return cache_getfile(&repack->caches, fname, /*readonly*/0,
+                         repack->i.generation_no, /*extraflags*/0);
 }
 
 /* return the offset for the start of the record! */
@@ -703,8 +1092,10 @@ EXPORTED int mailbox_cacherecord(struct mailbox *mailbox,
      * giving const protection to records which are only used for read */
     struct index_record *backdoor = (struct index_record *)record;
 
-    /* do we already have a record loaded? */
-    if (record->crec.len)
+    /* do we already have a record loaded?  (a compressed record's
+     * decoded copy may have been recycled since, in which case fall
+     * through and decode it again) */
+    if (record->crec.len && cache_decoded_valid(&backdoor->crec))
         return 0;
 
     /* make sure there's a file to read from */
@@ -717,7 +1108,8 @@ EXPORTED int mailbox_cacherecord(struct mailbox *mailbox,
         goto err;
 
     /* try to parse the cache record */
-    r = cache_parserecord(cachefile, record->cache_offset, &backdoor->crec);
+    r = cache_parserecord(cachefile, record->cache_offset,
+                          record->cache_version, &backdoor->crec);
     if (r) goto err;
 
     /* old-style record */
@@ -937,6 +1329,87 @@ static int mailbox_mboxlock_reopen(struct mailboxlist *listitem, int locktype)
     return r;
 }
 
+/*
+ * A small per-process cache of recently closed mailboxes.  Entries stay
+ * on the open_mailboxes list with nopen == 0 and no locks held, keeping
+ * their file descriptors, index map and parsed header alive so that
+ * reopening the same mailbox skips the open/map/parse work.
+ */
+static int mailboxcache_max(void)
+{
+    static int max = -1;
+    if (max < 0) max = config_getint(IMAPOPT_MAILBOX_OPEN_CACHE);
+    return max;
+}
+
+static void mailboxcache_prune(int keep)
+{
+    struct mailboxlist *item;
+    struct mailboxlist *oldest;
+    int ncached;
+
+    for (;;) {
+        ncached = 0;
+        oldest = NULL;
+        /* the list is newest-first, so the last cached item is oldest */
+        for (item = open_mailboxes; item; item = item->next) {
+            if (item->nopen) continue;
+            ncached++;
+            oldest = item;
+        }
+        if (ncached <= keep) return;
+        mailbox_discard_listitem(oldest);
+    }
+}
+
+/* take a fresh name lock on a cached mailbox and check that nothing
+ * moved underneath us while we held no locks.  On any failure the
+ * cached entry is discarded and the caller opens from scratch. */
+static int mailboxcache_revive(struct mailboxlist *listitem, int locktype)
+{
+    struct mailbox *mailbox = &listitem->m;
+    mbentry_t *mbentry = NULL;
+    struct stat sbuf;
+    const char *fname;
+    int r;
+
+    r = mboxname_lock(mailbox->name, &listitem->l, locktype);
+    if (r) goto fail;
+
+    /* the mboxlist entry may have changed - recheck it and pick up
+     * the current ACL */
+    r = mboxlist_lookup_allow_all(mailbox->name, &mbentry, NULL);
+    if (r) goto fail;
+
+    if ((mbentry->mbtype & MBTYPE_MOVING) || !mbentry->partition ||
+        strcmp(mailbox->part, mbentry->partition)) {
+        mboxlist_entry_free(&mbentry);
+        r = IMAP_MAILBOX_NONEXISTENT;
+        goto fail;
+    }
+
+    free(mailbox->acl);
+    mailbox->acl = xstrdup(mbentry->acl);
+    mailbox->mbtype = mbentry->mbtype;
+    mboxlist_entry_free(&mbentry);
+
+    /* cyrus.index is only stable while the name lock is held - if it
+     * was repacked in between it has a new inode, so remap it */
+    fname = mailbox_meta_fname(mailbox, META_INDEX);
+    if (!fname || stat(fname, &sbuf) == -1 ||
+        sbuf.st_ino != mailbox->index_ino) {
+        r = mailbox_open_index(mailbox);
+        if (r) goto fail;
+    }
+
+    listitem->nopen = 1;
+    return 0;
+
+fail:
+    mailbox_discard_listitem(listitem);
+    return r ? r : IMAP_MAILBOX_NONEXISTENT;
+}
+
 /*
  * Open and read the header of the mailbox with name 'name'
  * The structure pointed to by 'mailbox' is initialized.
@@ -949,12 +1422,28 @@ static int mailbox_open_advanced(const char *name,
     mbentry_t *mbentry = NULL;
     struct mailboxlist *listitem;
     struct mailbox *mailbox = NULL;
+    struct xstats_timer timer;
     int r = 0;
 
     assert(*mailboxptr == NULL);
 
+    xstats_timer_start(&timer);
+
     listitem = find_listitem(name);
 
+    /* cached from an earlier close?  revalidate it rather than
+     * opening from scratch */
+    if (listitem && !listitem->nopen) {
+        if (mailboxcache_revive(listitem, locktype)) {
+            /* entry was stale and has been discarded */
+            listitem = NULL;
+        }
+        else {
+            mailbox = &listitem->m;
+            goto lockindex;
+        }
+    }
+
     /* already open?  just use this one */
     if (listitem) {
         /* can't reuse an exclusive locked mailbox */
@@ -1029,6 +1518,8 @@ done:
     if (r) mailbox_close(&mailbox);
     else *mailboxptr = mailbox;
 
+    xstats_timer_end(&timer, MAILBOX_OPEN);
+
     return r;
 }
 
@@ -1073,6 +1564,9 @@ EXPORTED modseq_t mailbox_modseq_dirty(struct mailbox *mailbox)
         return mailbox->i.highestmodseq;
 
     if (!mailbox->modseq_dirty) {
+        /* remember where this transaction started, so the modseq log
+         * can tell whether it covers everything up to here */
+        mailbox->modseqlog_premodseq = mailbox->i.highestmodseq;
         mailbox->i.highestmodseq = mboxname_setmodseq(mailbox->name,
                                    mailbox->i.highestmodseq,
                                    mailbox->mbtype, /*dofolder*/0);
@@ -1124,7 +1618,6 @@ EXPORTED int mailbox_setversion(struct mailbox *mailbox, int version)
  */
 EXPORTED void mailbox_close(struct mailbox **mailboxptr)
 {
-    int flag;
     struct mailbox *mailbox = *mailboxptr;
     struct mailboxlist *listitem;
 
@@ -1180,8 +1673,32 @@ EXPORTED void mailbox_close(struct mailbox **mailboxptr)
          * THEIR mailbox_close call */
     }
 
+    /* keep recently used mailboxes open: drop the locks but leave the
+     * fds and maps behind so a reopen is nearly free.  Not worth it if
+     * we were in the middle of cleanup, or only partially open */
+    if (!in_shutdown && mailboxcache_max() > 0 &&
+        !(mailbox->i.options & MAILBOX_CLEANUP_MASK) &&
+        listitem->l && listitem->l->locktype == LOCK_SHARED &&
+        mailbox->index_fd != -1 && mailbox->index_base) {
+        mboxname_release(&listitem->l);
+        listitem->nopen = 0;
+        mailboxcache_prune(mailboxcache_max());
+        return;
+    }
+
+    mailbox_discard_listitem(listitem);
+}
+
+/* final teardown of a list entry: free everything the mailbox holds,
+ * release any name lock and take it off the open_mailboxes list */
+static void mailbox_discard_listitem(struct mailboxlist *listitem)
+{
+    struct mailbox *mailbox = &listitem->m;
+    int flag;
+
     mailbox_release_resources(mailbox);
 
+    buf_free(&mailbox->header_parsed);
     free(mailbox->name);
     free(mailbox->part);
     free(mailbox->acl);
@@ -1666,10 +2183,23 @@ static int mailbox_read_index_header(struct mailbox *mailbox)
                 &mailbox->index_len, mailbox->index_size,
                 "index", mailbox->name);
 
+    /* the header is rewritten in place, so if the bytes match what we
+     * parsed last time then every field of mailbox->i is still
+     * current and we can skip the decode (and its CRC check - the
+     * identical bytes already passed it) */
+    if (mailbox->header_parsed.len &&
+        mailbox->header_parsed.len <= mailbox->index_len &&
+        !memcmp(mailbox->header_parsed.s, mailbox->index_base,
+                mailbox->header_parsed.len))
+        return mailbox_refresh_index_map(mailbox);
+
     r = mailbox_buf_to_index_header(mailbox->index_base, mailbox->index_len,
                                     &mailbox->i);
     if (r) return r;
 
+    buf_setmap(&mailbox->header_parsed, mailbox->index_base,
+               mailbox->i.start_offset);
+
     r = mailbox_refresh_index_map(mailbox);
     if (r) return r;
 
@@ -1793,13 +2323,37 @@ static int _store_change(struct mailbox *mailbox, struct index_record *record, i
     return 0;
 }
 
+static void _audit_change(struct mailbox *mailbox, struct index_change *change)
+{
+    struct index_record *record = &change->record;
+
+    if (config_auditlog) {
+        if (change->flags & CHANGE_ISAPPEND)
+            syslog(LOG_NOTICE, "auditlog: append sessionid=<%s> "
+                    "mailbox=<%s> uniqueid=<%s> uid=<%u> modseq=<%llu> sysflags=<%u> guid=<%s>",
+                session_id(), mailbox->name, mailbox->uniqueid, record->uid,
+                record->modseq, record->system_flags, message_guid_encode(&record->guid));
+
+        if ((record->system_flags & FLAG_EXPUNGED) && !(change->flags & CHANGE_WASEXPUNGED))
+            syslog(LOG_NOTICE, "auditlog: expunge sessionid=<%s> "
+                   "mailbox=<%s> uniqueid=<%s> uid=<%u> modseq=<%llu> sysflags=<%u> guid=<%s>",
+                session_id(), mailbox->name, mailbox->uniqueid, record->uid,
+                record->modseq, record->system_flags, message_guid_encode(&record->guid));
+
+        if ((record->system_flags & FLAG_UNLINKED) && !(change->flags & CHANGE_WASUNLINKED))
+            syslog(LOG_NOTICE, "auditlog: unlink sessionid=<%s> "
+                   "mailbox=<%s> uniqueid=<%s> uid=<%u> modseq=<%llu> sysflags=<%u> guid=<%s>",
+                session_id(), mailbox->name, mailbox->uniqueid, record->uid,
+                record->modseq, record->system_flags, message_guid_encode(&record->guid));
+    }
+}
+
 static int _commit_one(struct mailbox *mailbox, struct index_change *change)
 {
     indexbuffer_t ibuf;
     unsigned char *buf = ibuf.buf;
     size_t offset;
-    struct index_record *record = &change->record;
-    uint32_t recno = record->recno;
+    uint32_t recno = change->record.recno;
 
     mailbox_index_record_to_buf(&change->record, mailbox->i.minor_version, buf);
 
@@ -1818,28 +2372,60 @@ static int _commit_one(struct mailbox *mailbox, struct index_change *change)
         return IMAP_IOERROR;
     }
 
-    /* audit logging */
-    if (config_auditlog) {
-        if (change->flags & CHANGE_ISAPPEND)
-            syslog(LOG_NOTICE, "auditlog: append sessionid=<%s> "
-                    "mailbox=<%s> uniqueid=<%s> uid=<%u> modseq=<%llu> sysflags=<%u> guid=<%s>",
-                session_id(), mailbox->name, mailbox->uniqueid, record->uid,
-                record->modseq, record->system_flags, message_guid_encode(&record->guid));
+    _audit_change(mailbox, change);
 
-        if ((record->system_flags & FLAG_EXPUNGED) && !(change->flags & CHANGE_WASEXPUNGED))
-            syslog(LOG_NOTICE, "auditlog: expunge sessionid=<%s> "
-                   "mailbox=<%s> uniqueid=<%s> uid=<%u> modseq=<%llu> sysflags=<%u> guid=<%s>",
-                session_id(), mailbox->name, mailbox->uniqueid, record->uid,
-                record->modseq, record->system_flags, message_guid_encode(&record->guid));
+    return 0;
+}
 
-        if ((record->system_flags & FLAG_UNLINKED) && !(change->flags & CHANGE_WASUNLINKED))
-            syslog(LOG_NOTICE, "auditlog: unlink sessionid=<%s> "
-                   "mailbox=<%s> uniqueid=<%s> uid=<%u> modseq=<%llu> sysflags=<%u> guid=<%s>",
-                session_id(), mailbox->name, mailbox->uniqueid, record->uid,
-                record->modseq, record->system_flags, message_guid_encode(&record->guid));
+/* Most records in the dirty set are usually adjacent - a bulk STORE
+ * (e.g. "mark folder read") touches nearly every record - so commit a
+ * whole contiguous run of them with a single write rather than one
+ * seek and write per record.  Capped so a huge run doesn't need a
+ * huge staging buffer. */
+#define COMMIT_RUN_RECORDS 4096
+
+static int _commit_run(struct mailbox *mailbox, uint32_t first, uint32_t n)
+{
+    indexbuffer_t ibuf;
+    char *buf = xmalloc((size_t)n * INDEX_RECORD_SIZE);
+    size_t offset;
+    uint32_t i;
+    int r = 0;
+
+    for (i = 0; i < n; i++) {
+        struct index_change *change = &mailbox->index_changes[first+i];
+        mailbox_index_record_to_buf(&change->record, mailbox->i.minor_version,
+                                    ibuf.buf);
+        memcpy(buf + (size_t)i * INDEX_RECORD_SIZE, ibuf.buf, INDEX_RECORD_SIZE);
     }
 
-    return 0;
+    offset = mailbox->i.start_offset +
+             ((mailbox->index_changes[first].record.recno - 1) *
+              mailbox->i.record_size);
+
+    /* any failure here is a disaster! */
+    if (lseek(mailbox->index_fd, offset, SEEK_SET) == -1) {
+        syslog(LOG_ERR, "IOERROR: seeking index record %u for %s: %m",
+               mailbox->index_changes[first].record.recno, mailbox->name);
+        r = IMAP_IOERROR;
+        goto out;
+    }
+
+    if (retry_write(mailbox->index_fd, buf, (size_t)n * INDEX_RECORD_SIZE)
+        != (ssize_t)((size_t)n * INDEX_RECORD_SIZE)) {
+        syslog(LOG_ERR, "IOERROR: writing index records %u-%u for %s: %m",
+               mailbox->index_changes[first].record.recno,
+               mailbox->index_changes[first+n-1].record.recno, mailbox->name);
+        r = IMAP_IOERROR;
+        goto out;
+    }
+
+    for (i = 0; i < n; i++)
+        _audit_change(mailbox, &mailbox->index_changes[first+i]);
+
+out:
+    free(buf);
+    return r;
 }
 
 static void _cleanup_changes(struct mailbox *mailbox)
@@ -1864,6 +2450,222 @@ static int change_compar(const void *a, const void *b)
     return 0;
 }
 
+/*
+ * Modseq log: a per-mailbox sidecar file (cyrus.modseq) recording, in
+ * modseq order, the UID of every record change we commit.  QRESYNC and
+ * CONDSTORE handlers can then find the records changed since a given
+ * modseq with a binary search and a short tail walk instead of a scan
+ * of the whole index.  The log is advisory: readers only believe it
+ * when its header shows it is complete up to the mailbox's current
+ * highestmodseq, and fall back to the index scan otherwise, so it is
+ * never fsynced and can be deleted at any time.
+ */
+
+#define MODSEQLOG_MAGIC     0x4d534551  /* "MSEQ" */
+#define MODSEQLOG_VERSION   1
+#define MODSEQLOG_HEADER    32  /* magic, version, uidvalidity, pad,
+                                 * startmodseq, lastmodseq */
+#define MODSEQLOG_RECSIZE   12  /* modseq, uid */
+
+static modseq_t modseqlog_get64(const char *p)
+{
+    bit64 v;
+    memcpy(&v, p, 8);   /* may be unaligned */
+    return ntohll(v);
+}
+
+static uint32_t modseqlog_get32(const char *p)
+{
+    bit32 v;
+    memcpy(&v, p, 4);   /* may be unaligned */
+    return ntohl(v);
+}
+
+struct modseqlog_entry {
+    modseq_t modseq;
+    uint32_t uid;
+};
+
+static int modseqlog_compar(const void *a, const void *b)
+{
+    const struct modseqlog_entry *ae = a;
+    const struct modseqlog_entry *be = b;
+
+    if (ae->modseq > be->modseq)
+        return 1;
+    if (ae->modseq < be->modseq)
+        return -1;
+    return 0;
+}
+
+static void mailbox_modseqlog_commit(struct mailbox *mailbox)
+{
+    struct modseqlog_entry *entries;
+    struct buf buf = BUF_INITIALIZER;
+    char hbuf[MODSEQLOG_HEADER];
+    const char *fname;
+    modseq_t lastmodseq = 0;
+    uint32_t i;
+    uint32_t n = 0;
+    int recreate = 0;
+    int fd = -1;
+
+    if (!config_getswitch(IMAPOPT_MAILBOX_MODSEQ_LOG)) return;
+
+    /* a silent-only transaction moves no modseq, so there's nothing
+     * a modseq-based reader could miss */
+    if (!mailbox->modseq_dirty) return;
+
+    /* entries at or below the transaction floor are silent rewrites
+     * of changes which have already been logged */
+    entries = xmalloc(mailbox->index_change_count * sizeof(*entries));
+    for (i = 0; i < mailbox->index_change_count; i++) {
+        const struct index_record *record = &mailbox->index_changes[i].record;
+        if (record->modseq <= mailbox->modseqlog_premodseq)
+            continue;
+        entries[n].modseq = record->modseq;
+        entries[n].uid = record->uid;
+        n++;
+    }
+    if (!n) goto out;
+
+    /* keep the file sorted: commit order is recno order, not
+     * modseq order */
+    qsort(entries, n, sizeof(*entries), modseqlog_compar);
+
+    fname = mailbox_meta_fname(mailbox, META_MODSEQ);
+    if (!fname) goto out;
+    fd = open(fname, O_RDWR|O_CREAT, 0666);
+    if (fd < 0) goto out;
+
+    /* only append if the log is complete up to the start of this
+     * transaction, otherwise changes went unlogged and we must start
+     * over from here */
+    if (retry_read(fd, hbuf, MODSEQLOG_HEADER) < MODSEQLOG_HEADER
+        || modseqlog_get32(hbuf) != MODSEQLOG_MAGIC
+        || modseqlog_get32(hbuf+4) != MODSEQLOG_VERSION
+        || modseqlog_get32(hbuf+8) != mailbox->i.uidvalidity
+        || modseqlog_get64(hbuf+24) != mailbox->modseqlog_premodseq)
+        recreate = 1;
+
+    if (recreate) {
+        if (ftruncate(fd, 0) < 0) goto out;
+        if (lseek(fd, 0L, SEEK_SET) < 0) goto out;
+        buf_appendbit32(&buf, MODSEQLOG_MAGIC);
+        buf_appendbit32(&buf, MODSEQLOG_VERSION);
+        buf_appendbit32(&buf, mailbox->i.uidvalidity);
+        buf_appendbit32(&buf, 0);
+        buf_appendbit64(&buf, mailbox->modseqlog_premodseq); /* startmodseq */
+        buf_appendbit64(&buf, mailbox->modseqlog_premodseq); /* lastmodseq */
+    }
+    else {
+        if (lseek(fd, 0L, SEEK_END) < 0) goto out;
+    }
+
+    for (i = 0; i < n; i++) {
+        buf_appendbit64(&buf, entries[i].modseq);
+        buf_appendbit32(&buf, entries[i].uid);
+    }
+
+    if (retry_write(fd, buf.s, buf.len) < 0) goto out;
+
+    /* mark the log complete last, so a torn append just looks stale */
+    lastmodseq = htonll(mailbox->i.highestmodseq);
+    if (lseek(fd, 24L, SEEK_SET) < 0) goto out;
+    retry_write(fd, (char *)&lastmodseq, 8);
+
+out:
+    if (fd >= 0) close(fd);
+    buf_free(&buf);
+    free(entries);
+}
+
+/*
+ * Report the UIDs of all records with a modseq greater than 'since',
+ * in modseq order, from the modseq log.  Returns 0 and a malloced
+ * array (which may repeat a UID if a record changed several times) if
+ * the log can answer the question, or IMAP_NOTFOUND if the caller
+ * has to scan the index the hard way.
+ */
+EXPORTED int mailbox_modseqlog_since(struct mailbox *mailbox, modseq_t since,
+                                     uint32_t **uidsp, unsigned *nuidsp)
+{
+    const char *fname;
+    struct stat sbuf;
+    const char *base = NULL;
+    size_t len = 0;
+    const char *recs;
+    uint32_t *uids = NULL;
+    modseq_t prev = 0;
+    unsigned nrecs, lo, hi, i;
+    unsigned n = 0;
+    int fd = -1;
+    int r = IMAP_NOTFOUND;
+
+    *uidsp = NULL;
+    *nuidsp = 0;
+
+    if (!config_getswitch(IMAPOPT_MAILBOX_MODSEQ_LOG)) return IMAP_NOTFOUND;
+
+    fname = mailbox_meta_fname(mailbox, META_MODSEQ);
+    if (!fname) return IMAP_NOTFOUND;
+    fd = open(fname, O_RDONLY);
+    if (fd < 0) return IMAP_NOTFOUND;
+    if (fstat(fd, &sbuf) < 0) goto out;
+    if (sbuf.st_size < MODSEQLOG_HEADER) goto out;
+
+    map_refresh(fd, 1, &base, &len, sbuf.st_size, fname, mailbox->name);
+
+    if (modseqlog_get32(base) != MODSEQLOG_MAGIC) goto out;
+    if (modseqlog_get32(base+4) != MODSEQLOG_VERSION) goto out;
+    if (modseqlog_get32(base+8) != mailbox->i.uidvalidity) goto out;
+    /* the log only covers changes after its creation */
+    if (since < modseqlog_get64(base+16)) goto out;
+    /* and is only believed when it is complete up to now */
+    if (modseqlog_get64(base+24) != mailbox->i.highestmodseq) goto out;
+
+    recs = base + MODSEQLOG_HEADER;
+    nrecs = (len - MODSEQLOG_HEADER) / MODSEQLOG_RECSIZE;
+
+    /* find the first entry with modseq greater than 'since' */
+    lo = 0;
+    hi = nrecs;
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (modseqlog_get64(recs + mid * MODSEQLOG_RECSIZE) > since)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    if (lo == nrecs) {
+        r = 0;      /* nothing has changed */
+        goto out;
+    }
+
+    uids = xmalloc((nrecs - lo) * sizeof(uint32_t));
+    for (i = lo; i < nrecs; i++) {
+        modseq_t modseq = modseqlog_get64(recs + i * MODSEQLOG_RECSIZE);
+        /* the binary search is only valid on a sorted tail */
+        if (modseq <= since || modseq < prev) {
+            free(uids);
+            uids = NULL;
+            goto out;
+        }
+        prev = modseq;
+        uids[n++] = modseqlog_get32(recs + i * MODSEQLOG_RECSIZE + 8);
+    }
+
+    *uidsp = uids;
+    *nuidsp = n;
+    r = 0;
+
+out:
+    if (base) map_free(&base, &len);
+    if (fd >= 0) close(fd);
+    return r;
+}
+
 static int _commit_changes(struct mailbox *mailbox)
 {
     uint32_t i;
@@ -1878,10 +2680,35 @@ static int _commit_changes(struct mailbox *mailbox)
     qsort(mailbox->index_changes, mailbox->index_change_count,
           sizeof(struct index_change), change_compar);
 
-    for (i = 1; i <= mailbox->index_change_count; i++) {
-        r = _commit_one(mailbox, &mailbox->index_changes[i-1]);
-        if (r) return r; /* DAMN, we're screwed */
+    if (mailbox->i.record_size == INDEX_RECORD_SIZE) {
+        /* records are packed at the newest size, so adjacent recnos
+         * are adjacent on disk and can be committed in runs */
+        i = 0;
+        while (i < mailbox->index_change_count) {
+            uint32_t n = 1;
+            while (i + n < mailbox->index_change_count
+                   && n < COMMIT_RUN_RECORDS
+                   && mailbox->index_changes[i+n].record.recno ==
+                      mailbox->index_changes[i+n-1].record.recno + 1)
+                n++;
+            if (n == 1)
+                r = _commit_one(mailbox, &mailbox->index_changes[i]);
+            else
+                r = _commit_run(mailbox, i, n);
+            if (r) return r; /* DAMN, we're screwed */
+            i += n;
+        }
     }
+    else {
+        /* other record sizes aren't laid out at INDEX_RECORD_SIZE
+         * stride, so take the one-at-a-time route */
+        for (i = 1; i <= mailbox->index_change_count; i++) {
+            r = _commit_one(mailbox, &mailbox->index_changes[i-1]);
+            if (r) return r; /* DAMN, we're screwed */
+        }
+    }
+
+    mailbox_modseqlog_commit(mailbox);
 
     _cleanup_changes(mailbox);
 
@@ -1940,6 +2767,55 @@ static int mailbox_read_index_record(struct mailbox *mailbox,
     return r;
 }
 
+/*
+ * Read just the hot columns (uid, system_flags, internaldate, modseq)
+ * for 'recno' directly out of the mapped index.  Unlike
+ * mailbox_read_index_record this touches only the cache lines holding
+ * those fields and skips the record CRC and annotation lookups, so
+ * tight scans over large mailboxes (flag counting, CONDSTORE modseq
+ * filtering, UID binary search) don't stride through the whole
+ * ~100 byte record.
+ */
+EXPORTED int mailbox_read_basic(struct mailbox *mailbox, uint32_t recno,
+                                struct index_basic *basic)
+{
+    const char *buf;
+    unsigned offset;
+    struct index_change *change = _find_change(mailbox, recno);
+
+    if (change) {
+        basic->uid = change->record.uid;
+        basic->system_flags = change->record.system_flags;
+        basic->internaldate = change->record.internaldate;
+        basic->modseq = change->record.modseq;
+        return 0;
+    }
+
+    offset = mailbox->i.start_offset + (recno-1) * mailbox->i.record_size;
+
+    if (offset + mailbox->i.record_size > mailbox->index_size) {
+        syslog(LOG_ERR,
+               "IOERROR: index record %u for %s past end of file",
+               recno, mailbox->name);
+        return IMAP_IOERROR;
+    }
+
+    buf = mailbox->index_base + offset;
+
+    basic->uid = ntohl(*((bit32 *)(buf+OFFSET_UID)));
+    basic->system_flags = ntohl(*((bit32 *)(buf+OFFSET_SYSTEM_FLAGS)));
+    basic->internaldate = ntohl(*((bit32 *)(buf+OFFSET_INTERNALDATE)));
+
+    if (mailbox->i.minor_version < 8)
+        basic->modseq = 0;
+    else if (mailbox->i.minor_version < 10)
+        basic->modseq = ntohll(*((bit64 *)(buf+72)));
+    else
+        basic->modseq = ntohll(*((bit64 *)(buf+OFFSET_MODSEQ)));
+
+    return 0;
+}
+
 EXPORTED int mailbox_has_conversations(struct mailbox *mailbox)
 {
     char *path;
@@ -2018,11 +2894,10 @@ EXPORTED struct webdav_db *mailbox_open_webdav(struct mailbox *mailbox)
 
 static uint32_t mailbox_getuid(struct mailbox *mailbox, uint32_t recno)
 {
-    struct index_record record;
-    record.uid = 0;
-    /* XXX - cheaper memory-access reads? */
-    mailbox_read_index_record(mailbox, recno, &record);
-    return record.uid;
+    struct index_basic basic;
+    basic.uid = 0;
+    mailbox_read_basic(mailbox, recno, &basic);
+    return basic.uid;
 }
 
 
@@ -2193,6 +3068,97 @@ EXPORTED int mailbox_lock_index(struct mailbox *mailbox, int locktype)
     return 0;
 }
 
+/*
+ * Incremental tombstone reaping.  cyr_expire retires expunged records
+ * in one big locked pass per mailbox; with expunge_reap_days set we
+ * additionally retire a small bounded batch of sufficiently old
+ * tombstones on each write transaction, so busy mailboxes stay compact
+ * without waiting for the dedicated maintenance run.  The records are
+ * only marked FLAG_UNLINKED here - actual removal still happens in
+ * mailbox_index_repack() via OPT_MAILBOX_NEEDS_REPACK, exactly as for
+ * mailbox_expunge_cleanup().
+ */
+#define MAILBOX_REAP_BATCH 32
+
+static void mailbox_reap_tombstones(struct mailbox *mailbox)
+{
+    int reap_days = config_getint(IMAPOPT_EXPUNGE_REAP_DAYS);
+    time_t expunge_mark;
+    time_t first_expunged = 0;
+    unsigned numreaped = 0;
+    int complete = 1;
+    const message_t *msg;
+
+    if (reap_days <= 0)
+        return;
+
+    /* only piggyback on an existing write transaction */
+    if (mailbox->index_locktype != LOCK_EXCLUSIVE)
+        return;
+    if (!mailbox->i.dirty)
+        return;
+    if (mailbox->i.options & OPT_MAILBOX_DELETED)
+        return;
+
+    /* cheap gate: the header tracks the oldest retained tombstone */
+    expunge_mark = time(0) - (reap_days * 86400);
+    if (!mailbox->i.first_expunged || mailbox->i.first_expunged > expunge_mark)
+        return;
+
+    struct mailbox_iter *iter = mailbox_iter_init(mailbox, 0, 0);
+    while ((msg = mailbox_iter_step(iter))) {
+        const struct index_record *record = msg_record(msg);
+
+        /* already unlinked, nothing to do */
+        if (record->system_flags & FLAG_UNLINKED)
+            continue;
+
+        /* not expunged, keep it */
+        if (!(record->system_flags & FLAG_EXPUNGED))
+            continue;
+
+        /* not stale enough yet - but track the updated time so the
+         * gate above knows when to look again */
+        if (record->last_updated > expunge_mark) {
+            if (!first_expunged || (first_expunged > record->last_updated))
+                first_expunged = record->last_updated;
+            continue;
+        }
+
+        if (numreaped >= MAILBOX_REAP_BATCH) {
+            /* bounded work per transaction: leave first_expunged
+             * alone so the next transaction picks up the rest */
+            complete = 0;
+            break;
+        }
+
+        struct index_record copyrecord = *record;
+        copyrecord.system_flags |= FLAG_UNLINKED;
+        copyrecord.silent = 1;
+        if (mailbox_rewrite_index_record(mailbox, &copyrecord)) {
+            syslog(LOG_ERR, "IOERROR: failed to mark unlinked %s %u (recno %d)",
+                   mailbox->name, copyrecord.uid, copyrecord.recno);
+            complete = 0;
+            break;
+        }
+
+        numreaped++;
+    }
+    mailbox_iter_done(&iter);
+
+    if (numreaped || (complete && mailbox->i.first_expunged != first_expunged)) {
+        mailbox_index_dirty(mailbox);
+        if (numreaped)
+            mailbox->i.options |= OPT_MAILBOX_NEEDS_REPACK;
+        if (complete)
+            mailbox->i.first_expunged = first_expunged;
+    }
+
+    if (numreaped)
+        syslog(LOG_DEBUG, "reaped %u expunged records from %s",
+               numreaped, mailbox->name);
+}
+
 /*
  * Release lock on the index file for 'mailbox'
  */
@@ -2207,6 +3173,10 @@ EXPORTED void mailbox_unlock_index(struct mailbox *mailbox, struct statusdata *s
      * refcounting isn't good about partial commit/abort and all the
      * unwinding, so here you are.  At least if you mailbox_abort, then
      * it resets the dirty flags, so this becomes a NOOP during close */
+    /* a write transaction is also a chance to retire a few old
+     * expunged records without a dedicated maintenance pass */
+    if (!in_shutdown)
+        mailbox_reap_tombstones(mailbox);
     /* naughty - you can't unlock a dirty mailbox! */
     r = mailbox_commit(mailbox);
     if (r) {
@@ -2493,12 +3463,29 @@ EXPORTED int mailbox_abort(struct mailbox *mailbox)
     r = mailbox_read_header(mailbox, NULL);
     if (r) return r;
 
+    /* the on-disk bytes haven't changed, but our in-memory copy has -
+     * force a full reparse */
+    buf_reset(&mailbox->header_parsed);
+
     r = mailbox_read_index_header(mailbox);
     if (r) return r;
 
     return 0;
 }
 
+/* Sync an in-place index update to disk.  Record and header rewrites
+ * never change the size of cyrus.index, so fdatasync is sufficient
+ * and spares the filesystem journalling an unchanged inode on every
+ * flag update.  Admins who'd rather take their chances (e.g. on a
+ * rebuildable replica) can skip the sync entirely. */
+static int mailbox_index_sync(struct mailbox *mailbox)
+{
+    if (config_getswitch(IMAPOPT_MAILBOX_UNSAFE_SYNC))
+        return 0;
+
+    return fdatasync(mailbox->index_fd);
+}
+
 /*
  * Write the index header for 'mailbox'
  */
@@ -2546,12 +3533,16 @@ EXPORTED int mailbox_commit(struct mailbox *mailbox)
 
     lseek(mailbox->index_fd, 0, SEEK_SET);
     n = retry_write(mailbox->index_fd, buf, mailbox->i.start_offset);
-    if (n < 0 || fsync(mailbox->index_fd)) {
+    if (n < 0 || mailbox_index_sync(mailbox)) {
         syslog(LOG_ERR, "IOERROR: writing index header for %s: %m",
                mailbox->name);
         return IMAP_IOERROR;
     }
 
+    /* what's on disk now matches what's in memory */
+    buf_setmap(&mailbox->header_parsed, (const char *)buf,
+               mailbox->i.start_offset);
+
     if (config_auditlog && mailbox->modseq_dirty)
         syslog(LOG_NOTICE, "auditlog: modseq sessionid=<%s> "
                "mailbox=<%s> uniqueid=<%s> highestmodseq=<" MODSEQ_FMT ">",
@@ -3748,6 +4739,18 @@ static int mailbox_repack_setup(struct mailbox *mailbox, int version,
     repack->i = mailbox->i; /* struct copy */
     repack->newindex_fd = -1;
 
+    /* every record's cache entry gets read during the repack, so fault
+     * the source caches in with one up-front read rather than stalling
+     * page by page partway through the rewrite */
+    fname = mailbox_meta_fname(mailbox, META_CACHE);
+    if (fname && !access(fname, F_OK))
+        cache_getfile(&mailbox->caches, fname, mailbox->is_readonly,
+                      mailbox->i.generation_no, MAPPEDFILE_POPULATE);
+    fname = mailbox_meta_fname(mailbox, META_ARCHIVECACHE);
+    if (fname && !access(fname, F_OK))
+        cache_getfile(&mailbox->caches, fname, mailbox->is_readonly,
+                      mailbox->i.generation_no, MAPPEDFILE_POPULATE);
+
     /* new files */
     fname = mailbox_meta_newfname(mailbox, META_INDEX);
     repack->newindex_fd = open(fname, O_RDWR|O_TRUNC|O_CREAT, 0666);
@@ -4102,6 +5105,21 @@ done:
     return r;
 }
 
+/*
+ * Compact the index/cache pair right now with a single sequential
+ * rewrite, rather than waiting for the close-time cleanup to get a
+ * non-blocking lock some day.  Bulk expire runs call this directly
+ * after marking records unlinked, so one pass streams the live
+ * records out and drops the tombstones instead of leaving the file
+ * fragmented until the next opportunistic repack.
+ */
+EXPORTED int mailbox_repack(struct mailbox *mailbox)
+{
+    assert(mailbox_index_islocked(mailbox, 1));
+
+    return mailbox_index_repack(mailbox, mailbox->i.minor_version);
+}
+
 /*
  * Used by mailbox_rename() to expunge all messages in INBOX
  */
@@ -4980,6 +5998,12 @@ static struct meta_file meta_files[] = {
     { META_INDEX,        0, 1 },
     { META_CACHE,        1, 1 },
     { META_SQUAT,        1, 0 },
+    { META_SQUAT_DELTA,  1, 0 },
+    { META_THREAD,       1, 0 },
+    { META_BLOOM,        1, 0 },
+    { META_MODSEQ,       1, 0 },
+    { META_POPCACHE,     1, 0 },
+    { META_OVERVIEW,     1, 0 },
     { META_ANNOTATIONS,  1, 1 },
     { META_ARCHIVECACHE, 1, 1 },
     { 0, 0, 0 }
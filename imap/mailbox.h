@@ -75,12 +75,25 @@
  * changed to be able to convert both backwards and forwards between the
  * new version and all supported previous versions */
 #define MAILBOX_MINOR_VERSION   13
-#define MAILBOX_CACHE_MINOR_VERSION 6
+#define MAILBOX_CACHE_MINOR_VERSION 8
+/* cache records from this version up are stored deflate-compressed;
+ * see cache_parserecord() in mailbox.c for the on-disk layout */
+#define MAILBOX_CACHE_COMPRESS_VERSION 7
+/* cache records from this version up carry the CACHE_SORTKEYS item
+ * and flag compression with a leading magic word instead of being
+ * unconditionally compressed */
+#define MAILBOX_CACHE_SORTKEY_VERSION 8
 
 #define FNAME_HEADER "/cyrus.header"
 #define FNAME_INDEX "/cyrus.index"
 #define FNAME_CACHE "/cyrus.cache"
 #define FNAME_SQUAT "/cyrus.squat"
+#define FNAME_SQUAT_DELTA "/cyrus.squat.delta"
+#define FNAME_THREAD "/cyrus.thread"
+#define FNAME_BLOOM "/cyrus.bloom"
+#define FNAME_MODSEQ "/cyrus.modseq"
+#define FNAME_POPCACHE "/cyrus.pop"
+#define FNAME_OVERVIEW "/cyrus.over"
 #define FNAME_EXPUNGE "/cyrus.expunge"
 #ifdef WITH_DAV
 #define FNAME_DAV "/cyrus.dav"
@@ -92,12 +105,18 @@ enum meta_filename {
   META_INDEX,
   META_CACHE,
   META_SQUAT,
+  META_SQUAT_DELTA,
+  META_THREAD,
+  META_BLOOM,
+  META_MODSEQ,
   META_EXPUNGE,
   META_ANNOTATIONS,
 #ifdef WITH_DAV
   META_DAV,
 #endif
-  META_ARCHIVECACHE
+  META_ARCHIVECACHE,
+  META_POPCACHE,
+  META_OVERVIEW
 };
 
 #define MAILBOX_FNAME_LEN 256
@@ -108,7 +127,7 @@ enum meta_filename {
 #define LOCK_NONBLOCK   4   /* flag to OR in */
 #define LOCK_NONBLOCKING (LOCK_NONBLOCK|LOCK_EXCLUSIVE)
 
-#define NUM_CACHE_FIELDS 10
+#define NUM_CACHE_FIELDS 11
 
 struct cacheitem {
     unsigned offset;
@@ -119,6 +138,12 @@ struct cacherecord {
     const struct buf *buf;
     unsigned offset;
     unsigned len;
+    /* compressed records point 'buf' into the per-process cache of
+     * decoded records; these spot the entry being recycled (0: 'buf'
+     * doesn't come from that cache and is valid as long as the file
+     * mapping) */
+    unsigned decode_slot;
+    unsigned decode_seq;
     struct cacheitem item[NUM_CACHE_FIELDS];
 };
 
@@ -162,6 +187,15 @@ struct index_record {
     struct cacherecord crec;
 };
 
+/* subset of hot index_record fields, cheap to decode straight from
+ * the mapped index without the full record parse */
+struct index_basic {
+    uint32_t uid;
+    uint32_t system_flags;
+    time_t internaldate;
+    modseq_t modseq;
+};
+
 struct synccrcs {
     uint32_t basic;
     uint32_t annot;
@@ -244,6 +278,10 @@ struct mailbox {
 
     struct index_header i;
 
+    /* raw copy of the index header bytes as last parsed, so relocking
+     * an unchanged mailbox can skip the full header decode */
+    struct buf header_parsed;
+
     /* Information in header */
     char *uniqueid;
     char *quotaroot;
@@ -266,6 +304,8 @@ struct mailbox {
     /* change management */
     int silentchanges;
     int modseq_dirty;
+    modseq_t modseqlog_premodseq; /* highestmodseq before this transaction,
+                                   * for the modseq log gap check */
     int header_dirty;
     int quota_dirty;
     int has_changed;
@@ -452,8 +492,22 @@ enum {
     CACHE_TO,
     CACHE_CC,
     CACHE_BCC,
-    CACHE_SUBJECT
+    CACHE_SUBJECT,
+    CACHE_SORTKEYS      /* only present from cache version 8 up */
+};
+
+/* Fields within the CACHE_SORTKEYS item: a bit32 ref/fwd counter
+ * followed by this many xdrstrings, in this order.  All are already
+ * collation-normalized, so SORT just compares them */
+enum {
+    SORTKEY_SUBJECT = 0,
+    SORTKEY_FROM,
+    SORTKEY_TO,
+    SORTKEY_CC,
+    SORTKEY_DISPLAYFROM,
+    SORTKEY_DISPLAYTO
 };
+#define NUM_SORTKEY_FIELDS 6
 
 /* Cached envelope token positions */
 enum {
@@ -501,6 +555,10 @@ extern int mailbox_map_record(struct mailbox *mailbox, const struct index_record
 /* cache record API */
 int mailbox_cacherecord(struct mailbox *mailbox,
                         const struct index_record *record);
+void mailbox_cacherecord_range(struct mailbox *mailbox,
+                               uint32_t system_flags,
+                               size_t first_offset,
+                               size_t last_offset);
 char *mailbox_cache_get_env(struct mailbox *mailbox,
                             const struct index_record *record,
                             int field);
@@ -538,6 +596,10 @@ extern int mailbox_append_index_record(struct mailbox *mailbox,
                                        struct index_record *record);
 extern int mailbox_find_index_record(struct mailbox *mailbox, uint32_t uid,
                                      struct index_record *record);
+extern int mailbox_modseqlog_since(struct mailbox *mailbox, modseq_t since,
+                                   uint32_t **uidsp, unsigned *nuidsp);
+extern int mailbox_read_basic(struct mailbox *mailbox, uint32_t recno,
+                              struct index_basic *basic);
 
 extern int mailbox_set_acl(struct mailbox *mailbox, const char *acl,
                            int dirty_modseq);
@@ -567,6 +629,7 @@ extern int mailbox_index_islocked(struct mailbox *mailbox, int write);
 
 extern int mailbox_expunge_cleanup(struct mailbox *mailbox, time_t expunge_mark,
                                    unsigned *ndeleted);
+extern int mailbox_repack(struct mailbox *mailbox);
 extern int mailbox_expunge(struct mailbox *mailbox,
                            mailbox_decideproc_t *decideproc, void *deciderock,
                            unsigned *nexpunged, int event_type);
@@ -63,11 +63,13 @@
 #include "assert.h"
 #include "global.h"
 #include "cyrusdb.h"
+#include "cyr_lock.h"
 #include "util.h"
 #include "mailbox.h"
 #include "mboxevent.h"
 #include "exitcodes.h"
 #include "xmalloc.h"
+#include "xstats.h"
 #include "xstrlcpy.h"
 #include "partlist.h"
 #include "xstrlcat.h"
@@ -205,9 +207,8 @@ EXPORTED const char *mboxlist_mbtype_to_string(uint32_t mbtype)
     return buf_cstring(&buf);
 }
 
-static char *mboxlist_entry_cstring(const mbentry_t *mbentry)
+EXPORTED struct dlist *mboxlist_entry_dlist(const mbentry_t *mbentry)
 {
-    struct buf buf = BUF_INITIALIZER;
     struct dlist *dl = dlist_newkvlist(NULL, mbentry->name);
 
     if (mbentry->acl)
@@ -233,6 +234,14 @@ static char *mboxlist_entry_cstring(const mbentry_t *mbentry)
 
     dlist_setdate(dl, "M", time(NULL));
 
+    return dl;
+}
+
+static char *mboxlist_entry_cstring(const mbentry_t *mbentry)
+{
+    struct buf buf = BUF_INITIALIZER;
+    struct dlist *dl = mboxlist_entry_dlist(mbentry);
+
     dlist_printbuf(dl, 0, &buf);
 
     dlist_free(&dl);
@@ -257,6 +266,40 @@ EXPORTED char *mbentry_datapath(const struct mboxlist_entry *mbentry, uint32_t u
                              uid);
 }
 
+/*
+ * One-call resolution of an internal mailbox name to its filesystem
+ * path: mboxlist lookup plus partition mapping.  For a remote mailbox
+ * the result is "server!partition".  The returned pointer is to a
+ * static buffer which is overwritten by the next path lookup, so copy
+ * it if you need to keep it.
+ */
+EXPORTED int mboxlist_lookup_path(const char *intname, int metadata,
+                                  const char **pathp)
+{
+    static char remotebuf[MAX_MAILBOX_BUFFER];
+    mbentry_t *mbentry = NULL;
+    int r;
+
+    r = mboxlist_lookup(intname, &mbentry, NULL);
+    if (r) return r;
+
+    if (mbentry->mbtype & MBTYPE_REMOTE) {
+        snprintf(remotebuf, sizeof(remotebuf), "%s!%s",
+                 mbentry->server, mbentry->partition);
+        *pathp = remotebuf;
+    }
+    else if (metadata) {
+        *pathp = mbentry_metapath(mbentry, 0, 0);
+    }
+    else {
+        *pathp = mbentry_datapath(mbentry, 0);
+    }
+
+    mboxlist_entry_free(&mbentry);
+
+    return 0;
+}
+
 /*
  * read a single record from the mailboxes.db and return a pointer to it
  */
@@ -510,9 +553,12 @@ EXPORTED int mboxlist_lookup(const char *name, mbentry_t **entryptr,
                              struct txn **tid)
 {
     mbentry_t *entry = NULL;
+    struct xstats_timer timer;
     int r;
 
+    xstats_timer_start(&timer);
     r = mboxlist_mylookup(name, &entry, tid, 0);
+    xstats_timer_end(&timer, MBOXLIST_LOOKUP);
 
     if (r) return r;
 
@@ -703,6 +749,87 @@ static int mboxlist_update_racl(const char *name, const mbentry_t *oldmbentry, c
     return r;
 }
 
+/* Global generation counter for the mailboxes list, bumped on every
+ * change that could alter a LIST response: create, delete, rename,
+ * ACL changes and subscription changes.  Long-lived clients use it to
+ * cheaply discover that nothing a LIST could see has changed.  Only
+ * maintained when "list_response_cache" is enabled; mboxlist_generation()
+ * returns 0 when the counter is unavailable, which callers must treat
+ * as "assume changed". */
+
+static char *mboxlist_generation_fname(void)
+{
+    return strconcat(config_dir, FNAME_MBOXLISTGEN, (char *)NULL);
+}
+
+static void mboxlist_bumpgeneration(void)
+{
+    char *fname;
+    uint64_t gen = 0;
+    char data[8];
+    int fd;
+
+    if (!config_getswitch(IMAPOPT_LIST_RESPONSE_CACHE)) return;
+
+    fname = mboxlist_generation_fname();
+    fd = open(fname, O_RDWR|O_CREAT, 0666);
+    if (fd == -1) {
+        syslog(LOG_ERR, "IOERROR: creating %s: %m", fname);
+        free(fname);
+        return;
+    }
+
+    if (lock_blocking(fd, fname) == -1) {
+        syslog(LOG_ERR, "IOERROR: locking %s: %m", fname);
+    }
+    else {
+        if (pread(fd, data, 8, 0) == 8) {
+            memcpy(&gen, data, 8);
+            gen = ntohll(gen);
+        }
+        gen = htonll(gen + 1);
+        memcpy(data, &gen, 8);
+        if (pwrite(fd, data, 8, 0) != 8)
+            syslog(LOG_ERR, "IOERROR: writing %s: %m", fname);
+    }
+
+    close(fd);
+    free(fname);
+}
+
+EXPORTED uint64_t mboxlist_generation(void)
+{
+    char *fname;
+    uint64_t gen = 0;
+    char data[8];
+    int seeded = 0;
+    int fd;
+
+    if (!config_getswitch(IMAPOPT_LIST_RESPONSE_CACHE)) return 0;
+
+    fname = mboxlist_generation_fname();
+
+ retry:
+    fd = open(fname, O_RDONLY, 0);
+    if (fd != -1) {
+        if (lock_shared(fd, fname) != -1 && pread(fd, data, 8, 0) == 8) {
+            memcpy(&gen, data, 8);
+            gen = ntohll(gen);
+        }
+        close(fd);
+    }
+
+    if (!gen && !seeded) {
+        /* first use on this server - seed the counter */
+        seeded = 1;
+        mboxlist_bumpgeneration();
+        goto retry;
+    }
+
+    free(fname);
+    return gen;
+}
+
 static int mboxlist_update_entry(const char *name, const mbentry_t *mbentry, struct txn **txn)
 {
     int r = 0;
@@ -722,6 +849,12 @@ static int mboxlist_update_entry(const char *name, const mbentry_t *mbentry, str
     else {
         r = cyrusdb_delete(mbdb, name, strlen(name), txn, /*force*/1);
     }
+
+    /* every mboxlist write funnels through here, so this catches
+     * create, delete, rename and ACL changes alike.  Bumping for a
+     * transaction that later aborts merely costs a cache miss */
+    if (!r) mboxlist_bumpgeneration();
+
     return r;
 }
 
@@ -1035,7 +1168,7 @@ static int mboxlist_createmailbox_full(const char *mboxname, int mbtype,
                                 modseq_t highestmodseq,
                                 const char *copyacl, const char *uniqueid,
                                 int localonly, int forceuser, int dbonly,
-                                struct mailbox **mboxptr)
+                                struct txn **tid, struct mailbox **mboxptr)
 {
     int r;
     char *newpartition = NULL;
@@ -1078,7 +1211,7 @@ static int mboxlist_createmailbox_full(const char *mboxname, int mbtype,
         newmbentry->uidvalidity = newmailbox->i.uidvalidity;
         newmbentry->foldermodseq = newmailbox->i.highestmodseq;
     }
-    r = mboxlist_update_entry(mboxname, newmbentry, NULL);
+    r = mboxlist_update_entry(mboxname, newmbentry, tid);
 
     if (r) {
         syslog(LOG_ERR, "DBERROR: failed to insert to mailboxes list %s: %s",
@@ -1097,7 +1230,7 @@ static int mboxlist_createmailbox_full(const char *mboxname, int mbtype,
         if (r) {
             syslog(LOG_ERR, "MUPDATE: can't commit mailbox entry for '%s'",
                    mboxname);
-            mboxlist_update_entry(mboxname, NULL, 0);
+            mboxlist_update_entry(mboxname, NULL, tid);
         }
         if (mupdate_h) mupdate_disconnect(&mupdate_h);
         free(loc);
@@ -1117,12 +1250,13 @@ done:
     return r;
 }
 
-EXPORTED int mboxlist_createmailbox(const char *name, int mbtype,
+EXPORTED int mboxlist_createmailbox_txn(const char *name, int mbtype,
                            const char *partition,
                            int isadmin, const char *userid,
                            const struct auth_state *auth_state,
                            int localonly, int forceuser, int dbonly,
-                           int notify, struct mailbox **mailboxptr)
+                           int notify, struct txn **tid,
+                           struct mailbox **mailboxptr)
 {
     int options = config_getint(IMAPOPT_MAILBOX_DEFAULT_OPTIONS)
                   | OPT_POP3_NEW_UIDL;
@@ -1143,7 +1277,7 @@ EXPORTED int mboxlist_createmailbox(const char *name, int mbtype,
     r = mboxlist_createmailbox_full(name, mbtype, partition,
                                     isadmin, userid, auth_state,
                                     options, uidvalidity, 0, NULL, NULL, localonly,
-                                    forceuser, dbonly, &mailbox);
+                                    forceuser, dbonly, tid, &mailbox);
 
     if (notify && !r) {
         /* send a MailboxCreate event notification */
@@ -1161,6 +1295,19 @@ EXPORTED int mboxlist_createmailbox(const char *name, int mbtype,
     return r;
 }
 
+EXPORTED int mboxlist_createmailbox(const char *name, int mbtype,
+                           const char *partition,
+                           int isadmin, const char *userid,
+                           const struct auth_state *auth_state,
+                           int localonly, int forceuser, int dbonly,
+                           int notify, struct mailbox **mailboxptr)
+{
+    return mboxlist_createmailbox_txn(name, mbtype, partition,
+                                      isadmin, userid, auth_state,
+                                      localonly, forceuser, dbonly,
+                                      notify, NULL, mailboxptr);
+}
+
 EXPORTED int mboxlist_createsync(const char *name, int mbtype,
                         const char *partition,
                         const char *userid, const struct auth_state *auth_state,
@@ -1173,7 +1320,7 @@ EXPORTED int mboxlist_createsync(const char *name, int mbtype,
                                        1, userid, auth_state,
                                        options, uidvalidity,
                                        highestmodseq, acl, uniqueid,
-                                       local_only, 1, 0, mboxptr);
+                                       local_only, 1, 0, NULL, mboxptr);
 }
 
 /* insert an entry for the proxy */
@@ -2747,20 +2894,24 @@ static int mboxlist_do_find(struct find_rock *rock, const strarray_t *patterns)
         userid = 0;
     }
 
-    /* Find the common search prefix of all patterns */
+    /* Find the common search prefix of all patterns.  The literal prefix
+     * of each compiled glob is the bytes any of its matches must start
+     * with, so the head those prefixes share bounds every match */
+    size_t firstlen;
     const char *firstpat = strarray_nth(patterns, 0);
-    for (prefixlen = 0; firstpat[prefixlen]; prefixlen++) {
+    const char *firstprefix = glob_prefix(ptrarray_nth(&rock->globs, 0), &firstlen);
+    for (prefixlen = 0; prefixlen < firstlen; prefixlen++) {
         if (prefixlen >= MAX_MAILBOX_NAME) {
             r = IMAP_MAILBOX_BADNAME;
             goto done;
         }
-        char c = firstpat[prefixlen];
+        char c = firstprefix[prefixlen];
         for (i = 1; i < patterns->count; i++) {
-            const char *pat = strarray_nth(patterns, i);
-            if (pat[prefixlen] != c) break;
+            size_t thislen;
+            const char *thisprefix = glob_prefix(ptrarray_nth(&rock->globs, i), &thislen);
+            if (prefixlen >= thislen || thisprefix[prefixlen] != c) break;
         }
         if (i < patterns->count) break;
-        if (c == '*' || c == '%' || c == '?') break;
         commonpat[prefixlen] = c;
     }
     commonpat[prefixlen] = '\0';
@@ -2877,8 +3028,21 @@ static int mboxlist_do_find(struct find_rock *rock, const strarray_t *patterns)
             r = (*rock->proc)(NULL, rock->procrock);
             if (r) goto done;
 
+            /* with the standard namespace the internal and external names
+             * of shared folders agree, so the literal prefix common to all
+             * the patterns also bounds the range of keys worth scanning.
+             * As above, crossdomains or admin defeats prefixing */
+            len = domainlen;
+            if (!isadmin && !crossdomains &&
+                !rock->namespace->isalt && rock->namespace->hier_sep == '.' &&
+                domainlen + prefixlen < sizeof(domainpat)) {
+                memcpy(domainpat + domainlen, commonpat, prefixlen);
+                domainpat[domainlen + prefixlen] = '\0';
+                len = domainlen + prefixlen;
+            }
+
             /* iterate through all the non-user folders on the server */
-            r = mboxlist_find_category(rock, domainpat, domainlen);
+            r = mboxlist_find_category(rock, domainpat, len);
             if (r) goto done;
         }
     }
@@ -3604,6 +3768,9 @@ EXPORTED int mboxlist_changesub(const char *name, const char *userid,
         break;
     }
 
+    /* subscriptions show up in LSUB and LIST (SUBSCRIBED) */
+    if (!r) mboxlist_bumpgeneration();
+
     sync_log_subscribe(userid, name);
     mboxlist_closesubs(subs);
     mboxlist_entry_free(&mbentry);
@@ -75,6 +75,9 @@
 /* master name of the mailboxes file */
 #define FNAME_MBOXLIST "/mailboxes.db"
 
+/* generation counter tracking changes to the mailboxes list */
+#define FNAME_MBOXLISTGEN "/mailboxes.generation"
+
 #define HOSTNAME_SIZE 512
 
 /* each mailbox has the following data */
@@ -101,10 +104,19 @@ mbentry_t *mboxlist_entry_create();
 char *mbentry_metapath(const struct mboxlist_entry *mbentry, int metatype, int isnew);
 char *mbentry_datapath(const struct mboxlist_entry *mbentry, uint32_t);
 
+/* lookup plus partition mapping in one call; *pathp is a static buffer */
+int mboxlist_lookup_path(const char *intname, int metadata,
+                         const char **pathp);
+
 int mboxlist_parse_entry(mbentry_t **mbentryptr,
                          const char *name, size_t namelen,
                          const char *data, size_t datalen);
 
+/* the database value for 'mbentry' as a dlist, named after the mailbox;
+ * rendering it with printkeys=0 gives exactly the stored form that
+ * mboxlist_parse_entry() reads back */
+struct dlist *mboxlist_entry_dlist(const mbentry_t *mbentry);
+
 mbentry_t *mboxlist_entry_copy(const mbentry_t *src);
 
 void mboxlist_entry_free(mbentry_t **mbentryptr);
@@ -112,6 +124,9 @@ void mboxlist_entry_free(mbentry_t **mbentryptr);
 const char *mboxlist_mbtype_to_string(uint32_t mbtype);
 uint32_t mboxlist_string_to_mbtype(const char *string);
 
+/* current mailboxes-list generation, or 0 if unavailable */
+uint64_t mboxlist_generation(void);
+
 int mboxlist_delete(const char *name);
 /* Lookup 'name' in the mailbox list. */
 int mboxlist_lookup(const char *name, mbentry_t **mbentryptr,
@@ -153,6 +168,19 @@ int mboxlist_createmailbox(const char *name, int mbtype,
                            int localonly, int forceuser, int dbonly,
                            int notify, struct mailbox **mailboxptr);
 
+/* create mailbox as part of a caller-held mailboxes.db transaction.
+ * Batch provisioning uses this to create a user's whole folder template
+ * under a single transaction; the caller must finish with
+ * mboxlist_commit() or mboxlist_abort().  Filesystem operations still
+ * happen per-mailbox - only the mailboxes list writes are deferred */
+int mboxlist_createmailbox_txn(const char *name, int mbtype,
+                           const char *partition,
+                           int isadmin, const char *userid,
+                           const struct auth_state *auth_state,
+                           int localonly, int forceuser, int dbonly,
+                           int notify, struct txn **tid,
+                           struct mailbox **mailboxptr);
+
 /* create mailbox from sync */
 int mboxlist_createsync(const char *name, int mbtype, const char *partition,
                         const char *userid, const struct auth_state *auth_state,
@@ -56,6 +56,7 @@
 #include "exitcodes.h"
 #include "glob.h"
 #include "global.h"
+#include "hash.h"
 #include "mailbox.h"
 #include "map.h"
 #include "retry.h"
@@ -756,12 +757,56 @@ EXPORTED void mbname_free(mbname_t **mbnamep)
     free(mbname);
 }
 
-EXPORTED char *mboxname_to_userid(const char *intname)
+/* ---- interned mbnames ----
+ * the same few internal names get parsed over and over - every ACL
+ * check, log line and conversations open does a mbname_from_intname /
+ * mbname_free round trip.  Keep the parsed objects in a per-process
+ * table instead and hand out borrowed read-only pointers.  When the
+ * table fills it is dumped wholesale - everything in it can be
+ * re-parsed, so the only cost is going cold again */
+
+#define MBNAME_INTERN_MAX 4096
+
+static hash_table interned_mbnames;
+static unsigned num_interned = 0;
+
+static void _intern_free(void *data)
 {
-    mbname_t *mbname = mbname_from_intname(intname);
-    char *res = xstrdupnull(mbname_userid(mbname));
+    mbname_t *mbname = (mbname_t *)data;
     mbname_free(&mbname);
-    return res;
+}
+
+EXPORTED const mbname_t *mbname_intern(const char *intname)
+{
+    mbname_t *mbname;
+
+    if (!intname) intname = "";
+
+    if (!interned_mbnames.size)
+        construct_hash_table(&interned_mbnames, MBNAME_INTERN_MAX, 0);
+
+    mbname = (mbname_t *)hash_lookup(intname, &interned_mbnames);
+    if (mbname) return mbname;
+
+    if (num_interned >= MBNAME_INTERN_MAX) {
+        free_hash_table(&interned_mbnames, _intern_free);
+        construct_hash_table(&interned_mbnames, MBNAME_INTERN_MAX, 0);
+        num_interned = 0;
+    }
+
+    mbname = mbname_from_intname(intname);
+    /* precompute the derived value every hot path wants */
+    mbname_userid(mbname);
+
+    hash_insert(intname, mbname, &interned_mbnames);
+    num_interned++;
+
+    return mbname;
+}
+
+EXPORTED char *mboxname_to_userid(const char *intname)
+{
+    return xstrdupnull(mbname_userid(mbname_intern(intname)));
 }
 
 EXPORTED char *mboxname_from_external(const char *extname, const struct namespace *ns, const char *userid)
@@ -1276,11 +1321,9 @@ EXPORTED struct namespace *mboxname_get_adminnamespace()
  */
 EXPORTED int mboxname_userownsmailbox(const char *userid, const char *name)
 {
-    mbname_t *mbname = mbname_from_intname(name);
-    int res = !strcmpsafe(mbname_userid(mbname), userid);
-    mbname_free(&mbname);
+    const mbname_t *mbname = mbname_intern(name);
 
-    return res;
+    return !strcmpsafe(mbname_userid(mbname), userid);
 }
 
 /*
@@ -1289,7 +1332,7 @@ EXPORTED int mboxname_userownsmailbox(const char *userid, const char *name)
  */
 EXPORTED int mboxname_isusermailbox(const char *name, int isinbox)
 {
-    mbname_t *mbname = mbname_from_intname(name);
+    const mbname_t *mbname = mbname_intern(name);
     int res = 0;
 
     if (mbname_localpart(mbname) && !mbname_isdeleted(mbname)) {
@@ -1297,7 +1340,6 @@ EXPORTED int mboxname_isusermailbox(const char *name, int isinbox)
             res = 1;
     }
 
-    mbname_free(&mbname);
     return res;
 }
 
@@ -1307,9 +1349,8 @@ EXPORTED int mboxname_isusermailbox(const char *name, int isinbox)
  */
 EXPORTED int mboxname_isdeletedmailbox(const char *name, time_t *timestampp)
 {
-    mbname_t *mbname = mbname_from_intname(name);
+    const mbname_t *mbname = mbname_intern(name);
     time_t res = mbname_isdeleted(mbname);
-    mbname_free(&mbname);
 
     if (timestampp)
         *timestampp = res;
@@ -1861,6 +1902,37 @@ EXPORTED char *mboxname_metapath(const char *partition,
         metaflag = IMAP_ENUM_METAPARTITION_FILES_SQUAT;
         filename = FNAME_SQUAT;
         break;
+    case META_SQUAT_DELTA:
+        /* lives wherever the main squat index lives */
+        snprintf(confkey, 256, "metadir-squat-%s", partition);
+        metaflag = IMAP_ENUM_METAPARTITION_FILES_SQUAT;
+        filename = FNAME_SQUAT_DELTA;
+        break;
+    case META_THREAD:
+        snprintf(confkey, 256, "metadir-thread-%s", partition);
+        metaflag = IMAP_ENUM_METAPARTITION_FILES_THREAD;
+        filename = FNAME_THREAD;
+        break;
+    case META_BLOOM:
+        snprintf(confkey, 256, "metadir-bloom-%s", partition);
+        metaflag = IMAP_ENUM_METAPARTITION_FILES_BLOOM;
+        filename = FNAME_BLOOM;
+        break;
+    case META_MODSEQ:
+        snprintf(confkey, 256, "metadir-modseq-%s", partition);
+        metaflag = IMAP_ENUM_METAPARTITION_FILES_MODSEQ;
+        filename = FNAME_MODSEQ;
+        break;
+    case META_POPCACHE:
+        snprintf(confkey, 256, "metadir-pop-%s", partition);
+        metaflag = IMAP_ENUM_METAPARTITION_FILES_POP;
+        filename = FNAME_POPCACHE;
+        break;
+    case META_OVERVIEW:
+        snprintf(confkey, 256, "metadir-over-%s", partition);
+        metaflag = IMAP_ENUM_METAPARTITION_FILES_OVERVIEW;
+        filename = FNAME_OVERVIEW;
+        break;
     case META_ANNOTATIONS:
         snprintf(confkey, 256, "metadir-index-%s", partition);
         metaflag = IMAP_ENUM_METAPARTITION_FILES_ANNOTATIONS;
@@ -108,6 +108,13 @@ mbname_t *mbname_from_extsub(const char *extsub, const struct namespace *ns, con
 mbname_t *mbname_from_recipient(const char *recip, const struct namespace *ns);
 mbname_t *mbname_dup(const mbname_t *mbname);
 
+/* a parsed, shared, READ-ONLY mbname for an internal name.  The object
+ * is owned by a per-process table and must not be modified or freed;
+ * repeated lookups of the same name return the same object without
+ * re-parsing.  The table is occasionally flushed, so don't hold the
+ * pointer across further intern calls - copy anything you need */
+const mbname_t *mbname_intern(const char *intname);
+
 void mbname_downcaseuser(mbname_t *mbname);
 void mbname_set_localpart(mbname_t *mbname, const char *localpart);
 void mbname_set_domain(mbname_t *mbname, const char *domain);
@@ -68,20 +68,48 @@ extern char *optarg;
 /* current namespace */
 static struct namespace mbpath_namespace;
 
+static int quiet = 0;
+static int stop_on_error = 0;
+static int metadata = 0;
+
 static int
 usage(void) {
-  fprintf(stderr,"usage: mbpath [-C <alt_config>] [-q] [-s] [-m] <mailbox name>...\n");
+  fprintf(stderr,"usage: mbpath [-C <alt_config>] [-q] [-s] [-m] [-b | <mailbox name>...]\n");
   fprintf(stderr,"\t-q\tquietly drop any error messages\n");
   fprintf(stderr,"\t-s\tstop on error\n");
   fprintf(stderr,"\t-m\toutput the path to the metadata files (if different from the message files)\n");
+  fprintf(stderr,"\t-b\tbatch mode: read newline-separated mailbox names from stdin\n");
   exit(-1);
 }
 
+static void do_paths(const char *extname)
+{
+  const char *path;
+  int rc;
+
+  /* Translate mailboxname */
+  char *intname = mboxname_from_external(extname, &mbpath_namespace, NULL);
+  if ((rc = mboxlist_lookup_path(intname, metadata, &path)) == 0) {
+    printf("%s\n", path);
+  } else {
+    if (!quiet && (rc == IMAP_MAILBOX_NONEXISTENT)) {
+      fprintf(stderr, "Invalid mailbox name: %s\n", extname);
+    }
+    if (stop_on_error) {
+      if (quiet) {
+        fatal("", -1);
+      } else {
+        fatal("Error in processing mailbox. Stopping\n", -1);
+      }
+    }
+  }
+  free(intname);
+}
+
 int
 main(int argc, char **argv)
 {
-  mbentry_t *mbentry = NULL;
-  int rc, i, quiet = 0, stop_on_error=0, metadata=0;
+  int rc, i, batch = 0;
   int opt;              /* getopt() returns an int */
   char *alt_config = NULL;
 
@@ -89,11 +117,14 @@ main(int argc, char **argv)
       fatal("must run as the Cyrus user", EC_USAGE);
   }
 
-  while ((opt = getopt(argc, argv, "C:qsm")) != EOF) {
+  while ((opt = getopt(argc, argv, "C:bqsm")) != EOF) {
     switch(opt) {
     case 'C': /* alt config file */
       alt_config = optarg;
       break;
+    case 'b':
+      batch = 1;
+      break;
     case 'q':
       quiet = 1;
       break;
@@ -118,34 +149,20 @@ main(int argc, char **argv)
   mboxlist_init(0);
   mboxlist_open(NULL);
 
-  for (i = optind; i < argc; i++) {
-    /* Translate mailboxname */
-    char *intname = mboxname_from_external(argv[i], &mbpath_namespace, NULL);
-    if ((rc = mboxlist_lookup(intname, &mbentry, NULL)) == 0) {
-      if (mbentry->mbtype & MBTYPE_REMOTE) {
-        printf("%s!%s\n", mbentry->server, mbentry->partition);
-      } else if (metadata) {
-        const char *path = mbentry_metapath(mbentry, 0, 0);
-        printf("%s\n", path);
-      }
-      else {
-        const char *path = mbentry_datapath(mbentry, 0);
-        printf("%s\n", path);
-      }
-      mboxlist_entry_free(&mbentry);
-    } else {
-      if (!quiet && (rc == IMAP_MAILBOX_NONEXISTENT)) {
-        fprintf(stderr, "Invalid mailbox name: %s\n", argv[i]);
-      }
-      if (stop_on_error) {
-        if (quiet) {
-          fatal("", -1);
-        } else {
-          fatal("Error in processing mailbox. Stopping\n", -1);
-        }
-      }
+  if (batch) {
+    char buf[MAX_MAILBOX_BUFFER];
+
+    while (fgets(buf, sizeof(buf), stdin)) {
+      buf[strcspn(buf, "\r\n")] = '\0';
+      if (!buf[0]) continue;
+      do_paths(buf);
+      /* keep driving scripts fed when stdout is a pipe */
+      fflush(stdout);
     }
-    free(intname);
+  }
+
+  for (i = optind; i < argc; i++) {
+    do_paths(argv[i]);
   }
 
   mboxlist_close();
@@ -65,6 +65,7 @@
 #include "hash.h"
 #include "map.h"
 #include "mailbox.h"
+#include "mpool.h"
 #include "message.h"
 #include "message_priv.h"
 #include "message_guid.h"
@@ -146,11 +147,68 @@ static void message_write_section(struct buf *buf, const struct body *body);
 static void message_write_charset(struct buf *buf, const struct body *body);
 static void message_write_searchaddr(struct buf *buf,
                                      const struct address *addrlist);
+static void message_write_sortkeys(struct buf *buf, struct buf *ib);
 static int message_need(const message_t *m, unsigned int need);
 static void message_yield(message_t *m, unsigned int yield);
 
 static void param_free(struct param **paramp);
 
+/*
+ * The body-part parser makes thousands of small allocations per
+ * message - type tokens, parameters, header strings - and they all
+ * die together when the tree is released.  To avoid hammering the
+ * heap (and the allocator locks in lmtpd), each parse carves them out
+ * of an mpool which is stashed in the root's 'pool' member and freed
+ * by message_free_body() in one go.  The pool is file-scope because
+ * the parser is not reentrant; whenever it is NULL (trees rebuilt
+ * from the cache, and outside callers of message_parse_string()) the
+ * helpers below fall back to the heap and the tree is freed field by
+ * field as before.
+ */
+static struct mpool *parse_pool = NULL;
+
+static void *parse_malloc(size_t size)
+{
+    return parse_pool ? mpool_malloc(parse_pool, size) : xmalloc(size);
+}
+
+static void *parse_zmalloc(size_t size)
+{
+    void *p = parse_malloc(size);
+
+    memset(p, 0, size);
+    return p;
+}
+
+static char *parse_strdup(const char *str)
+{
+    return parse_pool ? mpool_strdup(parse_pool, str) : xstrdup(str);
+}
+
+static char *parse_strndup(const char *str, size_t n)
+{
+    return parse_pool ? mpool_strndup(parse_pool, str, n) : xstrndup(str, n);
+}
+
+/* Grow a parsed string to 'size' bytes.  Pools can't realloc, so a
+ * fresh chunk is taken and the old one sits in the pool until the
+ * whole tree is released. */
+static char *parse_strgrow(char *str, size_t size)
+{
+    char *p;
+
+    if (!parse_pool) return xrealloc(str, size);
+    p = mpool_malloc(parse_pool, size);
+    strlcpy(p, str, size);
+    return p;
+}
+
+/* Free a parsed allocation; a no-op while the pool owns the memory */
+static void parse_free(void *ptr)
+{
+    if (!parse_pool) free(ptr);
+}
+
 /*
  * Convert a string to uppercase.  Returns the string.
  *
@@ -178,6 +236,18 @@ static char *message_ucase(char *s)
  */
 EXPORTED int message_copy_strict(struct protstream *from, FILE *to,
                                  unsigned size, int allow_null)
+{
+    return message_copy_strict_retain(from, to, size, allow_null, NULL);
+}
+
+/*
+ * As message_copy_strict(), but if 'retain' is non-NULL also append
+ * the message bytes to it as they stream past, so the caller can parse
+ * the message from memory without re-reading the spool file.
+ */
+EXPORTED int message_copy_strict_retain(struct protstream *from, FILE *to,
+                                        unsigned size, int allow_null,
+                                        struct buf *retain)
 {
     char buf[4096+1];
     unsigned char *p, *endp;
@@ -188,6 +258,10 @@ EXPORTED int message_copy_strict(struct protstream *from, FILE *to,
     int munge8bit = config_getswitch(IMAPOPT_MUNGE8BIT);
     int inheader = 1, blankline = 1;
 
+    /* we know how much is coming - let the prot layer drain the
+     * socket in large reads instead of 4K ones */
+    prot_setreadahead(from, size);
+
     while (size) {
         n = prot_read(from, buf, size > 4096 ? 4096 : size);
         if (!n) {
@@ -240,6 +314,7 @@ EXPORTED int message_copy_strict(struct protstream *from, FILE *to,
         }
 
         fwrite(buf, 1, n, to);
+        if (retain) buf_appendmap(retain, buf, n);
     }
 
     if (r) return r;
@@ -382,8 +457,12 @@ EXPORTED int message_parse_binary_file(FILE *infile, struct body **body)
     }
 
     if (!*body) *body = (struct body *) xzmalloc(sizeof(struct body));
+
+    parse_pool = new_mpool(0);
     message_parse_body(&msg, *body,
                        DEFAULT_CONTENT_TYPE, (strarray_t *)0);
+    (*body)->pool = parse_pool;
+    parse_pool = NULL;
 
     (*body)->filesize = msg.len;
 
@@ -415,8 +494,11 @@ EXPORTED int message_parse_mapped(const char *msg_base, unsigned long msg_len,
     msg.offset = 0;
     msg.encode = 0;
 
+    parse_pool = new_mpool(0);
     message_parse_body(&msg, body,
                        DEFAULT_CONTENT_TYPE, (strarray_t *)0);
+    body->pool = parse_pool;
+    parse_pool = NULL;
 
     body->filesize = msg_len;
 
@@ -768,116 +850,115 @@ static int message_parse_headers(struct msg *msg, struct body *body,
     body->content_offset = msg->offset;
     body->header_size = strlen(headers.s+1);
 
-    /* Scan over the slurped-up headers for interesting header information */
+    /* Scan over the slurped-up headers for interesting header information,
+     * hopping from newline to newline instead of walking every byte */
     body->header_lines = -1;    /* Correct for leading newline */
-    for (next = headers.s; *next; next++) {
-        if (*next == '\n') {
-            body->header_lines++;
-
-            /* if we're skipping, skip now */
-            if (have_max) continue;
-
-            /* check if we've hit a limit and flag it */
-            if (maxlines && body->header_lines > maxlines) {
-                syslog(LOG_ERR, "ERROR: message has more than %d header lines, not caching any more",
-                       maxlines);
-                have_max = 1;
-                continue;
-            }
+    for (next = headers.s; (next = strchr(next, '\n')); next++) {
+        body->header_lines++;
 
-            if (/* space preallocated, i.e. must be top-level body */
-                body->cacheheaders.s &&
-                /* this is not a continuation line */
-                (next[1] != ' ') && (next[1] != '\t') &&
-                /* this header is supposed to be cached */
-                mailbox_cached_header_inline(next+1) != BIT32_MAX) {
-                    /* append to the headers cache */
-                    message_parse_header(next+1, &body->cacheheaders);
-            }
+        /* if we're skipping, skip now */
+        if (have_max) continue;
 
-            switch (message_header_lookup(next+1, &value)) {
-            case RFC822_BCC:
-                message_parse_address(value, &body->bcc);
-                break;
-            case RFC822_CC:
-                message_parse_address(value, &body->cc);
-                break;
-            case RFC822_CONTENT_DESCRIPTION:
-                message_parse_string(value, &body->description);
-                break;
-            case RFC822_CONTENT_DISPOSITION:
-                message_parse_disposition(value, body);
-                break;
-            case RFC822_CONTENT_ID:
-                message_parse_string(value, &body->id);
-                break;
-            case RFC822_CONTENT_LANGUAGE:
-                message_parse_language(value, &body->language);
-                break;
-            case RFC822_CONTENT_LOCATION:
-                message_parse_string(value, &body->location);
-                break;
-            case RFC822_CONTENT_MD5:
-                message_parse_string(value, &body->md5);
-                break;
-            case RFC822_CONTENT_TRANSFER_ENCODING:
-                message_parse_encoding(value, &body->encoding);
-
-                /* If we're encoding binary, replace "binary"
-                   with "base64" in CTE header body */
-                if (msg->encode &&
-                    !strcmpsafe(body->encoding, "BINARY")) {
-                    char *p = (char*)
-                        stristr(msg->base + body->header_offset +
-                                (next - headers.s) + 27,
-                                "binary");
-                    memcpy(p, "base64", 6);
-                }
-                break;
-            case RFC822_CONTENT_TYPE:
-                message_parse_type(value, body);
-                break;
-            case RFC822_DATE:
-                message_parse_string(value, &body->date);
-                break;
-            case RFC822_FROM:
-                message_parse_address(value, &body->from);
-                break;
-            case RFC822_IN_REPLY_TO:
-                message_parse_string(value, &body->in_reply_to);
-                break;
-            case RFC822_MESSAGE_ID:
-                message_parse_string(value, &body->message_id);
-                break;
-            case RFC822_REPLY_TO:
-                message_parse_address(value, &body->reply_to);
-                break;
-            case RFC822_RECEIVED:
-                message_parse_received_date(value, &body->received_date);
-                break;
-            case RFC822_REFERENCES:
-                message_parse_string(value, &body->references);
-                break;
-            case RFC822_SUBJECT:
-                message_parse_string(value, &body->subject);
-                break;
-            case RFC822_SENDER:
-                message_parse_address(value, &body->sender);
-                break;
-            case RFC822_TO:
-                message_parse_address(value, &body->to);
-                break;
-            case RFC822_X_DELIVEREDINTERNALDATE:
-                /* Explicit x-deliveredinternaldate overrides received: headers */
-                message_parse_string(value, &body->received_date);
-                break;
-            case RFC822_X_ME_MESSAGE_ID:
-                message_parse_string(value, &body->x_me_message_id);
-                break;
-            default:
-                break;
-            } /* switch() */
-        } /* if (*next == '\n') */
+        /* check if we've hit a limit and flag it */
+        if (maxlines && body->header_lines > maxlines) {
+            syslog(LOG_ERR, "ERROR: message has more than %d header lines, not caching any more",
+                   maxlines);
+            have_max = 1;
+            continue;
+        }
+
+        if (/* space preallocated, i.e. must be top-level body */
+            body->cacheheaders.s &&
+            /* this is not a continuation line */
+            (next[1] != ' ') && (next[1] != '\t') &&
+            /* this header is supposed to be cached */
+            mailbox_cached_header_inline(next+1) != BIT32_MAX) {
+                /* append to the headers cache */
+                message_parse_header(next+1, &body->cacheheaders);
+        }
+
+        switch (message_header_lookup(next+1, &value)) {
+        case RFC822_BCC:
+            message_parse_address(value, &body->bcc);
+            break;
+        case RFC822_CC:
+            message_parse_address(value, &body->cc);
+            break;
+        case RFC822_CONTENT_DESCRIPTION:
+            message_parse_string(value, &body->description);
+            break;
+        case RFC822_CONTENT_DISPOSITION:
+            message_parse_disposition(value, body);
+            break;
+        case RFC822_CONTENT_ID:
+            message_parse_string(value, &body->id);
+            break;
+        case RFC822_CONTENT_LANGUAGE:
+            message_parse_language(value, &body->language);
+            break;
+        case RFC822_CONTENT_LOCATION:
+            message_parse_string(value, &body->location);
+            break;
+        case RFC822_CONTENT_MD5:
+            message_parse_string(value, &body->md5);
+            break;
+        case RFC822_CONTENT_TRANSFER_ENCODING:
+            message_parse_encoding(value, &body->encoding);
+
+            /* If we're encoding binary, replace "binary"
+               with "base64" in CTE header body */
+            if (msg->encode &&
+                !strcmpsafe(body->encoding, "BINARY")) {
+                char *p = (char*)
+                    stristr(msg->base + body->header_offset +
+                            (next - headers.s) + 27,
+                            "binary");
+                memcpy(p, "base64", 6);
+            }
+            break;
+        case RFC822_CONTENT_TYPE:
+            message_parse_type(value, body);
+            break;
+        case RFC822_DATE:
+            message_parse_string(value, &body->date);
+            break;
+        case RFC822_FROM:
+            message_parse_address(value, &body->from);
+            break;
+        case RFC822_IN_REPLY_TO:
+            message_parse_string(value, &body->in_reply_to);
+            break;
+        case RFC822_MESSAGE_ID:
+            message_parse_string(value, &body->message_id);
+            break;
+        case RFC822_REPLY_TO:
+            message_parse_address(value, &body->reply_to);
+            break;
+        case RFC822_RECEIVED:
+            message_parse_received_date(value, &body->received_date);
+            break;
+        case RFC822_REFERENCES:
+            message_parse_string(value, &body->references);
+            break;
+        case RFC822_SUBJECT:
+            message_parse_string(value, &body->subject);
+            break;
+        case RFC822_SENDER:
+            message_parse_address(value, &body->sender);
+            break;
+        case RFC822_TO:
+            message_parse_address(value, &body->to);
+            break;
+        case RFC822_X_DELIVEREDINTERNALDATE:
+            /* Explicit x-deliveredinternaldate overrides received: headers */
+            message_parse_string(value, &body->received_date);
+            break;
+        case RFC822_X_ME_MESSAGE_ID:
+            message_parse_string(value, &body->x_me_message_id);
+            break;
+        default:
+            break;
+        } /* switch() */
     }
 
     /* If didn't find Content-Type: header, use the passed-in default type */
@@ -893,7 +974,7 @@ static int message_parse_headers(struct msg *msg, struct body *body,
  */
 static void message_parse_address(const char *hdr, struct address **addrp)
 {
-    char *hdrend, hdrendchar = '\0';
+    const char *hdrend;
 
     /* If we saw this header already, discard the earlier value */
     if (*addrp) {
@@ -902,23 +983,13 @@ static void message_parse_address(const char *hdr, struct address **addrp)
     }
 
     /* Find end of header */
-    hdrend = (char *)hdr;
+    hdrend = hdr;
     do {
         hdrend = strchr(hdrend+1, '\n');
     } while (hdrend && (hdrend[1] == ' ' || hdrend[1] == '\t'));
+    if (hdrend && hdrend > hdr && hdrend[-1] == '\r') hdrend--;
 
-    /* Put a NUL character at the end of header */
-    /* gnb:TODO this is evil and should be stopped */
-    if (hdrend) {
-        if (hdrend > hdr && hdrend[-1] == '\r') hdrend--;
-        hdrendchar = *hdrend;
-        *hdrend = '\0';
-    }
-
-    parseaddr_list(hdr, addrp);
-
-    /* Put character at end of header back */
-    if (hdrend) *hdrend = hdrendchar;
+    parseaddr_list_n(hdr, hdrend ? (size_t)(hdrend - hdr) : strlen(hdr), addrp);
 }
 
 /*
@@ -931,7 +1002,7 @@ static void message_parse_encoding(const char *hdr, char **hdrp)
 
     /* If we saw this header already, discard the earlier value */
     if (*hdrp) {
-        free(*hdrp);
+        parse_free(*hdrp);
         *hdrp = NULL;
     }
 
@@ -950,7 +1021,7 @@ static void message_parse_encoding(const char *hdr, char **hdrp)
     if (p) return;
 
     /* Save encoding token */
-    *hdrp = message_ucase(xstrndup(hdr, len));
+    *hdrp = message_ucase(parse_strndup(hdr, len));
 }
 
 /*
@@ -1036,7 +1107,7 @@ EXPORTED void message_parse_string(const char *hdr, char **hdrp)
 
     /* If we saw this header already, discard the earlier value */
     if (*hdrp) {
-        free(*hdrp);
+        parse_free(*hdrp);
         *hdrp = NULL;
     }
 
@@ -1056,7 +1127,7 @@ EXPORTED void message_parse_string(const char *hdr, char **hdrp)
     }
 
     /* Save header value */
-    *hdrp = xstrndup(hdr, (hdrend - hdr));
+    *hdrp = parse_strndup(hdr, (hdrend - hdr));
 
     /* Un-fold header (overlapping buffers, use memmove) */
     he = *hdrp;
@@ -1111,8 +1182,8 @@ static void message_parse_type(const char *hdr, struct body *body)
 
     /* If we saw this header already, discard the earlier value */
     if (body->type) {
-        free(body->type);
-        free(body->subtype);
+        parse_free(body->type);
+        parse_free(body->subtype);
         body->type = body->subtype = NULL;
         param_free(&body->params);
     }
@@ -1153,8 +1224,8 @@ static void message_parse_type(const char *hdr, struct body *body)
     if (hdr && *hdr != ';') return;
 
     /* Save content type & subtype */
-    body->type = message_ucase(xstrndup(type, typelen));
-    body->subtype = message_ucase(xstrndup(subtype, subtypelen));
+    body->type = message_ucase(parse_strndup(type, typelen));
+    body->subtype = message_ucase(parse_strndup(subtype, subtypelen));
 
     /* Parse parameter list */
     if (hdr) {
@@ -1173,7 +1244,7 @@ static void message_parse_disposition(const char *hdr, struct body *body)
 
     /* If we saw this header already, discard the earlier value */
     if (body->disposition) {
-        free(body->disposition);
+        parse_free(body->disposition);
         body->disposition = NULL;
         param_free(&body->disposition_params);
     }
@@ -1196,7 +1267,7 @@ static void message_parse_disposition(const char *hdr, struct body *body)
     if (hdr && *hdr != ';') return;
 
     /* Save content disposition */
-    body->disposition = message_ucase(xstrndup(disposition, dispositionlen));
+    body->disposition = message_ucase(parse_strndup(disposition, dispositionlen));
 
     /* Parse parameter list */
     if (hdr) {
@@ -1284,9 +1355,9 @@ skip:
         }
 
         /* Save attribute/value pair */
-        *paramp = param = (struct param *)xzmalloc(sizeof(struct param));
-        param->attribute = message_ucase(xstrndup(attribute, attributelen));
-        param->value = xmalloc(valuelen + 1);
+        *paramp = param = (struct param *)parse_zmalloc(sizeof(struct param));
+        param->attribute = message_ucase(parse_strndup(attribute, attributelen));
+        param->value = parse_malloc(valuelen + 1);
         if (*value == '\"') {
             p = param->value;
             value++;
@@ -1376,9 +1447,9 @@ static void message_fold_params(struct param **params)
                     if (is_extended) {
                         /* Have to re-encode continuation value */
                         thisparam->value =
-                            xrealloc(thisparam->value,
-                                     strlen(thisparam->value) +
-                                     3*strlen((*continuation)->value) + 1);
+                            parse_strgrow(thisparam->value,
+                                          strlen(thisparam->value) +
+                                          3*strlen((*continuation)->value) + 1);
                         from = (*continuation)->value;
                         to = thisparam->value + strlen(thisparam->value);
                         while (*from) {
@@ -1396,9 +1467,9 @@ static void message_fold_params(struct param **params)
                     }
                     else {
                         thisparam->value =
-                            xrealloc(thisparam->value,
-                                     strlen(thisparam->value) +
-                                     strlen((*continuation)->value) + 1);
+                            parse_strgrow(thisparam->value,
+                                          strlen(thisparam->value) +
+                                          strlen((*continuation)->value) + 1);
                         from = (*continuation)->value;
                         to = thisparam->value + strlen(thisparam->value);
                         while ((*to++ = *from++)!= 0)
@@ -1409,9 +1480,9 @@ static void message_fold_params(struct param **params)
                     /* Continuation is extended */
                     if (is_extended) {
                         thisparam->value =
-                            xrealloc(thisparam->value,
-                                     strlen(thisparam->value) +
-                                     strlen((*continuation)->value) + 1);
+                            parse_strgrow(thisparam->value,
+                                          strlen(thisparam->value) +
+                                          strlen((*continuation)->value) + 1);
                         from = (*continuation)->value;
                         to = thisparam->value + strlen(thisparam->value);
                         while ((*to++ = *from++) != 0)
@@ -1420,8 +1491,8 @@ static void message_fold_params(struct param **params)
                     else {
                         /* Have to re-encode thisparam value */
                         char *tmpvalue =
-                            xmalloc(2 + 3*strlen(thisparam->value) +
-                                    strlen((*continuation)->value) + 1);
+                            parse_malloc(2 + 3*strlen(thisparam->value) +
+                                         strlen((*continuation)->value) + 1);
 
                         from = thisparam->value;
                         to = tmpvalue;
@@ -1443,18 +1514,18 @@ static void message_fold_params(struct param **params)
                         while ((*to++ = *from++)!=0)
                             { }
 
-                        free(thisparam->value);
+                        parse_free(thisparam->value);
                         thisparam->value = tmpvalue;
                         is_extended = 1;
                     }
                 }
 
                 /* Remove unneeded continuation */
-                free((*continuation)->attribute);
-                free((*continuation)->value);
+                parse_free((*continuation)->attribute);
+                parse_free((*continuation)->value);
                 tmpparam = *continuation;
                 *continuation = (*continuation)->next;
-                free(tmpparam);
+                parse_free(tmpparam);
                 section++;
             }
 
@@ -1505,8 +1576,8 @@ static void message_parse_language(const char *hdr, struct param **paramp)
         if (hdr && *hdr++ != ',') return;
 
         /* Save value pair */
-        *paramp = param = (struct param *)xzmalloc(sizeof(struct param));
-        param->value = message_ucase(xstrndup(value, valuelen));
+        *paramp = param = (struct param *)parse_zmalloc(sizeof(struct param));
+        param->value = message_ucase(parse_strndup(value, valuelen));
 
         /* Get ready to parse the next parameter */
         paramp = &param->next;
@@ -1756,8 +1827,8 @@ static void message_parse_content(struct msg *msg, struct body *body,
         msg->len += delta;
 
         /* Adjust body structure to account for encoding */
-        free(body->encoding);
-        body->encoding = xstrdup("BASE64");
+        parse_free(body->encoding);
+        body->encoding = parse_strdup("BASE64");
         body->content_size = b64_size;
         body->content_lines += b64_lines;
     }
@@ -1796,7 +1867,7 @@ static void message_parse_received_date(const char *hdr, char **hdrp)
   /* Found it, copy out date string part */
   curp++;
   message_parse_string(curp, hdrp);
-  free(hdrbuf);
+  parse_free(hdrbuf);
 }
 
 
@@ -1807,13 +1878,20 @@ static void message_parse_received_date(const char *hdr, char **hdrp)
 static char *message_getline(struct buf *buf, struct msg *msg)
 {
     unsigned int oldlen = buf_len(buf);
-    int c;
+    const char *line, *endline;
 
-    while (msg->offset < msg->len) {
-        c = msg->base[msg->offset++];
-        buf_putc(buf, c);
-        if (c == '\n')
-            break;
+    if (msg->offset < msg->len) {
+        /* let memchr find the line boundary (libc vectorizes it) and
+         * append the whole line in one go rather than a byte at a time;
+         * this is the hottest scan in message parsing */
+        line = msg->base + msg->offset;
+        endline = memchr(line, '\n', msg->len - msg->offset);
+        if (endline)
+            endline++;
+        else
+            endline = msg->base + msg->len;
+        buf_appendmap(buf, line, endline - line);
+        msg->offset += endline - line;
     }
     buf_cstring(buf);
 
@@ -1908,6 +1986,10 @@ EXPORTED int message_write_cache(struct index_record *record, const struct body
 
     free(subject);
 
+    /* precompute the sort keys from the items just built, so SORT
+     * doesn't have to re-derive them on every invocation */
+    message_write_sortkeys(&ib[CACHE_SORTKEYS], ib);
+
     /* append the records to the buffer */
     for (i = 0; i < NUM_CACHE_FIELDS; i++) {
         record->crec.item[i].len = buf_len(&ib[i]);
@@ -1923,6 +2005,8 @@ EXPORTED int message_write_cache(struct index_record *record, const struct body
     record->crec.buf = &cacheitem_buffer;
     record->crec.offset = 0; /* we're at the start of the buffer */
     record->crec.len = buf_len(&cacheitem_buffer);
+    record->crec.decode_slot = 0;
+    record->crec.decode_seq = 0;
 
     return 0;
 }
@@ -2468,6 +2552,278 @@ static void message_write_searchaddr(struct buf *buf,
     }
 }
 
+/*
+ * Get the 'local-part' of the first address in a cached address
+ * header (CACHE_FROM and friends), as used for SORT FROM/TO/CC.
+ */
+EXPORTED char *message_extract_localpart(const char *header)
+{
+    struct address *addr = NULL;
+    char *ret = NULL;
+
+    parseaddr_list(header, &addr);
+    if (!addr) return NULL;
+
+    if (addr->mailbox)
+        ret = xstrdup(addr->mailbox);
+
+    parseaddr_free(addr);
+
+    return ret;
+}
+
+/*
+ * Get the 'display-name' of the first address in a cached address
+ * header, as used for SORT DISPLAYFROM/DISPLAYTO.
+ */
+EXPORTED char *message_extract_displayname(const char *header)
+{
+    struct address *addr = NULL;
+    char *ret = NULL;
+    char *p;
+
+    parseaddr_list(header, &addr);
+    if (!addr) return NULL;
+
+    if (addr->name && addr->name[0]) {
+        /* pure RFC5255 compatible "searchform" conversion */
+        ret = charset_utf8_to_searchform(addr->name, /*flags*/0);
+    }
+    else if (addr->domain && addr->mailbox) {
+        ret = strconcat(addr->mailbox, "@", addr->domain, (char *)NULL);
+        /* gotta uppercase mailbox/domain */
+        for (p = ret; *p; p++)
+            *p = toupper(*p);
+    }
+    else if (addr->mailbox) {
+        ret = xstrdup(addr->mailbox);
+        /* gotta uppercase mailbox/domain */
+        for (p = ret; *p; p++)
+            *p = toupper(*p);
+    }
+
+    parseaddr_free(addr);
+
+    return ret;
+}
+
+/*
+ * Guts of subject extraction.
+ *
+ * Takes a subject string and returns a pointer to the base.
+ */
+static char *extract_base_subject(char *s, int *is_refwd)
+{
+    char *base, *x;
+
+    /* trim trailer
+     *
+     * start at the end of the string and work towards the front,
+     * resetting the end of the string as we go.
+     */
+    for (x = s + strlen(s) - 1; x >= s;) {
+        if (Uisspace(*x)) {                             /* whitespace? */
+            *x = '\0';                                  /* yes, trim it */
+            x--;                                        /* skip past it */
+        }
+        else if (x - s >= 4 &&
+                 !strncasecmp(x-4, "(fwd)", 5)) {       /* "(fwd)"? */
+            *(x-4) = '\0';                              /* yes, trim it */
+            x -= 5;                                     /* skip past it */
+            *is_refwd += 1;                             /* inc refwd counter */
+        }
+        else
+            break;                                      /* we're done */
+    }
+
+    /* trim leader
+     *
+     * start at the head of the string and work towards the end,
+     * skipping over stuff we don't care about.
+     */
+    for (base = s; base;) {
+        if (Uisspace(*base)) base++;                    /* whitespace? */
+
+        /* possible refwd */
+        else if ((!strncasecmp(base, "re", 2) &&        /* "re"? */
+                  (x = base + 2)) ||                    /* yes, skip past it */
+                 (!strncasecmp(base, "fwd", 3) &&       /* "fwd"? */
+                  (x = base + 3)) ||                    /* yes, skip past it */
+                 (!strncasecmp(base, "fw", 2) &&        /* "fw"? */
+                  (x = base + 2))) {                    /* yes, skip past it */
+            int count = 0;                              /* init counter */
+
+            while (Uisspace(*x)) x++;                   /* skip whitespace */
+
+            if (*x == '[') {                            /* start of blob? */
+                for (x++; x;) {                         /* yes, get count */
+                    if (!*x) {                          /* end of subj, quit */
+                        x = NULL;
+                        break;
+                    }
+                    else if (*x == ']') {               /* end of blob, done */
+                        break;
+                                        /* if we have a digit, and we're still
+                                           counting, keep building the count */
+                    } else if (cyrus_isdigit((int) *x) && count != -1) {
+                        count = count * 10 + *x - '0';
+                        if (count < 0) {                /* overflow */
+                            count = -1; /* abort counting */
+                        }
+                    } else {                            /* no digit, */
+                        count = -1;                     /*  abort counting */
+                    }
+                    x++;
+                }
+
+                if (x)                                  /* end of blob? */
+                    x++;                                /* yes, skip past it */
+                else
+                    break;                              /* no, we're done */
+            }
+
+            while (Uisspace(*x)) x++;                   /* skip whitespace */
+
+            if (*x == ':') {                            /* ending colon? */
+                base = x + 1;                           /* yes, skip past it */
+                *is_refwd += (count > 0 ? count : 1);   /* inc refwd counter
+                                                           by count or 1 */
+            }
+            else
+                break;                                  /* no, we're done */
+        }
+
+#if 0 /* do nested blobs - wait for decision on this */
+        else if (*base == '[') {                        /* start of blob? */
+            int count = 1;                              /* yes, */
+            x = base + 1;                               /*  find end of blob */
+            while (count) {                             /* find matching ']' */
+                if (!*x) {                              /* end of subj, quit */
+                    x = NULL;
+                    break;
+                }
+                else if (*x == '[')                     /* new open */
+                    count++;                            /* inc counter */
+                else if (*x == ']')                     /* close */
+                    count--;                            /* dec counter */
+                x++;
+            }
+
+            if (!x)                                     /* blob didn't close */
+                break;                                  /*  so quit */
+
+            else if (*x)                                /* end of subj? */
+                base = x;                               /* no, skip blob */
+#else
+        else if (*base == '[' &&                        /* start of blob? */
+                 (x = strpbrk(base+1, "[]")) &&         /* yes, end of blob */
+                 *x == ']') {                           /*  (w/o nesting)? */
+
+            if (*(x+1))                                 /* yes, end of subj? */
+                base = x + 1;                           /* no, skip blob */
+#endif
+            else
+                break;                                  /* yes, return blob */
+        }
+        else
+            break;                                      /* we're done */
+    }
+
+    return base;
+}
+
+/*
+ * Extract base subject from subject header
+ *
+ * This is a wrapper around extract_base_subject() which preps the
+ * subj NSTRING and checks for Netscape "[Fwd: ]".
+ */
+EXPORTED char *message_extract_subject(const char *subj, size_t len,
+                                       int *is_refwd)
+{
+    char *rawbuf, *buf, *s, *base;
+
+    /* parse the subj NSTRING and make a working copy */
+    if (!strcmp(subj, "NIL")) {                 /* NIL? */
+        return xstrdup("");                     /* yes, return empty */
+    } else if (*subj == '"') {                  /* quoted? */
+        rawbuf = xstrndup(subj + 1, len - 2);   /* yes, strip quotes */
+    } else {
+        s = strchr(subj, '}') + 3;              /* literal, skip { }\r\n */
+        rawbuf = xstrndup(s, len - (s - subj));
+    }
+
+    buf = charset_parse_mimeheader(rawbuf, charset_flags);
+    free(rawbuf);
+
+    for (s = buf;;) {
+        base = extract_base_subject(s, is_refwd);
+
+        /* If we have a Netscape "[Fwd: ...]", extract the contents */
+        if (!strncasecmp(base, "[fwd:", 5) &&
+            base[strlen(base) - 1]  == ']') {
+
+            /* inc refwd counter */
+            *is_refwd += 1;
+
+            /* trim "]" */
+            base[strlen(base) - 1] = '\0';
+
+            /* trim "[fwd:" */
+            s = base + 5;
+        }
+        else /* otherwise, we're done */
+            break;
+    }
+
+    base = xstrdup(base);
+
+    free(buf);
+
+    for (s = base; *s; s++) {
+        *s = toupper(*s);
+    }
+
+    return base;
+}
+
+/*
+ * Write the precomputed sort keys (cache version 8) for the message
+ * whose other cache items have already been built in 'ib'.  The keys
+ * are derived from those items rather than from the raw message, so
+ * they come out identical to what index.c computes when it has to
+ * fall back to extracting them at SORT time.
+ */
+static void message_write_sortkeys(struct buf *buf, struct buf *ib)
+{
+    struct buf scratch = BUF_INITIALIZER;
+    char *keys[NUM_SORTKEY_FIELDS];
+    int is_refwd = 0;
+    int i;
+
+    keys[SORTKEY_SUBJECT] =
+        message_extract_subject(buf_cstring(&ib[CACHE_SUBJECT]),
+                                buf_len(&ib[CACHE_SUBJECT]), &is_refwd);
+    keys[SORTKEY_FROM] =
+        message_extract_localpart(buf_cstring(&ib[CACHE_FROM]));
+    keys[SORTKEY_TO] =
+        message_extract_localpart(buf_cstring(&ib[CACHE_TO]));
+    keys[SORTKEY_CC] =
+        message_extract_localpart(buf_cstring(&ib[CACHE_CC]));
+    keys[SORTKEY_DISPLAYFROM] =
+        message_extract_displayname(buf_cstring(&ib[CACHE_FROM]));
+    keys[SORTKEY_DISPLAYTO] =
+        message_extract_displayname(buf_cstring(&ib[CACHE_TO]));
+
+    buf_appendbit32(buf, is_refwd);
+    for (i = 0; i < NUM_SORTKEY_FIELDS; i++) {
+        buf_init_ro(&scratch, keys[i] ? keys[i] : "",
+                    keys[i] ? strlen(keys[i]) : 0);
+        message_write_xdrstring(buf, &scratch);
+        free(keys[i]);
+    }
+}
+
 static void param_free(struct param **paramp)
 {
     struct param *param, *nextparam;
@@ -2477,12 +2833,48 @@ static void param_free(struct param **paramp)
 
     for (; param; param = nextparam) {
         nextparam = param->next;
+        if (parse_pool) continue;       /* the pool owns it all */
         if (param->attribute) free(param->attribute);
         if (param->value) free(param->value);
         free(param);
     }
 }
 
+/*
+ * Free the parts of a pool-parsed body tree that do not come from the
+ * pool: address lists, subpart arrays, cached headers and decoded
+ * content bolted on after parsing.
+ */
+static void message_free_body_offpool(struct body *body)
+{
+    int part;
+
+    if (!body) return;
+
+    if (body->from) parseaddr_free(body->from);
+    if (body->sender) parseaddr_free(body->sender);
+    if (body->reply_to) parseaddr_free(body->reply_to);
+    if (body->to) parseaddr_free(body->to);
+    if (body->cc) parseaddr_free(body->cc);
+    if (body->bcc) parseaddr_free(body->bcc);
+
+    if (body->subpart) {
+        if (body->numparts) {
+            for (part=0; part < body->numparts; part++) {
+                message_free_body_offpool(&body->subpart[part]);
+            }
+        }
+        else {
+            message_free_body_offpool(body->subpart);
+        }
+        free(body->subpart);
+    }
+
+    buf_free(&body->cacheheaders);
+
+    if (body->decoded_body) free(body->decoded_body);
+}
+
 /*
  * Free the parsed body-part 'body'
  */
@@ -2492,6 +2884,16 @@ EXPORTED void message_free_body(struct body *body)
 
     if (!body) return;
 
+    /* parser-built trees: free what lives outside the pool, then
+     * release the pool itself in one go */
+    if (body->pool) {
+        struct mpool *pool = body->pool;
+        body->pool = NULL;
+        message_free_body_offpool(body);
+        free_mpool(pool);
+        return;
+    }
+
     if (body->type) {
         free(body->type);
         free(body->subtype);
@@ -2706,22 +3108,29 @@ static int message_read_params(struct protstream *strm, struct param **paramp,
     int c;
 
     if ((c = prot_getc(strm)) == '(') {
-        /* parse list */
+        /* parse list; a NULL 'paramp' just skips over it */
         struct param *param;
 
         do {
-            *paramp = param = (struct param *) xzmalloc(sizeof(struct param));
+            param = NULL;
+            if (paramp) {
+                *paramp = param =
+                    (struct param *) xzmalloc(sizeof(struct param));
+            }
 
             if (withattr) {
                 /* attribute */
-                c = message_read_nstring(strm, &param->attribute, 1);
+                c = message_read_nstring(strm,
+                                         param ? &param->attribute : NULL,
+                                         param != NULL);
             }
 
             /* value */
-            c = message_read_nstring(strm, &param->value, 1);
+            c = message_read_nstring(strm, param ? &param->value : NULL,
+                                     param != NULL);
 
             /* get ready to append the next parameter */
-            paramp = &param->next;
+            if (param) paramp = &param->next;
 
         } while (c == ' ');
 
@@ -2768,6 +3177,20 @@ static int message_read_address(struct protstream *strm, struct address **addrp)
         struct buf buf;
         unsigned nameoff = 0, rtoff = 0, mboxoff = 0, domoff = 0;
 
+        if (!addrp) {
+            /* skip over the list without building it */
+            do {
+                c = prot_getc(strm);    /* opening '(' */
+                c = message_read_nstring(strm, NULL, 0);
+                c = message_read_nstring(strm, NULL, 0);
+                c = message_read_nstring(strm, NULL, 0);
+                c = message_read_nstring(strm, NULL, 0);
+            } while (((c = prot_getc(strm)) == '(') && prot_ungetc(c, strm));
+
+            if (c == ')') c = prot_getc(strm);
+            return c;
+        }
+
         do {
             *addrp = addr = (struct address *) xzmalloc(sizeof(struct address));
             buf_init(&buf);
@@ -2815,7 +3238,8 @@ static int message_read_address(struct protstream *strm, struct address **addrp)
 
 /*
  * Read a cached envelope response.
- * Analog to mesage_write_envelope()
+ * Analog to mesage_write_envelope().
+ * A NULL 'body' skips over the envelope without storing it.
  */
 static int message_read_envelope(struct protstream *strm, struct body *body)
 {
@@ -2825,34 +3249,36 @@ static int message_read_envelope(struct protstream *strm, struct body *body)
     c = prot_getc(strm);
 
     /* date */
-    c = message_read_nstring(strm, &body->date, 1);
+    c = message_read_nstring(strm, body ? &body->date : NULL, body != NULL);
 
     /* subject */
-    c = message_read_nstring(strm, &body->subject, 1);
+    c = message_read_nstring(strm, body ? &body->subject : NULL, body != NULL);
 
     /* from */
-    c = message_read_address(strm, &body->from);
+    c = message_read_address(strm, body ? &body->from : NULL);
 
     /* sender */
-    c = message_read_address(strm, &body->sender);
+    c = message_read_address(strm, body ? &body->sender : NULL);
 
     /* reply-to */
-    c = message_read_address(strm, &body->reply_to);
+    c = message_read_address(strm, body ? &body->reply_to : NULL);
 
     /* to */
-    c = message_read_address(strm, &body->to);
+    c = message_read_address(strm, body ? &body->to : NULL);
 
     /* cc */
-    c = message_read_address(strm, &body->cc);
+    c = message_read_address(strm, body ? &body->cc : NULL);
 
     /* bcc */
-    c = message_read_address(strm, &body->bcc);
+    c = message_read_address(strm, body ? &body->bcc : NULL);
 
     /* in-reply-to */
-    c = message_read_nstring(strm, &body->in_reply_to, 1);
+    c = message_read_nstring(strm, body ? &body->in_reply_to : NULL,
+                             body != NULL);
 
     /* message-id */
-    c = message_read_nstring(strm, &body->message_id, 1);
+    c = message_read_nstring(strm, body ? &body->message_id : NULL,
+                             body != NULL);
 
     if (c == ')') c = prot_getc(strm);
 
@@ -2861,9 +3287,13 @@ static int message_read_envelope(struct protstream *strm, struct body *body)
 
 /*
  * Read cached bodystructure response.
- * Analog to mesage_write_body()
+ * Analog to mesage_write_body().
+ * When 'full' is zero, only the part types and nesting are stored -
+ * enough to resolve body sections together with the binary section
+ * offsets - and every other field is skipped without being copied.
  */
-static int message_read_body(struct protstream *strm, struct body *body, const char *part_id)
+static int message_read_body(struct protstream *strm, struct body *body,
+                             const char *part_id, int full)
 {
 #define prot_peek(strm) prot_ungetc(prot_getc(strm), strm)
 
@@ -2888,7 +3318,7 @@ static int message_read_body(struct protstream *strm, struct body *body, const c
             buf_printf(&buf, "%d", body->numparts + 1);
             struct body *subbody = &body->subpart[body->numparts++];
             subbody->part_id = buf_release(&buf);
-            c = message_read_body(strm, subbody, subbody->part_id);
+            c = message_read_body(strm, subbody, subbody->part_id, full);
         } while (((c = prot_getc(strm)) == '(') && prot_ungetc(c, strm));
 
         /* remove the part_id here, you can't address multiparts directly */
@@ -2902,7 +3332,7 @@ static int message_read_body(struct protstream *strm, struct body *body, const c
         /* extension data */
 
         /* body parameters */
-        c = message_read_params(strm, &body->params, 1);
+        c = message_read_params(strm, full ? &body->params : NULL, 1);
         if (c == EOF) goto done;
     }
     else {
@@ -2923,19 +3353,19 @@ static int message_read_body(struct protstream *strm, struct body *body, const c
         if (c == EOF) goto done;
 
         /* body parameters */
-        c = message_read_params(strm, &body->params, 1);
+        c = message_read_params(strm, full ? &body->params : NULL, 1);
         if (c == EOF) goto done;
 
         /* body id */
-        c = message_read_nstring(strm, &body->id, 1);
+        c = message_read_nstring(strm, full ? &body->id : NULL, full);
         if (c == EOF) goto done;
 
         /* body description */
-        c = message_read_nstring(strm, &body->description, 1);
+        c = message_read_nstring(strm, full ? &body->description : NULL, full);
         if (c == EOF) goto done;
 
         /* body encoding */
-        c = message_read_nstring(strm, &body->encoding, 1);
+        c = message_read_nstring(strm, full ? &body->encoding : NULL, full);
         if (c == EOF) goto done;
 
         /* body size */
@@ -2953,11 +3383,11 @@ static int message_read_body(struct protstream *strm, struct body *body, const c
             body->subpart = (struct body *) xzmalloc(sizeof(struct body));
 
             /* envelope structure */
-            c = message_read_envelope(strm, body->subpart);
+            c = message_read_envelope(strm, full ? body->subpart : NULL);
             if (c == EOF) goto done;
 
             /* body structure */
-            c = message_read_body(strm, body->subpart, body->part_id);
+            c = message_read_body(strm, body->subpart, body->part_id, full);
             if (c == EOF) goto done;
             c = prot_getc(strm); /* trailing SP */
             if (c == EOF) goto done;
@@ -2970,7 +3400,7 @@ static int message_read_body(struct protstream *strm, struct body *body, const c
         /* extension data */
 
         /* body MD5 */
-        c = message_read_nstring(strm, &body->md5, 1);
+        c = message_read_nstring(strm, full ? &body->md5 : NULL, full);
         if (c == EOF) goto done;
     }
 
@@ -2978,29 +3408,30 @@ static int message_read_body(struct protstream *strm, struct body *body, const c
 
     /* body disposition */
     if ((c = prot_getc(strm)) == '(') {
-        c = message_read_nstring(strm, &body->disposition, 1);
+        c = message_read_nstring(strm, full ? &body->disposition : NULL, full);
         if (c == EOF) goto done;
 
-        c = message_read_params(strm, &body->disposition_params, 1);
+        c = message_read_params(strm, full ? &body->disposition_params : NULL,
+                                1);
         if (c == ')') c = prot_getc(strm); /* trailing SP */
         if (c == EOF) goto done;
     }
     else {
         /* NIL */
         prot_ungetc(c, strm);
-        c = message_read_nstring(strm, &body->disposition, 1);
+        c = message_read_nstring(strm, full ? &body->disposition : NULL, full);
         if (c == EOF) goto done;
     }
 
     /* body language */
     if ((c = prot_peek(strm)) == '(') {
-        c = message_read_params(strm, &body->language, 0);
+        c = message_read_params(strm, full ? &body->language : NULL, 0);
         if (c == EOF) goto done;
     }
     else {
-        char *lang;
+        char *lang = NULL;
 
-        c = message_read_nstring(strm, &lang, 1);
+        c = message_read_nstring(strm, full ? &lang : NULL, full);
         if (c == EOF) goto done;
         if (lang) {
             body->language = (struct param *) xzmalloc(sizeof(struct param));
@@ -3009,7 +3440,7 @@ static int message_read_body(struct protstream *strm, struct body *body, const c
     }
 
     /* body location */
-    c = message_read_nstring(strm, &body->location, 1);
+    c = message_read_nstring(strm, full ? &body->location : NULL, full);
 
     /* XXX  We currently don't store any other extension data.
             MUST keep in sync with message_write_body() */
@@ -3128,7 +3559,8 @@ static void message_read_binarybody(struct body *body, const char **sect,
  * Read cached envelope, binary bodystructure response and binary bodystructure
  * of the specified record.  Populates 'body' which must be freed by the caller.
  */
-EXPORTED void message_read_bodystructure(const struct index_record *record, struct body **body)
+static void message_read_bodystructure_internal(const struct index_record *record,
+                                                struct body **body, int full)
 {
     struct protstream *strm;
     struct body toplevel;
@@ -3144,7 +3576,7 @@ EXPORTED void message_read_bodystructure(const struct index_record *record, stru
                         cacheitem_size(record, CACHE_ENVELOPE));
     prot_setisclient(strm, 1);  /* no-sync literals */
 
-    message_read_envelope(strm, *body);
+    message_read_envelope(strm, full ? *body : NULL);
     prot_free(strm);
 
     /* Read bodystructure response from cache */
@@ -3152,7 +3584,7 @@ EXPORTED void message_read_bodystructure(const struct index_record *record, stru
                         cacheitem_size(record, CACHE_BODYSTRUCTURE));
     prot_setisclient(strm, 1);  /* no-sync literals */
 
-    message_read_body(strm, *body, NULL);
+    message_read_body(strm, *body, NULL, full);
     prot_free(strm);
 
     /* Read binary bodystructure from cache */
@@ -3160,6 +3592,25 @@ EXPORTED void message_read_bodystructure(const struct index_record *record, stru
     message_read_binarybody(&toplevel, &binbody, record->cache_version);
 }
 
+EXPORTED void message_read_bodystructure(const struct index_record *record,
+                                         struct body **body)
+{
+    message_read_bodystructure_internal(record, body, 1);
+}
+
+/*
+ * As message_read_bodystructure(), but only reads as much of the cached
+ * bodystructure as is needed to resolve body sections: part types,
+ * nesting and the section offsets.  Everything else (envelopes,
+ * parameters, addresses) is skipped without being copied, which matters
+ * when fetching a single section of a message with many parts.
+ */
+EXPORTED void message_read_bodystructure_sections(const struct index_record *record,
+                                                  struct body **body)
+{
+    message_read_bodystructure_internal(record, body, 0);
+}
+
 static void de_nstring_buf(struct buf *src, struct buf *dst)
 {
     char *p, *q;
@@ -3374,7 +3825,8 @@ EXPORTED int message_update_conversations(struct conversations_state *state,
                 conversation_id_t cid = arrayu64_nth(&cids, j);
                 conversation_free(conv);
                 conv = NULL;
-                r = conversation_load(state, cid, &conv);
+                r = conversation_load_advanced(state, cid, &conv,
+                                               CONV_WANT_SUBJECT);
                 if (r) goto out;
                 /* [IRIS-1576] if X-ME-Message-ID says the messages are
                 * linked, ignore any difference in Subject: header fields. */
@@ -55,6 +55,7 @@
 
 #include "prot.h"
 #include "mailbox.h"
+#include "mpool.h"
 #include "strarray.h"
 #include "util.h"
 #include "charset.h"
@@ -128,6 +129,12 @@ struct body {
 
     /* Message GUID. Only filled in at top level */
     struct message_guid guid;
+
+    /* Memory pool the tree was parsed out of.  Only set on the root
+     * of a parser-built tree and released wholesale by
+     * message_free_body(); NULL for trees rebuilt from the cache,
+     * which are freed field by field as before */
+    struct mpool *pool;
 };
 
 /* List of Content-type parameters */
@@ -138,6 +145,9 @@ struct param {
 };
 extern int message_copy_strict P((struct protstream *from, FILE *to,
                                   unsigned size, int allow_null));
+extern int message_copy_strict_retain P((struct protstream *from, FILE *to,
+                                         unsigned size, int allow_null,
+                                         struct buf *retain));
 
 extern int message_parse(const char *fname, struct index_record *record);
 
@@ -182,10 +192,19 @@ extern void message_free_body P((struct body *body));
 /* NOTE - scribbles on its input */
 extern void message_parse_env_address(char *str, struct address *addr);
 
+/* sort key extraction, shared between the cache writer and the
+ * legacy SORT fallback for records without CACHE_SORTKEYS */
+extern char *message_extract_subject(const char *subj, size_t len,
+                                     int *is_refwd);
+extern char *message_extract_localpart(const char *header);
+extern char *message_extract_displayname(const char *header);
+
 extern char *parse_nstring(char **str);
 
 extern void message_read_bodystructure(const struct index_record *record,
                                        struct body **body);
+extern void message_read_bodystructure_sections(const struct index_record *record,
+                                                struct body **body);
 
 extern int message_update_conversations(struct conversations_state *, struct mailbox *, struct index_record *, conversation_t **);
 
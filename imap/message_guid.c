@@ -89,6 +89,34 @@ EXPORTED void message_guid_generate(struct message_guid *guid,
     xsha1((const unsigned char *) msg_base, msg_len, guid->value);
 }
 
+/* message_guid_generate_start() *****************************************
+ *
+ * Streaming GUID computation: hash the message in chunks as it is
+ * received or written, instead of a second pass over the whole thing.
+ * The SHA1 under the hood (OpenSSL's when built with SSL) picks the
+ * best implementation for the host at runtime.
+ *
+ ************************************************************************/
+
+EXPORTED void message_guid_generate_start(struct message_guid_gen *gen)
+{
+    SHA1_Init(&gen->ctx);
+}
+
+EXPORTED void message_guid_generate_chunk(struct message_guid_gen *gen,
+                                          const char *data, unsigned long len)
+{
+    SHA1_Update(&gen->ctx, (const unsigned char *) data, len);
+}
+
+EXPORTED void message_guid_generate_finish(struct message_guid_gen *gen,
+                                           struct message_guid *guid)
+{
+    memset(guid->value, 0, MESSAGE_GUID_SIZE);
+    guid->status = GUID_NONNULL;
+    SHA1_Final(guid->value, &gen->ctx);
+}
+
 EXPORTED void message_guid_permute32(struct message_guid *guid, uint32_t val)
 {
     if (message_guid_isnull(guid))
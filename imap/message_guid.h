@@ -45,6 +45,8 @@
 
 #include <stdint.h>
 
+#include "xsha1.h"
+
 /* Public interface */
 
 #define MESSAGE_GUID_SIZE         (20)    /* Size of GUID byte sequence */
@@ -64,6 +66,18 @@ struct message_guid {
 void message_guid_generate(struct message_guid *guid,
                            const char *msg_base, unsigned long msg_len);
 
+/* Streaming variant, for hashing a message as it arrives rather than
+ * making a second pass over it afterwards */
+struct message_guid_gen {
+    SHA_CTX ctx;
+};
+
+void message_guid_generate_start(struct message_guid_gen *gen);
+void message_guid_generate_chunk(struct message_guid_gen *gen,
+                                 const char *data, unsigned long len);
+void message_guid_generate_finish(struct message_guid_gen *gen,
+                                  struct message_guid *guid);
+
 void message_guid_permute32(struct message_guid *guid, uint32_t val);
 
 /* Copy a GUID */
@@ -42,6 +42,7 @@
 
 #include <config.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <signal.h>
@@ -55,15 +56,19 @@
 #endif
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
 
+#include "bloom.h"
 #include "exitcodes.h"
 #include "global.h"
+#include "map.h"
 #include "mupdate.h"
 #include "prot.h"
 #include "protocol.h"
@@ -82,6 +87,7 @@ static struct protocol_t mupdate_protocol =
         { { "AUTH", CAPA_AUTH },
           { "STARTTLS", CAPA_STARTTLS },
           { "COMPRESS=DEFLATE", CAPA_COMPRESS },
+          { "DELTA-UPDATE", CAPA_MUPDATE_DELTA },
           { NULL, 0 } } },
       { "S01 STARTTLS", "S01 OK", "S01 NO", 1 },
       { "A01 AUTHENTICATE", USHRT_MAX, 1, "A01 OK", "A01 NO", "", "*", NULL, 0 },
@@ -467,6 +473,43 @@ EXPORTED int mupdate_find(mupdate_handle *handle, const char *mailbox,
     }
 }
 
+EXPORTED int mupdate_find_batch(mupdate_handle *handle,
+                                const strarray_t *mailboxes,
+                                mupdate_callback callback, void *context)
+{
+    int i, ret;
+    enum mupdate_cmd_response response;
+
+    if (!handle) {
+        syslog(LOG_ERR, "%s: no mupdate_handle", __func__);
+        return MUPDATE_BADPARAM;
+    }
+
+    if (!mailboxes || !callback) {
+        syslog(LOG_ERR, "%s: no mailboxes/callback", __func__);
+        return MUPDATE_BADPARAM;
+    }
+
+    /* pipeline the whole batch before reading anything back */
+    for (i = 0; i < mailboxes->count; i++) {
+        const char *mailbox = strarray_nth(mailboxes, i);
+
+        prot_printf(handle->conn->out,
+                    "X%u FIND {" SIZE_T_FMT "+}\r\n%s\r\n", handle->tagn++,
+                    strlen(mailbox), mailbox);
+    }
+    prot_flush(handle->conn->out);
+
+    /* responses come back in command order */
+    for (i = 0; i < mailboxes->count; i++) {
+        ret = mupdate_scarf(handle, callback, context, 1, &response);
+        if (ret) return ret;
+        if (response != MUPDATE_OK) return MUPDATE_FAIL;
+    }
+
+    return 0;
+}
+
 EXPORTED int mupdate_list(mupdate_handle *handle, mupdate_callback callback,
                  const char *prefix, void *context)
 {
@@ -718,7 +761,15 @@ EXPORTED int mupdate_scarf(mupdate_handle *handle,
             }
             goto badcmd;
         case 'R':
-            if (!strncmp(handle->cmd.s, "RESERVE", 7)) {
+            if (!strncmp(handle->cmd.s, "RESYNC", 6)) {
+                /* server is answering our UPDATE SINCE with a full
+                 * dump rather than a delta */
+                ch = getstring(handle->conn->in, handle->conn->out, &(handle->arg1));
+                CHECKNEWLINE(handle, ch);
+
+                handle->saw_resync = 1;
+                break;
+            } else if (!strncmp(handle->cmd.s, "RESERVE", 7)) {
                 /* Mailbox Name */
                 ch = getstring(handle->conn->in, handle->conn->out, &(handle->arg1));
                 if (ch != ' ') {
@@ -745,6 +796,18 @@ EXPORTED int mupdate_scarf(mupdate_handle *handle,
             }
             goto badcmd;
 
+        case 'V':
+            if (!strncmp(handle->cmd.s, "VERSION", 7)) {
+                /* the server's change counter as of the data we've
+                 * just been streamed */
+                ch = getstring(handle->conn->in, handle->conn->out, &(handle->arg1));
+                CHECKNEWLINE(handle, ch);
+
+                handle->lastversion = strtoull(handle->arg1.s, NULL, 10);
+                break;
+            }
+            goto badcmd;
+
         default:
         badcmd:
             /* Bad Command */
@@ -762,6 +825,71 @@ EXPORTED int mupdate_scarf(mupdate_handle *handle,
     return r;
 }
 
+/*
+ * Test a name against the murder-wide mailbox name bloom filter
+ * maintained by the local mupdate slave, so that lookups for names
+ * which exist nowhere in the murder (typos, probes) don't pay for a
+ * kick_mupdate() round trip.  Fails open: any problem with the filter
+ * just means every miss kicks, as before.
+ */
+static struct bloom mbloom_params;
+static const char *mbloom_base = NULL;
+static size_t mbloom_len = 0;
+static ino_t mbloom_ino = 0;
+static time_t mbloom_checked = 0;
+
+#define MBLOOM_RECHECK 60  /* seconds between re-stats of the file */
+
+EXPORTED int mupdate_bloom_check(const char *mailbox)
+{
+    char fnamebuf[2048];
+    struct stat sbuf;
+    time_t now = time(NULL);
+    int fd;
+
+    if (!config_getswitch(IMAPOPT_MUPDATE_BLOOM))
+        return 1;
+
+    if (!mbloom_params.ready &&
+        bloom_init(&mbloom_params, MUPDATE_BLOOM_ENTRIES,
+                   MUPDATE_BLOOM_ERROR))
+        return 1;
+
+    /* (re)map the file if we haven't looked recently - a rebuild
+     * replaces the file, so check the inode, not just the times */
+    if (now - mbloom_checked >= MBLOOM_RECHECK) {
+        mbloom_checked = now;
+
+        strlcpy(fnamebuf, config_dir, sizeof(fnamebuf));
+        strlcat(fnamebuf, FNAME_MUPDATE_BLOOM, sizeof(fnamebuf));
+
+        if (stat(fnamebuf, &sbuf) < 0 ||
+            sbuf.st_size != (off_t) mbloom_params.bytes) {
+            /* no usable filter (yet) */
+            if (mbloom_base) map_free(&mbloom_base, &mbloom_len);
+            mbloom_ino = 0;
+            return 1;
+        }
+
+        if (sbuf.st_ino != mbloom_ino) {
+            if (mbloom_base) map_free(&mbloom_base, &mbloom_len);
+
+            fd = open(fnamebuf, O_RDONLY);
+            if (fd < 0) return 1;
+            map_refresh(fd, 1, &mbloom_base, &mbloom_len, sbuf.st_size,
+                        fnamebuf, NULL);
+            close(fd);
+            mbloom_ino = sbuf.st_ino;
+        }
+    }
+
+    if (!mbloom_base) return 1;
+
+    return bloom_check_raw(&mbloom_params,
+                           (const unsigned char *) mbloom_base,
+                           mailbox, strlen(mailbox)) != 0;
+}
+
 EXPORTED void kick_mupdate(void)
 {
     char buf[2048];
@@ -45,8 +45,24 @@
 
 #include <sasl/sasl.h>
 
+#include "strarray.h"
+
 #define FNAME_MUPDATE_TARGET_SOCK "/socket/mupdate.target"
 
+/* bloom filter over every mailbox name in the murder, written by the
+ * local mupdate slave (see mupdate_bloom in imapd.conf).  The file is
+ * the raw bit array of a filter built with exactly these parameters;
+ * writer and readers must agree, and readers ignore a file whose size
+ * doesn't match (fail open). */
+#define FNAME_MUPDATE_BLOOM "/mupdate_bloom"
+#define MUPDATE_BLOOM_ENTRIES (1024*1024)
+#define MUPDATE_BLOOM_ERROR   0.01
+
+/* mupdate-specific capabilities */
+enum {
+    CAPA_MUPDATE_DELTA  = (1 << 3)      /* server does DELTA-UPDATE */
+};
+
 typedef struct mupdate_handle_s mupdate_handle;
 
 /* connect & authenticate to an mupdate server */
@@ -92,6 +108,15 @@ struct mupdate_mailboxdata {
 int mupdate_find(mupdate_handle *handle, const char *mailbox,
                  struct mupdate_mailboxdata **target);
 
+/* look up a batch of mailboxes with pipelined FINDs, so the whole batch
+ * costs a single round trip.  The callback (see below) is invoked once
+ * for each mailbox that exists - correlate by mdata->mailbox; names
+ * that don't exist produce no callback. */
+int mupdate_find_batch(mupdate_handle *handle, const strarray_t *mailboxes,
+                       int (*callback)(struct mupdate_mailboxdata *mdata,
+                                       const char *cmd, void *context),
+                       void *context);
+
 /* Callbacks for mupdate_scarf and mupdate_list */
 /* cmd is one of DELETE, MAILBOX, RESERVE */
 /* context is as provided to mupdate_scarf */
@@ -112,4 +137,10 @@ int mupdate_noop(mupdate_handle *handle, mupdate_callback callback,
 /* ping a local slave */
 void kick_mupdate(void);
 
+/* test 'mailbox' against the slave-maintained murder name filter.
+ * Returns 0 only when the name definitely exists nowhere in the
+ * murder, so callers can skip kick_mupdate(); returns 1 on a possible
+ * hit, or when the filter is disabled or unreadable. */
+int mupdate_bloom_check(const char *mailbox);
+
 #endif
@@ -169,14 +169,18 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
     struct mbent_queue remote_boxes;
     struct mpool *pool;
     int r;
+    int delta = 0;
+    unsigned long long savedversion = 0;
     enum mupdate_cmd_response response;
 
     if (!handle || !handle->saslcompleted) return;
 
     pool = new_mpool(131072); /* Arbitrary, but large (128k) */
 
-    /* first get the list of remote mailboxes from the mupdate master */
-    r = mupdate_synchronize_remote(handle, &remote_boxes, pool);
+    /* first get the list of remote mailboxes from the mupdate master
+     * (or, if the master speaks DELTA-UPDATE and we have synced before,
+     * just the changes since our last synced version) */
+    r = mupdate_synchronize_remote(handle, &remote_boxes, pool, &delta);
     if (r) {
         free_mpool(pool);
         return;
@@ -187,12 +191,21 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
     mupdate_unready();
 
     /* Now, resync the database by comparing the remote mbox with our local*/
-    r = mupdate_synchronize(&remote_boxes, pool);
+    r = mupdate_synchronize(&remote_boxes, pool, delta);
     free_mpool(pool);
     if (r) return;
 
+    /* remember where we're synced to for the next reconnect */
+    if (handle->lastversion) {
+        mupdate_version_save(FNAME_MASTERVERSION, handle->lastversion);
+        savedversion = handle->lastversion;
+    }
+
     mupdate_signal_db_synced();
 
+    /* give the proxies a fresh negative-lookup filter to match */
+    mupdate_bloom_rebuild();
+
     /* Okay, we're all set to go */
     mupdate_ready();
 
@@ -232,6 +245,14 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
 
                 /* If we were waiting on a noop, we no longer are.
                  * If we have been kicked, tell them we're done now */
+                /* checkpoint how far we've synced for the next
+                 * reconnect */
+                if (handle->lastversion != savedversion) {
+                    mupdate_version_save(FNAME_MASTERVERSION,
+                                         handle->lastversion);
+                    savedversion = handle->lastversion;
+                }
+
                 if (waiting_for_noop) {
                     if (response != MUPDATE_OK) {
                         syslog(LOG_ERR, "update/noop sync error %d", response);
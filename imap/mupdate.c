@@ -53,6 +53,7 @@
 #include <stdlib.h>
 #include <syslog.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include <netdb.h>
 #include <sys/socket.h>
@@ -68,7 +69,9 @@
 #include <pthread.h>
 #include <sasl/sasl.h>
 #include <sasl/saslutil.h>
+#include <sys/mman.h>
 
+#include "bloom.h"
 #include "mupdate.h"
 #include "mupdate-client.h"
 #include "telemetry.h"
@@ -82,6 +85,7 @@
 #include "mpool.h"
 #include "nonblock.h"
 #include "prot.h"
+#include "retry.h"
 #include "tls.h"
 #include "tls_th-lock.h"
 #include "util.h"
@@ -112,6 +116,7 @@ enum {
 struct pending {
     struct pending *next;
 
+    unsigned long long version; /* our change counter when this was posted */
     char mailbox[MAX_MAILBOX_BUFFER];
 };
 
@@ -149,6 +154,7 @@ struct conn {
     /* UPDATE command handling */
     const char *streaming; /* tag */
     strarray_t *streaming_hosts; /* partial updates */
+    int streaming_version; /* client did UPDATE SINCE, wants VERSION lines */
 
     /* pending changes to send, in reverse order */
     pthread_mutex_t m;
@@ -206,6 +212,41 @@ static int conn_pipe[2];
 static pthread_mutex_t mailboxes_mutex = PTHREAD_MUTEX_INITIALIZER;
 static struct conn *updatelist = NULL;
 
+/* ---- DELTA-UPDATE state (protected by mailboxes_mutex) ----
+ *
+ * Every change we apply bumps 'local_version' and is remembered in a
+ * ring of recent changes, so that a client reconnecting with
+ * UPDATE SINCE can be answered with a replay of just what it missed
+ * instead of a full dump.
+ *
+ * The counter survives restarts: we persist a preallocated ceiling
+ * (bumped in steps of VERSION_SLACK, so it costs one file write per
+ * thousand changes) and rewrite the exact value at clean shutdown.
+ * After a clean restart a client that was current gets an empty delta;
+ * after a crash the counter resumes from the ceiling, which can only
+ * force an unnecessary full resync, never a missed change. */
+#define VERSION_SLACK 1000
+#define DELTA_RING_SIZE 8192
+
+struct delta_ent {
+    char *mailbox;
+};
+
+static unsigned long long local_version = 0;
+static unsigned long long version_ceiling = 0;
+static int version_loaded = 0;
+static struct delta_ent delta_ring[DELTA_RING_SIZE];
+static unsigned long long delta_count = 0;      /* changes since startup */
+
+/* murder mailbox-name bloom filter, shared with the proxy processes on
+ * this host through an mmap'd file (see mupdate_bloom in imapd.conf).
+ * Rebuilt from the local database after each resync; streamed changes
+ * are OR'd into the live map as they are applied.  Protected by
+ * mailboxes_mutex. */
+static struct bloom mbloom_params;              /* parameters only */
+static unsigned char *mbloom_map = NULL;
+static size_t mbloom_maplen = 0;
+
 /* --- prototypes --- */
 static void conn_free(struct conn *C);
 static mupdate_docmd_result_t docmd(struct conn *c);
@@ -219,7 +260,7 @@ static void cmd_find(struct conn *C, const char *tag, const char *mailbox,
               int send_ok, int send_delete);
 static void cmd_list(struct conn *C, const char *tag, const char *host_prefix);
 static void cmd_startupdate(struct conn *C, const char *tag,
-                     strarray_t *partial);
+                     strarray_t *partial, const char *since);
 static void cmd_starttls(struct conn *C, const char *tag);
 #ifdef HAVE_ZLIB
 static void cmd_compress(struct conn *C, const char *tag, const char *alg);
@@ -922,7 +963,15 @@ static mupdate_docmd_result_t docmd(struct conn *c)
             CHECKNEWLINE(c, ch);
             if (c->streaming) goto notwhenstreaming;
 
-            cmd_startupdate(c, c->tag.s, arg);
+            if (arg && arg->count == 2 &&
+                !strcasecmp(strarray_nth(arg, 0), "SINCE")) {
+                /* UPDATE SINCE <version> - incremental update */
+                cmd_startupdate(c, c->tag.s, NULL, strarray_nth(arg, 1));
+                strarray_free(arg);
+            }
+            else {
+                cmd_startupdate(c, c->tag.s, arg, NULL);
+            }
         }
         else goto badcmd;
         break;
@@ -1076,6 +1125,8 @@ static void dobanner(struct conn *c)
 
     prot_printf(c->pout, "* PARTIAL-UPDATE\r\n");
 
+    prot_printf(c->pout, "* DELTA-UPDATE\r\n");
+
     prot_printf(c->pout,
                 "* OK MUPDATE \"%s\" \"Cyrus IMAP\" \"%s\" \"%s\"\r\n",
                 config_servername,
@@ -1387,6 +1438,51 @@ static void *thread_main(void *rock __attribute__((unused)))
     return NULL;
 }
 
+unsigned long long mupdate_version_load(const char *fname)
+{
+    char path[MAX_MAILBOX_PATH];
+    char buf[64];
+    int fd, n;
+
+    snprintf(path, sizeof(path), "%s%s", config_dir, fname);
+
+    fd = open(path, O_RDONLY, 0);
+    if (fd < 0) return 0;
+
+    n = read(fd, buf, sizeof(buf)-1);
+    close(fd);
+    if (n <= 0) return 0;
+
+    buf[n] = '\0';
+    return strtoull(buf, NULL, 10);
+}
+
+void mupdate_version_save(const char *fname, unsigned long long version)
+{
+    char path[MAX_MAILBOX_PATH];
+    char newpath[MAX_MAILBOX_PATH];
+    char buf[64];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s%s", config_dir, fname);
+    snprintf(newpath, sizeof(newpath), "%s.NEW", path);
+
+    fd = open(newpath, O_WRONLY|O_CREAT|O_TRUNC, 0640);
+    if (fd < 0) {
+        syslog(LOG_ERR, "IOERROR: creating %s: %m", newpath);
+        return;
+    }
+
+    snprintf(buf, sizeof(buf), "%llu\n", version);
+    if (retry_write(fd, buf, strlen(buf)) < 0 ||
+        fsync(fd) < 0 ||
+        rename(newpath, path) < 0) {
+        syslog(LOG_ERR, "IOERROR: writing %s: %m", path);
+    }
+
+    close(fd);
+}
+
 /* read from disk database must be unlocked. */
 static void database_init(void)
 {
@@ -1395,9 +1491,30 @@ static void database_init(void)
     mboxlist_init(0);
     mboxlist_open(NULL);
 
+    /* recover our change counter */
+    local_version = version_ceiling = mupdate_version_load(FNAME_MUPDATEVERSION);
+    version_loaded = 1;
+
     pthread_mutex_unlock(&mailboxes_mutex); /* UNLOCK */
 }
 
+/* note a change for the benefit of UPDATE SINCE clients.
+ * database must be locked. */
+static void database_note_change(const char *name)
+{
+    struct delta_ent *ent = &delta_ring[delta_count % DELTA_RING_SIZE];
+
+    local_version++;
+    if (local_version >= version_ceiling) {
+        version_ceiling = local_version + VERSION_SLACK;
+        mupdate_version_save(FNAME_MUPDATEVERSION, version_ceiling);
+    }
+
+    free(ent->mailbox);
+    ent->mailbox = xstrdup(name);
+    delta_count++;
+}
+
 /* log change to database. database must be locked. */
 static void database_log(const struct mbent *mb, struct txn **mytid)
 {
@@ -1439,6 +1556,90 @@ static void database_log(const struct mbent *mb, struct txn **mytid)
     }
 
     mboxlist_entry_free(&mbentry);
+
+    database_note_change(mb->mailbox);
+
+    /* keep the murder name filter in step with the database */
+    if (mbloom_map && mb->t != SET_DELETE)
+        bloom_add_raw(&mbloom_params, mbloom_map,
+                      mb->mailbox, strlen(mb->mailbox));
+}
+
+static int mupdate_bloom_addcb(const mbentry_t *mbentry,
+                               void *rock)
+{
+    struct bloom *filter = (struct bloom *) rock;
+
+    bloom_add(filter, mbentry->name, strlen(mbentry->name));
+    return 0;
+}
+
+/* rebuild the murder mailbox-name bloom filter from the local database
+ * and swap the new file into place, keeping it mapped so database_log()
+ * can OR in names as further updates stream in.  Deleted names linger
+ * in the filter until the next rebuild, which only costs readers a
+ * kick they would have made anyway.  Called by the slave after each
+ * successful resync. */
+void mupdate_bloom_rebuild(void)
+{
+    char path[MAX_MAILBOX_PATH];
+    char newpath[MAX_MAILBOX_PATH];
+    struct bloom filter;
+    const unsigned char *bits;
+    int len, fd;
+
+    if (!config_getswitch(IMAPOPT_MUPDATE_BLOOM)) return;
+
+    if (!mbloom_params.ready &&
+        bloom_init(&mbloom_params, MUPDATE_BLOOM_ENTRIES,
+                   MUPDATE_BLOOM_ERROR))
+        return;
+
+    if (bloom_init(&filter, MUPDATE_BLOOM_ENTRIES, MUPDATE_BLOOM_ERROR))
+        return;
+
+    pthread_mutex_lock(&mailboxes_mutex); /* LOCK */
+    mboxlist_allmbox("", &mupdate_bloom_addcb, &filter, 0);
+    pthread_mutex_unlock(&mailboxes_mutex); /* UNLOCK */
+
+    bits = bloom_bits(&filter, &len);
+
+    snprintf(path, sizeof(path), "%s%s", config_dir, FNAME_MUPDATE_BLOOM);
+    snprintf(newpath, sizeof(newpath), "%s.NEW", path);
+
+    fd = open(newpath, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        syslog(LOG_ERR, "IOERROR: creating %s: %m", newpath);
+        bloom_free(&filter);
+        return;
+    }
+
+    if (retry_write(fd, (const char *) bits, len) < 0 ||
+        fsync(fd) < 0 ||
+        rename(newpath, path) < 0) {
+        syslog(LOG_ERR, "IOERROR: writing %s: %m", path);
+        close(fd);
+        unlink(newpath);
+        bloom_free(&filter);
+        return;
+    }
+
+    /* swap in the map of the new file for incremental adds */
+    pthread_mutex_lock(&mailboxes_mutex); /* LOCK */
+    if (mbloom_map) munmap(mbloom_map, mbloom_maplen);
+    mbloom_map = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mbloom_map == MAP_FAILED) {
+        syslog(LOG_ERR, "IOERROR: mapping %s: %m", path);
+        mbloom_map = NULL;
+        mbloom_maplen = 0;
+    }
+    else {
+        mbloom_maplen = len;
+    }
+    pthread_mutex_unlock(&mailboxes_mutex); /* UNLOCK */
+
+    close(fd);
+    bloom_free(&filter);
 }
 
 /* lookup in database. database must be locked */
@@ -1576,6 +1777,7 @@ static void log_update(const char *mailbox,
         /* for each connection, add to pending list */
         struct pending *p = (struct pending *) xmalloc(sizeof(struct pending));
         p->next = NULL;
+        p->version = local_version;
         strlcpy(p->mailbox, mailbox, sizeof(p->mailbox));
 
         /* this might need to be inside the mutex, but I doubt it */
@@ -1909,8 +2111,11 @@ static struct prot_waitevent *sendupdates_evt(struct protstream *s __attribute__
 }
 
 static void cmd_startupdate(struct conn *C, const char *tag,
-                     strarray_t *partial)
+                     strarray_t *partial, const char *since)
 {
+    unsigned long long clientversion = 0;
+    int delta = 0;
+
     /* initialize my condition variable */
 
     /* The inital dump of the database can result in a lot of data,
@@ -1924,9 +2129,42 @@ static void cmd_startupdate(struct conn *C, const char *tag,
     updatelist = C;
     C->streaming = xstrdup(tag);
     C->streaming_hosts = partial;
+    C->streaming_version = since ? 1 : 0;
+
+    if (since) {
+        /* can we serve the delta from the ring of recent changes? */
+        clientversion = strtoull(since, NULL, 10);
+        if (clientversion <= local_version &&
+            local_version - clientversion <= delta_count &&
+            local_version - clientversion < DELTA_RING_SIZE) {
+            delta = 1;
+        }
+    }
 
-    /* dump initial list */
-    mboxlist_allmbox("", sendupdate, (void*)C, /*incdel*/0);
+    if (delta) {
+        /* replay just the changes the client missed.  Current state is
+         * looked up per mailbox, so replaying a name twice is harmless */
+        unsigned long long k;
+
+        for (k = delta_count - (local_version - clientversion);
+             k < delta_count; k++) {
+            cmd_find(C, C->streaming, delta_ring[k % DELTA_RING_SIZE].mailbox,
+                     0, 1);
+        }
+    }
+    else {
+        if (since) {
+            /* tell the client it can't apply this as a delta */
+            prot_printf(C->pout, "%s RESYNC \"full update follows\"\r\n", tag);
+        }
+
+        /* dump initial list */
+        mboxlist_allmbox("", sendupdate, (void*)C, /*incdel*/0);
+    }
+
+    if (since) {
+        prot_printf(C->pout, "%s VERSION %llu\r\n", tag, local_version);
+    }
 
     pthread_mutex_unlock(&mailboxes_mutex); /* UNLOCK */
 
@@ -1945,6 +2183,7 @@ static void cmd_startupdate(struct conn *C, const char *tag,
 static void sendupdates(struct conn *C, int flushnow)
 {
     struct pending *p, *q;
+    unsigned long long maxversion = 0;
 
     pthread_mutex_lock(&C->m);
 
@@ -1963,9 +2202,16 @@ static void sendupdates(struct conn *C, int flushnow)
          * notifications */
         cmd_find(C, C->streaming, q->mailbox, 0, 1);
 
+        if (q->version > maxversion) maxversion = q->version;
+
         free(q);
     }
 
+    /* let DELTA-UPDATE clients checkpoint how far they've got */
+    if (C->streaming_version && maxversion) {
+        prot_printf(C->pout, "%s VERSION %llu\r\n", C->streaming, maxversion);
+    }
+
     /* reschedule event for 'update_wait' seconds */
     C->ev->mark = time(NULL) + update_wait;
 
@@ -2107,6 +2353,11 @@ void shut_down(int code)
 {
     in_shutdown = 1;
 
+    /* remember exactly where our change counter got to, so clients that
+     * are current can resynchronize with an empty delta after restart */
+    if (version_loaded)
+        mupdate_version_save(FNAME_MUPDATEVERSION, local_version);
+
     cyrus_done();
 
     exit(code);
@@ -2299,7 +2550,9 @@ static int cmd_resync(struct mupdate_mailboxdata *mdata,
     }
 
     newm->mailbox = mpool_strdup(r->pool, mdata->mailbox);
-    newm->location = mpool_strdup(r->pool, mdata->location);
+    /* DELETEs carry no location */
+    newm->location = mpool_strdup(r->pool,
+                                  mdata->location ? mdata->location : "");
 
     if (mdata->acl) {
         strcpy(newm->acl, mdata->acl);
@@ -2311,6 +2564,9 @@ static int cmd_resync(struct mupdate_mailboxdata *mdata,
         newm->t = SET_ACTIVE;
     } else if (!strncmp(rock, "RESERVE", 7)) {
         newm->t = SET_RESERVE;
+    } else if (!strncmp(rock, "DELETE", 6)) {
+        /* only seen when the master is replaying a delta */
+        newm->t = SET_DELETE;
     } else {
         syslog(LOG_NOTICE,
                "bad mupdate command in cmd_resync: %s", rock);
@@ -2347,16 +2603,29 @@ static int sync_findall_cb(const mbentry_t *mbentry, void *rock)
 
 int mupdate_synchronize_remote(mupdate_handle *handle,
                                struct mbent_queue *remote_boxes,
-                               struct mpool *pool)
+                               struct mpool *pool, int *delta)
 {
     struct sync_rock rock;
+    unsigned long long lastseen = 0;
 
     if (!handle || !handle->saslcompleted) return 1;
 
     rock.pool = pool;
 
+    *delta = 0;
+    handle->saw_resync = 0;
+    handle->lastversion = 0;
+
     /* ask mupdate master for updates and set nonblocking */
-    prot_printf(handle->conn->out, "U01 UPDATE\r\n");
+    if (CAPA(handle->conn, CAPA_MUPDATE_DELTA)) {
+        /* ask for just the changes since the version we last synced;
+         * the master sends RESYNC first if it has to full-dump anyway */
+        lastseen = mupdate_version_load(FNAME_MASTERVERSION);
+        prot_printf(handle->conn->out, "U01 UPDATE SINCE %llu\r\n", lastseen);
+    }
+    else {
+        prot_printf(handle->conn->out, "U01 UPDATE\r\n");
+    }
 
     syslog(LOG_NOTICE,
            "scarfing mailbox list from master mupdate server");
@@ -2376,13 +2645,17 @@ int mupdate_synchronize_remote(mupdate_handle *handle,
         return 1;
     }
 
+    if (CAPA(handle->conn, CAPA_MUPDATE_DELTA) && !handle->saw_resync)
+        *delta = 1;
+
     /* Make socket nonblocking now */
     prot_NONBLOCK(handle->conn->in);
 
     return 0;
 }
 
-int mupdate_synchronize(struct mbent_queue *remote_boxes, struct mpool *pool)
+int mupdate_synchronize(struct mbent_queue *remote_boxes, struct mpool *pool,
+                        int delta)
 {
     struct mbent_queue local_boxes;
     struct mbent *l,*r;
@@ -2401,6 +2674,57 @@ int mupdate_synchronize(struct mbent_queue *remote_boxes, struct mpool *pool)
     syslog(LOG_NOTICE,
            "synchronizing mailbox list with master mupdate server");
 
+    if (delta) {
+        /* the queue is a replay of just the changes since the version
+         * we last synced - apply it as-is, no full comparison needed */
+        int changes = 0;
+
+        for (r = remote_boxes->head; r; r = r->next) {
+            /* same protection for locally hosted mailboxes in a unified
+             * murder as the full comparison below */
+            if (config_mupdate_config == IMAP_ENUM_MUPDATE_CONFIG_UNIFIED) {
+                struct mbent *lm = database_lookup(r->mailbox, NULL, pool);
+                if (lm && strchr(lm->location, '!') == NULL) {
+                    syslog(LOG_ERR, "local mailbox %s wrong in mailbox list",
+                           r->mailbox);
+                    continue;
+                }
+            }
+
+            if (r->t == SET_DELETE) {
+                mboxlist_deleteremote(r->mailbox, &tid);
+            }
+            else {
+                mbentry_t *mbentry = mboxlist_entry_create();
+                mbentry->name = xstrdupnull(r->mailbox);
+                mbentry->mbtype = (r->t == SET_RESERVE ? MBTYPE_RESERVE : 0);
+                mbentry->server = xstrdupnull(r->location);
+
+                c = strchr(mbentry->server, '!');
+                if (c) {
+                    *c++ = '\0';
+                    mbentry->partition = xstrdupnull(c);
+                }
+
+                mbentry->acl = xstrdupnull(r->acl);
+                mboxlist_insertremote(mbentry, &tid);
+                mboxlist_entry_free(&mbentry);
+            }
+
+            database_note_change(r->mailbox);
+            changes++;
+        }
+
+        if (tid) mboxlist_commit(tid);
+
+        syslog(LOG_NOTICE,
+               "mailbox list delta synchronization complete (%d changes)",
+               changes);
+
+        pthread_mutex_unlock(&mailboxes_mutex); /* UNLOCK */
+        return 0;
+    }
+
     local_boxes.head = NULL;
     local_boxes.tail = &(local_boxes.head);
 
@@ -2447,6 +2771,7 @@ int mupdate_synchronize(struct mbent_queue *remote_boxes, struct mpool *pool)
                     mbentry->acl = xstrdupnull(r->acl);
                     mboxlist_insertremote(mbentry, &tid);
                     mboxlist_entry_free(&mbentry);
+                    database_note_change(r->mailbox);
                 }
             }
             /* Okay, dump these two */
@@ -2473,6 +2798,7 @@ int mupdate_synchronize(struct mbent_queue *remote_boxes, struct mpool *pool)
                 err++;
             } else {
                 mboxlist_deleteremote(l->mailbox, &tid);
+                database_note_change(l->mailbox);
             }
             local_boxes.head = l->next;
         } else /* (ret > 0) */ {
@@ -2491,6 +2817,7 @@ int mupdate_synchronize(struct mbent_queue *remote_boxes, struct mpool *pool)
             mbentry->acl = xstrdupnull(r->acl);
             mboxlist_insertremote(mbentry, &tid);
             mboxlist_entry_free(&mbentry);
+            database_note_change(r->mailbox);
             remote_boxes->head = r->next;
         }
     }
@@ -2505,6 +2832,7 @@ int mupdate_synchronize(struct mbent_queue *remote_boxes, struct mpool *pool)
                 err++;
             } else {
                 mboxlist_deleteremote(l->mailbox, &tid);
+                database_note_change(l->mailbox);
             }
             local_boxes.head = l->next;
             l = local_boxes.head;
@@ -2526,6 +2854,7 @@ int mupdate_synchronize(struct mbent_queue *remote_boxes, struct mpool *pool)
             mbentry->acl = xstrdupnull(r->acl);
             mboxlist_insertremote(mbentry, &tid);
             mboxlist_entry_free(&mbentry);
+            database_note_change(r->mailbox);
             remote_boxes->head = r->next;
             r = remote_boxes->head;
         }
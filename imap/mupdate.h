@@ -77,6 +77,11 @@ struct mupdate_handle_s {
     struct mupdate_mailboxdata mailboxdata_buf;
 
     int saslcompleted;
+
+    /* For DELTA-UPDATE - the last VERSION the server reported, and
+     * whether it answered our UPDATE SINCE with a full dump instead */
+    unsigned long long lastversion;
+    int saw_resync;
 };
 
 enum settype {
@@ -109,17 +114,36 @@ void free_mbent(struct mbent *p);
 int cmd_change(struct mupdate_mailboxdata *mdata,
                const char *cmd, void *context);
 
+/* '*delta' is set if the server answered our UPDATE SINCE with a replay
+ * of just the changes since our last synced version */
 int mupdate_synchronize_remote(mupdate_handle *handle,
                                struct mbent_queue *remote_boxes,
-                               struct mpool *pool);
-/* Given an mbent_queue, will synchronize the local database to it */
-int mupdate_synchronize(struct mbent_queue *remote_boxes, struct mpool *pool);
+                               struct mpool *pool, int *delta);
+/* Given an mbent_queue, will synchronize the local database to it.
+ * If 'delta' is set the queue is applied as-is instead of compared
+ * against the full local list */
+int mupdate_synchronize(struct mbent_queue *remote_boxes, struct mpool *pool,
+                        int delta);
+
+/* Persistent version counter files, under {configdirectory}.
+ * FNAME_MUPDATEVERSION holds our own change counter (for serving
+ * UPDATE SINCE), FNAME_MASTERVERSION the last version we synced from
+ * our master (for requesting it) */
+#define FNAME_MUPDATEVERSION "/mupdate_version"
+#define FNAME_MASTERVERSION "/mupdate_master_version"
+
+unsigned long long mupdate_version_load(const char *fname);
+void mupdate_version_save(const char *fname, unsigned long long version);
 
 /* Signal that we are ready to accept connections */
 void mupdate_ready(void);
 void mupdate_unready(void);
 void mupdate_signal_db_synced(void);
 
+/* rebuild the murder mailbox-name bloom filter from the local
+ * database (no-op unless mupdate_bloom is enabled) */
+void mupdate_bloom_rebuild(void);
+
 /* --- internal client functions (mupdate-client.c) --- */
 /* these are used by the slave thread and by the client API */
 
@@ -79,6 +79,7 @@
 #include "append.h"
 #include "auth.h"
 #include "backend.h"
+#include "cyr_lock.h"
 #include "duplicate.h"
 #include "exitcodes.h"
 #include "global.h"
@@ -287,7 +288,8 @@ static int mlookup(const char *name, mbentry_t **mbentryptr)
     int r;
 
     r = mboxlist_lookup(name, &mbentry, NULL);
-    if (r == IMAP_MAILBOX_NONEXISTENT && config_mupdate_server) {
+    if (r == IMAP_MAILBOX_NONEXISTENT && config_mupdate_server &&
+        mupdate_bloom_check(name)) {
         kick_mupdate();
         mboxlist_entry_free(&mbentry);
         r = mboxlist_lookup(name, &mbentry, NULL);
@@ -2076,11 +2078,11 @@ static void cmd_authinfo_pass(char *pass)
             return;
         }
     }
-    else if (sasl_checkpass(nntp_saslconn,
-                            nntp_userid,
-                            strlen(nntp_userid),
-                            pass,
-                            strlen(pass))!=SASL_OK) {
+    else if (global_sasl_checkpass(nntp_saslconn,
+                                   &nntp_proxyctx,
+                                   nntp_userid,
+                                   pass,
+                                   NULL)!=SASL_OK) {
         syslog(LOG_NOTICE, "badlogin: %s plaintext %s %s",
                nntp_clienthost, nntp_userid, sasl_errdetail(nntp_saslconn));
         failedloginpause = config_getint(IMAPOPT_FAILEDLOGINPAUSE);
@@ -2101,7 +2103,7 @@ static void cmd_authinfo_pass(char *pass)
         prot_printf(nntp_out, "281 User logged in\r\n");
 
         /* nntp_authstate may have been set as a side effect
-         * of sasl_checkpass() calling mysasl_proxy_policy */
+         * of global_sasl_checkpass() running mysasl_proxy_policy */
         if (nntp_authstate)
             auth_freestate(nntp_authstate);
 
@@ -2856,23 +2858,304 @@ static void cmd_newnews(char *wild, time_t tstamp)
     free_wildmats(nrock.wild);
 }
 
+/*
+ * Group overview sidecar.  When nntpoverviewcache is enabled the
+ * overview fields of each served article are appended to a per-group
+ * cyrus.over file, so catch-up OVER/XOVER range requests are one
+ * sequential read of the sidecar instead of a cache record fetch and
+ * envelope parse per article.  Entries are appended (under a file
+ * lock) the first time an article's overview is served; articles not
+ * yet in the sidecar fall back to index_overview() and are
+ * backfilled.  A uidvalidity change invalidates the whole file.
+ */
+
+#define OVERCACHE_MAGIC     0x4e4f5652      /* "NOVR" */
+#define OVERCACHE_VERSION   1
+#define OVERCACHE_MAXTEXT   65536           /* sanity bound on one entry */
+
+struct overcache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t uidvalidity;
+    uint32_t pad;
+};
+
+/* on disk each record is uid/bytes/lines/textlen followed by the five
+ * overview strings NUL-terminated back to back */
+struct overcache_entry {
+    unsigned long bytes;
+    unsigned long lines;
+    const char *subj;
+    const char *from;
+    const char *date;
+    const char *msgid;
+    const char *ref;
+    /* the strings live in the same allocation, after the struct */
+};
+
+static struct {
+    char *mboxname;
+    uint32_t uidvalidity;
+    hash_table byuid;
+} overcache;
+
+static void overcache_close(void)
+{
+    if (overcache.mboxname) {
+        free_hash_table(&overcache.byuid, free);
+        free(overcache.mboxname);
+        overcache.mboxname = NULL;
+    }
+}
+
+/* rebuild an entry from the text blob; NULL if the blob is corrupt */
+static struct overcache_entry *overcache_parse(const char *text, size_t textlen,
+                                               uint32_t bytes, uint32_t lines)
+{
+    struct overcache_entry *entry;
+    const char *p, *end;
+    const char **fields[] = { NULL, NULL, NULL, NULL, NULL };
+    int i;
+
+    if (!textlen || text[textlen-1] != '\0') return NULL;
+
+    entry = xmalloc(sizeof(*entry) + textlen);
+    memcpy(entry + 1, text, textlen);
+    entry->bytes = bytes;
+    entry->lines = lines;
+
+    fields[0] = &entry->subj;
+    fields[1] = &entry->from;
+    fields[2] = &entry->date;
+    fields[3] = &entry->msgid;
+    fields[4] = &entry->ref;
+
+    p = (const char *)(entry + 1);
+    end = p + textlen;
+    for (i = 0 ; i < 5 ; i++) {
+        if (p >= end) {
+            free(entry);
+            return NULL;
+        }
+        *fields[i] = p;
+        p += strlen(p) + 1;
+    }
+    return entry;
+}
+
+static void overcache_load(struct mailbox *mailbox)
+{
+    const char *fname;
+    struct overcache_header header;
+    off_t good;
+    int corrupt = 0;
+    int fd;
+
+    if (overcache.mboxname &&
+        !strcmp(overcache.mboxname, mailbox->name) &&
+        overcache.uidvalidity == mailbox->i.uidvalidity)
+        return;
+
+    overcache_close();
+    overcache.mboxname = xstrdup(mailbox->name);
+    overcache.uidvalidity = mailbox->i.uidvalidity;
+    construct_hash_table(&overcache.byuid, 1024, 0);
+
+    fname = mailbox_meta_fname(mailbox, META_OVERVIEW);
+    if (!fname) return;
+
+    /* open for write and take the append lock so a torn or corrupt
+       tail can be truncated away - appends always go to the end of
+       the file, so anything left behind garbage would never be read
+       again and the file would just grow */
+    fd = open(fname, O_RDWR);
+    if (fd < 0) return;
+    if (lock_blocking(fd, fname) < 0) {
+        syslog(LOG_ERR, "IOERROR: locking %s: %m", fname);
+        close(fd);
+        return;
+    }
+
+    if (retry_read(fd, &header, sizeof(header)) != sizeof(header) ||
+        header.magic != OVERCACHE_MAGIC ||
+        header.version != OVERCACHE_VERSION ||
+        header.uidvalidity != mailbox->i.uidvalidity) {
+        /* stale, e.g. a uidvalidity bump; start over */
+        unlink(fname);
+        close(fd);      /* drops the lock */
+        return;
+    }
+
+    good = sizeof(header);
+    for (;;) {
+        uint32_t rec[4];    /* uid, bytes, lines, textlen */
+        struct overcache_entry *entry;
+        char *text;
+        char key[32];
+        ssize_t n;
+
+        n = retry_read(fd, rec, sizeof(rec));
+        if (!n) break;      /* clean end of file */
+        if (n != sizeof(rec)) {
+            corrupt = 1;
+            break;
+        }
+        if (!rec[3] || rec[3] > OVERCACHE_MAXTEXT) {
+            corrupt = 1;
+            break;
+        }
+        text = xmalloc(rec[3]);
+        if (retry_read(fd, text, rec[3]) != (ssize_t)rec[3]) {
+            /* a partial append; everything before it is still good */
+            free(text);
+            corrupt = 1;
+            break;
+        }
+        entry = overcache_parse(text, rec[3], rec[1], rec[2]);
+        free(text);
+        if (!entry) {
+            corrupt = 1;
+            break;
+        }
+        snprintf(key, sizeof(key), "%u", rec[0]);
+        free(hash_del(key, &overcache.byuid));
+        hash_insert(key, entry, &overcache.byuid);
+        good += sizeof(rec) + rec[3];
+    }
+
+    /* chop the bad tail off so future appends are readable again */
+    if (corrupt && ftruncate(fd, good) < 0) {
+        syslog(LOG_ERR, "IOERROR: truncating %s: %m", fname);
+        unlink(fname);
+    }
+
+    close(fd);      /* drops the lock */
+}
+
+static struct overcache_entry *overcache_get(uint32_t uid)
+{
+    char key[32];
+
+    if (!overcache.mboxname) return NULL;
+    snprintf(key, sizeof(key), "%u", uid);
+    return hash_lookup(key, &overcache.byuid);
+}
+
+/* best-effort append; a failure just means the next reader rebuilds */
+static void overcache_append(struct mailbox *mailbox,
+                             const struct nntp_overview *over)
+{
+    const char *fname = mailbox_meta_fname(mailbox, META_OVERVIEW);
+    struct buf data = BUF_INITIALIZER;
+    struct overcache_header header;
+    struct overcache_entry *entry;
+    struct stat sbuf;
+    uint32_t rec[4];
+    char key[32];
+    int fd;
+
+    if (!fname) return;
+
+    /* serialise the five strings NUL-terminated back to back */
+    buf_appendcstr(&data, over->subj ? over->subj : "");
+    buf_putc(&data, '\0');
+    buf_appendcstr(&data, over->from ? over->from : "");
+    buf_putc(&data, '\0');
+    buf_appendcstr(&data, over->date ? over->date : "");
+    buf_putc(&data, '\0');
+    buf_appendcstr(&data, over->msgid ? over->msgid : "");
+    buf_putc(&data, '\0');
+    buf_appendcstr(&data, over->ref ? over->ref : "");
+    buf_putc(&data, '\0');
+
+    if (data.len > OVERCACHE_MAXTEXT) {
+        buf_free(&data);
+        return;
+    }
+
+    rec[0] = over->uid;
+    rec[1] = over->bytes;
+    rec[2] = over->lines;
+    rec[3] = data.len;
+
+    fd = open(fname, O_WRONLY|O_CREAT, 0666);
+    if (fd < 0 || lock_blocking(fd, fname) < 0) {
+        syslog(LOG_ERR, "IOERROR: locking %s: %m", fname);
+        if (fd >= 0) close(fd);
+        buf_free(&data);
+        return;
+    }
+
+    /* first writer lays down the header */
+    if (fstat(fd, &sbuf) < 0) sbuf.st_size = -1;
+    if (sbuf.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        header.magic = OVERCACHE_MAGIC;
+        header.version = OVERCACHE_VERSION;
+        header.uidvalidity = mailbox->i.uidvalidity;
+        if (retry_write(fd, &header, sizeof(header)) != sizeof(header))
+            sbuf.st_size = -1;
+    }
+    else if (sbuf.st_size > 0) {
+        lseek(fd, 0, SEEK_END);
+    }
+
+    if (sbuf.st_size < 0 ||
+        retry_write(fd, rec, sizeof(rec)) != sizeof(rec) ||
+        retry_write(fd, data.s, data.len) != (ssize_t)data.len) {
+        syslog(LOG_ERR, "IOERROR: appending to %s: %m", fname);
+    }
+    else if (overcache.mboxname && !strcmp(overcache.mboxname, mailbox->name)) {
+        entry = overcache_parse(data.s, data.len, rec[1], rec[2]);
+        if (entry) {
+            snprintf(key, sizeof(key), "%u", over->uid);
+            free(hash_del(key, &overcache.byuid));
+            hash_insert(key, entry, &overcache.byuid);
+        }
+    }
+
+    close(fd);      /* drops the lock */
+    buf_free(&data);
+}
+
 static void cmd_over(char *msgid, unsigned long uid, unsigned long last)
 {
     uint32_t msgno, last_msgno;
     struct nntp_overview *over;
+    int usecache = config_getswitch(IMAPOPT_NNTPOVERVIEWCACHE);
     int found = 0;
 
+    if (usecache) overcache_load(group_state->mailbox);
+
     msgno = index_finduid(group_state, uid);
     if (!msgno || index_getuid(group_state, msgno) != uid) msgno++;
     last_msgno = index_finduid(group_state, last);
 
     for (; msgno <= last_msgno; msgno++) {
+        struct buf xref = BUF_INITIALIZER;
+
         if (!found++)
             prot_printf(nntp_out, "224 Overview information follows:\r\n");
 
-        if ((over = index_overview(group_state, msgno))) {
-            struct buf xref = BUF_INITIALIZER;
+        if (usecache) {
+            const struct overcache_entry *entry =
+                overcache_get(index_getuid(group_state, msgno));
+
+            if (entry) {
+                build_xref(entry->msgid, &xref, 0);
+                prot_printf(nntp_out,
+                            "%lu\t%s\t%s\t%s\t%s\t%s\t%lu\t%lu\t%s\r\n",
+                            msgid ? 0 : (unsigned long)index_getuid(group_state, msgno),
+                            entry->subj, entry->from, entry->date,
+                            entry->msgid, entry->ref,
+                            entry->bytes + xref.len + 2, /* +2 for \r\n */
+                            entry->lines, buf_cstring(&xref));
+                buf_free(&xref);
+                continue;
+            }
+        }
 
+        if ((over = index_overview(group_state, msgno))) {
             build_xref(over->msgid, &xref, 0);
 
             prot_printf(nntp_out, "%lu\t%s\t%s\t%s\t%s\t%s\t%lu\t%lu\t%s\r\n",
@@ -2884,8 +3167,10 @@ static void cmd_over(char *msgid, unsigned long uid, unsigned long last)
                         over->ref ? over->ref : "",
                         over->bytes + xref.len + 2, /* +2 for \r\n */
                         over->lines, buf_cstring(&xref));
-            buf_free(&xref);
+
+            if (usecache) overcache_append(group_state->mailbox, over);
         }
+        buf_free(&xref);
     }
 
     if (found)
@@ -92,6 +92,7 @@
 #include "imap/imap_err.h"
 
 #include "sync_log.h"
+#include "retry.h"
 #include "statuscache.h"
 
 #include "iostat.h"
@@ -357,21 +358,20 @@ static void popd_reset(void)
         prot_NONBLOCK(popd_in);
         prot_fill(popd_in);
         bytes_in = prot_bytes_in(popd_in);
-        prot_free(popd_in);
+        /* keep the stream (and its buffer) for the next connection */
+        prot_reuse(popd_in, 0, 0);
     }
 
     if (popd_out) {
         prot_flush(popd_out);
         bytes_out = prot_bytes_out(popd_out);
-        prot_free(popd_out);
+        prot_reuse(popd_out, 1, 1);
     }
 
     if (config_auditlog)
         syslog(LOG_NOTICE, "auditlog: traffic sessionid=<%s> bytes_in=<%d> bytes_out=<%d>",
                            session_id(), bytes_in, bytes_out);
 
-    popd_in = popd_out = NULL;
-
 #ifdef HAVE_SSL
     if (tls_conn) {
         tls_reset_servertls(&tls_conn);
@@ -523,8 +523,10 @@ int service_main(int argc __attribute__((unused)),
 
     sync_log_init();
 
-    popd_in = prot_new(0, 0);
-    popd_out = prot_new(1, 1);
+    /* the streams survive from the previous connection unless this is
+     * the first one (or shut_down tore them down) */
+    if (!popd_in) popd_in = prot_new(0, 0);
+    if (!popd_out) popd_out = prot_new(1, 1);
 
     count_retr = 0;
     count_top = 0;
@@ -1489,6 +1491,7 @@ static void cmd_user(char *user)
 
 static void cmd_pass(char *pass)
 {
+    const char *sasluser = NULL;
     int failedloginpause;
 
     if (!popd_userid) {
@@ -1533,11 +1536,11 @@ static void cmd_pass(char *pass)
             return;
         }
     }
-    else if (sasl_checkpass(popd_saslconn,
-                            popd_userid,
-                            strlen(popd_userid),
-                            pass,
-                            strlen(pass))!=SASL_OK) {
+    else if (global_sasl_checkpass(popd_saslconn,
+                                   &popd_proxyctx,
+                                   popd_userid,
+                                   pass,
+                                   &sasluser)!=SASL_OK) {
         syslog(LOG_NOTICE, "badlogin: %s plaintext %s %s",
                popd_clienthost, popd_userid, sasl_errdetail(popd_saslconn));
         failedloginpause = config_getint(IMAPOPT_FAILEDLOGINPAUSE);
@@ -1553,27 +1556,14 @@ static void cmd_pass(char *pass)
     }
     else {
         /* successful authentication */
-        int sasl_result, plaintextloginpause;
-        const void *val;
+        int plaintextloginpause;
 
         free(popd_userid);
-        popd_userid = 0;
 
-        /* get the userid from SASL --- already canonicalized from
-         * mysasl_proxy_policy()
+        /* 'sasluser' is the canonical userid from SASL --- already
+         * canonicalized from mysasl_proxy_policy()
          */
-        sasl_result = sasl_getprop(popd_saslconn, SASL_USERNAME, &val);
-        if (sasl_result != SASL_OK) {
-            prot_printf(popd_out,
-                        "-ERR [AUTH] weird SASL error %d getting SASL_USERNAME\r\n",
-                        sasl_result);
-            if (popd_subfolder) {
-                free(popd_subfolder);
-                popd_subfolder = 0;
-            }
-            return;
-        }
-        popd_userid = xstrdup((const char *) val);
+        popd_userid = xstrdup(sasluser);
 
         syslog(LOG_NOTICE, "login: %s %s%s plaintext%s %s SESSIONID=<%s>", popd_clienthost,
                popd_userid, popd_subfolder ? popd_subfolder : "",
@@ -1587,7 +1577,7 @@ static void cmd_pass(char *pass)
     }
 
     /* popd_authstate may have been set as a side effect
-     * of sasl_checkpass() calling mysasl_proxy_policy */
+     * of global_sasl_checkpass() running mysasl_proxy_policy */
     if (popd_authstate)
         auth_freestate(popd_authstate);
 
@@ -1806,6 +1796,144 @@ static void cmd_auth(char *arg)
     }
 }
 
+/*
+ * Maildrop snapshot cache.  When popmaildropcache is enabled the
+ * msgno/size/uid table we serve to POP clients is saved next to the
+ * mailbox index as cyrus.pop, keyed by the index highestmodseq (plus
+ * the settings which shape the table).  Most POP logins are polls of
+ * an unchanged maildrop, which can then reload the table from one
+ * small host-local file instead of walking the index records.
+ */
+
+#define POPCACHE_MAGIC      0x504f5043      /* "POPC" */
+#define POPCACHE_VERSION    2
+
+struct popcache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t uidvalidity;
+    uint32_t exists;
+    uint64_t highestmodseq;
+    uint64_t show_after;
+    uint32_t useimapflags;
+    /* repack renumbers recnos without moving highestmodseq (expunged
+     * records are removed silently), so the snapshot is only valid
+     * for the index generation it was taken from */
+    uint32_t generation_no;
+};
+
+struct popcache_record {
+    uint32_t uid;
+    uint32_t recno;
+    uint32_t size;
+};
+
+/* load the snapshot if it matches the current mailbox state;
+ * returns nonzero and leaves *mapp alone on any mismatch */
+static int popcache_read(struct mailbox *mailbox,
+                         struct msg **mapp, uint32_t *existsp)
+{
+    const char *fname = mailbox_meta_fname(mailbox, META_POPCACHE);
+    struct popcache_header header;
+    struct popcache_record *records = NULL;
+    struct msg *map;
+    size_t len;
+    unsigned i;
+    int fd = -1;
+    int r = -1;
+
+    if (!fname) return -1;
+    fd = open(fname, O_RDONLY);
+    if (fd < 0) return -1;
+
+    if (retry_read(fd, &header, sizeof(header)) != sizeof(header))
+        goto out;
+    if (header.magic != POPCACHE_MAGIC ||
+        header.version != POPCACHE_VERSION ||
+        header.uidvalidity != mailbox->i.uidvalidity ||
+        header.highestmodseq != mailbox->i.highestmodseq ||
+        header.show_after != (uint64_t)mailbox->i.pop3_show_after ||
+        header.useimapflags != (uint32_t)config_popuseimapflags ||
+        header.generation_no != mailbox->i.generation_no ||
+        header.exists > mailbox->i.exists)
+        goto out;
+
+    len = header.exists * sizeof(struct popcache_record);
+    records = xmalloc(len ? len : 1);
+    if (retry_read(fd, records, len) != (ssize_t)len)
+        goto out;
+
+    map = xmalloc(header.exists * sizeof(struct msg));
+    for (i = 0 ; i < header.exists ; i++) {
+        map[i].uid = records[i].uid;
+        map[i].recno = records[i].recno;
+        map[i].size = records[i].size;
+        map[i].deleted = 0;
+        map[i].seen = 0;
+    }
+    free(*mapp);
+    *mapp = map;
+    *existsp = header.exists;
+    r = 0;
+
+out:
+    free(records);
+    close(fd);
+    return r;
+}
+
+/* best-effort: a failed write just means the next login rebuilds */
+static void popcache_write(struct mailbox *mailbox,
+                           const struct msg *map, unsigned exists)
+{
+    const char *newfname = mailbox_meta_newfname(mailbox, META_POPCACHE);
+    struct popcache_header header;
+    struct popcache_record *records = NULL;
+    size_t len;
+    unsigned i;
+    int fd = -1;
+    int r;
+
+    if (!newfname) return;
+    fd = open(newfname, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0) {
+        syslog(LOG_ERR, "IOERROR: creating %s: %m", newfname);
+        return;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = POPCACHE_MAGIC;
+    header.version = POPCACHE_VERSION;
+    header.uidvalidity = mailbox->i.uidvalidity;
+    header.exists = exists;
+    header.highestmodseq = mailbox->i.highestmodseq;
+    header.show_after = (uint64_t)mailbox->i.pop3_show_after;
+    header.useimapflags = (uint32_t)config_popuseimapflags;
+    header.generation_no = mailbox->i.generation_no;
+
+    len = exists * sizeof(struct popcache_record);
+    records = xmalloc(len ? len : 1);
+    for (i = 0 ; i < exists ; i++) {
+        records[i].uid = map[i].uid;
+        records[i].recno = map[i].recno;
+        records[i].size = map[i].size;
+    }
+
+    r = (retry_write(fd, &header, sizeof(header)) == sizeof(header) &&
+         retry_write(fd, records, len) == (ssize_t)len);
+    if (close(fd) < 0) r = 0;
+    free(records);
+
+    if (!r) {
+        syslog(LOG_ERR, "IOERROR: writing %s: %m", newfname);
+        unlink(newfname);
+        return;
+    }
+
+    if (mailbox_meta_rename(mailbox, META_POPCACHE))
+        syslog(LOG_ERR, "IOERROR: renaming %s: %m", newfname);
+}
+
 /*
  * Complete the login process by opening and locking the user's inbox
  */
@@ -1947,38 +2075,49 @@ int openinbox(void)
             goto fail;
         }
 
-        free(popd_map);
-        popd_map = (struct msg *)xmalloc(popd_mailbox->i.exists *
-                                         sizeof(struct msg));
         config_popuseimapflags = config_getswitch(IMAPOPT_POPUSEIMAPFLAGS);
+        int usecache = config_getswitch(IMAPOPT_POPMAILDROPCACHE);
         exists = 0;
 
-        unsigned iterflags = ITER_SKIP_EXPUNGED;
-        if (config_popuseimapflags) iterflags |= ITER_SKIP_DELETED;
+        if (!usecache || popcache_read(popd_mailbox, &popd_map, &exists)) {
+            free(popd_map);
+            popd_map = (struct msg *)xmalloc(popd_mailbox->i.exists *
+                                             sizeof(struct msg));
+
+            unsigned iterflags = ITER_SKIP_EXPUNGED;
+            if (config_popuseimapflags) iterflags |= ITER_SKIP_DELETED;
+
+            struct mailbox_iter *iter = mailbox_iter_init(popd_mailbox, 0, iterflags);
+
+            const message_t *msg;
+            while ((msg = mailbox_iter_step(iter))) {
+                const struct index_record *record = msg_record(msg);
+                if (popd_mailbox->i.pop3_show_after &&
+                    record->internaldate <= popd_mailbox->i.pop3_show_after) {
+                    /* Ignore messages older than the "show after" date */
+                    continue;
+                }
 
-        struct mailbox_iter *iter = mailbox_iter_init(popd_mailbox, 0, iterflags);
+                popd_map[exists].recno = record->recno;
+                popd_map[exists].uid = record->uid;
+                popd_map[exists].size = record->size;
+                popd_map[exists].deleted = 0;
+                popd_map[exists].seen = 0;
+                exists++;
 
-        const message_t *msg;
-        while ((msg = mailbox_iter_step(iter))) {
-            const struct index_record *record = msg_record(msg);
-            if (popd_mailbox->i.pop3_show_after &&
-                record->internaldate <= popd_mailbox->i.pop3_show_after) {
-                /* Ignore messages older than the "show after" date */
-                continue;
+                if (exists >= popd_mailbox->i.exists)
+                    break; /* we're full! */
             }
 
-            popd_map[exists].recno = record->recno;
-            popd_map[exists].uid = record->uid;
-            popd_map[exists].size = record->size;
-            popd_map[exists].deleted = 0;
-            popd_map[exists].seen = 0;
-            exists++;
+            mailbox_iter_done(&iter);
 
-            if (exists >= popd_mailbox->i.exists)
-                break; /* we're full! */
+            if (usecache)
+                popcache_write(popd_mailbox, popd_map, exists);
+        }
+        else {
+            syslog(LOG_DEBUG, "%s: maildrop snapshot hit (%u messages)",
+                   mbname_intname(mbname), exists);
         }
-
-        mailbox_iter_done(&iter);
 
         popd_exists = exists;
 
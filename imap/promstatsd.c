@@ -0,0 +1,374 @@
+/* promstatsd.c -- serve server statistics in Prometheus text format
+ *
+ * Copyright (c) 1994-2016 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A lightweight master SERVICE which answers "GET /metrics" with the
+ * server's shared-memory statistics in Prometheus text exposition
+ * format: the xstats operation timers, the lockstat lock wait
+ * statistics, and a per-service count of registered server processes
+ * from the proc directory.  Run it from cyrus.conf, e.g.
+ *
+ *   promstatsd cmd="promstatsd" listen="127.0.0.1:9143"
+ *
+ * Every connection is a fresh snapshot; there is no state between
+ * requests, so the service is safe to put behind any scrape interval.
+ */
+
+#include <config.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <signal.h>
+
+#include "exitcodes.h"
+#include "global.h"
+#include "hash.h"
+#include "lockstat.h"
+#include "proc.h"
+#include "prot.h"
+#include "util.h"
+#include "xmalloc.h"
+#include "xstats.h"
+
+/* config.c info */
+const int config_need_data = 0;
+
+static struct protstream *stats_in, *stats_out;
+
+static void promstatsd_reset(void)
+{
+    if (stats_in) {
+        prot_NONBLOCK(stats_in);
+        prot_fill(stats_in);
+        prot_free(stats_in);
+    }
+
+    if (stats_out) {
+        prot_flush(stats_out);
+        prot_free(stats_out);
+    }
+
+    stats_in = stats_out = NULL;
+
+    cyrus_reset_stdio();
+}
+
+void shut_down(int code) __attribute__((noreturn));
+void shut_down(int code)
+{
+    in_shutdown = 1;
+
+    promstatsd_reset();
+
+    cyrus_done();
+    exit(code);
+}
+
+EXPORTED void fatal(const char* s, int code)
+{
+    static int recurse_code = 0;
+    if (recurse_code) {
+        /* We were called recursively. Just give up */
+        exit(code);
+    }
+    recurse_code = code;
+    syslog(LOG_ERR, "Fatal error: %s", s);
+
+    shut_down(code);
+}
+
+/* ====================================================================== */
+
+/* upper bound in seconds of xstats timer histogram bucket 'idx',
+ * inverting the log-linear bucketing in xstats.c */
+static double timer_bucket_bound(int idx)
+{
+    int k, sub;
+
+    if (idx < XSTATS_TIMER_SUBBUCKETS)
+        return (idx + 1) / 1e6;
+
+    k = idx / XSTATS_TIMER_SUBBUCKETS + 1;
+    sub = idx % XSTATS_TIMER_SUBBUCKETS;
+    return ((1ULL << k) + (uint64_t)(sub + 1) * (1ULL << (k-2))) / 1e6;
+}
+
+static void emit_timers(struct buf *buf)
+{
+    const struct xstats_map *map = xstats_map_readonly();
+    uint32_t i;
+    int b;
+
+    if (!map) return;
+
+    buf_appendcstr(buf,
+        "# HELP cyrus_timer_duration_seconds Time spent in instrumented server operations.\n"
+        "# TYPE cyrus_timer_duration_seconds histogram\n");
+    for (i = 0 ; i < map->ntimers ; i++) {
+        const struct xstats_timing *t = &map->timers[i];
+        char name[XSTATS_TIMER_NAMELEN];
+        uint64_t cum = 0;
+
+        if (!t->count) continue;
+        strlcpy(name, t->name, sizeof(name));
+        lcase(name);
+
+        for (b = 0 ; b < XSTATS_TIMER_NBUCKETS ; b++) {
+            cum += t->buckets[b];
+            if (!t->buckets[b]) continue;
+            buf_printf(buf, "cyrus_timer_duration_seconds_bucket"
+                            "{timer=\"%s\",le=\"%g\"} %llu\n",
+                       name, timer_bucket_bound(b),
+                       (unsigned long long)cum);
+        }
+        buf_printf(buf, "cyrus_timer_duration_seconds_bucket"
+                        "{timer=\"%s\",le=\"+Inf\"} %llu\n",
+                   name, (unsigned long long)t->count);
+        buf_printf(buf, "cyrus_timer_duration_seconds_sum{timer=\"%s\"} %g\n",
+                   name, t->total_usec / 1e6);
+        buf_printf(buf, "cyrus_timer_duration_seconds_count{timer=\"%s\"} %llu\n",
+                   name, (unsigned long long)t->count);
+    }
+
+    buf_appendcstr(buf,
+        "# HELP cyrus_timer_max_seconds Longest observed duration of each operation.\n"
+        "# TYPE cyrus_timer_max_seconds gauge\n");
+    for (i = 0 ; i < map->ntimers ; i++) {
+        const struct xstats_timing *t = &map->timers[i];
+        char name[XSTATS_TIMER_NAMELEN];
+
+        if (!t->count) continue;
+        strlcpy(name, t->name, sizeof(name));
+        lcase(name);
+        buf_printf(buf, "cyrus_timer_max_seconds{timer=\"%s\"} %g\n",
+                   name, t->max_usec / 1e6);
+    }
+}
+
+static void emit_locks(struct buf *buf)
+{
+    const struct lockstat_map *map = lockstat_map_readonly();
+    uint32_t i;
+    int b;
+
+    if (!map) return;
+
+    buf_appendcstr(buf,
+        "# HELP cyrus_lock_acquisitions_total Successful lock acquisitions per lock class.\n"
+        "# TYPE cyrus_lock_acquisitions_total counter\n"
+        "# HELP cyrus_lock_contended_total Lock acquisitions which had to wait.\n"
+        "# TYPE cyrus_lock_contended_total counter\n"
+        "# HELP cyrus_lock_failures_total Nonblocking lock misses and errors.\n"
+        "# TYPE cyrus_lock_failures_total counter\n");
+    for (i = 0 ; i < map->nslots ; i++) {
+        const struct lockstat_slot *slot = &map->slots[i];
+
+        if (!slot->class[0]) continue;
+        buf_printf(buf, "cyrus_lock_acquisitions_total{class=\"%s\"} %llu\n",
+                   slot->class, (unsigned long long)slot->acquisitions);
+        buf_printf(buf, "cyrus_lock_contended_total{class=\"%s\"} %llu\n",
+                   slot->class, (unsigned long long)slot->contended);
+        buf_printf(buf, "cyrus_lock_failures_total{class=\"%s\"} %llu\n",
+                   slot->class, (unsigned long long)slot->failures);
+    }
+
+    buf_appendcstr(buf,
+        "# HELP cyrus_lock_wait_seconds Time spent waiting for locks per lock class.\n"
+        "# TYPE cyrus_lock_wait_seconds histogram\n");
+    for (i = 0 ; i < map->nslots ; i++) {
+        const struct lockstat_slot *slot = &map->slots[i];
+        uint64_t cum = 0;
+
+        if (!slot->class[0]) continue;
+        for (b = 0 ; b < LOCKSTAT_NBUCKETS ; b++) {
+            cum += slot->hist[b];
+            if (!slot->hist[b]) continue;
+            buf_printf(buf, "cyrus_lock_wait_seconds_bucket"
+                            "{class=\"%s\",le=\"%g\"} %llu\n",
+                       slot->class, (1ULL << (b+1)) / 1e6,
+                       (unsigned long long)cum);
+        }
+        buf_printf(buf, "cyrus_lock_wait_seconds_bucket"
+                        "{class=\"%s\",le=\"+Inf\"} %llu\n",
+                   slot->class, (unsigned long long)slot->acquisitions);
+        buf_printf(buf, "cyrus_lock_wait_seconds_sum{class=\"%s\"} %g\n",
+                   slot->class, slot->wait_usec / 1e6);
+        buf_printf(buf, "cyrus_lock_wait_seconds_count{class=\"%s\"} %llu\n",
+                   slot->class, (unsigned long long)slot->acquisitions);
+    }
+}
+
+static int count_proc(pid_t pid __attribute__((unused)),
+                      const char *servicename,
+                      const char *clienthost __attribute__((unused)),
+                      const char *userid __attribute__((unused)),
+                      const char *mailbox __attribute__((unused)),
+                      const char *cmd __attribute__((unused)),
+                      void *rock)
+{
+    hash_table *counts = rock;
+    int *np;
+
+    if (!servicename || !servicename[0]) servicename = "unknown";
+    np = hash_lookup(servicename, counts);
+    if (!np) {
+        np = xzmalloc(sizeof(*np));
+        hash_insert(servicename, np, counts);
+    }
+    (*np)++;
+    return 0;
+}
+
+static void emit_one_service(const char *key, void *data, void *rock)
+{
+    buf_printf((struct buf *)rock,
+               "cyrus_service_processes{service=\"%s\"} %d\n",
+               key, *(int *)data);
+}
+
+static void emit_services(struct buf *buf)
+{
+    hash_table counts;
+
+    construct_hash_table(&counts, 64, 0);
+    proc_foreach(count_proc, &counts);
+
+    buf_appendcstr(buf,
+        "# HELP cyrus_service_processes Server processes registered in the proc directory.\n"
+        "# TYPE cyrus_service_processes gauge\n");
+    hash_enumerate(&counts, emit_one_service, buf);
+    free_hash_table(&counts, free);
+}
+
+/* ====================================================================== */
+
+static void send_response(const char *status, const struct buf *body)
+{
+    prot_printf(stats_out, "HTTP/1.0 %s\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: %lu\r\n"
+                           "Connection: close\r\n"
+                           "\r\n",
+                status, (unsigned long)body->len);
+    prot_write(stats_out, body->s, body->len);
+    prot_flush(stats_out);
+}
+
+static void begin_handling(void)
+{
+    struct buf body = BUF_INITIALIZER;
+    char method[8], path[256];
+    char line[1024];
+
+    if (!prot_fgets(line, sizeof(line), stats_in)) return;
+    if (sscanf(line, "%7s %255s", method, path) != 2) {
+        buf_setcstr(&body, "bad request\n");
+        send_response("400 Bad Request", &body);
+        goto out;
+    }
+
+    /* drain the request headers; we don't use any of them */
+    while (prot_fgets(line, sizeof(line), stats_in)) {
+        if (!strcmp(line, "\r\n") || !strcmp(line, "\n")) break;
+    }
+
+    if (strcmp(method, "GET")) {
+        buf_setcstr(&body, "only GET is supported\n");
+        send_response("405 Method Not Allowed", &body);
+        goto out;
+    }
+    if (strcmp(path, "/metrics") && strcmp(path, "/")) {
+        buf_setcstr(&body, "try /metrics\n");
+        send_response("404 Not Found", &body);
+        goto out;
+    }
+
+    emit_timers(&body);
+    emit_locks(&body);
+    emit_services(&body);
+    send_response("200 OK", &body);
+
+out:
+    buf_free(&body);
+}
+
+/*
+ * run once when process is forked;
+ * MUST NOT exit directly; must return with non-zero error code
+ */
+int service_init(int argc, char **argv, char **envp)
+{
+    if (geteuid() == 0) fatal("must run as the Cyrus user", EC_USAGE);
+
+    setproctitle_init(argc, argv, envp);
+
+    signals_set_shutdown(&shut_down);
+    signal(SIGPIPE, SIG_IGN);
+
+    return 0;
+}
+
+/* Called by service API to shut down the service */
+void service_abort(int error)
+{
+    shut_down(error);
+}
+
+int service_main(int argc __attribute__((unused)),
+                 char **argv __attribute__((unused)),
+                 char **envp __attribute__((unused)))
+{
+    stats_in = prot_new(0, 0);
+    stats_out = prot_new(1, 1);
+    prot_setflushonread(stats_in, stats_out);
+    prot_settimeout(stats_in, 60);
+
+    begin_handling();
+
+    /* one request per connection, like any scrape target */
+    promstatsd_reset();
+    return 0;
+}
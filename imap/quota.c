@@ -54,6 +54,7 @@
 #include <netinet/in.h>
 #include <sys/stat.h>
 #include <sys/poll.h>
+#include <sys/wait.h>
 
 #if HAVE_DIRENT_H
 # include <dirent.h>
@@ -82,6 +83,7 @@
 #include "mboxname.h"
 #include "quota.h"
 #include "convert_code.h"
+#include "strhash.h"
 #include "util.h"
 #include <jansson.h>
 
@@ -96,6 +98,7 @@ static struct namespace quota_namespace;
 
 struct quotaentry {
     char *name;
+    char *scanmbox;     /* resume point from an interrupted run */
     int refcount;
     int deleted;
 };
@@ -119,8 +122,20 @@ static int quota_todo = 0;
 
 static int test_sync_mode = 0;
 
+/* sharded fix mode: nworkers > 1 forks that many children, each owning
+ * the quota roots (and rootless mailboxes) that hash into its slice */
+static int nworkers = 0;
+static int worker = -1;
+static int resume_mode = 0;
+
 static json_t *jsonout;
 
+static int root_mine(int thisquota)
+{
+    if (nworkers < 2) return 1;
+    return (int)(strhash(quotaroots[thisquota].name) % nworkers) == worker;
+}
+
 int main(int argc,char **argv)
 {
     int opt;
@@ -134,7 +149,7 @@ int main(int argc,char **argv)
         fatal("must run as the Cyrus user", EC_USAGE);
     }
 
-    while ((opt = getopt(argc, argv, "C:d:fqJZ")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:d:fj:qrJZ")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -152,6 +167,15 @@ int main(int argc,char **argv)
             fflag = 1;
             break;
 
+        case 'j':
+            nworkers = atoi(optarg);
+            if (nworkers < 1) usage();
+            break;
+
+        case 'r':
+            resume_mode = 1;
+            break;
+
         case 'J':
             jsonout = json_object();
             break;
@@ -166,6 +190,10 @@ int main(int argc,char **argv)
         }
     }
 
+    /* -j and -r only make sense when fixing */
+    if ((nworkers > 1 || resume_mode) && !fflag)
+        usage();
+
     /* always report if not fixing, otherwise we do nothing */
     if (!fflag)
         do_report = 1;
@@ -213,8 +241,10 @@ int main(int argc,char **argv)
     mboxlist_done();
 
     /* just for neatness */
-    for (i = 0; i < quota_num; i++)
+    for (i = 0; i < quota_num; i++) {
         free(quotaroots[i].name);
+        free(quotaroots[i].scanmbox);
+    }
     free(quotaroots);
 
     if (jsonout) json_decref(jsonout);
@@ -227,7 +257,7 @@ int main(int argc,char **argv)
 static void usage(void)
 {
     fprintf(stderr,
-            "usage: quota [-C <alt_config>] [-d <domain>] [-f] [-q] [prefix]...\n");
+            "usage: quota [-C <alt_config>] [-d <domain>] [-f [-j <nworkers>] [-r]] [-q] [prefix]...\n");
     exit(EC_USAGE);
 }
 
@@ -336,16 +366,23 @@ static int fixquota_addroot(struct quota *q,
         goto done;
     }
 
-    /* clean the scanused data if present */
+    /* clean the scanused data if present - unless we're resuming an
+     * interrupted run, in which case it's our journal: remember where
+     * the last run got to so we can skip what's already accounted */
     if (localq.scanmbox) {
-        free(localq.scanmbox);
-        localq.scanmbox = NULL;
-
-        r = quota_write(&localq, &tid);
-        if (r) {
-            errmsg("failed writing quota record for '%s'",
-                   q->root, r);
-            goto done;
+        if (resume_mode) {
+            quotaroots[quota_num].scanmbox = xstrdup(localq.scanmbox);
+        }
+        else {
+            free(localq.scanmbox);
+            localq.scanmbox = NULL;
+
+            r = quota_write(&localq, &tid);
+            if (r) {
+                errmsg("failed writing quota record for '%s'",
+                       q->root, r);
+                goto done;
+            }
         }
     }
 
@@ -457,8 +494,9 @@ static int fixquota_dombox(const mbentry_t *mbentry, void *rock)
         if (mboxname_is_prefix(mbentry->name, root))
             break;
 
-        /* finished, close out now */
-        r = fixquota_finish(quota_todo);
+        /* finished, close out now (if it's ours) */
+        if (root_mine(quota_todo))
+            r = fixquota_finish(quota_todo);
         quota_todo++;
         if (r) goto done;
     }
@@ -471,6 +509,23 @@ static int fixquota_dombox(const mbentry_t *mbentry, void *rock)
         goto done;
     }
 
+    /* in a sharded run another worker owns this mailbox; rootless
+     * mailboxes are dealt out by name hash */
+    if (thisquota >= 0) {
+        if (!root_mine(thisquota)) goto done;
+    }
+    else if (nworkers > 1 &&
+             (int)(strhash(mbentry->name) % nworkers) != worker) {
+        goto done;
+    }
+
+    /* the scan record says the interrupted run already accounted this
+     * mailbox, and quota_update_useds has kept the scan totals current
+     * since, so don't even open it */
+    if (resume_mode && thisquota >= 0 && quotaroots[thisquota].scanmbox &&
+        compar(mbentry->name, quotaroots[thisquota].scanmbox) <= 0)
+        goto done;
+
     r = mailbox_open_iwl(mbentry->name, &mailbox);
     if (r) {
         errmsg("failed opening header for mailbox '%s'", mbentry->name, r);
@@ -651,22 +706,157 @@ int fixquota_dopass(char *domain, char **roots, int nroots,
 }
 
 /*
- * Fix all the quota roots
+ * Pass 4: rebuild the subtree rollups bottom-up.  The root list is
+ * sorted, so walking it in reverse sees every root after all of its
+ * children; each root's total is pushed into its nearest surviving
+ * ancestor as we go.
  */
-int fixquotas(char *domain, char **roots, int nroots)
+static int fixquota_rollup(void)
+{
+    quota_t *totals =
+        xzmalloc(quota_num * QUOTA_NUMRESOURCES * sizeof(quota_t));
+    int i, res, r = 0;
+
+    for (i = quota_num - 1; i >= 0; i--) {
+        struct quota localq;
+        struct txn *tid = NULL;
+        quota_t *total = totals + i * QUOTA_NUMRESOURCES;
+        int parent;
+        int dirty = 0;
+
+        if (quotaroots[i].deleted) continue;
+
+        quota_init(&localq, quotaroots[i].name);
+        r = quota_read(&localq, &tid, 1);
+        if (r == IMAP_QUOTAROOT_NONEXISTENT) {
+            /* a worker in another process removed it */
+            quotaroots[i].deleted = 1;
+            quota_free(&localq);
+            quota_abort(&tid);
+            r = 0;
+            continue;
+        }
+        if (r) {
+            errmsg("failed reading quotaroot '%s'", quotaroots[i].name, r);
+            quota_free(&localq);
+            quota_abort(&tid);
+            break;
+        }
+
+        for (res = 0; res < QUOTA_NUMRESOURCES; res++) {
+            total[res] += localq.useds[res];
+            if (localq.subtreeuseds[res] != total[res]) {
+                fprintf(stderr, "%s: %s subtree usage was " QUOTA_T_FMT
+                        ", now " QUOTA_T_FMT "\n",
+                        quotaroots[i].name, quota_names[res],
+                        localq.subtreeuseds[res], total[res]);
+                localq.subtreeuseds[res] = total[res];
+                dirty = 1;
+            }
+        }
+
+        if (dirty) {
+            r = quota_write(&localq, &tid);
+            if (r) {
+                errmsg("failed writing quotaroot '%s'", quotaroots[i].name, r);
+                quota_free(&localq);
+                quota_abort(&tid);
+                break;
+            }
+            quota_commit(&tid);
+        }
+        else {
+            quota_abort(&tid);
+        }
+        quota_free(&localq);
+
+        /* push this subtree's total into the nearest ancestor root */
+        for (parent = i - 1; parent >= 0; parent--) {
+            if (quotaroots[parent].deleted) continue;
+            if (mboxname_is_prefix(quotaroots[i].name,
+                                   quotaroots[parent].name)) {
+                quota_t *ptotal = totals + parent * QUOTA_NUMRESOURCES;
+                for (res = 0; res < QUOTA_NUMRESOURCES; res++)
+                    ptotal[res] += total[res];
+                break;
+            }
+        }
+    }
+
+    free(totals);
+    return r;
+}
+
+/*
+ * Passes 2 and 3 for one worker's slice of the roots
+ */
+static int fixquota_slice(char *domain, char **roots, int nroots)
 {
     int r;
 
     r = fixquota_dopass(domain, roots, nroots, fixquota_dombox);
 
     while (!r && quota_todo < quota_num) {
-        r = fixquota_finish(quota_todo);
+        if (root_mine(quota_todo))
+            r = fixquota_finish(quota_todo);
         quota_todo++;
     }
 
     return r;
 }
 
+/*
+ * Fork a child per slice and wait for them all.  The parent holds the
+ * quota changelock throughout, so the workers don't take it themselves.
+ */
+static int fixquota_runworkers(char *domain, char **roots, int nroots)
+{
+    int i, status;
+    int r = 0;
+
+    for (i = 0; i < nworkers; i++) {
+        pid_t pid = fork();
+        if (pid < 0) fatal("unable to fork worker", EC_OSERR);
+        if (!pid) {
+            /* fresh db handles - fcntl locks don't survive a fork */
+            quotadb_close();
+            mboxlist_close();
+            mboxlist_open(NULL);
+            quotadb_open(NULL);
+            worker = i;
+            r = fixquota_slice(domain, roots, nroots);
+            _exit(r ? 1 : 0);
+        }
+    }
+
+    while (waitpid(-1, &status, 0) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+            syslog(LOG_ERR, "quota: fix worker failed");
+            r = IMAP_SYS_ERROR;
+        }
+    }
+
+    return r;
+}
+
+/*
+ * Fix all the quota roots
+ */
+int fixquotas(char *domain, char **roots, int nroots)
+{
+    int r;
+
+    if (nworkers > 1)
+        r = fixquota_runworkers(domain, roots, nroots);
+    else
+        r = fixquota_slice(domain, roots, nroots);
+
+    if (!r)
+        r = fixquota_rollup();
+
+    return r;
+}
+
 static void reportquota_resource(struct quota * quota, const char *root, int res, json_t *jsonroot)
 {
     if (jsonroot) {
@@ -80,6 +80,11 @@ struct quota {
     quota_t useds[QUOTA_NUMRESOURCES];
     quota_t limits[QUOTA_NUMRESOURCES];         /* in QUOTA_UNITS */
 
+    /* rollup: usage charged to this root plus all quota roots nested
+     * beneath it, so subtree reporting reads one record.  Maintained
+     * by quota_update_useds(); quota -f recomputes it */
+    quota_t subtreeuseds[QUOTA_NUMRESOURCES];
+
     /* information for scanning */
     char *scanmbox;
     quota_t scanuseds[QUOTA_NUMRESOURCES];
@@ -118,6 +123,7 @@ extern int quota_update_useds(const char *quotaroot,
                               const char *mboxname);
 extern int quota_check_useds(const char *quotaroot,
                              const quota_t diff[QUOTA_NUMRESOURCES]);
+extern int quota_apply_deltas(int nonblock);
 
 extern int quota_deleteroot(const char *quotaroot);
 
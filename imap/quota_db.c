@@ -45,11 +45,15 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/stat.h>
 
+#include "cyr_lock.h"
 #include "cyrusdb.h"
 #include "dlist.h"
 #include "exitcodes.h"
@@ -58,6 +62,7 @@
 #include "mboxname.h"
 #include "mboxevent.h"
 #include "quota.h"
+#include "retry.h"
 #include "util.h"
 #include "xmalloc.h"
 #include "xstrlcpy.h"
@@ -76,6 +81,19 @@ static struct mboxlock *qchangelock;
 
 static int quota_dbopen = 0;
 
+/* Deferred quota accounting: when quota_deferred_updates is enabled,
+ * quota_update_useds() appends its deltas to an append-only log beside
+ * the quota db instead of rewriting the quota record under a write
+ * lock, so concurrent deliveries to the same quotaroot don't serialize
+ * on it.  The log is folded back into the db in batches - once it
+ * grows past QUOTA_DELTAS_BATCH, or on enforcement when the recorded
+ * usage is close enough to a limit that the unapplied deltas could
+ * change the answer (see quota_check_useds). */
+#define QUOTA_DELTAS_BATCH (64*1024)
+#define QUOTA_DELTAS_RETRIES (64)
+
+static char *quota_deltas_fname = NULL;
+
 /* keywords used when storing fields in the new quota db format */
 static const char * const quota_db_names[QUOTA_NUMRESOURCES] = {
     "S",        /* QUOTA_STORAGE */
@@ -157,6 +175,7 @@ static int quota_parseval(const char *data, size_t datalen,
     int res = QUOTA_STORAGE;
     struct dlist *dl = NULL;
     quota_t temp;
+    int have_subtree = 0;
 
     /* new dlist format */
     if (data[0] == '%') {
@@ -173,6 +192,15 @@ static int quota_parseval(const char *data, size_t datalen,
             if (val) quota->limits[res] = dlist_num(val);
         }
 
+        struct dlist *sub = dlist_getchild(dl, "SUBTREE");
+        if (sub) {
+            have_subtree = 1;
+            for (res = 0; res < QUOTA_NUMRESOURCES; res++) {
+                struct dlist *val = dlist_getchild(sub, quota_db_names[res]);
+                if (val) quota->subtreeuseds[res] = dlist_num(val);
+            }
+        }
+
         /* only read the SCAN stuff if it's a write lock */
         if (iswrite) {
             struct dlist *scan = dlist_getchild(dl, "SCAN");
@@ -217,6 +245,12 @@ static int quota_parseval(const char *data, size_t datalen,
     }
 
 done:
+    /* records from before the rollups existed: the best available
+     * guess is the root's own usage, quota -f makes it exact */
+    if (!have_subtree) {
+        for (res = 0; res < QUOTA_NUMRESOURCES; res++)
+            quota->subtreeuseds[res] = quota->useds[res];
+    }
     r = 0;
 out:
     dlist_free(&dl);
@@ -324,6 +358,62 @@ EXPORTED void quota_use(struct quota *q,
     }
 }
 
+/* apply a delta to the subtree rollup, with the same underflow
+ * clamping as quota_use() */
+static void quota_use_subtree(struct quota *q, enum quota_resource res,
+                              quota_t delta)
+{
+    if ((delta < 0) && (-delta > q->subtreeuseds[res]))
+        q->subtreeuseds[res] = 0;
+    else
+        q->subtreeuseds[res] += delta;
+}
+
+/* roll 'diff' up into the subtree counters of every quota root
+ * strictly above 'quotaroot', in the same transaction.  An ancestor
+ * name which isn't a root is simply skipped */
+static int quota_update_ancestors(const char *quotaroot,
+                                  const quota_t diff[QUOTA_NUMRESOURCES],
+                                  struct txn **tid)
+{
+    char name[MAX_MAILBOX_BUFFER];
+    char *mbox, *p, *tail;
+    int res;
+    int r = 0;
+
+    strlcpy(name, quotaroot, sizeof(name));
+    mbox = (config_virtdomains && (p = strchr(name, '!'))) ? p+1 : name;
+
+    for (;;) {
+        struct quota q;
+
+        tail = strrchr(mbox, '.');
+        if (tail)
+            *tail = '\0';
+        else if (mbox > name && *mbox)
+            *mbox = '\0';   /* last stop: the domain quota */
+        else
+            break;
+
+        quota_init(&q, name);
+        r = quota_read(&q, tid, 1);
+        if (r == IMAP_QUOTAROOT_NONEXISTENT) {
+            quota_free(&q);
+            r = 0;
+            continue;
+        }
+        if (!r) {
+            for (res = 0; res < QUOTA_NUMRESOURCES; res++)
+                quota_use_subtree(&q, res, diff[res]);
+            r = quota_write(&q, tid);
+        }
+        quota_free(&q);
+        if (r) return r;
+    }
+
+    return 0;
+}
+
 struct quota_foreach_t {
     quotaproc_t *proc;
     void *rock;
@@ -421,6 +511,10 @@ EXPORTED int quota_write(struct quota *quota, struct txn **tid)
             dlist_setnum64(item, NULL, quota->limits[res]);
     }
 
+    struct dlist *sub = dlist_newkvlist(dl, "SUBTREE");
+    for (res = 0; res < QUOTA_NUMRESOURCES; res++)
+        dlist_setnum64(sub, quota_db_names[res], quota->subtreeuseds[res]);
+
     if (quota->scanmbox) {
         struct dlist *scan = dlist_newkvlist(dl, "SCAN");
         dlist_setatom(scan, "MBOX", quota->scanmbox);
@@ -453,6 +547,249 @@ EXPORTED int quota_write(struct quota *quota, struct txn **tid)
     return r;
 }
 
+/* fold one delta log file back into the quota db and unlink it.
+ * Everything goes in a single transaction, and consecutive lines
+ * against the same root are merged onto one read/write, so a
+ * same-user burst costs a single record rewrite */
+static int quota_apply_file(const char *fname)
+{
+    FILE *f;
+    int fd;
+    char buf[MAX_MAILBOX_BUFFER+128];
+    struct quota q;
+    struct txn *tid = NULL;
+    struct mboxevent *mboxevents = NULL;
+    quota_t rolled[QUOTA_NUMRESOURCES];
+    int live = 0;
+    int res;
+    int r = 0;
+
+    fd = open(fname, O_RDWR, 0);
+    if (fd < 0) return (errno == ENOENT) ? 0 : IMAP_IOERROR;
+
+    /* serialise against any writer which locked this inode before we
+     * renamed it into place - once we've held the lock, writers still
+     * appending to it have finished, and new ones will stat, notice
+     * the rename and start a fresh log (see quota_delta_log) */
+    if (lock_blocking(fd, fname) == -1) {
+        syslog(LOG_ERR, "IOERROR: locking %s: %m", fname);
+        close(fd);
+        return IMAP_IOERROR;
+    }
+    lock_unlock(fd, fname);
+
+    f = fdopen(fd, "r");
+    if (!f) {
+        close(fd);
+        return IMAP_IOERROR;
+    }
+
+    memset(&q, 0, sizeof(q));
+    memset(rolled, 0, sizeof(rolled));
+
+    while (fgets(buf, sizeof(buf), f)) {
+        strarray_t *fields = strarray_split(buf, "\t", 0);
+        quota_t diff[QUOTA_NUMRESOURCES];
+        const char *mboxname;
+        int cmp = 1;
+        int bad = (fields->count != 2 + QUOTA_NUMRESOURCES);
+
+        for (res = 0; !bad && res < QUOTA_NUMRESOURCES; res++) {
+            if (sscanf(fields->data[2+res], QUOTA_T_FMT, &diff[res]) != 1)
+                bad = 1;
+        }
+        if (bad) {
+            syslog(LOG_ERR, "IOERROR: bad quota delta record in %s: %s",
+                   fname, buf);
+            strarray_free(fields);
+            continue;
+        }
+
+        if (!live || strcmp(q.root, fields->data[0])) {
+            if (live) {
+                r = quota_write(&q, &tid);
+                if (!r) r = quota_update_ancestors(q.root, rolled, &tid);
+                quota_free(&q);
+                live = 0;
+                if (r) {
+                    strarray_free(fields);
+                    break;
+                }
+            }
+            memset(rolled, 0, sizeof(rolled));
+            quota_init(&q, fields->data[0]);
+            r = quota_read(&q, &tid, 1);
+            if (r == IMAP_QUOTAROOT_NONEXISTENT) {
+                /* root deleted since the delta was logged */
+                quota_free(&q);
+                strarray_free(fields);
+                r = 0;
+                continue;
+            }
+            if (r) {
+                quota_free(&q);
+                strarray_free(fields);
+                break;
+            }
+            live = 1;
+        }
+
+        mboxname = fields->data[1];
+        if (q.scanmbox && strcmp(mboxname, "-")) {
+            cmp = cyrusdb_compar(qdb, mboxname, strlen(mboxname),
+                                 q.scanmbox, strlen(q.scanmbox));
+        }
+        for (res = 0; res < QUOTA_NUMRESOURCES; res++) {
+            int was_over = quota_is_overquota(&q, res, NULL);
+            quota_use(&q, res, diff[res]);
+            quota_use_subtree(&q, res, diff[res]);
+            rolled[res] += diff[res];
+            if (cmp <= 0)
+                q.scanuseds[res] += diff[res];
+
+            if (was_over && !quota_is_overquota(&q, res, NULL)) {
+                struct mboxevent *mboxevent =
+                    mboxevent_enqueue(EVENT_QUOTA_WITHIN, &mboxevents);
+                mboxevent_extract_quota(mboxevent, &q, res);
+            }
+        }
+
+        strarray_free(fields);
+    }
+
+    if (live) {
+        if (!r) r = quota_write(&q, &tid);
+        if (!r) r = quota_update_ancestors(q.root, rolled, &tid);
+        quota_free(&q);
+    }
+    fclose(f);
+
+    if (r) {
+        quota_abort(&tid);
+    }
+    else {
+        quota_commit(&tid);
+        unlink(fname);
+        mboxevent_notify(&mboxevents);
+    }
+    mboxevent_freequeue(&mboxevents);
+
+    return r;
+}
+
+/*
+ * Fold the accumulated quota delta log back into the quota db.  Runs
+ * under its own exclusive lock so only one process applies at a time;
+ * with 'nonblock', gives up silently if somebody else is already at it.
+ */
+EXPORTED int quota_apply_deltas(int nonblock)
+{
+    struct mboxlock *lock = NULL;
+    char *applyfname;
+    int r;
+
+    if (!quota_deltas_fname) return 0;
+
+    r = mboxname_lock("$QUOTADELTAS", &lock,
+                      LOCK_EXCLUSIVE | (nonblock ? LOCK_NONBLOCK : 0));
+    if (r) return (nonblock && r == IMAP_MAILBOX_LOCKED) ? 0 : r;
+
+    applyfname = strconcat(quota_deltas_fname, ".apply", (char *)NULL);
+
+    /* a leftover .apply file means an earlier run died after the
+     * rename - fold it in before taking any new records */
+    r = quota_apply_file(applyfname);
+
+    if (!r) {
+        if (rename(quota_deltas_fname, applyfname) < 0) {
+            if (errno != ENOENT) {
+                syslog(LOG_ERR, "IOERROR: renaming %s: %m",
+                       quota_deltas_fname);
+                r = IMAP_IOERROR;
+            }
+        }
+        else {
+            r = quota_apply_file(applyfname);
+        }
+    }
+
+    free(applyfname);
+    mboxname_release(&lock);
+    return r;
+}
+
+/* append one delta record to the log.  As in sync_log_base(), we must
+ * hold a lock on the file and be sure the name still points at the
+ * inode we opened, or we could append to a log the applier has already
+ * renamed away and read to EOF, silently losing the delta */
+static int quota_delta_log(const char *quotaroot,
+                           const quota_t diff[QUOTA_NUMRESOURCES],
+                           const char *mboxname)
+{
+    struct buf line = BUF_INITIALIZER;
+    struct stat sbuffd, sbuffile;
+    int retries = 0;
+    int batch = 0;
+    int fd = -1;
+    int res;
+    int r = 0;
+
+    while (retries++ < QUOTA_DELTAS_RETRIES) {
+        fd = open(quota_deltas_fname, O_WRONLY|O_APPEND|O_CREAT, 0666);
+        if (fd < 0) {
+            syslog(LOG_ERR, "IOERROR: opening %s: %m", quota_deltas_fname);
+            return IMAP_IOERROR;
+        }
+
+        if (lock_blocking(fd, quota_deltas_fname) == -1) {
+            syslog(LOG_ERR, "IOERROR: locking %s: %m", quota_deltas_fname);
+            close(fd);
+            return IMAP_IOERROR;
+        }
+
+        /* check the file wasn't renamed away after it was opened */
+        if (fstat(fd, &sbuffd) == 0 &&
+            stat(quota_deltas_fname, &sbuffile) == 0 &&
+            sbuffd.st_ino == sbuffile.st_ino)
+            break;
+
+        lock_unlock(fd, quota_deltas_fname);
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) {
+        syslog(LOG_ERR, "IOERROR: failed to lock %s after %d attempts",
+               quota_deltas_fname, retries);
+        return IMAP_IOERROR;
+    }
+
+    buf_printf(&line, "%s\t%s", quotaroot, mboxname ? mboxname : "-");
+    for (res = 0; res < QUOTA_NUMRESOURCES; res++)
+        buf_printf(&line, "\t" QUOTA_T_FMT, diff[res]);
+    buf_putc(&line, '\n');
+
+    if (retry_write(fd, line.s, line.len) < 0) {
+        syslog(LOG_ERR, "IOERROR: writing %s: %m", quota_deltas_fname);
+        r = IMAP_IOERROR;
+    }
+
+    if (!r && !fstat(fd, &sbuffd))
+        batch = (sbuffd.st_size >= QUOTA_DELTAS_BATCH);
+
+    /* drop our lock before applying - the applier locks the log
+     * itself, and we mustn't deadlock against our own lock */
+    lock_unlock(fd, quota_deltas_fname);
+    close(fd);
+    buf_free(&line);
+
+    /* time to fold the log back in?  Skip it if somebody else
+     * already is - the deltas are safely on disk either way */
+    if (batch)
+        quota_apply_deltas(/*nonblock*/1);
+
+    return r;
+}
+
 EXPORTED int quota_update_useds(const char *quotaroot,
                        const quota_t diff[QUOTA_NUMRESOURCES],
                        const char *mboxname)
@@ -465,6 +802,13 @@ EXPORTED int quota_update_useds(const char *quotaroot,
     if (!quotaroot || !*quotaroot)
         return IMAP_QUOTAROOT_NONEXISTENT;
 
+    if (quota_deltas_fname &&
+        config_getswitch(IMAPOPT_QUOTA_DEFERRED_UPDATES)) {
+        r = quota_delta_log(quotaroot, diff, mboxname);
+        if (!r) return 0;
+        /* fall through to the synchronous path if the log is sick */
+    }
+
     quota_init(&q, quotaroot);
 
     r = quota_read(&q, &tid, 1);
@@ -479,6 +823,7 @@ EXPORTED int quota_update_useds(const char *quotaroot,
         for (res = 0; res < QUOTA_NUMRESOURCES; res++) {
             int was_over = quota_is_overquota(&q, res, NULL);
             quota_use(&q, res, diff[res]);
+            quota_use_subtree(&q, res, diff[res]);
             if (cmp <= 0)
                 q.scanuseds[res] += diff[res];
 
@@ -489,6 +834,7 @@ EXPORTED int quota_update_useds(const char *quotaroot,
             }
         }
         r = quota_write(&q, &tid);
+        if (!r) r = quota_update_ancestors(quotaroot, diff, &tid);
     }
 
     if (r) {
@@ -541,6 +887,35 @@ EXPORTED int quota_check_useds(const char *quotaroot,
     }
     if (r) goto done;
 
+    if (quota_deltas_fname &&
+        config_getswitch(IMAPOPT_QUOTA_DEFERRED_UPDATES)) {
+        int margin = config_getint(IMAPOPT_QUOTA_DEFERRED_MARGIN);
+        int close = 0;
+
+        for (res = 0 ; res < QUOTA_NUMRESOURCES ; res++) {
+            quota_t lim;
+            if (q.limits[res] < 0 || diff[res] < 0)
+                continue;
+            lim = (quota_t)q.limits[res] * quota_units[res];
+            if (q.useds[res] + diff[res] > lim - (lim * margin) / 100)
+                close = 1;
+        }
+
+        /* the recorded usage may be missing logged deltas; only pay
+         * for folding them in when we're near enough to a limit that
+         * they could change the answer */
+        if (close && !quota_apply_deltas(/*nonblock*/0)) {
+            quota_free(&q);
+            quota_init(&q, quotaroot);
+            r = quota_read(&q, NULL, /*wrlock*/0);
+            if (r == IMAP_QUOTAROOT_NONEXISTENT) {
+                r = 0;
+                goto done;
+            }
+            if (r) goto done;
+        }
+    }
+
     for (res = 0 ; res < QUOTA_NUMRESOURCES ; res++) {
         r = quota_check(&q, res, diff[res]);
         if (r) goto done;
@@ -642,6 +1017,8 @@ EXPORTED void quotadb_open(const char *fname)
         fatal("can't read quotas file", EC_TEMPFAIL);
     }
 
+    quota_deltas_fname = strconcat(fname, ".deltas", (char *)NULL);
+
     free(tofree);
 
     quota_dbopen = 1;
@@ -657,6 +1034,8 @@ EXPORTED void quotadb_close(void)
             syslog(LOG_ERR, "DBERROR: error closing quotas: %s",
                    cyrusdb_strerror(r));
         }
+        free(quota_deltas_fname);
+        quota_deltas_fname = NULL;
         quota_dbopen = 0;
     }
 }
@@ -54,6 +54,7 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #ifdef HAVE_ZLIB
 #include <zlib.h>
 #endif
@@ -138,6 +139,7 @@ int main(int argc, char **argv)
     int mflag = 0;
     int fflag = 0;
     int xflag = 0;
+    int nworkers = 0;
     struct buf buf = BUF_INITIALIZER;
     char *alt_config = NULL;
     char *start_part = NULL;
@@ -149,12 +151,17 @@ int main(int argc, char **argv)
 
     construct_hash_table(&unqid_table, 2047, 1);
 
-    while ((opt = getopt(argc, argv, "C:kp:rmfsxgGqRUMoOnV:u")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:j:kp:rmfsxgGqRUMoOnV:u")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
             break;
 
+        case 'j':
+            nworkers = atoi(optarg);
+            if (nworkers < 0) usage();
+            break;
+
         case 'p':
             start_part = optarg;
             break;
@@ -254,6 +261,53 @@ int main(int argc, char **argv)
         do_mboxlist();
     }
 
+    /* Fan the named mailboxes out across worker processes.  We fork
+     * before any database is opened, so each worker sets up its own
+     * handles and no state is shared across the pool.  Each worker
+     * takes every nworkers'th argument, which spreads users evenly
+     * when reconstructing many of them with -r/-u. */
+    if (nworkers > 1 && argc - optind > 1) {
+        int nchildren = 0;
+        int status;
+        int code = 0;
+
+        if (nworkers > argc - optind)
+            nworkers = argc - optind;
+
+        for (i = 0; i < nworkers; i++) {
+            pid_t pid = fork();
+            if (pid < 0)
+                fatal("failed to fork reconstruct worker", EC_OSERR);
+            if (!pid) {
+                /* child: compact our share of the arguments and fall
+                 * through to the normal single-process path */
+                int j, n = 0;
+                for (j = optind; j < argc; j++) {
+                    if ((j - optind) % nworkers == i)
+                        argv[optind + n++] = argv[j];
+                }
+                argc = optind + n;
+                nchildren = 0;
+                break;
+            }
+            nchildren++;
+        }
+
+        if (nchildren) {
+            /* parent: nothing to do but collect the workers */
+            while (nchildren--) {
+                if (wait(&status) < 0) break;
+                if (WIFEXITED(status) && WEXITSTATUS(status))
+                    code = WEXITSTATUS(status);
+                else if (WIFSIGNALED(status))
+                    code = EC_SOFTWARE;
+            }
+            sync_log_done();
+            cyrus_done();
+            return code;
+        }
+    }
+
     mboxlist_init(0);
     mboxlist_open(NULL);
 
@@ -416,7 +470,7 @@ int main(int argc, char **argv)
 static void usage(void)
 {
     fprintf(stderr,
-            "usage: reconstruct [-C <alt_config>] [-p partition] [-ksrfxu] mailbox...\n");
+            "usage: reconstruct [-C <alt_config>] [-p partition] [-j workers] [-ksrfxu] mailbox...\n");
     fprintf(stderr, "       reconstruct [-C <alt_config>] -m\n");
     exit(EC_USAGE);
 }
@@ -30,6 +30,9 @@ enum rfc822_header {
     RFC822_X_DELIVEREDINTERNALDATE=20,
     RFC822_X_ME_MESSAGE_ID=21,
 };
+
+#define RFC822_HEADER_NUM_STRINGS 22
+
 extern enum rfc822_header rfc822_header_from_string(const char *s);
 extern enum rfc822_header rfc822_header_from_string_len(const char *s, size_t len);
 extern const char *rfc822_header_to_string(enum rfc822_header v);
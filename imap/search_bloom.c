@@ -0,0 +1,399 @@
+/* search_bloom.c -- per-mailbox trigram sketches for unindexed search
+ *
+ * Copyright (c) 1994-2016 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * When a mailbox has no squat or xapian index, a substring SEARCH has
+ * to decode and scan every message.  To make that cheaper we keep a
+ * compact per-mailbox sketch file, cyrus.bloom, holding one small
+ * fixed-size bloom filter per message charged with every trigram of
+ * the message's text in canonical search form.  At search time, any
+ * message whose filter is missing one of the trigrams of the search
+ * string provably cannot contain it, and is skipped without being
+ * opened at all.
+ *
+ * The file is a 20 byte header (magic, version, uidvalidity, the
+ * charset_flags the text was normalised with, and the filter size)
+ * followed by fixed-size records of uid plus filter bits, appended in
+ * uid order as messages arrive.  Everything about it is advisory: a
+ * missing, stale or torn file just means messages get scanned the hard
+ * way, so the writer never fsyncs and readers quietly ignore anything
+ * they cannot validate.
+ *
+ * The filter parameters cover about a thousand distinct trigrams per
+ * message at a 5% false positive rate, costing some 800 bytes per
+ * message.  Larger messages degrade to fewer skips, never to wrong
+ * answers.
+ */
+
+#include <config.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <syslog.h>
+
+#include "bloom.h"
+#include "charset.h"
+#include "global.h"
+#include "map.h"
+#include "retry.h"
+#include "search_bloom.h"
+#include "util.h"
+#include "xmalloc.h"
+
+#define SEARCH_BLOOM_MAGIC      0x424c4f4d      /* "BLOM" */
+#define SEARCH_BLOOM_VERSION    1
+#define SEARCH_BLOOM_HEADER     20
+/* ~1000 distinct trigrams at 5% error works out at 798 bytes and 5
+ * hashes per message */
+#define SEARCH_BLOOM_ENTRIES    1024
+#define SEARCH_BLOOM_ERROR      0.05
+#define SEARCH_BLOOM_NGRAM      3
+
+/* ====================================================================== */
+
+/* Maintaining the sketch at append time */
+
+struct sketcher {
+    struct bloom bloom;
+    unsigned char window[SEARCH_BLOOM_NGRAM];
+    int nwindow;
+};
+
+/* Slide the trigram window along 'len' bytes of canonical-form text,
+ * charging the filter with each trigram.  The window carries over
+ * between the chunks charset_extract() emits, and is reset between
+ * sections, which matches the per-section searches searchfile does. */
+static void sketch_bytes(struct sketcher *s, const char *base, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)base;
+
+    while (len--) {
+        if (s->nwindow == SEARCH_BLOOM_NGRAM) {
+            s->window[0] = s->window[1];
+            s->window[1] = s->window[2];
+            s->window[2] = *p++;
+        }
+        else {
+            s->window[s->nwindow++] = *p++;
+        }
+        if (s->nwindow == SEARCH_BLOOM_NGRAM)
+            bloom_add(&s->bloom, s->window, SEARCH_BLOOM_NGRAM);
+    }
+}
+
+static void sketch_extract_cb(const struct buf *text, void *rock)
+{
+    sketch_bytes((struct sketcher *)rock, text->s, text->len);
+}
+
+static int sketch_section_cb(int isbody, charset_t charset, int encoding,
+                             const char *subtype __attribute__((unused)),
+                             struct buf *data, void *rock)
+{
+    struct sketcher *s = (struct sketcher *)rock;
+
+    s->nwindow = 0;
+
+    if (!isbody) {
+        /* every header section: unlike the indexers, the fallback
+         * search scans embedded message headers too */
+        char *q = charset_decode_mimeheader(buf_cstring(data), charset_flags);
+        if (q) {
+            sketch_bytes(s, q, strlen(q));
+            free(q);
+        }
+    }
+    else {
+        if (charset == CHARSET_UNKNOWN_CHARSET) return 0;
+        /* no subtype, so html is not stripped: charset_searchfile()
+         * searches the raw markup and the sketch must cover everything
+         * it could match */
+        charset_extract(sketch_extract_cb, s, data, charset, encoding,
+                        NULL, charset_flags);
+    }
+
+    return 0;
+}
+
+/* Append the finished filter for 'uid' to the sketch file, recreating
+ * the file whenever the existing header is for another mailbox
+ * incarnation, parameter set or charset normalisation. */
+static void sketch_store(struct mailbox *mailbox, uint32_t uid,
+                         const struct bloom *bloom)
+{
+    const char *fname = mailbox_meta_fname(mailbox, META_BLOOM);
+    const unsigned char *bits;
+    struct buf buf = BUF_INITIALIZER;
+    bit32 hdr[5];
+    unsigned int recsize;
+    struct stat sbuf;
+    off_t size = 0;
+    int recreate = 0;
+    int nbytes;
+    int fd;
+
+    bits = bloom_bits(bloom, &nbytes);
+    if (!bits) return;
+    recsize = 4 + nbytes;
+
+    fd = open(fname, O_RDWR|O_CREAT, 0666);
+    if (fd == -1) {
+        syslog(LOG_ERR, "IOERROR: creating %s: %m", fname);
+        return;
+    }
+
+    if (fstat(fd, &sbuf) != -1)
+        size = sbuf.st_size;
+
+    if (size >= SEARCH_BLOOM_HEADER) {
+        if (retry_read(fd, hdr, sizeof(hdr)) != sizeof(hdr) ||
+            ntohl(hdr[0]) != SEARCH_BLOOM_MAGIC ||
+            ntohl(hdr[1]) != SEARCH_BLOOM_VERSION ||
+            ntohl(hdr[2]) != mailbox->i.uidvalidity ||
+            ntohl(hdr[3]) != (uint32_t)charset_flags ||
+            ntohl(hdr[4]) != (uint32_t)nbytes)
+            size = 0;
+    }
+    else {
+        size = 0;
+    }
+
+    if (!size) {
+        hdr[0] = htonl(SEARCH_BLOOM_MAGIC);
+        hdr[1] = htonl(SEARCH_BLOOM_VERSION);
+        hdr[2] = htonl(mailbox->i.uidvalidity);
+        hdr[3] = htonl((uint32_t)charset_flags);
+        hdr[4] = htonl((uint32_t)nbytes);
+        buf_appendmap(&buf, (const char *)hdr, sizeof(hdr));
+        recreate = 1;
+    }
+    else {
+        /* drop any torn record left behind by an earlier crash */
+        size = SEARCH_BLOOM_HEADER +
+               ((size - SEARCH_BLOOM_HEADER) / recsize) * recsize;
+    }
+
+    buf_appendbit32(&buf, uid);
+    buf_appendmap(&buf, (const char *)bits, nbytes);
+
+    if (recreate) size = 0;
+
+    if (ftruncate(fd, size) == -1 ||
+        lseek(fd, size, SEEK_SET) == (off_t)-1 ||
+        retry_write(fd, buf.s, buf.len) == -1) {
+        syslog(LOG_ERR, "IOERROR: writing %s: %m", fname);
+        /* leave it; readers ignore a torn tail */
+    }
+    /* no fsync: the sketch is purely advisory */
+
+    buf_free(&buf);
+    close(fd);
+}
+
+EXPORTED void search_bloom_add(struct mailbox *mailbox,
+                               const struct index_record *record)
+{
+    struct sketcher s;
+    message_t *m;
+    int r;
+
+    if (!config_getswitch(IMAPOPT_SEARCH_BLOOM_SKETCH)) return;
+
+    memset(&s, 0, sizeof(s));
+    if (bloom_init(&s.bloom, SEARCH_BLOOM_ENTRIES, SEARCH_BLOOM_ERROR))
+        return;
+
+    m = message_new_from_record(mailbox, record);
+    r = message_foreach_text_section(m, sketch_section_cb, &s);
+    message_unref(&m);
+
+    if (!r)
+        sketch_store(mailbox, record->uid, &s.bloom);
+
+    bloom_free(&s.bloom);
+}
+
+/* ====================================================================== */
+
+/* Consulting the sketch at search time.  Unindexed searches scan one
+ * mailbox at a time, so a single cached mapping is all we need. */
+
+static struct {
+    char *mboxname;
+    uint32_t uidvalidity;
+    const char *base;
+    size_t len;
+    unsigned int nrecs;
+    unsigned int recsize;
+    int fd;
+    int usable;
+} sketch_reader = { NULL, 0, NULL, 0, 0, 0, -1, 0 };
+
+/* only supplies the filter geometry for bloom_check_raw() */
+static struct bloom sketch_params;
+
+static uint32_t sketch_uid(unsigned int recno)
+{
+    bit32 u;
+
+    memcpy(&u, sketch_reader.base + SEARCH_BLOOM_HEADER +
+               recno * sketch_reader.recsize, sizeof(u));
+    return ntohl(u);
+}
+
+static void sketch_close(void)
+{
+    if (sketch_reader.base)
+        map_free(&sketch_reader.base, &sketch_reader.len);
+    if (sketch_reader.fd != -1)
+        close(sketch_reader.fd);
+    free(sketch_reader.mboxname);
+    sketch_reader.mboxname = NULL;
+    sketch_reader.fd = -1;
+    sketch_reader.nrecs = 0;
+    sketch_reader.usable = 0;
+}
+
+static void sketch_open(struct mailbox *mailbox)
+{
+    const char *fname = mailbox_meta_fname(mailbox, META_BLOOM);
+    bit32 hdr[5];
+    struct stat sbuf;
+    unsigned int i;
+    int fd;
+
+    sketch_close();
+    sketch_reader.mboxname = xstrdup(mailbox->name);
+    sketch_reader.uidvalidity = mailbox->i.uidvalidity;
+
+    if (!sketch_params.ready &&
+        bloom_init(&sketch_params, SEARCH_BLOOM_ENTRIES, SEARCH_BLOOM_ERROR))
+        return;
+
+    fd = open(fname, O_RDONLY);
+    if (fd == -1) return;
+    if (fstat(fd, &sbuf) == -1 || sbuf.st_size < SEARCH_BLOOM_HEADER) {
+        close(fd);
+        return;
+    }
+
+    sketch_reader.fd = fd;
+    map_refresh(fd, 1, &sketch_reader.base, &sketch_reader.len,
+                sbuf.st_size, fname, mailbox->name);
+
+    memcpy(hdr, sketch_reader.base, sizeof(hdr));
+    if (ntohl(hdr[0]) != SEARCH_BLOOM_MAGIC ||
+        ntohl(hdr[1]) != SEARCH_BLOOM_VERSION ||
+        ntohl(hdr[2]) != mailbox->i.uidvalidity ||
+        ntohl(hdr[3]) != (uint32_t)charset_flags ||
+        ntohl(hdr[4]) != (uint32_t)sketch_params.bytes)
+        return;
+
+    sketch_reader.recsize = 4 + sketch_params.bytes;
+    sketch_reader.nrecs = (sketch_reader.len - SEARCH_BLOOM_HEADER) /
+                          sketch_reader.recsize;
+
+    /* the uids must be ascending for the binary search below */
+    for (i = 1; i < sketch_reader.nrecs; i++) {
+        if (sketch_uid(i-1) >= sketch_uid(i)) {
+            sketch_reader.nrecs = 0;
+            return;
+        }
+    }
+
+    sketch_reader.usable = 1;
+}
+
+EXPORTED int search_bloom_maymatch(message_t *m, const char *substr)
+{
+    struct mailbox *mailbox = NULL;
+    uint32_t uid = 0;
+    const unsigned char *row = NULL;
+    unsigned int lo, hi;
+    size_t len, i;
+
+    len = substr ? strlen(substr) : 0;
+    if (len < SEARCH_BLOOM_NGRAM) return 1;     /* too short to sketch */
+
+    if (message_get_mailbox(m, &mailbox) || !mailbox) return 1;
+    if (message_get_uid(m, &uid) || !uid) return 1;
+
+    if (!sketch_reader.mboxname ||
+        strcmp(sketch_reader.mboxname, mailbox->name) ||
+        sketch_reader.uidvalidity != mailbox->i.uidvalidity)
+        sketch_open(mailbox);
+
+    if (!sketch_reader.usable) return 1;
+
+    lo = 0;
+    hi = sketch_reader.nrecs;
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        uint32_t u = sketch_uid(mid);
+        if (u == uid) {
+            row = (const unsigned char *)sketch_reader.base +
+                  SEARCH_BLOOM_HEADER + mid * sketch_reader.recsize + 4;
+            break;
+        }
+        if (u < uid)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (!row) return 1;         /* message predates the sketch */
+
+    /* every trigram of the substring must appear in the message */
+    for (i = 0 ; i + SEARCH_BLOOM_NGRAM <= len ; i++) {
+        if (!bloom_check_raw(&sketch_params, row,
+                             substr + i, SEARCH_BLOOM_NGRAM))
+            return 0;
+    }
+
+    return 1;
+}
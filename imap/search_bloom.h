@@ -0,0 +1,62 @@
+/* search_bloom.h -- per-mailbox trigram sketches for unindexed search
+ *
+ * Copyright (c) 1994-2016 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef INCLUDED_SEARCH_BLOOM_H
+#define INCLUDED_SEARCH_BLOOM_H
+
+#include "mailbox.h"
+#include "message.h"
+
+/* Append a sketch of the text of a freshly appended message to the
+ * mailbox's cyrus.bloom file, if the search_bloom_sketch option is
+ * enabled.  Failure is not an error, the worst case is just that the
+ * message gets scanned the hard way at search time. */
+extern void search_bloom_add(struct mailbox *mailbox,
+                             const struct index_record *record);
+
+/* Returns zero iff the mailbox's sketch proves that no text section of
+ * 'm' can contain the substring 'substr', which must already be in
+ * canonical search form.  Returns nonzero (maybe) whenever there is no
+ * usable sketch for the message. */
+extern int search_bloom_maymatch(message_t *m, const char *substr);
+
+#endif /* INCLUDED_SEARCH_BLOOM_H */
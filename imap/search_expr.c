@@ -58,6 +58,7 @@
 #include "annotate.h"
 #include "global.h"
 #include "lsort.h"
+#include "search_bloom.h"
 #include "xstrlcpy.h"
 #include "xmalloc.h"
 
@@ -678,6 +679,54 @@ static void sort_children(search_expr_t *e)
     e->children = lsort(e->children, getnext, setnext, compare, NULL);
 }
 
+/*
+ * Estimate the cost of evaluating a subtree: comparison nodes report
+ * their attribute's cost class, and interior nodes (including NOT)
+ * the most expensive thing they might have to evaluate.
+ */
+static int expr_cost(const search_expr_t *e)
+{
+    const search_expr_t *child;
+    int cost = (e->attr ? e->attr->cost : 0);
+
+    for (child = e->children ; child ; child = child->next) {
+        int childcost = expr_cost(child);
+        if (childcost > cost) cost = childcost;
+    }
+
+    return cost;
+}
+
+static int compare_cost(void *p1, void *p2, void *calldata)
+{
+    int r = expr_cost(p1) - expr_cost(p2);
+
+    if (!r)
+        r = compare(p1, p2, calldata);
+    return r;
+}
+
+/*
+ * Reorder the children of AND and OR nodes so that cheaper subtrees
+ * are evaluated first.  search_expr_evaluate() short-circuits, so
+ * running indexed attributes (flags, dates, sizes) ahead of cache or
+ * body matches lets most messages be excluded on metadata alone,
+ * without ever touching the cache or spool files.  Note this runs on
+ * the evaluation copy only; the canonical order established by
+ * sort_children(), which cache keys are built from, is used to break
+ * ties so that logically equivalent trees still evaluate identically.
+ */
+static void sort_children_by_cost(search_expr_t *e)
+{
+    search_expr_t *child;
+
+    for (child = e->children ; child ; child = child->next)
+        sort_children_by_cost(child);
+
+    if (e->op == SEOP_AND || e->op == SEOP_OR)
+        e->children = lsort(e->children, getnext, setnext, compare_cost, NULL);
+}
+
 /*
  * Reorganise a search expression tree into Disjunctive Normal Form.
  * This form is useful for picking out cacheable and runnable sub-queries.
@@ -750,11 +799,13 @@ static int internalise(search_expr_t *e, void *rock)
 }
 
 /*
- * Prepare the given expression for use with the given mailbox.
+ * Prepare the given expression for use with the given mailbox, and
+ * reorder it so that evaluation tries the cheapest clauses first.
  */
 EXPORTED void search_expr_internalise(struct index_state *state, search_expr_t *e)
 {
     search_expr_apply(e, internalise, state);
+    sort_children_by_cost(e);
 }
 
 /*
@@ -1821,7 +1872,8 @@ static int search_convflags_match(message_t *m,
     if (!rock->cstate) return 0;
 
     message_get_cid(m, &cid);
-    if (conversation_load(rock->cstate, cid, &conv)) return 0;
+    if (conversation_load_advanced(rock->cstate, cid, &conv,
+                                   CONV_WANT_COUNTS)) return 0;
     if (!conv) return 0;
 
     if (rock->num == 0)
@@ -1864,7 +1916,8 @@ static int search_convmodseq_match(message_t *m, const union search_value *v,
     if (!rock->cstate) return 0;
 
     message_get_cid(m, &cid);
-    if (conversation_load(rock->cstate, cid, &conv)) return 0;
+    if (conversation_load_advanced(rock->cstate, cid, &conv,
+                                   CONV_WANT_COUNTS)) return 0;
     if (!conv) return 0;
 
     r = (v->u == conv->modseq);
@@ -2016,6 +2069,11 @@ static int search_text_match(message_t *m, const union search_value *v,
 {
     struct searchmsg_rock sr;
 
+    /* if the mailbox's trigram sketch proves the substring can't be
+     * in this message, don't open it at all */
+    if (!search_bloom_maymatch(m, v->s))
+        return 0;
+
     sr.substr = v->s;
     sr.pat = (comp_pat *)internalised;
     sr.skipheader = (int)(unsigned long)data1;
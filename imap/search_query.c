@@ -43,9 +43,12 @@
 #include <config.h>
 
 #include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <stdlib.h>
 #include <syslog.h>
 #include <string.h>
+#include <errno.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -58,6 +61,7 @@
 #include "annotate.h"
 #include "global.h"
 #include "bsearch.h"
+#include "retry.h"
 #include "xstrlcpy.h"
 #include "xmalloc.h"
 
@@ -66,6 +70,57 @@
 
 /* ====================================================================== */
 
+/* Slow-query logging.  When search_slowlog_threshold is configured,
+ * any query whose search_query_run() exceeds it logs a forensic
+ * "slowquery:" line with the parsed search expression, the engine
+ * used, the mailbox size, per-subquery timings and the number of
+ * messages examined by folder scans. */
+
+/* keep the per-subquery trail from flooding syslog on wide scans */
+#define SLOWLOG_DETAIL_MAX  1024
+
+static unsigned long long slowlog_now_usec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* threshold in seconds, or 0 when slow-query logging is disabled */
+static double slowlog_threshold(void)
+{
+    static double threshold = -1;
+
+    if (threshold < 0) {
+        const char *s = config_getstring(IMAPOPT_SEARCH_SLOWLOG_THRESHOLD);
+        threshold = (s ? atof(s) : 0);
+        if (threshold < 0) threshold = 0;
+    }
+    return threshold;
+}
+
+static const char *slowlog_engine_name(void)
+{
+    switch (config_getenum(IMAPOPT_SEARCH_ENGINE)) {
+    case IMAP_ENUM_SEARCH_ENGINE_SQUAT: return "squat";
+    case IMAP_ENUM_SEARCH_ENGINE_SPHINX: return "sphinx";
+    case IMAP_ENUM_SEARCH_ENGINE_XAPIAN: return "xapian";
+    default: return "none";
+    }
+}
+
+static void slowlog_append(search_query_t *query, const char *kind,
+                           const char *name, unsigned long long usec)
+{
+    if (query->slowlog_detail.len >= SLOWLOG_DETAIL_MAX) return;
+    buf_printf(&query->slowlog_detail, " %s{%s}=%.1fms",
+               kind, name, usec / 1000.0);
+    if (query->slowlog_detail.len >= SLOWLOG_DETAIL_MAX)
+        buf_appendcstr(&query->slowlog_detail, " ...");
+}
+
+/* ====================================================================== */
+
 EXPORTED search_query_t *search_query_new(struct index_state *state,
                                           struct searchargs *searchargs)
 {
@@ -123,6 +178,7 @@ EXPORTED void search_query_free(search_query_t *query)
     }
     ptrarray_fini(&query->saved_msgdata);
 
+    buf_free(&query->slowlog_detail);
     free(query);
 }
 
@@ -444,6 +500,13 @@ struct subquery_rock {
     search_subquery_t *sub;
 };
 
+/* Have we already matched as many messages as the caller asked for? */
+static int query_is_satisfied(const search_query_t *query)
+{
+    return query->terminate_after &&
+           query->nmatches >= query->terminate_after;
+}
+
 /*
  * After an indexed subquery is run, we have accumulated a number of
  * unchecked UID hits in folders.  Here we check those UIDs for a) not
@@ -465,6 +528,7 @@ static void subquery_post_indexed(const char *key, void *data, void *rock)
     int r = 0;
 
     if (query->error) return;
+    if (query_is_satisfied(query)) return;
     if (!folder->unchecked_dirty) return;
 
     if (sub->expr && query->verbose) {
@@ -529,6 +593,9 @@ static void subquery_post_indexed(const char *key, void *data, void *rock)
         /* track first and last for MIN/MAX queries */
         if (!folder->first_modseq) folder->first_modseq = im->modseq;
         folder->last_modseq = im->modseq;
+
+        query->nmatches++;
+        if (query_is_satisfied(query)) break;
     }
 
     /* msgno_list contains only the MSNs for newly
@@ -595,14 +662,14 @@ static int add_unchecked_uid(const char *mboxname, uint32_t uidvalidity,
     return 0;
 }
 
-static void subquery_run_indexed(const char *key __attribute__((unused)),
-                                 void *data, void *rock)
+static void subquery_run_indexed(const char *key, void *data, void *rock)
 {
 //     const char *mboxname = key;
     search_subquery_t *sub = data;
     search_query_t *query = rock;
     search_builder_t *bx;
     struct subquery_rock qr;
+    unsigned long long t0 = 0;
     int r;
 
     if (query->error) return;
@@ -613,6 +680,7 @@ static void subquery_run_indexed(const char *key __attribute__((unused)),
         free(s);
     }
 
+    if (query->slowlog) t0 = slowlog_now_usec();
     bx = search_begin_search(query->state->mailbox,
                              (query->multiple ? SEARCH_MULTIPLE : 0)|
                              SEARCH_VERBOSE(query->verbose));
@@ -623,11 +691,18 @@ static void subquery_run_indexed(const char *key __attribute__((unused)),
     search_build_query(bx, sub->indexed);
     r = bx->run(bx, add_unchecked_uid, query);
     search_end_search(bx);
+    if (query->slowlog) {
+        unsigned long long usec = slowlog_now_usec() - t0;
+        query->engine_usec += usec;
+        slowlog_append(query, "indexed", key, usec);
+    }
     if (r) goto out;
 
     qr.query = query;
     qr.sub = sub;
+    if (query->slowlog) t0 = slowlog_now_usec();
     hash_enumerate(&query->folders_by_name, subquery_post_indexed, &qr);
+    if (query->slowlog) query->scan_usec += slowlog_now_usec() - t0;
 
 out:
     if (r) query->error = r;
@@ -642,8 +717,11 @@ static int subquery_run_one_folder(search_query_t *query,
     search_folder_t *folder = NULL;
     unsigned nmsgs = 0;
     unsigned *msgno_list = NULL;
+    unsigned long long t0 = 0;
     int r = 0;
 
+    if (query->slowlog) t0 = slowlog_now_usec();
+
     if (query->verbose) {
         char *s = search_expr_serialise(e);
         syslog(LOG_INFO, "Folder %s: running folder scan subquery: %s",
@@ -685,6 +763,8 @@ static int subquery_run_one_folder(search_query_t *query,
         if ((im->system_flags & FLAG_EXPUNGED) && !query->want_expunged)
             continue;
 
+        query->msgs_examined++;
+
         /* run the search program */
         if (!index_search_evaluate(state, e, msgno))
             continue;
@@ -710,6 +790,9 @@ static int subquery_run_one_folder(search_query_t *query,
         /* track first and last for MIN/MAX queries */
         if (!folder->first_modseq) folder->first_modseq = im->modseq;
         folder->last_modseq = im->modseq;
+
+        query->nmatches++;
+        if (query_is_satisfied(query)) break;
     }
 
     if (query->sortcrit && nmsgs)
@@ -720,6 +803,11 @@ static int subquery_run_one_folder(search_query_t *query,
 out:
     query_end_index(query, &state);
     free(msgno_list);
+    if (query->slowlog) {
+        unsigned long long usec = slowlog_now_usec() - t0;
+        query->scan_usec += usec;
+        slowlog_append(query, "scan", mboxname, usec);
+    }
     return r;
 }
 
@@ -731,6 +819,7 @@ static void subquery_run_folder(const char *key, void *data, void *rock)
     int r;
 
     if (query->error) return;
+    if (query_is_satisfied(query)) return;
     if (!query->multiple && strcmp(mboxname, index_mboxname(query->state)))
         return;
     r = subquery_run_one_folder(query, mboxname, sub->expr);
@@ -775,9 +864,293 @@ static int subquery_run_global(search_query_t *query, const char *mboxname)
 static int subquery_run_global_cb(const mbentry_t *mbentry, void *rock)
 {
     search_query_t *query = rock;
+    if (query_is_satisfied(query)) return 0;
     return subquery_run_global(query, mbentry->name);
 }
 
+/* ====================================================================== */
+
+/*
+ * Folder scan fan-out.  Scanning candidate folders decodes message
+ * text and dominates multi-folder query time, but the folders are
+ * independent of each other, so with search_fanout_procs > 1 we deal
+ * the folders out round-robin to a few forked workers.  Each worker
+ * inherits the whole query state, runs the same per-folder scan code
+ * the serial path uses, and writes its folders' uid sets back over a
+ * pipe; the parent merges them, deduplicating against anything the
+ * indexed phase already found, and then loads sort data for just the
+ * newly matched messages.  Workers only ever read mailboxes, which is
+ * why fan-out is not used when the query needs an expunge pass first.
+ */
+
+struct fanout_child {
+    pid_t pid;
+    int fd;
+};
+
+static void fanout_serialise_folder(const char *key __attribute__((unused)),
+                                    void *data, void *rock)
+{
+    search_folder_t *folder = data;
+    struct buf *buf = rock;
+    int uid;
+
+    if (bv_first_set(&folder->uids) < 0) return;
+
+    buf_appendbit32(buf, strlen(folder->mboxname));
+    buf_appendmap(buf, folder->mboxname, strlen(folder->mboxname));
+    buf_appendbit32(buf, folder->uidvalidity);
+    buf_appendbit64(buf, folder->highest_modseq);
+    buf_appendbit64(buf, folder->first_modseq);
+    buf_appendbit64(buf, folder->last_modseq);
+    buf_appendbit32(buf, bv_count(&folder->uids));
+    for (uid = bv_first_set(&folder->uids) ;
+         uid >= 0 ;
+         uid = bv_next_set(&folder->uids, uid+1))
+        buf_appendbit32(buf, uid);
+}
+
+static int fanout_worker(search_query_t *query, const strarray_t *mboxnames,
+                         int myidx, int nprocs, int global, int fd)
+{
+    struct buf buf = BUF_INITIALIZER;
+    int i;
+    int r = 0;
+
+    /* the inherited database handles are not safe to use after fork() */
+    mboxlist_close();
+    mboxlist_open(NULL);
+    annotatemore_close();
+    annotatemore_open();
+
+    /* the parent merges the results, loads any sort data, and talks to
+     * the client; we must do none of those */
+    query->sortcrit = NULL;
+    query->state->out = NULL;
+
+    for (i = myidx ; i < mboxnames->count ; i += nprocs) {
+        const char *mboxname = strarray_nth(mboxnames, i);
+
+        if (global) {
+            r = subquery_run_global(query, mboxname);
+        }
+        else {
+            search_subquery_t *sub =
+                (search_subquery_t *)hash_lookup(mboxname, &query->subs_by_folder);
+            if (!sub) continue;
+            r = subquery_run_one_folder(query, mboxname, sub->expr);
+        }
+        if (r) break;
+    }
+
+    if (!r) {
+        hash_enumerate(&query->folders_by_name, fanout_serialise_folder, &buf);
+        buf_appendbit32(&buf, 0);
+        if (retry_write(fd, buf.s, buf.len) < 0)
+            r = IMAP_IOERROR;
+    }
+
+    buf_free(&buf);
+    return r;
+}
+
+static int fanout_read(int fd, void *data, size_t len)
+{
+    if (retry_read(fd, data, len) != (ssize_t)len)
+        return IMAP_SYS_ERROR;
+    return 0;
+}
+
+/* Load sort data for the messages in 'newuids', which the merge just
+ * added to 'folder'; this is the work the worker skipped by running
+ * with sortcrit disabled. */
+static int fanout_load_msgdata(search_query_t *query,
+                               search_folder_t *folder,
+                               const bitvector_t *newuids)
+{
+    struct index_state *state = NULL;
+    unsigned *msgno_list;
+    unsigned nmsgs = 0;
+    unsigned msgno;
+    int r;
+
+    if (!query->sortcrit) return 0;
+    if (bv_first_set(newuids) < 0) return 0;
+
+    r = query_begin_index(query, folder->mboxname, &state);
+    if (r == IMAP_MAILBOX_NONEXISTENT) return 0;
+    if (r) return r;
+
+    msgno_list = (unsigned *)xmalloc((state->exists+1) * sizeof(unsigned));
+    for (msgno = 1 ; msgno <= state->exists ; msgno++) {
+        struct index_map *im = &state->map[msgno-1];
+        if (bv_isset(newuids, im->uid))
+            msgno_list[nmsgs++] = msgno;
+    }
+    if (nmsgs)
+        query_load_msgdata(query, folder, state, msgno_list, nmsgs);
+    free(msgno_list);
+
+    query_end_index(query, &state);
+    return 0;
+}
+
+static int fanout_merge(search_query_t *query, int fd)
+{
+    char name[MAX_MAILBOX_BUFFER];
+    bitvector_t newuids = BV_INITIALIZER;
+    int r = 0;
+
+    for (;;) {
+        search_folder_t *folder;
+        bit32 nlen, uidvalidity, nuids, i;
+        bit64 highest, first, last;
+
+        r = fanout_read(fd, &nlen, sizeof(nlen));
+        if (r) goto out;
+        nlen = ntohl(nlen);
+        if (!nlen) break;               /* end of this worker's results */
+        if (nlen >= sizeof(name)) {
+            r = IMAP_SYS_ERROR;
+            goto out;
+        }
+        r = fanout_read(fd, name, nlen);
+        if (r) goto out;
+        name[nlen] = '\0';
+
+        r = fanout_read(fd, &uidvalidity, sizeof(uidvalidity));
+        if (!r) r = fanout_read(fd, &highest, sizeof(highest));
+        if (!r) r = fanout_read(fd, &first, sizeof(first));
+        if (!r) r = fanout_read(fd, &last, sizeof(last));
+        if (!r) r = fanout_read(fd, &nuids, sizeof(nuids));
+        if (r) goto out;
+        uidvalidity = ntohl(uidvalidity);
+        highest = ntohll(highest);
+        first = ntohll(first);
+        last = ntohll(last);
+        nuids = ntohl(nuids);
+
+        folder = query_get_valid_folder(query, name, uidvalidity);
+
+        bv_clearall(&newuids);
+        for (i = 0 ; i < nuids ; i++) {
+            bit32 uid;
+            r = fanout_read(fd, &uid, sizeof(uid));
+            if (r) goto out;
+            uid = ntohl(uid);
+            if (!folder) continue;
+            if (bv_isset(&folder->uids, uid)) continue;
+            folder_add_uid(folder, uid);
+            bv_set(&newuids, uid);
+        }
+        if (!folder) continue;
+
+        folder_add_modseq(folder, highest);
+        if (first && !folder->first_modseq) folder->first_modseq = first;
+        if (last) folder->last_modseq = last;
+
+        r = fanout_load_msgdata(query, folder, &newuids);
+        if (r) goto out;
+    }
+
+out:
+    bv_free(&newuids);
+    return r;
+}
+
+static int subquery_run_folders_fanout(search_query_t *query,
+                                       const strarray_t *mboxnames,
+                                       int global, int nprocs)
+{
+    struct fanout_child *children;
+    int nstarted = 0;
+    int status;
+    int i;
+    unsigned long long t0 = 0;
+    int r = 0;
+
+    if (query->slowlog) t0 = slowlog_now_usec();
+
+    if (nprocs > mboxnames->count) nprocs = mboxnames->count;
+
+    if (query->verbose)
+        syslog(LOG_INFO, "Fanning out scan of %d folders over %d workers",
+               mboxnames->count, nprocs);
+
+    children = (struct fanout_child *)xmalloc(nprocs * sizeof(*children));
+
+    for (i = 0 ; i < nprocs ; i++) {
+        int pfd[2];
+        pid_t pid;
+
+        if (pipe(pfd) < 0) {
+            syslog(LOG_ERR, "search fanout: pipe(): %m");
+            r = IMAP_SYS_ERROR;
+            break;
+        }
+        pid = fork();
+        if (pid < 0) {
+            syslog(LOG_ERR, "search fanout: fork(): %m");
+            close(pfd[0]);
+            close(pfd[1]);
+            r = IMAP_SYS_ERROR;
+            break;
+        }
+        if (!pid) {
+            /* worker: must not touch the client connection or flush
+             * any inherited state on the way out */
+            close(pfd[0]);
+            r = fanout_worker(query, mboxnames, i, nprocs, global, pfd[1]);
+            _exit(r ? 1 : 0);
+        }
+        close(pfd[1]);
+        children[nstarted].pid = pid;
+        children[nstarted].fd = pfd[0];
+        nstarted++;
+    }
+
+    /* merge each worker's results; on error just close the remaining
+     * pipes, which makes those workers fail their result write and
+     * exit */
+    for (i = 0 ; i < nstarted ; i++) {
+        if (!r) r = fanout_merge(query, children[i].fd);
+        close(children[i].fd);
+    }
+
+    for (i = 0 ; i < nstarted ; i++) {
+        pid_t pr;
+        do {
+            pr = waitpid(children[i].pid, &status, 0);
+        } while (pr < 0 && errno == EINTR);
+        if (pr < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            if (!r) r = IMAP_SYS_ERROR;
+        }
+    }
+
+    free(children);
+    if (query->slowlog) {
+        unsigned long long usec = slowlog_now_usec() - t0;
+        char nbuf[32];
+        query->scan_usec += usec;
+        snprintf(nbuf, sizeof(nbuf), "%d folders", mboxnames->count);
+        slowlog_append(query, "fanout", nbuf, usec);
+    }
+    return r;
+}
+
+static int fanout_collect_mbentry_cb(const mbentry_t *mbentry, void *rock)
+{
+    strarray_append((strarray_t *)rock, mbentry->name);
+    return 0;
+}
+
+static void fanout_collect_folder_cb(const char *key,
+                                     void *data __attribute__((unused)),
+                                     void *rock)
+{
+    strarray_append((strarray_t *)rock, key);
+}
+
 static search_subquery_t *subquery_new(void)
 {
     search_subquery_t *sub = xzmalloc(sizeof(*sub));
@@ -835,7 +1208,19 @@ static void query_add_subquery(const char *mboxname,
 
 EXPORTED int search_query_run(search_query_t *query)
 {
+    int nprocs;
     int r = 0;
+    char *exprstr = NULL;
+    unsigned long long start = 0;
+    double threshold = slowlog_threshold();
+
+    if (threshold > 0) {
+        /* serialise the tree now; the split below consumes it */
+        query->slowlog = 1;
+        if (query->searchargs->root)
+            exprstr = search_expr_serialise(query->searchargs->root);
+        start = slowlog_now_usec();
+    }
 
     search_expr_split_by_folder_and_index(query->searchargs->root, query_add_subquery, query);
     query->searchargs->root = NULL;
@@ -852,12 +1237,34 @@ EXPORTED int search_query_run(search_query_t *query)
         if (r) goto out;
     }
 
+    /* fanning out folder scans is only worthwhile (and only safe) for
+     * read-only multi-folder queries; it's also pointless when the
+     * caller wants to stop early, since the whole idea there is to
+     * scan as little as possible */
+    nprocs = config_getint(IMAPOPT_SEARCH_FANOUT_PROCS);
+    if (nprocs < 2 || !query->multiple || query->need_expunge ||
+        query->terminate_after)
+        nprocs = 1;
+
     if (query->global_sub.expr) {
         /* We have a scan expression which applies to all folders.
          * Walk over every folder, applying the scan expression. */
         if (query->multiple) {
             char *userid = mboxname_to_userid(index_mboxname(query->state));
-            r = mboxlist_usermboxtree(userid, subquery_run_global_cb, query, /*flags*/0);
+            if (nprocs > 1) {
+                strarray_t mboxnames = STRARRAY_INITIALIZER;
+                r = mboxlist_usermboxtree(userid, fanout_collect_mbentry_cb,
+                                          &mboxnames, /*flags*/0);
+                if (!r && mboxnames.count > 1)
+                    r = subquery_run_folders_fanout(query, &mboxnames,
+                                                    /*global*/1, nprocs);
+                else if (!r && mboxnames.count)
+                    r = subquery_run_global(query, strarray_nth(&mboxnames, 0));
+                strarray_fini(&mboxnames);
+            }
+            else {
+                r = mboxlist_usermboxtree(userid, subquery_run_global_cb, query, /*flags*/0);
+            }
             free(userid);
         }
         else {
@@ -868,17 +1275,48 @@ EXPORTED int search_query_run(search_query_t *query)
     else if (query->folder_count) {
         /* We only have scan expressions limited to specific folders,
          * let's iterate those folders */
-        hash_enumerate(&query->subs_by_folder, subquery_run_folder, query);
-        r = query->error;
+        if (nprocs > 1 && query->folder_count > 1) {
+            strarray_t mboxnames = STRARRAY_INITIALIZER;
+            hash_enumerate(&query->subs_by_folder, fanout_collect_folder_cb,
+                           &mboxnames);
+            strarray_sort(&mboxnames, cmpstringp_raw);
+            r = subquery_run_folders_fanout(query, &mboxnames,
+                                            /*global*/0, nprocs);
+            strarray_fini(&mboxnames);
+        }
+        else if (query->terminate_after) {
+            /* Visit the folders in mboxname order so that the scan
+             * prefix, and thus any windowed paging built on it, is
+             * deterministic */
+            strarray_t mboxnames = STRARRAY_INITIALIZER;
+            int i;
+            hash_enumerate(&query->subs_by_folder, fanout_collect_folder_cb,
+                           &mboxnames);
+            strarray_sort(&mboxnames, cmpstringp_raw);
+            for (i = 0 ; i < mboxnames.count ; i++) {
+                const char *mboxname = strarray_nth(&mboxnames, i);
+                subquery_run_folder(mboxname,
+                                    hash_lookup(mboxname, &query->subs_by_folder),
+                                    query);
+            }
+            strarray_fini(&mboxnames);
+            r = query->error;
+        }
+        else {
+            hash_enumerate(&query->subs_by_folder, subquery_run_folder, query);
+            r = query->error;
+        }
         if (r) goto out;
     }
 
     if (query->need_ids)
         query_assign_folder_ids(query);
 
-    if (query->sortcrit) {
+    if (query->sortcrit && !query->terminate_after) {
         /*
-         * Do a post-search sorting phase.
+         * Do a post-search sorting phase.  (Skipped when the caller
+         * asked for early termination: the contract there is that the
+         * results come back in scan order.)
          *
          * Sorts MsgData objects.  These really really need to be replaced with
          * either message_t objects or some new smaller object which only stores
@@ -894,6 +1332,23 @@ EXPORTED int search_query_run(search_query_t *query)
     }
 
 out:
+    if (query->slowlog) {
+        unsigned long long elapsed = slowlog_now_usec() - start;
+        if (elapsed >= (unsigned long long)(threshold * 1e6)) {
+            syslog(LOG_NOTICE, "slowquery: mailbox %s msgs %u engine %s "
+                   "elapsed %.3fs engine %.3fs scan %.3fs "
+                   "examined %u matched %u%s expr %s%s",
+                   index_mboxname(query->state), query->state->exists,
+                   slowlog_engine_name(),
+                   elapsed / 1e6, query->engine_usec / 1e6,
+                   query->scan_usec / 1e6,
+                   query->msgs_examined, query->nmatches,
+                   r ? " (failed)" : "",
+                   exprstr ? exprstr : "()",
+                   buf_cstring(&query->slowlog_detail));
+        }
+    }
+    free(exprstr);
     return r;
 }
 
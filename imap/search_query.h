@@ -104,6 +104,18 @@ struct search_query {
     int want_expunged;
     uint32_t want_mbtype;
     int verbose;
+    /*
+     * When nonzero, scanning stops early once this many messages have
+     * matched, and the results are the prefix of the match set in scan
+     * order: folders in mboxname order, UIDs ascending within each
+     * folder (messages found by a search engine lookup arrive first,
+     * in whatever order the engine reports their folders).  The final
+     * sort pass is skipped - sortcrit still controls whether MsgData
+     * are loaded - and the modseq aggregates only cover the messages
+     * actually scanned.  Callers must only set this if a window of
+     * matches in scan order is acceptable.
+     */
+    unsigned int terminate_after;
 
     /*
      * A query comprises multiple sub-queries logically ORed together.
@@ -128,6 +140,19 @@ struct search_query {
     /* Used as a temporary holder for errors, e.g. to pass an error from
      * a hashtable enumeration callback back up to the caller */
     int error;
+    /* Number of messages matched so far, checked against
+     * terminate_after */
+    unsigned int nmatches;
+    /* Slow-query forensics, collected while search_slowlog_threshold
+     * is configured: wall time spent in search engine lookups and in
+     * folder scans, the number of messages examined by scans, and a
+     * capped per-subquery timing trail.  Scans fanned out to worker
+     * processes contribute to scan_usec but are not itemised. */
+    int slowlog;
+    unsigned long long engine_usec;
+    unsigned long long scan_usec;
+    unsigned int msgs_examined;
+    struct buf slowlog_detail;
     /*
      * Resulting messages from a search engine query or a folder scan
      * need to be organised per-folder both for the secondary scan
@@ -83,6 +83,8 @@ typedef struct {
     int verbose;
     SquatSearchIndex *index;
     int fd;
+    SquatSearchIndex *delta_index;
+    int delta_fd;
     const char *part_types;
     int found_validity;
     int depth;
@@ -256,6 +258,16 @@ static int drop_indexed_docs(void* closure, const SquatListDoc *doc)
     return SQUAT_CALLBACK_CONTINUE;
 }
 
+static int check_validity_doc(void* closure, const SquatListDoc *doc)
+{
+    SquatBuilderData* bb = (SquatBuilderData*)closure;
+
+    if (!strncmp(doc->doc_name, "validity.", 9) &&
+        (unsigned) atoi(doc->doc_name + 9) == bb->mailbox->i.uidvalidity)
+        bb->found_validity = 1;
+    return SQUAT_CALLBACK_CONTINUE;
+}
+
 static int fill_with_hits(void* closure, char const* doc)
 {
     SquatBuilderData* bb = (SquatBuilderData*)closure;
@@ -319,6 +331,21 @@ static void match(search_builder_t *bx, int part, const char *str)
                           str, bb->part_types, squat_strerror(r));
         goto out;
     }
+
+    /* Messages indexed since the last compaction live in the delta
+     * index; hits from there just OR into the same vector */
+    if (bb->delta_index) {
+        r = squat_search_execute(bb->delta_index, str, strlen(str),
+                                 fill_with_hits, bb);
+        if (r != SQUAT_OK) {
+            if (squat_get_last_error() == SQUAT_ERR_SEARCH_STRING_TOO_SHORT)
+                goto out;
+            syslog(LOG_ERR, "SQUAT string list search failed on string %s "
+                              "with part types %s: %s",
+                              str, bb->part_types, squat_strerror(r));
+            goto out;
+        }
+    }
     top->valid = 1;
 
 #if DEBUG
@@ -376,6 +403,37 @@ static search_builder_t *begin_search(struct mailbox *mailbox, int opts)
     bb->verbose = (opts & _SEARCH_VERBOSE_MASK);
     bb->index = index;
     bb->fd = fd;
+    bb->delta_fd = -1;
+
+    /* Open the delta index too, if there is one.  It holds messages
+     * indexed since the main index was last folded; a missing delta
+     * just means everything is in the main index. */
+    fname = mailbox_meta_fname(mailbox, META_SQUAT_DELTA);
+    if ((bb->delta_fd = open(fname, O_RDONLY)) >= 0) {
+        bb->delta_index = squat_search_open(bb->delta_fd);
+        if (bb->delta_index == NULL) {
+            syslog(LOG_ERR, "SQUAT failed to open delta index %s: %s",
+                   fname, squat_strerror(squat_get_last_error()));
+        }
+        else {
+            /* a delta left over from before a uidvalidity change would
+             * contribute hits for renumbered messages, so check its
+             * validity nonce before trusting it */
+            bb->found_validity = 0;
+            if (squat_search_list_docs(bb->delta_index,
+                                       check_validity_doc, bb) != SQUAT_OK ||
+                !bb->found_validity) {
+                syslog(LOG_ERR, "SQUAT stale delta index %s, ignoring",
+                       fname);
+                squat_search_close(bb->delta_index);
+                bb->delta_index = NULL;
+            }
+        }
+        if (bb->delta_index == NULL) {
+            close(bb->delta_fd);
+            bb->delta_fd = -1;
+        }
+    }
 
     /* Push a boolean node on the stack -- this will be used
      * at the end of the search to OR in any unindexed messages */
@@ -402,6 +460,15 @@ static int add_unindexed(SquatBuilderData *bb)
         r = IMAP_IOERROR;
         goto out;
     }
+    if (bb->delta_index) {
+        r = squat_search_list_docs(bb->delta_index, drop_indexed_docs, bb);
+        if (r != SQUAT_OK) {
+            syslog(LOG_ERR, "SQUAT failed to get list of delta-indexed "
+                            "documents: %s", squat_strerror(r));
+            r = IMAP_IOERROR;
+            goto out;
+        }
+    }
     if (!bb->found_validity) {
         syslog(LOG_ERR, "SQUAT didn't find validity record");
         r = IMAP_IOERROR;
@@ -458,6 +525,8 @@ static void end_search(search_builder_t *bx)
 
     while (bb->depth) opstack_pop(bb);
     free(bb->stack);
+    if (bb->delta_index) squat_search_close(bb->delta_index);
+    if (bb->delta_fd >= 0) close(bb->delta_fd);
     if (bb->index) squat_search_close(bb->index);
     if (bb->fd >= 0) close(bb->fd);
     free(bx);
@@ -482,11 +551,20 @@ static void end_search(search_builder_t *bx)
   the UIDs have been renumbered since we created the index (in which
   case the index is useless and is ignored).
 
-  Updating creates new indexes for one or more mailboxes. (We do not
-  support true incremental updates to an index yet.) The index is created
-  in "cyrus.squat.tmp" and then, if creation was successful, it is
-  atomically renamed to "cyrus.squat". This guarantees that we don't
+  Updating creates new indexes for one or more mailboxes. The index is
+  created under a temporary name and then, if creation was successful,
+  it is atomically renamed into place. This guarantees that we don't
   interfere with anyone who has the old index open.
+
+  Incremental updates write newly indexed messages into a small delta
+  index, "cyrus.squat.delta", and leave the main index untouched, so
+  the cost of an update is proportional to the delta rather than to
+  the whole mailbox. Searches consult both files and OR the results.
+  Once the delta grows past a fraction of the main index's size it is
+  folded back: the main index's documents are copied into a fresh
+  index, the delta's messages are reindexed from source, and the delta
+  file is removed. The delta carries its own validity nonce so a
+  leftover from before a uidvalidity change is never trusted.
 */
 
 /* These stats are gathered 1) per mailbox and 2) for the whole operation. */
@@ -508,6 +586,10 @@ typedef struct {
     int fd;
     SquatSearchIndex *old_index;
     int old_fd;
+    SquatSearchIndex *old_delta_index;
+    int old_delta_fd;
+    int delta_mode;     /* this update writes the delta index, not the
+                         * main one */
     struct mailbox *mailbox;
     int valid;
     uint32_t uidvalidity;
@@ -751,6 +833,33 @@ static int doc_check(void *closure, const SquatListDoc *doc)
     return (0);
 }
 
+/* Like doc_check, but only takes notes: used to learn which UIDs an
+ * index covers without copying its documents anywhere */
+static int note_indexed_docs(void *closure, const SquatListDoc *doc)
+{
+    doc_check(closure, doc);
+    return SQUAT_CALLBACK_CONTINUE;
+}
+
+/* Vet an old delta index before deciding to carry it forward: pick out
+ * its validity nonce and flag malformed document names, but don't
+ * touch d->indexed */
+static int probe_old_delta(void *closure, const SquatListDoc *doc)
+{
+    SquatReceiverData *d = (SquatReceiverData *)closure;
+
+    if (!strncmp(doc->doc_name, "validity.", 9))
+        d->uidvalidity = strtoul(doc->doc_name + 9, NULL, 10);
+    else if (!strchr("tfcbsmh", doc->doc_name[0]) ||
+             strtoul(doc->doc_name + 1, NULL, 10) == 0)
+        d->valid = 0;
+    return SQUAT_CALLBACK_CONTINUE;
+}
+
+/* Fold the delta index back into the main one once it has grown
+ * past this fraction of the main index's size */
+#define SQUAT_DELTA_FRACTION    4
+
 static int begin_mailbox(search_text_receiver_t *rx,
                          struct mailbox *mailbox,
                          int incremental)
@@ -761,33 +870,17 @@ static int begin_mailbox(search_text_receiver_t *rx,
     const char *old_filename;
     int fd = -1;
     int old_fd = -1;
+    int old_delta_fd = -1;
     SquatIndex *index = NULL;
     SquatSearchIndex *old_index = NULL;
+    SquatSearchIndex *old_delta_index = NULL;
+    struct stat sb_main, sb_delta;
+    int delta_mode = 0;
     int r = 0;      /* IMAP error code */
     int s = 0;      /* SQUAT error code */
 
     bv_clearall(&d->indexed);
 
-    filename = mailbox_meta_newfname(mailbox, META_SQUAT);
-    if ((fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0666)) < 0) {
-        syslog(LOG_ERR, "squat: unable to create temporary index file %s: %m",
-               filename);
-        r = IMAP_IOERROR;
-        goto out;
-    }
-
-    options.option_mask = SQUAT_OPTION_TMP_PATH | SQUAT_OPTION_STATISTICS;
-    options.tmp_path = mailbox_datapath(mailbox, 0);
-    options.stats_callback = stats_callback;
-    options.stats_callback_closure = (void *)d;
-    index = squat_index_init(fd, &options);
-    if (index == NULL) {
-        syslog(LOG_ERR, "squat: unable to initialise index %s: %s",
-               filename, squat_strerror(squat_get_last_error()));
-        r = IMAP_IOERROR;
-        goto out;
-    }
-
     /* Open existing index if it exists */
     old_filename = mailbox_meta_fname(mailbox, META_SQUAT);
     if (incremental) {
@@ -803,12 +896,14 @@ static int begin_mailbox(search_text_receiver_t *rx,
     }
 
     if (incremental) {
-        /* Copy existing document names verbatim. They end up with the same
-         * doc_IDs as in the old index, which makes trie copying much simpler.
-         */
+        /* Learn which messages the main index covers.  In delta mode
+         * its documents are never copied anywhere, so this listing is
+         * all that keeps them out of the update. */
         d->valid = 1;
         d->uidvalidity = 0L;
-        squat_index_add_existing(index, old_index, doc_check, d);
+        if (squat_search_list_docs(old_index, note_indexed_docs, d)
+                != SQUAT_OK)
+            d->valid = 0;
 
         if (!d->valid) {
             syslog(LOG_ERR, "squat: corrupt old index for mailbox %s, "
@@ -827,11 +922,91 @@ static int begin_mailbox(search_text_receiver_t *rx,
                             d->uidvalidity);
             incremental = 0;
         }
+
+        if (!incremental)
+            bv_clearall(&d->indexed);
     }
 
-    if (!incremental) {
-        bv_clearall(&d->indexed);
+    if (incremental) {
+        /* The main index is good, so aim to leave it alone and write
+         * the new messages into the delta index beside it. */
+        delta_mode = 1;
+        filename = mailbox_meta_fname(mailbox, META_SQUAT_DELTA);
+        old_delta_fd = open(filename, O_RDONLY);
+        if (old_delta_fd >= 0) {
+            /* Fold the delta back into the main index once it has
+             * grown past its welcome, and whenever it can't be
+             * trusted.  Folding is just the old-style incremental
+             * update: the delta's messages are not marked as indexed,
+             * so they are reindexed from source below. */
+            d->valid = 1;
+            d->uidvalidity = 0L;
+            if (fstat(old_fd, &sb_main) < 0 ||
+                fstat(old_delta_fd, &sb_delta) < 0)
+                delta_mode = 0;
+            else if (sb_delta.st_size * SQUAT_DELTA_FRACTION >
+                     sb_main.st_size)
+                delta_mode = 0;
+            else if ((old_delta_index = squat_search_open(old_delta_fd))
+                        == NULL)
+                delta_mode = 0;
+            else if (squat_search_list_docs(old_delta_index,
+                                            probe_old_delta, d) != SQUAT_OK ||
+                     !d->valid ||
+                     d->uidvalidity != mailbox->i.uidvalidity)
+                delta_mode = 0;
+
+            if (!delta_mode) {
+                syslog(LOG_NOTICE, "squat: folding delta index into "
+                                   "main index for mailbox %s",
+                                   mailbox->name);
+                if (old_delta_index) squat_search_close(old_delta_index);
+                old_delta_index = NULL;
+                close(old_delta_fd);
+                old_delta_fd = -1;
+            }
+        }
+    }
+
+    filename = mailbox_meta_newfname(mailbox, delta_mode ? META_SQUAT_DELTA
+                                                         : META_SQUAT);
+    if ((fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0666)) < 0) {
+        syslog(LOG_ERR, "squat: unable to create temporary index file %s: %m",
+               filename);
+        r = IMAP_IOERROR;
+        goto out;
+    }
+
+    options.option_mask = SQUAT_OPTION_TMP_PATH | SQUAT_OPTION_STATISTICS;
+    options.tmp_path = mailbox_datapath(mailbox, 0);
+    options.stats_callback = stats_callback;
+    options.stats_callback_closure = (void *)d;
+    index = squat_index_init(fd, &options);
+    if (index == NULL) {
+        syslog(LOG_ERR, "squat: unable to initialise index %s: %s",
+               filename, squat_strerror(squat_get_last_error()));
+        r = IMAP_IOERROR;
+        goto out;
+    }
 
+    if (delta_mode && old_delta_index) {
+        /* Copy the old delta's document names (including its validity
+         * nonce) verbatim. They end up with the same doc_IDs as in the
+         * old delta, which makes trie copying much simpler.
+         */
+        d->valid = 1;
+        squat_index_add_existing(index, old_delta_index, doc_check, d);
+    }
+    else if (incremental && !delta_mode) {
+        /* Folding: copy the main index's document names verbatim, same
+         * as the delta case above.  The messages that were only in the
+         * old delta are reindexed from source. */
+        bv_clearall(&d->indexed);
+        d->valid = 1;
+        d->uidvalidity = 0L;
+        squat_index_add_existing(index, old_index, doc_check, d);
+    }
+    else {
         /* write an empty document at the beginning to record the validity
            nonce */
         snprintf(d->doc_name, sizeof(d->doc_name),
@@ -867,6 +1042,11 @@ out:
         if (old_fd >= 0) close(old_fd);
         d->old_fd = -1;
 
+        if (old_delta_index != NULL) squat_search_close(old_delta_index);
+        d->old_delta_index = NULL;
+        if (old_delta_fd >= 0) close(old_delta_fd);
+        d->old_delta_fd = -1;
+
         d->mailbox = NULL;
     }
     else {
@@ -876,6 +1056,10 @@ out:
         d->old_index = old_index;
         d->old_fd = old_fd;
 
+        d->old_delta_index = old_delta_index;
+        d->old_delta_fd = old_delta_fd;
+        d->delta_mode = delta_mode;
+
         d->mailbox = mailbox;
         start_stats(&d->mailbox_stats);
     }
@@ -939,9 +1123,14 @@ static int end_mailbox(search_text_receiver_t *rx,
 
     /* OK, we successfully created the index under the temporary file name.
        Let's rename it to make it the real index. */
-    r = mailbox_meta_rename(d->mailbox, META_SQUAT);
+    r = mailbox_meta_rename(d->mailbox, d->delta_mode ? META_SQUAT_DELTA
+                                                      : META_SQUAT);
     if (r) goto out;
 
+    /* A new main index supersedes whatever delta was lying around */
+    if (!d->delta_mode)
+        unlink(mailbox_meta_fname(d->mailbox, META_SQUAT_DELTA));
+
     if (d->verbose) {
         stop_stats(&d->mailbox_stats);
         print_stats(d->mailbox->name, &d->mailbox_stats);
@@ -955,6 +1144,11 @@ out:
     if (d->old_fd >= 0) close(d->old_fd);
     d->old_fd = -1;
 
+    if (d->old_delta_index) squat_search_close(d->old_delta_index);
+    d->old_delta_index = NULL;
+    if (d->old_delta_fd >= 0) close(d->old_delta_fd);
+    d->old_delta_fd = -1;
+
     d->index = NULL;
     if (d->fd >= 0) close(d->fd);
     d->fd = -1;
@@ -44,6 +44,7 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#include <dirent.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <syslog.h>
@@ -55,7 +56,14 @@
 #include "bsearch.h"
 #include "exitcodes.h"
 #include "global.h"
+#include "append.h"
 #include "index.h"
+#include "mailbox.h"
+#include "mboxevent.h"
+#include "mboxlist.h"
+#include "quota.h"
+#include "strarray.h"
+#include "sync_log.h"
 #include "search_engines.h"
 #include "search_expr.h"
 #include "search_query.h"
@@ -243,13 +251,382 @@ out:
 
 /* ====================================================================== */
 
+/* Benchmark mode: ingest a maildir corpus into the target mailbox, then
+ * for each requested search engine build its index from scratch and
+ * replay a query workload file, reporting index size, build time and
+ * query latency distributions.  The engine is selected per-call through
+ * the search_engine option, so we can compare engines in one run by
+ * rewriting the option between passes. */
+
+#define BENCH_INGEST_BATCH  256     /* messages per append transaction */
+
+static const struct bench_engine {
+    const char *name;
+    enum enum_value conf;
+} bench_engines[] = {
+    { "squat",  IMAP_ENUM_SEARCH_ENGINE_SQUAT },
+    { "sphinx", IMAP_ENUM_SEARCH_ENGINE_SPHINX },
+    { "xapian", IMAP_ENUM_SEARCH_ENGINE_XAPIAN },
+    { NULL, 0 }
+};
+
+static uint64_t bench_now_usec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int bench_lat_compar(const void *a, const void *b)
+{
+    uint64_t la = *(const uint64_t *)a;
+    uint64_t lb = *(const uint64_t *)b;
+    return (la < lb ? -1 : la > lb ? 1 : 0);
+}
+
+static uint64_t bench_percentile(const uint64_t *lats, int n, int pct)
+{
+    int i = (n * pct) / 100;
+    return lats[i >= n ? n-1 : i];
+}
+
+/* append every regular file under 'maildir' to 'mboxname', creating the
+ * mailbox if necessary */
+static int bench_ingest(const char *mboxname, const char *maildir)
+{
+    DIR *dir;
+    struct dirent *d;
+    int msgnum = 0;
+    int r;
+
+    r = mboxlist_createmailbox(mboxname, /*mbtype*/0, /*partition*/NULL,
+                               /*isadmin*/1, "search_test",
+                               /*auth_state*/NULL, /*localonly*/0,
+                               /*forceuser*/1, /*dbonly*/0,
+                               /*notify*/0, NULL);
+    if (r == IMAP_MAILBOX_EXISTS) r = 0;
+    if (r) {
+        fprintf(stderr, "%s: can't create: %s\n", mboxname, error_message(r));
+        return r;
+    }
+
+    dir = opendir(maildir);
+    if (!dir) {
+        perror(maildir);
+        return IMAP_IOERROR;
+    }
+
+    d = readdir(dir);
+    while (d) {
+        struct appendstate as;
+        int thisbatch = 0;
+
+        r = append_setup(&as, mboxname, /*userid*/NULL,
+                         /*auth_state*/NULL, /*aclcheck*/0,
+                         /*quotacheck*/NULL, /*namespace*/NULL,
+                         /*isadmin*/1, EVENT_MESSAGE_APPEND);
+        if (r) break;
+
+        for ( ; d && thisbatch < BENCH_INGEST_BATCH ; d = readdir(dir)) {
+            char path[MAX_MAILBOX_PATH+1];
+            struct stagemsg *stage = NULL;
+            struct body *body = NULL;
+            struct stat sbuf;
+            char buf[8192];
+            size_t n;
+            FILE *in, *out;
+
+            if (d->d_name[0] == '.') continue;
+            snprintf(path, sizeof(path), "%s/%s", maildir, d->d_name);
+            if (stat(path, &sbuf) < 0 || !S_ISREG(sbuf.st_mode)) continue;
+
+            in = fopen(path, "r");
+            if (!in) continue;
+
+            out = append_newstage(mboxname, time(NULL), msgnum, &stage);
+            if (!out) {
+                fclose(in);
+                r = IMAP_IOERROR;
+                break;
+            }
+            while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+                fwrite(buf, 1, n, out);
+            fclose(in);
+            fclose(out);
+
+            r = append_fromstage(&as, &body, stage, /*internaldate*/0,
+                                 /*flags*/NULL, /*nolink*/0,
+                                 /*annotations*/NULL);
+            if (body) {
+                message_free_body(body);
+                free(body);
+            }
+            append_removestage(stage);
+            if (r) break;
+            msgnum++;
+            thisbatch++;
+        }
+
+        if (r) {
+            append_abort(&as);
+            break;
+        }
+        r = append_commit(&as);
+        if (r) break;
+    }
+    closedir(dir);
+
+    if (r)
+        fprintf(stderr, "%s: ingest failed after %d messages: %s\n",
+                mboxname, msgnum, error_message(r));
+    else if (verbose)
+        fprintf(stderr, "search_test: ingested %d messages from %s\n",
+                msgnum, maildir);
+    return r;
+}
+
+/* total on-disk size of the current engine's index.  Engines which
+ * don't implement list_files (squat) keep a single per-mailbox file */
+static uint64_t bench_index_size(struct mailbox *mailbox, const char *userid)
+{
+    strarray_t files = STRARRAY_INITIALIZER;
+    uint64_t size = 0;
+    struct stat sbuf;
+    int i;
+
+    search_list_files(userid, &files);
+    for (i = 0 ; i < files.count ; i++) {
+        if (stat(strarray_nth(&files, i), &sbuf) == 0)
+            size += sbuf.st_size;
+    }
+    if (!files.count) {
+        const char *fname = mailbox_meta_fname(mailbox, META_SQUAT);
+        if (fname && stat(fname, &sbuf) == 0)
+            size += sbuf.st_size;
+    }
+    strarray_fini(&files);
+    return size;
+}
+
+static void bench_count_folder(const char *key __attribute__((unused)),
+                               void *data, void *rock)
+{
+    *(uint64_t *)rock += search_folder_get_count((search_folder_t *)data);
+}
+
+/* run one workload query against an open index, recording its latency
+ * and the number of matching messages */
+static int bench_query(struct index_state *state,
+                       struct namespace *ns,
+                       const char *userid,
+                       struct auth_state *authstate,
+                       const char *line,
+                       uint64_t *usecp, uint64_t *nmatchesp)
+{
+    struct buf querytext = BUF_INITIALIZER;
+    struct protstream *pin = NULL;
+    struct protstream *pout = NULL;
+    struct searchargs *searchargs = NULL;
+    search_query_t *query = NULL;
+    uint64_t start;
+    int r;
+
+    buf_appendcstr(&querytext, line);
+    buf_putc(&querytext, '\r');
+    buf_cstring(&querytext);
+
+    pin = prot_readmap(querytext.s, querytext.len);
+    pout = prot_new(/*fd*/0, /*write*/1);
+
+    searchargs = new_searchargs(".", GETSEARCH_CHARSET_KEYWORD, ns,
+                                userid, authstate, /*isadmin*/0);
+    r = get_search_program(pin, pout, searchargs);
+    if (r != '\r') {
+        fprintf(stderr, "Couldn't parse IMAP search program \"%s\"\n", line);
+        r = IMAP_PROTOCOL_ERROR;
+        goto out;
+    }
+
+    query = search_query_new(state, searchargs);
+    query->verbose = verbose;
+    start = bench_now_usec();
+    r = search_query_run(query);
+    *usecp = bench_now_usec() - start;
+    if (r) {
+        fprintf(stderr, "Failed to run query \"%s\": %s\n",
+                line, error_message(r));
+        goto out;
+    }
+    hash_enumerate(&query->folders_by_name, bench_count_folder, nmatchesp);
+
+out:
+    prot_free(pin);
+    prot_free(pout);
+    freesearchargs(searchargs);
+    search_query_free(query);
+    buf_free(&querytext);
+    return r;
+}
+
+static int bench_one_engine(const struct bench_engine *be,
+                            const char *mboxname,
+                            const char *userid,
+                            const strarray_t *workload)
+{
+    struct mailbox *mailbox = NULL;
+    search_text_receiver_t *rx;
+    struct index_init init;
+    struct index_state *state = NULL;
+    struct namespace ns;
+    uint64_t *lats = NULL;
+    uint64_t build_usec, nmatches = 0;
+    uint64_t start;
+    int nlats = 0;
+    int i;
+    int r;
+
+    imapopts[IMAPOPT_SEARCH_ENGINE].val.e = be->conf;
+
+    rx = search_begin_update(verbose);
+    if (!rx) {
+        printf("engine %s: not compiled in, skipping\n", be->name);
+        return 0;
+    }
+
+    /* build the index from scratch */
+    r = mailbox_open_irl(mboxname, &mailbox);
+    if (r) {
+        fprintf(stderr, "%s: %s\n", mboxname, error_message(r));
+        search_end_update(rx);
+        return r;
+    }
+    start = bench_now_usec();
+    r = search_update_mailbox(rx, mailbox, /*flags*/0);
+    build_usec = bench_now_usec() - start;
+    search_end_update(rx);
+    if (r) {
+        fprintf(stderr, "engine %s: index build failed: %s\n",
+                be->name, error_message(r));
+        mailbox_close(&mailbox);
+        return r;
+    }
+
+    printf("engine %s: build %.3f sec, index %llu bytes\n",
+           be->name, build_usec / 1e6,
+           (unsigned long long)bench_index_size(mailbox, userid));
+    mailbox_close(&mailbox);
+
+    if (!workload->count) return 0;
+
+    /* replay the workload */
+    memset(&init, 0, sizeof(struct index_init));
+    r = mboxname_init_namespace(&ns, /*isadmin*/0);
+    if (r) {
+        fprintf(stderr, "Failed to initialise namespace: %s\n", error_message(r));
+        return r;
+    }
+    init.userid = userid;
+    init.authstate = auth_newstate(userid);
+    init.out = prot_new(/*fd*/0, /*write*/1);
+
+    r = index_open(mboxname, &init, &state);
+    if (r) {
+        fprintf(stderr, "%s: %s\n", mboxname, error_message(r));
+        goto out;
+    }
+    index_checkflags(state, 0, 0);
+
+    lats = xmalloc(workload->count * sizeof(uint64_t));
+    for (i = 0 ; i < workload->count ; i++) {
+        r = bench_query(state, &ns, userid, init.authstate,
+                        strarray_nth(workload, i),
+                        &lats[nlats], &nmatches);
+        if (r) goto out;
+        nlats++;
+    }
+
+    qsort(lats, nlats, sizeof(uint64_t), bench_lat_compar);
+    printf("engine %s: %d queries, %llu matches, "
+           "p50 %llu p90 %llu p99 %llu max %llu usec\n",
+           be->name, nlats, (unsigned long long)nmatches,
+           (unsigned long long)bench_percentile(lats, nlats, 50),
+           (unsigned long long)bench_percentile(lats, nlats, 90),
+           (unsigned long long)bench_percentile(lats, nlats, 99),
+           (unsigned long long)lats[nlats-1]);
+
+out:
+    free(lats);
+    index_close(&state);
+    prot_free(init.out);
+    auth_freestate(init.authstate);
+    return r;
+}
+
+static int do_bench(const char *mboxname,
+                    const char *userid,
+                    const char *maildir,
+                    const char *workloadfile,
+                    const char *engines)
+{
+    strarray_t workload = STRARRAY_INITIALIZER;
+    strarray_t *names = NULL;
+    char line[1024];
+    FILE *f;
+    int i;
+    int r = 0;
+
+    f = fopen(workloadfile, "r");
+    if (!f) {
+        perror(workloadfile);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *p = line + strlen(line);
+        while (p > line && Uisspace(p[-1])) *--p = '\0';
+        if (!line[0] || line[0] == '#') continue;
+        strarray_append(&workload, line);
+    }
+    fclose(f);
+
+    if (maildir) {
+        r = bench_ingest(mboxname, maildir);
+        if (r) goto out;
+    }
+
+    names = strarray_split(engines, ",", 0);
+    for (i = 0 ; i < names->count ; i++) {
+        const struct bench_engine *be;
+        for (be = bench_engines ; be->name ; be++) {
+            if (!strcmp(be->name, strarray_nth(names, i))) break;
+        }
+        if (!be->name) {
+            fprintf(stderr, "Unknown search engine \"%s\"\n",
+                    strarray_nth(names, i));
+            r = -1;
+            goto out;
+        }
+        r = bench_one_engine(be, mboxname, userid, &workload);
+        if (r) goto out;
+    }
+
+out:
+    strarray_free(names);
+    strarray_fini(&workload);
+    return !!r;
+}
+
+/* ====================================================================== */
+
 int main(int argc, char **argv)
 {
     int c;
     const char *alt_config = NULL;
     const char *userid = NULL;
     const char *mboxname = NULL;
-    enum { SEARCH, SERIALISE } mode = SEARCH;
+    const char *maildir = NULL;
+    const char *workloadfile = NULL;
+    const char *engines = "squat,xapian";
+    enum { SEARCH, SERIALISE, BENCH } mode = SEARCH;
     int multiple = 0;
     int r = 0;
 
@@ -257,7 +634,7 @@ int main(int argc, char **argv)
         fatal("must run as the Cyrus user", EC_USAGE);
     }
 
-    while ((c = getopt(argc, argv, "C:LMSm:u:v")) != EOF) {
+    while ((c = getopt(argc, argv, "C:LMSb:d:e:m:u:v")) != EOF) {
         switch (c) {
 
         case 'C': /* alt config file */
@@ -268,6 +645,19 @@ int main(int argc, char **argv)
             mode = SERIALISE;
             break;
 
+        case 'b': /* benchmark against this query workload file */
+            workloadfile = optarg;
+            mode = BENCH;
+            break;
+
+        case 'd': /* maildir corpus to ingest before benchmarking */
+            maildir = optarg;
+            break;
+
+        case 'e': /* engines to benchmark */
+            engines = optarg;
+            break;
+
         case 'M':
             multiple = 1;
             break;
@@ -294,9 +684,9 @@ int main(int argc, char **argv)
         }
     }
 
-    if (optind == argc)
+    if (optind == argc && mode != BENCH)
         usage(argv[0]);
-    if (mode == SEARCH && !mboxname)
+    if (mode != SERIALISE && !mboxname)
         usage(argv[0]);
 
     cyrus_init(alt_config, "search_test",
@@ -324,6 +714,24 @@ int main(int argc, char **argv)
     case SERIALISE:
         r = do_serialise(argv+optind, argc-optind);
         break;
+
+    case BENCH:
+        if (!userid) {
+            userid = freeme = mboxname_to_userid(mboxname);
+            if (!userid)
+                usage(argv[0]);
+        }
+
+        quotadb_init(0);
+        quotadb_open(NULL);
+        sync_log_init();
+
+        r = do_bench(mboxname, userid, maildir, workloadfile, engines);
+        free(freeme);
+
+        quotadb_close();
+        quotadb_done();
+        break;
     }
 
     mboxlist_close();
@@ -337,6 +745,7 @@ int main(int argc, char **argv)
 static int usage(const char *name)
 {
     fprintf(stderr, "usage: %s [format-options] -m mailbox -u userid searchprogram...\n", name);
+    fprintf(stderr, "       %s -b workload-file [-d maildir] [-e engine,...] -m mailbox [-u userid]\n", name);
     exit(EC_USAGE);
 }
 
@@ -319,6 +319,12 @@ EXPORTED int seen_write(struct seen *seendb, const char *uniqueid, struct seenda
 
     sync_log_seen(seendb->user, uniqueid);
 
+    /* optionally feed the access event log which arbitron -i
+     * aggregates in place of a full seen database scan */
+    if (config_getswitch(IMAPOPT_ARBITRON_LOG))
+        sync_log_channel_seen(SYNC_LOG_ARBITRON_CHANNEL,
+                              seendb->user, uniqueid);
+
     return r;
 }
 
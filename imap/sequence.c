@@ -52,6 +52,17 @@
 
 #define SETGROWSIZE 30
 
+/* Make room for at least `need' more ranges.  Grows geometrically so
+ * that building a large set costs O(log n) reallocs, not O(n) */
+static void seqset_ensure(struct seqset *seq, size_t need)
+{
+    if (seq->len + need <= seq->alloc) return;
+
+    if (!seq->alloc) seq->alloc = SETGROWSIZE;
+    while (seq->len + need > seq->alloc) seq->alloc *= 2;
+    seq->set = xrealloc(seq->set, seq->alloc * sizeof(struct seq_range));
+}
+
 /*
  * Allocate and return a new seqset object.
  *
@@ -106,11 +117,7 @@ EXPORTED void seqset_add(struct seqset *seq, unsigned num, int ismember)
 
     /* do we need to add a new set? */
     if (!seq->set || seq->set[seq->len-1].high < seq->prev) {
-        if (seq->len == seq->alloc) {
-            seq->alloc += SETGROWSIZE;
-            seq->set =
-                xrealloc(seq->set, seq->alloc * sizeof(struct seq_range));
-        }
+        seqset_ensure(seq, 1);
         seq->set[seq->len].low = num;
         seq->len++;
     }
@@ -233,12 +240,22 @@ EXPORTED struct seqset *seqset_parse(const char *sequence,
                             unsigned maxval)
 {
     unsigned start = 0, end = 0;
+    size_t count = 1;
+    const char *p;
 
     /* short circuit no sequence */
     if (!sequence) return NULL;
 
     if (!set) set = seqset_init(maxval, SEQ_SPARSE);
 
+    /* size the range array up front: one cheap pass over the string
+     * beats reallocating every few ranges for the huge sets some
+     * clients send */
+    for (p = sequence; *p; p++) {
+        if (*p == ',') count++;
+    }
+    seqset_ensure(set, count);
+
     while (*sequence) {
         if (read_num(&sequence, maxval, &start))
             fatal("invalid sequence", EC_SOFTWARE);
@@ -255,10 +272,6 @@ EXPORTED struct seqset *seqset_parse(const char *sequence,
             start = i;
         }
 
-        if (set->len == set->alloc) {
-            set->alloc += SETGROWSIZE;
-            set->set = xrealloc(set->set, set->alloc * sizeof(struct seq_range));
-        }
         set->set[set->len].low = start;
         set->set[set->len].high = end;
         set->len++;
@@ -389,6 +402,27 @@ EXPORTED unsigned seqset_getnext(struct seqset *seq)
     return 0;
 }
 
+/*
+ * Iterate the sequence a run at a time rather than a number at a
+ * time, so callers can process contiguous ranges in one go.  `*iterp'
+ * must be initialised to zero before the first call and is advanced
+ * internally; unlike seqset_getnext() no state is kept in the seqset,
+ * so several iterations can be in flight over the same set.  Returns
+ * 1 and fills in `*lowp'/`*highp' with the next run, or returns 0
+ * when the sequence is exhausted.
+ */
+EXPORTED int seqset_getrange(const struct seqset *seq, size_t *iterp,
+                             unsigned *lowp, unsigned *highp)
+{
+    if (!seq) return 0;
+    if (*iterp >= seq->len) return 0;
+
+    *lowp = seq->set[*iterp].low;
+    *highp = seq->set[*iterp].high;
+    (*iterp)++;
+    return 1;
+}
+
 /*
  * Merge the numbers in seqset `b' into seqset `a'.
  */
@@ -413,7 +447,7 @@ static void format_num(struct buf *buf, unsigned i)
     if (i == UINT_MAX)
         buf_putc(buf, '*');
     else
-        buf_printf(buf, "%u", i);
+        buf_appenduint32(buf, i);
 }
 
 /*
@@ -447,6 +481,46 @@ EXPORTED char *seqset_cstring(const struct seqset *seq)
     return buf_release(&buf);
 }
 
+/*
+ * Set in `bv' the bit for every number which is a member of `seq'.
+ * Bits already set in `bv' are left alone, so this can be used to
+ * merge sequences into one bitmap.
+ */
+EXPORTED void seqset_tobitvector(const struct seqset *seq, bitvector_t *bv)
+{
+    unsigned i;
+    unsigned num;
+
+    if (!seq) return;
+
+    for (i = 0; i < seq->len; i++) {
+        unsigned high = seq->set[i].high;
+
+        /* an unresolved '*' has no bit to set */
+        if (high == UINT_MAX) high = seq->maxval;
+        if (high == UINT_MAX) continue;
+
+        for (num = seq->set[i].low; num <= high; num++)
+            bv_set(bv, num);
+    }
+}
+
+/*
+ * Build a seqset containing every number whose bit is set in `bv',
+ * the inverse of seqset_tobitvector().  Returns a newly allocated
+ * seqset which must be freed with seqset_free().
+ */
+EXPORTED struct seqset *seqset_frombitvector(const bitvector_t *bv)
+{
+    struct seqset *seq = seqset_init(0, SEQ_MERGE);
+    int num;
+
+    for (num = bv_first_set(bv); num >= 0; num = bv_next_set(bv, num+1))
+        seqset_add(seq, num, 1);
+
+    return seq;
+}
+
 /*
  * Duplicate the given seqset.
  */
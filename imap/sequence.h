@@ -46,6 +46,8 @@
 #ifndef SEQUENCE_H
 #define SEQUENCE_H
 
+#include "bitvector.h"
+
 struct seq_range {
     unsigned low;
     unsigned high;
@@ -76,6 +78,8 @@ extern struct seqset *seqset_parse(const char *sequence,
 extern void seqset_join(struct seqset *a, const struct seqset *b);
 extern int seqset_ismember(struct seqset *set, unsigned num);
 extern unsigned seqset_getnext(struct seqset *set);
+extern int seqset_getrange(const struct seqset *set, size_t *iterp,
+                           unsigned *lowp, unsigned *highp);
 extern unsigned seqset_first(const struct seqset *set);
 extern unsigned seqset_firstnonmember(const struct seqset *set);
 extern unsigned seqset_last(const struct seqset *set);
@@ -83,4 +87,8 @@ extern char *seqset_cstring(const struct seqset *set);
 extern void seqset_free(struct seqset *set);
 extern struct seqset *seqset_dup(const struct seqset *);
 
+/* bitmap representation of a sequence */
+extern void seqset_tobitvector(const struct seqset *seq, bitvector_t *bv);
+extern struct seqset *seqset_frombitvector(const bitvector_t *bv);
+
 #endif /* SEQUENCE_H */
@@ -55,11 +55,11 @@
  * The request consists of the database map name and the lookup key
  * separated by a space character:
  *
- * <mapname> � � <key>
+ * <mapname> � � <key>
  *
  * The server responds with a status indicator and the result (if any):
  *
- * <status> � � <result>
+ * <status> � � <result>
  *
  * The status indicator is one of the following upper case words:
  *
@@ -274,7 +274,8 @@ static int verify_user(const char *key, struct auth_state *authstate)
      * - must not be overquota
      */
     r = mboxlist_lookup(mbname_intname(mbname), &mbentry, NULL);
-    if (r == IMAP_MAILBOX_NONEXISTENT && config_mupdate_server) {
+    if (r == IMAP_MAILBOX_NONEXISTENT && config_mupdate_server &&
+        mupdate_bloom_check(mbname_intname(mbname))) {
         kick_mupdate();
         mboxlist_entry_free(&mbentry);
         r = mboxlist_lookup(mbname_intname(mbname), &mbentry, NULL);
@@ -58,28 +58,48 @@
 
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
+#include "imap/rfc822_header.h"
 
 struct header_t {
     char *name;
     char *body;
+    enum rfc822_header id;  /* interned token, or RFC822_BAD if not known */
     struct header_t *next;
     struct header_t *prev;
 };
 
 struct hdrcache_t {
-    hash_table cache;       /* hash table of headers for quick retrieval     */
+    hash_table2 cache;      /* hash table of headers for quick retrieval     */
     struct header_t *head;  /* head of double-linked list of ordered headers */
     struct header_t *tail;  /* tail of double-linked list of ordered headers */
+    hash_table2 memo;       /* case-folded name -> strarray_t of bodies, as
+                             * returned by spool_getheader().  One delivery
+                             * queries the same headers once per recipient
+                             * (sieve tests, duplicate suppression, notify),
+                             * so lookups are built once and invalidated only
+                             * when that header is modified */
     ptrarray_t getheader_cache;  /* header bodies returned by spool_getheader()   */
+
+    /* headers with a token in rfc822_header.st skip the string hashing
+     * above entirely - they are interned to their token by the generated
+     * perfect hash and indexed here, so identity checks and lookups are
+     * integer operations */
+    ptrarray_t byid[RFC822_HEADER_NUM_STRINGS];
+    strarray_t *memo_byid[RFC822_HEADER_NUM_STRINGS];
 };
 
 hdrcache_t spool_new_hdrcache(void)
 {
     hdrcache_t cache = xzmalloc(sizeof(struct hdrcache_t));
 
-    if (!construct_hash_table(&cache->cache, 4000, 0)) {
+    if (!construct_hash_table2(&cache->cache, 4000)) {
+        free(cache);
+        return NULL;
+    }
+    if (!construct_hash_table2(&cache->memo, 100)) {
+        free_hash_table2(&cache->cache, NULL);
         free(cache);
-        cache = NULL;
+        return NULL;
     }
 
     return cache;
@@ -275,21 +295,35 @@ static int parseheader(struct protstream *fin, FILE *fout,
 }
 
 static struct header_t *__spool_cache_header(char *name, char *body,
-                                             hash_table *table)
+                                             hdrcache_t cache)
 {
     ptrarray_t *contents;
     struct header_t *hdr = xzmalloc(sizeof(struct header_t));
 
     hdr->name = name;
     hdr->body = body;
+    hdr->id = rfc822_header_from_string(name);
+
+    if (hdr->id >= 0) {
+        /* known header - intern by token, no string hashing */
+        ptrarray_append(&cache->byid[hdr->id], hdr);
+
+        /* this header changed; rebuild any memoized lookup on next use */
+        cache->memo_byid[hdr->id] = NULL;
+
+        return hdr;
+    }
 
     /* add header to hash table */
     name = lcase(xstrdup(name));
-    contents = (ptrarray_t *) hash_lookup(name, table);
+    contents = (ptrarray_t *) hash_lookup2(name, &cache->cache);
 
-    if (!contents) contents = hash_insert(name, ptrarray_new(), table);
+    if (!contents) contents = hash_insert2(name, ptrarray_new(), &cache->cache);
     ptrarray_append(contents, hdr);
 
+    /* this header changed; rebuild any memoized lookup on next use */
+    hash_del2(name, &cache->memo);
+
     free(name);
 
     return hdr;
@@ -297,7 +331,7 @@ static struct header_t *__spool_cache_header(char *name, char *body,
 
 EXPORTED void spool_prepend_header(char *name, char *body, hdrcache_t cache)
 {
-    struct header_t *hdr = __spool_cache_header(name, body, &cache->cache);
+    struct header_t *hdr = __spool_cache_header(name, body, cache);
 
     /* link header at head of list */
     hdr->next = cache->head;
@@ -310,7 +344,7 @@ EXPORTED void spool_prepend_header(char *name, char *body, hdrcache_t cache)
 
 EXPORTED void spool_append_header(char *name, char *body, hdrcache_t cache)
 {
-    struct header_t *hdr = __spool_cache_header(name, body, &cache->cache);
+    struct header_t *hdr = __spool_cache_header(name, body, cache);
 
     /* link header at tail of list */
     hdr->prev = cache->tail;
@@ -330,8 +364,21 @@ EXPORTED void spool_replace_header(char *name, char *body, hdrcache_t cache)
 static void __spool_remove_header(char *name, int first, int last,
                                   hdrcache_t cache)
 {
-    ptrarray_t *contents =
-        (ptrarray_t *) hash_lookup(lcase(name), &cache->cache);
+    ptrarray_t *contents;
+    enum rfc822_header id = rfc822_header_from_string(name);
+
+    if (id >= 0) {
+        contents = &cache->byid[id];
+
+        /* this header is changing; rebuild any memoized lookup on next use */
+        cache->memo_byid[id] = NULL;
+    }
+    else {
+        contents = (ptrarray_t *) hash_lookup2(lcase(name), &cache->cache);
+
+        /* this header is changing; rebuild any memoized lookup on next use */
+        hash_del2(name, &cache->memo);
+    }
 
     if (contents) {
         int idx;
@@ -402,6 +449,45 @@ EXPORTED int spool_fill_hdrcache(struct protstream *fin, FILE *fout,
     return r;
 }
 
+/* build the read-only array of bodies for a ptrarray of header_t */
+static strarray_t *__spool_build_bodies(hdrcache_t cache, ptrarray_t *contents)
+{
+    strarray_t *array = strarray_new();
+    int i;
+
+    for (i = 0; i < ptrarray_size(contents); i++) {
+        struct header_t *hdr = ptrarray_nth(contents, i);
+        strarray_append(array, hdr->body);
+    }
+
+    /* cache the response so we clean it up later */
+    ptrarray_append(&cache->getheader_cache, array);
+
+    return array;
+}
+
+EXPORTED const char **spool_getheader_byid(hdrcache_t cache,
+                                           enum rfc822_header id)
+{
+    strarray_t *array;
+
+    assert(cache && id >= 0 && id < RFC822_HEADER_NUM_STRINGS);
+
+    /* served this lookup before?  The same array can go out again -
+     * any change to the header would have dropped it from the memo */
+    array = cache->memo_byid[id];
+    if (array) return (const char **) array->data;
+
+    if (!ptrarray_size(&cache->byid[id])) return NULL;
+
+    array = __spool_build_bodies(cache, &cache->byid[id]);
+
+    /* memoize it for the next recipient asking the same question */
+    cache->memo_byid[id] = array;
+
+    return (const char **) array->data;
+}
+
 EXPORTED const char **spool_getheader(hdrcache_t cache, const char *phead)
 {
     char *head;
@@ -409,54 +495,60 @@ EXPORTED const char **spool_getheader(hdrcache_t cache, const char *phead)
 
     assert(cache && phead);
 
+    /* known headers dispatch on their interned token */
+    enum rfc822_header id = rfc822_header_from_string(phead);
+    if (id >= 0) return spool_getheader_byid(cache, id);
+
     head = xstrdup(phead);
     lcase(head);
 
-    /* check the cache */
-    contents = (ptrarray_t *) hash_lookup(head, &cache->cache);
+    /* served this lookup before?  The same array can go out again -
+     * any change to the header would have dropped it from the memo */
+    strarray_t *array = (strarray_t *) hash_lookup2(head, &cache->memo);
+    if (array) {
+        free(head);
+        return (const char **) array->data;
+    }
 
-    free(head);
+    /* check the cache */
+    contents = (ptrarray_t *) hash_lookup2(head, &cache->cache);
 
     if (contents && ptrarray_size(contents)) {
-        strarray_t *array = strarray_new();
-        /* build read-only array of header bodies */
-
-        int i;
-        for (i = 0; i < ptrarray_size(contents); i++) {
-            struct header_t *hdr = ptrarray_nth(contents, i);
-            strarray_append(array, hdr->body);
-        }
-
-        /* cache the response so we clean it up later */
-        ptrarray_append(&cache->getheader_cache, array);
+        /* build read-only array of header bodies, and memoize it
+         * for the next recipient asking the same question */
+        array = __spool_build_bodies(cache, contents);
+        hash_insert2(head, array, &cache->memo);
 
+        free(head);
         return (const char **) array->data;
     }
 
+    free(head);
     return NULL;
 }
 
-static void __spool_free_hdrcache(ptrarray_t *pa)
+EXPORTED void spool_free_hdrcache(hdrcache_t cache)
 {
-    int idx;
+    struct header_t *hdr, *next;
+    int i;
 
-    for (idx = ptrarray_size(pa) - 1; idx >= 0; idx--) {
-        struct header_t *hdr = ptrarray_nth(pa, idx);
+    if (!cache) return;
 
+    /* every header is on the ordered list, known or not */
+    for (hdr = cache->head; hdr; hdr = next) {
+        next = hdr->next;
         free(hdr->name);
         free(hdr->body);
         free(hdr);
     }
-    ptrarray_free(pa);
-}
 
-EXPORTED void spool_free_hdrcache(hdrcache_t cache)
-{
-    int i;
+    free_hash_table2(&cache->cache, (void (*)(void *)) ptrarray_free);
 
-    if (!cache) return;
+    for (i = 0; i < RFC822_HEADER_NUM_STRINGS; i++)
+        ptrarray_fini(&cache->byid[i]);
 
-    free_hash_table(&cache->cache, (void (*)(void *)) __spool_free_hdrcache);
+    /* the memoized arrays are owned by getheader_cache below */
+    free_hash_table2(&cache->memo, NULL);
 
     for (i = 0; i < cache->getheader_cache.count; i++) {
         strarray_t *item = ptrarray_nth(&cache->getheader_cache, i);
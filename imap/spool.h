@@ -46,6 +46,9 @@
 #include <stdio.h>
 #include "prot.h"
 
+/* generated headers are not necessarily in current directory */
+#include "imap/rfc822_header.h"
+
 typedef struct hdrcache_t *hdrcache_t;
 
 hdrcache_t spool_new_hdrcache(void);
@@ -60,6 +63,9 @@ void spool_remove_header_instance(char *name, int n, hdrcache_t cache);
 int spool_fill_hdrcache(struct protstream *fin, FILE *fout, hdrcache_t cache,
                         const char **skipheaders);
 const char **spool_getheader(hdrcache_t cache, const char *phead);
+/* as spool_getheader(), but dispatching on the interned header token -
+ * use this when the header of interest is known at compile time */
+const char **spool_getheader_byid(hdrcache_t cache, enum rfc822_header id);
 void spool_free_hdrcache(hdrcache_t cache);
 void spool_enum_hdrcache(hdrcache_t cache,
                          void (*proc)(const char *, const char *, void *),
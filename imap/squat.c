@@ -72,6 +72,26 @@ struct _SquatSearchIndex {
 /* For each 0 <= i < 256, bit_counts[i] is the number of bits set in i */
 static char bit_counts[256];
 
+/* How much of the trie data just below the word list root to ask for
+ * up front at open time: every lookup descends through the top levels
+ * of the root trie, which are written immediately before the root */
+#define SQUAT_ROOT_PRELOAD (256*1024)
+
+/* Hint to the VM that we're about to access [start, end) in random
+ * order: queues readahead without blocking on it */
+static void squat_advise_willneed(SquatSearchIndex const* index,
+                                  char const* start, char const* end)
+{
+  size_t pagemask = ((size_t)getpagesize()) - 1;
+  size_t off = (start - index->data) & ~pagemask;
+
+  if (end > index->data_end) end = index->data_end;
+  if (end <= index->data + off) return;
+
+  (void)madvise((void *)(index->data + off),
+                end - (index->data + off), MADV_WILLNEED);
+}
+
 /* Returns true IFF the 'len' bytes starting at 's' are each equal to 'v' */
 static int memconst(char const* s, int len, char v) {
   while (len > 0 && *s == v) {
@@ -141,6 +161,22 @@ EXPORTED SquatSearchIndex* squat_search_open(int fd) {
   memcpy(index->valid_char_bits, header->valid_char_bits,
          sizeof(index->valid_char_bits));
 
+  /* The tries are written leaves-first, so a search descends towards
+     LOWER addresses in essentially random order; the kernel's default
+     sequential readahead just streams in data we'll never touch.
+     Tell it so. */
+  (void)madvise((void *)index->data, data_len + SQUAT_SAFETY_ZONE,
+                MADV_RANDOM);
+
+  /* Every lookup walks the top levels of the root trie, which are
+     written immediately below the word list root; pull those in now
+     so the first searches don't fault one page at a time */
+  squat_advise_willneed(index,
+                        index->word_list > index->data + SQUAT_ROOT_PRELOAD
+                          ? index->word_list - SQUAT_ROOT_PRELOAD
+                          : index->data,
+                        index->word_list + getpagesize());
+
   return index;
 
 cleanup_unmap:
@@ -883,8 +919,9 @@ EXPORTED int squat_scan(SquatSearchIndex* index, char first_char,
  * squat_count_docs() will page in lots of data from disk via the mmapped
  * index file. Unfortunately squat indexes are built back to front, so
  * the scan would read blocks out of order as the data structure is
- * traversed. squat_preload_data() is a rather evil hack to try and
- * force sequential disk I/O: it serves no other function.
+ * traversed. squat_preload_data() asks the kernel to read the whole
+ * subtree in ahead of time so the scan faults against warm pages: it
+ * serves no other function.
  */
 
 static int
@@ -899,29 +936,20 @@ squat_count_docs_callback(void* closure,
   return SQUAT_CALLBACK_CONTINUE;
 }
 
-/* Attempt to load blocks of data from mmap()ed array before we start
-   random access */
+/* Queue readahead for the mmap()ed range before we start random access */
 
-#define PRELOAD_BLOCK_SIZE (4096)          /*  4 KBytes */
 #define PRELOAD_MAX_SIZE   (20*1024*1024)  /* 20 MBytes */
 
 static void
-squat_preload_data(char const* t, char const* s)
+squat_preload_data(SquatSearchIndex const* index, char const* t, char const* s)
 {
-  char buf[PRELOAD_BLOCK_SIZE];
   char const* start = (t > s) ? s : t;
-  unsigned long len = (t > s) ? (t-s) : (s-t);
+  char const* end = (t > s) ? t : s;
 
-  if (len >= PRELOAD_MAX_SIZE)
+  if ((unsigned long)(end - start) >= PRELOAD_MAX_SIZE)
     return;
 
-  while (len > 0) {
-    unsigned long size = (len > PRELOAD_BLOCK_SIZE) ? PRELOAD_BLOCK_SIZE : len;
-
-    memcpy(buf, start, size);
-    start += size;
-    len   -= size;
-  }
+  squat_advise_willneed(index, start, end);
 }
 
 EXPORTED int squat_count_docs(SquatSearchIndex* index, char first_char, int *counter)
@@ -940,7 +968,7 @@ EXPORTED int squat_count_docs(SquatSearchIndex* index, char first_char, int *cou
   /* First trie is at index->doc_ID_list + (no_docIDs *4). However
    * no_docIDs doesn't appear to be stored anywhere (zero terminated list).
    * Following is good enough for our purposes */
-  squat_preload_data((t) ? t : index->doc_ID_list, s);
+  squat_preload_data(index, (t) ? t : index->doc_ID_list, s);
 
   memset(buf, 0, sizeof(buf));
   buf[0] = first_char;
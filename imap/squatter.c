@@ -56,6 +56,7 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <sys/poll.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -68,6 +69,7 @@
 #include "mboxlist.h"
 #include "global.h"
 #include "exitcodes.h"
+#include "hash.h"
 #include "search_engines.h"
 #include "sync_log.h"
 #include "mailbox.h"
@@ -95,6 +97,7 @@ static struct namespace squat_namespace;
 const int SKIP_FUZZ = 60;
 
 static int verbose = 0;
+static int jobs = 1;
 static int incremental_mode = 0;
 static int batch_mode = 0;
 static int recursive_flag = 0;
@@ -124,6 +127,7 @@ static int usage(const char *name)
             "\n"
             "Index mode options:\n"
             "  -i          index incrementally\n"
+            "  -j N        index using N worker processes\n"
             "  -N name     index mailbox names starting with name\n"
             "  -S seconds  sleep seconds between indexing mailboxes\n"
             "\n"
@@ -365,6 +369,115 @@ static int do_indexer(const strarray_t *sa)
     return r;
 }
 
+/* Per-partition dealing state for partition_mboxnames() */
+struct part_deal {
+    int first;      /* worker the partition's first mailbox went to */
+    int count;      /* mailboxes dealt out so far */
+};
+
+/* Deal the mailboxes out across nprocs worker slices.  Each spool
+ * partition's mailboxes are spread evenly over the workers, and each
+ * partition starts dealing at a different worker, so a parallel run
+ * doesn't gang all the workers up on one partition's disks at once.
+ * Any -S sleep then applies per worker, which bounds the aggregate
+ * I/O rate against a single partition. */
+static void partition_mboxnames(const strarray_t *sa, int nprocs,
+                                strarray_t *slices)
+{
+    hash_table deals = HASH_TABLE_INITIALIZER;
+    int nparts = 0;
+    int i;
+
+    construct_hash_table(&deals, 128, 0);
+
+    for (i = 0 ; i < sa->count ; i++) {
+        const char *name = sa->data[i];
+        const char *partition = "";
+        mbentry_t *mbentry = NULL;
+        struct part_deal *deal;
+
+        if (!mboxlist_lookup(name, &mbentry, NULL) && mbentry->partition)
+            partition = mbentry->partition;
+
+        deal = hash_lookup(partition, &deals);
+        if (!deal) {
+            deal = xzmalloc(sizeof(struct part_deal));
+            deal->first = nparts++ % nprocs;
+            hash_insert(partition, deal, &deals);
+        }
+        strarray_append(&slices[(deal->first + deal->count++) % nprocs],
+                        name);
+
+        mboxlist_entry_free(&mbentry);
+    }
+
+    free_hash_table(&deals, free);
+}
+
+static int do_indexer_parallel(const strarray_t *sa, int nprocs)
+{
+    strarray_t *slices;
+    pid_t *pids;
+    int i;
+    int r = 0;
+
+    if (nprocs > sa->count)
+        nprocs = sa->count;
+    if (nprocs <= 1)
+        return do_indexer(sa);
+
+    slices = xmalloc(nprocs * sizeof(strarray_t));
+    for (i = 0 ; i < nprocs ; i++)
+        strarray_init(&slices[i]);
+    partition_mboxnames(sa, nprocs, slices);
+
+    pids = xzmalloc(nprocs * sizeof(pid_t));
+    for (i = 0 ; i < nprocs ; i++) {
+        pid_t pid;
+
+        if (!slices[i].count) continue;
+
+        pid = fork();
+        if (pid < 0) {
+            syslog(LOG_ERR, "squatter: unable to fork worker: %m");
+            r = IMAP_SYS_ERROR;
+            break;
+        }
+        if (!pid) {
+            /* worker: the parent's database handles are not safe to
+             * share across a fork, so get our own */
+            int wr;
+
+            mboxlist_close();
+            mboxlist_open(NULL);
+            annotatemore_close();
+            annotatemore_open();
+
+            wr = do_indexer(&slices[i]);
+            shut_down(wr ? EC_TEMPFAIL : 0);
+        }
+        pids[i] = pid;
+    }
+
+    for (i = 0 ; i < nprocs ; i++) {
+        int status;
+
+        if (!pids[i]) continue;
+        if (waitpid(pids[i], &status, 0) < 0) continue;
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+            syslog(LOG_ERR, "squatter: worker %d exited abnormally", i);
+            r = IMAP_SYS_ERROR;
+        }
+    }
+
+    for (i = 0 ; i < nprocs ; i++)
+        strarray_fini(&slices[i]);
+    free(slices);
+    free(pids);
+
+    return r;
+}
+
 static int index_single_message(const char *mboxname, uint32_t uid)
 {
     int r;
@@ -827,7 +940,7 @@ int main(int argc, char **argv)
 
     setbuf(stdout, NULL);
 
-    while ((opt = getopt(argc, argv, "C:I:N:RUXT:S:Fc:de:f:mn:riavz:t:ouh")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:I:N:RUXT:S:Fc:de:f:j:mn:riavz:t:ouh")) != EOF) {
         switch (opt) {
         case 'C':               /* alt config file */
             alt_config = optarg;
@@ -928,6 +1041,11 @@ int main(int argc, char **argv)
             incremental_mode = 1;
             break;
 
+        case 'j':               /* parallel workers */
+            jobs = atoi(optarg);
+            if (jobs < 1) usage(argv[0]);
+            break;
+
         case 'a':               /* use /squat annotation */
             if (mode != UNKNOWN && mode != INDEXER) usage(argv[0]);
             annotation_flag = 1;
@@ -1000,7 +1118,10 @@ int main(int argc, char **argv)
         if (recursive_flag && optind == argc) usage(argv[0]);
         expand_mboxnames(&mboxnames, argc-optind, (const char **)argv+optind, user_mode);
         syslog(LOG_NOTICE, "indexing mailboxes");
-        r = do_indexer(&mboxnames);
+        if (jobs > 1)
+            r = do_indexer_parallel(&mboxnames, jobs);
+        else
+            r = do_indexer(&mboxnames);
         syslog(LOG_NOTICE, "done indexing mailboxes");
         break;
     case INDEXFROM:
@@ -78,6 +78,12 @@ extern int statuscache_lookup(const char *mboxname, const char *userid,
 extern int statuscache_invalidate(const char *mboxname,
                                   struct statusdata *sdata);
 
+/* read the mailbox's counter from the shared generation table; returns
+   nonzero and fills *genp when the table is available.  While the
+   counter holds the same value, any answer previously computed for the
+   mailbox is still current */
+extern int statuscache_generation(const char *mboxname, uint32_t *genp);
+
 /* close the database */
 extern void statuscache_close(void);
 
@@ -51,15 +51,20 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <syslog.h>
 
 #include "assert.h"
 #include "cyrusdb.h"
+#include "cyr_lock.h"
+#include "hash.h"
 #include "imapd.h"
 #include "global.h"
 #include "mboxlist.h"
 #include "mailbox.h"
+#include "murmurhash2.h"
+#include "retry.h"
 #include "seen.h"
 #include "util.h"
 #include "xmalloc.h"
@@ -75,6 +80,186 @@
 static struct db *statuscachedb;
 static int statuscache_dbopen = 0;
 
+/* ---- shared generation table ----
+ *
+ * A fixed array of per-mailbox generation counters in a writable
+ * MAP_SHARED file.  statuscache_invalidate() - the push-invalidation
+ * choke point, called from mailbox_unlock_index() after a commit and
+ * from the seen-state writers - bumps the mailbox's counter, and each
+ * process stamps the statuscache answers it hands out with the counter
+ * value it read them at.  While the counter hasn't moved, a repeat
+ * STATUS is answered from the stamped in-process copy: two memory
+ * reads, no mailbox open, no db fetch.
+ *
+ * Slots are hashed by mailbox name (the invalidation paths have the
+ * name, not the uniqueid), so a collision only ever causes a spurious
+ * refetch, never a stale answer.  The counters are advisory - a torn
+ * or lost update just means one extra trip to the db - so they're
+ * read and written without any locking. */
+
+#define FNAME_STATUSCACHEGEN "/statuscache.gen"
+
+#define SCGEN_MAGIC ("\241\002\213\015statuscachegen\0\0")
+#define SCGEN_MAGIC_SIZE (20)
+#define SCGEN_HEADER_SIZE (32)
+#define SCGEN_OFFSET_VERSION (20)
+#define SCGEN_OFFSET_NSLOTS (24)
+#define SCGEN_VERSION (1)
+#define SCGEN_NSLOTS (16384)
+#define SCGEN_FILE_SIZE (SCGEN_HEADER_SIZE + \
+                         (size_t)SCGEN_NSLOTS * sizeof(uint32_t))
+
+static int scgen_fd = -1;
+static char *scgen_base = NULL;
+
+/* in-process statusdata copies, stamped with the generation they were
+ * read at.  Keyed by the same mboxname%%userid key as the db */
+struct scmemo {
+    uint32_t gen;
+    unsigned statusitems;
+    uint32_t messages;
+    uint32_t recent;
+    uint32_t uidnext;
+    uint32_t uidvalidity;
+    uint32_t unseen;
+    modseq_t highestmodseq;
+};
+
+static hash_table scmemo_table;
+
+static int scgen_init_file(const char *fname)
+{
+    char header[SCGEN_HEADER_SIZE];
+    uint32_t num;
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, SCGEN_MAGIC, SCGEN_MAGIC_SIZE);
+    num = htonl(SCGEN_VERSION);
+    memcpy(header + SCGEN_OFFSET_VERSION, &num, 4);
+    num = htonl(SCGEN_NSLOTS);
+    memcpy(header + SCGEN_OFFSET_NSLOTS, &num, 4);
+
+    /* sparse - slots fill in as they're touched */
+    if (ftruncate(scgen_fd, 0) < 0 ||
+        retry_write(scgen_fd, header, SCGEN_HEADER_SIZE) < 0 ||
+        ftruncate(scgen_fd, SCGEN_FILE_SIZE) < 0) {
+        syslog(LOG_ERR, "IOERROR: initialising %s: %m", fname);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int scgen_header_ok(void)
+{
+    uint32_t num;
+
+    if (memcmp(scgen_base, SCGEN_MAGIC, SCGEN_MAGIC_SIZE)) return 0;
+
+    memcpy(&num, scgen_base + SCGEN_OFFSET_VERSION, 4);
+    if (ntohl(num) != SCGEN_VERSION) return 0;
+
+    memcpy(&num, scgen_base + SCGEN_OFFSET_NSLOTS, 4);
+    if (ntohl(num) != SCGEN_NSLOTS) return 0;
+
+    return 1;
+}
+
+static void scgen_open(void)
+{
+    char *fname;
+    struct stat sbuf;
+
+    if (scgen_base) return;
+
+    fname = strconcat(config_dir, FNAME_STATUSCACHEGEN, (char *)NULL);
+
+    scgen_fd = open(fname, O_RDWR | O_CREAT, 0644);
+    if (scgen_fd < 0) {
+        syslog(LOG_ERR, "IOERROR: opening %s: %m", fname);
+        goto out;
+    }
+
+    /* hold the lock while checking so only one process initialises */
+    if (lock_setlock(scgen_fd, /*exclusive*/1, /*nonblock*/0, fname)) {
+        syslog(LOG_ERR, "IOERROR: locking %s: %m", fname);
+        goto fail;
+    }
+
+    if (fstat(scgen_fd, &sbuf) < 0) {
+        syslog(LOG_ERR, "IOERROR: fstat %s: %m", fname);
+        goto fail_unlock;
+    }
+
+    /* wrong size, new, or damaged - the contents are disposable, so
+     * just start over with a zeroed table */
+    if ((size_t)sbuf.st_size != SCGEN_FILE_SIZE &&
+        scgen_init_file(fname) < 0)
+        goto fail_unlock;
+
+    scgen_base = mmap(NULL, SCGEN_FILE_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, scgen_fd, 0L);
+    if (scgen_base == MAP_FAILED) {
+        syslog(LOG_ERR, "IOERROR: mmap %s: %m", fname);
+        scgen_base = NULL;
+        goto fail_unlock;
+    }
+
+    if (!scgen_header_ok() && scgen_init_file(fname) < 0) {
+        munmap(scgen_base, SCGEN_FILE_SIZE);
+        scgen_base = NULL;
+        goto fail_unlock;
+    }
+
+    lock_unlock(scgen_fd, fname);
+
+    construct_hash_table(&scmemo_table, 1024, 0);
+    goto out;
+
+ fail_unlock:
+    lock_unlock(scgen_fd, fname);
+ fail:
+    close(scgen_fd);
+    scgen_fd = -1;
+ out:
+    free(fname);
+}
+
+static uint32_t *scgen_slot(const char *mboxname)
+{
+    uint32_t hash;
+
+    if (!scgen_base) return NULL;
+
+    hash = murmurhash2(mboxname, strlen(mboxname), 0) % SCGEN_NSLOTS;
+    return (uint32_t *)(scgen_base + SCGEN_HEADER_SIZE) + hash;
+}
+
+static void scgen_bump(const char *mboxname)
+{
+    uint32_t *slot;
+
+    if (!scgen_base) scgen_open();
+
+    slot = scgen_slot(mboxname);
+    /* two racing bumps may collapse into one, but either way the
+     * value differs from every stamp handed out before the change */
+    if (slot) (*slot)++;
+}
+
+EXPORTED int statuscache_generation(const char *mboxname, uint32_t *genp)
+{
+    uint32_t *slot;
+
+    if (!scgen_base) scgen_open();
+
+    slot = scgen_slot(mboxname);
+    if (!slot) return 0;
+
+    *genp = *slot;
+    return 1;
+}
+
 char *statuscache_filename(void)
 {
     const char *fname = config_getstring(IMAPOPT_STATUSCACHE_DB_PATH);
@@ -100,6 +285,7 @@ EXPORTED void statuscache_open(void)
     }
 
     statuscache_dbopen = 1;
+    scgen_open();
 out:
     free(fname);
 }
@@ -366,11 +552,33 @@ EXPORTED int statuscache_lookup(const char *mboxname, const char *userid,
     const char *data = NULL, *dend;
     char *p, *key = statuscache_buildkey(mboxname, userid, &keylen);
     unsigned version;
+    uint32_t *genslot;
+    uint32_t gen = 0;
+    struct scmemo *memo = NULL;
 
     /* Don't access DB if it hasn't been opened */
     if (!statuscache_dbopen)
         return IMAP_NO_NOSUCHMSG;
 
+    /* steady state: if the mailbox's generation hasn't moved since we
+     * last answered for this key, serve the stamped in-process copy */
+    genslot = scgen_slot(mboxname);
+    if (genslot) {
+        gen = *genslot;
+        memo = (struct scmemo *)hash_lookup(key, &scmemo_table);
+        if (memo && memo->gen == gen &&
+            (memo->statusitems & statusitems) == statusitems) {
+            sdata->statusitems = memo->statusitems;
+            sdata->messages = memo->messages;
+            sdata->recent = memo->recent;
+            sdata->uidnext = memo->uidnext;
+            sdata->uidvalidity = memo->uidvalidity;
+            sdata->unseen = memo->unseen;
+            sdata->highestmodseq = memo->highestmodseq;
+            return 0;
+        }
+    }
+
     /* Check if there is an entry in the database */
     do {
         r = cyrusdb_fetch(statuscachedb, key, keylen, &data, &datalen, NULL);
@@ -406,6 +614,23 @@ EXPORTED int statuscache_lookup(const char *mboxname, const char *userid,
         return IMAP_NO_NOSUCHMSG;
     }
 
+    /* stamp a copy with the generation read before the fetch, so a
+     * change which raced the fetch leaves the copy already stale */
+    if (genslot) {
+        if (!memo) {
+            memo = xzmalloc(sizeof(struct scmemo));
+            hash_insert(key, memo, &scmemo_table);
+        }
+        memo->gen = gen;
+        memo->statusitems = sdata->statusitems;
+        memo->messages = sdata->messages;
+        memo->recent = sdata->recent;
+        memo->uidnext = sdata->uidnext;
+        memo->uidvalidity = sdata->uidvalidity;
+        memo->unseen = sdata->unseen;
+        memo->highestmodseq = sdata->highestmodseq;
+    }
+
     return 0;
 }
 
@@ -519,6 +744,10 @@ HIDDEN int statuscache_invalidate(const char *mboxname, struct statusdata *sdata
         if (drock.tid) cyrusdb_abort(drock.db, drock.tid);
     }
 
+    /* tell every process their stamped copies are stale.  Bumped even
+     * if the store failed - a spurious refetch is harmless */
+    scgen_bump(mboxname);
+
     if (doclose)
         statuscache_close();
 
@@ -83,6 +83,7 @@
 #include "xstrlcat.h"
 #include "signals.h"
 #include "cyrusdb.h"
+#include "strhash.h"
 
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
@@ -110,6 +111,11 @@ static int background      = 0;
 static int do_compress     = 0;
 static int no_copyback     = 0;
 
+/* hash-partitioned rolling replication (-N) */
+static unsigned num_shards = 0;
+static const char *shard_channel = NULL;
+static pid_t *shard_pids   = NULL;
+
 static char *prev_userid;
 
 static void shut_down(int code) __attribute__((noreturn));
@@ -735,15 +741,40 @@ static void replica_connect(const char *channel)
 
 #ifdef HAVE_ZLIB
     /* Does the backend support compression? */
-    if (CAPA(sync_backend, CAPA_COMPRESS)) {
-        prot_printf(sync_backend->out, "%s\r\n",
-                    sync_backend->prot->u.std.compress_cmd.cmd);
-        prot_flush(sync_backend->out);
+    if (CAPA(sync_backend, CAPA_COMPRESS) ||
+        CAPA(sync_backend, CAPA_COMPRESS_DICT)) {
+        int dict = CAPA(sync_backend, CAPA_COMPRESS_DICT) ? 1 : 0;
+        int ok = 0;
+
+        /* a dictionary-capable peer shares our preset dictionary, which
+         * improves the ratio on the protocol chatter between messages */
+        if (dict) {
+            prot_printf(sync_backend->out, "%s-DICT\r\n",
+                        sync_backend->prot->u.std.compress_cmd.cmd);
+            prot_flush(sync_backend->out);
+
+            ok = !sync_parse_response("COMPRESS", sync_backend->in, NULL);
+            if (!ok) dict = 0;
+        }
+
+        if (!ok) {
+            prot_printf(sync_backend->out, "%s\r\n",
+                        sync_backend->prot->u.std.compress_cmd.cmd);
+            prot_flush(sync_backend->out);
+
+            ok = !sync_parse_response("COMPRESS", sync_backend->in, NULL);
+        }
 
-        if (sync_parse_response("COMPRESS", sync_backend->in, NULL)) {
+        if (!ok) {
             if (do_compress) fatal("Failed to enable compression, aborting", EC_SOFTWARE);
             syslog(LOG_NOTICE, "Failed to enable compression, continuing uncompressed");
         }
+        else if (dict) {
+            prot_setcompress_dict(sync_backend->in, prot_deflate_dict,
+                                  prot_deflate_dict_len);
+            prot_setcompress_dict(sync_backend->out, prot_deflate_dict,
+                                  prot_deflate_dict_len);
+        }
         else {
             prot_setcompress(sync_backend->in);
             prot_setcompress(sync_backend->out);
@@ -752,6 +783,18 @@ static void replica_connect(const char *channel)
     else if (do_compress) fatal("Backend does not support compression, aborting", EC_SOFTWARE);
 #endif
 
+    /* Does the backend accept binary dlists?  Negotiate after
+     * compression so the bulk data gets deflated too */
+    if (CAPA(sync_backend, CAPA_SYNC_BINARY)) {
+        prot_printf(sync_backend->out, "BINARY\r\n");
+        prot_flush(sync_backend->out);
+
+        if (!sync_parse_response("BINARY", sync_backend->in, NULL))
+            sync_dlist_binary(sync_backend->in, sync_backend->out);
+        else
+            syslog(LOG_NOTICE, "Failed to enable binary dlists, continuing with text");
+    }
+
     /* links to sockets */
     sync_in = sync_backend->in;
     sync_out = sync_backend->out;
@@ -776,7 +819,11 @@ static void replica_disconnect(void)
     backend_disconnect(sync_backend);
 }
 
-static void do_daemon(const char *channel, const char *sync_shutdown_file,
+/* 'conf_channel' is the channel used for config lookups - it differs
+   from 'channel' only for shard workers, which read a per-shard
+   sub-channel but connect with the base channel's settings */
+static void do_daemon(const char *channel, const char *conf_channel,
+                      const char *sync_shutdown_file,
                       unsigned long timeout, unsigned long min_delta)
 {
     int r = 0;
@@ -785,7 +832,7 @@ static void do_daemon(const char *channel, const char *sync_shutdown_file,
     signal(SIGPIPE, SIG_IGN); /* don't fail on server disconnects */
 
     while (restart) {
-        replica_connect(channel);
+        replica_connect(conf_channel);
         r = do_daemon_work(channel, sync_shutdown_file,
                            timeout, min_delta, &restart);
         if (r) {
@@ -799,6 +846,110 @@ static void do_daemon(const char *channel, const char *sync_shutdown_file,
     }
 }
 
+/* ====================================================================== */
+
+/* Name of the per-shard sub-channel that the splitter feeds and the
+   shard's worker replays */
+static char *shard_channel_name(const char *channel, unsigned shard)
+{
+    struct buf buf = BUF_INITIALIZER;
+
+    buf_printf(&buf, "%s-shard%u", channel ? channel : "sync", shard);
+
+    return buf_release(&buf);
+}
+
+/* Map a sync log entry to the shard that owns it.  Every entry for a
+   given user hashes to the same shard, preserving per-user ordering;
+   entries with no owning user (server annotations, shared mailboxes)
+   all go to shard 0 */
+static unsigned shard_of_item(const char *type, const char *arg1)
+{
+    const char *userid = arg1;
+    char *freeme = NULL;
+    unsigned shard;
+
+    if (strcmp(type, "USER") && strcmp(type, "UNUSER") &&
+        strcmp(type, "META") && strcmp(type, "SIEVE") &&
+        strcmp(type, "SEEN") && strcmp(type, "SUB") &&
+        strcmp(type, "UNSUB")) {
+        /* argument is a mailbox name (or quota root) */
+        userid = freeme = mboxname_to_userid(arg1);
+    }
+
+    shard = userid ? strhash(userid) % num_shards : 0;
+
+    free(freeme);
+    return shard;
+}
+
+/* Parent process of sharded rolling replication: split the incoming
+   sync log across the per-shard sub-channels.  The workers do all of
+   the actual replication */
+static void do_shard_split(const char *channel,
+                           const char *sync_shutdown_file,
+                           unsigned long min_delta)
+{
+    sync_log_reader_t *slr;
+    struct stat sbuf;
+    const char *args[3];
+    int r;
+
+    slr = sync_log_reader_create_with_channel(channel);
+
+    while (1) {
+        signals_poll();
+
+        /* Check for shutdown file */
+        if (sync_shutdown_file && !stat(sync_shutdown_file, &sbuf)) {
+            unlink(sync_shutdown_file);
+            break;
+        }
+
+        r = sync_log_reader_begin(slr);
+        if (r) {
+            /* including specifically r == IMAP_AGAIN */
+            if (min_delta > 0) {
+                sleep(min_delta);
+            } else {
+                usleep(100000);    /* 1/10th second */
+            }
+            continue;
+        }
+
+        while (sync_log_reader_getitem(slr, args) != EOF) {
+            char *shardchan =
+                shard_channel_name(channel, shard_of_item(args[0], args[1]));
+
+            if (args[2])
+                sync_log_channel(shardchan, "%s %s %s",
+                                 args[0], args[1], args[2]);
+            else
+                sync_log_channel(shardchan, "%s %s", args[0], args[1]);
+
+            free(shardchan);
+        }
+
+        r = sync_log_reader_end(slr);
+        if (r) {
+            syslog(LOG_ERR, "Error splitting sync log file %s: %s",
+                   sync_log_reader_get_file_name(slr), error_message(r));
+            break;
+        }
+    }
+    sync_log_reader_free(slr);
+
+    /* Shut the workers down and reap them */
+    unsigned i;
+    for (i = 0; i < num_shards; i++) kill(shard_pids[i], SIGTERM);
+    for (i = 0; i < num_shards; i++) {
+        int status;
+        waitpid(shard_pids[i], &status, 0);
+    }
+}
+
+/* ====================================================================== */
+
 static int do_mailbox(const char *mboxname, const char **channelp, unsigned flags)
 {
     struct sync_name_list *list = sync_name_list_create();
@@ -898,7 +1049,7 @@ int main(int argc, char **argv)
 
     setbuf(stdout, NULL);
 
-    while ((opt = getopt(argc, argv, "C:vlLS:F:f:w:t:d:n:rRumsozOAp:")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:vlLS:F:f:w:t:d:n:N:rRumsozOAp:")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -937,6 +1088,10 @@ int main(int argc, char **argv)
             channel = optarg;
             break;
 
+        case 'N': /* number of shards for rolling replication */
+            num_shards = atoi(optarg);
+            break;
+
         case 'w':
             wait = atoi(optarg);
             break;
@@ -1027,6 +1182,38 @@ int main(int argc, char **argv)
         }
     }
 
+    /* fork the shard workers for hash-partitioned rolling replication,
+     * before any databases are opened so that the splitter and every
+     * worker get their own handles.  The parent does no replication
+     * itself - it splits the incoming log across the shard channels */
+    if (num_shards > 1) {
+        unsigned shard;
+
+        if (mode != MODE_REPEAT || input_filename)
+            fatal("sharding (-N) requires rolling replication mode (-r/-R)",
+                  EC_USAGE);
+
+        shard_pids = xzmalloc(num_shards * sizeof(pid_t));
+
+        for (shard = 0; shard < num_shards; shard++) {
+            int pid = fork();
+
+            if (pid == -1) {
+                perror("fork");
+                exit(1);
+            }
+
+            if (pid == 0) { /* worker - replays this shard's channel */
+                free(shard_pids);
+                shard_pids = NULL;
+                shard_channel = shard_channel_name(channel, shard);
+                break;
+            }
+
+            shard_pids[shard] = pid;
+        }
+    }
+
     cyrus_init(alt_config, "sync_client",
                (verbose > 1 ? CYRUSINIT_PERROR : 0),
                CONFIG_NEED_PARTITION_DATA);
@@ -1201,7 +1388,18 @@ int main(int argc, char **argv)
             if (!min_delta)
                 min_delta = sync_get_intconfig(channel, "sync_repeat_interval");
 
-            do_daemon(channel, sync_shutdown_file, timeout, min_delta);
+            if (shard_pids) {
+                /* splitter parent - the workers check no shutdown
+                   file; they are signalled when the splitter stops */
+                do_shard_split(channel, sync_shutdown_file, min_delta);
+            }
+            else if (shard_channel) {
+                do_daemon(shard_channel, channel, NULL, timeout, min_delta);
+            }
+            else {
+                do_daemon(channel, channel, sync_shutdown_file,
+                          timeout, min_delta);
+            }
         }
 
         break;
@@ -59,6 +59,7 @@
 
 #include "assert.h"
 #include "exitcodes.h"
+#include "hash.h"
 #include "sync_log.h"
 #include "global.h"
 #include "cyr_lock.h"
@@ -75,6 +76,25 @@ static int sync_log_suppressed = 0;
 static strarray_t *channels = NULL;
 static strarray_t *unsuppressable = NULL;
 
+/* Writer-side dedupe: remember the lines this process has already
+ * written to the current incarnation (dev/ino) of each channel's log
+ * file.  Log entries just name what to examine and are written after
+ * the change they describe has been committed, so while an identical
+ * line is still sitting in a log file that hasn't been rotated away,
+ * appending it again is pure noise - the pending entry will cover this
+ * change too when it is processed.  Once the reader rename()s the log
+ * the inode changes and the cache resets. */
+#define SYNC_LOG_DEDUPE_MAX 256     /* lines remembered per channel */
+
+struct sync_log_dedupe {
+    struct sync_log_dedupe *next;
+    char *channel;
+    dev_t dev;
+    ino_t ino;
+    strarray_t lines;
+};
+static struct sync_log_dedupe *dedupe_cache = NULL;
+
 EXPORTED void sync_log_init(void)
 {
     const char *conf;
@@ -116,6 +136,66 @@ EXPORTED void sync_log_done(void)
 
     strarray_free(unsuppressable);
     unsuppressable = NULL;
+
+    while (dedupe_cache) {
+        struct sync_log_dedupe *dedupe = dedupe_cache;
+        dedupe_cache = dedupe->next;
+        strarray_fini(&dedupe->lines);
+        free(dedupe->channel);
+        free(dedupe);
+    }
+}
+
+static struct sync_log_dedupe *sync_log_dedupe_get(const char *channel)
+{
+    struct sync_log_dedupe *dedupe;
+
+    for (dedupe = dedupe_cache; dedupe; dedupe = dedupe->next) {
+        if (!strcmpsafe(dedupe->channel, channel))
+            return dedupe;
+    }
+
+    dedupe = xzmalloc(sizeof(struct sync_log_dedupe));
+    dedupe->channel = xstrdupnull(channel);
+    dedupe->next = dedupe_cache;
+    dedupe_cache = dedupe;
+
+    return dedupe;
+}
+
+/* Returns non-zero if 'string' is already pending in the log file at
+ * 'fname', in which case writing it again can be skipped */
+static int sync_log_dedupe_check(const char *channel, const char *fname,
+                                 const char *string)
+{
+    struct sync_log_dedupe *dedupe = sync_log_dedupe_get(channel);
+    struct stat sbuf;
+
+    if (stat(fname, &sbuf) < 0)
+        return 0;
+    if (sbuf.st_dev != dedupe->dev || sbuf.st_ino != dedupe->ino)
+        return 0;   /* log file has been rotated since we last wrote */
+
+    return (strarray_find(&dedupe->lines, string, 0) >= 0);
+}
+
+static void sync_log_dedupe_record(const char *channel,
+                                   const struct stat *sbuf,
+                                   const char *string)
+{
+    struct sync_log_dedupe *dedupe = sync_log_dedupe_get(channel);
+
+    if (sbuf->st_dev != dedupe->dev || sbuf->st_ino != dedupe->ino) {
+        strarray_truncate(&dedupe->lines, 0);
+        dedupe->dev = sbuf->st_dev;
+        dedupe->ino = sbuf->st_ino;
+    }
+    else if (dedupe->lines.count >= SYNC_LOG_DEDUPE_MAX) {
+        /* keep the cache small - worst case we log a duplicate */
+        strarray_truncate(&dedupe->lines, 0);
+    }
+
+    strarray_append(&dedupe->lines, string);
 }
 
 static char *sync_log_fname(const char *channel)
@@ -152,6 +232,9 @@ static void sync_log_base(const char *channel, const char *string)
 
     fname = sync_log_fname(channel);
 
+    if (sync_log_dedupe_check(channel, fname, string))
+        return;
+
     while (retries++ < SYNC_LOG_RETRIES) {
         fd = open(fname, O_WRONLY|O_APPEND|O_CREAT, 0640);
         if (fd < 0 && errno == ENOENT) {
@@ -192,6 +275,8 @@ static void sync_log_base(const char *channel, const char *string)
     if (retry_write(fd, string, strlen(string)) < 0)
         syslog(LOG_ERR, "write() to %s failed: %s",
                fname, strerror(errno));
+    else
+        sync_log_dedupe_record(channel, &sbuffd, string);
 
     (void)fsync(fd); /* paranoia */
     lock_unlock(fd, fname);
@@ -353,6 +438,7 @@ struct sync_log_reader
     struct buf type;
     struct buf arg1;
     struct buf arg2;
+    hash_table seen;    /* lines already returned from this file */
 };
 
 static sync_log_reader_t *sync_log_reader_alloc(void)
@@ -419,6 +505,7 @@ EXPORTED void sync_log_reader_free(sync_log_reader_t *slr)
     if (!slr) return;
     if (slr->input) prot_free(slr->input);
     if (slr->fd_is_ours && slr->fd >= 0) close(slr->fd);
+    if (slr->seen.table) free_hash_table(&slr->seen, NULL);
     free(slr->log_file);
     free(slr->work_file);
     buf_free(&slr->type);
@@ -504,6 +591,10 @@ EXPORTED int sync_log_reader_begin(sync_log_reader_t *slr)
 
     slr->input = prot_new(slr->fd, /*write*/0);
 
+    /* for weeding out duplicate lines as we read - busy folders log
+     * the same entry many times between runs */
+    construct_hash_table(&slr->seen, 1024, 0);
+
     return 0;
 }
 
@@ -527,6 +618,8 @@ EXPORTED int sync_log_reader_end(sync_log_reader_t *slr)
         slr->input = NULL;
     }
 
+    if (slr->seen.table) free_hash_table(&slr->seen, NULL);
+
     if (slr->fd_is_ours && slr->fd >= 0) {
         lock_unlock(slr->fd, slr->work_file);
         close(slr->fd);
@@ -559,6 +652,7 @@ EXPORTED int sync_log_reader_end(sync_log_reader_t *slr)
 EXPORTED int sync_log_reader_getitem(sync_log_reader_t *slr,
                                      const char *args[3])
 {
+    static struct buf key = BUF_INITIALIZER;    /* BSS */
     int c;
     const char *arg1s = NULL;
     const char *arg2s = NULL;
@@ -597,10 +691,28 @@ EXPORTED int sync_log_reader_getitem(sync_log_reader_t *slr,
             continue;
         }
 
+        /* skip lines identical to one we've already returned from this
+         * file - the writers only dedupe within a single process, so a
+         * busy folder can still appear many times */
+        ucase(slr->type.s);
+        buf_setcstr(&key, slr->type.s);
+        if (arg1s) {
+            buf_putc(&key, ' ');
+            buf_appendcstr(&key, arg1s);
+        }
+        if (arg2s) {
+            buf_putc(&key, ' ');
+            buf_appendcstr(&key, arg2s);
+        }
+        if (slr->seen.table) {
+            if (hash_lookup(buf_cstring(&key), &slr->seen))
+                continue;
+            hash_insert(buf_cstring(&key), (void *)1, &slr->seen);
+        }
+
         break;
     }
 
-    ucase(slr->type.s);
     args[0] = slr->type.s;
     args[1] = arg1s;
     args[2] = arg2s;
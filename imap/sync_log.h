@@ -48,6 +48,10 @@
 
 #define SYNC_LOG_RETRIES (64)
 
+/* channel fed with access events by seen_db.c when arbitron_log is
+ * enabled, and drained by arbitron -i */
+#define SYNC_LOG_ARBITRON_CHANNEL "arbitron"
+
 void sync_log_init(void);
 void sync_log_suppress(void);
 void sync_log_done(void);
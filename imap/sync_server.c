@@ -77,6 +77,7 @@
 #ifdef WITH_DAV
 #include "caldav_db.h"
 #include "carddav_db.h"
+#include "conversations.h"
 #include "dav_db.h"
 #endif /* WITH_DAV */
 #include "dlist.h"
@@ -135,6 +136,7 @@ static struct protstream *sync_in = NULL;
 static int sync_logfd = -1;
 static int sync_starttls_done = 0;
 static int sync_compress_done = 0;
+static int sync_binary_done = 0;
 
 static int opt_force = 0;
 
@@ -145,6 +147,7 @@ static void cmd_starttls(void);
 static void cmd_restart(struct sync_reserve_list **reserve_listp,
                        int realloc);
 static void cmd_compress(char *alg);
+static void cmd_binary(void);
 
 /* generic commands - in dlist format */
 static void cmd_get(struct dlist *kl);
@@ -153,6 +156,9 @@ static void cmd_apply(struct dlist *kl,
 static void cmd_restore(struct dlist *kin,
                         struct sync_reserve_list *reserve_list);
 
+/* batched apply mode (sync_apply_batch) */
+static void sync_batch_release(void);
+
 static void usage(void);
 void shut_down(int code) __attribute__ ((noreturn));
 
@@ -227,6 +233,8 @@ static void sync_reset(void)
     }
     sync_starttls_done = 0;
     sync_compress_done = 0;
+    sync_binary_done = 0;
+    sync_dlist_binary(NULL, NULL);
 
     if(saslprops.iplocalport) {
        free(saslprops.iplocalport);
@@ -329,8 +337,16 @@ static void dobanner(void)
 #ifdef HAVE_ZLIB
         if (!sync_compress_done && !sync_starttls_done) {
             prot_printf(sync_out, "* COMPRESS DEFLATE\r\n");
+            prot_printf(sync_out, "* COMPRESS DEFLATE-DICT\r\n");
         }
 #endif
+
+        /* the sender may omit the immutable fields from records that
+         * already exist on our end */
+        prot_printf(sync_out, "* SYNC-DELTA\r\n");
+
+        /* we accept the binary dlist encoding */
+        prot_printf(sync_out, "* SYNC-BINARY\r\n");
     }
 
     prot_printf(sync_out,
@@ -442,6 +458,9 @@ void shut_down(int code)
 
     proc_cleanup();
 
+    /* commit any batched conversations changes (sync_apply_batch) */
+    sync_batch_release();
+
 #ifdef WITH_DAV
     carddav_done();
     caldav_done();
@@ -623,6 +642,15 @@ static void cmdloop(void)
             }
             break;
 
+        case 'B':
+            if (!strcmp(cmd.s, "Binary")) {
+                if (c == '\r') c = prot_getc(sync_in);
+                if (c != '\n') goto extraargs;
+                cmd_binary();
+                continue;
+            }
+            break;
+
         case 'C':
             if (!strcmp(cmd.s, "Compress")) {
                 if (c != ' ') goto missingargs;
@@ -936,11 +964,13 @@ static void cmd_starttls(void)
 #ifdef HAVE_ZLIB
 static void cmd_compress(char *alg)
 {
+    int dict = !strcasecmp(alg, "DEFLATE-DICT");
+
     if (sync_compress_done) {
         prot_printf(sync_out, "NO Compression already active: %s\r\n", alg);
         return;
     }
-    if (strcasecmp(alg, "DEFLATE")) {
+    if (!dict && strcasecmp(alg, "DEFLATE")) {
         prot_printf(sync_out, "NO Unknown compression algorithm: %s\r\n", alg);
         return;
     }
@@ -951,8 +981,16 @@ static void cmd_compress(char *alg)
     }
     prot_printf(sync_out, "OK %s active\r\n", alg);
     prot_flush(sync_out);
-    prot_setcompress(sync_in);
-    prot_setcompress(sync_out);
+    if (dict) {
+        prot_setcompress_dict(sync_in, prot_deflate_dict,
+                              prot_deflate_dict_len);
+        prot_setcompress_dict(sync_out, prot_deflate_dict,
+                              prot_deflate_dict_len);
+    }
+    else {
+        prot_setcompress(sync_in);
+        prot_setcompress(sync_out);
+    }
     sync_compress_done = 1;
 }
 #else
@@ -962,6 +1000,20 @@ static void cmd_compress(char *alg __attribute__((unused)))
 }
 #endif
 
+static void cmd_binary(void)
+{
+    if (sync_binary_done) {
+        prot_printf(sync_out, "NO Binary dlists already active\r\n");
+        return;
+    }
+    /* the OK must go out in the text encoding, so flush before
+     * switching over */
+    prot_printf(sync_out, "OK Binary dlists active\r\n");
+    prot_flush(sync_out);
+    sync_dlist_binary(sync_in, sync_out);
+    sync_binary_done = 1;
+}
+
 /* ====================================================================== */
 
 /* partition_list is simple linked list of names used by cmd_restart */
@@ -1003,6 +1055,40 @@ partition_list_free(struct partition_list *current)
     }
 }
 
+/* Batched apply mode (sync_apply_batch): hold the user's conversations
+ * database open across consecutive APPLY commands, so that applying
+ * many mailboxes for one user costs a single conversations
+ * commit/fsync when the batch moves on, instead of one per mailbox.
+ * While we hold it, mailbox_lock_conversations() finds the open state
+ * through the conversations registry and leaves the commit to us.
+ */
+static struct conversations_state *batch_cstate = NULL;
+
+static void sync_batch_release(void)
+{
+    int r;
+
+    if (!batch_cstate) return;
+
+    r = conversations_commit(&batch_cstate);
+    if (r)
+        syslog(LOG_ERR, "sync_server: error committing batched "
+                        "conversations: %s", error_message(r));
+}
+
+static void sync_batch_hold(const char *mboxname)
+{
+    if (batch_cstate) {
+        /* already holding this user's?  keep it */
+        if (conversations_get_mbox(mboxname) == batch_cstate) return;
+        sync_batch_release();
+    }
+
+    /* a mailbox with no conversations is fine - nothing to hold */
+    if (conversations_open_mbox(mboxname, &batch_cstate))
+        batch_cstate = NULL;
+}
+
 static void cmd_restart(struct sync_reserve_list **reserve_listp, int re_alloc)
 {
     struct sync_reserve *res;
@@ -1011,6 +1097,9 @@ static void cmd_restart(struct sync_reserve_list **reserve_listp, int re_alloc)
     int hash_size = l->hash_size;
     struct partition_list *p, *pl = NULL;
 
+    /* restart ends any batch in progress */
+    sync_batch_release();
+
     for (res = l->head; res; res = res->next) {
         for (msg = res->list->head; msg; msg = msg->next) {
             if (!msg->fname) continue;
@@ -1049,6 +1138,20 @@ static void cmd_apply(struct dlist *kin, struct sync_reserve_list *reserve_list)
         0 /* local_only */
     };
 
+    if (config_getswitch(IMAPOPT_SYNC_APPLY_BATCH)) {
+        const char *mboxname = NULL;
+
+        /* mailbox-scoped commands join (or start) a batch for their
+         * user.  message uploads are user-independent staging and
+         * leave the batch alone.  anything else - renames, quota,
+         * user deletes - ends it first */
+        if (dlist_getatom(kin, "MBOXNAME", &mboxname))
+            sync_batch_hold(mboxname);
+        else if (strcasecmp(kin->name, "MESSAGE") &&
+                 strcasecmp(kin->name, "RESERVE"))
+            sync_batch_release();
+    }
+
     const char *resp = sync_apply(kin, reserve_list, &sync_state);
     prot_printf(sync_out, "%s\r\n", resp);
 }
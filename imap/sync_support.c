@@ -76,6 +76,7 @@
 #include "user.h"
 #include "prot.h"
 #include "dlist.h"
+#include "ptrarray.h"
 #include "xstrlcat.h"
 
 #ifdef USE_SIEVE
@@ -112,6 +113,7 @@ struct protocol_t imap_csync_protocol =
 //        { "LIST-EXTENDED", CAPA_LISTEXTENDED },
           { "SASL-IR", CAPA_SASL_IR },
           { "X-REPLICATION", CAPA_REPLICATION },
+          { "X-SYNC-DELTA", CAPA_SYNC_DELTA },
           { NULL, 0 } } },
       { "S01 STARTTLS", "S01 OK", "S01 NO", 0 },
       { "A01 AUTHENTICATE", 0, 0, "A01 OK", "A01 NO", "+ ", "*",
@@ -129,6 +131,9 @@ struct protocol_t csync_protocol =
         { { "SASL", CAPA_AUTH },
           { "STARTTLS", CAPA_STARTTLS },
           { "COMPRESS=DEFLATE", CAPA_COMPRESS },
+          { "COMPRESS=DEFLATE-DICT", CAPA_COMPRESS_DICT },
+          { "SYNC-DELTA", CAPA_SYNC_DELTA },
+          { "SYNC-BINARY", CAPA_SYNC_BINARY },
           { NULL, 0 } } },
       { "STARTTLS", "OK", "NO", 1 },
       { "AUTHENTICATE", USHRT_MAX, 0, "OK", "NO", "+ ", "*", NULL, 0 },
@@ -442,14 +447,19 @@ int parse_upload(struct dlist *kr, struct mailbox *mailbox,
         return IMAP_PROTOCOL_BAD_PARAMETERS;
     if (!dlist_getlist(kr, "FLAGS", &fl))
         return IMAP_PROTOCOL_BAD_PARAMETERS;
-    if (!dlist_getdate(kr, "INTERNALDATE", &record->internaldate))
-        return IMAP_PROTOCOL_BAD_PARAMETERS;
-    if (!dlist_getnum32(kr, "SIZE", &record->size))
-        return IMAP_PROTOCOL_BAD_PARAMETERS;
-    if (!dlist_getguid(kr, "GUID", &tmpguid))
-        return IMAP_PROTOCOL_BAD_PARAMETERS;
-
-    record->guid = *tmpguid;
+    if (dlist_getguid(kr, "GUID", &tmpguid)) {
+        record->guid = *tmpguid;
+        if (!dlist_getdate(kr, "INTERNALDATE", &record->internaldate))
+            return IMAP_PROTOCOL_BAD_PARAMETERS;
+        if (!dlist_getnum32(kr, "SIZE", &record->size))
+            return IMAP_PROTOCOL_BAD_PARAMETERS;
+    }
+    else {
+        /* a compact flag-only update (SYNC-DELTA) omits the immutable
+         * fields - the record must already exist on the receiving end,
+         * which mailbox_compare_update() enforces */
+        message_guid_set_null(&record->guid);
+    }
 
     /* parse the flags */
     r = sync_getflags(fl, mailbox, record);
@@ -1471,12 +1481,33 @@ void sync_action_list_free(struct sync_action_list **lp)
     *lp = NULL;
 }
 
+/* streams on which the binary dlist encoding has been negotiated
+ * (see the SYNC-BINARY capability and the BINARY command).  The
+ * command words and response codes stay textual; only the dlist
+ * payloads change representation */
+static struct protstream *sync_binary_in = NULL;
+static struct protstream *sync_binary_out = NULL;
+
+void sync_dlist_binary(struct protstream *in, struct protstream *out)
+{
+    sync_binary_in = in;
+    sync_binary_out = out;
+}
+
+static void sync_dlist_print(struct dlist *kl, struct protstream *out)
+{
+    if (out == sync_binary_out)
+        dlist_printbin(kl, 1, out);
+    else
+        dlist_print(kl, 1, out);
+}
+
 /* NOTE - we don't prot_flush here, as we always send an OK at the
  * end of a response anyway */
 void sync_send_response(struct dlist *kl, struct protstream *out)
 {
     prot_printf(out, "* ");
-    dlist_print(kl, 1, out);
+    sync_dlist_print(kl, out);
     prot_printf(out, "\r\n");
 }
 
@@ -1498,7 +1529,7 @@ void sync_send_apply(struct dlist *kl, struct protstream *out)
         prot_printf(out, "%s SYNC", sync_gentag((struct buf *) out->userdata));
     }
     prot_printf(out, "APPLY ");
-    dlist_print(kl, 1, out);
+    sync_dlist_print(kl, out);
     prot_printf(out, "\r\n");
     prot_flush(out);
 }
@@ -1510,7 +1541,7 @@ void sync_send_lookup(struct dlist *kl, struct protstream *out)
         prot_printf(out, "%s SYNC", sync_gentag((struct buf *) out->userdata));
     }
     prot_printf(out, "GET ");
-    dlist_print(kl, 1, out);
+    sync_dlist_print(kl, out);
     prot_printf(out, "\r\n");
     prot_flush(out);
 }
@@ -1532,7 +1563,7 @@ void sync_send_restore(struct dlist *kl, struct protstream *out)
         prot_printf(out, "%s SYNC", sync_gentag((struct buf *) out->userdata));
     }
     prot_printf(out, "RESTORE ");
-    dlist_print(kl, 1, out);
+    sync_dlist_print(kl, out);
     prot_printf(out, "\r\n");
     prot_flush(out);
 }
@@ -1542,7 +1573,10 @@ struct dlist *sync_parseline(struct protstream *in)
     struct dlist *dl = NULL;
     int c;
 
-    c = dlist_parse(&dl, 1, in, NULL);
+    if (in == sync_binary_in)
+        c = dlist_parsebin(&dl, 1, in, NULL);
+    else
+        c = dlist_parse(&dl, 1, in, NULL);
 
     /* end line - or fail */
     if (c == '\r') c = prot_getc(in);
@@ -1586,13 +1620,16 @@ static int sync_send_file(struct mailbox *mailbox,
     return 0;
 }
 
+/* 'compact' (only valid with a SYNC-DELTA capable peer) sends records
+ * that already exist on the replica as flag-only updates, omitting the
+ * immutable INTERNALDATE/SIZE/GUID fields */
 static int sync_prepare_dlists(struct mailbox *mailbox,
                                struct sync_folder *local,
                                struct sync_folder *remote,
                                const char *topart,
                                struct sync_msgid_list *part_list,
                                struct dlist *kl, struct dlist *kupload,
-                               int printrecords)
+                               int printrecords, int compact)
 {
     struct sync_annot_list *annots = NULL;
     struct mailbox_iter *iter = NULL;
@@ -1701,9 +1738,13 @@ static int sync_prepare_dlists(struct mailbox *mailbox,
             dlist_setnum64(il, "MODSEQ", mymodseq);
             dlist_setdate(il, "LAST_UPDATED", record->last_updated);
             sync_print_flags(il, mailbox, record);
-            dlist_setdate(il, "INTERNALDATE", record->internaldate);
-            dlist_setnum32(il, "SIZE", record->size);
-            dlist_setatom(il, "GUID", message_guid_encode(&record->guid));
+            if (!(compact && remote && record->uid <= remote->last_uid)) {
+                /* the immutable fields - elided for records the
+                 * replica already has when it speaks SYNC-DELTA */
+                dlist_setdate(il, "INTERNALDATE", record->internaldate);
+                dlist_setnum32(il, "SIZE", record->size);
+                dlist_setatom(il, "GUID", message_guid_encode(&record->guid));
+            }
 
             r = read_annotations(mailbox, record, &annots);
             if (r) goto done;
@@ -2379,8 +2420,11 @@ static int mailbox_compare_update(struct mailbox *mailbox,
                 continue;
 
             /* GUID mismatch is an error straight away, it only ever happens if we
-             * had a split brain - and it will take a full sync to sort out the mess */
-            if (!message_guid_equal(&mrecord.guid, &rrecord->guid)) {
+             * had a split brain - and it will take a full sync to sort out the mess.
+             * A compact flag-only update carries no GUID; the mailbox-level
+             * SYNC_CRC check still guards against divergence */
+            if (!message_guid_isnull(&mrecord.guid) &&
+                !message_guid_equal(&mrecord.guid, &rrecord->guid)) {
                 syslog(LOG_ERR, "SYNCERROR: guid mismatch %s %u",
                        mailbox->name, mrecord.uid);
                 r = IMAP_SYNC_CHECKSUM;
@@ -2419,7 +2463,8 @@ static int mailbox_compare_update(struct mailbox *mailbox,
             copy.basecid = mrecord.basecid;
             copy.modseq = mrecord.modseq;
             copy.last_updated = mrecord.last_updated;
-            copy.internaldate = mrecord.internaldate;
+            if (mrecord.internaldate)
+                copy.internaldate = mrecord.internaldate;
             copy.system_flags = (mrecord.system_flags & FLAGS_GLOBAL) |
                                 (rrecord->system_flags & FLAGS_LOCAL);
             for (i = 0; i < MAX_USER_FLAGS/32; i++)
@@ -2459,6 +2504,15 @@ static int mailbox_compare_update(struct mailbox *mailbox,
 
         /* after LAST_UID, it's an append, that's OK */
         else {
+            /* but not with a compact record - we don't have the
+             * immutable fields needed to append */
+            if (message_guid_isnull(&mrecord.guid)) {
+                syslog(LOG_ERR, "SYNCERROR: compact record for unseen uid %s %u",
+                       mailbox->name, mrecord.uid);
+                r = IMAP_SYNC_CHECKSUM;
+                goto out;
+            }
+
             /* skip out on the first pass */
             if (!doupdate) continue;
 
@@ -2872,7 +2926,7 @@ static int mailbox_byname(const char *name, void *rock)
          !sync_name_lookup(qrl, mailbox->quotaroot))
         sync_name_list_add(qrl, mailbox->quotaroot);
 
-    r = sync_prepare_dlists(mailbox, NULL, NULL, NULL, NULL, kl, NULL, 0);
+    r = sync_prepare_dlists(mailbox, NULL, NULL, NULL, NULL, kl, NULL, 0, 0);
     if (!r) sync_send_response(kl, mrock->pout);
 
 out:
@@ -2900,7 +2954,7 @@ int sync_get_fullmailbox(struct dlist *kin, struct sync_state *sstate)
     if (!r) r = sync_mailbox_version_check(&mailbox);
     if (r) goto out;
 
-    r = sync_prepare_dlists(mailbox, NULL, NULL, NULL, NULL, kl, NULL, 1);
+    r = sync_prepare_dlists(mailbox, NULL, NULL, NULL, NULL, kl, NULL, 1, 0);
     if (r) goto out;
 
     sync_send_response(kl, sstate->pout);
@@ -5198,13 +5252,155 @@ static int is_unchanged(struct mailbox *mailbox, struct sync_folder *remote)
  * shouldn't be in .h with the rest of them */
 #define SYNC_FLAG_ISREPEAT      (1<<15)
 
+/* A window of pipelined APPLY commands whose responses haven't been
+ * read yet.  Responses arrive in strict command order, so matching
+ * them up FIFO is sufficient.  Each entry remembers the IMAP tag of
+ * its command (NULL in csync mode, which is untagged) - the shared tag
+ * buffer has been overwritten by every send since the command went
+ * out, so the right one is restored before parsing.  Entries also
+ * remember which folder they belong to, so that a failure can be
+ * retried in lockstep once the stream is idle again */
+
+struct sync_pipeline_entry {
+    char *tag;                  /* NULL in csync mode (untagged) */
+    const char *cmd;            /* response to parse: MESSAGE, MAILBOX */
+    struct sync_folder *folder;
+    int r;                      /* result, once collected */
+};
+
+struct sync_pipeline {
+    struct backend *sync_be;
+    int window;
+    ptrarray_t outstanding;     /* entries awaiting a response */
+    ptrarray_t failed;          /* first failure for each folder */
+};
+
+static struct sync_pipeline *sync_pipeline_new(struct backend *sync_be)
+{
+    struct sync_pipeline *sp = xzmalloc(sizeof(*sp));
+
+    sp->sync_be = sync_be;
+    sp->window = config_getint(IMAPOPT_SYNC_APPLY_WINDOW);
+    if (sp->window < 1) sp->window = 1;
+
+    return sp;
+}
+
+static void sync_pipeline_entry_free(struct sync_pipeline_entry **entryp)
+{
+    struct sync_pipeline_entry *entry = *entryp;
+    *entryp = NULL;
+    free(entry->tag);
+    free(entry);
+}
+
+/* record a failure against a folder.  Only the first failure counts -
+ * later ones are usually just fallout from it */
+static void sync_pipeline_fail(struct sync_pipeline *sp,
+                               struct sync_folder *folder, int r)
+{
+    struct sync_pipeline_entry *failed;
+    int i;
+
+    for (i = 0; i < sp->failed.count; i++) {
+        failed = ptrarray_nth(&sp->failed, i);
+        if (failed->folder == folder) return;
+    }
+
+    failed = xzmalloc(sizeof(*failed));
+    failed->folder = folder;
+    failed->r = r;
+    ptrarray_append(&sp->failed, failed);
+}
+
+/* the first failure recorded against a folder, if any */
+static int sync_pipeline_status(struct sync_pipeline *sp,
+                                const struct sync_folder *folder)
+{
+    int i;
+
+    for (i = 0; i < sp->failed.count; i++) {
+        struct sync_pipeline_entry *failed = ptrarray_nth(&sp->failed, i);
+        if (!folder || failed->folder == folder) return failed->r;
+    }
+
+    return 0;
+}
+
+/* read the response to the oldest outstanding command */
+static void sync_pipeline_collect_one(struct sync_pipeline *sp)
+{
+    struct sync_pipeline_entry *entry = ptrarray_shift(&sp->outstanding);
+    struct protstream *in = sp->sync_be->in;
+    int r;
+
+    if (!entry) return;
+
+    if (entry->tag && in->userdata)
+        buf_setcstr((struct buf *) in->userdata, entry->tag);
+
+    r = sync_parse_response(entry->cmd, in, NULL);
+    if (r) sync_pipeline_fail(sp, entry->folder, r);
+
+    sync_pipeline_entry_free(&entry);
+}
+
+/* send an apply command, collecting old responses as necessary to
+ * keep the number outstanding within the window */
+static void sync_pipeline_send(struct sync_pipeline *sp, struct dlist *kl,
+                               const char *cmd, struct sync_folder *folder)
+{
+    struct sync_pipeline_entry *entry = xzmalloc(sizeof(*entry));
+    struct protstream *out = sp->sync_be->out;
+
+    sync_send_apply(kl, out);
+
+    entry->cmd = cmd;
+    entry->folder = folder;
+    if (out->userdata)
+        entry->tag = xstrdup(buf_cstring((struct buf *) out->userdata));
+    ptrarray_append(&sp->outstanding, entry);
+
+    while (sp->outstanding.count >= sp->window)
+        sync_pipeline_collect_one(sp);
+}
+
+/* read all the responses still in flight.  Must be called before any
+ * non-pipelined command, or that would read a stale response off the
+ * stream */
+static void sync_pipeline_drain(struct sync_pipeline *sp)
+{
+    while (sp->outstanding.count)
+        sync_pipeline_collect_one(sp);
+}
+
+static void sync_pipeline_free(struct sync_pipeline **spp)
+{
+    struct sync_pipeline *sp = *spp;
+    int i;
+
+    *spp = NULL;
+
+    /* keep the stream in sync even if the caller is bailing out */
+    sync_pipeline_drain(sp);
+
+    ptrarray_fini(&sp->outstanding);
+    for (i = 0; i < sp->failed.count; i++) {
+        struct sync_pipeline_entry *failed = ptrarray_nth(&sp->failed, i);
+        sync_pipeline_entry_free(&failed);
+    }
+    ptrarray_fini(&sp->failed);
+    free(sp);
+}
+
 static int update_mailbox_once(struct sync_folder *local,
                                struct sync_folder *remote,
                                const char *topart,
                                struct sync_reserve_list *reserve_list,
-                               struct backend *sync_be,
+                               struct sync_pipeline *sp,
                                unsigned flags)
 {
+    struct backend *sync_be = sp->sync_be;
     struct sync_msgid_list *part_list;
     struct mailbox *mailbox = NULL;
     int r = 0;
@@ -5275,7 +5471,8 @@ static int update_mailbox_once(struct sync_folder *local,
 
     if (!topart) topart = mailbox->part;
     part_list = sync_reserve_partlist(reserve_list, topart);
-    r = sync_prepare_dlists(mailbox, local, remote, topart, part_list, kl, kupload, 1);
+    r = sync_prepare_dlists(mailbox, local, remote, topart, part_list, kl, kupload, 1,
+                            CAPA(sync_be, CAPA_SYNC_DELTA) ? 1 : 0);
     if (r) goto done;
 
     /* keep the mailbox locked for shorter time! Unlock the index now
@@ -5289,21 +5486,25 @@ static int update_mailbox_once(struct sync_folder *local,
     if (flags & SYNC_FLAG_LOGGING)
         syslog(LOG_INFO, "%s %s", cmd, local->name);
 
-    /* upload in small(ish) blocks to avoid timeouts */
+    /* upload in small(ish) blocks to avoid timeouts.  The pipeline
+     * keeps a window of outstanding APPLY commands on the wire so
+     * that throughput over a high-latency link is bounded by
+     * bandwidth, not round trips */
     while (kupload->head) {
         struct dlist *kul1 = dlist_splice(kupload, 1024);
-        sync_send_apply(kul1, sync_be->out);
-        r = sync_parse_response("MESSAGE", sync_be->in, NULL);
+        sync_pipeline_send(sp, kul1, "MESSAGE", local);
         dlist_free(&kul1);
+        r = sync_pipeline_status(sp, local);
         if (r) goto done; /* abort earlier */
     }
 
     /* close before sending the apply - all data is already read */
     if (!local->mailbox) mailbox_close(&mailbox);
 
-    /* update the mailbox */
-    sync_send_apply(kl, sync_be->out);
-    r = sync_parse_response("MAILBOX", sync_be->in, NULL);
+    /* update the mailbox.  The response is collected through the
+     * pipeline too - possibly while a later folder is uploading */
+    sync_pipeline_send(sp, kl, "MAILBOX", local);
+    r = sync_pipeline_status(sp, local);
 
 done:
     if (mailbox && !local->mailbox) mailbox_close(&mailbox);
@@ -5313,16 +5514,35 @@ done:
     return r;
 }
 
-int sync_update_mailbox(struct sync_folder *local,
-                        struct sync_folder *remote,
-                        const char *topart,
-                        struct sync_reserve_list *reserve_list,
-                        struct backend *sync_be,
-                        unsigned flags)
+/* update a single folder in lockstep - all responses are read before
+ * returning, so it's safe to follow up with any other command */
+static int update_mailbox_lockstep(struct sync_folder *local,
+                                   struct sync_folder *remote,
+                                   const char *topart,
+                                   struct sync_reserve_list *reserve_list,
+                                   struct backend *sync_be,
+                                   unsigned flags)
 {
+    struct sync_pipeline *sp = sync_pipeline_new(sync_be);
     int r = update_mailbox_once(local, remote, topart,
-                                reserve_list, sync_be, flags);
+                                reserve_list, sp, flags);
+
+    sync_pipeline_drain(sp);
+    if (!r) r = sync_pipeline_status(sp, local);
+    sync_pipeline_free(&sp);
 
+    return r;
+}
+
+/* retry a failed update with a full sync, if the error is retryable.
+ * Must only be called once the stream is idle */
+static int update_mailbox_retry(struct sync_folder *local,
+                                struct sync_folder *remote,
+                                const char *topart,
+                                struct sync_reserve_list *reserve_list,
+                                struct backend *sync_be,
+                                unsigned flags, int r)
+{
     /* never retry - other end should always sync cleanly */
     if (flags & SYNC_FLAG_NO_COPYBACK) return r;
 
@@ -5331,20 +5551,34 @@ int sync_update_mailbox(struct sync_folder *local,
     if (r == IMAP_AGAIN) {
         local->ispartial = 0; /* don't batch the re-update, means sync to 2.4 will still work after fullsync */
         r = mailbox_full_update(local, reserve_list, sync_be, flags);
-        if (!r) r = update_mailbox_once(local, remote, topart,
-                                        reserve_list, sync_be, flags);
+        if (!r) r = update_mailbox_lockstep(local, remote, topart,
+                                            reserve_list, sync_be, flags);
     }
     else if (r == IMAP_SYNC_CHECKSUM) {
         syslog(LOG_ERR, "CRC failure on sync for %s, trying full update",
                local->name);
         r = mailbox_full_update(local, reserve_list, sync_be, flags);
-        if (!r) r = update_mailbox_once(local, remote, topart,
-                                        reserve_list, sync_be, flags);
+        if (!r) r = update_mailbox_lockstep(local, remote, topart,
+                                            reserve_list, sync_be, flags);
     }
 
     return r;
 }
 
+int sync_update_mailbox(struct sync_folder *local,
+                        struct sync_folder *remote,
+                        const char *topart,
+                        struct sync_reserve_list *reserve_list,
+                        struct backend *sync_be,
+                        unsigned flags)
+{
+    int r = update_mailbox_lockstep(local, remote, topart,
+                                    reserve_list, sync_be, flags);
+
+    return update_mailbox_retry(local, remote, topart, reserve_list,
+                                sync_be, flags, r);
+}
+
 /* ====================================================================== */
 
 static int update_seen_work(const char *user, const char *uniqueid,
@@ -5634,20 +5868,44 @@ static int do_folders(struct sync_name_list *mboxname_list, const char *topart,
         }
     }
 
+    /* Update the folders.  The updates all stream through a shared
+     * pipeline, so consecutive folders don't cost a round trip each -
+     * a large user transfers at line speed rather than stalling on
+     * every folder boundary */
+    struct sync_pipeline *sp = sync_pipeline_new(sync_be);
+    int i;
+
     for (mfolder = master_folders->head; mfolder; mfolder = mfolder->next) {
         if (mfolder->mark) continue;
         /* NOTE: rfolder->name may now be wrong, but we're guaranteed that
          * it was successfully renamed above, so just use mfolder->name for
          * all commands */
         rfolder = sync_folder_lookup(replica_folders, mfolder->uniqueid);
-        r = sync_update_mailbox(mfolder, rfolder, topart, reserve_list,
-                                sync_be, flags);
+        r = update_mailbox_once(mfolder, rfolder, topart, reserve_list,
+                                sp, flags);
+        if (r) sync_pipeline_fail(sp, mfolder, r);
+    }
+    sync_pipeline_drain(sp);
+
+    /* retry any failures in lockstep now the stream is idle */
+    r = 0;
+    for (i = 0; i < sp->failed.count && !r; i++) {
+        struct sync_pipeline_entry *failed = ptrarray_nth(&sp->failed, i);
+        mfolder = failed->folder;
+        rfolder = sync_folder_lookup(replica_folders, mfolder->uniqueid);
+        r = update_mailbox_retry(mfolder, rfolder, topart, reserve_list,
+                                 sync_be, flags, failed->r);
         if (r) {
             syslog(LOG_ERR, "do_folders(): update failed: %s '%s'",
                    mfolder->name, error_message(r));
-            goto bail;
         }
-        if (channelp && mfolder->ispartial) {
+    }
+    sync_pipeline_free(&sp);
+    if (r) goto bail;
+
+    if (channelp) {
+        for (mfolder = master_folders->head; mfolder; mfolder = mfolder->next) {
+            if (mfolder->mark || !mfolder->ispartial) continue;
             sync_log_channel_mailbox(*channelp, mfolder->name);
         }
     }
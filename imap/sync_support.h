@@ -55,6 +55,15 @@
 extern struct protocol_t imap_csync_protocol;
 extern struct protocol_t csync_protocol;
 
+enum {
+    /* sync protocol specific capabilities, see protocol.h */
+    CAPA_COMPRESS_DICT  = (1 << 3),
+    CAPA_SYNC_DELTA     = (1 << 4), /* accepts flag-only update records
+                                       with the immutable fields omitted */
+    CAPA_SYNC_BINARY    = (1 << 5)  /* accepts binary-encoded dlists
+                                       (see dlist_printbin) */
+};
+
 #define SYNC_MSGID_LIST_HASH_SIZE        (65536)
 #define SYNC_MESSAGE_LIST_HASH_SIZE      (65536)
 #define SYNC_MESSAGE_LIST_MAX_OPEN_FILES (64)
@@ -403,6 +412,10 @@ void sync_action_list_free(struct sync_action_list **lp);
 
 /* ====================================================================== */
 
+/* switch the dlist payloads on the given streams to the binary
+ * encoding (negotiated via the SYNC-BINARY capability) */
+void sync_dlist_binary(struct protstream *in, struct protstream *out);
+
 void sync_send_response(struct dlist *kl, struct protstream *out);
 void sync_send_apply(struct dlist *kl, struct protstream *out);
 void sync_send_lookup(struct dlist *kl, struct protstream *out);
@@ -49,12 +49,239 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <string.h>
 #include <syslog.h>
 
+#include "cyr_lock.h"
 #include "prot.h"
 #include "global.h"
+#include "telemetry.h"
+
+/* The mapped ring, shared by every process on the host */
+static struct telemetry_ringhdr *ring = NULL;
+static unsigned char *ring_data = NULL;
+
+/* copy 'len' bytes into the ring at absolute offset 'pos', wrapping
+ * around the physical end of the data area as needed */
+static void ring_copyin(uint64_t pos, const void *buf, size_t len)
+{
+    size_t off = pos % ring->size;
+    size_t run = ring->size - off;
+
+    if (run > len) run = len;
+    memcpy(ring_data + off, buf, run);
+    if (run < len)
+        memcpy(ring_data, (const char *) buf + run, len - run);
+}
+
+/* the mirror image, for the drainer */
+static void ring_copyout(uint64_t pos, void *buf, size_t len)
+{
+    size_t off = pos % ring->size;
+    size_t run = ring->size - off;
+
+    if (run > len) run = len;
+    memcpy(buf, ring_data + off, run);
+    if (run < len)
+        memcpy((char *) buf + run, ring_data, len - run);
+}
+
+/*
+ * Map (creating and initializing if needed) the shared ring buffer.
+ * Every process maps the same file, so the header offsets are shared.
+ */
+EXPORTED int telemetry_ring_attach(void)
+{
+    char fname[1024];
+    struct stat sbuf;
+    uint64_t size;
+    void *base;
+    int fd;
+
+    if (ring) return 0;
+
+    size = (uint64_t) config_getint(IMAPOPT_TELEMETRY_RINGBUFFER_SIZE) * 1024;
+    if (!size) return -1;
+    size &= ~(uint64_t) 7;  /* keep record offsets 8 byte aligned */
+
+    snprintf(fname, sizeof(fname), "%s%s", config_dir, TELEMETRY_RING_FNAME);
+
+    fd = open(fname, O_CREAT | O_RDWR, 0600);
+    if (fd == -1) {
+        syslog(LOG_ERR, "IOERROR: opening telemetry ring %s: %m", fname);
+        return -1;
+    }
+
+    /* serialize initialization against other processes racing here */
+    if (lock_blocking(fd, fname) == -1) {
+        syslog(LOG_ERR, "IOERROR: locking telemetry ring %s: %m", fname);
+        close(fd);
+        return -1;
+    }
+
+    if (fstat(fd, &sbuf) == -1 ||
+        (uint64_t) sbuf.st_size < TELEMETRY_RING_HDRSIZE + size) {
+        struct telemetry_ringhdr hdr;
+
+        if (ftruncate(fd, TELEMETRY_RING_HDRSIZE + size) == -1) {
+            syslog(LOG_ERR, "IOERROR: sizing telemetry ring %s: %m", fname);
+            lock_unlock(fd, fname);
+            close(fd);
+            return -1;
+        }
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = TELEMETRY_RING_MAGIC;
+        hdr.version = TELEMETRY_RING_VERSION;
+        hdr.size = size;
+        if (lseek(fd, 0, SEEK_SET) == -1 ||
+            write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+            syslog(LOG_ERR, "IOERROR: initializing telemetry ring %s: %m",
+                   fname);
+            lock_unlock(fd, fname);
+            close(fd);
+            return -1;
+        }
+    }
+
+    base = mmap(NULL, TELEMETRY_RING_HDRSIZE + size,
+                PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    lock_unlock(fd, fname);
+    close(fd);  /* the mapping keeps the file alive */
+
+    if (base == MAP_FAILED) {
+        syslog(LOG_ERR, "IOERROR: mapping telemetry ring %s: %m", fname);
+        return -1;
+    }
+
+    ring = (struct telemetry_ringhdr *) base;
+    if (ring->magic != TELEMETRY_RING_MAGIC ||
+        ring->version != TELEMETRY_RING_VERSION ||
+        ring->size != size) {
+        syslog(LOG_ERR, "telemetry ring %s: bad magic/version/size, "
+               "remove it and restart", fname);
+        munmap(base, TELEMETRY_RING_HDRSIZE + size);
+        ring = NULL;
+        return -1;
+    }
+
+    ring_data = (unsigned char *) base + TELEMETRY_RING_HDRSIZE;
+    return 0;
+}
+
+/*
+ * Append one telemetry record to the ring.  Matches prot_logcallback_t
+ * so it hangs straight off a protstream.  Reservation takes a
+ * few-instruction spinlock; the record copy runs unlocked and the
+ * record is published by storing its state word last, so a slow writer
+ * never blocks the others or the drainer (the drainer just waits for
+ * that record to commit).  When the ring is full the record is counted
+ * in 'drops' and thrown away rather than stalling the command loop.
+ */
+EXPORTED void telemetry_ring_log(const char *buf, size_t len, int iswrite,
+                                 void *rock __attribute__((unused)))
+{
+    struct telemetry_rec rec;
+    struct timeval tv;
+    const char *sid = session_id();
+    size_t sidlen = strlen(sid);
+    uint64_t pos;
+    size_t need;
+
+    if (!ring) return;
+
+    if (sidlen > 255) sidlen = 255;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.origlen = len;
+    if (len > TELEMETRY_MAX_PAYLOAD) len = TELEMETRY_MAX_PAYLOAD;
+    rec.len = len;
+    rec.pid = getpid();
+    gettimeofday(&tv, NULL);
+    rec.sec = tv.tv_sec;
+    rec.usec = tv.tv_usec;
+    rec.dir = iswrite ? 1 : 0;
+    rec.sidlen = sidlen;
+
+    need = (sizeof(rec) + sidlen + len + 7) & ~(size_t) 7;
+
+    /* reserve our extent */
+    while (__sync_lock_test_and_set(&ring->lock, 1))
+        ;
+    if (ring->head - ring->tail + need > ring->size) {
+        ring->drops++;
+        __sync_lock_release(&ring->lock);
+        return;
+    }
+    pos = ring->head;
+    ring->head += need;
+    __sync_lock_release(&ring->lock);
+
+    /* fill in the extent, then publish it with the state word.  The
+     * drainer zeroed the state words in this extent before it recycled
+     * the space, so it can't mistake it for complete before the store */
+    ring_copyin(pos + sizeof(rec), sid, sidlen);
+    if (len) ring_copyin(pos + sizeof(rec) + sidlen, buf, len);
+    ring_copyin(pos, &rec, sizeof(rec));
+    __sync_synchronize();
+    *(volatile uint32_t *)(ring_data + (pos % ring->size)) =
+        TELEMETRY_REC_COMMITTED;
+}
+
+/*
+ * Drain committed records, oldest first, through 'proc'.  Single
+ * reader only (telemetryd).  Returns how many records were consumed;
+ * 0 means the ring is empty or the oldest record is still being
+ * written.
+ */
+EXPORTED int telemetry_ring_drain(telemetry_drain_cb_t *proc, void *rock)
+{
+    static unsigned char recbuf[sizeof(struct telemetry_rec) + 255 +
+                                TELEMETRY_MAX_PAYLOAD + 8];
+    struct telemetry_rec *rec = (struct telemetry_rec *) recbuf;
+    int nconsumed = 0;
+    size_t need;
+
+    if (!ring) return 0;
+
+    while (ring->tail != ring->head) {
+        uint64_t pos = ring->tail;
+
+        if (*(volatile uint32_t *)(ring_data + (pos % ring->size)) !=
+            TELEMETRY_REC_COMMITTED)
+            break;  /* oldest record still being copied in */
+        __sync_synchronize();
+
+        ring_copyout(pos, recbuf, sizeof(struct telemetry_rec));
+        need = (sizeof(struct telemetry_rec) + rec->sidlen + rec->len + 7)
+               & ~(size_t) 7;
+        if (need > sizeof(recbuf) || pos + need > ring->head) {
+            /* can't happen unless the ring is corrupt; resync */
+            syslog(LOG_ERR, "telemetry ring: corrupt record, resetting");
+            ring->tail = ring->head;
+            break;
+        }
+        ring_copyout(pos + sizeof(struct telemetry_rec),
+                     recbuf + sizeof(struct telemetry_rec),
+                     rec->sidlen + rec->len);
+
+        proc(rec, rock);
+
+        /* scrub the state word so a future lap can't alias it, then
+         * hand the space back to the writers */
+        {
+            uint32_t zero = 0;
+            ring_copyin(pos, &zero, sizeof(zero));
+        }
+        __sync_synchronize();
+        ring->tail = pos + need;
+        nconsumed++;
+    }
+
+    return nconsumed;
+}
 
 /* create telemetry log; return fd of log */
 EXPORTED int telemetry_log(const char *userid, struct protstream *pin,
@@ -66,6 +293,13 @@ EXPORTED int telemetry_log(const char *userid, struct protstream *pin,
     time_t now;
     int r;
 
+    /* with a ring buffer configured, log there instead of a file */
+    if (!telemetry_ring_attach()) {
+        prot_setlogcb(pin, telemetry_ring_log, NULL);
+        prot_setlogcb(pout, telemetry_ring_log, NULL);
+        return -1;
+    }
+
     if (usetimestamp) {
         struct timeval tv;
 
@@ -106,7 +340,7 @@ EXPORTED int telemetry_log(const char *userid, struct protstream *pin,
     return fd;
 }
 
-EXPORTED void telemetry_rusage(char *userid)
+EXPORTED void telemetry_rusage(const char *userid)
 {
     static struct rusage        previous;
     struct rusage               current;
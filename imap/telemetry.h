@@ -43,8 +43,74 @@
 #ifndef INCLUDED_TELEMETRY_H
 #define INCLUDED_TELEMETRY_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 int telemetry_log(const char *userid, struct protstream *pin,
                   struct protstream *pout, int usetimestamp);
 void telemetry_rusage(const char *userid);
 
+/*
+ * Shared-memory telemetry ring buffer (see telemetry_ringbuffer_size).
+ *
+ * Writers reserve space under a few-instruction spinlock, copy their
+ * record and then publish it by storing the record state word last;
+ * the payload copy itself runs unlocked.  telemetryd(8) is the single
+ * reader and drains committed records in order.
+ */
+
+#define TELEMETRY_RING_MAGIC    0x43544c4d      /* "CTLM" */
+#define TELEMETRY_RING_VERSION  1
+#define TELEMETRY_RING_FNAME    "/telemetry.ring"
+#define TELEMETRY_RING_HDRSIZE  64
+
+/* payload bytes stored per record; longer chunks are truncated but
+ * keep their original length in the record header */
+#define TELEMETRY_MAX_PAYLOAD   4096
+
+#define TELEMETRY_REC_COMMITTED 0x5245434fU     /* "RECO" */
+
+struct telemetry_ringhdr {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;              /* data bytes following the header */
+    uint64_t head;              /* absolute reserve offset */
+    uint64_t tail;              /* absolute drain offset */
+    uint64_t drops;             /* records dropped because ring full */
+    uint32_t lock;              /* reservation spinlock */
+    uint32_t pad;
+    /* header is padded to TELEMETRY_RING_HDRSIZE; data follows */
+};
+
+/* on-ring (and on-disk, once drained) record header; always followed
+ * by sidlen session id bytes and len payload bytes, with the whole
+ * record padded to an 8 byte boundary */
+struct telemetry_rec {
+    uint32_t state;             /* 0 while being written, then COMMITTED */
+    uint32_t len;               /* payload bytes stored */
+    uint32_t origlen;           /* payload bytes before truncation */
+    uint32_t pid;
+    uint64_t sec;
+    uint32_t usec;
+    uint8_t  dir;               /* 0 = from client, 1 = to client */
+    uint8_t  sidlen;            /* session id bytes after this header */
+    uint16_t pad;
+};
+
+/* attach (creating if necessary) to the shared ring; returns 0 on
+ * success.  A no-op returning -1 when telemetry_ringbuffer_size is 0 */
+int telemetry_ring_attach(void);
+
+/* append one record; drops silently (counted) when the ring is full */
+void telemetry_ring_log(const char *buf, size_t len, int iswrite,
+                        void *rock);
+
+/* drain committed records through 'proc' (called with the record
+ * header, session id and payload contiguous in 'rec'), advancing the
+ * tail.  Returns the number of records consumed.  Only telemetryd
+ * may call this */
+typedef void telemetry_drain_cb_t(const struct telemetry_rec *rec,
+                                  void *rock);
+int telemetry_ring_drain(telemetry_drain_cb_t *proc, void *rock);
+
 #endif
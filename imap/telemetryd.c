@@ -0,0 +1,194 @@
+/* telemetryd.c - daemon draining the shared telemetry ring buffer
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <signal.h>
+#include <fcntl.h>
+
+#include "global.h"
+#include "telemetry.h"
+#include "exitcodes.h"
+#include "retry.h"
+
+extern int optind;
+extern char *optarg;
+
+static int verbose = 0;
+static int debugmode = 0;
+
+static int log_fd = -1;
+
+EXPORTED void fatal(const char *msg, int err)
+{
+    if (debugmode) fprintf(stderr, "dying with %s %d\n", msg, err);
+    syslog(LOG_CRIT, "%s", msg);
+    syslog(LOG_NOTICE, "exiting");
+
+    cyrus_done();
+
+    exit(err);
+}
+
+/* append one consumed record, raw, to the binary log */
+static void write_record(const struct telemetry_rec *rec,
+                         void *rock __attribute__((unused)))
+{
+    size_t len = sizeof(*rec) + rec->sidlen + rec->len;
+
+    if (retry_write(log_fd, rec, len) == -1)
+        syslog(LOG_ERR, "IOERROR: writing telemetry log: %m");
+}
+
+static void shut_down(int ec) __attribute__((noreturn));
+static void shut_down(int ec)
+{
+    /* pick up anything committed since the last pass */
+    telemetry_ring_drain(&write_record, NULL);
+    if (log_fd != -1) close(log_fd);
+    cyrus_done();
+    exit(ec);
+}
+
+int main(int argc, char **argv)
+{
+    char *p = NULL;
+    char fname[1024];
+    int opt;
+    pid_t pid;
+    char *alt_config = NULL;
+
+    if ((geteuid()) == 0 && (become_cyrus(/*is_master*/0) != 0)) {
+        fatal("must run as the Cyrus user", EC_USAGE);
+    }
+
+    p = getenv("CYRUS_VERBOSE");
+    if (p) verbose = atoi(p) + 1;
+
+    while ((opt = getopt(argc, argv, "C:d")) != EOF) {
+        switch (opt) {
+        case 'C': /* alt config file */
+            alt_config = optarg;
+            break;
+        case 'd': /* don't fork. debugging mode */
+            debugmode = 1;
+            break;
+        default:
+            fprintf(stderr, "invalid argument\n");
+            exit(EC_USAGE);
+            break;
+        }
+    }
+
+    cyrus_init(alt_config, "telemetryd", 0, 0);
+
+    if (telemetry_ring_attach()) {
+        fprintf(stderr,
+                "telemetryd: telemetry_ringbuffer_size is not configured\n");
+        cyrus_done();
+        exit(EC_CONFIG);
+    }
+
+    snprintf(fname, sizeof(fname), "%s%s/telemetry.bin",
+             config_dir, FNAME_LOGDIR);
+    log_fd = open(fname, O_CREAT | O_APPEND | O_WRONLY, 0600);
+    if (log_fd == -1) {
+        fprintf(stderr, "telemetryd: can't open %s: %s\n",
+                fname, strerror(errno));
+        cyrus_done();
+        exit(EC_IOERR);
+    }
+
+    signals_set_shutdown(shut_down);
+    signals_add_handlers(0);
+
+    /* fork unless we were given the -d option or we're running as a daemon */
+    if (debugmode == 0 && !getenv("CYRUS_ISDAEMON")) {
+
+        pid = fork();
+
+        if (pid == -1) {
+            perror("fork");
+            exit(1);
+        }
+
+        if (pid != 0) { /* parent */
+            exit(0);
+        }
+    }
+    /* child */
+
+    for (;;) {
+        int n;
+
+        signals_poll();
+
+        /* check for shutdown file */
+        if (shutdown_file(NULL, 0)) {
+            if (verbose || debugmode)
+                syslog(LOG_DEBUG, "Detected shutdown file\n");
+            shut_down(0);
+        }
+
+        n = telemetry_ring_drain(&write_record, NULL);
+        if (verbose && n)
+            syslog(LOG_DEBUG, "drained %d telemetry records", n);
+
+        /* nothing committed; don't spin on an idle ring */
+        if (!n) usleep(100000);
+    }
+
+    /* NOTREACHED */
+    shut_down(0);
+}
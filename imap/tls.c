@@ -103,6 +103,7 @@
 /* System library. */
 
 #include <sys/types.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
@@ -113,13 +114,17 @@
 #include <openssl/lhash.h>
 #include <openssl/bn.h>
 #include <openssl/err.h>
+#include <openssl/hmac.h>
 #include <openssl/pem.h>
+#include <openssl/rand.h>
 #include <openssl/x509.h>
 #include <openssl/ssl.h>
 
 /* Application-specific. */
 #include "assert.h"
+#include "cyr_lock.h"
 #include "nonblock.h"
+#include "retry.h"
 #include "util.h"
 #include "xmalloc.h"
 #include "tls.h"
@@ -134,6 +139,17 @@
 static struct db *sessdb = NULL;
 static int sess_dbopen = 0;
 
+/* resumption counters, summarised at engine shutdown so hit rates can
+ * be tracked across the pool from syslog */
+static struct {
+    unsigned sess_new;
+    unsigned sess_hit;
+    unsigned sess_miss;
+    unsigned ticket_hit;
+    unsigned ticket_renew;
+    unsigned ticket_miss;
+} sess_stats;
+
 enum {
     var_imapd_tls_loglevel = 0,
     var_proxy_tls_loglevel = 0,
@@ -534,6 +550,8 @@ static int new_session_cb(SSL *ssl __attribute__((unused)),
 
     free(data);
 
+    if (ret == 0) sess_stats.sess_new++;
+
     /* log this transaction */
     if (var_imapd_tls_loglevel > 0) {
         unsigned int i;
@@ -641,6 +659,9 @@ static SSL_SESSION *get_session_cb(SSL *ssl __attribute__((unused)),
         }
     }
 
+    if (sess) sess_stats.sess_hit++;
+    else sess_stats.sess_miss++;
+
     /* log this transaction */
     if (var_imapd_tls_loglevel > 0) {
         int i;
@@ -657,6 +678,170 @@ static SSL_SESSION *get_session_cb(SSL *ssl __attribute__((unused)),
     return sess;
 }
 
+#if (OPENSSL_VERSION_NUMBER >= 0x10000000L) && !defined(OPENSSL_NO_TLSEXT)
+
+/*
+ * Session ticket support.  OpenSSL generates a random ticket key per
+ * SSL_CTX, which in our preforked model means per process - a ticket
+ * issued by one child is garbage to every other child, so clients
+ * which prefer tickets (and therefore skip the session-id cache
+ * above) end up doing a full handshake almost every time.  Instead
+ * all processes share a ticket key file alongside the session
+ * database, rotated at the session timeout interval; the previous
+ * key is kept through one rotation so tickets issued just before it
+ * still resume (and get reissued under the new key).
+ */
+
+struct ticket_key {
+    unsigned char name[16];
+    unsigned char hmac[32];
+    unsigned char aes[16];
+    time_t created;
+};
+
+#define TLS_TICKET_MAGIC "CyrusTK1"
+
+struct ticket_keyfile {
+    char magic[8];
+    struct ticket_key cur;
+    struct ticket_key prev;
+};
+
+static struct ticket_keyfile ticket_keys;
+static int sess_timeout = 0;    /* seconds; also the rotation interval */
+
+static int ticket_key_fresh(const struct ticket_keyfile *keyfile, time_t now)
+{
+    if (memcmp(keyfile->magic, TLS_TICKET_MAGIC, sizeof(keyfile->magic)))
+        return 0;
+    /* a key from the future means somebody's clock is off - replace it */
+    if (keyfile->cur.created > now)
+        return 0;
+    if (keyfile->cur.created + sess_timeout <= now)
+        return 0;
+    return 1;
+}
+
+/*
+ * Re-read the shared key file, cutting a fresh key (under an
+ * exclusive lock) if it's missing or due for rotation.  Only called
+ * when the in-process copy is stale or fails to match a ticket, so
+ * the lock sees no steady-state traffic.
+ */
+static int ticket_key_reload(void)
+{
+    char *fname = strconcat(config_dir, FNAME_TLSTICKETKEY, (char *)NULL);
+    struct ticket_keyfile keyfile;
+    time_t now = time(0);
+    int r = -1;
+    int n;
+
+    int fd = open(fname, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+        syslog(LOG_ERR, "IOERROR: creating %s: %m", fname);
+        goto done;
+    }
+    if (lock_setlock(fd, /*exclusive*/1, /*nonblock*/0, fname)) {
+        syslog(LOG_ERR, "IOERROR: locking %s: %m", fname);
+        goto done;
+    }
+
+    n = read(fd, &keyfile, sizeof(keyfile));
+    if (n != sizeof(keyfile) || !ticket_key_fresh(&keyfile, now)) {
+        /* keep the outgoing key so its tickets still resume */
+        if (n == sizeof(keyfile) &&
+            !memcmp(keyfile.magic, TLS_TICKET_MAGIC, sizeof(keyfile.magic)))
+            keyfile.prev = keyfile.cur;
+        else
+            memset(&keyfile.prev, 0, sizeof(keyfile.prev));
+        memcpy(keyfile.magic, TLS_TICKET_MAGIC, sizeof(keyfile.magic));
+
+        if (RAND_bytes(keyfile.cur.name, sizeof(keyfile.cur.name)) <= 0 ||
+            RAND_bytes(keyfile.cur.hmac, sizeof(keyfile.cur.hmac)) <= 0 ||
+            RAND_bytes(keyfile.cur.aes, sizeof(keyfile.cur.aes)) <= 0) {
+            syslog(LOG_ERR, "TLS ticket key generation failed");
+            lock_unlock(fd, fname);
+            goto done;
+        }
+        keyfile.cur.created = now;
+
+        lseek(fd, 0, SEEK_SET);
+        if (retry_write(fd, &keyfile, sizeof(keyfile)) != sizeof(keyfile)) {
+            syslog(LOG_ERR, "IOERROR: writing %s: %m", fname);
+            lock_unlock(fd, fname);
+            goto done;
+        }
+
+        if (var_imapd_tls_loglevel > 0)
+            syslog(LOG_DEBUG, "rotated TLS session ticket key");
+    }
+    lock_unlock(fd, fname);
+
+    ticket_keys = keyfile;
+    r = 0;
+
+ done:
+    if (fd != -1) close(fd);
+    free(fname);
+    return r;
+}
+
+static int ticket_key_cb(SSL *ssl __attribute__((unused)),
+                         unsigned char key_name[16],
+                         unsigned char *iv,
+                         EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+{
+    time_t now = time(0);
+    int reloaded = 0;
+
+    if (enc) {
+        /* issue a ticket under the current shared key */
+        if (!ticket_key_fresh(&ticket_keys, now) && ticket_key_reload())
+            return -1;  /* no key - fall back to a plain session */
+        if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) <= 0)
+            return -1;
+        memcpy(key_name, ticket_keys.cur.name, sizeof(ticket_keys.cur.name));
+        EVP_EncryptInit_ex(ectx, EVP_aes_128_cbc(), NULL,
+                           ticket_keys.cur.aes, iv);
+        HMAC_Init_ex(hctx, ticket_keys.cur.hmac, sizeof(ticket_keys.cur.hmac),
+                     EVP_sha256(), NULL);
+        return 1;
+    }
+
+    /* try the current key, then the previous one, then once more
+     * after a reload in case another process has rotated since we
+     * last looked */
+    for (;;) {
+        if (!memcmp(key_name, ticket_keys.cur.name,
+                    sizeof(ticket_keys.cur.name))) {
+            EVP_DecryptInit_ex(ectx, EVP_aes_128_cbc(), NULL,
+                               ticket_keys.cur.aes, iv);
+            HMAC_Init_ex(hctx, ticket_keys.cur.hmac,
+                         sizeof(ticket_keys.cur.hmac), EVP_sha256(), NULL);
+            sess_stats.ticket_hit++;
+            return 1;
+        }
+        /* the all-zero slot of a never-rotated file is not a key */
+        if (ticket_keys.prev.created &&
+            !memcmp(key_name, ticket_keys.prev.name,
+                    sizeof(ticket_keys.prev.name))) {
+            EVP_DecryptInit_ex(ectx, EVP_aes_128_cbc(), NULL,
+                               ticket_keys.prev.aes, iv);
+            HMAC_Init_ex(hctx, ticket_keys.prev.hmac,
+                         sizeof(ticket_keys.prev.hmac), EVP_sha256(), NULL);
+            sess_stats.ticket_renew++;
+            return 2;   /* accept, but reissue under the current key */
+        }
+        if (reloaded++ || ticket_key_reload())
+            break;
+    }
+
+    sess_stats.ticket_miss++;
+    return 0;
+}
+
+#endif /* OPENSSL_VERSION_NUMBER && !OPENSSL_NO_TLSEXT */
+
 /*
  * Seed the random number generator.
  */
@@ -735,6 +920,10 @@ EXPORTED int     tls_init_serverengine(const char *ident,
     off |= SSL_OP_NO_SSLv2;       /* Disable insecure SSLv2 */
     off |= SSL_OP_NO_SSLv3;       /* Disable insecure SSLv3 */
     off |= SSL_OP_NO_COMPRESSION; /* Disable TLS compression */
+#ifdef SSL_OP_ENABLE_KTLS
+    off |= SSL_OP_ENABLE_KTLS;    /* Kernel TLS offload where supported;
+                                   * silently ignored otherwise */
+#endif
 
     const char *tls_versions = config_getstring(IMAPOPT_TLS_VERSIONS);
 
@@ -994,6 +1183,17 @@ EXPORTED int     tls_init_serverengine(const char *ident,
             sess_dbopen = 1;
 
         free(tofree);
+
+#if (OPENSSL_VERSION_NUMBER >= 0x10000000L) && !defined(OPENSSL_NO_TLSEXT)
+        /* shared ticket key, so tickets resume across the whole pool
+         * rather than only against the child that issued them */
+        sess_timeout = timeout * 60;
+        if (ticket_key_reload())
+            syslog(LOG_WARNING,
+                   "TLS ticket key unavailable, tickets will be per-process");
+        else
+            SSL_CTX_set_tlsext_ticket_key_cb(s_ctx, ticket_key_cb);
+#endif
     }
 
     tls_serverengine = 1;
@@ -1297,6 +1497,18 @@ EXPORTED int tls_shutdown_serverengine(void)
     int r;
 
     if (tls_serverengine) {
+        /* one summary line per process so resumption hit rates can be
+         * aggregated across the pool */
+        if (sess_stats.sess_new || sess_stats.sess_hit || sess_stats.sess_miss ||
+            sess_stats.ticket_hit || sess_stats.ticket_renew ||
+            sess_stats.ticket_miss) {
+            syslog(LOG_NOTICE, "tlsresume: sessions %u new, %u hits, %u misses; "
+                   "tickets %u hits, %u renewals, %u misses",
+                   sess_stats.sess_new, sess_stats.sess_hit,
+                   sess_stats.sess_miss, sess_stats.ticket_hit,
+                   sess_stats.ticket_renew, sess_stats.ticket_miss);
+        }
+
         if (sess_dbopen) {
             r = cyrusdb_close(sessdb);
             if (r) {
@@ -1463,6 +1675,10 @@ HIDDEN int tls_init_clientengine(int verifydepth,
     off |= SSL_OP_NO_SSLv2;       /* Disable insecure SSLv2 */
     off |= SSL_OP_NO_SSLv3;       /* Disable insecure SSLv3 */
     off |= SSL_OP_NO_COMPRESSION; /* Disable TLS compression */
+#ifdef SSL_OP_ENABLE_KTLS
+    off |= SSL_OP_ENABLE_KTLS;    /* Kernel TLS offload where supported;
+                                   * silently ignored otherwise */
+#endif
 
     SSL_CTX_set_options(c_ctx, off);
     SSL_CTX_set_info_callback(c_ctx, apps_ssl_info_callback);
@@ -53,6 +53,9 @@ int tls_enabled(void);
 /* name of the SSL/TLS sessions database */
 #define FNAME_TLSSESSIONS "/tls_sessions.db"
 
+/* name of the shared session ticket key file */
+#define FNAME_TLSTICKETKEY "/tls_ticket.key"
+
 #ifdef HAVE_SSL
 
 #include <openssl/ssl.h>
@@ -3,9 +3,11 @@
 #include <config.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <syslog.h>
 
 #include <fstream>
+#include <map>
 #include <sstream>
 
 extern "C" {
@@ -527,6 +529,67 @@ int xapian_dbw_is_indexed(xapian_dbw_t *dbw, const char *cyrusid)
 
 /* ====================================================================== */
 
+/* Process-lifetime cache of open database readers, keyed by path.
+ * Opening a database repays block-cache warmup every time, which
+ * dominates the latency of small searches; repeated searches from the
+ * same process reuse the open reader instead.  Xapian::Database is a
+ * refcounted handle, so the per-session aggregate built in
+ * xapian_db_open() shares the cached reader's state.
+ *
+ * A cached reader is brought up to date with reopen(), which is
+ * almost free when nothing has changed.  reopen() can't detect the
+ * whole database being replaced (e.g. by compaction renaming a fresh
+ * tree into place) because it works from the already-open file
+ * descriptors, so we remember the directory's inode as a generation
+ * marker and discard the reader when it changes. */
+
+struct cached_reader {
+    Xapian::Database database;
+    ino_t ino;
+};
+
+static std::map<std::string, struct cached_reader> *reader_cache = NULL;
+
+/* imapd can wander over many users' shared folders; don't hold every
+ * database we ever saw open forever */
+#define READER_CACHE_MAX 20
+
+static Xapian::Database reader_cache_open(const std::string &path)
+{
+    struct stat sb;
+    ino_t ino = 0;
+
+    if (stat(path.c_str(), &sb) == 0)
+        ino = sb.st_ino;
+
+    if (!reader_cache)
+        reader_cache = new std::map<std::string, struct cached_reader>();
+
+    std::map<std::string, struct cached_reader>::iterator it =
+        reader_cache->find(path);
+    if (it != reader_cache->end()) {
+        if (it->second.ino == ino) {
+            try {
+                it->second.database.reopen();
+                return it->second.database;
+            }
+            catch (const Xapian::Error &err) {
+                /* fall through and open afresh */
+            }
+        }
+        reader_cache->erase(it);
+    }
+
+    if (reader_cache->size() >= READER_CACHE_MAX)
+        reader_cache->clear();
+
+    struct cached_reader reader;
+    reader.database = Xapian::Database(path);
+    reader.ino = ino;
+    reader_cache->insert(std::make_pair(path, reader));
+    return reader.database;
+}
+
 struct xapian_db
 {
     std::string *paths;
@@ -548,7 +611,7 @@ int xapian_db_open(const char **paths, xapian_db_t **dbp)
         db->database = new Xapian::Database();
         while (*paths) {
             thispath = *paths++;
-            Xapian::Database database = Xapian::Database(thispath);
+            Xapian::Database database = reader_cache_open(thispath);
             int stem_version = stem_version_get(&database);
             if (stem_version < 0) {
                 syslog(LOG_ERR, "xapian_wrapper: Invalid prefix version %d in %s",
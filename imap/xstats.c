@@ -41,6 +41,18 @@
  */
 
 #include <config.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libconfig.h"
 #include "xstats.h"
 
 
@@ -50,3 +62,197 @@ EXPORTED const char *xstats_names[XSTATS_NUM_METRICS] = {
 #include "xstats_metrics.h"
 #undef X
 };
+
+EXPORTED const char *xstats_timer_names[XSTATS_NUM_TIMERS] = {
+#define X(x) _STRINGIFY(x)
+#include "xstats_timers.h"
+#undef X
+};
+
+static struct xstats_map *timermap = NULL;
+static int timer_state = -1;        /* -1 unknown, 0 off, 1 on */
+
+/*
+ * Map (creating and initializing if needed) the shared statistics
+ * file.  Raw fcntl serializes initialization, same as lockstat.
+ */
+static int xstats_attach(void)
+{
+    char fname[1024];
+    struct flock fl;
+    struct stat sbuf;
+    void *base;
+    int fd, i;
+
+    snprintf(fname, sizeof(fname), "%s%s", config_dir, XSTATS_SHM_FNAME);
+
+    fd = open(fname, O_CREAT | O_RDWR, 0600);
+    if (fd == -1) {
+        syslog(LOG_ERR, "IOERROR: opening timing statistics %s: %m", fname);
+        return -1;
+    }
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    while (fcntl(fd, F_SETLKW, &fl) == -1) {
+        if (errno != EINTR) {
+            syslog(LOG_ERR, "IOERROR: locking timing statistics %s: %m",
+                   fname);
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (fstat(fd, &sbuf) == -1 ||
+        (size_t) sbuf.st_size < sizeof(struct xstats_map)) {
+        if (ftruncate(fd, sizeof(struct xstats_map)) == -1) {
+            syslog(LOG_ERR, "IOERROR: sizing timing statistics %s: %m",
+                   fname);
+            close(fd);
+            return -1;
+        }
+    }
+
+    base = mmap(NULL, sizeof(struct xstats_map),
+                PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        syslog(LOG_ERR, "IOERROR: mapping timing statistics %s: %m", fname);
+        close(fd);
+        return -1;
+    }
+    timermap = (struct xstats_map *) base;
+
+    if (!timermap->magic) {
+        /* freshly created - we hold the init lock, so write the header
+         * and name table, publishing the magic last */
+        timermap->version = XSTATS_SHM_VERSION;
+        timermap->ntimers = XSTATS_NUM_TIMERS;
+        timermap->nbuckets = XSTATS_TIMER_NBUCKETS;
+        for (i = 0 ; i < XSTATS_NUM_TIMERS ; i++)
+            snprintf(timermap->timers[i].name, XSTATS_TIMER_NAMELEN,
+                     "%s", xstats_timer_names[i]);
+        __sync_synchronize();
+        timermap->magic = XSTATS_SHM_MAGIC;
+    }
+    else if (timermap->magic != XSTATS_SHM_MAGIC ||
+             timermap->version != XSTATS_SHM_VERSION ||
+             timermap->ntimers != XSTATS_NUM_TIMERS ||
+             timermap->nbuckets != XSTATS_TIMER_NBUCKETS) {
+        syslog(LOG_ERR, "timing statistics %s: bad magic/version/size, "
+               "remove it and restart", fname);
+        munmap(base, sizeof(struct xstats_map));
+        timermap = NULL;
+        close(fd);
+        return -1;
+    }
+
+    close(fd);  /* drops the init lock; the mapping keeps the file alive */
+
+    return 0;
+}
+
+/* cheap after the first call.  Operations timed before the config is
+ * read are not counted */
+static int timer_ready(void)
+{
+    if (timer_state >= 0) return timer_state;
+    if (!config_dir) return 0;
+
+    timer_state = xstats_attach() ? 0 : 1;
+
+    return timer_state;
+}
+
+/* log-linear bucket index: XSTATS_TIMER_SUBBUCKETS linear sub-buckets
+ * per power of two of microseconds (assumes SUBBUCKETS == 4) */
+static unsigned timer_bucket(uint64_t usec)
+{
+    uint64_t v = usec;
+    unsigned k = 0;
+    unsigned idx;
+
+    if (usec < XSTATS_TIMER_SUBBUCKETS) return (unsigned) usec;
+
+    while (v > 1) {
+        v >>= 1;
+        k++;
+    }
+    idx = (k - 1) * XSTATS_TIMER_SUBBUCKETS
+        + ((usec >> (k - 2)) & (XSTATS_TIMER_SUBBUCKETS - 1));
+    if (idx >= XSTATS_TIMER_NBUCKETS) idx = XSTATS_TIMER_NBUCKETS - 1;
+
+    return idx;
+}
+
+EXPORTED void xstats_timer_start(struct xstats_timer *t)
+{
+    t->armed = 0;
+    if (!timer_ready()) return;
+
+    t->armed = 1;
+    clock_gettime(CLOCK_MONOTONIC, &t->start);
+}
+
+EXPORTED void xstats_timer_record(struct xstats_timer *t, int timer)
+{
+    struct xstats_timing *tm;
+    struct timespec end;
+    uint64_t usec;
+
+    if (!t->armed) return;
+    t->armed = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    usec = (uint64_t)(end.tv_sec - t->start.tv_sec) * 1000000
+         + (end.tv_nsec - t->start.tv_nsec) / 1000;
+
+    tm = &timermap->timers[timer];
+    __sync_fetch_and_add(&tm->count, 1);
+    __sync_fetch_and_add(&tm->total_usec, usec);
+    __sync_fetch_and_add(&tm->buckets[timer_bucket(usec)], 1);
+    /* racy, but a lost update on a maximum is harmless */
+    if (usec > tm->max_usec) tm->max_usec = usec;
+}
+
+EXPORTED const struct xstats_timing *xstats_timing_get(int timer)
+{
+    if (timer_state != 1) return NULL;
+    return &timermap->timers[timer];
+}
+
+EXPORTED const struct xstats_map *xstats_map_readonly(void)
+{
+    const struct xstats_map *map;
+    char fname[1024];
+    struct stat sbuf;
+    void *base;
+    int fd;
+
+    if (!config_dir) return NULL;
+
+    snprintf(fname, sizeof(fname), "%s%s", config_dir, XSTATS_SHM_FNAME);
+
+    fd = open(fname, O_RDONLY);
+    if (fd == -1) return NULL;
+
+    if (fstat(fd, &sbuf) == -1 ||
+        (size_t) sbuf.st_size < sizeof(struct xstats_map)) {
+        close(fd);
+        return NULL;
+    }
+
+    base = mmap(NULL, sizeof(struct xstats_map), PROT_READ, MAP_SHARED,
+                fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return NULL;
+
+    map = (const struct xstats_map *) base;
+    if (map->magic != XSTATS_SHM_MAGIC ||
+        map->version != XSTATS_SHM_VERSION) {
+        munmap(base, sizeof(struct xstats_map));
+        return NULL;
+    }
+
+    return map;
+}
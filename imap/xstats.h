@@ -48,6 +48,7 @@
 #elif defined(HAVE_STDINT_H)
 # include <stdint.h>
 #endif
+#include <time.h>
 #include <config.h>
 
 #define _PASTE(a,b)             a##b
@@ -65,6 +66,66 @@ extern const char *xstats_names[XSTATS_NUM_METRICS];
 
 #define xstats_inc(m)           (xstats[_PASTE(XSTATS_,m)]++)
 #define xstats_add(m, x)        (xstats[_PASTE(XSTATS_,m)] += (x))
+#define xstats_set(m, x)        (xstats[_PASTE(XSTATS_,m)] = (x))
+
+/*-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-*/
+
+/* Always-on latency histograms for a few key operations
+ * (xstats_timers.h is the canonical list).  Unlike the counters above
+ * these are aggregated host-wide: every process maps the statistics
+ * file at {configdirectory}/xstats shared and records into it with
+ * atomic adds, so an external exporter can scrape live numbers without
+ * touching the processes at all. */
+
+#define XSTATS_SHM_FNAME        "/xstats"
+#define XSTATS_SHM_MAGIC        0x58535453      /* "XSTS" */
+#define XSTATS_SHM_VERSION      1
+#define XSTATS_TIMER_NAMELEN    32
+/* log-linear: four linear sub-buckets per power of two of microseconds,
+ * so out to ~4 seconds; anything slower lands in the last bucket */
+#define XSTATS_TIMER_SUBBUCKETS 4
+#define XSTATS_TIMER_NBUCKETS   88
+
+enum
+{
+#define X(x)    _PASTE(XSTATS_TIMER_,x)
+#include "xstats_timers.h"
+#undef X
+    XSTATS_NUM_TIMERS
+};
+extern const char *xstats_timer_names[XSTATS_NUM_TIMERS];
+
+struct xstats_timing {
+    char name[XSTATS_TIMER_NAMELEN];
+    uint64_t count;
+    uint64_t total_usec;
+    uint64_t max_usec;
+    uint64_t buckets[XSTATS_TIMER_NBUCKETS];
+};
+
+struct xstats_map {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ntimers;
+    uint32_t nbuckets;
+    struct xstats_timing timers[XSTATS_NUM_TIMERS];
+};
+
+struct xstats_timer {
+    int armed;
+    struct timespec start;
+};
+
+void xstats_timer_start(struct xstats_timer *t);
+void xstats_timer_record(struct xstats_timer *t, int timer);
+#define xstats_timer_end(t, m) \
+    xstats_timer_record((t), _PASTE(XSTATS_TIMER_,m))
+
+/* this process's live (host-wide) view; NULL when unavailable */
+const struct xstats_timing *xstats_timing_get(int timer);
+
+/* read-only attach for exporters; NULL if there is nothing to read */
+const struct xstats_map *xstats_map_readonly(void);
 
 /*-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-*/
 
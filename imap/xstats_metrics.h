@@ -60,3 +60,5 @@ X(SPHINX_QUERY),
 X(SPHINX_ROW),
 X(SPHINX_RESULT),
 X(SPHINX_UNINDEXED),
+X(ARENA_HIGHWATER),
+X(RSS_HIGHWATER),
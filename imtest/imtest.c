@@ -46,6 +46,7 @@
 
 #include <fcntl.h>
 #include <limits.h>
+#include <math.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <pwd.h>
@@ -62,6 +63,7 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <ctype.h>
 
@@ -2542,12 +2544,314 @@ static int http_do_auth(struct sasl_cmd_t *sasl_cmd __attribute__((unused)),
 /*****************************************************************************/
 
 /* didn't give correct parameters; let's exit */
+/*
+ * Load generation mode: N concurrent scripted sessions driving canned
+ * IMAP workloads with per-command latency capture.  Sessions use a
+ * plain LOGIN - no SASL negotiation and no TLS - so what's measured is
+ * the server, not the handshake machinery in this client.
+ */
+
+#define LOAD_NBUCKETS 28        /* log2 microsecond buckets */
+
+struct load_stats {
+    uint64_t count;
+    uint64_t failed;
+    uint64_t sum_us;
+    uint64_t max_us;
+    uint64_t buckets[LOAD_NBUCKETS];
+};
+
+static uint64_t load_now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void load_record(struct load_stats *st, uint64_t us)
+{
+    uint64_t v = us;
+    int b = 0;
+
+    while (v > 1 && b < LOAD_NBUCKETS-1) {
+        v >>= 1;
+        b++;
+    }
+    st->buckets[b]++;
+    st->count++;
+    st->sum_us += us;
+    if (us > st->max_us) st->max_us = us;
+}
+
+/* exponentially distributed think time with the given mean */
+static void load_think(int think_ms)
+{
+    double u, ms;
+
+    if (!think_ms) return;
+
+    u = (rand() + 1.0) / ((double)RAND_MAX + 2.0);
+    ms = -think_ms * log(u);
+    usleep((unsigned int)(ms * 1000));
+}
+
+/* send one command, wait for its tagged response, record the latency */
+static int load_docmd(struct load_stats *st, const char *cmd)
+{
+    static int cmdnum = 0;
+    char tag[32];
+    uint64_t t0;
+    char *resp;
+
+    snprintf(tag, sizeof(tag), "L%d", ++cmdnum);
+
+    t0 = load_now_us();
+    prot_printf(pout, "%s %s\r\n", tag, cmd);
+    prot_flush(pout);
+    resp = waitfor(tag, NULL, 0);
+    load_record(st, load_now_us() - t0);
+
+    if (strncmp(resp + strlen(tag) + 1, "OK", 2)) {
+        st->failed++;
+        return -1;
+    }
+    return 0;
+}
+
+static int load_connect(const char *servername, const char *port,
+                        const char *user, const char *pass,
+                        struct load_stats *st, int measure_login)
+{
+    char cmdbuf[1024];
+    int r;
+
+    if (init_net((char *)servername, (char *)port) != IMTEST_OK)
+        return -1;
+    pin = prot_new(sock, 0);
+    pout = prot_new(sock, 1);
+
+    /* greeting */
+    waitfor("* OK", "* PREAUTH", 0);
+
+    snprintf(cmdbuf, sizeof(cmdbuf), "LOGIN \"%s\" \"%s\"", user, pass);
+    if (measure_login) {
+        r = load_docmd(st, cmdbuf);
+    }
+    else {
+        struct load_stats scratch;
+
+        memset(&scratch, 0, sizeof(scratch));
+        r = load_docmd(&scratch, cmdbuf);
+        if (r) st->failed++;
+    }
+
+    return r;
+}
+
+static void load_disconnect(void)
+{
+    prot_printf(pout, "Q LOGOUT\r\n");
+    prot_flush(pout);
+    waitfor("Q ", NULL, 0);
+    prot_free(pin);
+    prot_free(pout);
+    close(sock);
+}
+
+static int load_worker(const char *servername, const char *port,
+                       const char *workload, int iters, int think_ms,
+                       struct load_stats *st)
+{
+    const char *user = username ? username : authname;
+    int i;
+
+    if (!strcmp(workload, "login")) {
+        /* login storm: a full connect/LOGIN/LOGOUT cycle each time,
+         * measuring the LOGIN */
+        for (i = 0; i < iters; i++) {
+            if (load_connect(servername, port, user, cmdline_password,
+                             st, 1) == 0)
+                load_disconnect();
+            load_think(think_ms);
+        }
+    }
+    else if (!strcmp(workload, "fetch")) {
+        /* FETCH storm: one session, hammer the selected mailbox */
+        if (load_connect(servername, port, user, cmdline_password,
+                         st, 0) < 0)
+            return -1;
+        if (load_docmd(st, "SELECT INBOX") < 0) {
+            load_disconnect();
+            return -1;
+        }
+        for (i = 0; i < iters; i++) {
+            load_docmd(st, "FETCH 1:* (UID FLAGS INTERNALDATE)");
+            load_think(think_ms);
+        }
+        load_disconnect();
+    }
+    else if (!strcmp(workload, "idle")) {
+        /* IDLE fleet: hold an idling session open for 'iters' seconds,
+         * measuring how long the server takes to start idling */
+        uint64_t t0;
+        char str[1024];
+
+        if (load_connect(servername, port, user, cmdline_password,
+                         st, 0) < 0)
+            return -1;
+        if (load_docmd(st, "SELECT INBOX") < 0) {
+            load_disconnect();
+            return -1;
+        }
+
+        t0 = load_now_us();
+        prot_printf(pout, "I IDLE\r\n");
+        prot_flush(pout);
+        do {
+            if (prot_fgets(str, sizeof(str), pin) == NULL) {
+                st->failed++;
+                close(sock);
+                return -1;
+            }
+        } while (str[0] != '+');
+        load_record(st, load_now_us() - t0);
+
+        sleep(iters);
+
+        prot_printf(pout, "DONE\r\n");
+        prot_flush(pout);
+        waitfor("I ", NULL, 0);
+        load_disconnect();
+    }
+    else {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void load_report(const char *workload, int nsessions,
+                        struct load_stats *st, double wall_secs)
+{
+    uint64_t running = 0;
+    uint64_t p50 = 0, p90 = 0, p99 = 0;
+    uint64_t maxcount = 0;
+    int b;
+
+    printf("workload %s: %d sessions, %llu commands, %llu failed, "
+           "%.2f secs, %.0f cmds/sec\n",
+           workload, nsessions,
+           (unsigned long long)st->count,
+           (unsigned long long)st->failed,
+           wall_secs, st->count / wall_secs);
+
+    if (!st->count) return;
+
+    for (b = 0; b < LOAD_NBUCKETS; b++) {
+        running += st->buckets[b];
+        if (!p50 && running * 100 >= st->count * 50) p50 = 2ULL << b;
+        if (!p90 && running * 100 >= st->count * 90) p90 = 2ULL << b;
+        if (!p99 && running * 100 >= st->count * 99) p99 = 2ULL << b;
+        if (st->buckets[b] > maxcount) maxcount = st->buckets[b];
+    }
+
+    printf("latency: mean %.1fms  p50 <%.1fms  p90 <%.1fms  p99 <%.1fms"
+           "  max %.1fms\n",
+           st->sum_us / (double)st->count / 1e3,
+           p50 / 1e3, p90 / 1e3, p99 / 1e3, st->max_us / 1e3);
+
+    for (b = 0; b < LOAD_NBUCKETS; b++) {
+        int width, w;
+
+        if (!st->buckets[b]) continue;
+        width = (int)((st->buckets[b] * 50) / maxcount);
+        printf("%9.1fms %8llu |", (2ULL << b) / 1e3,
+               (unsigned long long)st->buckets[b]);
+        for (w = 0; w <= width; w++) putchar('#');
+        putchar('\n');
+    }
+}
+
+static int run_loadgen(const char *servername, const char *port,
+                       const char *workload, int nsessions,
+                       int iters, int think_ms)
+{
+    struct load_stats total;
+    uint64_t t0;
+    int fds[2];
+    int i, status;
+    int failed = 0;
+
+    if (pipe(fds) < 0)
+        imtest_fatal("pipe failed");
+
+    t0 = load_now_us();
+
+    for (i = 0; i < nsessions; i++) {
+        pid_t pid = fork();
+
+        if (pid < 0)
+            imtest_fatal("unable to fork session");
+        if (!pid) {
+            struct load_stats st;
+
+            close(fds[0]);
+            srand(getpid() ^ time(NULL));
+            memset(&st, 0, sizeof(st));
+            load_worker(servername, port, workload, iters, think_ms, &st);
+            /* st fits in PIPE_BUF, so this write is atomic */
+            retry_write(fds[1], (char *)&st, sizeof(st));
+            _exit(0);
+        }
+    }
+    close(fds[1]);
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < nsessions; i++) {
+        struct load_stats st;
+        int b;
+
+        if (retry_read(fds[0], (char *)&st, sizeof(st)) !=
+            (int)sizeof(st)) {
+            failed = 1;
+            break;
+        }
+        total.count += st.count;
+        total.failed += st.failed;
+        total.sum_us += st.sum_us;
+        if (st.max_us > total.max_us) total.max_us = st.max_us;
+        for (b = 0; b < LOAD_NBUCKETS; b++)
+            total.buckets[b] += st.buckets[b];
+    }
+    close(fds[0]);
+
+    while (waitpid(-1, &status, 0) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) failed = 1;
+    }
+
+    if (failed)
+        fprintf(stderr, "warning: one or more sessions died early\n");
+
+    load_report(workload, nsessions, &total, (load_now_us() - t0) / 1e6);
+
+    return total.failed || failed ? 1 : 0;
+}
+
 static void usage(char *prog, char *prot)
 {
     printf("Usage: %s [options] hostname\n", prog);
     printf("  -p port  : port to use (default=standard port for protocol)\n");
-    if (!strcasecmp(prot, "imap"))
+    if (!strcasecmp(prot, "imap")) {
         printf("  -z       : timing test\n");
+        printf("  -L wload : load generation - run a canned workload\n"
+               "             (\"login\", \"fetch\" or \"idle\"; needs -u/-a and -w)\n");
+        printf("  -N #     : load generation: concurrent sessions (default=10)\n");
+        printf("  -g #     : load generation: iterations per session, or seconds\n"
+               "             to hold an idle session open (default=100)\n");
+        printf("  -T #     : load generation: mean think time between commands,\n"
+               "             in milliseconds (default=0)\n");
+    }
     printf("  -k #     : minimum protection layer required\n");
     printf("  -l #     : max protection layer (0=none; 1=integrity; etc)\n");
     printf("  -u user  : authorization name to use\n");
@@ -2722,6 +3026,8 @@ int main(int argc, char **argv)
     void *rock = NULL;
     int reauth = 1;
     int dochallenge = 0, noinitresp = 0;
+    char *load_workload = NULL;
+    int load_sessions = 10, load_iters = 100, load_think_ms = 0;
     char *val;
 
 #undef WITH_SSL_ONLY
@@ -2738,7 +3044,7 @@ int main(int argc, char **argv)
     prog = strrchr(argv[0], '/') ? strrchr(argv[0], '/')+1 : argv[0];
 
     /* look at all the extra args */
-    while ((c = getopt(argc, argv, "P:qscizvk:l:p:u:a:m:f:r:t:n:I:x:X:w:o:?h")) != EOF)
+    while ((c = getopt(argc, argv, "P:qscizvk:l:p:u:a:m:f:r:t:n:I:x:X:w:o:L:N:g:T:?h")) != EOF)
         switch (c) {
         case 'P':
             prot = optarg;
@@ -2837,6 +3143,28 @@ int main(int argc, char **argv)
 
             break;
 
+        case 'L':
+            if (strcmp(optarg, "login") && strcmp(optarg, "fetch") &&
+                strcmp(optarg, "idle"))
+                imtest_fatal("workload must be login, fetch or idle\n");
+            load_workload = optarg;
+            break;
+        case 'N':
+            load_sessions = atoi(optarg);
+            if (load_sessions <= 0)
+                imtest_fatal("number of sessions must be > 0\n");
+            break;
+        case 'g':
+            load_iters = atoi(optarg);
+            if (load_iters <= 0)
+                imtest_fatal("number of iterations must be > 0\n");
+            break;
+        case 'T':
+            load_think_ms = atoi(optarg);
+            if (load_think_ms < 0)
+                imtest_fatal("think time must be >= 0\n");
+            break;
+
         case 'o':
             /* parse the opt=val string.  if no value is given, assume '1' */
             if ((val = strchr(optarg, '=')))
@@ -2889,6 +3217,9 @@ int main(int argc, char **argv)
     if (run_stress_test && strcmp(protocol->protocol, "imap"))
         imtest_fatal("stress test can only be run for IMAP\n");
 
+    if (load_workload && strcmp(protocol->protocol, "imap"))
+        imtest_fatal("load generation can only be run for IMAP\n");
+
     if (errflg) {
         usage(prog, protocol->protocol);
     }
@@ -2921,6 +3252,13 @@ int main(int argc, char **argv)
         fclose(pf);
     }
 
+    if (load_workload) {
+        if (!(username || authname) || !cmdline_password)
+            imtest_fatal("load generation needs -u/-a and -w\n");
+        exit(run_loadgen(servername, port, load_workload,
+                         load_sessions, load_iters, load_think_ms));
+    }
+
     /* attempt to start sasl */
     if (sasl_client_init(callbacks+(!dochallenge ? 2 : 0)) != IMTEST_OK) {
         imtest_fatal("SASL initialization");
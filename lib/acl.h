@@ -115,6 +115,12 @@ extern char *cyrus_acl_masktostr(int acl, char *str);
  */
 extern int cyrus_acl_myrights(const struct auth_state *auth_state, const char *acl);
 
+/*  cyrus_acl_freestate(auth_state)
+ * drop any rights masks cached for 'auth_state'.  Called by
+ * auth_freestate() so a recycled pointer can't hit stale entries.
+ */
+extern void cyrus_acl_freestate(const struct auth_state *auth_state);
+
 /*  cyrus_acl_set(acl, identifier, mode, access, canonproc, canonrock) Modify the
  * ACL pointed to by 'acl' to modify the rights granted to
  * 'identifier' as specified by 'mode' and the set specified in the
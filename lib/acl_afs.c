@@ -50,24 +50,74 @@
 
 #include <config.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 
 #include "acl.h"
 #include "auth.h"
+#include "hash.h"
 #include "xmalloc.h"
 #include "strarray.h"
 #include "libconfig.h"
 
+/* Compiled rights masks, keyed by the raw ACL string.  A mask is only
+ * a function of (auth_state, acl string), the cache is scoped to a
+ * single auth_state - it flushes whenever a different state comes
+ * along, and auth_freestate() flushes it explicitly so a recycled
+ * pointer can't match stale entries.  SETACL needs no hook at all:
+ * changing an ACL changes the string, which is the key.
+ *
+ * Masks are stored in the hash value itself, offset by one so that a
+ * mask of zero isn't mistaken for a missed lookup. */
+
+#define RIGHTSCACHE_MAX 4096
+
+static const struct auth_state *rightscache_state = NULL;
+static hash_table rightscache;
+static unsigned rightscache_count = 0;
+
+static void rightscache_flush(void)
+{
+    if (rightscache.size)
+        free_hash_table(&rightscache, NULL);
+    rightscache_count = 0;
+}
+
+EXPORTED void cyrus_acl_freestate(const struct auth_state *auth_state)
+{
+    if (auth_state && auth_state == rightscache_state) {
+        rightscache_flush();
+        rightscache_state = NULL;
+    }
+}
+
 /*
  * Calculate the set of rights the user in 'auth_state' has in the ACL 'acl'.
  */
 EXPORTED int cyrus_acl_myrights(const struct auth_state *auth_state, const char *origacl)
 {
-    char *acl = xstrdupsafe(origacl);
+    char *acl;
     char *thisid, *rights, *nextid;
     long acl_positive = 0, acl_negative = 0;
     long *acl_ptr;
+    void *cached;
+
+    if (auth_state != rightscache_state) {
+        rightscache_flush();
+        rightscache_state = auth_state;
+    }
+
+    if (origacl) {
+        if (!rightscache.size)
+            construct_hash_table(&rightscache, RIGHTSCACHE_MAX, 0);
+
+        cached = hash_lookup(origacl, &rightscache);
+        if (cached)
+            return (int)((uintptr_t)cached - 1);
+    }
+
+    acl = xstrdupsafe(origacl);
 
     for (thisid = acl; *thisid; thisid = nextid) {
         acl_ptr = &acl_positive;
@@ -98,6 +148,16 @@ EXPORTED int cyrus_acl_myrights(const struct auth_state *auth_state, const char
 
     free(acl);
 
+    if (origacl) {
+        if (rightscache_count >= RIGHTSCACHE_MAX) {
+            rightscache_flush();
+            construct_hash_table(&rightscache, RIGHTSCACHE_MAX, 0);
+        }
+        cached = (void *)((uintptr_t)(acl_positive & ~acl_negative) + 1);
+        hash_insert(origacl, cached, &rightscache);
+        rightscache_count++;
+    }
+
     return acl_positive & ~acl_negative;
 }
 
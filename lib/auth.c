@@ -43,6 +43,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "acl.h"
 #include "auth.h"
 #include "exitcodes.h"
 #include "libcyr_cfg.h"
@@ -108,5 +109,10 @@ EXPORTED void auth_freestate(struct auth_state *auth_state)
 {
     struct auth_mech *auth = auth_fromname();
 
-    if (auth_state) auth->freestate(auth_state);
+    if (auth_state) {
+        /* a later state could be allocated at the same address, so
+         * any rights compiled against this one must go now */
+        cyrus_acl_freestate(auth_state);
+        auth->freestate(auth_state);
+    }
 }
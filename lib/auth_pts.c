@@ -54,6 +54,7 @@
 #include <sys/uio.h>
 
 #include "auth_pts.h"
+#include "cyr_lock.h"
 #include "cyrusdb.h"
 #include "exitcodes.h"
 #include "libcyr_cfg.h"
@@ -326,6 +327,50 @@ static struct auth_state *mynewstate(const char *identifier)
 
 static const char *the_ptscache_db = NULL;
 
+/* Remember a failed lookup so that every authorization attempt doesn't
+ * retry a struggling backend; the entry expires on its own (shorter)
+ * timeout */
+static void ptcache_store_negative(struct db *ptdb,
+                                   const char *identifier, size_t id_len)
+{
+    struct auth_state negative;
+
+    memset(&negative, 0, sizeof(negative));
+    strlcpy(negative.userid.id, identifier, sizeof(negative.userid.id));
+    negative.userid.hash = strhash(identifier);
+    negative.mark = time(NULL);
+    negative.ngroups = PTS_NEGCACHE_NGROUPS;
+
+    cyrusdb_store(ptdb, identifier, id_len,
+                  (void *)&negative, sizeof(negative), NULL);
+}
+
+/* Append an identifier to the refresh queue consumed by ptexpire(8).
+ * Duplicates are weeded out there, and a lost entry only means the
+ * record expires normally, so failures are not fatal */
+static void ptcache_queue_refresh(const char *identifier)
+{
+    const char *config_dir =
+        libcyrus_config_getstring(CYRUSOPT_CONFIG_DIR);
+    char *fname = strconcat(config_dir, PTS_REFRESH_QUEUE, (char *)NULL);
+    char buf[PTS_DB_KEYSIZE+2];
+    int fd, len;
+
+    fd = open(fname, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd >= 0) {
+        len = snprintf(buf, sizeof(buf), "%s\n", identifier);
+        if (!lock_blocking(fd, fname)) {
+            retry_write(fd, buf, len);
+            lock_unlock(fd, fname);
+        }
+        close(fd);
+    }
+    else {
+        syslog(LOG_DEBUG, "ptload(): can't open %s: %m", fname);
+    }
+    free(fname);
+}
+
 /* Returns 0 on success */
 static int ptload(const char *identifier, struct auth_state **state)
 {
@@ -338,7 +383,7 @@ static int ptload(const char *identifier, struct auth_state **state)
     struct db *ptdb;
     int s;
     struct sockaddr_un srvaddr;
-    int r, rc=0;
+    int r, rc=0, neghit=0;
     static char response[1024];
     struct iovec iov[10];
     int niov, n;
@@ -394,7 +439,28 @@ static int ptload(const char *identifier, struct auth_state **state)
      * ask the ptloader to reload it and reread it */
     fetched = (struct auth_state *) data;
 
-    if(fetched) {
+    if(fetched && fetched->ngroups == PTS_NEGCACHE_NGROUPS) {
+        time_t now = time(NULL);
+        int negtimeout =
+            libcyrus_config_getint(CYRUSOPT_PTS_CACHE_NEGATIVE_TIMEOUT);
+        int fresh = (fetched->mark > (now - negtimeout));
+
+        /* never hand a negative entry out as an auth_state, and never
+         * fall back on it when the backend is down */
+        data = NULL;
+        fetched = NULL;
+
+        if (fresh) {
+            /* fail now rather than retrying the backend */
+            syslog(LOG_DEBUG,
+                   "ptload(): negative cache hit for %s", identifier);
+            neghit = 1;
+            rc = -1;
+            goto done;
+        }
+        /* expired; retry the lookup */
+    }
+    else if(fetched) {
         time_t now = time(NULL);
         int timeout = libcyrus_config_getint(CYRUSOPT_PTS_CACHE_TIMEOUT);
 
@@ -404,6 +470,14 @@ static int ptload(const char *identifier, struct auth_state **state)
                fetched->mark, now, now - timeout);
 
         if (fetched->mark > (now - timeout)) {
+            int window =
+                libcyrus_config_getint(CYRUSOPT_PTS_CACHE_REFRESH_WINDOW);
+
+            /* if it's about to expire, queue it for refresh-ahead so
+             * hot entries never miss */
+            if (window > 0 && fetched->mark <= (now - timeout + window))
+                ptcache_queue_refresh(identifier);
+
             /* not expired; let's return it */
             goto done;
         }
@@ -490,6 +564,12 @@ static int ptload(const char *identifier, struct auth_state **state)
     }
 
  done:
+    /* cache the failure so the next few lookups fail fast, but never
+     * clobber stale positive data, which is still usable as a fallback
+     * while the backend recovers */
+    if (rc == -1 && !neghit && data == NULL)
+        ptcache_store_negative(ptdb, identifier, id_len);
+
     /* ok, we got real data, let's use it */
     if (data != NULL) {
       fetched = (struct auth_state *) data;
@@ -58,6 +58,13 @@
 #define PTS_DBSOCKET "/ptclient/ptsock"
 #define PTS_DB_KEYSIZE 512
 
+/* queue of identifiers awaiting refresh-ahead, consumed by ptexpire(8) */
+#define PTS_REFRESH_QUEUE "/ptclient/ptrefresh"
+
+/* ngroups value marking a cached failed lookup; such entries carry no
+ * group data and expire on their own (shorter) timeout */
+#define PTS_NEGCACHE_NGROUPS (-1)
+
 struct auth_ident {
     unsigned hash;
     char id[PTS_DB_KEYSIZE];
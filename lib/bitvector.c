@@ -62,6 +62,12 @@
 #define vlen(x)         vidx((x)+7)
 #define QUANTUM         (256)
 
+/* The allocation is always a xmalloc'd array rounded up to QUANTUM
+ * bytes, so it's safe to walk it a whole machine word at a time for
+ * the bulk of the combining and counting loops below */
+#define BYTES_PER_LONG  ((unsigned int)sizeof(unsigned long))
+#define BITS_PER_LONG   (BITS_PER_UNIT*BYTES_PER_LONG)
+
 EXPORTED void bv_init(bitvector_t *bv)
 {
     memset(bv, 0, sizeof(*bv));
@@ -139,29 +145,44 @@ EXPORTED void bv_clear(bitvector_t *bv, unsigned int i)
 
 EXPORTED void bv_andeq(bitvector_t *a, const bitvector_t *b)
 {
+    unsigned long *aw;
+    const unsigned long *bw;
     unsigned int n;
+    unsigned int nw;
     unsigned int i;
 
     bv_ensure(a, b->length);
     if (!a->length)
         return;
-    n = vlen(b->length+1);
-    for (i = 0 ; i <= n ; i++)
+    aw = (unsigned long *)a->bits;
+    bw = (const unsigned long *)b->bits;
+    n = vlen(b->length);
+    nw = n / BYTES_PER_LONG;
+    for (i = 0 ; i < nw ; i++)
+        aw[i] &= bw[i];
+    for (i = nw * BYTES_PER_LONG ; i < n ; i++)
         a->bits[i] &= b->bits[i];
-    n = vlen(a->length);
-    for ( ; i <= n ; i++)
-        a->bits[i] = 0;
+    if (vlen(a->length) > n)
+        memset(a->bits + n, 0, vlen(a->length) - n);
     a->length = MAX(a->length, b->length);
 }
 
 EXPORTED void bv_oreq(bitvector_t *a, const bitvector_t *b)
 {
+    unsigned long *aw;
+    const unsigned long *bw;
     unsigned int n;
+    unsigned int nw;
     unsigned int i;
 
     bv_ensure(a, b->length);
-    n = vlen(b->length+1);
-    for (i = 0 ; i <= n ; i++)
+    aw = (unsigned long *)a->bits;
+    bw = (const unsigned long *)b->bits;
+    n = vlen(b->length);
+    nw = n / BYTES_PER_LONG;
+    for (i = 0 ; i < nw ; i++)
+        aw[i] |= bw[i];
+    for (i = nw * BYTES_PER_LONG ; i < n ; i++)
         a->bits[i] |= b->bits[i];
     a->length = MAX(a->length, b->length);
 }
@@ -182,7 +203,13 @@ EXPORTED int bv_next_set(const bitvector_t *bv, int start)
             return i;
 
     while (i < (int)bv->length) {
-        if (!bv->bits[vidx(i)]) {
+        if (!(i & (int)(BITS_PER_LONG-1)) &&
+            i + (int)BITS_PER_LONG <= (int)bv->length &&
+            !*(const unsigned long *)(bv->bits + vidx(i))) {
+            /* skip a whole zero word at a time */
+            i += BITS_PER_LONG;
+        }
+        else if (!bv->bits[vidx(i)]) {
             i += BITS_PER_UNIT;
         }
         else {
@@ -243,13 +270,27 @@ static unsigned int bitcount(unsigned int i)
     return (((i + (i >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
 }
 
+static unsigned int bitcountl(unsigned long w)
+{
+    unsigned int n = bitcount((unsigned int)w);
+
+    if (BYTES_PER_LONG > (unsigned int)sizeof(unsigned int))
+        n += bitcount((unsigned int)((w >> 16) >> 16));
+    return n;
+}
+
 EXPORTED unsigned bv_count(const bitvector_t *bv)
 {
-    unsigned i;
+    const unsigned long *w = (const unsigned long *)bv->bits;
+    unsigned int nbytes = vlen(bv->length);
+    unsigned int nw = nbytes / BYTES_PER_LONG;
+    unsigned int i;
     unsigned int n = 0;
 
-    for (i = 0 ; i < bv->length ; i += BITS_PER_UNIT)
-        n += bitcount(bv->bits[vidx(i)]);
+    for (i = 0 ; i < nw ; i++)
+        n += bitcountl(w[i]);
+    for (i = nw * BYTES_PER_LONG ; i < nbytes ; i++)
+        n += bitcount(bv->bits[i]);
     return n;
 }
 
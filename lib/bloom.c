@@ -132,6 +132,63 @@ EXPORTED int bloom_add(struct bloom * bloom, const void * buffer, int len)
 }
 
 
+EXPORTED const unsigned char * bloom_bits(const struct bloom * bloom,
+                                          int * lenp)
+{
+  if (bloom->ready == 0) {
+    return NULL;
+  }
+  *lenp = bloom->bytes;
+  return bloom->bf;
+}
+
+
+EXPORTED int bloom_check_raw(const struct bloom * bloom,
+                             const unsigned char * bf,
+                             const void * buffer, int len)
+{
+  if (bloom->ready == 0) {
+    return -1;
+  }
+
+  unsigned int a = murmurhash2(buffer, len, 0x9747b28c);
+  unsigned int b = murmurhash2(buffer, len, a);
+  unsigned int x;
+  unsigned int i;
+
+  for (i = 0; i < (unsigned)bloom->hashes; i++) {
+    x = (a + i*b) % bloom->bits;
+    if (!(bf[x >> 3] & (1 << (x % 8)))) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+EXPORTED int bloom_add_raw(const struct bloom * bloom,
+                           unsigned char * bf,
+                           const void * buffer, int len)
+{
+  if (bloom->ready == 0) {
+    return -1;
+  }
+
+  unsigned int a = murmurhash2(buffer, len, 0x9747b28c);
+  unsigned int b = murmurhash2(buffer, len, a);
+  unsigned int x;
+  unsigned int i;
+
+  for (i = 0; i < (unsigned)bloom->hashes; i++) {
+    x = (a + i*b) % bloom->bits;
+    bf[x >> 3] |= (1 << (x % 8));
+  }
+
+  return 0;
+}
+
+
 void bloom_print(struct bloom * bloom)
 {
   printf("bloom at %p\n", (void *)bloom);
@@ -117,6 +117,73 @@ int bloom_check(struct bloom * bloom, const void * buffer, int len);
 int bloom_add(struct bloom * bloom, const void * buffer, int len);
 
 
+/** ***************************************************************************
+ * Return a pointer to the raw filter bit array, so that callers can
+ * persist a filter built with fixed parameters and later test elements
+ * against the stored copy with bloom_check_raw().  (Cyrus addition, not
+ * part of upstream libbloom.)
+ *
+ * Parameters:
+ * -----------
+ *     bloom  - Pointer to an allocated struct bloom (see above).
+ *     lenp   - Receives the length of the bit array in bytes.
+ *
+ * Return:
+ * -------
+ *     Pointer to the bit array, or NULL if bloom not initialized.
+ *
+ */
+const unsigned char * bloom_bits(const struct bloom * bloom, int * lenp);
+
+
+/** ***************************************************************************
+ * Check if the given element is in an externally stored filter bit
+ * array 'bf', which must have been produced (via bloom_bits()) by a
+ * filter initialized with the same entries/error parameters as 'bloom'.
+ * 'bloom' itself only supplies the parameters; its own bits are not
+ * consulted.  (Cyrus addition, not part of upstream libbloom.)
+ *
+ * Parameters:
+ * -----------
+ *     bloom  - Pointer to an allocated struct bloom (see above).
+ *     bf     - Stored bit array of at least bloom->bytes bytes.
+ *     buffer - Pointer to buffer containing element to check.
+ *     len    - Size of 'buffer'.
+ *
+ * Return:
+ * -------
+ *     0 - element is not present
+ *     1 - element is present (or false positive due to collision)
+ *    -1 - bloom not initialized
+ *
+ */
+int bloom_check_raw(const struct bloom * bloom, const unsigned char * bf,
+                    const void * buffer, int len);
+
+
+/** ***************************************************************************
+ * Set the bits for the given element in an externally stored filter
+ * bit array 'bf', as bloom_check_raw() but adding instead of testing.
+ * 'bloom' itself only supplies the parameters; its own bits are not
+ * touched.  (Cyrus addition, not part of upstream libbloom.)
+ *
+ * Parameters:
+ * -----------
+ *     bloom  - Pointer to an allocated struct bloom (see above).
+ *     bf     - Stored bit array of at least bloom->bytes bytes.
+ *     buffer - Pointer to buffer containing element to add.
+ *     len    - Size of 'buffer'.
+ *
+ * Return:
+ * -------
+ *     0 - element was added
+ *    -1 - bloom not initialized
+ *
+ */
+int bloom_add_raw(const struct bloom * bloom, unsigned char * bf,
+                  const void * buffer, int len);
+
+
 /** ***************************************************************************
  * Print (to stdout) info about this bloom filter. Debugging aid.
  *
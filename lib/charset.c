@@ -41,6 +41,7 @@
  */
 
 #include <config.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -54,6 +55,9 @@
 
 #define U_REPLACEMENT   0xfffd
 
+/* how much text to feed the search pipeline between match checks */
+#define CHARSET_SEARCH_CHUNKSZ  4096
+
 #define unicode_isvalid(c) \
         (!((c >= 0xd800 && c <= 0xdfff) || ((unsigned)c > 0x10ffff)))
 
@@ -105,6 +109,8 @@ struct canon_state {
 struct comp_pat_s {
     int max_start;
     size_t patlen;
+    /* Boyer-Moore-Horspool bad character shifts for the bulk matcher */
+    size_t shift[256];
 };
 
 struct search_state {
@@ -114,6 +120,7 @@ struct search_state {
     unsigned char *substr;
     size_t patlen;
     size_t offset;
+    const size_t *shift;        /* borrowed from the compiled pattern */
 };
 
 enum html_state {
@@ -195,11 +202,16 @@ static void table_reset(struct convert_rock *rock, int to_uni);
 static void table_free(struct convert_rock *rock);
 
 typedef void convertproc_t(struct convert_rock *rock, uint32_t c);
+typedef void asciiproc_t(struct convert_rock *rock, const char *s, size_t len);
 typedef void freeconvert_t(struct convert_rock *rock);
 typedef void flushproc_t(struct convert_rock *rock);
 
 struct convert_rock {
     convertproc_t *f;
+    /* optional bulk handler for runs of plain ASCII bytes; stages
+     * that treat ASCII as identity set this so such runs bypass the
+     * byte-at-a-time state machines */
+    asciiproc_t *asciicatn;
     freeconvert_t *cleanup;
     flushproc_t *flush;
     struct convert_rock *next;
@@ -315,24 +327,73 @@ static inline void convert_putc(struct convert_rock *rock, uint32_t c)
     rock->f(rock, c);
 }
 
-static void convert_cat(struct convert_rock *rock, const char *s)
+/* Length of the leading run of plain ASCII (high bit clear) bytes,
+ * checked a word at a time once the pointer is aligned */
+static size_t ascii_span(const char *s, size_t len)
 {
-    while (*s) {
-        convert_putc(rock, (unsigned char)*s);
-        s++;
+    const unsigned char *p = (const unsigned char *)s;
+    size_t n = 0;
+
+    while (n < len && ((uintptr_t)(p + n) & (sizeof(uint64_t)-1))) {
+        if (p[n] & 0x80) return n;
+        n++;
     }
-    convert_flush(rock);
+    while (n + sizeof(uint64_t) <= len) {
+        uint64_t w;
+        memcpy(&w, p + n, sizeof(w));
+        if (w & UINT64_C(0x8080808080808080)) break;
+        n += sizeof(w);
+    }
+    while (n < len && !(p[n] & 0x80)) n++;
+
+    return n;
 }
 
-static void convert_catn(struct convert_rock *rock, const char *s, size_t len)
+/* Pass a run of plain ASCII bytes down the pipeline.  Stages that
+ * treat ASCII as identity provide a bulk handler; anything else gets
+ * the bytes one at a time as before.  (In debug mode always go a byte
+ * at a time so every character is traced.) */
+static void convert_ascii(struct convert_rock *rock, const char *s, size_t len)
 {
-    while (len-- > 0) {
-        convert_putc(rock, (unsigned char)*s);
-        s++;
+    if (rock->asciicatn && !charset_debug) {
+        rock->asciicatn(rock, s, len);
+    }
+    else {
+        while (len-- > 0)
+            convert_putc(rock, (unsigned char)*s++);
+    }
+}
+
+/* Feed bytes down the pipeline without flushing, splitting out runs
+ * of plain ASCII for the bulk path */
+static void convert_feed(struct convert_rock *rock, const char *s, size_t len)
+{
+    while (len > 0) {
+        size_t n = ascii_span(s, len);
+        if (n) {
+            convert_ascii(rock, s, n);
+            s += n;
+            len -= n;
+        }
+        if (len > 0) {
+            convert_putc(rock, (unsigned char)*s);
+            s++;
+            len--;
+        }
     }
+}
+
+static void convert_catn(struct convert_rock *rock, const char *s, size_t len)
+{
+    convert_feed(rock, s, len);
     convert_flush(rock);
 }
 
+static void convert_cat(struct convert_rock *rock, const char *s)
+{
+    convert_catn(rock, s, strlen(s));
+}
+
 /* convertproc_t conversion functions */
 static void qp_flushline(struct convert_rock *rock, int endline)
 {
@@ -440,6 +501,73 @@ static void b64_2byte(struct convert_rock *rock, uint32_t c)
     }
 }
 
+/*
+ * Bulk base64 decoding for the ASCII fast path.  The bytewise decoder
+ * costs a virtual call and a state-machine switch per input character;
+ * base64 bodies are the bulk of attachment decoding in squatter and
+ * search, so whole quanta are decoded four coding characters at a
+ * time here and only line breaks, padding and junk drop back to
+ * b64_2byte() (which skips them, keeping the two paths equivalent).
+ */
+static void b64_ascii_catn(struct convert_rock *rock, const char *s, size_t len)
+{
+    struct b64_state *st = (struct b64_state *)rock->state;
+
+    while (len >= 4) {
+        if (!st->bytesleft) {
+            char b0 = CHAR64(s[0]), b1 = CHAR64(s[1]),
+                 b2 = CHAR64(s[2]), b3 = CHAR64(s[3]);
+
+            if (b0 != XX && b1 != XX && b2 != XX && b3 != XX) {
+                convert_putc(rock->next, ((b0 << 2) | (b1 >> 4)) & 0xff);
+                convert_putc(rock->next, ((b1 << 4) | (b2 >> 2)) & 0xff);
+                convert_putc(rock->next, ((b2 << 6) | b3) & 0xff);
+                s += 4;
+                len -= 4;
+                continue;
+            }
+        }
+        b64_2byte(rock, (unsigned char)*s++);
+        len--;
+    }
+
+    while (len) {
+        b64_2byte(rock, (unsigned char)*s++);
+        len--;
+    }
+}
+
+/*
+ * Bulk quoted-printable for the ASCII fast path: runs of ordinary
+ * characters are copied into the line buffer in one go instead of a
+ * call per byte; qp_flushline() still does the '=' decoding per line.
+ */
+static void qp_ascii_catn(struct convert_rock *rock, const char *s, size_t len)
+{
+    struct qp_state *st = (struct qp_state *)rock->state;
+
+    while (len) {
+        size_t n;
+
+        if (*s == '\r' || *s == '\n') {
+            qp2byte(rock, (unsigned char)*s++);
+            len--;
+            continue;
+        }
+
+        n = 0;
+        while (n < len && s[n] != '\r' && s[n] != '\n') n++;
+        if (n > (size_t)(999 - st->len)) n = 999 - st->len;
+        memcpy(st->buf + st->len, s, n);
+        st->len += n;
+        s += n;
+        len -= n;
+
+        /* really overlength line? just flush now, like qp2byte() */
+        if (st->len > 998) qp_flushline(rock, 0);
+    }
+}
+
 /*
  * This filter unfolds folded RFC2822 header field lines, i.e. it strips
  * a CRLF pair only if the first character after the CRLF is LWS, and
@@ -567,6 +695,62 @@ static void uni2searchform(struct convert_rock *rock, uint32_t c)
     }
 }
 
+/* Bytes the search form translation maps to themselves (and that are
+ * not whitespace, so the space merging state machine doesn't care);
+ * runs of these pass through uni2searchform untouched */
+static unsigned char searchform_identity[128];
+static int searchform_identity_set = 0;
+
+static void searchform_identity_init(void)
+{
+    unsigned int c;
+
+    for (c = 0; c < 128; c++) {
+        unsigned char table16 = chartables_translation_block16[0];
+        unsigned char table8;
+        int code;
+
+        if (table16 == 255) {
+            searchform_identity[c] = 1;
+            continue;
+        }
+        table8 = chartables_translation_block8[table16][0];
+        if (table8 == 255) {
+            searchform_identity[c] = 1;
+            continue;
+        }
+        code = chartables_translation[table8][c];
+        searchform_identity[c] =
+            (code == (int)c && code != 0 &&
+             code != ' ' && code != '\r' && code != '\n');
+    }
+    searchform_identity_set = 1;
+}
+
+/* Bulk form of uni2searchform: forward the subruns that translate to
+ * themselves and feed everything else through the byte converter */
+static void searchform_ascii_catn(struct convert_rock *rock,
+                                  const char *s, size_t len)
+{
+    struct canon_state *st = (struct canon_state *)rock->state;
+    size_t i = 0;
+
+    while (i < len) {
+        size_t start = i;
+
+        while (i < len && searchform_identity[(unsigned char)s[i]])
+            i++;
+        if (i > start) {
+            st->seenspace = 0;
+            convert_ascii(rock->next, s + start, i - start);
+        }
+        if (i < len) {
+            uni2searchform(rock, (unsigned char)s[i]);
+            i++;
+        }
+    }
+}
+
 /*
  * Given a Unicode codepoint, emit one or more Unicode codepoints in
  * HTML form, suitable for generating search snippets.
@@ -662,6 +846,81 @@ static void byte2search(struct convert_rock *rock, uint32_t c)
     s->offset++;
 }
 
+/*
+ * Bulk form of byte2search for a run of plain ASCII bytes: finish any
+ * matches in progress with memcmp, find matches wholly inside the run
+ * with a Boyer-Moore-Horspool scan, then register pattern prefixes
+ * hanging off the end of the run as new in-progress matches.  Matches
+ * involving non-ASCII bytes still arrive a byte at a time.
+ */
+static void search_ascii_catn(struct convert_rock *rock,
+                              const char *text, size_t len)
+{
+    struct search_state *s = (struct search_state *)rock->state;
+    const unsigned char *t = (const unsigned char *)text;
+    int i, cur;
+    size_t pos;
+
+    if (s->havematch) {
+        s->offset += len;
+        return;
+    }
+
+    /* check our "in_progress" matches against the start of the run */
+    for (i = 0, cur = 0; i < s->max_start; i++) {
+        size_t done, todo;
+
+        if (s->starts[i] == -1)
+            break;
+
+        done = s->offset - s->starts[i];
+        todo = s->patlen - done;
+        if (todo <= len) {
+            if (!memcmp(t, s->substr + done, todo)) {
+                /* we're there! */
+                s->havematch = 1;
+                s->offset += len;
+                return;
+            }
+        }
+        else if (!memcmp(t, s->substr + done, len)) {
+            /* still going past the end of this run, keep it */
+            s->starts[cur++] = s->starts[i];
+        }
+    }
+    /* empty out any others that aren't being kept */
+    for (pos = cur; (int)pos < i; pos++) s->starts[pos] = -1;
+
+    /* matches lying wholly inside the run */
+    pos = 0;
+    while (pos + s->patlen <= len) {
+        unsigned char last = t[pos + s->patlen - 1];
+
+        if (last == s->substr[s->patlen - 1] &&
+            !memcmp(t + pos, s->substr, s->patlen - 1)) {
+            s->havematch = 1;
+            s->offset += len;
+            return;
+        }
+        pos += s->shift[last];
+    }
+
+    /* starting new ones: pattern prefixes that are suffixes of the run.
+     * The same pigeonhole bound as the byte matcher applies: every
+     * in-progress match begins with the pattern's first character, so
+     * there are never more than max_start of them */
+    pos = (s->patlen - 1 <= len) ? len - (s->patlen - 1) : 0;
+    for (; pos < len; pos++) {
+        if (t[pos] == s->substr[0] &&
+            !memcmp(t + pos, s->substr, len - pos) &&
+            cur < s->max_start) {
+            s->starts[cur++] = s->offset + pos;
+        }
+    }
+
+    s->offset += len;
+}
+
 /* Given an octet, append it to a buffer */
 static void byte2buffer(struct convert_rock *rock, uint32_t c)
 {
@@ -670,6 +929,13 @@ static void byte2buffer(struct convert_rock *rock, uint32_t c)
     buf_putc(buf, c & 0xff);
 }
 
+/* Bulk form of byte2buffer for plain ASCII runs */
+static void buffer_ascii_catn(struct convert_rock *rock,
+                              const char *s, size_t len)
+{
+    buf_appendmap((struct buf *)rock->state, s, len);
+}
+
 /* Given an octet c and an icu converter, convert c to
  * its Unicode codepoint. During a flush, c is ignored.
  */
@@ -892,6 +1158,23 @@ emit_replacement:
     }
 }
 
+/* Bulk form of utf8_2uni: a run of plain ASCII bytes needs no
+ * sequence decoding, so forward it untouched once any pending
+ * sequence has been resolved */
+static void utf8_ascii_catn(struct convert_rock *rock,
+                            const char *s, size_t len)
+{
+    struct charset_converter *st = (struct charset_converter *)rock->state;
+
+    if (st->bytesleft) {
+        /* mid-sequence: let the state machine emit the replacement
+         * for the truncated sequence */
+        utf8_2uni(rock, (unsigned char)*s++);
+        if (!--len) return;
+    }
+    convert_ascii(rock->next, s, len);
+}
+
 /* Given a Unicode codepoint, emit valid UTF-8 encoded octets */
 static void uni2utf8(struct convert_rock *rock, uint32_t c)
 {
@@ -922,6 +1205,13 @@ static void uni2utf8(struct convert_rock *rock, uint32_t c)
     }
 }
 
+/* Bulk form of uni2utf8: ASCII codepoints encode to themselves */
+static void uni2utf8_ascii_catn(struct convert_rock *rock,
+                                const char *s, size_t len)
+{
+    convert_ascii(rock->next, s, len);
+}
+
 /* Given an octet which is a codepoint in some 7bit or 8bit character
  * set, or the Unicode replacement character, emit the corresponding
  * Unicode codepoint. */
@@ -943,6 +1233,14 @@ static void table2uni(struct convert_rock *rock, uint32_t c)
     s->curtable = s->initialtable + map->next;
 }
 
+/* Bulk form of table2uni for us-ascii only, whose table maps every
+ * ASCII byte to itself with no table switching */
+static void table_ascii_catn(struct convert_rock *rock,
+                             const char *s, size_t len)
+{
+    convert_ascii(rock->next, s, len);
+}
+
 /*
  * The HTML5 standard mandates that certain Unicode code points
  * cannot be generated using &#nnn; numerical character references,
@@ -1585,6 +1883,7 @@ static void icu_reset(struct convert_rock *rock, size_t len, int to_uni)
     s->src_next = s->src_base;
 
     rock->f = to_uni ? icu2uni : uni2icu;
+    rock->asciicatn = NULL;     /* ICU charsets may not be ASCII clean */
     rock->flush = icu_flush;
     rock->cleanup = icu_free;
 }
@@ -1604,12 +1903,16 @@ static void table_reset(struct convert_rock *rock, int to_uni)
     }
     if (strstr(chartables_charset_table[s->num].name, "utf-8")) {
         rock->f = to_uni ? utf8_2uni : uni2utf8;
+        rock->asciicatn = to_uni ? utf8_ascii_catn : uni2utf8_ascii_catn;
     } else {
         /* A truly table-based converter may never convert from Unicode
          * to its charmap. This has been implicitly assumed in the existing
          * code, but let's be explicit here. */
         assert(to_uni);
         rock->f = table2uni;
+        rock->asciicatn =
+            strcmp(chartables_charset_table[s->num].name, "us-ascii") ?
+            NULL : table_ascii_catn;
     }
     s->bytesleft = 0;
     s->codepoint = 0;
@@ -1702,6 +2005,7 @@ static struct convert_rock *qp_init(int isheader, struct convert_rock *next)
     s->isheader = isheader;
     rock->state = (void *)s;
     rock->f = qp2byte;
+    rock->asciicatn = qp_ascii_catn;
     rock->flush = qp_flush;
     rock->next = next;
     return rock;
@@ -1712,6 +2016,7 @@ static struct convert_rock *b64_init(struct convert_rock *next)
     struct convert_rock *rock = xzmalloc(sizeof(struct convert_rock));
     rock->state = xzmalloc(sizeof(struct b64_state));
     rock->f = b64_2byte;
+    rock->asciicatn = b64_ascii_catn;
     rock->next = next;
     return rock;
 }
@@ -1734,8 +2039,11 @@ static struct convert_rock *canon_init(int flags, struct convert_rock *next)
     s->flags = flags;
     if ((flags & CHARSET_SNIPPET))
         rock->f = uni2html;
-    else
+    else {
         rock->f = uni2searchform;
+        if (!searchform_identity_set) searchform_identity_init();
+        rock->asciicatn = searchform_ascii_catn;
+    }
     rock->state = s;
     rock->next = next;
     return rock;
@@ -1774,6 +2082,7 @@ static struct convert_rock *search_init(const char *substr, comp_pat *pat) {
     s->max_start = p->max_start;
     s->patlen = p->patlen;
     s->substr = (unsigned char *)substr;
+    s->shift = p->shift;
 
     /* allocate tracking space and initialise to "no match" */
     s->starts = xmalloc(s->max_start * sizeof(s->starts[0]));
@@ -1783,6 +2092,7 @@ static struct convert_rock *search_init(const char *substr, comp_pat *pat) {
 
     /* set up the rock */
     rock->f = byte2search;
+    rock->asciicatn = search_ascii_catn;
     rock->cleanup = search_free;
     rock->state = (void *)s;
 
@@ -1795,6 +2105,7 @@ static struct convert_rock *buffer_init(void)
     struct buf *buf = xzmalloc(sizeof(struct buf));
 
     rock->f = byte2buffer;
+    rock->asciicatn = buffer_ascii_catn;
     rock->cleanup = buffer_free;
     rock->state = (void *)buf;
 
@@ -2379,12 +2690,18 @@ EXPORTED comp_pat *charset_compilepat(const char *s)
 {
     struct comp_pat_s *pat = xzmalloc(sizeof(struct comp_pat_s));
     const char *p = s;
+    size_t i;
     /* count occurances */
     while (*p) {
         if (*p == *s) pat->max_start++;
         pat->patlen++;
         p++;
     }
+    /* bad character shifts for the bulk Boyer-Moore-Horspool matcher */
+    for (i = 0; i < 256; i++)
+        pat->shift[i] = pat->patlen;
+    for (i = 0; pat->patlen && i < pat->patlen - 1; i++)
+        pat->shift[(unsigned char)s[i]] = pat->patlen - 1 - i;
     return (comp_pat *)pat;
 }
 
@@ -2424,10 +2741,13 @@ EXPORTED int charset_searchstring(const char *substr, comp_pat *pat,
     input = canon_init(flags, input);
     input = convert_init(utf8from, 1/*to_uni*/, len, input);
 
-    /* feed the handler */
-    while (len-- > 0) {
-        convert_putc(input, (unsigned char)*s++);
-        if (search_havematch(tosearch)) break; /* shortcut if there's a match */
+    /* feed the handler in chunks so ASCII runs take the bulk path,
+     * still shortcutting between chunks if there's a match */
+    while (len > 0 && !search_havematch(tosearch)) {
+        size_t n = len > CHARSET_SEARCH_CHUNKSZ ? CHARSET_SEARCH_CHUNKSZ : len;
+        convert_feed(input, s, n);
+        s += n;
+        len -= n;
     }
 
     /* copy the value */
@@ -2494,10 +2814,13 @@ EXPORTED int charset_searchfile(const char *substr, comp_pat *pat,
         return 0;
     }
 
-    /* implement the loop here so we can check on the search each time */
-    for (i = 0; i < len; i++) {
-        convert_putc(input, (unsigned char)msg_base[i]);
-        if (search_havematch(tosearch)) break;
+    /* implement the loop here so we can check on the search between
+     * chunks; chunked feeding lets ASCII runs take the bulk path */
+    for (i = 0; i < len && !search_havematch(tosearch);
+         i += CHARSET_SEARCH_CHUNKSZ) {
+        size_t n = len - i;
+        if (n > CHARSET_SEARCH_CHUNKSZ) n = CHARSET_SEARCH_CHUNKSZ;
+        convert_feed(input, msg_base + i, n);
     }
 
     res = search_havematch(tosearch); /* copy before we free it */
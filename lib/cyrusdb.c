@@ -60,19 +60,25 @@
 #include "xmalloc.h"
 #include "xstrlcpy.h"
 
+EXPORTED uint64_t cyrusdb_ops = 0;
+
 /* Note that some of these may be undefined symbols
  * if libcyrus was not built with support for them */
+extern struct cyrusdb_backend cyrusdb_cache;
 extern struct cyrusdb_backend cyrusdb_flat;
 extern struct cyrusdb_backend cyrusdb_skiplist;
 extern struct cyrusdb_backend cyrusdb_quotalegacy;
+extern struct cyrusdb_backend cyrusdb_sharded;
 extern struct cyrusdb_backend cyrusdb_sql;
 extern struct cyrusdb_backend cyrusdb_twoskip;
 extern struct cyrusdb_backend cyrusdb_lmdb;
 
 static struct cyrusdb_backend *_backends[] = {
+    &cyrusdb_cache,
     &cyrusdb_flat,
     &cyrusdb_skiplist,
     &cyrusdb_quotalegacy,
+    &cyrusdb_sharded,
 #if defined USE_CYRUSDB_SQL
     &cyrusdb_sql,
 #endif
@@ -200,6 +206,7 @@ EXPORTED int cyrusdb_fetch(struct db *db,
              const char **data, size_t *datalen,
              struct txn **mytid)
 {
+    cyrusdb_ops++;
     if (!db->backend->fetch)
         return CYRUSDB_NOTIMPLEMENTED;
     return db->backend->fetch(db->engine, key, keylen,
@@ -211,6 +218,7 @@ EXPORTED int cyrusdb_fetchlock(struct db *db,
                  const char **data, size_t *datalen,
                  struct txn **mytid)
 {
+    cyrusdb_ops++;
     if (!db->backend->fetchlock)
         return CYRUSDB_NOTIMPLEMENTED;
     return db->backend->fetchlock(db->engine, key, keylen,
@@ -223,6 +231,7 @@ EXPORTED int cyrusdb_fetchnext(struct db *db,
                  const char **data, size_t *datalen,
                  struct txn **mytid)
 {
+    cyrusdb_ops++;
     if (!db->backend->fetchnext)
         return CYRUSDB_NOTIMPLEMENTED;
     return db->backend->fetchnext(db->engine, key, keylen,
@@ -230,12 +239,128 @@ EXPORTED int cyrusdb_fetchnext(struct db *db,
                                   data, datalen, mytid);
 }
 
+/* pull-style iteration, built on fetchnext.  The cursor remembers its
+ * position in a single reused buffer, so stepping a range allocates
+ * nothing per record - unlike foreach, where callers have to copy keys
+ * and values out before doing anything else with the database */
+struct cyrusdb_cursor {
+    struct db *db;
+    struct txn **tidptr;
+    struct buf prefix;
+    struct buf pos;     /* last key returned */
+    int first;
+    int done;
+};
+
+EXPORTED int cyrusdb_cursor_open(struct db *db,
+                 const char *prefix, size_t prefixlen,
+                 struct txn **mytid,
+                 struct cyrusdb_cursor **cursorp)
+{
+    struct cyrusdb_cursor *cursor;
+
+    if (prefixlen) assert(prefix);
+
+    if (!db->backend->fetchnext)
+        return CYRUSDB_NOTIMPLEMENTED;
+
+    cursor = xzmalloc(sizeof(struct cyrusdb_cursor));
+    cursor->db = db;
+    cursor->tidptr = mytid;
+    if (prefixlen) buf_setmap(&cursor->prefix, prefix, prefixlen);
+    cursor->first = 1;
+
+    *cursorp = cursor;
+
+    return 0;
+}
+
+EXPORTED int cyrusdb_cursor_next(struct cyrusdb_cursor *cursor,
+                 const char **keyp, size_t *keylenp,
+                 const char **datap, size_t *datalenp)
+{
+    struct db *db = cursor->db;
+    const char *key;
+    size_t keylen;
+    int r;
+
+    if (cursor->done) return CYRUSDB_NOTFOUND;
+
+    if (cursor->first) {
+        cursor->first = 0;
+
+        /* fetchnext is exclusive, so the prefix itself needs an
+         * exact fetch first */
+        if (cursor->prefix.len) {
+            r = cyrusdb_fetch(db, cursor->prefix.s, cursor->prefix.len,
+                              datap, datalenp, cursor->tidptr);
+            if (!r) {
+                buf_copy(&cursor->pos, &cursor->prefix);
+                *keyp = cursor->pos.s;
+                *keylenp = cursor->pos.len;
+                return 0;
+            }
+            if (r != CYRUSDB_NOTFOUND) goto fail;
+        }
+
+        r = cyrusdb_fetchnext(db, cursor->prefix.s, cursor->prefix.len,
+                              &key, &keylen, datap, datalenp,
+                              cursor->tidptr);
+    }
+    else {
+        r = cyrusdb_fetchnext(db, cursor->pos.s, cursor->pos.len,
+                              &key, &keylen, datap, datalenp,
+                              cursor->tidptr);
+    }
+
+    if (r == CYRUSDB_NOTFOUND) {
+        cursor->done = 1;
+        return r;
+    }
+    if (r) goto fail;
+
+    /* off the end of the range? */
+    if (cursor->prefix.len &&
+        (keylen < cursor->prefix.len ||
+         memcmp(key, cursor->prefix.s, cursor->prefix.len))) {
+        cursor->done = 1;
+        return CYRUSDB_NOTFOUND;
+    }
+
+    /* hold our position in the reused buffer - the backend's pointer
+     * is only valid until the next database operation */
+    buf_setmap(&cursor->pos, key, keylen);
+    *keyp = cursor->pos.s;
+    *keylenp = cursor->pos.len;
+
+    return 0;
+
+fail:
+    cursor->done = 1;
+    return r;
+}
+
+EXPORTED int cyrusdb_cursor_close(struct cyrusdb_cursor **cursorp)
+{
+    struct cyrusdb_cursor *cursor = *cursorp;
+
+    if (!cursor) return 0;
+
+    buf_free(&cursor->prefix);
+    buf_free(&cursor->pos);
+    free(cursor);
+    *cursorp = NULL;
+
+    return 0;
+}
+
 EXPORTED int cyrusdb_foreach(struct db *db,
                const char *prefix, size_t prefixlen,
                foreach_p *p,
                foreach_cb *cb, void *rock,
                struct txn **tid)
 {
+    cyrusdb_ops++;
     if (!db->backend->foreach)
         return CYRUSDB_NOTIMPLEMENTED;
     return db->backend->foreach(db->engine, prefix, prefixlen,
@@ -264,6 +389,7 @@ EXPORTED int cyrusdb_create(struct db *db,
               const char *data, size_t datalen,
               struct txn **tid)
 {
+    cyrusdb_ops++;
     if (!db->backend->create)
         return CYRUSDB_NOTIMPLEMENTED;
     return db->backend->create(db->engine, key, keylen, data, datalen, tid);
@@ -274,15 +400,55 @@ EXPORTED int cyrusdb_store(struct db *db,
              const char *data, size_t datalen,
              struct txn **tid)
 {
+    cyrusdb_ops++;
     if (!db->backend->store)
         return CYRUSDB_NOTIMPLEMENTED;
     return db->backend->store(db->engine, key, keylen, data, datalen, tid);
 }
 
+EXPORTED int cyrusdb_storev(struct db *db,
+              const struct cyrusdb_keyvalue *kv, size_t nkv,
+              struct txn **tid)
+{
+    struct txn *localtid = NULL;
+    size_t i;
+    int r = 0;
+
+    cyrusdb_ops++;
+
+    if (db->backend->storev)
+        return db->backend->storev(db->engine, kv, nkv, tid);
+
+    if (!db->backend->store || !db->backend->delete)
+        return CYRUSDB_NOTIMPLEMENTED;
+
+    /* fall back to applying the entries one at a time within a
+     * single transaction, so the batch still commits atomically */
+    if (!tid) tid = &localtid;
+
+    for (i = 0; i < nkv; i++) {
+        if (kv[i].data)
+            r = db->backend->store(db->engine, kv[i].key, kv[i].keylen,
+                                   kv[i].data, kv[i].datalen, tid);
+        else
+            r = db->backend->delete(db->engine, kv[i].key, kv[i].keylen,
+                                    tid, /*force*/1);
+        if (r) break;
+    }
+
+    if (localtid) {
+        if (r) cyrusdb_abort(db, localtid);
+        else r = cyrusdb_commit(db, localtid);
+    }
+
+    return r;
+}
+
 EXPORTED int cyrusdb_delete(struct db *db,
               const char *key, size_t keylen,
               struct txn **tid, int force)
 {
+    cyrusdb_ops++;
     if (!db->backend->delete)
         return CYRUSDB_NOTIMPLEMENTED;
     return db->backend->delete(db->engine, key, keylen, tid, force);
@@ -376,14 +542,36 @@ static int delete_cb(void *rock,
     return cyrusdb_delete(cr->db, key, keylen, cr->tid, 1);
 }
 
+/* Dump format is one "key TAB value NL" line per record.  Bytes which
+ * would break that framing (and backslash, so the escapes themselves
+ * round-trip) are written as C-style escapes; cyrusdb_undumpfile()
+ * reverses them. */
+static void print_escaped(FILE *f, const char *s, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        switch (s[i]) {
+        case '\0': fputs("\\0", f); break;
+        case '\t': fputs("\\t", f); break;
+        case '\n': fputs("\\n", f); break;
+        case '\r': fputs("\\r", f); break;
+        case '\\': fputs("\\\\", f); break;
+        default: fputc(s[i], f); break;
+        }
+    }
+}
+
 static int print_cb(void *rock,
                     const char *key, size_t keylen,
                     const char *data, size_t datalen)
 {
     FILE *f = (FILE *)rock;
 
-    /* XXX: improve binary safety */
-    fprintf(f, "%.*s\t%.*s\n", (int)keylen, key, (int)datalen, data);
+    print_escaped(f, key, keylen);
+    fputc('\t', f);
+    print_escaped(f, data, datalen);
+    fputc('\n', f);
 
     return 0;
 }
@@ -408,11 +596,41 @@ EXPORTED int cyrusdb_truncate(struct db *db,
     return cyrusdb_foreach(db, "", 0, NULL, delete_cb, &tr, tid);
 }
 
+/* Reverse the escaping done by print_escaped().  An unrecognised
+ * escape is passed through untouched, which also keeps old dumps
+ * (which never escaped anything) loading correctly. */
+static void undump_unescape(struct buf *out, const char *s, size_t len)
+{
+    size_t i;
+
+    buf_reset(out);
+    for (i = 0; i < len; i++) {
+        if (s[i] == '\\' && i+1 < len) {
+            switch (s[++i]) {
+            case '0': buf_putc(out, '\0'); break;
+            case 't': buf_putc(out, '\t'); break;
+            case 'n': buf_putc(out, '\n'); break;
+            case 'r': buf_putc(out, '\r'); break;
+            case '\\': buf_putc(out, '\\'); break;
+            default:
+                buf_putc(out, '\\');
+                buf_putc(out, s[i]);
+                break;
+            }
+        }
+        else {
+            buf_putc(out, s[i]);
+        }
+    }
+}
+
 EXPORTED int cyrusdb_undumpfile(struct db *db,
                                 FILE *f,
                                 struct txn **tid)
 {
     struct buf line = BUF_INITIALIZER;
+    struct buf key = BUF_INITIALIZER;
+    struct buf val = BUF_INITIALIZER;
     const char *tab;
     const char *str;
     int r = 0;
@@ -424,11 +642,13 @@ EXPORTED int cyrusdb_undumpfile(struct db *db,
         /* skip comments */
         if (str[0] == '#') continue;
 
+        /* escaped tabs never match here, only the separator does */
         tab = strchr(str, '\t');
 
         /* deletion (no value) */
         if (!tab) {
-            r = cyrusdb_delete(db, str, line.len, tid, 1);
+            undump_unescape(&key, str, line.len);
+            r = cyrusdb_delete(db, key.s, key.len, tid, 1);
             if (r) goto out;
         }
 
@@ -436,13 +656,17 @@ EXPORTED int cyrusdb_undumpfile(struct db *db,
         else {
             unsigned klen = (tab - str);
             unsigned vlen = line.len - klen - 1; /* TAB */
-            r = cyrusdb_store(db, str, klen, tab + 1, vlen, tid);
+            undump_unescape(&key, str, klen);
+            undump_unescape(&val, tab + 1, vlen);
+            r = cyrusdb_store(db, key.s, key.len, val.s, val.len, tid);
             if (r) goto out;
         }
     }
 
   out:
     buf_free(&line);
+    buf_free(&key);
+    buf_free(&val);
     return r;
 }
 
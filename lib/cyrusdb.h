@@ -43,11 +43,16 @@
 #define INCLUDED_CYRUSDB_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include "strarray.h"
 
 struct db;
 struct txn;
 
+/* running count of data operations issued through the cyrusdb
+ * wrappers, for per-command resource accounting */
+extern uint64_t cyrusdb_ops;
+
 enum cyrusdb_ret {
     CYRUSDB_OK = 0,
     CYRUSDB_DONE = 1,
@@ -89,6 +94,16 @@ typedef int foreach_cb(void *rock,
 typedef int cyrusdb_archiver(const strarray_t *fnames,
                              const char *dirname);
 
+/* a single update for a batched store.  data == NULL deletes the key
+ * (ignoring not found errors); a non-NULL data with datalen == 0
+ * stores a zero-length record, as store() does */
+struct cyrusdb_keyvalue {
+    const char *key;
+    size_t keylen;
+    const char *data;
+    size_t datalen;
+};
+
 struct dbengine;
 
 struct cyrusdb_backend {
@@ -219,6 +234,14 @@ struct cyrusdb_backend {
     int (*repack)(struct dbengine *db);
     int (*compar)(struct dbengine *db, const char *s1, int l1,
                   const char *s2, int l2);
+
+    /* Apply a whole batch of updates in one call, under a single lock
+     * acquisition.  Optional (and deliberately last, so backends using
+     * positional initializers get NULL): cyrusdb_storev() falls back
+     * to one store()/delete() per entry in a single transaction. */
+    int (*storev)(struct dbengine *db,
+                  const struct cyrusdb_keyvalue *kv, size_t nkv,
+                  struct txn **tid);
 };
 
 extern int cyrusdb_copyfile(const char *srcname, const char *dstname);
@@ -264,6 +287,30 @@ extern int cyrusdb_fetchnext(struct db *db,
                              const char **found, size_t *foundlen,
                              const char **data, size_t *datalen,
                              struct txn **mytid);
+
+/* pull-style iteration over a prefix range, as an alternative to the
+   foreach callback model.  cursor_next returns one record per call and
+   CYRUSDB_NOTFOUND once the range is exhausted, so callers can stop,
+   batch or interleave other work without copying records out.
+
+   The returned key is valid until the next cursor_next/cursor_close;
+   the returned data is a view into the backend's internal buffer and
+   is only valid until the next operation on the database, like fetch.
+   Writes to the database below the cursor position are skipped, like
+   foreach.  Only available on backends with fetchnext support (see
+   cyrusdb_canfetchnext); cursor_open returns CYRUSDB_NOTIMPLEMENTED
+   otherwise. */
+struct cyrusdb_cursor;
+
+extern int cyrusdb_cursor_open(struct db *db,
+                               const char *prefix, size_t prefixlen,
+                               struct txn **mytid,
+                               struct cyrusdb_cursor **cursorp);
+extern int cyrusdb_cursor_next(struct cyrusdb_cursor *cursor,
+                               const char **keyp, size_t *keylenp,
+                               const char **datap, size_t *datalenp);
+extern int cyrusdb_cursor_close(struct cyrusdb_cursor **cursorp);
+
 extern int cyrusdb_foreach(struct db *db,
                            const char *prefix, size_t prefixlen,
                            foreach_p *p,
@@ -282,6 +329,9 @@ extern int cyrusdb_store(struct db *db,
                          const char *key, size_t keylen,
                          const char *data, size_t datalen,
                          struct txn **tid);
+extern int cyrusdb_storev(struct db *db,
+                          const struct cyrusdb_keyvalue *kv, size_t nkv,
+                          struct txn **tid);
 extern int cyrusdb_delete(struct db *db,
                           const char *key, size_t keylen,
                           struct txn **tid, int force);
@@ -0,0 +1,710 @@
+/* cyrusdb_cache: non-durable hash backend for regenerable data
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* A cache, not a database.  Records live in a fixed-size open-addressed
+ * hash table which is shared between processes through a writable
+ * MAP_SHARED mapping, and mutations go straight into the map under an
+ * fcntl lock - there is never an fsync, so a crash can lose or tear
+ * recent writes.  A per-slot crc means a torn slot just reads as empty.
+ *
+ * This makes it only suitable for data which can be recomputed on a
+ * miss (e.g. statuscache.db).  The other ways it earns its speed:
+ *
+ *  - a full slot window is resolved by EVICTION, not chaining
+ *  - records larger than a slot are silently not stored
+ *  - abort is the same as commit: writes are never rolled back
+ *  - foreach walks slot order, not key order
+ *
+ * All of these are fine for a cache (a lost record is just a miss) and
+ * none of them are fine for real data, so don't list this backend as an
+ * option for anything which can't be regenerated.
+ */
+
+#include <config.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+
+#include "assert.h"
+#include "bsearch.h"
+#include "crc32.h"
+#include "cyrusdb.h"
+#include "cyr_lock.h"
+#include "exitcodes.h"
+#include "murmurhash2.h"
+#include "retry.h"
+#include "util.h"
+#include "xmalloc.h"
+
+/* on-disk geometry.  The file is created sparse at full size, so a
+ * mostly-empty cache costs little real storage */
+#define HEADER_MAGIC ("\241\002\213\015cyrus cache\0\0\0\0\0")
+#define HEADER_MAGIC_SIZE (20)
+#define HEADER_SIZE 64
+#define OFFSET_VERSION 20
+#define OFFSET_NSLOTS 24
+#define VERSION 1
+
+#define SLOT_SIZE 256
+/* crc32(4) keylen(2) datalen(2) */
+#define SLOT_HEAD 8
+#define SLOT_ROOM (SLOT_SIZE - SLOT_HEAD)
+
+/* how many consecutive slots a record may land in.  Once the window is
+ * full, a new record evicts the first slot in its window */
+#define PROBE_WINDOW 8
+
+/* default table size for newly created files - the geometry of an
+ * existing file always comes from its header */
+#define DEFAULT_NSLOTS 65536
+
+struct dbengine {
+    char *fname;
+    int fd;
+    char *base;
+    size_t size;
+    uint32_t nslots;
+    int is_locked;
+
+    /* compar is only advisory here (the table is unordered), but
+     * consumers may ask for it via cyrusdb_compar */
+    int (*compar)(const char *s1, int l1, const char *s2, int l2);
+
+    /* fetch results are copied out of the map, so they stay valid
+     * after the lock is dropped */
+    struct buf data;
+    struct buf key;
+};
+
+struct txn {
+    int dummy;
+};
+
+#define SLOTPTR(db, n) ((db)->base + HEADER_SIZE + ((size_t)(n)) * SLOT_SIZE)
+
+/* slot accessors.  Lengths are stored in network order to match the
+ * other file-backed backends; the crc covers lengths, key and data */
+static unsigned slot_keylen(const char *slot)
+{
+    uint16_t num;
+    memcpy(&num, slot + 4, 2);
+    return ntohs(num);
+}
+
+static unsigned slot_datalen(const char *slot)
+{
+    uint16_t num;
+    memcpy(&num, slot + 6, 2);
+    return ntohs(num);
+}
+
+static int slot_isvalid(const char *slot)
+{
+    unsigned keylen = slot_keylen(slot);
+    unsigned datalen = slot_datalen(slot);
+    uint32_t crc;
+
+    if (!keylen) return 0; /* empty */
+    if (keylen + datalen > SLOT_ROOM) return 0;
+
+    memcpy(&crc, slot, 4);
+
+    return crc32_map(slot + 4, 4 + keylen + datalen) == ntohl(crc);
+}
+
+static void slot_write(char *slot, const char *key, size_t keylen,
+                       const char *data, size_t datalen)
+{
+    uint16_t num;
+    uint32_t crc;
+
+    num = htons(keylen);
+    memcpy(slot + 4, &num, 2);
+    num = htons(datalen);
+    memcpy(slot + 6, &num, 2);
+    memcpy(slot + SLOT_HEAD, key, keylen);
+    if (datalen) memcpy(slot + SLOT_HEAD + keylen, data, datalen);
+
+    /* crc last, so a torn write reads as an invalid slot */
+    crc = htonl(crc32_map(slot + 4, 4 + keylen + datalen));
+    memcpy(slot, &crc, 4);
+}
+
+static void slot_clear(char *slot)
+{
+    memset(slot, 0, SLOT_HEAD);
+}
+
+/* find the slot holding this key, or NULL.  Must hold the lock */
+static char *find_slot(struct dbengine *db, const char *key, size_t keylen)
+{
+    uint32_t hash = murmurhash2(key, keylen, 0);
+    unsigned i;
+
+    for (i = 0; i < PROBE_WINDOW; i++) {
+        char *slot = SLOTPTR(db, (hash + i) % db->nslots);
+
+        if (!slot_isvalid(slot)) continue;
+        if (slot_keylen(slot) != keylen) continue;
+        if (memcmp(slot + SLOT_HEAD, key, keylen)) continue;
+
+        return slot;
+    }
+
+    return NULL;
+}
+
+/* find somewhere to put this key: its existing slot, else an empty
+ * slot in the window, else evict the first slot.  Must hold the lock */
+static char *place_slot(struct dbengine *db, const char *key, size_t keylen)
+{
+    uint32_t hash = murmurhash2(key, keylen, 0);
+    char *empty = NULL;
+    unsigned i;
+
+    for (i = 0; i < PROBE_WINDOW; i++) {
+        char *slot = SLOTPTR(db, (hash + i) % db->nslots);
+
+        if (!slot_isvalid(slot)) {
+            if (!empty) empty = slot;
+            continue;
+        }
+        if (slot_keylen(slot) != keylen) continue;
+        if (memcmp(slot + SLOT_HEAD, key, keylen)) continue;
+
+        return slot;
+    }
+
+    if (empty) return empty;
+
+    return SLOTPTR(db, hash % db->nslots);
+}
+
+static int lock_db(struct dbengine *db, int ex)
+{
+    int r;
+
+    assert(!db->is_locked);
+
+    r = lock_setlock(db->fd, ex, /*nonblocking*/0, db->fname);
+    if (r) {
+        syslog(LOG_ERR, "IOERROR: locking %s: %m", db->fname);
+        return CYRUSDB_IOERROR;
+    }
+
+    db->is_locked = 1;
+
+    return 0;
+}
+
+static void unlock_db(struct dbengine *db)
+{
+    assert(db->is_locked);
+
+    lock_unlock(db->fd, db->fname);
+    db->is_locked = 0;
+}
+
+/* a transaction is just holding the exclusive lock until commit, so a
+ * batch of writes pays for one lock round-trip.  There's no rollback */
+static int newtxn(struct dbengine *db, struct txn **tidptr)
+{
+    int r;
+
+    r = lock_db(db, /*ex*/1);
+    if (r) return r;
+
+    *tidptr = xzmalloc(sizeof(struct txn));
+
+    return 0;
+}
+
+/* (re)write an empty table.  Must hold the exclusive lock */
+static int init_file(struct dbengine *db)
+{
+    char header[HEADER_SIZE];
+    uint32_t num;
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, HEADER_MAGIC, HEADER_MAGIC_SIZE);
+    num = htonl(VERSION);
+    memcpy(header + OFFSET_VERSION, &num, 4);
+    num = htonl(DEFAULT_NSLOTS);
+    memcpy(header + OFFSET_NSLOTS, &num, 4);
+
+    if (ftruncate(db->fd, 0) < 0) {
+        syslog(LOG_ERR, "IOERROR: truncating %s: %m", db->fname);
+        return CYRUSDB_IOERROR;
+    }
+
+    if (retry_write(db->fd, header, HEADER_SIZE) < 0) {
+        syslog(LOG_ERR, "IOERROR: writing header for %s: %m", db->fname);
+        return CYRUSDB_IOERROR;
+    }
+
+    /* sparse - slots fill in as they're used */
+    if (ftruncate(db->fd, HEADER_SIZE +
+                          (off_t)DEFAULT_NSLOTS * SLOT_SIZE) < 0) {
+        syslog(LOG_ERR, "IOERROR: extending %s: %m", db->fname);
+        return CYRUSDB_IOERROR;
+    }
+
+    return 0;
+}
+
+/* check the header and learn the geometry.  Returns nonzero if the
+ * file needs to be (re)initialised */
+static int read_header(struct dbengine *db)
+{
+    struct stat sbuf;
+    uint32_t num;
+
+    if (fstat(db->fd, &sbuf) < 0) return 1;
+    if (sbuf.st_size < HEADER_SIZE) return 1;
+    if (memcmp(db->base, HEADER_MAGIC, HEADER_MAGIC_SIZE)) return 1;
+
+    memcpy(&num, db->base + OFFSET_VERSION, 4);
+    if (ntohl(num) != VERSION) return 1;
+
+    memcpy(&num, db->base + OFFSET_NSLOTS, 4);
+    if (!ntohl(num)) return 1;
+    if ((size_t)sbuf.st_size !=
+        HEADER_SIZE + (size_t)ntohl(num) * SLOT_SIZE) return 1;
+
+    db->nslots = ntohl(num);
+    db->size = sbuf.st_size;
+
+    return 0;
+}
+
+static void map_db(struct dbengine *db)
+{
+    if (db->base) munmap(db->base, db->size);
+
+    /* a writable shared mapping - every process sees stores as they
+     * happen, and nothing ever forces the pages to stable storage.
+     * map_refresh() is read-only, so this backend maps by hand */
+    db->base = mmap(NULL, db->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    db->fd, 0L);
+    if (db->base == MAP_FAILED)
+        fatal("failed to mmap cache db file", EC_IOERR);
+}
+
+static void dispose_db(struct dbengine *db)
+{
+    if (!db) return;
+
+    if (db->base && db->base != MAP_FAILED) munmap(db->base, db->size);
+    if (db->fd >= 0) {
+        if (db->is_locked) unlock_db(db);
+        close(db->fd);
+    }
+    buf_free(&db->data);
+    buf_free(&db->key);
+    free(db->fname);
+    free(db);
+}
+
+static int myopen(const char *fname, int flags, struct dbengine **ret,
+                  struct txn **mytid)
+{
+    struct dbengine *db;
+    struct stat sbuf;
+    int r;
+
+    assert(fname);
+    assert(ret);
+
+    db = (struct dbengine *) xzmalloc(sizeof(struct dbengine));
+    db->fname = xstrdup(fname);
+    db->compar = (flags & CYRUSDB_MBOXSORT) ? bsearch_ncompare_mbox
+                                            : bsearch_ncompare_raw;
+
+    db->fd = open(fname, O_RDWR | ((flags & CYRUSDB_CREATE) ? O_CREAT : 0),
+                  0644);
+    if (db->fd < 0) {
+        if (errno == ENOENT) r = CYRUSDB_NOTFOUND;
+        else {
+            syslog(LOG_ERR, "IOERROR: opening %s: %m", fname);
+            r = CYRUSDB_IOERROR;
+        }
+        goto err;
+    }
+
+    if (fstat(db->fd, &sbuf) < 0) {
+        syslog(LOG_ERR, "IOERROR: fstat %s: %m", fname);
+        r = CYRUSDB_IOERROR;
+        goto err;
+    }
+    db->size = sbuf.st_size;
+    if (db->size) map_db(db);
+
+    if (read_header(db)) {
+        /* new, damaged or differently-sized file - since the contents
+         * are disposable, just start again with an empty table */
+        r = lock_db(db, /*ex*/1);
+        if (r) goto err;
+
+        /* maybe another opener got in first */
+        if (read_header(db)) {
+            r = init_file(db);
+            if (r) {
+                unlock_db(db);
+                goto err;
+            }
+            if (read_header(db)) {
+                unlock_db(db);
+                r = CYRUSDB_IOERROR;
+                goto err;
+            }
+        }
+        map_db(db);
+
+        unlock_db(db);
+    }
+
+    *ret = db;
+
+    if (mytid) {
+        r = newtxn(db, mytid);
+        if (r) goto err;
+    }
+
+    return 0;
+
+err:
+    dispose_db(db);
+    return r;
+}
+
+static int myclose(struct dbengine *db)
+{
+    assert(db);
+
+    dispose_db(db);
+
+    return 0;
+}
+
+static int myfetch(struct dbengine *db,
+                   const char *key, size_t keylen,
+                   const char **data, size_t *datalen,
+                   struct txn **tidptr)
+{
+    const char *slot;
+    int need_unlock = 0;
+    int r = 0;
+
+    assert(db);
+    assert(key && keylen);
+
+    if (datalen) assert(data);
+
+    if (data) *data = NULL;
+    if (datalen) *datalen = 0;
+
+    if (tidptr) {
+        if (!*tidptr) {
+            r = newtxn(db, tidptr);
+            if (r) return r;
+        }
+    }
+    else {
+        r = lock_db(db, /*ex*/0);
+        if (r) return r;
+        need_unlock = 1;
+    }
+
+    slot = find_slot(db, key, keylen);
+
+    if (slot) {
+        if (data) {
+            /* copy the value out, so it survives the unlock */
+            buf_setmap(&db->data, slot + SLOT_HEAD + keylen,
+                       slot_datalen(slot));
+            *data = db->data.s ? db->data.s : "";
+            if (datalen) *datalen = db->data.len;
+        }
+    }
+    else {
+        r = CYRUSDB_NOTFOUND;
+    }
+
+    if (need_unlock) unlock_db(db);
+
+    return r;
+}
+
+static int myforeach(struct dbengine *db,
+                     const char *prefix, size_t prefixlen,
+                     foreach_p *goodp,
+                     foreach_cb *cb, void *rock,
+                     struct txn **tidptr)
+{
+    int need_unlock = 0;
+    uint32_t n;
+    int r = 0, cb_r = 0;
+
+    assert(db);
+    assert(cb);
+    if (prefixlen) assert(prefix);
+
+    if (tidptr) {
+        if (!*tidptr) {
+            r = newtxn(db, tidptr);
+            if (r) return r;
+        }
+    }
+    else {
+        r = lock_db(db, /*ex*/0);
+        if (r) return r;
+        need_unlock = 1;
+    }
+
+    /* slot order, not key order - cache consumers only use foreach to
+     * find and invalidate entries, so ordering doesn't matter */
+    for (n = 0; n < db->nslots; n++) {
+        const char *slot = SLOTPTR(db, n);
+        unsigned keylen, datalen;
+
+        if (!slot_isvalid(slot)) continue;
+
+        keylen = slot_keylen(slot);
+        datalen = slot_datalen(slot);
+
+        if (prefixlen) {
+            if (keylen < prefixlen) continue;
+            if (db->compar(slot + SLOT_HEAD, prefixlen, prefix, prefixlen))
+                continue;
+        }
+
+        /* copy out, so the callback can safely write to this db */
+        buf_setmap(&db->key, slot + SLOT_HEAD, keylen);
+        buf_setmap(&db->data, slot + SLOT_HEAD + keylen, datalen);
+
+        if (goodp && !goodp(rock, db->key.s, db->key.len,
+                                  db->data.s, db->data.len))
+            continue;
+
+        if (need_unlock) {
+            /* release around the callback, like the other backends */
+            unlock_db(db);
+            need_unlock = 0;
+        }
+
+        cb_r = cb(rock, db->key.s, db->key.len, db->data.s, db->data.len);
+        if (cb_r) break;
+
+        if (!tidptr) {
+            r = lock_db(db, /*ex*/0);
+            if (r) return r;
+            need_unlock = 1;
+        }
+    }
+
+    if (need_unlock) unlock_db(db);
+
+    return r ? r : cb_r;
+}
+
+static int skipwrite(struct dbengine *db,
+                     const char *key, size_t keylen,
+                     const char *data, size_t datalen,
+                     int force)
+{
+    char *slot;
+
+    if (keylen + datalen > SLOT_ROOM) {
+        /* won't fit - a cache is allowed to just not keep it */
+        syslog(LOG_DEBUG, "cyrusdb_cache: not storing oversized record "
+               "(%llu bytes) in %s",
+               (unsigned long long)(keylen + datalen), db->fname);
+        return 0;
+    }
+
+    if (!data) {
+        /* delete */
+        slot = find_slot(db, key, keylen);
+        if (!slot) return force ? 0 : CYRUSDB_NOTFOUND;
+        slot_clear(slot);
+        return 0;
+    }
+
+    slot = place_slot(db, key, keylen);
+
+    if (!force && slot_isvalid(slot)
+        && slot_keylen(slot) == keylen
+        && !memcmp(slot + SLOT_HEAD, key, keylen))
+        return CYRUSDB_EXISTS;
+
+    slot_write(slot, key, keylen, data, datalen);
+
+    return 0;
+}
+
+static int mystore(struct dbengine *db,
+                   const char *key, size_t keylen,
+                   const char *data, size_t datalen,
+                   struct txn **tidptr, int force)
+{
+    struct txn *localtid = NULL;
+    int r;
+
+    assert(db);
+    assert(key && keylen);
+
+    if (!tidptr) tidptr = &localtid;
+
+    if (!*tidptr) {
+        r = newtxn(db, tidptr);
+        if (r) return r;
+    }
+
+    r = skipwrite(db, key, keylen, data, datalen, force);
+
+    if (localtid) {
+        unlock_db(db);
+        free(localtid);
+    }
+
+    return r;
+}
+
+static int create(struct dbengine *db,
+                  const char *key, size_t keylen,
+                  const char *data, size_t datalen,
+                  struct txn **tidptr)
+{
+    if (datalen) assert(data);
+    return mystore(db, key, keylen, data ? data : "", datalen, tidptr, 0);
+}
+
+static int store(struct dbengine *db,
+                 const char *key, size_t keylen,
+                 const char *data, size_t datalen,
+                 struct txn **tidptr)
+{
+    if (datalen) assert(data);
+    return mystore(db, key, keylen, data ? data : "", datalen, tidptr, 1);
+}
+
+static int delete(struct dbengine *db,
+                  const char *key, size_t keylen,
+                  struct txn **tidptr, int force)
+{
+    return mystore(db, key, keylen, NULL, 0, tidptr, force);
+}
+
+static int commit_txn(struct dbengine *db, struct txn *tid)
+{
+    assert(db);
+    assert(tid);
+
+    /* the writes already happened - just let everyone else in */
+    unlock_db(db);
+    free(tid);
+
+    return 0;
+}
+
+static int abort_txn(struct dbengine *db, struct txn *tid)
+{
+    assert(db);
+    assert(tid);
+
+    /* no rollback: writes went straight into the map.  The worst case
+     * is a cache entry that shouldn't be there yet, which just costs a
+     * recompute when it's found to be wrong */
+    unlock_db(db);
+    free(tid);
+
+    return 0;
+}
+
+static int mycompar(struct dbengine *db,
+                    const char *a, int alen,
+                    const char *b, int blen)
+{
+    return db->compar(a, alen, b, blen);
+}
+
+HIDDEN struct cyrusdb_backend cyrusdb_cache =
+{
+    "cache",                    /* name */
+
+    &cyrusdb_generic_init,
+    &cyrusdb_generic_done,
+    &cyrusdb_generic_sync,
+    &cyrusdb_generic_noarchive,
+    &cyrusdb_generic_unlink,
+
+    &myopen,
+    &myclose,
+
+    &myfetch,
+    &myfetch,
+    NULL,
+
+    &myforeach,
+    &create,
+    &store,
+    &delete,
+
+    &commit_txn,
+    &abort_txn,
+
+    NULL,
+    NULL,
+    NULL,
+    &mycompar
+};
@@ -59,6 +59,7 @@
 #include "cyrusdb.h"
 #include "map.h"
 #include "bsearch.h"
+#include "libcyr_cfg.h"
 #include "cyr_lock.h"
 #include "retry.h"
 #include "util.h"
@@ -81,6 +82,15 @@ struct dbengine {
     size_t len;         /* mapped size */
 
     struct buf data;            /* returned storage for fetch */
+
+    /* optional read index: sorted offsets of each line start,
+     * built lazily on first access and thrown away whenever the
+     * file is replaced or changes size */
+    int use_index;
+    size_t *index;
+    int nindex;
+    ino_t index_ino;
+    size_t index_size;
 };
 #define DATA(db)        ((db)->data.s ? (db)->data.s : "")
 #define DATALEN(db)     ((db)->data.len)
@@ -162,6 +172,77 @@ static void decode(const char *ps, int len, struct buf *buf)
      * and so code that depends on it is quite broken anyway */
 }
 
+static void index_invalidate(struct dbengine *db)
+{
+    free(db->index);
+    db->index = NULL;
+    db->nindex = 0;
+}
+
+/* lazily build the line offset index over the current map.  the file
+ * itself is kept in sorted order, so the array is born sorted */
+static void index_build(struct dbengine *db)
+{
+    const char *p, *pend;
+    int n = 0, alloc;
+
+    if (db->index && db->index_ino == db->ino && db->index_size == db->size)
+        return;
+
+    index_invalidate(db);
+
+    alloc = 256;
+    db->index = (size_t *) xmalloc(alloc * sizeof(size_t));
+
+    pend = db->base + db->size;
+    for (p = db->base; p < pend; ) {
+        const char *eol = memchr(p, '\n', pend - p);
+        if (n == alloc) {
+            alloc *= 2;
+            db->index = (size_t *) xrealloc(db->index, alloc * sizeof(size_t));
+        }
+        db->index[n++] = p - db->base;
+        if (!eol) break;    /* no trailing newline: stop at the tail */
+        p = eol + 1;
+    }
+
+    db->nindex = n;
+    db->index_ino = db->ino;
+    db->index_size = db->size;
+}
+
+/* binary search the offset index for an encoded key.  Returns the
+ * offset of the first line whose key sorts >= 'key', with *len set
+ * to the length of that line (including the \n) on an exact match
+ * and 0 otherwise - the same contract as bsearch_mem_mbox() */
+static size_t index_seek(struct dbengine *db,
+                         const char *key, size_t keylen,
+                         unsigned long *len)
+{
+    int lo = 0, hi = db->nindex - 1;
+
+    *len = 0;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        size_t o = db->index[mid];
+        size_t oend = (mid+1 < db->nindex) ? db->index[mid+1] : db->size;
+        const char *line = db->base + o;
+        const char *tab = memchr(line, '\t', oend - o);
+        size_t linekeylen = tab ? (size_t)(tab - line) : oend - o;
+        int cmp = bsearch_ncompare_mbox(key, keylen, line, linekeylen);
+
+        if (!cmp) {
+            *len = oend - o;
+            return o;
+        }
+        if (cmp < 0) hi = mid - 1;
+        else lo = mid + 1;
+    }
+
+    return (lo < db->nindex) ? db->index[lo] : db->size;
+}
+
 /* other routines call this one when they fail */
 static int abort_txn(struct dbengine *db, struct txn *tid)
 {
@@ -208,6 +289,7 @@ static void free_db(struct dbengine *db)
 {
     if (db) {
         free(db->fname);
+        free(db->index);
         buf_free(&db->data);
         free(db);
     }
@@ -345,6 +427,7 @@ static int myopen(const char *fname, int flags, struct dbengine **ret, struct tx
 
     db->fname = xstrdup(fname);
     db->refcount = 1;
+    db->use_index = libcyrus_config_getswitch(CYRUSOPT_FLAT_INDEX);
 
     /* prepend to the list */
     db->next = alldbs;
@@ -405,7 +488,13 @@ static int myfetch(struct dbengine *db,
 
     encode(key, keylen, &keybuf);
 
-    offset = bsearch_mem_mbox(keybuf.s, db->base, db->size, 0, &len);
+    if (db->use_index) {
+        index_build(db);
+        offset = index_seek(db, keybuf.s, keybuf.len, &len);
+    }
+    else {
+        offset = bsearch_mem_mbox(keybuf.s, db->base, db->size, 0, &len);
+    }
 
     if (len) {
         if (data) {
@@ -527,7 +616,15 @@ static int foreach(struct dbengine *db,
 
     if (prefix) {
         encode(prefix, prefixlen, &prefixbuf);
-        offset = bsearch_mem_mbox(prefixbuf.s, dbbase, db->size, 0, &len);
+        if (db->use_index) {
+            /* 'dbbase' is a map of the same file content, so the
+             * offsets in the index apply to it too */
+            index_build(db);
+            offset = index_seek(db, prefixbuf.s, prefixbuf.len, &len);
+        }
+        else {
+            offset = bsearch_mem_mbox(prefixbuf.s, dbbase, db->size, 0, &len);
+        }
     }
     else {
         offset = 0;
@@ -715,6 +812,9 @@ static int mystore(struct dbengine *db,
         map_refresh(writefd, 0, &db->base, &db->len, sbuf.st_size,
                     fnamebuf, 0);
         db->size = sbuf.st_size;
+        /* the map now shows fname.NEW but db->ino still names the
+         * old file, so the staleness check can't catch this */
+        index_invalidate(db);
     } else {
         /* commit immediately */
         if (fsync(writefd) ||
@@ -0,0 +1,588 @@
+/*  cyrusdb_sharded: hash-sharded wrapper around twoskip databases
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* LAYOUT:
+ * A "database" is N separate twoskip files, "<fname>.0" .. "<fname>.N-1".
+ * Keys are assigned to a shard by hashing the "user part" of the key
+ * (e.g. "user.brong" from "user.brong.Trash", including any leading
+ * domain), so all of one user's records land in the same shard and a
+ * foreach scoped to a single user only ever touches one file.
+ *
+ * Unscoped foreach runs a sorted merge over per-shard fetchnext
+ * cursors, so callers still see keys in globally sorted order, but
+ * each shard is only read-locked for the duration of one cursor step.
+ *
+ * The shard count is fixed by whatever already exists on disk; the
+ * sharded_db_shards option only applies when creating a new database
+ * (use cvt_cyrusdb to change the count of an existing one).  Each
+ * shard is an ordinary twoskip file, so offline tools can process the
+ * shards of one database in parallel.
+ *
+ * Transactions lock shards independently.  A transaction which spans
+ * shards commits them one at a time, so it is only atomic per shard -
+ * the same property the per-file sub-transactions of quotalegacy have.
+ */
+
+#include <config.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "assert.h"
+#include "cyrusdb.h"
+#include "libcyr_cfg.h"
+#include "murmurhash2.h"
+#include "strarray.h"
+#include "util.h"
+#include "xmalloc.h"
+
+#define SHARD_BACKEND "twoskip"
+#define MAX_SHARDS 64
+
+struct dbengine {
+    int nshards;
+    struct db *shard[MAX_SHARDS];
+};
+
+/* each sub-transaction is started lazily, the first time its shard
+ * is touched */
+struct txn {
+    struct txn *sub[MAX_SHARDS];
+};
+
+static void shard_fname(struct buf *fn, const char *fname, int n)
+{
+    buf_reset(fn);
+    buf_printf(fn, "%s.%d", fname, n);
+}
+
+/* length of the shard-determining prefix of 'key':
+ *   "user.brong.Trash"             => "user.brong"
+ *   "example.com!user.brong.Trash" => "example.com!user.brong"
+ *   "shared.folder"                => "shared"
+ * or the whole key if there's no separator past the user part */
+static size_t shard_prefix_len(const char *key, size_t keylen)
+{
+    const char *start = key;
+    const char *end = key + keylen;
+    const char *p;
+
+    p = memchr(start, '!', end - start);
+    if (p) start = p + 1;
+
+    if ((size_t)(end - start) > 5 && !memcmp(start, "user.", 5))
+        start += 5;
+
+    p = memchr(start, '.', end - start);
+    if (!p) return keylen;
+
+    return p - key;
+}
+
+static unsigned shard_of(struct dbengine *db, const char *key, size_t keylen)
+{
+    size_t len = shard_prefix_len(key, keylen);
+
+    return murmurhash2(key, (int)len, 0) % (unsigned)db->nshards;
+}
+
+static struct txn **subtid(struct txn **tidptr, int n)
+{
+    if (!tidptr) return NULL;
+    if (!*tidptr) *tidptr = xzmalloc(sizeof(struct txn));
+    return &(*tidptr)->sub[n];
+}
+
+static int count_shards(const char *fname)
+{
+    struct buf fn = BUF_INITIALIZER;
+    struct stat sbuf;
+    int n;
+
+    for (n = 0; n < MAX_SHARDS; n++) {
+        shard_fname(&fn, fname, n);
+        if (stat(buf_cstring(&fn), &sbuf) == -1) break;
+    }
+
+    buf_free(&fn);
+    return n;
+}
+
+static int myopen(const char *fname, int flags, struct dbengine **ret, struct txn **mytid)
+{
+    struct dbengine *db;
+    struct buf fn = BUF_INITIALIZER;
+    int i, n, r;
+
+    assert(fname && ret);
+
+    /* the on-disk shard count always wins; the option only applies
+     * when creating a new database */
+    n = count_shards(fname);
+    if (!n) {
+        n = libcyrus_config_getint(CYRUSOPT_SHARDED_DB_SHARDS);
+        if (n < 1) n = 1;
+        if (n > MAX_SHARDS) n = MAX_SHARDS;
+    }
+
+    db = (struct dbengine *) xzmalloc(sizeof(struct dbengine));
+    db->nshards = n;
+
+    for (i = 0; i < n; i++) {
+        shard_fname(&fn, fname, i);
+        r = cyrusdb_open(SHARD_BACKEND, buf_cstring(&fn), flags, &db->shard[i]);
+        if (r) {
+            syslog(LOG_ERR, "DBERROR: opening shard %s: %s",
+                   buf_cstring(&fn), cyrusdb_strerror(r));
+            while (i--) cyrusdb_close(db->shard[i]);
+            free(db);
+            buf_free(&fn);
+            return r;
+        }
+    }
+
+    buf_free(&fn);
+
+    *ret = db;
+
+    /* sub-transactions are created lazily, so there's nothing to
+     * lock up front */
+    if (mytid) *mytid = (struct txn *) xzmalloc(sizeof(struct txn));
+
+    return 0;
+}
+
+static int myclose(struct dbengine *db)
+{
+    int i, r = 0;
+
+    assert(db);
+
+    for (i = 0; i < db->nshards; i++) {
+        int r2 = cyrusdb_close(db->shard[i]);
+        if (r2 && !r) r = r2;
+    }
+    free(db);
+
+    return r;
+}
+
+static int myfetch(struct dbengine *db,
+                   const char *key, size_t keylen,
+                   const char **data, size_t *datalen,
+                   struct txn **tidptr)
+{
+    unsigned n = shard_of(db, key, keylen);
+
+    return cyrusdb_fetch(db->shard[n], key, keylen,
+                         data, datalen, subtid(tidptr, n));
+}
+
+static int myfetchlock(struct dbengine *db,
+                       const char *key, size_t keylen,
+                       const char **data, size_t *datalen,
+                       struct txn **tidptr)
+{
+    unsigned n = shard_of(db, key, keylen);
+
+    return cyrusdb_fetchlock(db->shard[n], key, keylen,
+                             data, datalen, subtid(tidptr, n));
+}
+
+static int myfetchnext(struct dbengine *db,
+                       const char *key, size_t keylen,
+                       const char **foundkey, size_t *foundkeylen,
+                       const char **data, size_t *datalen,
+                       struct txn **tidptr)
+{
+    const char *bestkey = NULL, *bestdata = NULL;
+    size_t bestkeylen = 0, bestdatalen = 0;
+    int i, r;
+
+    /* the next key overall is the smallest of the per-shard next
+     * keys.  each shard's pointers stay valid until the next
+     * operation on that same shard, so the winners survive */
+    for (i = 0; i < db->nshards; i++) {
+        const char *fk = NULL, *d = NULL;
+        size_t fklen = 0, dlen = 0;
+
+        r = cyrusdb_fetchnext(db->shard[i], key, keylen, &fk, &fklen,
+                              &d, &dlen, subtid(tidptr, i));
+        if (r == CYRUSDB_NOTFOUND) continue;
+        if (r) return r;
+
+        if (!bestkey || cyrusdb_compar(db->shard[0], fk, fklen,
+                                       bestkey, bestkeylen) < 0) {
+            bestkey = fk;
+            bestkeylen = fklen;
+            bestdata = d;
+            bestdatalen = dlen;
+        }
+    }
+
+    if (!bestkey) return CYRUSDB_NOTFOUND;
+
+    if (foundkey) *foundkey = bestkey;
+    if (foundkeylen) *foundkeylen = bestkeylen;
+    if (data) *data = bestdata;
+    if (datalen) *datalen = bestdatalen;
+
+    return 0;
+}
+
+/* merging iterator over the shards */
+
+struct mergecursor {
+    struct db *shard;
+    struct txn **tidptr;
+    /* copies of the current record - writes from the callback may
+     * move any shard's own buffer, including a parked cursor's */
+    struct buf key;
+    struct buf data;
+    int done;
+};
+
+static void cursor_checkprefix(struct mergecursor *c,
+                               const char *prefix, size_t prefixlen)
+{
+    if (c->done || !prefixlen) return;
+    if (c->key.len < prefixlen || memcmp(c->key.s, prefix, prefixlen))
+        c->done = 1;
+}
+
+static int cursor_advance(struct mergecursor *c,
+                          const char *prefix, size_t prefixlen)
+{
+    const char *foundkey = NULL;
+    const char *data = NULL;
+    size_t foundkeylen = 0;
+    size_t datalen = 0;
+    int r;
+
+    r = cyrusdb_fetchnext(c->shard, c->key.len ? c->key.s : NULL, c->key.len,
+                          &foundkey, &foundkeylen,
+                          &data, &datalen, c->tidptr);
+    if (r == CYRUSDB_NOTFOUND) {
+        c->done = 1;
+        return 0;
+    }
+    if (r) return r;
+
+    buf_reset(&c->key);
+    buf_appendmap(&c->key, foundkey, foundkeylen);
+    buf_reset(&c->data);
+    buf_appendmap(&c->data, data, datalen);
+
+    cursor_checkprefix(c, prefix, prefixlen);
+
+    return 0;
+}
+
+static int cursor_start(struct mergecursor *c,
+                        const char *prefix, size_t prefixlen)
+{
+    int r;
+
+    if (prefixlen) {
+        const char *data = NULL;
+        size_t datalen = 0;
+
+        /* fetchnext is exclusive, but foreach includes an exact
+         * match on the prefix itself */
+        r = cyrusdb_fetch(c->shard, prefix, prefixlen,
+                          &data, &datalen, c->tidptr);
+        if (!r) {
+            buf_appendmap(&c->key, prefix, prefixlen);
+            buf_appendmap(&c->data, data, datalen);
+            return 0;
+        }
+        if (r != CYRUSDB_NOTFOUND) return r;
+        buf_appendmap(&c->key, prefix, prefixlen);
+    }
+
+    return cursor_advance(c, prefix, prefixlen);
+}
+
+static int myforeach(struct dbengine *db,
+                     const char *prefix, size_t prefixlen,
+                     foreach_p *goodp,
+                     foreach_cb *cb, void *rock,
+                     struct txn **tidptr)
+{
+    struct mergecursor *cur;
+    int lo = 0, hi = db->nshards;
+    int ncur, i, best;
+    int r = 0;
+
+    assert(db);
+    assert(cb);
+    if (prefixlen) assert(prefix);
+
+    /* if the prefix pins down the user part, only one shard can
+     * hold matching keys */
+    if (prefixlen && shard_prefix_len(prefix, prefixlen) < prefixlen) {
+        lo = shard_of(db, prefix, prefixlen);
+        hi = lo + 1;
+    }
+
+    ncur = hi - lo;
+    cur = (struct mergecursor *) xzmalloc(ncur * sizeof(struct mergecursor));
+
+    for (i = 0; i < ncur; i++) {
+        cur[i].shard = db->shard[lo + i];
+        cur[i].tidptr = subtid(tidptr, lo + i);
+        r = cursor_start(&cur[i], prefix, prefixlen);
+        if (r) goto done;
+    }
+
+    for (;;) {
+        /* pick the smallest live cursor */
+        best = -1;
+        for (i = 0; i < ncur; i++) {
+            if (cur[i].done) continue;
+            if (best < 0 ||
+                cyrusdb_compar(db->shard[0],
+                               cur[i].key.s, cur[i].key.len,
+                               cur[best].key.s, cur[best].key.len) < 0)
+                best = i;
+        }
+        if (best < 0) break;
+
+        if (!goodp || goodp(rock, cur[best].key.s, cur[best].key.len,
+                            cur[best].data.s, cur[best].data.len)) {
+            r = cb(rock, cur[best].key.s, cur[best].key.len,
+                   cur[best].data.s, cur[best].data.len);
+            if (r) break;
+        }
+
+        r = cursor_advance(&cur[best], prefix, prefixlen);
+        if (r) break;
+    }
+
+done:
+    for (i = 0; i < ncur; i++) {
+        buf_free(&cur[i].key);
+        buf_free(&cur[i].data);
+    }
+    free(cur);
+
+    return r;
+}
+
+static int create(struct dbengine *db,
+                  const char *key, size_t keylen,
+                  const char *data, size_t datalen,
+                  struct txn **tidptr)
+{
+    unsigned n = shard_of(db, key, keylen);
+
+    return cyrusdb_create(db->shard[n], key, keylen,
+                          data, datalen, subtid(tidptr, n));
+}
+
+static int store(struct dbengine *db,
+                 const char *key, size_t keylen,
+                 const char *data, size_t datalen,
+                 struct txn **tidptr)
+{
+    unsigned n = shard_of(db, key, keylen);
+
+    return cyrusdb_store(db->shard[n], key, keylen,
+                         data, datalen, subtid(tidptr, n));
+}
+
+static int delete(struct dbengine *db,
+                  const char *key, size_t keylen,
+                  struct txn **tidptr, int force)
+{
+    unsigned n = shard_of(db, key, keylen);
+
+    return cyrusdb_delete(db->shard[n], key, keylen,
+                          subtid(tidptr, n), force);
+}
+
+static int commit_txn(struct dbengine *db, struct txn *tid)
+{
+    int i, r = 0;
+
+    assert(db && tid);
+
+    for (i = 0; i < db->nshards; i++) {
+        int r2;
+        if (!tid->sub[i]) continue;
+        r2 = cyrusdb_commit(db->shard[i], tid->sub[i]);
+        if (r2 && !r) r = r2;
+    }
+    free(tid);
+
+    return r;
+}
+
+static int abort_txn(struct dbengine *db, struct txn *tid)
+{
+    int i, r = 0;
+
+    assert(db && tid);
+
+    for (i = 0; i < db->nshards; i++) {
+        int r2;
+        if (!tid->sub[i]) continue;
+        r2 = cyrusdb_abort(db->shard[i], tid->sub[i]);
+        if (r2 && !r) r = r2;
+    }
+    free(tid);
+
+    return r;
+}
+
+static int dump(struct dbengine *db, int detail)
+{
+    int i, r = 0;
+
+    for (i = 0; i < db->nshards && !r; i++)
+        r = cyrusdb_dump(db->shard[i], detail);
+
+    return r;
+}
+
+static int consistent(struct dbengine *db)
+{
+    int i, r = 0;
+
+    for (i = 0; i < db->nshards && !r; i++)
+        r = cyrusdb_consistent(db->shard[i]);
+
+    return r;
+}
+
+static int repack(struct dbengine *db)
+{
+    int i, r = 0;
+
+    for (i = 0; i < db->nshards && !r; i++)
+        r = cyrusdb_repack(db->shard[i]);
+
+    return r;
+}
+
+static int mycompar(struct dbengine *db, const char *a, int alen,
+                    const char *b, int blen)
+{
+    return cyrusdb_compar(db->shard[0], a, alen, b, blen);
+}
+
+static int myarchive(const strarray_t *fnames, const char *dirname)
+{
+    strarray_t shardnames = STRARRAY_INITIALIZER;
+    struct buf fn = BUF_INITIALIZER;
+    int i, j, r;
+
+    /* expand each database name into its shard files */
+    for (i = 0; i < fnames->count; i++) {
+        const char *fname = strarray_nth(fnames, i);
+        int n = count_shards(fname);
+
+        for (j = 0; j < n; j++) {
+            shard_fname(&fn, fname, j);
+            strarray_append(&shardnames, buf_cstring(&fn));
+        }
+    }
+    buf_free(&fn);
+
+    r = cyrusdb_generic_archive(&shardnames, dirname);
+
+    strarray_fini(&shardnames);
+    return r;
+}
+
+static int myunlink(const char *fname, int flags)
+{
+    struct buf fn = BUF_INITIALIZER;
+    int i, n = count_shards(fname);
+
+    for (i = 0; i < n; i++) {
+        shard_fname(&fn, fname, i);
+        cyrusdb_unlink(SHARD_BACKEND, buf_cstring(&fn), flags);
+    }
+    buf_free(&fn);
+
+    return 0;
+}
+
+HIDDEN struct cyrusdb_backend cyrusdb_sharded =
+{
+    "sharded",                  /* name */
+
+    &cyrusdb_generic_init,
+    &cyrusdb_generic_done,
+    &cyrusdb_generic_sync,
+    &myarchive,
+    &myunlink,
+
+    &myopen,
+    &myclose,
+
+    &myfetch,
+    &myfetchlock,
+    &myfetchnext,
+
+    &myforeach,
+    &create,
+    &store,
+    &delete,
+
+    &commit_txn,
+    &abort_txn,
+
+    &dump,
+    &consistent,
+    &repack,
+    &mycompar
+};
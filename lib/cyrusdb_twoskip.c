@@ -57,6 +57,7 @@
 #include "byteorder64.h"
 #include "cyrusdb.h"
 #include "crc32.h"
+#include "crc32c.h"
 #include "libcyr_cfg.h"
 #include "mappedfile.h"
 #include "util.h"
@@ -282,6 +283,16 @@
 /* format specifics */
 #undef VERSION /* defined in config.h */
 #define VERSION 1
+/* files contain front-coded records; bumped lazily so that files
+ * without any compressed records stay readable by older software */
+#define VERSION_FC 2
+/* all checksums in the file are crc32c (hardware-assisted where the
+ * cpu supports it) rather than zlib crc32.  The algorithm is a
+ * whole-file property chosen at creation time, so this version is only
+ * ever set on a fresh file - existing files are upgraded by being
+ * rewritten (checkpoint, or cvt_cyrusdb to a new file) */
+#define VERSION_CRC32C 3
+#define MAXVERSION VERSION_CRC32C
 
 /* type aliases */
 #define LLU long long unsigned int
@@ -290,9 +301,20 @@
 /* record types */
 #define DUMMY '='
 #define RECORD '+'
+#define FCRECORD '%'
 #define DELETE '-'
 #define COMMIT '$'
 
+/* front-coding: an FCRECORD stores the offset of an earlier "base"
+ * record plus the length of the key prefix it shares with it, and
+ * only the key suffix on disk.  Committed key bytes are immutable
+ * (restitching only rewrites record heads), so the base stays valid
+ * even when records are inserted or deleted in between.  Every chain
+ * bottoms out at a plain record within FC_RESTART links. */
+#define FC_MINPREFIX 8
+#define FC_RESTART 16
+#define FC_MAXCHAIN 64  /* read-side sanity bound */
+
 /********** DATA STRUCTURES *************/
 
 /* A single "record" in the twoskip file.  This could be a
@@ -306,9 +328,13 @@ struct skiprecord {
     /* what are our header fields */
     uint8_t type;
     uint8_t level;
-    size_t keylen;
+    size_t keylen;      /* NOTE: just the suffix length for an FCRECORD */
     size_t vallen;
 
+    /* front-coding fields (FCRECORD only) */
+    size_t baseoffset;
+    size_t prefixlen;
+
     /* where to do we go from here? */
     size_t nextloc[MAXLEVEL+1];
 
@@ -393,6 +419,19 @@ struct dbengine {
     int txn_num;
     struct txn *current_txn;
 
+    /* optimistic lockless reads */
+    int lockless;
+    int in_lockless;
+
+    /* key prefix compression */
+    int compress;
+    struct buf fckey1;  /* scratch for reconstructed keys */
+    struct buf fckey2;
+
+    /* checksum engine, from the file version */
+    uint32_t (*crcmap)(const char *base, unsigned len);
+    uint32_t (*crciovec)(struct iovec *iov, int iovcnt);
+
     /* comparator function to use for sorting */
     int open_flags;
     int (*compar) (const char *s1, int l1, const char *s2, int l2);
@@ -421,7 +460,7 @@ enum {
 
 #define HEADER_SIZE 64
 #define DUMMY_OFFSET HEADER_SIZE
-#define MAXRECORDHEAD ((MAXLEVEL + 5)*8)
+#define MAXRECORDHEAD ((MAXLEVEL + 7)*8)
 
 /* mount a scratch monkey */
 static union skipwritebuf {
@@ -467,6 +506,20 @@ static uint8_t randlvl(uint8_t lvl, uint8_t maxlvl)
 
 /************** HEADER ****************/
 
+/* pick the checksum engine matching the file version.  crc32c_init()
+ * has already chosen a hardware implementation if the cpu has one */
+static void choose_crc(struct dbengine *db)
+{
+    if (db->header.version >= VERSION_CRC32C) {
+        db->crcmap = crc32c_map;
+        db->crciovec = crc32c_iovec;
+    }
+    else {
+        db->crcmap = crc32_map;
+        db->crciovec = crc32_iovec;
+    }
+}
+
 /* given an open, mapped db, read in the header information */
 static int read_header(struct dbengine *db)
 {
@@ -488,12 +541,14 @@ static int read_header(struct dbengine *db)
     db->header.version
         = ntohl(*((uint32_t *)(BASE(db) + OFFSET_VERSION)));
 
-    if (db->header.version > VERSION) {
+    if (db->header.version > MAXVERSION) {
         syslog(LOG_ERR, "twoskip: version mismatch: %s has version %d",
                FNAME(db), db->header.version);
         return CYRUSDB_IOERROR;
     }
 
+    choose_crc(db);
+
     db->header.generation
         = ntohll(*((uint64_t *)(BASE(db) + OFFSET_GENERATION)));
 
@@ -511,7 +566,7 @@ static int read_header(struct dbengine *db)
 
     crc = ntohl(*((uint32_t *)(BASE(db) + OFFSET_CRC32)));
 
-    if (crc32_map(BASE(db), OFFSET_CRC32) != crc) {
+    if (db->crcmap(BASE(db), OFFSET_CRC32) != crc) {
         syslog(LOG_ERR, "DBERROR: %s: twoskip header CRC failure",
                FNAME(db));
         return CYRUSDB_IOERROR;
@@ -536,7 +591,7 @@ static int write_header(struct dbengine *db)
     *((uint64_t *)(buf + OFFSET_REPACK_SIZE)) = htonll(db->header.repack_size);
     *((uint64_t *)(buf + OFFSET_CURRENT_SIZE)) = htonll(db->header.current_size);
     *((uint32_t *)(buf + OFFSET_FLAGS)) = htonl(db->header.flags);
-    *((uint32_t *)(buf + OFFSET_CRC32)) = htonl(crc32_map(buf, OFFSET_CRC32));
+    *((uint32_t *)(buf + OFFSET_CRC32)) = htonl(db->crcmap(buf, OFFSET_CRC32));
 
     /* write it out */
     n = mappedfile_pwrite(db->mf, buf, HEADER_SIZE, 0);
@@ -559,11 +614,12 @@ static int check_tailcrc(struct dbengine *db, struct skiprecord *record)
 {
     uint32_t crc;
 
-    crc = crc32_map(BASE(db) + record->keyoffset,
-                    roundup(record->keylen + record->vallen, 8));
+    crc = db->crcmap(BASE(db) + record->keyoffset,
+                     roundup(record->keylen + record->vallen, 8));
     if (crc != record->crc32_tail) {
-        syslog(LOG_ERR, "DBERROR: invalid tail crc %s at %llX",
-               FNAME(db), (LLU)record->offset);
+        if (!db->in_lockless)
+            syslog(LOG_ERR, "DBERROR: invalid tail crc %s at %llX",
+                   FNAME(db), (LLU)record->offset);
         return CYRUSDB_IOERROR;
     }
 
@@ -599,8 +655,9 @@ static int read_onerecord(struct dbengine *db, size_t offset,
 
     /* make sure we fit */
     if (record->level > MAXLEVEL) {
-        syslog(LOG_ERR, "DBERROR: twoskip invalid level %d for %s at %08llX",
-               record->level, FNAME(db), (LLU)offset);
+        if (!db->in_lockless)
+            syslog(LOG_ERR, "DBERROR: twoskip invalid level %d for %s at %08llX",
+                   record->level, FNAME(db), (LLU)offset);
         return CYRUSDB_IOERROR;
     }
 
@@ -618,6 +675,22 @@ static int read_onerecord(struct dbengine *db, size_t offset,
         offset += 8;
     }
 
+    /* front-coded key */
+    if (record->type == FCRECORD) {
+        base = BASE(db) + offset;
+        record->baseoffset = ntohll(*((uint64_t *)base));
+        record->prefixlen = ntohll(*((uint64_t *)(base+8)));
+        offset += 16;
+
+        /* bases always come earlier in the file, so chains terminate */
+        if (!record->baseoffset || record->baseoffset >= record->offset) {
+            if (!db->in_lockless)
+                syslog(LOG_ERR, "DBERROR: twoskip invalid base offset for %s at %08llX",
+                       FNAME(db), (LLU)record->offset);
+            return CYRUSDB_IOERROR;
+        }
+    }
+
     /* we know the length now */
     record->len = (offset - record->offset) /* header including lengths */
                 + 8 * (1 + record->level)   /* ptrs */
@@ -635,10 +708,11 @@ static int read_onerecord(struct dbengine *db, size_t offset,
 
     base = BASE(db) + offset;
     record->crc32_head = ntohl(*((uint32_t *)base));
-    if (crc32_map(BASE(db) + record->offset, (offset - record->offset))
+    if (db->crcmap(BASE(db) + record->offset, (offset - record->offset))
         != record->crc32_head) {
-        syslog(LOG_ERR, "DBERROR: twoskip checksum head error for %s at %08llX",
-               FNAME(db), (LLU)offset);
+        if (!db->in_lockless)
+            syslog(LOG_ERR, "DBERROR: twoskip checksum head error for %s at %08llX",
+                   FNAME(db), (LLU)offset);
         return CYRUSDB_IOERROR;
     }
 
@@ -650,8 +724,9 @@ static int read_onerecord(struct dbengine *db, size_t offset,
     return 0;
 
 badsize:
-    syslog(LOG_ERR, "twoskip: attempt to read past end of file %s: %08llX > %08llX",
-           FNAME(db), (LLU)record->offset + record->len, (LLU)SIZE(db));
+    if (!db->in_lockless)
+        syslog(LOG_ERR, "twoskip: attempt to read past end of file %s: %08llX > %08llX",
+               FNAME(db), (LLU)record->offset + record->len, (LLU)SIZE(db));
     return CYRUSDB_IOERROR;
 }
 
@@ -669,9 +744,89 @@ static int read_skipdelete(struct dbengine *db, size_t offset,
     return r;
 }
 
+/* get the full key for a record.  Plain records just point into the
+ * map; front-coded records get reconstructed into 'scratch' by
+ * walking the base chain down to a plain record and building the key
+ * back up */
+static int record_key(struct dbengine *db, const struct skiprecord *record,
+                      struct buf *scratch,
+                      const char **keyp, size_t *keylenp)
+{
+    struct skiprecord chain[FC_MAXCHAIN];
+    int depth = 0;
+    int i, r;
+
+    if (record->type != FCRECORD) {
+        *keyp = KEY(db, record);
+        *keylenp = record->keylen;
+        return 0;
+    }
+
+    chain[depth++] = *record;
+    while (chain[depth-1].type == FCRECORD) {
+        if (depth == FC_MAXCHAIN) goto broken;
+        r = read_onerecord(db, chain[depth-1].baseoffset, &chain[depth]);
+        if (r) return r;
+        depth++;
+    }
+
+    /* the deepest record holds the front of the key, build forwards */
+    buf_setmap(scratch, KEY(db, &chain[depth-1]), chain[depth-1].keylen);
+    for (i = depth-2; i >= 0; i--) {
+        if (scratch->len < chain[i].prefixlen) goto broken;
+        buf_truncate(scratch, chain[i].prefixlen);
+        buf_appendmap(scratch, KEY(db, &chain[i]), chain[i].keylen);
+    }
+
+    *keyp = scratch->s;
+    *keylenp = scratch->len;
+
+    return 0;
+
+broken:
+    if (!db->in_lockless)
+        syslog(LOG_ERR, "DBERROR: twoskip invalid prefix chain for %s at %08llX",
+               FNAME(db), (LLU)record->offset);
+    return CYRUSDB_IOERROR;
+}
+
+/* as above, but always materialise the key into 'buf' */
+static int record_key_copy(struct dbengine *db,
+                           const struct skiprecord *record,
+                           struct buf *buf)
+{
+    const char *key = NULL;
+    size_t keylen = 0;
+    int r;
+
+    r = record_key(db, record, buf, &key, &keylen);
+    if (r) return r;
+
+    if (key != buf->s)
+        buf_setmap(buf, key, keylen);
+
+    return 0;
+}
+
+/* how many links from this record down to a plain record */
+static int fc_depth(struct dbengine *db, const struct skiprecord *record)
+{
+    struct skiprecord iter = *record;
+    int depth = 0;
+
+    while (iter.type == FCRECORD) {
+        if (depth >= FC_RESTART) break;
+        if (read_onerecord(db, iter.baseoffset, &iter)) return FC_RESTART;
+        depth++;
+    }
+
+    return depth;
+}
+
 /* prepare the header part of the record (everything except the key, value
  * and padding).  Used for both writes and rewrites. */
-static void prepare_record(struct skiprecord *record, char *buf, size_t *sizep)
+static void prepare_record(struct dbengine *db, struct skiprecord *record,
+                           char *buf, size_t *sizep)
 {
     int len = 8;
     int i;
@@ -698,6 +853,12 @@ static void prepare_record(struct skiprecord *record, char *buf, size_t *sizep)
         len += 8;
     }
 
+    if (record->type == FCRECORD) {
+        *((uint64_t *)(buf+len)) = htonll(record->baseoffset);
+        *((uint64_t *)(buf+len+8)) = htonll(record->prefixlen);
+        len += 16;
+    }
+
     /* got pointers? */
     for (i = 0; i <= record->level; i++) {
         *((uint64_t *)(buf+len)) = htonll(record->nextloc[i]);
@@ -705,7 +866,7 @@ static void prepare_record(struct skiprecord *record, char *buf, size_t *sizep)
     }
 
     /* NOTE: crc32_tail does not change */
-    record->crc32_head = crc32_map(buf, len);
+    record->crc32_head = db->crcmap(buf, len);
     *((uint32_t *)(buf+len)) = htonl(record->crc32_head);
     *((uint32_t *)(buf+len+4)) = htonl(record->crc32_tail);
     len += 8;
@@ -724,7 +885,7 @@ static int rewrite_record(struct dbengine *db, struct skiprecord *record)
     assert(db->header.flags & DIRTY);
     assert(record->offset);
 
-    prepare_record(record, buf, &len);
+    prepare_record(db, record, buf, &len);
 
     n = mappedfile_pwrite(db->mf, buf, len, record->offset);
     if (n < 0) return CYRUSDB_IOERROR;
@@ -760,10 +921,10 @@ static int write_record(struct dbengine *db, struct skiprecord *record,
     io[3].iov_len = roundup(len, 8) - len;
 
     /* calculate the CRC32 of the tail first */
-    record->crc32_tail = crc32_iovec(io+1, 3);
+    record->crc32_tail = db->crciovec(io+1, 3);
 
     /* prepare the record once we know the crc32 of the tail */
-    prepare_record(record, scratchspace.s, &iolen);
+    prepare_record(db, record, scratchspace.s, &iolen);
     io[0].iov_base = scratchspace.s;
     io[0].iov_len = iolen;
 
@@ -856,6 +1017,8 @@ static int relocate(struct dbengine *db)
     struct skiprecord newrecord;
     size_t offset;
     size_t oldoffset = 0;
+    const char *reckey;
+    size_t reckeylen;
     uint8_t level;
     uint8_t i;
     int cmp = -1; /* never found a thing! */
@@ -898,7 +1061,11 @@ static int relocate(struct dbengine *db)
             if (newrecord.offset) {
                 assert(newrecord.level >= level);
 
-                cmp = db->compar(KEY(db, &newrecord), newrecord.keylen,
+                r = record_key(db, &newrecord, &db->fckey1,
+                               &reckey, &reckeylen);
+                if (r) return r;
+
+                cmp = db->compar(reckey, reckeylen,
                                  loc->keybuf.s, loc->keybuf.len);
 
                 /* not there?  stay at this level */
@@ -935,6 +1102,8 @@ static int find_loc(struct dbengine *db, const char *key, size_t keylen)
 {
     struct skiprecord newrecord;
     struct skiploc *loc = &db->loc;
+    const char *reckey;
+    size_t reckeylen;
     int cmp, i, r;
 
     if (key != loc->keybuf.s)
@@ -945,7 +1114,10 @@ static int find_loc(struct dbengine *db, const char *key, size_t keylen)
     /* can we special case advance? */
     if (keylen && loc->end == db->end
                && loc->generation == db->header.generation) {
-        cmp = db->compar(KEY(db, &loc->record), loc->record.keylen,
+        r = record_key(db, &loc->record, &db->fckey1, &reckey, &reckeylen);
+        if (r) return r;
+
+        cmp = db->compar(reckey, reckeylen,
                          loc->keybuf.s, loc->keybuf.len);
         /* same place, and was exact.  Otherwise we're going back,
          * and the reverse pointers are no longer valid... */
@@ -969,7 +1141,10 @@ static int find_loc(struct dbengine *db, const char *key, size_t keylen)
             }
 
             /* now where is THIS record? */
-            cmp = db->compar(KEY(db, &newrecord), newrecord.keylen,
+            r = record_key(db, &newrecord, &db->fckey1, &reckey, &reckeylen);
+            if (r) return r;
+
+            cmp = db->compar(reckey, reckeylen,
                              loc->keybuf.s, loc->keybuf.len);
 
             /* exact match? */
@@ -1032,7 +1207,8 @@ static int advance_loc(struct dbengine *db)
         loc->forwardloc[i] = _getloc(db, &loc->record, i);
 
     /* keep our location */
-    buf_setmap(&loc->keybuf, KEY(db, &loc->record), loc->record.keylen);
+    r = record_key_copy(db, &loc->record, &loc->keybuf);
+    if (r) return r;
     loc->is_exactmatch = 1;
 
     /* make sure this record is complete */
@@ -1088,6 +1264,7 @@ static int store_here(struct dbengine *db, const char *val, size_t vallen)
 {
     struct skiploc *loc = &db->loc;
     struct skiprecord newrecord;
+    size_t prefixlen = 0;
     uint8_t level = 0;
     uint8_t i;
     int r;
@@ -1097,6 +1274,27 @@ static int store_here(struct dbengine *db, const char *val, size_t vallen)
         db->header.num_records--;
     }
 
+    /* can we front-code against the record just before us?  Committed
+     * key bytes are never rewritten, so the base offset stays valid for
+     * the life of the file */
+    if (db->compress && !loc->is_exactmatch
+        && (loc->record.type == RECORD || loc->record.type == FCRECORD)
+        && fc_depth(db, &loc->record) < FC_RESTART) {
+        const char *prevkey;
+        size_t prevkeylen;
+        size_t maxlen;
+
+        r = record_key(db, &loc->record, &db->fckey1, &prevkey, &prevkeylen);
+        if (r) return r;
+
+        maxlen = prevkeylen < loc->keybuf.len ? prevkeylen : loc->keybuf.len;
+        while (prefixlen < maxlen && prevkey[prefixlen] == loc->keybuf.s[prefixlen])
+            prefixlen++;
+
+        if (prefixlen < FC_MINPREFIX)
+            prefixlen = 0;
+    }
+
     /* build a new record */
     memset(&newrecord, 0, sizeof(struct skiprecord));
     newrecord.type = RECORD;
@@ -1108,8 +1306,19 @@ static int store_here(struct dbengine *db, const char *val, size_t vallen)
     if (newrecord.level > level)
         level = newrecord.level;
 
+    if (prefixlen) {
+        newrecord.type = FCRECORD;
+        newrecord.baseoffset = loc->record.offset;
+        newrecord.prefixlen = prefixlen;
+        newrecord.keylen = loc->keybuf.len - prefixlen;
+        /* bump the version first, so even a dirty file is refused by
+         * older software rather than misparsed */
+        if (db->header.version < VERSION_FC)
+            db->header.version = VERSION_FC;
+    }
+
     /* append to the file */
-    r = append_record(db, &newrecord, loc->keybuf.s, val);
+    r = append_record(db, &newrecord, loc->keybuf.s + prefixlen, val);
     if (r) return r;
 
     /* get the nextlevel to point here for all this record's levels */
@@ -1232,6 +1441,151 @@ static int read_lock(struct dbengine *db)
     return 0;
 }
 
+/* OPTIMISTIC LOCKLESS READS
+ *
+ * Writers always set the DIRTY flag in the header (and fdatasync it)
+ * before modifying any record in place, and the key and value bytes of
+ * a committed record are never rewritten - only record heads get their
+ * pointers restitched.  So a reader which sees a clean header before
+ * AND after a lookup, with the same generation and current_size, knows
+ * that no writer touched the file while it was looking, and everything
+ * it read was consistent - all without taking the fcntl lock.  If the
+ * check fails we just retry the read the old way, with the lock held.
+ */
+
+/* the pinned view of the file that a lockless read started from */
+struct readpin {
+    uint64_t generation;
+    uint64_t current_size;
+};
+
+/* refresh the map and pin the current generation.  Returns non-zero
+ * (and the caller takes the lock instead) if the file is mid-write or
+ * needs recovery */
+static int lockless_start(struct dbengine *db, struct readpin *pin)
+{
+    int r;
+
+    r = mappedfile_refresh(db->mf);
+    if (r) return CYRUSDB_IOERROR;
+
+    r = read_header(db);
+    if (r) return r;
+
+    if (!db_is_clean(db))
+        return CYRUSDB_AGAIN;
+
+    pin->generation = db->header.generation;
+    pin->current_size = db->header.current_size;
+
+    /* on weakly-ordered CPUs the record reads which follow could
+     * otherwise be satisfied ahead of the header reads above, pinning
+     * a state the records don't belong to */
+    __sync_synchronize();
+
+    return 0;
+}
+
+/* check that no writer has touched the file since lockless_start() */
+static int lockless_valid(struct dbengine *db, const struct readpin *pin)
+{
+    /* order the revalidation loads below after the record reads they
+     * are vouching for - without this a reader could see the clean
+     * post-write header while still holding half-written record
+     * bytes */
+    __sync_synchronize();
+
+    if (SIZE(db) < HEADER_SIZE)
+        return 0;
+
+    if (ntohl(*((uint32_t *)(BASE(db) + OFFSET_FLAGS))) & DIRTY)
+        return 0;
+
+    if (ntohll(*((uint64_t *)(BASE(db) + OFFSET_GENERATION)))
+        != pin->generation)
+        return 0;
+
+    if (ntohll(*((uint64_t *)(BASE(db) + OFFSET_CURRENT_SIZE)))
+        != pin->current_size)
+        return 0;
+
+    return 1;
+}
+
+/* attempt a fetch without taking the file lock.  Returns CYRUSDB_AGAIN
+ * if we raced a writer (or tripped over a half-written record) and the
+ * caller should retry with the lock held */
+static int lockless_fetch(struct dbengine *db,
+                          const char *key, size_t keylen,
+                          const char **foundkey, size_t *foundkeylen,
+                          const char **data, size_t *datalen,
+                          int fetchnext)
+{
+    struct readpin pin;
+    int r;
+
+    r = lockless_start(db, &pin);
+    if (r) return CYRUSDB_AGAIN;
+
+    db->in_lockless = 1;
+    r = find_loc(db, key, keylen);
+    if (!r && fetchnext)
+        r = advance_loc(db);
+    db->in_lockless = 0;
+
+    /* if a writer got in, anything we read may be garbage - and if the
+     * pin is still valid but the read failed anyway, the locked path
+     * will rediscover (and log) the real corruption */
+    if (!lockless_valid(db, &pin) || r == CYRUSDB_IOERROR)
+        return CYRUSDB_AGAIN;
+
+    if (r) return r;
+
+    if (foundkey) *foundkey = db->loc.keybuf.s;
+    if (foundkeylen) *foundkeylen = db->loc.keybuf.len;
+
+    if (!db->loc.is_exactmatch)
+        return CYRUSDB_NOTFOUND;
+
+    if (data) *data = VAL(db, &db->loc.record);
+    if (datalen) *datalen = db->loc.record.vallen;
+
+    return 0;
+}
+
+/* a lockless foreach raced a writer: take the real lock and re-seek so
+ * iteration continues from just after 'lastkey' (the last key handed to
+ * the callback), or from the start of 'prefix' if nothing has been
+ * delivered yet */
+static int foreach_fallback(struct dbengine *db,
+                            const char *prefix, size_t prefixlen,
+                            const struct buf *lastkey,
+                            int *use_lockless, int *need_unlock)
+{
+    int r;
+
+    *use_lockless = 0;
+    db->in_lockless = 0;
+
+    r = read_lock(db);
+    if (r) return r;
+    *need_unlock = 1;
+
+    if (lastkey->len) {
+        r = find_loc(db, lastkey->s, lastkey->len);
+        if (r) return r;
+        return advance_loc(db);
+    }
+
+    r = find_loc(db, prefix, prefixlen);
+    if (r) return r;
+
+    if (!db->loc.is_exactmatch)
+        return advance_loc(db);
+
+    return 0;
+}
+
 static int newtxn(struct dbengine *db, struct txn **tidptr)
 {
     int r;
@@ -1265,6 +1619,8 @@ static void dispose_db(struct dbengine *db)
     }
 
     buf_free(&db->loc.keybuf);
+    buf_free(&db->fckey1);
+    buf_free(&db->fckey2);
 
     free(db);
 }
@@ -1275,7 +1631,9 @@ static int opendb(const char *fname, int flags, struct dbengine **ret, struct tx
 {
     struct dbengine *db;
     int r;
-    int mappedfile_flags = MAPPEDFILE_RW;
+    /* twoskip files are long-lived and randomly accessed; the big ones
+     * (mailboxes.db and friends) benefit from transparent hugepages */
+    int mappedfile_flags = MAPPEDFILE_RW | MAPPEDFILE_HUGEPAGE;
 
     assert(fname);
     assert(ret);
@@ -1288,6 +1646,8 @@ static int opendb(const char *fname, int flags, struct dbengine **ret, struct tx
     db->open_flags = flags & ~CYRUSDB_CREATE;
     db->compar = (flags & CYRUSDB_MBOXSORT) ? bsearch_ncompare_mbox
                                             : bsearch_ncompare_raw;
+    db->lockless = libcyrus_config_getswitch(CYRUSOPT_TWOSKIP_LOCKLESS_READS);
+    db->compress = libcyrus_config_getswitch(CYRUSOPT_TWOSKIP_PREFIX_COMPRESSION);
 
     r = mappedfile_open(&db->mf, fname, mappedfile_flags);
     if (r) {
@@ -1320,6 +1680,13 @@ static int opendb(const char *fname, int flags, struct dbengine **ret, struct tx
         if (!mappedfile_iswritelocked(db->mf))
             goto retry_write;
 
+        /* the checksum engine is fixed for the life of the file, so
+         * choose it before anything is written */
+        db->header.version =
+            libcyrus_config_getswitch(CYRUSOPT_TWOSKIP_CRC32C)
+            ? VERSION_CRC32C : VERSION;
+        choose_crc(db);
+
         /* create the dummy! */
         memset(&dummy, 0, sizeof(struct skiprecord));
         dummy.type = DUMMY;
@@ -1335,7 +1702,6 @@ static int opendb(const char *fname, int flags, struct dbengine **ret, struct tx
         }
 
         /* create the header */
-        db->header.version = VERSION;
         db->header.generation = 1;
         db->header.repack_size = db->end;
         db->header.current_size = db->end;
@@ -1468,6 +1834,15 @@ static int myfetch(struct dbengine *db,
             if (r) return r;
         }
     } else {
+        if (db->lockless) {
+            r = lockless_fetch(db, key, keylen, foundkey, foundkeylen,
+                               data, datalen, fetchnext);
+            if (r != CYRUSDB_AGAIN) return r;
+            /* raced a writer - retry with the lock held */
+            if (data) *data = NULL;
+            if (datalen) *datalen = 0;
+        }
+
         /* grab a r lock */
         r = read_lock(db);
         if (r) return r;
@@ -1517,6 +1892,8 @@ static int myforeach(struct dbengine *db,
     int r = 0, cb_r = 0;
     int num_misses = 0;
     int need_unlock = 0;
+    int use_lockless = 0;
+    struct readpin pin;
     const char *val;
     size_t vallen;
     struct buf keybuf = BUF_INITIALIZER;
@@ -1537,6 +1914,12 @@ static int myforeach(struct dbengine *db,
             r = newtxn(db, tidptr);
             if (r) return r;
         }
+    } else if (db->lockless && !lockless_start(db, &pin)) {
+        /* optimistic lockless iteration - the pin is revalidated every
+         * time we position on a record, and we fall back to a locked
+         * iteration if a writer gets in */
+        use_lockless = 1;
+        db->in_lockless = 1;
     } else {
         /* grab a r lock */
         r = read_lock(db);
@@ -1545,19 +1928,22 @@ static int myforeach(struct dbengine *db,
     }
 
     r = find_loc(db, prefix, prefixlen);
-    if (r) goto done;
-
-    if (!db->loc.is_exactmatch) {
+    if (!r && !db->loc.is_exactmatch) {
         /* advance to the first match */
         r = advance_loc(db);
-        if (r) goto done;
     }
+    if (use_lockless && (r || !lockless_valid(db, &pin))) {
+        /* raced a writer - take the lock and re-seek */
+        r = foreach_fallback(db, prefix, prefixlen, &keybuf,
+                             &use_lockless, &need_unlock);
+    }
+    if (r) goto done;
 
     while (db->loc.is_exactmatch) {
-        /* does it match prefix? */
+        /* does it match prefix?  (keybuf always holds the full key) */
         if (prefixlen) {
-            if (db->loc.record.keylen < prefixlen) break;
-            if (db->compar(KEY(db, &db->loc.record), prefixlen, prefix, prefixlen)) break;
+            if (db->loc.keybuf.len < prefixlen) break;
+            if (db->compar(db->loc.keybuf.s, prefixlen, prefix, prefixlen)) break;
         }
 
         val = VAL(db, &db->loc.record);
@@ -1569,7 +1955,7 @@ static int myforeach(struct dbengine *db,
              * and clobbers loc */
             buf_copy(&keybuf, &db->loc.keybuf);
 
-            if (!tidptr) {
+            if (!tidptr && !use_lockless) {
                 /* release read lock */
                 r = unlock(db);
                 if (r) goto done;
@@ -1581,7 +1967,7 @@ static int myforeach(struct dbengine *db,
                             val, vallen);
             if (cb_r) break;
 
-            if (!tidptr) {
+            if (!tidptr && !use_lockless) {
                 /* grab a r lock */
                 r = read_lock(db);
                 if (r) goto done;
@@ -1592,9 +1978,17 @@ static int myforeach(struct dbengine *db,
 
             /* should be cheap if we're already here */
             r = find_loc(db, keybuf.s, keybuf.len);
+            if (r && use_lockless && !lockless_valid(db, &pin)) {
+                /* raced a writer - take the lock and re-seek */
+                r = foreach_fallback(db, prefix, prefixlen, &keybuf,
+                                     &use_lockless, &need_unlock);
+                if (r) goto done;
+                /* already positioned on the next record */
+                continue;
+            }
             if (r) goto done;
         }
-        else if (!tidptr) {
+        else if (!tidptr && !use_lockless) {
             num_misses++;
             if (num_misses > FOREACH_LOCK_RELEASE) {
                 /* take a copy of they key - just in case cb does actions on this database
@@ -1621,11 +2015,17 @@ static int myforeach(struct dbengine *db,
 
         /* move to the next one */
         r = advance_loc(db);
+        if (use_lockless && (r || !lockless_valid(db, &pin))) {
+            /* raced a writer - take the lock and re-seek */
+            r = foreach_fallback(db, prefix, prefixlen, &keybuf,
+                                 &use_lockless, &need_unlock);
+        }
         if (r) goto done;
     }
 
  done:
 
+    db->in_lockless = 0;
     buf_free(&keybuf);
 
     if (need_unlock) {
@@ -1790,6 +2190,50 @@ static int mystore(struct dbengine *db,
     return r2 ? r2 : r;
 }
 
+/* as mystore(), but applies a whole batch of updates under a single
+ * write lock, with a single commit record when there's no enclosing
+ * transaction.  Sorted batches get the best locality out of find_loc(),
+ * but any order is legal. */
+static int mystorev(struct dbengine *db,
+                    const struct cyrusdb_keyvalue *kv, size_t nkv,
+                    struct txn **tidptr)
+{
+    struct txn *localtid = NULL;
+    size_t i;
+    int r = 0;
+    int r2 = 0;
+
+    assert(db);
+
+    /* not keeping the transaction, just create one local to
+     * this function */
+    if (!tidptr) tidptr = &localtid;
+
+    /* make sure we're write locked and up to date */
+    if (!*tidptr) {
+        r = newtxn(db, tidptr);
+        if (r) return r;
+    }
+
+    for (i = 0; i < nkv; i++) {
+        assert(kv[i].key && kv[i].keylen);
+        r = skipwrite(db, kv[i].key, kv[i].keylen,
+                      kv[i].data, kv[i].datalen, /*force*/1);
+        if (r) break;
+    }
+
+    if (r) {
+        r2 = myabort(db, *tidptr);
+        *tidptr = NULL;
+    }
+    else if (localtid) {
+        /* commit the batch, which releases the write lock */
+        r = mycommit(db, localtid);
+    }
+
+    return r2 ? r2 : r;
+}
+
 /* compress 'db', closing at the end.  Uses foreach to copy into a new
  * database, then rewrites over the old one */
 
@@ -1861,6 +2305,8 @@ static int mycheckpoint(struct dbengine *db)
     /* gotta clean it all up */
     mappedfile_close(&db->mf);
     buf_free(&db->loc.keybuf);
+    buf_free(&db->fckey1);
+    buf_free(&db->fckey2);
 
     *db = *cr.db;
     free(cr.db); /* leaked? */
@@ -1925,11 +2371,17 @@ static int dump(struct dbengine *db, int detail __attribute__((unused)))
             break;
 
         case RECORD:
+        case FCRECORD:
         case DUMMY:
-            buf_setmap(&scratch, KEY(db, &record), record.keylen);
+            r = record_key_copy(db, &record, &scratch);
+            if (r) {
+                printf("ERROR\n");
+                break;
+            }
             buf_replace_char(&scratch, '\0', '-');
             printf("%s kl=%llu dl=%llu lvl=%d (%s)\n",
-                   (record.type == RECORD ? "RECORD" : "DUMMY"),
+                   (record.type == DUMMY ? "DUMMY" :
+                    record.type == FCRECORD ? "FCRECORD" : "RECORD"),
                    (LLU)record.keylen, (LLU)record.vallen,
                    record.level, buf_cstring(&scratch));
             printf("\t");
@@ -1981,6 +2433,8 @@ static int myconsistent(struct dbengine *db, struct txn *tid)
     r = read_onerecord(db, DUMMY_OFFSET, &prevrecord);
     if (r) return r;
 
+    buf_reset(&db->fckey2);
+
     /* set up the location pointers */
     for (i = 0; i < MAXLEVEL; i++)
         fwd[i] = _getloc(db, &prevrecord, i);
@@ -1994,13 +2448,16 @@ static int myconsistent(struct dbengine *db, struct txn *tid)
             continue;
         }
 
-        cmp = db->compar(KEY(db, &record), record.keylen,
-                         KEY(db, &prevrecord), prevrecord.keylen);
+        r = record_key_copy(db, &record, &db->fckey1);
+        if (r) return r;
+
+        cmp = db->compar(db->fckey1.s, db->fckey1.len,
+                         db->fckey2.s, db->fckey2.len);
         if (cmp <= 0) {
             syslog(LOG_ERR, "DBERROR: twoskip out of order %s: %.*s (%08llX) <= %.*s (%08llX)",
-                   FNAME(db), (int)record.keylen, KEY(db, &record),
+                   FNAME(db), (int)db->fckey1.len, db->fckey1.s,
                    (LLU)record.offset,
-                   (int)prevrecord.keylen, KEY(db, &prevrecord),
+                   (int)db->fckey2.len, db->fckey2.s,
                    (LLU)prevrecord.offset);
             return CYRUSDB_INTERNAL;
         }
@@ -2019,6 +2476,7 @@ static int myconsistent(struct dbengine *db, struct txn *tid)
         /* keep a copy for comparison purposes */
         num_records++;
         prevrecord = record;
+        buf_copy(&db->fckey2, &db->fckey1);
     }
 
     for (i = 0; i < MAXLEVEL; i++) {
@@ -2050,6 +2508,9 @@ static int _copy_commit(struct dbengine *db, struct dbengine *newdb,
     int r = 0;
 
     for (offset = commit->nextloc[0]; offset < commit->offset; offset += record.len) {
+        const char *key;
+        size_t keylen;
+
         r = read_onerecord(db, offset, &record);
         if (r) goto err;
         switch (record.type) {
@@ -2057,6 +2518,7 @@ static int _copy_commit(struct dbengine *db, struct dbengine *newdb,
             val = NULL;
             break;
         case RECORD:
+        case FCRECORD:
             val = VAL(db, &record);
             break;
         default:
@@ -2064,8 +2526,11 @@ static int _copy_commit(struct dbengine *db, struct dbengine *newdb,
             goto err;
         }
 
+        r = record_key(db, &record, &db->fckey1, &key, &keylen);
+        if (r) goto err;
+
         /* store into the new DB */
-        r = mystore(newdb, KEY(db, &record), record.keylen, val, record.vallen, &tid, 1);
+        r = mystore(newdb, key, keylen, val, record.vallen, &tid, 1);
         if (r) goto err;
     }
 
@@ -2141,6 +2606,8 @@ static int recovery2(struct dbengine *db, int *count)
     /* gotta clean it all up */
     mappedfile_close(&db->mf);
     buf_free(&db->loc.keybuf);
+    buf_free(&db->fckey1);
+    buf_free(&db->fckey2);
 
     *db = *newdb;
     free(newdb); /* leaked? */
@@ -2194,6 +2661,8 @@ static int recovery1(struct dbengine *db, int *count)
     r = read_onerecord(db, DUMMY_OFFSET, &prevrecord);
     if (r) return r;
 
+    buf_reset(&db->fckey2);
+
     /* and pointers forwards */
     for (i = 2; i <= MAXLEVEL; i++) {
         prev[i] = prevrecord.offset;
@@ -2221,13 +2690,16 @@ static int recovery1(struct dbengine *db, int *count)
             continue;
         }
 
-        cmp = db->compar(KEY(db, &record), record.keylen,
-                         KEY(db, &prevrecord), prevrecord.keylen);
+        r = record_key_copy(db, &record, &db->fckey1);
+        if (r) return r;
+
+        cmp = db->compar(db->fckey1.s, db->fckey1.len,
+                         db->fckey2.s, db->fckey2.len);
         if (cmp <= 0) {
             syslog(LOG_ERR, "DBERROR: twoskip out of order %s: %.*s (%08llX) <= %.*s (%08llX)",
-                   FNAME(db), (int)record.keylen, KEY(db, &record),
+                   FNAME(db), (int)db->fckey1.len, db->fckey1.s,
                    (LLU)record.offset,
-                   (int)prevrecord.keylen, KEY(db, &prevrecord),
+                   (int)db->fckey2.len, db->fckey2.s,
                    (LLU)prevrecord.offset);
             return CYRUSDB_INTERNAL;
         }
@@ -2265,6 +2737,7 @@ static int recovery1(struct dbengine *db, int *count)
         nextoffset = _getloc(db, &record, 0);
 
         prevrecord = record;
+        buf_copy(&db->fckey2, &db->fckey1);
     }
 
     /* check for remaining offsets needing fixing */
@@ -2411,5 +2884,7 @@ HIDDEN struct cyrusdb_backend cyrusdb_twoskip =
     &dump,
     &consistent,
     &mycheckpoint,
-    &mycompar
+    &mycompar,
+
+    &mystorev
 };
@@ -0,0 +1,302 @@
+/* eventio.c - scalable readiness notification for file descriptors
+ *
+ * Copyright (c) 1994-2017 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(HAVE_SYS_EPOLL_H)
+#include <sys/epoll.h>
+#elif defined(HAVE_SYS_EVENT_H)
+#include <sys/types.h>
+#include <sys/event.h>
+#else
+#include <poll.h>
+#endif
+
+#include "eventio.h"
+#include "xmalloc.h"
+
+/* how many events one wait call collects from the kernel at most */
+#define EVENTIO_BATCH 64
+
+struct eventio_reg {
+    int fd;
+    void *rock;
+};
+
+struct eventio {
+    struct eventio_reg **regs;  /* registrations, indexed by fd */
+    int regs_size;
+    unsigned count;
+#if defined(HAVE_SYS_EPOLL_H) || defined(HAVE_SYS_EVENT_H)
+    int pfd;                    /* the epoll instance or kqueue */
+#else
+    struct pollfd *pollfds;     /* scratch space for eventio_wait */
+    struct eventio_reg **pollregs;
+    int pollfds_size;
+#endif
+};
+
+EXPORTED struct eventio *eventio_new(void)
+{
+    struct eventio *io = xzmalloc(sizeof(*io));
+
+#if defined(HAVE_SYS_EPOLL_H)
+    io->pfd = epoll_create(1024); /* size hint, ignored by modern kernels */
+    if (io->pfd < 0) {
+        free(io);
+        return NULL;
+    }
+    fcntl(io->pfd, F_SETFD, FD_CLOEXEC);
+#elif defined(HAVE_SYS_EVENT_H)
+    io->pfd = kqueue();
+    if (io->pfd < 0) {
+        free(io);
+        return NULL;
+    }
+#endif
+
+    return io;
+}
+
+EXPORTED void eventio_free(struct eventio **iop)
+{
+    struct eventio *io = *iop;
+    int fd;
+
+    if (!io) return;
+    *iop = NULL;
+
+    for (fd = 0; fd < io->regs_size; fd++)
+        free(io->regs[fd]);
+    free(io->regs);
+
+#if defined(HAVE_SYS_EPOLL_H) || defined(HAVE_SYS_EVENT_H)
+    close(io->pfd);
+#else
+    free(io->pollfds);
+    free(io->pollregs);
+#endif
+
+    free(io);
+}
+
+EXPORTED unsigned eventio_count(const struct eventio *io)
+{
+    return io->count;
+}
+
+EXPORTED int eventio_add(struct eventio *io, int fd, void *rock)
+{
+    struct eventio_reg *reg;
+
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (fd >= io->regs_size) {
+        int newsize = io->regs_size ? io->regs_size : 64;
+        while (fd >= newsize) newsize *= 2;
+        io->regs = xrealloc(io->regs, newsize * sizeof(io->regs[0]));
+        memset(io->regs + io->regs_size, 0,
+               (newsize - io->regs_size) * sizeof(io->regs[0]));
+        io->regs_size = newsize;
+    }
+
+    if (io->regs[fd]) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    reg = xmalloc(sizeof(*reg));
+    reg->fd = fd;
+    reg->rock = rock;
+
+#if defined(HAVE_SYS_EPOLL_H)
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = reg;
+        if (epoll_ctl(io->pfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            free(reg);
+            return -1;
+        }
+    }
+#elif defined(HAVE_SYS_EVENT_H)
+    {
+        struct kevent kev;
+        EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, reg);
+        if (kevent(io->pfd, &kev, 1, NULL, 0, NULL) < 0) {
+            free(reg);
+            return -1;
+        }
+    }
+#endif
+
+    io->regs[fd] = reg;
+    io->count++;
+    return 0;
+}
+
+EXPORTED int eventio_remove(struct eventio *io, int fd)
+{
+    struct eventio_reg *reg;
+
+    if (fd < 0 || fd >= io->regs_size || !io->regs[fd]) {
+        errno = ENOENT;
+        return -1;
+    }
+    reg = io->regs[fd];
+
+#if defined(HAVE_SYS_EPOLL_H)
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        /* the fd may already be closed - that removes it anyway */
+        epoll_ctl(io->pfd, EPOLL_CTL_DEL, fd, &ev);
+    }
+#elif defined(HAVE_SYS_EVENT_H)
+    {
+        struct kevent kev;
+        EV_SET(&kev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+        kevent(io->pfd, &kev, 1, NULL, 0, NULL);
+    }
+#endif
+
+    io->regs[fd] = NULL;
+    io->count--;
+    free(reg);
+    return 0;
+}
+
+EXPORTED int eventio_wait(struct eventio *io,
+                          struct eventio_event *events, int nevents,
+                          const struct timeval *timeout)
+{
+    int n, i;
+
+    if (nevents > EVENTIO_BATCH) nevents = EVENTIO_BATCH;
+
+#if defined(HAVE_SYS_EPOLL_H)
+    {
+        struct epoll_event evs[EVENTIO_BATCH];
+        int timeout_ms = timeout
+            ? timeout->tv_sec * 1000 + timeout->tv_usec / 1000
+            : -1;
+
+        n = epoll_wait(io->pfd, evs, nevents, timeout_ms);
+        if (n <= 0) return n;
+
+        for (i = 0; i < n; i++) {
+            struct eventio_reg *reg = evs[i].data.ptr;
+            events[i].fd = reg->fd;
+            events[i].rock = reg->rock;
+        }
+        return n;
+    }
+#elif defined(HAVE_SYS_EVENT_H)
+    {
+        struct kevent kevs[EVENTIO_BATCH];
+        struct timespec ts, *tsptr = NULL;
+
+        if (timeout) {
+            ts.tv_sec = timeout->tv_sec;
+            ts.tv_nsec = timeout->tv_usec * 1000;
+            tsptr = &ts;
+        }
+
+        n = kevent(io->pfd, NULL, 0, kevs, nevents, tsptr);
+        if (n <= 0) return n;
+
+        for (i = 0; i < n; i++) {
+            struct eventio_reg *reg = kevs[i].udata;
+            events[i].fd = reg->fd;
+            events[i].rock = reg->rock;
+        }
+        return n;
+    }
+#else
+    {
+        /* fallback: poll the whole set.  O(count) per wait, but still
+         * not limited to FD_SETSIZE */
+        int fd, nfds = 0, found = 0;
+        int timeout_ms = timeout
+            ? timeout->tv_sec * 1000 + timeout->tv_usec / 1000
+            : -1;
+
+        if ((int) io->count > io->pollfds_size) {
+            io->pollfds_size = io->count;
+            io->pollfds = xrealloc(io->pollfds,
+                                   io->pollfds_size * sizeof(io->pollfds[0]));
+            io->pollregs = xrealloc(io->pollregs,
+                                    io->pollfds_size * sizeof(io->pollregs[0]));
+        }
+
+        for (fd = 0; fd < io->regs_size; fd++) {
+            if (!io->regs[fd]) continue;
+            io->pollfds[nfds].fd = fd;
+            io->pollfds[nfds].events = POLLIN;
+            io->pollfds[nfds].revents = 0;
+            io->pollregs[nfds] = io->regs[fd];
+            nfds++;
+        }
+
+        n = poll(io->pollfds, nfds, timeout_ms);
+        if (n <= 0) return n;
+
+        for (i = 0; i < nfds && found < nevents; i++) {
+            if (!io->pollfds[i].revents) continue;
+            events[found].fd = io->pollregs[i]->fd;
+            events[found].rock = io->pollregs[i]->rock;
+            found++;
+        }
+        return found;
+    }
+#endif
+}
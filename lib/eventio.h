@@ -0,0 +1,79 @@
+/* eventio.h - scalable readiness notification for file descriptors
+ *
+ * Copyright (c) 1994-2017 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef INCLUDED_EVENTIO_H
+#define INCLUDED_EVENTIO_H
+
+#include <sys/time.h>
+
+/* A persistent set of file descriptors watched for readability,
+ * backed by epoll or kqueue where the platform has them (with a
+ * poll(2) fallback), so that waiting costs proportional to the number
+ * of ready descriptors rather than the number watched, and is not
+ * capped at FD_SETSIZE */
+
+struct eventio;
+
+struct eventio_event {
+    int fd;
+    void *rock;     /* as given to eventio_add() */
+};
+
+extern struct eventio *eventio_new(void);
+extern void eventio_free(struct eventio **iop);
+
+/* watch fd for readability.  'rock' is handed back with each event */
+extern int eventio_add(struct eventio *io, int fd, void *rock);
+extern int eventio_remove(struct eventio *io, int fd);
+
+/* number of descriptors currently watched */
+extern unsigned eventio_count(const struct eventio *io);
+
+/* wait for readability.  Fills in up to 'nevents' events and returns
+ * how many, 0 on timeout (NULL timeout means wait forever), or -1 on
+ * error with errno set (EINTR is passed through for the caller's
+ * signal handling) */
+extern int eventio_wait(struct eventio *io,
+                        struct eventio_event *events, int nevents,
+                        const struct timeval *timeout);
+
+#endif /* INCLUDED_EVENTIO_H */
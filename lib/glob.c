@@ -57,60 +57,33 @@
  */
 EXPORTED glob *glob_init(const char *str, char sep)
 {
-    struct buf buf = BUF_INITIALIZER;
+    glob *g = xmalloc(sizeof(glob));
+    char *dst = xmalloc(strlen(str) + 1);
+
+    g->pat = dst;
+    g->sep = sep;
 
-    buf_appendcstr(&buf, "(^");
     while (*str) {
-        switch (*str) {
-        case '*':
-        case '%':
+        if (*str == '*' || *str == '%') {
             /* remove duplicate hierarchy match (2) */
             while (*str == '%') ++str;
             /* If we found a '*', treat '%' as '*' (1) */
             if (*str == '*') {
                 /* remove duplicate wildcards (1) */
                 while (*str == '*' || (*str == '%' && str[1])) ++str;
-                buf_appendcstr(&buf, ".*");
+                *dst++ = '*';
             }
             else {
-                buf_appendcstr(&buf, "[^");
-                if (sep == '\\') buf_putc(&buf, '\\');
-                buf_putc(&buf, sep);
-                buf_appendcstr(&buf, "]*");
+                *dst++ = '%';
             }
-            break;
-        /* http://stackoverflow.com/questions/399078/what-special-characters-must-be-escaped-in-regular-expressions
-         * In POSIX basic regular expressions (BRE), these are metacharacters
-         * that you need to escape to suppress their meaning:
-         * .^$*
-         * (and we're already handling * above)
-         * also discovered that prceposix will segfault if we don't escape +, ?, and of course \
-         */
-        case '.':
-        case '^':
-        case '$':
-        case '+':
-        case '?':
-        case '(':
-        case ')':
-        case '[':
-        case ']':
-        case '\\':
-            buf_putc(&buf, '\\');
-            /* fall through */
-        default:
-            buf_putc(&buf, *str++);
-            break;
+        }
+        else {
+            *dst++ = *str++;
         }
     }
-    buf_appendcstr(&buf, ")([");
-    if (sep == '\\') buf_putc(&buf, '\\');
-    buf_putc(&buf, sep);
-    buf_appendcstr(&buf, "]|$)");
+    *dst = '\0';
 
-    glob *g = xmalloc(sizeof(glob));
-    regcomp(&g->regex, buf_cstring(&buf), 0);
-    buf_free(&buf);
+    g->prefixlen = strcspn(g->pat, "*%");
 
     return g;
 }
@@ -121,26 +94,74 @@ EXPORTED void glob_free(glob **gp)
 {
     glob *g = *gp;
     if (g) {
-        regfree(&g->regex);
+        free(g->pat);
         free(g);
     }
     *gp = NULL;
 }
 
+/* match the rest of the pattern against the rest of the name.  Returns
+ * the longest offset into the original name at which the whole pattern
+ * has matched and the next character is the hierarchy separator or the
+ * end of the name, or -1 if there is no such offset.  This is the same
+ * leftmost-longest answer the old regex engine gave for
+ *    (^pattern)([sep]|$)
+ * Recursion depth is bounded by the number of wildcards in the pattern.
+ */
+static int glob_run(const char *pat, const char *str, const char *base, char sep)
+{
+    for (;;) {
+        /* literals match byte for byte - including '?', which has not
+         * been a wildcard since the 2015 rewrite */
+        while (*pat && *pat != '*' && *pat != '%') {
+            if (*pat++ != *str++) return -1;
+        }
+
+        if (!*pat) {
+            if (*str && *str != sep) return -1;
+            return str - base;
+        }
+
+        /* '%' matches anything up to the next separator, '*' matches
+         * anything at all.  Try the longest extent first so the first
+         * success is also the longest match, and back off one byte at
+         * a time until the rest of the pattern fits */
+        const char *limit = str;
+        if (*pat == '*') {
+            limit += strlen(str);
+        }
+        else {
+            while (*limit && *limit != sep) ++limit;
+        }
+        ++pat;
+
+        /* a trailing wildcard's longest extent always ends at a valid
+         * boundary, so it is the answer */
+        if (!*pat) return limit - base;
+
+        while (limit > str) {
+            int n = glob_run(pat, limit, base, sep);
+            if (n >= 0) return n;
+            --limit;
+        }
+        /* zero-width wildcard: carry on with the rest of the pattern */
+    }
+}
+
 /* returns -1 if no match, otherwise length of match or partial-match
  *  g         pre-processed glob string
  *  ptr       string to perform glob on
- *  len       length of ptr string
- *  min       pointer to minimum length of a valid partial-match
- *            set to return value + 1 on partial match, otherwise -1
- *            if NULL, partial matches not allowed
  */
 EXPORTED int glob_test(glob *g, const char *str)
 {
-    regmatch_t match[3];
-
-    if (regexec(&g->regex, str, 2, match, 0))
-        return -1;
+    return glob_run(g->pat, str, str, g->sep);
+}
 
-    return match[1].rm_eo;
+/* literal prefix of the compiled pattern -- every match starts with
+ * these bytes, so they bound the keyspace a caller needs to scan
+ */
+EXPORTED const char *glob_prefix(glob *g, size_t *lenp)
+{
+    *lenp = g->prefixlen;
+    return g->pat;
 }
@@ -54,7 +54,9 @@
 /* "compiled" glob structure: may change
  */
 typedef struct glob {
-    regex_t regex;
+    char *pat;          /* canonical pattern: wildcard runs collapsed */
+    size_t prefixlen;   /* literal bytes in pat before the first wildcard */
+    char sep;           /* hierarchy separator */
 } glob;
 
 /* initialize globbing structure
@@ -73,6 +75,13 @@ extern void glob_free(glob **gp);
  */
 extern int glob_test(glob *g, const char *str);
 
+/* literal prefix of the pattern -- the bytes every matching name must
+ * start with, so callers can bound a database range scan and verify
+ * the candidates with glob_test().  Returns the prefix (not NUL
+ * terminated, valid until glob_free) and its length in *lenp.
+ */
+extern const char *glob_prefix(glob *g, size_t *lenp);
+
 /* MACROS */
 #define GLOB_MATCH(g, str) ((int)strlen(str) == glob_test((g), (str)))
 
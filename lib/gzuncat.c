@@ -81,6 +81,16 @@
 
 static const size_t default_in_buf_size = 16 * 1024;
 
+/* optional process-wide hook, called with the number of compressed
+ * bytes each time some are read from the underlying file.  used by
+ * tools that need to throttle their aggregate read rate */
+static gzuc_read_hook_cb *gzuc_read_hook = NULL;
+
+EXPORTED void gzuc_set_read_hook(gzuc_read_hook_cb *hook)
+{
+    gzuc_read_hook = hook;
+}
+
 struct gzuncat {
     int   fd;
     off_t current_offset;
@@ -198,6 +208,21 @@ done:
     return r;
 }
 
+/* stop reading the current member without decompressing the rest of it.
+ * unlike gzuc_member_end, the start of the next member is not discovered,
+ * so the next member can only be started with gzuc_member_start_from()
+ */
+EXPORTED void gzuc_member_abort(struct gzuncat *gz)
+{
+    if (gz->current_offset < 0) return;
+
+    inflateEnd(&gz->strm);
+    gz->current_offset = -1;
+    gz->next_offset = -1;
+    gz->member_eof = -1;
+    gz->bytes_read = 0;
+}
+
 EXPORTED void gzuc_free(struct gzuncat **gzp)
 {
     if (!gzp) return;
@@ -257,6 +282,7 @@ EXPORTED ssize_t gzuc_read(struct gzuncat *gz, void *buf, size_t count)
                 break;
             }
             else {
+                if (gzuc_read_hook) gzuc_read_hook(r);
                 gz->strm.avail_in = r;
                 gz->strm.next_in = gz->in_buf;
             }
@@ -50,6 +50,9 @@
 
 struct gzuncat;
 
+typedef void gzuc_read_hook_cb(size_t bytes);
+void gzuc_set_read_hook(gzuc_read_hook_cb *hook);
+
 struct gzuncat *gzuc_new(int fd);
 void gzuc_free(struct gzuncat **gzp);
 
@@ -57,6 +60,7 @@ int gzuc_set_bufsize(struct gzuncat *gz, size_t size);
 int gzuc_member_start_from(struct gzuncat *gz, off_t offset);
 int gzuc_member_start(struct gzuncat *gz);
 int gzuc_member_end(struct gzuncat *gz, off_t *offset);
+void gzuc_member_abort(struct gzuncat *gz);
 int gzuc_member_eof(struct gzuncat *gz);
 int gzuc_eof(struct gzuncat *gz);
 ssize_t gzuc_read(struct gzuncat *gz, void *buf, size_t count);
@@ -347,3 +347,237 @@ EXPORTED int hash_numrecords(hash_table *table)
 
     return count;
 }
+
+/*
+** Open-addressing (robin hood) variant - see hash.h.  Slots keep
+** short keys inline and entries are kept ordered by probe distance,
+** so lookups touch a short contiguous run of one flat array instead
+** of chasing per-node allocations.
+*/
+
+/* empty slots have hash 0, so never use 0 as a real hash value */
+static unsigned hash2_val(const char *key)
+{
+    unsigned h = strhash(key);
+    return h ? h : 1;
+}
+
+static const char *hash2_key(const hash2_slot *slot)
+{
+    return slot->keyptr ? slot->keyptr : slot->inlkey;
+}
+
+static void hash2_setkey(hash2_slot *slot, const char *key)
+{
+    size_t len = strlen(key);
+
+    if (len <= HASH2_INLINE_KEYLEN) {
+        memcpy(slot->inlkey, key, len+1);
+        slot->keyptr = NULL;
+    }
+    else {
+        slot->keyptr = xstrdup(key);
+    }
+}
+
+/* how far 'slot' has been pushed from its home bucket */
+static size_t hash2_distance(const hash2_slot *slot, size_t pos, size_t mask)
+{
+    return (pos - (slot->hash & mask)) & mask;
+}
+
+/* place an already-constructed slot, robbing richer entries as we go.
+** Only used with keys known not to be in the table */
+static void hash2_place(hash_table2 *table, hash2_slot slot)
+{
+    size_t mask = table->size - 1;
+    size_t pos = slot.hash & mask;
+    size_t dist = 0;
+
+    for (;;) {
+        hash2_slot *cur = &table->table[pos];
+
+        if (!cur->hash) {
+            *cur = slot;
+            return;
+        }
+
+        size_t curdist = hash2_distance(cur, pos, mask);
+        if (curdist < dist) {
+            /* the resident is closer to home than we are - swap, and
+             * carry on placing the displaced entry */
+            hash2_slot tmp = *cur;
+            *cur = slot;
+            slot = tmp;
+            dist = curdist;
+        }
+
+        pos = (pos + 1) & mask;
+        dist++;
+    }
+}
+
+static void hash2_grow(hash_table2 *table, size_t newsize)
+{
+    hash2_slot *oldtable = table->table;
+    size_t oldsize = table->size;
+    size_t i;
+
+    table->size = newsize;
+    table->table = xzmalloc(newsize * sizeof(hash2_slot));
+
+    for (i = 0; i < oldsize; i++) {
+        if (oldtable[i].hash)
+            hash2_place(table, oldtable[i]);
+    }
+
+    free(oldtable);
+}
+
+EXPORTED hash_table2 *construct_hash_table2(hash_table2 *table, size_t size)
+{
+    size_t slots = 16;
+
+    assert(table);
+    assert(size);
+
+    /* size is a hint for the number of entries: leave probing
+     * headroom, and round up to a power of two for cheap masking */
+    while (slots < size + size/4)
+        slots <<= 1;
+
+    table->size = slots;
+    table->count = 0;
+    table->table = xzmalloc(slots * sizeof(hash2_slot));
+
+    return table;
+}
+
+/* find the slot holding 'key', or NULL.  Probe runs are ordered by
+** distance, so we can stop as soon as we pass our own distance */
+static hash2_slot *hash2_find(const char *key, unsigned hash,
+                              const hash_table2 *table)
+{
+    size_t mask = table->size - 1;
+    size_t pos = hash & mask;
+    size_t dist = 0;
+
+    for (;;) {
+        hash2_slot *cur = &table->table[pos];
+
+        if (!cur->hash)
+            return NULL;
+        if (hash2_distance(cur, pos, mask) < dist)
+            return NULL;
+        if (cur->hash == hash && !strcmp(key, hash2_key(cur)))
+            return cur;
+
+        pos = (pos + 1) & mask;
+        dist++;
+    }
+}
+
+EXPORTED void *hash_insert2(const char *key, void *data, hash_table2 *table)
+{
+    unsigned hash = hash2_val(key);
+    hash2_slot *cur = hash2_find(key, hash, table);
+
+    if (cur) {
+        void *old_data = cur->data;
+        cur->data = data;
+        return old_data;
+    }
+
+    /* grow at 7/8 load */
+    if ((table->count + 1) * 8 >= table->size * 7)
+        hash2_grow(table, table->size * 2);
+
+    hash2_slot slot;
+    memset(&slot, 0, sizeof(slot));
+    slot.hash = hash;
+    slot.data = data;
+    hash2_setkey(&slot, key);
+    hash2_place(table, slot);
+    table->count++;
+
+    return data;
+}
+
+EXPORTED void *hash_lookup2(const char *key, hash_table2 *table)
+{
+    hash2_slot *cur;
+
+    if (!table->size) return NULL;
+
+    cur = hash2_find(key, hash2_val(key), table);
+    return cur ? cur->data : NULL;
+}
+
+EXPORTED void *hash_del2(const char *key, hash_table2 *table)
+{
+    size_t mask = table->size - 1;
+    hash2_slot *cur;
+    void *data;
+    size_t pos;
+
+    if (!table->size) return NULL;
+
+    cur = hash2_find(key, hash2_val(key), table);
+    if (!cur) return NULL;
+
+    data = cur->data;
+    free(cur->keyptr);
+    table->count--;
+
+    /* backward-shift deletion keeps probe runs gap-free, so no
+     * tombstones are needed */
+    pos = cur - table->table;
+    for (;;) {
+        size_t next = (pos + 1) & mask;
+        hash2_slot *nslot = &table->table[next];
+
+        if (!nslot->hash || !hash2_distance(nslot, next, mask))
+            break;
+
+        table->table[pos] = *nslot;
+        pos = next;
+    }
+    memset(&table->table[pos], 0, sizeof(hash2_slot));
+
+    return data;
+}
+
+EXPORTED void hash_enumerate2(hash_table2 *table,
+                              void (*func)(const char *, void *, void *),
+                              void *rock)
+{
+    size_t i;
+
+    for (i = 0; i < table->size; i++) {
+        hash2_slot *cur = &table->table[i];
+        if (cur->hash)
+            func(hash2_key(cur), cur->data, rock);
+    }
+}
+
+EXPORTED int hash_numrecords2(hash_table2 *table)
+{
+    return table->count;
+}
+
+EXPORTED void free_hash_table2(hash_table2 *table, void (*func)(void *))
+{
+    size_t i;
+
+    for (i = 0; i < table->size; i++) {
+        hash2_slot *cur = &table->table[i];
+        if (!cur->hash) continue;
+        if (func) func(cur->data);
+        free(cur->keyptr);
+    }
+
+    free(table->table);
+    table->table = NULL;
+    table->size = 0;
+    table->count = 0;
+}
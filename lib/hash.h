@@ -99,4 +99,51 @@ int hash_numrecords(hash_table *table);
 
 void free_hash_table(hash_table *table, void (*func)(void *));
 
+/*
+** Open-addressing variant.  One flat slot array, robin hood probing,
+** and keys up to HASH2_INLINE_KEYLEN bytes stored inline in the slot,
+** so the common case does no per-node allocation and no pointer
+** chasing.  Unlike hash_table the slot array grows itself, so the
+** construction size is only a hint.  Suited to tables that are built,
+** probed heavily and then thrown away in one go (e.g. the delivery
+** header cache); the API mirrors the chained table with a '2' suffix.
+*/
+
+#define HASH2_INLINE_KEYLEN 23
+
+typedef struct hash2_slot {
+    unsigned hash;              /* 0 means the slot is empty */
+    void *data;
+    char *keyptr;               /* heap copy, only for long keys */
+    char inlkey[HASH2_INLINE_KEYLEN+1];
+} hash2_slot;
+
+typedef struct hash_table2 {
+    size_t size;                /* slot count, always a power of two */
+    size_t count;
+    hash2_slot *table;
+} hash_table2;
+
+#define HASH_TABLE2_INITIALIZER {0, 0, NULL}
+
+hash_table2 *construct_hash_table2(hash_table2 *table, size_t size);
+
+/* same contract as hash_insert: returns the old data pointer if 'key'
+** was already present, otherwise 'data' */
+void *hash_insert2(const char *key, void *data, hash_table2 *table);
+
+void *hash_lookup2(const char *key, hash_table2 *table);
+
+/* returns the data that was associated with 'key', or NULL */
+void *hash_del2(const char *key, hash_table2 *table);
+
+void hash_enumerate2(hash_table2 *table,
+                     void (*func)(const char *, void *, void *), void *rock);
+
+int hash_numrecords2(hash_table2 *table);
+
+/* bulk free: one pass over the slot array, calling 'func' (if
+** non-NULL) on each data pointer, then a single free of the array */
+void free_hash_table2(hash_table2 *table, void (*func)(void *));
+
 #endif /* HASH__H */
@@ -4,6 +4,9 @@
 
 #include <string.h>
 
+
+#define HTMLCHAR_NUM_STRINGS 2125
+
 extern int htmlchar_from_string(const char *s);
 extern int htmlchar_from_string_len(const char *s, size_t len);
 
@@ -935,112 +935,171 @@ EXPORTED void imclient_getselectinfo(struct imclient *imclient, int *fd,
 }
 
 /*
- * Process one input or output event on the connection 'imclient'.
+ * Try to make progress on the connection 'imclient': flush pending
+ * output, or read input if 'canread' says the file descriptor is
+ * readable.  Returns nonzero iff an event was processed.
  */
-EXPORTED void imclient_processoneevent(struct imclient *imclient)
+static int imclient_processevent(struct imclient *imclient, int canread)
 {
     char buf[IMCLIENT_BUFSIZE];
     int n;
     int writelen;
-    fd_set rfds, wfds;
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
 
-    assert(imclient);
+    writelen = imclient->outptr - imclient->outstart;
 
-    for (;;) {
-        writelen = imclient->outptr - imclient->outstart;
+    if ((imclient->saslcompleted==1) && (writelen>0)) {
+        unsigned int cryptlen=0;
+        const char *cryptptr=NULL;
 
-        if ((imclient->saslcompleted==1) && (writelen>0)) {
-            unsigned int cryptlen=0;
-            const char *cryptptr=NULL;
-
-          if (sasl_encode(imclient->saslconn, imclient->outstart, writelen,
-                          &cryptptr,&cryptlen)!=SASL_OK)
-          {
-              /* XXX encoding error */
-              n=0;
-          }
+      if (sasl_encode(imclient->saslconn, imclient->outstart, writelen,
+                      &cryptptr,&cryptlen)!=SASL_OK)
+      {
+          /* XXX encoding error */
+          n=0;
+      }
 
 #ifdef HAVE_SSL
-          if (imclient->tls_on==1)
-          {
-            n = SSL_write(imclient->tls_conn, cryptptr, cryptlen);
-          } else {
-            n = write(imclient->fd, cryptptr, cryptlen);
-          }
+      if (imclient->tls_on==1)
+      {
+        n = SSL_write(imclient->tls_conn, cryptptr, cryptlen);
+      } else {
+        n = write(imclient->fd, cryptptr, cryptlen);
+      }
 #else  /* HAVE_SSL */
-          n = write(imclient->fd, cryptptr,
-                    cryptlen);
+      n = write(imclient->fd, cryptptr,
+                cryptlen);
 #endif /* HAVE_SSL */
 
-          if (n > 0) {
-            imclient->outstart += writelen;
-            return;
-          }
+      if (n > 0) {
+        imclient->outstart += writelen;
+        return 1;
+      }
 
-          /* XXX Also EPIPE & the like? */
-          /* Make sure we select() for writing */
+      /* XXX Also EPIPE & the like? */
+      /* Make sure we select() for writing */
 
-        }
-        else if (writelen) {
+    }
+    else if (writelen) {
 
-          /* No protection mechanism, just write the plaintext */
+      /* No protection mechanism, just write the plaintext */
 
 #ifdef HAVE_SSL
-          if (imclient->tls_on==1)
-          {
-            n = SSL_write(imclient->tls_conn, imclient->outstart, writelen);
-          } else {
-            n = write(imclient->fd, imclient->outstart, writelen);
-          }
+      if (imclient->tls_on==1)
+      {
+        n = SSL_write(imclient->tls_conn, imclient->outstart, writelen);
+      } else {
+        n = write(imclient->fd, imclient->outstart, writelen);
+      }
 #else  /* HAVE_SSL */
-          n = write(imclient->fd, imclient->outstart, writelen);
+      n = write(imclient->fd, imclient->outstart, writelen);
 #endif /* HAVE_SSL */
 
 
-            if (n > 0) {
-                imclient->outstart += n;
-                return;
-            }
-            /* XXX Also EPIPE & the like? */
+        if (n > 0) {
+            imclient->outstart += n;
+            return 1;
         }
+        /* XXX Also EPIPE & the like? */
+    }
 
-        if (FD_ISSET(imclient->fd, &rfds))
-        {
+    if (canread)
+    {
 #ifdef HAVE_SSL
-          /* just do a SSL read instead if we're under a tls layer */
-          if (imclient->tls_on==1)
-          {
-            n = SSL_read(imclient->tls_conn, buf, sizeof(buf));
+      /* just do a SSL read instead if we're under a tls layer */
+      if (imclient->tls_on==1)
+      {
+        n = SSL_read(imclient->tls_conn, buf, sizeof(buf));
 
-          } else {
-            n = read(imclient->fd, buf, sizeof(buf));
-          }
+      } else {
+        n = read(imclient->fd, buf, sizeof(buf));
+      }
 
 #else  /* HAVE_SSL */
-          n = read(imclient->fd, buf, sizeof(buf));
+      n = read(imclient->fd, buf, sizeof(buf));
 #endif /* HAVE_SSL */
 
-          if (n >= 0) {
-            if (n == 0) {
-              imclient_eof(imclient);
-            }
-            else {
-              imclient_input(imclient, buf, n);
-            }
-            return;
-          }
+      if (n >= 0) {
+        if (n == 0) {
+          imclient_eof(imclient);
         }
+        else {
+          imclient_input(imclient, buf, n);
+        }
+        return 1;
+      }
+    }
+
+    return 0;
+}
+
+/*
+ * Process one input or output event on the connection 'imclient'.
+ */
+EXPORTED void imclient_processoneevent(struct imclient *imclient)
+{
+    fd_set rfds, wfds;
+    int canread = 0;
+
+    assert(imclient);
+
+    for (;;) {
+        if (imclient_processevent(imclient, canread)) return;
 
         FD_ZERO(&rfds);
         FD_ZERO(&wfds);
         FD_SET(imclient->fd, &rfds);
-        if (writelen) FD_SET(imclient->fd, &wfds);
+        if (imclient->outptr - imclient->outstart)
+            FD_SET(imclient->fd, &wfds);
         (void) select(imclient->fd + 1, &rfds, &wfds, (fd_set *)0, 0);
+        canread = FD_ISSET(imclient->fd, &rfds);
     }
 }
 
+/*
+ * Process events across several connections at once, so that commands
+ * issued concurrently (via imclient_send) on 'nclients' connections
+ * complete in the time of the slowest round trip rather than the sum
+ * of them.  Waits up to 'timeout' (NULL to wait forever) for any of
+ * the connections in 'imclients' to become ready, then services every
+ * one that is.  Completion is signalled through the usual callbacks;
+ * keep calling this until all of them have fired.
+ * Returns the number of connections serviced, 0 on timeout, or -1 on
+ * select() error.
+ */
+EXPORTED int imclient_processevents(struct imclient **imclients, int nclients,
+                                    struct timeval *timeout)
+{
+    fd_set rfds, wfds;
+    int maxfd = -1;
+    int i, n;
+    int serviced = 0;
+
+    assert(imclients || !nclients);
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    for (i = 0; i < nclients; i++) {
+        struct imclient *imclient = imclients[i];
+        FD_SET(imclient->fd, &rfds);
+        if (imclient->outptr - imclient->outstart)
+            FD_SET(imclient->fd, &wfds);
+        if (imclient->fd > maxfd) maxfd = imclient->fd;
+    }
+
+    n = select(maxfd + 1, &rfds, &wfds, (fd_set *)0, timeout);
+    if (n <= 0) return n;
+
+    for (i = 0; i < nclients; i++) {
+        struct imclient *imclient = imclients[i];
+        if (FD_ISSET(imclient->fd, &rfds) || FD_ISSET(imclient->fd, &wfds)) {
+            if (imclient_processevent(imclient, FD_ISSET(imclient->fd, &rfds)))
+                serviced++;
+        }
+    }
+
+    return serviced;
+}
+
 enum replytype {replytype_inprogress, replytype_ok, replytype_no,
                   replytype_bad, replytype_prematureok};
 
@@ -43,6 +43,7 @@
 #ifndef INCLUDED_IMCLIENT_H
 #define INCLUDED_IMCLIENT_H
 
+#include <sys/time.h>
 #include <sasl/sasl.h>
 
 struct imclient;
@@ -76,6 +77,10 @@ extern void imclient_send(struct imclient *imclient,
                           imclient_proc_t *proc, void *rock,
                           const char *fmt, ...);
 extern void imclient_processoneevent(struct imclient *imclient);
+/* service whichever of several connections are ready, so concurrent
+ * commands complete in the slowest round trip, not the sum of them */
+extern int imclient_processevents(struct imclient **imclients, int nclients,
+                                  struct timeval *timeout);
 extern void imclient_getselectinfo(struct imclient *imclient,
                                    int *fd, int *wanttowrite);
 
@@ -61,6 +61,8 @@
 #include "xstrlcpy.h"
 #include "util.h"
 
+#define OPTHASHSIZE 512   /* sized for one entry per imapopts[] option */
+
 #define CONFIGHASHSIZE 30 /* relatively small,
                            * because it is for overflow only */
 #define INCLUDEHASHSIZE 5 /* relatively small,
@@ -68,6 +70,16 @@
 
 static struct hash_table confighash, includehash;
 
+/* precomputed option-name -> enum index table, so parsing the config
+ * file doesn't linear-scan imapopts[] for every line */
+static struct hash_table opthash;
+static int opthash_built = 0;
+
+/* pre-resolved overflow view for this service: <ident>_key entries
+ * folded over the generic ones, so hot-path lookups are a single hash
+ * probe with no key rewriting */
+static struct hash_table *overlayhash = NULL;
+
 /* cached configuration variables accessible to the external world */
 EXPORTED const char *config_filename= NULL;       /* filename of configuration file */
 EXPORTED const char *config_dir = NULL;          /* ie /var/imap */
@@ -93,6 +105,71 @@ extern void fatal(const char *fatal_message, int fatal_code)
 /* prototype to allow for sane function ordering */
 static void config_read_file(const char *filename);
 
+static void config_buildopthash(void)
+{
+    enum imapopt opt;
+
+    if (opthash_built) return;
+
+    if (!construct_hash_table(&opthash, OPTHASHSIZE, 1))
+        fatal("could not construct option name table", EC_CONFIG);
+
+    for (opt = IMAPOPT_ZERO; opt < IMAPOPT_LAST; opt++) {
+        if (imapopts[opt].t == OPT_NOTOPT) continue;
+        /* stored off by one so a miss is distinguishable from NULL */
+        hash_insert(imapopts[opt].optname,
+                    (void *)((uintptr_t) opt + 1), &opthash);
+    }
+
+    opthash_built = 1;
+}
+
+/* look up an option name; returns IMAPOPT_LAST if it isn't one */
+static enum imapopt config_findopt(const char *name)
+{
+    void *val = hash_lookup(name, &opthash);
+
+    return val ? (enum imapopt) ((uintptr_t) val - 1) : IMAPOPT_LAST;
+}
+
+static void config_overlay_generic_cb(const char *key, void *data, void *rock)
+{
+    hash_insert(key, data, (struct hash_table *) rock);
+}
+
+static void config_overlay_service_cb(const char *key, void *data, void *rock)
+{
+    size_t idlen = strlen(config_ident);
+
+    if (!strncmp(key, config_ident, idlen) && key[idlen] == '_')
+        hash_insert(key + idlen + 1, data, (struct hash_table *) rock);
+}
+
+/* (Re)build the pre-resolved overflow view for config_ident.  The new
+ * view is built aside and swapped in, so a rebuild for another service
+ * identity never leaves lookups without a table */
+static void config_build_overlay(void)
+{
+    struct hash_table *view = xzmalloc(sizeof(struct hash_table));
+    struct hash_table *old = overlayhash;
+
+    if (!construct_hash_table(view, CONFIGHASHSIZE, 1))
+        fatal("could not construct configuration overlay table", EC_CONFIG);
+
+    /* generic entries first; service-specific entries replace them */
+    hash_enumerate(&confighash, config_overlay_generic_cb, view);
+    if (config_ident)
+        hash_enumerate(&confighash, config_overlay_service_cb, view);
+
+    overlayhash = view;
+
+    if (old) {
+        /* values are owned by confighash */
+        free_hash_table(old, NULL);
+        free(old);
+    }
+}
+
 EXPORTED const char *config_getstring(enum imapopt opt)
 {
     assert(opt > IMAPOPT_ZERO && opt < IMAPOPT_LAST);
@@ -153,6 +230,17 @@ EXPORTED const char *config_getoverflowstring(const char *key, const char *def)
 
     if (!config_filename) return 0;
 
+    if (overlayhash) {
+        /* service overrides are already folded into the overlay */
+        if (strlcpy(buf, key, sizeof(buf)) >= sizeof(buf))
+            fatal("key too long in config_getoverflowstring", EC_TEMPFAIL);
+
+        lcase(buf);
+        ret = hash_lookup(buf, overlayhash);
+
+        return ret ? ret : def;
+    }
+
     /* First lookup <ident>_key, to see if we have a service-specific
      * override */
 
@@ -317,8 +405,20 @@ EXPORTED void config_reset(void)
     }
     config_dir = NULL;
 
+    /* free the overlay view before the values it borrows */
+    if (overlayhash) {
+        free_hash_table(overlayhash, NULL);
+        free(overlayhash);
+        overlayhash = NULL;
+    }
+
     /* free the overflow table */
     free_hash_table(&confighash, free);
+
+    if (opthash_built) {
+        free_hash_table(&opthash, NULL);
+        opthash_built = 0;
+    }
 }
 
 static const unsigned char qos[] = {
@@ -350,6 +450,8 @@ EXPORTED void config_read(const char *alt_config, const int config_need_data)
         fatal("could not construct include file  hash table", EC_CONFIG);
     }
 
+    config_buildopthash();
+
     config_read_file(config_filename);
 
     free_hash_table(&includehash, NULL);
@@ -408,6 +510,9 @@ EXPORTED void config_read(const char *alt_config, const int config_need_data)
         }
     }
 
+    /* snapshot the pre-resolved overflow view for this service */
+    config_build_overlay();
+
     /* Look up default partition */
     config_defpartition = config_getstring(IMAPOPT_DEFAULTPARTITION);
     for (p = (char *)config_defpartition; p && *p; p++) {
@@ -620,23 +725,17 @@ static void config_read_file(const char *filename)
 
         /* look for a service_ prefix match in imapopts */
         if (srvkey) {
-            for (opt = IMAPOPT_ZERO; opt < IMAPOPT_LAST; opt++) {
-                if (!strcasecmp(imapopts[opt].optname, srvkey)) {
-                    key = srvkey;
-                    service_specific = 1;
-                    break;
-                }
+            opt = config_findopt(srvkey);
+            if (opt != IMAPOPT_LAST) {
+                key = srvkey;
+                service_specific = 1;
             }
         }
 
         /* Did not find a service_ specific match, try looking for an
          * exact match */
         if (!service_specific) {
-            for (opt = IMAPOPT_ZERO; opt < IMAPOPT_LAST; opt++) {
-                if (!strcasecmp(imapopts[opt].optname, key)) {
-                    break;
-                }
-            }
+            opt = config_findopt(key);
         }
 
         /* If both of those loops failed, it goes verbatim into the
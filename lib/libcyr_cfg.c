@@ -81,6 +81,14 @@ static struct cyrusopt_s cyrus_options[] = {
       CFGVAL(long, 3 * 60 * 60), /* 3 hours */
       CYRUS_OPT_INT },
 
+    { CYRUSOPT_PTS_CACHE_NEGATIVE_TIMEOUT,
+      CFGVAL(long, 60), /* 1 minute */
+      CYRUS_OPT_INT },
+
+    { CYRUSOPT_PTS_CACHE_REFRESH_WINDOW,
+      CFGVAL(long, 0),
+      CYRUS_OPT_INT },
+
     { CYRUSOPT_CONFIG_DIR,
       CFGVAL(const char *, "/var/imap"),
       CYRUS_OPT_STRING },
@@ -145,6 +153,26 @@ static struct cyrusopt_s cyrus_options[] = {
       CFGVAL(long, 1),
       CYRUS_OPT_SWITCH },
 
+    { CYRUSOPT_TWOSKIP_LOCKLESS_READS,
+      CFGVAL(long, 0),
+      CYRUS_OPT_SWITCH },
+
+    { CYRUSOPT_SHARDED_DB_SHARDS,
+      CFGVAL(long, 8),
+      CYRUS_OPT_INT },
+
+    { CYRUSOPT_FLAT_INDEX,
+      CFGVAL(long, 0),
+      CYRUS_OPT_SWITCH },
+
+    { CYRUSOPT_TWOSKIP_PREFIX_COMPRESSION,
+      CFGVAL(long, 0),
+      CYRUS_OPT_SWITCH },
+
+    { CYRUSOPT_TWOSKIP_CRC32C,
+      CFGVAL(long, 0),
+      CYRUS_OPT_SWITCH },
+
     { CYRUSOPT_LAST, { NULL }, CYRUS_OPT_NOTOPT }
 };
 
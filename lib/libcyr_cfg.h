@@ -73,6 +73,10 @@ enum cyrus_opt {
     CYRUSOPT_TEMP_PATH,
     /* PTS Cache Timeout */
     CYRUSOPT_PTS_CACHE_TIMEOUT,
+    /* PTS negative-result cache timeout */
+    CYRUSOPT_PTS_CACHE_NEGATIVE_TIMEOUT,
+    /* PTS cache refresh-ahead window (OFF) */
+    CYRUSOPT_PTS_CACHE_REFRESH_WINDOW,
     /* IMAPd config directory */
     CYRUSOPT_CONFIG_DIR,
     /* CyrusDB INIT flags */
@@ -105,6 +109,16 @@ enum cyrus_opt {
     CYRUSOPT_SQL_USESSL,
     /* Checkpoint after every recovery (OFF) */
     CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
+    /* Optimistic lockless reads for the twoskip backend (OFF) */
+    CYRUSOPT_TWOSKIP_LOCKLESS_READS,
+    /* Shard count for new "sharded" backend databases (8) */
+    CYRUSOPT_SHARDED_DB_SHARDS,
+    /* Offset index for reads in the flat backend (OFF) */
+    CYRUSOPT_FLAT_INDEX,
+    /* Front-coded keys in the twoskip backend (OFF) */
+    CYRUSOPT_TWOSKIP_PREFIX_COMPRESSION,
+    /* crc32c checksums in new twoskip files (OFF) */
+    CYRUSOPT_TWOSKIP_CRC32C,
 
     CYRUSOPT_LAST
 
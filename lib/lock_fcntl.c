@@ -48,6 +48,7 @@
 #include <errno.h>
 
 #include "cyr_lock.h"
+#include "lockstat.h"
 
 EXPORTED const char *lock_method_desc = "fcntl";
 
@@ -72,6 +73,7 @@ EXPORTED int lock_reopen_ex(int fd, const char *filename,
     int r;
     struct flock fl;
     struct stat sbuffile, sbufspare;
+    struct lockstat_timer lt;
     int newfd;
 
     if (!sbuf) sbuf = &sbufspare;
@@ -81,12 +83,15 @@ EXPORTED int lock_reopen_ex(int fd, const char *filename,
         fl.l_whence = SEEK_SET;
         fl.l_start = 0;
         fl.l_len = 0;
+        lockstat_wait_start(&lt, filename, /*exclusive*/1);
         r = fcntl(fd, F_SETLKW, &fl);
         if (r == -1) {
             if (errno == EINTR) continue;
             if (failaction) *failaction = "locking";
+            lockstat_wait_end(&lt, -1);
             return -1;
         }
+        lockstat_wait_end(&lt, 0);
 
         r = fstat(fd, sbuf);
         if (!r) r = stat(filename, &sbuffile);
@@ -106,6 +111,9 @@ EXPORTED int lock_reopen_ex(int fd, const char *filename,
             r = lock_unlock(fd, filename);
             return -1;
         }
+        /* the dup2 drops the old lock without coming through
+         * lock_unlock() */
+        lockstat_unlock(filename);
         dup2(newfd, fd);
         close(newfd);
     }
@@ -121,21 +129,27 @@ EXPORTED int lock_reopen_ex(int fd, const char *filename,
  * appropriate error code.
  */
 EXPORTED int lock_setlock(int fd, int exclusive, int nonblock,
-                          const char *filename  __attribute__((unused)))
+                          const char *filename)
 {
     int r;
     struct flock fl;
+    struct lockstat_timer lt;
     int type = (exclusive ? F_WRLCK : F_RDLCK);
     int cmd = (nonblock ? F_SETLK : F_SETLKW);
 
+    lockstat_wait_start(&lt, filename, exclusive);
     for (;;) {
         fl.l_type= type;
         fl.l_whence = SEEK_SET;
         fl.l_start = 0;
         fl.l_len = 0;
         r = fcntl(fd, cmd, &fl);
-        if (r != -1) return 0;
+        if (r != -1) {
+            lockstat_wait_end(&lt, 0);
+            return 0;
+        }
         if (errno == EINTR) continue;
+        lockstat_wait_end(&lt, -1);
         return -1;
     }
 }
@@ -143,7 +157,7 @@ EXPORTED int lock_setlock(int fd, int exclusive, int nonblock,
 /*
  * Release any lock on 'fd'.  Always returns success.
  */
-EXPORTED int lock_unlock(int fd, const char *filename __attribute__((unused)))
+EXPORTED int lock_unlock(int fd, const char *filename)
 {
     struct flock fl;
     int r;
@@ -155,7 +169,10 @@ EXPORTED int lock_unlock(int fd, const char *filename __attribute__((unused)))
 
     for (;;) {
         r = fcntl(fd, F_SETLKW, &fl);
-        if (r != -1) return 0;
+        if (r != -1) {
+            lockstat_unlock(filename);
+            return 0;
+        }
         if (errno == EINTR) continue;
         /* xxx help! */
         return -1;
@@ -50,6 +50,7 @@
 #endif
 
 #include "cyr_lock.h"
+#include "lockstat.h"
 
 EXPORTED const char *lock_method_desc = "flock";
 
@@ -73,17 +74,21 @@ EXPORTED int lock_reopen_ex(int fd, const char *filename,
 {
     int r;
     struct stat sbuffile, sbufspare;
+    struct lockstat_timer lt;
     int newfd;
 
     if (!sbuf) sbuf = &sbufspare;
 
     for (;;) {
+        lockstat_wait_start(&lt, filename, /*exclusive*/1);
         r = flock(fd, LOCK_EX);
         if (r == -1) {
             if (errno == EINTR) continue;
             if (failaction) *failaction = "locking";
+            lockstat_wait_end(&lt, -1);
             return -1;
         }
+        lockstat_wait_end(&lt, 0);
 
         r = fstat(fd, sbuf);
         if (!r) r = stat(filename, &sbuffile);
@@ -103,6 +108,9 @@ EXPORTED int lock_reopen_ex(int fd, const char *filename,
             lock_unlock(fd, filename);
             return -1;
         }
+        /* the dup2 drops the old lock without coming through
+         * lock_unlock() */
+        lockstat_unlock(filename);
         dup2(newfd, fd);
         close(newfd);
     }
@@ -118,16 +126,22 @@ EXPORTED int lock_reopen_ex(int fd, const char *filename,
  * appropriate error code.
  */
 EXPORTED int lock_setlock(int fd, int exclusive, int nonblock,
-                          const char *filename __attribute__((unused)))
+                          const char *filename)
 {
     int r;
+    struct lockstat_timer lt;
     int op = (exclusive ? LOCK_EX : LOCK_SH);
     if (nonblock) op |= LOCK_NB;
 
+    lockstat_wait_start(&lt, filename, exclusive);
     for (;;) {
         r = flock(fd, op);
-        if (r != -1) return 0;
+        if (r != -1) {
+            lockstat_wait_end(&lt, 0);
+            return 0;
+        }
         if (errno == EINTR) continue;
+        lockstat_wait_end(&lt, -1);
         return -1;
     }
 }
@@ -135,13 +149,16 @@ EXPORTED int lock_setlock(int fd, int exclusive, int nonblock,
 /*
  * Release any lock on 'fd'.  Always returns success.
  */
-EXPORTED int lock_unlock(int fd, const char *filename __attribute__((unused)))
+EXPORTED int lock_unlock(int fd, const char *filename)
 {
     int r;
 
     for (;;) {
         r = flock(fd, LOCK_UN);
-        if (r != -1) return 0;
+        if (r != -1) {
+            lockstat_unlock(filename);
+            return 0;
+        }
         if (errno == EINTR) continue;
         /* xxx help! */
         return -1;
@@ -0,0 +1,347 @@
+/* lockstat.c -- shared-memory lock wait statistics
+ *
+ * Copyright (c) 1994-2016 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libconfig.h"
+#include "lockstat.h"
+#include "strhash.h"
+#include "util.h"
+
+static struct lockstat_map *lockmap = NULL;
+static uint64_t process_wait_usec = 0;
+static int lockstat_state = -1;     /* -1 unknown, 0 off, 1 on */
+
+/*
+ * Map (creating and initializing if needed) the shared statistics file.
+ * Uses raw fcntl to serialize initialization: the instrumented lock
+ * wrappers call back in here, so they cannot be used.
+ */
+static int lockstat_attach(void)
+{
+    char fname[1024];
+    struct flock fl;
+    struct stat sbuf;
+    void *base;
+    int fd;
+
+    snprintf(fname, sizeof(fname), "%s%s", config_dir, LOCKSTAT_FNAME);
+
+    fd = open(fname, O_CREAT | O_RDWR, 0600);
+    if (fd == -1) {
+        syslog(LOG_ERR, "IOERROR: opening lock statistics %s: %m", fname);
+        return -1;
+    }
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    while (fcntl(fd, F_SETLKW, &fl) == -1) {
+        if (errno != EINTR) {
+            syslog(LOG_ERR, "IOERROR: locking lock statistics %s: %m", fname);
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (fstat(fd, &sbuf) == -1 ||
+        (size_t) sbuf.st_size < sizeof(struct lockstat_map)) {
+        /* ftruncate zero-fills, so only the header needs writing */
+        struct lockstat_map hdr;
+
+        if (ftruncate(fd, sizeof(struct lockstat_map)) == -1) {
+            syslog(LOG_ERR, "IOERROR: sizing lock statistics %s: %m", fname);
+            close(fd);
+            return -1;
+        }
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = LOCKSTAT_MAGIC;
+        hdr.version = LOCKSTAT_VERSION;
+        hdr.nslots = LOCKSTAT_NSLOTS;
+        if (lseek(fd, 0, SEEK_SET) == -1 ||
+            write(fd, &hdr, 4*sizeof(uint32_t)) != 4*sizeof(uint32_t)) {
+            syslog(LOG_ERR, "IOERROR: initializing lock statistics %s: %m",
+                   fname);
+            close(fd);
+            return -1;
+        }
+    }
+
+    base = mmap(NULL, sizeof(struct lockstat_map),
+                PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);  /* the mapping keeps the file alive, and drops the lock */
+
+    if (base == MAP_FAILED) {
+        syslog(LOG_ERR, "IOERROR: mapping lock statistics %s: %m", fname);
+        return -1;
+    }
+
+    lockmap = (struct lockstat_map *) base;
+    if (lockmap->magic != LOCKSTAT_MAGIC ||
+        lockmap->version != LOCKSTAT_VERSION ||
+        lockmap->nslots != LOCKSTAT_NSLOTS) {
+        syslog(LOG_ERR, "lock statistics %s: bad magic/version/size, "
+               "remove it and restart", fname);
+        munmap(base, sizeof(struct lockstat_map));
+        lockmap = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* is profiling on, and the map attached?  Cheap after the first call.
+ * Locks taken before the config is read are not counted */
+static int lockstat_ready(void)
+{
+    if (lockstat_state >= 0) return lockstat_state;
+    if (!config_dir) return 0;
+
+    if (!config_getswitch(IMAPOPT_LOCK_PROFILING) || lockstat_attach())
+        lockstat_state = 0;
+    else
+        lockstat_state = 1;
+
+    return lockstat_state;
+}
+
+/*
+ * Reduce a locked filename to its class: the basename, so every
+ * cyrus.index (say) shares a slot regardless of mailbox.  Spool
+ * message files (all digits plus a dot) get one collective slot.
+ */
+static const char *lockstat_classify(const char *filename,
+                                     char *buf, size_t len)
+{
+    const char *base;
+    const char *p;
+
+    if (!filename || !*filename) return "<unknown>";
+
+    base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
+
+    for (p = base; Uisdigit(*p); p++);
+    if (p > base && p[0] == '.' && !p[1]) return "<message>";
+
+    snprintf(buf, len, "%s", base);
+    return buf;
+}
+
+/* find (claiming if needed) the slot for 'class'; NULL if the table
+ * is full or (for claim == 0) the class has never been seen */
+static struct lockstat_slot *lockstat_findslot(const char *class, int claim)
+{
+    unsigned n = strhash(class) % LOCKSTAT_NSLOTS;
+    unsigned i;
+
+    for (i = 0; i < LOCKSTAT_NSLOTS; i++) {
+        struct lockstat_slot *slot = &lockmap->slots[n];
+
+        if (slot->class[0]) {
+            if (!strcmp(slot->class, class)) return slot;
+        }
+        else {
+            if (!claim) return NULL;
+
+            /* claiming is rare - a few-instruction spinlock is fine */
+            while (__sync_lock_test_and_set(&lockmap->claimlock, 1))
+                ;
+            if (!slot->class[0]) {
+                /* publish the name last, so readers never see a
+                 * half-written class */
+                snprintf(slot->class + 1, LOCKSTAT_CLASSLEN - 1, "%s",
+                         class + 1);
+                __sync_synchronize();
+                slot->class[0] = class[0];
+                __sync_lock_release(&lockmap->claimlock);
+                return slot;
+            }
+            __sync_lock_release(&lockmap->claimlock);
+            if (!strcmp(slot->class, class)) return slot;
+        }
+
+        n = (n + 1) % LOCKSTAT_NSLOTS;
+    }
+
+    return NULL;
+}
+
+EXPORTED void lockstat_wait_start(struct lockstat_timer *t,
+                                  const char *filename, int exclusive)
+{
+    char buf[LOCKSTAT_CLASSLEN];
+
+    t->slot = NULL;
+    if (!lockstat_ready()) return;
+
+    t->slot = lockstat_findslot(lockstat_classify(filename, buf, sizeof(buf)),
+                                /*claim*/1);
+    if (!t->slot) return;
+
+    t->exclusive = exclusive;
+    clock_gettime(CLOCK_MONOTONIC, &t->start);
+}
+
+EXPORTED void lockstat_wait_end(struct lockstat_timer *t, int r)
+{
+    struct lockstat_slot *slot = t->slot;
+    struct timespec end;
+    uint64_t usec;
+    uint64_t v;
+    int b, i;
+
+    if (!slot) return;
+    t->slot = NULL;
+
+    if (r) {
+        __sync_fetch_and_add(&slot->failures, 1);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    usec = (uint64_t)(end.tv_sec - t->start.tv_sec) * 1000000
+         + (end.tv_nsec - t->start.tv_nsec) / 1000;
+
+    process_wait_usec += usec;
+
+    __sync_fetch_and_add(&slot->acquisitions, 1);
+    __sync_fetch_and_add(&slot->wait_usec, usec);
+    if (usec >= LOCKSTAT_CONTENDED_USEC)
+        __sync_fetch_and_add(&slot->contended, 1);
+    /* racy, but a lost update on a maximum is harmless */
+    if (usec > slot->max_wait_usec) slot->max_wait_usec = usec;
+
+    b = 0;
+    v = usec;
+    while (v >>= 1) b++;
+    if (b >= LOCKSTAT_NBUCKETS) b = LOCKSTAT_NBUCKETS - 1;
+    __sync_fetch_and_add(&slot->hist[b], 1);
+
+    /* note ourselves as a current holder.  If all the entries are
+     * taken the holder just goes unlisted */
+    for (i = 0; i < LOCKSTAT_NHOLDERS; i++) {
+        struct lockstat_holder *h = &slot->holders[i];
+        if (!h->pid &&
+            __sync_bool_compare_and_swap(&h->pid, 0, (uint32_t) getpid())) {
+            h->exclusive = t->exclusive;
+            h->since = time(NULL);
+            break;
+        }
+    }
+}
+
+/* this process's total lock wait, for per-command accounting; only
+ * counts once lock_profiling is on */
+EXPORTED uint64_t lockstat_process_wait_usec(void)
+{
+    return process_wait_usec;
+}
+
+EXPORTED void lockstat_unlock(const char *filename)
+{
+    char buf[LOCKSTAT_CLASSLEN];
+    struct lockstat_slot *slot;
+    uint32_t pid;
+    int i;
+
+    if (!lockstat_ready()) return;
+
+    slot = lockstat_findslot(lockstat_classify(filename, buf, sizeof(buf)),
+                             /*claim*/0);
+    if (!slot) return;
+
+    pid = (uint32_t) getpid();
+    for (i = 0; i < LOCKSTAT_NHOLDERS; i++) {
+        struct lockstat_holder *h = &slot->holders[i];
+        if (h->pid == pid &&
+            __sync_bool_compare_and_swap(&h->pid, pid, 0))
+            break;
+    }
+}
+
+EXPORTED const struct lockstat_map *lockstat_map_readonly(void)
+{
+    char fname[1024];
+    const struct lockstat_map *map;
+    struct stat sbuf;
+    void *base;
+    int fd;
+
+    if (!config_dir) return NULL;
+
+    snprintf(fname, sizeof(fname), "%s%s", config_dir, LOCKSTAT_FNAME);
+
+    fd = open(fname, O_RDONLY);
+    if (fd == -1) return NULL;
+
+    if (fstat(fd, &sbuf) == -1 ||
+        (size_t) sbuf.st_size < sizeof(struct lockstat_map)) {
+        close(fd);
+        return NULL;
+    }
+
+    base = mmap(NULL, sizeof(struct lockstat_map), PROT_READ, MAP_SHARED,
+                fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return NULL;
+
+    map = (const struct lockstat_map *) base;
+    if (map->magic != LOCKSTAT_MAGIC ||
+        map->version != LOCKSTAT_VERSION ||
+        map->nslots != LOCKSTAT_NSLOTS) {
+        munmap(base, sizeof(struct lockstat_map));
+        return NULL;
+    }
+
+    return map;
+}
@@ -0,0 +1,111 @@
+/* lockstat.h -- shared-memory lock wait statistics
+ *
+ * Copyright (c) 1994-2016 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef INCLUDED_LOCKSTAT_H
+#define INCLUDED_LOCKSTAT_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* When lock_profiling is enabled, every process maps the statistics
+ * file at {configdirectory}/lockstat shared, and each lock acquisition
+ * records its wait time into the slot for its "lock class" (roughly,
+ * the basename of the locked file, so every cyrus.index lock lands in
+ * one slot regardless of mailbox).  Slots are claimed on first use and
+ * never released.  cyr_locktop(8) reads the same mapping. */
+
+#define LOCKSTAT_FNAME      "/lockstat"
+#define LOCKSTAT_MAGIC      0x4c4b5354      /* "LKST" */
+#define LOCKSTAT_VERSION    1
+#define LOCKSTAT_NSLOTS     128
+#define LOCKSTAT_NBUCKETS   24              /* log2 of wait in usec */
+#define LOCKSTAT_CLASSLEN   48
+#define LOCKSTAT_NHOLDERS   16
+
+/* waits at least this long count as contended */
+#define LOCKSTAT_CONTENDED_USEC 1000
+
+struct lockstat_holder {
+    uint32_t pid;               /* 0 = free entry */
+    uint32_t exclusive;
+    uint64_t since;             /* wall clock, for display only */
+};
+
+struct lockstat_slot {
+    char class[LOCKSTAT_CLASSLEN];      /* "" = unclaimed */
+    uint64_t acquisitions;      /* successful acquires */
+    uint64_t contended;         /* ...that waited LOCKSTAT_CONTENDED_USEC */
+    uint64_t failures;          /* nonblocking misses and errors */
+    uint64_t wait_usec;         /* total time spent waiting */
+    uint64_t max_wait_usec;
+    uint64_t hist[LOCKSTAT_NBUCKETS];   /* hist[b]: waits of ~2^b usec */
+    struct lockstat_holder holders[LOCKSTAT_NHOLDERS];
+};
+
+struct lockstat_map {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nslots;
+    uint32_t claimlock;         /* spinlock, only for claiming slots */
+    struct lockstat_slot slots[LOCKSTAT_NSLOTS];
+};
+
+/* wait measurement, used by the cyr_lock implementations */
+struct lockstat_timer {
+    struct lockstat_slot *slot; /* NULL when profiling is off */
+    int exclusive;
+    struct timespec start;
+};
+
+void lockstat_wait_start(struct lockstat_timer *t, const char *filename,
+                         int exclusive);
+void lockstat_wait_end(struct lockstat_timer *t, int r);
+void lockstat_unlock(const char *filename);
+
+/* this process's total lock wait; zero until lock_profiling is on */
+uint64_t lockstat_process_wait_usec(void);
+
+/* read-only attach for reporting tools; returns NULL if there are no
+ * statistics to read */
+const struct lockstat_map *lockstat_map_readonly(void);
+
+#endif /* INCLUDED_LOCKSTAT_H */
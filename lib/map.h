@@ -45,6 +45,22 @@
 
 #define MAP_UNKNOWN_LEN ((unsigned long)-1)
 
+/* Per-use mapping policies for map_refresh_ex()/map_free_ex().  All of
+ * these are advisory: each backend applies whatever the platform
+ * supports and silently ignores the rest.
+ */
+#define MAP_POLICY_NONE      0
+#define MAP_POLICY_POPULATE  (1<<0) /* the caller will scan the whole
+                                     * file: prefault it in one up-front
+                                     * read instead of a fault per page */
+#define MAP_POLICY_HUGEPAGE  (1<<1) /* large, long-lived map (big
+                                     * databases): align it so transparent
+                                     * hugepages can be used */
+#define MAP_POLICY_DROPCLEAN (1<<2) /* one-shot data: map_free_ex() drops
+                                     * the resident pages immediately
+                                     * rather than letting them compete
+                                     * with the working set */
+
 extern const char *map_method_desc;
 
 /* Create a memory map
@@ -64,9 +80,19 @@ extern void map_refresh(int fd, int onceonly, const char **base,
                         size_t *len, size_t newlen,
                         const char *name, const char *mboxname);
 
+/* As map_refresh(), with an ORed set of MAP_POLICY_* flags describing
+ * how the mapping will be used */
+extern void map_refresh_ex(int fd, int onceonly, const char **base,
+                           size_t *len, size_t newlen,
+                           const char *name, const char *mboxname,
+                           int policy);
+
 /* map_free will free a memory map allocated by map_refresh
  *
  * base and len are the same values that were passed to map_refresh */
 extern void map_free(const char **base, size_t *len);
 
+/* As map_free(), honouring MAP_POLICY_DROPCLEAN */
+extern void map_free_ex(const char **base, size_t *len, int policy);
+
 #endif /* INCLUDED_MAP_H */
@@ -110,6 +110,17 @@ EXPORTED map_refresh(int fd, int onceonly, const char **base,
     }
 }
 
+/* reading the whole file into memory is as populated as a map gets,
+ * so the mapping policies have nothing left to do here */
+void
+EXPORTED map_refresh_ex(int fd, int onceonly, const char **base,
+                        size_t *len, size_t newlen, const char *name,
+                        const char *mboxname,
+                        int policy __attribute__((unused)))
+{
+    map_refresh(fd, onceonly, base, len, newlen, name, mboxname);
+}
+
 /*
  * Destroy mapping of file
  */
@@ -120,3 +131,10 @@ EXPORTED map_free(const char **base, size_t *len)
     *base = 0;
     *len = 0;
 }
+
+void
+EXPORTED map_free_ex(const char **base, size_t *len,
+                     int policy __attribute__((unused)))
+{
+    map_free(base, len);
+}
@@ -42,6 +42,7 @@
 
 #include <config.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -53,16 +54,60 @@
 
 #define SLOP (8*1024)
 
+#ifdef MADV_HUGEPAGE
+/* transparent hugepages only assemble over suitably aligned ranges */
+#define HUGEPAGE_SIZE (2*1024*1024)
+/* not worth aligning maps smaller than a few hugepages */
+#define HUGEPAGE_THRESHOLD (4*HUGEPAGE_SIZE)
+#endif
+
 EXPORTED const char *map_method_desc = "shared";
 
+#ifdef MADV_HUGEPAGE
+/*
+ * Map 'len' bytes of 'fd' starting on a hugepage boundary, by carving
+ * an aligned range out of a larger anonymous reservation.  Returns
+ * MAP_FAILED on any failure and the caller falls back to a plain map.
+ */
+static void *mmap_hugealigned(size_t len, int flags, int fd)
+{
+    char *reserve, *aligned;
+    size_t front, back;
+
+    reserve = mmap(NULL, len + HUGEPAGE_SIZE, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reserve == MAP_FAILED) return MAP_FAILED;
+
+    aligned = (char *)(((uintptr_t)reserve + HUGEPAGE_SIZE - 1)
+                       & ~((uintptr_t)HUGEPAGE_SIZE - 1));
+    if (mmap(aligned, len, PROT_READ, flags | MAP_FIXED, fd, 0L)
+        == MAP_FAILED) {
+        munmap(reserve, len + HUGEPAGE_SIZE);
+        return MAP_FAILED;
+    }
+
+    /* trim the unused ends of the reservation */
+    front = aligned - reserve;
+    back = HUGEPAGE_SIZE - front;
+    if (front) munmap(reserve, front);
+    if (back) munmap(aligned + len, back);
+
+    (void)madvise(aligned, len, MADV_HUGEPAGE);
+
+    return aligned;
+}
+#endif
+
 /*
  * Create/refresh mapping of file
  */
-EXPORTED void map_refresh(int fd, int onceonly, const char **base,
+EXPORTED void map_refresh_ex(int fd, int onceonly, const char **base,
                  size_t *len, size_t newlen,
-                 const char *name, const char *mboxname)
+                 const char *name, const char *mboxname,
+                 int policy)
 {
     struct stat sbuf;
+    int flags;
     char buf[256];
 
     if (newlen == MAP_UNKNOWN_LEN) {
@@ -84,14 +129,28 @@ EXPORTED void map_refresh(int fd, int onceonly, const char **base,
         newlen = (newlen + 2*SLOP - 1) & ~(SLOP-1);
     }
 
-    *base = (char *)mmap((caddr_t)0, newlen, PROT_READ, MAP_SHARED
+    flags = MAP_SHARED;
 #ifdef MAP_FILE
-| MAP_FILE
+    flags |= MAP_FILE;
 #endif
 #ifdef MAP_VARIABLE
-| MAP_VARIABLE
+    flags |= MAP_VARIABLE;
+#endif
+#ifdef MAP_POPULATE
+    if (policy & MAP_POLICY_POPULATE) flags |= MAP_POPULATE;
+#endif
+
+#ifdef MADV_HUGEPAGE
+    if ((policy & MAP_POLICY_HUGEPAGE) && newlen >= HUGEPAGE_THRESHOLD) {
+        *base = (char *)mmap_hugealigned(newlen, flags, fd);
+        if (*base != (char *)MAP_FAILED) {
+            *len = newlen;
+            return;
+        }
+    }
 #endif
-                         , fd, 0L);
+
+    *base = (char *)mmap((caddr_t)0, newlen, PROT_READ, flags, fd, 0L);
     if (*base == (char *)-1) {
         syslog(LOG_ERR, "IOERROR: mapping %s file%s%s: %m", name,
                mboxname ? " for " : "", mboxname ? mboxname : "");
@@ -101,12 +160,31 @@ EXPORTED void map_refresh(int fd, int onceonly, const char **base,
     *len = newlen;
 }
 
+EXPORTED void map_refresh(int fd, int onceonly, const char **base,
+                 size_t *len, size_t newlen,
+                 const char *name, const char *mboxname)
+{
+    map_refresh_ex(fd, onceonly, base, len, newlen, name, mboxname,
+                   MAP_POLICY_NONE);
+}
+
 /*
  * Destroy mapping of file
  */
-EXPORTED void map_free(const char **base, size_t *len)
+EXPORTED void map_free_ex(const char **base, size_t *len, int policy)
 {
-    if (*len) munmap((char *)*base, *len);
+    if (*len) {
+#ifdef MADV_DONTNEED
+        if (policy & MAP_POLICY_DROPCLEAN)
+            (void)madvise((char *)*base, *len, MADV_DONTNEED);
+#endif
+        munmap((char *)*base, *len);
+    }
     *base = 0;
     *len = 0;
 }
+
+EXPORTED void map_free(const char **base, size_t *len)
+{
+    map_free_ex(base, len, MAP_POLICY_NONE);
+}
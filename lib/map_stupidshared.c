@@ -104,6 +104,17 @@ EXPORTED map_refresh(int fd, int onceonly, const char **base,
     *len = newlen;
 }
 
+/* this backend exists for platforms whose mmap() is too limited for
+ * anything clever, so the mapping policies are best-effort no-ops */
+void
+EXPORTED map_refresh_ex(int fd, int onceonly, const char **base,
+                        size_t *len, size_t newlen, const char *name,
+                        const char *mboxname,
+                        int policy __attribute__((unused)))
+{
+    map_refresh(fd, onceonly, base, len, newlen, name, mboxname);
+}
+
 /*
  * Destroy mapping of file
  */
@@ -114,3 +125,10 @@ EXPORTED map_free(const char **base, size_t *len)
     *base = 0;
     *len = 0;
 }
+
+void
+EXPORTED map_free_ex(const char **base, size_t *len,
+                     int policy __attribute__((unused)))
+{
+    map_free(base, len);
+}
@@ -98,6 +98,7 @@ struct mappedfile {
     int dirty;
     int was_resized;
     int is_rw;
+    int map_policy;
 };
 
 static void _ensure_mapped(struct mappedfile *mf, size_t offset, int update)
@@ -111,8 +112,8 @@ static void _ensure_mapped(struct mappedfile *mf, size_t offset, int update)
     }
 
     /* always give refresh another go, we may be map_nommap */
-    buf_init_mmap(&mf->map_buf, /*onceonly*/0, mf->fd, mf->fname,
-                  offset, /*mboxname*/NULL);
+    buf_init_mmap_ex(&mf->map_buf, /*onceonly*/0, mf->fd, mf->fname,
+                     offset, /*mboxname*/NULL, mf->map_policy);
 
     mf->map_size = offset;
 }
@@ -134,6 +135,8 @@ EXPORTED int mappedfile_open(struct mappedfile **mfp,
     mf = xzmalloc(sizeof(struct mappedfile));
     mf->fname = xstrdup(fname);
     mf->is_rw = (flags & MAPPEDFILE_RW) ? 1 : 0;
+    if (flags & MAPPEDFILE_POPULATE) mf->map_policy |= MAP_POLICY_POPULATE;
+    if (flags & MAPPEDFILE_HUGEPAGE) mf->map_policy |= MAP_POLICY_HUGEPAGE;
 
     mf->fd = open(mf->fname, openmode, 0644);
     if (mf->fd < 0 && errno == ENOENT) {
@@ -294,6 +297,50 @@ EXPORTED int mappedfile_unlock(struct mappedfile *mf)
     return 0;
 }
 
+/* re-examine the file WITHOUT taking a lock: reopen it if it has been
+ * replaced (e.g. by a checkpoint) and extend the mapping to cover any
+ * appended data.  The caller must be able to cope with the mapped data
+ * changing underneath it at any time. */
+EXPORTED int mappedfile_refresh(struct mappedfile *mf)
+{
+    struct stat sbuf, sbuffile;
+    int newfd = -1;
+
+    assert(mf->lock_status == MF_UNLOCKED);
+    assert(mf->fd != -1);
+    assert(!mf->dirty);
+
+    if (stat(mf->fname, &sbuffile) == -1) {
+        syslog(LOG_ERR, "IOERROR: stat %s: %m", mf->fname);
+        return -EIO;
+    }
+
+    if (fstat(mf->fd, &sbuf) == -1) {
+        syslog(LOG_ERR, "IOERROR: fstat %s: %m", mf->fname);
+        return -EIO;
+    }
+
+    if (sbuf.st_ino != sbuffile.st_ino) {
+        newfd = open(mf->fname, mf->is_rw ? O_RDWR : O_RDONLY, 0644);
+        if (newfd == -1) {
+            syslog(LOG_ERR, "IOERROR: open %s: %m", mf->fname);
+            return -EIO;
+        }
+        buf_free(&mf->map_buf);
+        dup2(newfd, mf->fd);
+        close(newfd);
+
+        if (fstat(mf->fd, &sbuf) == -1) {
+            syslog(LOG_ERR, "IOERROR: fstat %s: %m", mf->fname);
+            return -EIO;
+        }
+    }
+
+    _ensure_mapped(mf, sbuf.st_size, /*update*/0);
+
+    return 0;
+}
+
 EXPORTED int mappedfile_commit(struct mappedfile *mf)
 {
     assert(mf->fd != -1);
@@ -52,6 +52,9 @@ struct mappedfile;
 
 #define MAPPEDFILE_CREATE (1<<0)
 #define MAPPEDFILE_RW     (1<<1)
+/* advisory mapping policies, applied on every (re)map of the file */
+#define MAPPEDFILE_POPULATE (1<<2)  /* will be scanned in full */
+#define MAPPEDFILE_HUGEPAGE (1<<3)  /* large and long-lived */
 
 extern int mappedfile_open(struct mappedfile **mfp,
                            const char *fname, int flags);
@@ -60,6 +63,7 @@ extern int mappedfile_close(struct mappedfile **mfp);
 extern int mappedfile_readlock(struct mappedfile *mf);
 extern int mappedfile_writelock(struct mappedfile *mf);
 extern int mappedfile_unlock(struct mappedfile *mf);
+extern int mappedfile_refresh(struct mappedfile *mf);
 
 extern int mappedfile_commit(struct mappedfile *mf);
 extern ssize_t mappedfile_pwrite(struct mappedfile *mf,
@@ -52,34 +52,82 @@
 static const char unknown_user[] = "unknown-user";
 static const char unspecified_domain[] = "unspecified-domain";
 
+/*
+ * Character class table for the scanner.  The inner loops below used
+ * to test each character with strchr() against a specials string plus
+ * a couple of ctype macros; one table lookup classifies it instead,
+ * with a bit per structural special so each caller just passes the
+ * mask of the specials it stops at.
+ */
+#define AC_WS     0x001         /* whitespace, as Uisspace() */
+#define AC_COMMA  0x002
+#define AC_AT     0x004
+#define AC_LT     0x008
+#define AC_GT     0x010
+#define AC_SEMI   0x020
+#define AC_COLON  0x040
+#define AC_DOMAIN 0x080         /* chars valid in a domain: alnum - [ ] : */
+#define AC_ROUTE  0x100         /* chars valid in a route: alnum - [ ] , @ */
+
+static unsigned short addr_class[256];
+
+#define ADDR_CLASS(c) (addr_class[(unsigned char)(c)])
+
+static void addr_class_init(void)
+{
+    static int done = 0;
+    int c;
+
+    if (done) return;
+
+    for (c = 0; c < 256; c++) {
+        if (Uisalnum(c)) addr_class[c] |= AC_DOMAIN|AC_ROUTE;
+        if (Uisspace(c)) addr_class[c] |= AC_WS;
+    }
+    addr_class['-'] |= AC_DOMAIN|AC_ROUTE;
+    addr_class['['] |= AC_DOMAIN|AC_ROUTE;
+    addr_class[']'] |= AC_DOMAIN|AC_ROUTE;
+    addr_class[':'] |= AC_COLON|AC_DOMAIN;
+    addr_class[','] |= AC_COMMA|AC_ROUTE;
+    addr_class['@'] |= AC_AT|AC_ROUTE;
+    addr_class['<'] |= AC_LT;
+    addr_class['>'] |= AC_GT;
+    addr_class[';'] |= AC_SEMI;
+
+    done = 1;
+}
+
 static void parseaddr_append(struct address ***addrpp, const char *name,
                              const char *route, const char *mailbox,
                              const char *domain, char **freemep, int invalid);
-static int parseaddr_phrase (char **inp, char **phrasep, const char *specials);
+static int parseaddr_phrase (char **inp, char **phrasep, unsigned specials);
 static int parseaddr_domain (char **inp, char **domainp, char **commmentp, int *invalid);
 static int parseaddr_route (char **inp, char **routep);
 
 /*
- * Parse an address list in 's', appending address structures to
- * the list pointed to by 'addrp'.
+ * Parse an address list in 's' (which the caller hands over along
+ * with the responsibility to free it), appending address structures
+ * to the list pointed to by 'addrp'.
  */
-EXPORTED void parseaddr_list(const char *str, struct address **addrp)
+static void parseaddr_list_impl(char *freeme, struct address **addrp)
 {
     char *s;
     int ingroup = 0;
-    char *freeme;
     int tok = ' ', invalid = 0;
     char *phrase, *route, *mailbox, *domain, *comment;
 
+    addr_class_init();
+
     /* Skip down to the tail */
     while (*addrp) {
         addrp = &(*addrp)->next;
     }
 
-    s = freeme = xstrdup(str);
+    s = freeme;
 
     while (tok) {
-        tok = parseaddr_phrase(&s, &phrase, ingroup ? ",@<;" : ",@<:");
+        tok = parseaddr_phrase(&s, &phrase,
+                               AC_COMMA|AC_AT|AC_LT|(ingroup ? AC_SEMI : AC_COLON));
         switch (tok) {
         case ',':
         case '\0':
@@ -108,7 +156,7 @@ EXPORTED void parseaddr_list(const char *str, struct address **addrp)
             continue;
 
         case '<':
-            tok = parseaddr_phrase(&s, &mailbox, "@>");
+            tok = parseaddr_phrase(&s, &mailbox, AC_AT|AC_GT);
             if (tok == '@') {
                 route = 0;
                 if (!*mailbox) {
@@ -119,7 +167,7 @@ EXPORTED void parseaddr_list(const char *str, struct address **addrp)
                         while (tok && tok != '>') tok = *s++;
                         continue;
                     }
-                    tok = parseaddr_phrase(&s, &mailbox, "@>");
+                    tok = parseaddr_phrase(&s, &mailbox, AC_AT|AC_GT);
                     if (tok != '@') {
                         parseaddr_append(&addrp, phrase, route, mailbox, "",
                                          &freeme, invalid);
@@ -142,6 +190,21 @@ EXPORTED void parseaddr_list(const char *str, struct address **addrp)
     if (freeme) free(freeme);
 }
 
+EXPORTED void parseaddr_list(const char *str, struct address **addrp)
+{
+    parseaddr_list_impl(xstrdup(str), addrp);
+}
+
+/*
+ * As parseaddr_list(), but only the first 'len' bytes of 'str' are
+ * looked at.  Saves callers parsing a header in the middle of a
+ * larger mapped buffer from plugging a NUL into it first.
+ */
+EXPORTED void parseaddr_list_n(const char *str, size_t len, struct address **addrp)
+{
+    parseaddr_list_impl(xstrndup(str, len), addrp);
+}
+
 /*
  * Free the address list 'addr'
  */
@@ -216,7 +279,7 @@ static void parseaddr_append(struct address ***addrpp, const char *name,
             } \
             (s)--; \
         } \
-        else if (!Uisspace(_c)) break; \
+        else if (!(ADDR_CLASS(_c) & AC_WS)) break; \
         (s)++; \
     } \
 }
@@ -224,7 +287,7 @@ static void parseaddr_append(struct address ***addrpp, const char *name,
 /*
  * Parse an RFC 822 "phrase", stopping at 'specials'
  */
-static int parseaddr_phrase(char **inp, char **phrasep, const char *specials)
+static int parseaddr_phrase(char **inp, char **phrasep, unsigned specials)
 {
     int c;
     char *src = *inp;
@@ -261,12 +324,12 @@ static int parseaddr_phrase(char **inp, char **phrasep, const char *specials)
             }
             if (c != '"') goto fail;        /* unbalanced " */
         }
-        else if (Uisspace(c) || c == '(') {
+        else if ((ADDR_CLASS(c) & AC_WS) || c == '(') {
             src--;
             SKIPWHITESPACE(src);
             *dst++ = ' ';
         }
-        else if (!c || strchr(specials, c)) {
+        else if (!c || (ADDR_CLASS(c) & specials)) {
             if (dst > *phrasep && dst[-1] == ' ') dst--;
             *dst = '\0';
             *inp = src;
@@ -302,7 +365,7 @@ static int parseaddr_domain(char **inp, char **domainp, char **commentp, int *in
 
     for (;;) {
         c = *src++;
-        if (Uisalnum(c) || c == '-' || c == '[' || c == ']' || c == ':') {
+        if (ADDR_CLASS(c) & AC_DOMAIN) {
             *dst++ = c;
             if (commentp) *commentp = 0;
         }
@@ -336,7 +399,7 @@ static int parseaddr_domain(char **inp, char **domainp, char **commentp, int *in
             *dst++ = c;
             if (commentp) *commentp = 0;
         }
-        else if (!Uisspace(c)) {
+        else if (!(ADDR_CLASS(c) & AC_WS)) {
             if (dst > *domainp && dst[-1] == '.') dst--;
             *dst = '\0';
             *inp = src;
@@ -360,14 +423,13 @@ static int parseaddr_route(char **inp, char **routep)
 
     for (;;) {
         c = *src++;
-        if (Uisalnum(c) || c == '-' || c == '[' || c == ']' ||
-            c == ',' || c == '@') {
+        if (ADDR_CLASS(c) & AC_ROUTE) {
             *dst++ = c;
         }
         else if (c == '.') {
             if (dst > *routep && dst[-1] != '.') *dst++ = c;
         }
-        else if (Uisspace(c) || c == '(') {
+        else if ((ADDR_CLASS(c) & AC_WS) || c == '(') {
             src--;
             SKIPWHITESPACE(src);
         }
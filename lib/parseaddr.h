@@ -43,6 +43,8 @@
 #ifndef INCLUDED_PARSEADDR_H
 #define INCLUDED_PARSEADDR_H
 
+#include <stddef.h>           /* For size_t     */
+
 struct address {
     const char *name;
     const char *route;
@@ -60,6 +62,7 @@ struct address_itr {
 };
 
 extern void parseaddr_list(const char *s, struct address **addrp);
+extern void parseaddr_list_n(const char *s, size_t len, struct address **addrp);
 extern void parseaddr_free(struct address *addr);
 
 extern char *address_get_all(const struct address *, int canon_domain);
@@ -52,6 +52,7 @@
 #endif
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
@@ -68,6 +69,11 @@
 #include "util.h"
 #include "xmalloc.h"
 
+/* Number of entries in the scatter-gather output queue.  Each queued
+ * reference may also seal an extent of the memory buffer, so the queue
+ * fills at worst twice as fast as blocks are queued */
+#define PROT_IOV_MAX 16
+
 /* Transparant protgroup structure */
 struct protgroup
 {
@@ -180,6 +186,7 @@ EXPORTED int prot_free(struct protstream *s)
 {
     if (s->error) free(s->error);
     free(s->buf);
+    if (s->iov) free(s->iov);
 
     if(s->big_buffer != PROT_NO_FD) {
         map_free(&(s->bigbuf_base), &(s->bigbuf_siz));
@@ -200,6 +207,49 @@ EXPORTED int prot_free(struct protstream *s)
     return 0;
 }
 
+/*
+ * Reset a protection stream for use on a new connection, keeping its
+ * allocated buffer.  Equivalent to prot_free() followed by prot_new(),
+ * minus the allocator round trip - for services which serve many
+ * short sequential connections from one process.
+ */
+EXPORTED int prot_reuse(struct protstream *s, int fd, int write)
+{
+    unsigned char *buf = s->buf;
+    size_t buf_size = s->buf_size;
+
+    if (s->error) free(s->error);
+    if (s->iov) free(s->iov);
+
+    if (s->big_buffer != PROT_NO_FD) {
+        map_free(&(s->bigbuf_base), &(s->bigbuf_siz));
+        close(s->big_buffer);
+    }
+
+#ifdef HAVE_ZLIB
+    if (s->zstrm) {
+        if (s->write) deflateEnd(s->zstrm);
+        else inflateEnd(s->zstrm);
+        free(s->zstrm);
+    }
+    if (s->zbuf) free(s->zbuf);
+#endif
+
+    memset(s, 0, sizeof(*s));
+    s->buf = buf;
+    s->buf_size = buf_size;
+    s->ptr = s->buf;
+    s->maxplain = buf_size;
+    s->fd = fd;
+    s->write = write;
+    s->logfd = PROT_NO_FD;
+    s->big_buffer = PROT_NO_FD;
+    if (write)
+        s->cnt = buf_size;
+
+    return 0;
+}
+
 /*
  * Set the logging file descriptor for stream 's' to be 'fd'.
  */
@@ -209,6 +259,17 @@ EXPORTED int prot_setlog(struct protstream *s, int fd)
     return 0;
 }
 
+/*
+ * Route telemetry for stream 's' to 'proc' instead of the logfd.
+ */
+EXPORTED int prot_setlogcb(struct protstream *s,
+                           prot_logcallback_t *proc, void *rock)
+{
+    s->logcallback_proc = proc;
+    s->logcallback_rock = rock;
+    return 0;
+}
+
 EXPORTED int prot_setisclient(struct protstream *s, int val)
 {
     s->isclient = val;
@@ -230,6 +291,19 @@ EXPORTED int prot_settls(struct protstream *s, SSL *tlsconn)
                  SSL_MODE_ENABLE_PARTIAL_WRITE
                  | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
+    if (s->write && s->buf_size < PROT_TLSBUFSIZE) {
+        /* Grow the plaintext buffer to a full TLS record, so each
+         * flush hands SSL_write() 16K at a time instead of paying
+         * the per-record overhead on every PROT_BUFSIZE chunk */
+        unsigned used = s->ptr - s->buf;
+
+        s->buf = (unsigned char *) xrealloc(s->buf, PROT_TLSBUFSIZE);
+        s->buf_size = PROT_TLSBUFSIZE;
+        s->ptr = s->buf + used;
+        s->maxplain = PROT_TLSBUFSIZE;
+        s->cnt = PROT_TLSBUFSIZE - used;
+    }
+
     return 0;
 }
 
@@ -330,7 +404,7 @@ EXPORTED int prot_setsasl(struct protstream *s, sasl_conn_t *conn)
 EXPORTED void prot_unsetsasl(struct protstream *s)
 {
     s->conn = NULL;
-    s->maxplain = PROT_BUFSIZE;
+    s->maxplain = s->buf_size;  /* PROT_TLSBUFSIZE under TLS */
     s->saslssf = 0;
 }
 
@@ -393,8 +467,9 @@ EXPORTED int prot_setcompress(struct protstream *s)
      * format defined here, the worst case expansion is 5 bytes per 32K-
      * byte block, i.e., a size increase of 0.015% for large data sets.
      *
-     * We say: maxplain can never be bigger than PROT_BUFSIZE, which
-     * is currently 4096, so adding 5 bytes will do it!
+     * We say: maxplain can never be bigger than the stream buffer,
+     * at most PROT_TLSBUFSIZE (16K), still well inside one 32K-byte
+     * block, so adding 5 bytes will do it!
      *
      * Add another spare byte and we'll never totally fill the buffer,
      * which saves a loop.
@@ -407,6 +482,8 @@ EXPORTED int prot_setcompress(struct protstream *s)
     syslog(LOG_DEBUG, "created %scompress buffer of %u bytes",
            s->write ? "" : "de", s->zbuf_size);
     s->zstrm = zstrm;
+    s->zflush = Z_SYNC_FLUSH;
+    s->zpending = 0;
 
     return 0;
 
@@ -417,6 +494,60 @@ error:
     return EOF;
 }
 
+/*
+ * The preset dictionary for prot_setcompress_dict(): text that keeps
+ * turning up in IMAP and sync protocol traffic.  deflate favours
+ * matches near the end of the dictionary, so the most common strings
+ * come last.  These bytes are baked into the wire protocol - both
+ * peers use them verbatim - so never edit them; add a new dictionary
+ * under a new negotiation token instead.
+ */
+EXPORTED const char prot_deflate_dict[] =
+    "LIST LSUB SUBSCRIBED \\HasChildren \\HasNoChildren \\Noselect "
+    "BODY[HEADER.FIELDS (DATE FROM SUBJECT TO CC MESSAGE-ID REFERENCES "
+    "IN-REPLY-TO CONTENT-TYPE)] BODYSTRUCTURE ENVELOPE RFC822.SIZE "
+    "INTERNALDATE \"charset\" \"us-ascii\" \"utf-8\" \"base64\" "
+    "\"quoted-printable\" (\"text\" \"plain\" (\"text\" \"html\" "
+    "NIL NIL NIL ANNOTATION QUOTAROOT ACL SETACL DELETED EXPUNGE "
+    "RESERVE APPLY UNMAILBOX UNUSER GET USER MAILBOX MESSAGE FETCH "
+    "SIEVE SUB QUOTA %(UNIQUEID MBOXNAME PARTITION ACL OPTIONS "
+    "SYNC_CRC RECENTUID RECENTTIME LAST_APPENDDATE POP3_LAST_LOGIN "
+    "POP3_SHOW_AFTER UIDVALIDITY LAST_UID HIGHESTMODSEQ XCONVMODSEQ "
+    "RECORD %(UID MODSEQ LAST_UPDATED FLAGS (\\Answered \\Flagged "
+    "\\Draft \\Deleted \\Seen INTERNALDATE SIZE GUID "
+    "* OK success\r\nOK success\r\n";
+EXPORTED const unsigned prot_deflate_dict_len = sizeof(prot_deflate_dict) - 1;
+
+/*
+ * Turn on (de)compression with a preset dictionary.  Raw deflate has
+ * no way to signal which dictionary is in use, so the peer must seed
+ * the identical bytes - only safe on Cyrus-to-Cyrus links where the
+ * dictionary was explicitly negotiated.
+ */
+EXPORTED int prot_setcompress_dict(struct protstream *s,
+                                   const char *dict, unsigned dictlen)
+{
+    int zr;
+
+    if (prot_setcompress(s) == EOF)
+        return EOF;
+
+    if (s->write)
+        zr = deflateSetDictionary(s->zstrm, (const Bytef *) dict, dictlen);
+    else
+        zr = inflateSetDictionary(s->zstrm, (const Bytef *) dict, dictlen);
+
+    if (zr != Z_OK) {
+        syslog(LOG_NOTICE, "failed to set %scompression dictionary",
+               s->write ? "" : "de");
+        /* stream is unusable - the peer will be using the dictionary */
+        s->error = xstrdup("Error setting compression dictionary");
+        return EOF;
+    }
+
+    return 0;
+}
+
 /* Table of incompressible file type signatures */
 static struct file_sig {
     const char *type;
@@ -490,6 +621,38 @@ EXPORTED int prot_resettimeout(struct protstream *s)
     return 0;
 }
 
+/*
+ * Hint that 'size' bytes of bulk data (e.g. a literal with a known
+ * byte count) are about to be read from 's'.  The input buffer is
+ * grown up to PROT_READAHEAD_MAX so prot_fill() can drain the socket
+ * in large reads instead of PROT_BUFSIZE nibbles; once the hinted
+ * bytes have been consumed, reads drop back to PROT_BUFSIZE for
+ * line-oriented traffic.  Purely a performance hint: overshoot and
+ * short counts are harmless.
+ */
+EXPORTED void prot_setreadahead(struct protstream *s, size_t size)
+{
+    assert(!s->write);
+
+    /* only plain descriptor (or TLS) streams read into 'buf' at
+     * sizes we control; layered and fixed streams get no benefit */
+    if (s->fixedsize || s->fillcallback_proc || s->saslssf) return;
+#ifdef HAVE_ZLIB
+    if (s->zstrm) return;
+#endif
+
+    s->readahead = size;
+
+    if (size > s->buf_size) {
+        size_t want = (size > PROT_READAHEAD_MAX) ? PROT_READAHEAD_MAX : size;
+        size_t off = s->ptr - s->buf;
+
+        s->buf = (unsigned char *) xrealloc(s->buf, want);
+        s->buf_size = want;
+        s->ptr = s->buf + off;
+    }
+}
+
 /*
  * Set the stream 's' to flush the stream 'flushs' before
  * blocking for reading. 's' must have been created for reading,
@@ -621,6 +784,7 @@ EXPORTED int prot_fill(struct protstream *s)
     struct timeval timeout;
     fd_set rfds;
     int haveinput;
+    unsigned rsize;
     time_t read_timeout;
     struct prot_waitevent *event, *next;
 
@@ -753,19 +917,27 @@ EXPORTED int prot_fill(struct protstream *s)
         /* we have data, reset the timeout_mark */
         prot_resettimeout(s);
 
+        /* bulk data is coming (see prot_setreadahead); drain the
+         * socket in large chunks rather than PROT_BUFSIZE nibbles */
+        rsize = PROT_BUFSIZE;
+        if (s->readahead > rsize) {
+            rsize = (s->readahead > s->buf_size) ?
+                s->buf_size : (unsigned) s->readahead;
+        }
+
         do {
             cmdtime_netstart();
             if (s->fillcallback_proc != NULL) {
-                n = (*s->fillcallback_proc)(s->buf, PROT_BUFSIZE, s->fillcallback_rock);
+                n = (*s->fillcallback_proc)(s->buf, rsize, s->fillcallback_rock);
             }
 #ifdef HAVE_SSL
             /* just do a SSL read instead if we're under a tls layer */
             else if (s->tls_conn != NULL) {
-                n = SSL_read(s->tls_conn, (char *) s->buf, PROT_BUFSIZE);
+                n = SSL_read(s->tls_conn, (char *) s->buf, rsize);
             }
 #endif /* HAVE_SSL */
             else {
-                n = read(s->fd, s->buf, PROT_BUFSIZE);
+                n = read(s->fd, s->buf, rsize);
             }
             cmdtime_netend();
         } while (n == -1 && errno == EINTR && !signals_poll());
@@ -796,7 +968,17 @@ EXPORTED int prot_fill(struct protstream *s)
 #endif /* HAVE_ZLIB */
     } while (!s->cnt);
 
-    if (s->logfd != -1) {
+    /* account the delivered bytes against any readahead hint */
+    if (s->readahead) {
+        if (s->readahead > s->cnt) s->readahead -= s->cnt;
+        else s->readahead = 0;
+    }
+
+    if (s->logcallback_proc) {
+        s->logcallback_proc((const char *) s->ptr, s->cnt, 0,
+                            s->logcallback_rock);
+    }
+    else if (s->logfd != -1) {
         time_t newtime;
         char timebuf[20];
 
@@ -853,35 +1035,82 @@ EXPORTED int prot_flush(struct protstream *s)
     return prot_flush_internal(s, 1);
 }
 
-/* Do the logging part of prot_flush */
-static void prot_flush_log(struct protstream *s)
+/*
+ * Nonblocking flush.  Writes out as much buffered output as the socket
+ * will take right now and spills the rest to the bigbuffer, so the
+ * caller can go back to waiting for other events instead of being held
+ * hostage by a slow client.  Only does anything different from
+ * prot_flush() after prot_NONBLOCK(); use prot_outputpending() to
+ * discover whether to wait for the socket to become writable again.
+ */
+EXPORTED int prot_flush_nb(struct protstream *s)
 {
-    if(s->logfd != PROT_NO_FD) {
-        unsigned char *ptr = s->buf;
-        int left = s->ptr - s->buf;
-        int n;
-        time_t newtime;
-        char timebuf[20];
+    assert(s->write);
 
-        time(&newtime);
-        snprintf(timebuf, sizeof(timebuf), ">%ld>", newtime);
-        n = write(s->logfd, timebuf, strlen(timebuf));
+    return prot_flush_internal(s, 0);
+}
 
-        do {
-            n = write(s->logfd, ptr, left);
-            if (n == -1 && (errno != EINTR || signals_poll())) {
-                break;
-            }
-            if (n > 0) {
-                ptr += n;
-                left -= n;
-            }
-        } while (left);
+/*
+ * Number of output bytes still queued on 's': whatever is sitting in
+ * the memory buffer or queued by reference, plus anything spilled to
+ * the bigbuffer by a nonblocking flush.
+ */
+EXPORTED size_t prot_outputpending(struct protstream *s)
+{
+    size_t pending;
+
+    assert(s->write);
 
-        /* we don't care THAT much about logs
-         * (void)fsync(s->logfd);
-         */
+    pending = (s->ptr - s->buf) + s->iov_bytes
+        + (s->bigbuf_len - s->bigbuf_pos);
+#ifdef HAVE_ZLIB
+    /* plaintext batched inside the deflate state still needs a
+     * sync flush to reach the wire */
+    if (s->zstrm) pending += s->zpending;
+#endif
+    return pending;
+}
+
+/* Write a timestamped chunk of raw output to the telemetry log */
+static void prot_log_raw(struct protstream *s, const char *buf, size_t len)
+{
+    const char *ptr = buf;
+    size_t left = len;
+    int n;
+    time_t newtime;
+    char timebuf[20];
+
+    if (s->logcallback_proc) {
+        s->logcallback_proc(buf, len, 1, s->logcallback_rock);
+        return;
     }
+
+    if (s->logfd == PROT_NO_FD) return;
+
+    time(&newtime);
+    snprintf(timebuf, sizeof(timebuf), ">%ld>", newtime);
+    n = write(s->logfd, timebuf, strlen(timebuf));
+
+    do {
+        n = write(s->logfd, ptr, left);
+        if (n == -1 && (errno != EINTR || signals_poll())) {
+            break;
+        }
+        if (n > 0) {
+            ptr += n;
+            left -= n;
+        }
+    } while (left);
+
+    /* we don't care THAT much about logs
+     * (void)fsync(s->logfd);
+     */
+}
+
+/* Do the logging part of prot_flush */
+static void prot_flush_log(struct protstream *s)
+{
+    prot_log_raw(s, (const char *) s->buf, s->ptr - s->buf);
 }
 
 /* Do the encoding part of prot_flush */
@@ -916,7 +1145,7 @@ static int prot_flush_encode(struct protstream *s,
                 s->zbuf_size += PROT_BUFSIZE;
             }
 
-            zr = deflate(s->zstrm, Z_SYNC_FLUSH);
+            zr = deflate(s->zstrm, s->zflush);
             if (!(zr == Z_OK || zr == Z_STREAM_END || zr == Z_BUF_ERROR)) {
                 /* something went wrong */
                 syslog(LOG_ERR, "zlib deflate error: %d %s", zr, s->zstrm->msg);
@@ -932,6 +1161,13 @@ static int prot_flush_encode(struct protstream *s,
              */
         } while (!s->zstrm->avail_out);
 
+        /* with Z_NO_FLUSH some (or all) of the input may stay buffered
+         * inside the deflate state until the next sync flush */
+        if (s->zflush == Z_NO_FLUSH)
+            s->zpending += in;
+        else
+            s->zpending = 0;
+
         ptr = s->zbuf;
         left = s->zbuf_size - s->zstrm->avail_out;
 
@@ -984,23 +1220,101 @@ static int prot_flush_writebuffer(struct protstream *s,
     return n;
 }
 
+/* Flush the scatter-gather queue: everything queued by reference plus
+ * whatever has accumulated in the memory buffer goes to the socket,
+ * ideally in a single writev().  The queue only ever forms on a plain
+ * blocking stream (see prot_writemap), so there is no TLS, SASL or
+ * zlib layer to feed and no bigbuffer to worry about here. */
+static int prot_flush_iov(struct protstream *s)
+{
+    struct iovec iov[PROT_IOV_MAX + 1];
+    struct iovec *iovp = iov;
+    int iovcnt = s->iov_cnt;
+    int n, i;
+
+    memcpy(iov, s->iov, iovcnt * sizeof(struct iovec));
+
+    /* pick up the tail of the buffer that no queued block has sealed */
+    if (s->ptr - s->buf > (ptrdiff_t) s->buf_sealed) {
+        iov[iovcnt].iov_base = s->buf + s->buf_sealed;
+        iov[iovcnt].iov_len = (s->ptr - s->buf) - s->buf_sealed;
+        iovcnt++;
+    }
+
+    /* telemetry wants to see the raw data too */
+    if (s->logfd != PROT_NO_FD || s->logcallback_proc) {
+        for (i = 0; i < iovcnt; i++)
+            prot_log_raw(s, iov[i].iov_base, iov[i].iov_len);
+    }
+
+    /* hand it to the kernel, handling partial writes */
+    while (iovcnt) {
+        do {
+            cmdtime_netstart();
+            n = writev(s->fd, iovp, iovcnt);
+            cmdtime_netend();
+        } while (n == -1 && errno == EINTR && !signals_poll());
+
+        if (n == -1) {
+            s->error = xstrdup(strerror(errno));
+            break;
+        }
+
+        while (iovcnt && (size_t) n >= iovp->iov_len) {
+            n -= iovp->iov_len;
+            iovp++;
+            iovcnt--;
+        }
+        if (n) {
+            iovp->iov_base = (char *) iovp->iov_base + n;
+            iovp->iov_len -= n;
+        }
+    }
+
+    /* Reset the queue and the memory buffer */
+    s->iov_cnt = 0;
+    s->iov_bytes = 0;
+    s->buf_sealed = 0;
+    s->ptr = s->buf;
+    s->cnt = s->maxplain;
+
+    return s->error ? EOF : 0;
+}
+
 int prot_flush_internal(struct protstream *s, int force)
 {
     int n;
     int save_dontblock = s->dontblock;
+    int zdrain = 0;
 
     const char *ptr = (char *) s->buf; /* Memory buffer info */
     unsigned left = s->ptr - s->buf;
 
     assert(s->write);
 
+#ifdef HAVE_ZLIB
+    /* a sync flush must run the encoder even with an empty buffer if
+     * earlier spill flushes left plaintext inside the deflate state */
+    if (s->zstrm && s->zpending && s->zflush != Z_NO_FLUSH)
+        zdrain = 1;
+#endif
+
     /* Is this protstream finished? */
     if (s->eof || s->error) {
+        s->iov_cnt = 0;
+        s->iov_bytes = 0;
+        s->buf_sealed = 0;
         s->ptr = s->buf;
         s->cnt = 1;
         return EOF;
     }
 
+    /* If blocks are queued by reference, the whole flush goes through
+     * writev() - the stream was a plain blocking socket when they were
+     * queued, so 'force' and the layers have nothing to do */
+    if (s->iov_cnt)
+        return prot_flush_iov(s);
+
     /* make sure that the main file descriptor is set up to
      * be blocking or nonblocking based on the configuration of the
      * protstream and the force flag */
@@ -1042,14 +1356,14 @@ int prot_flush_internal(struct protstream *s, int force)
         }
 
         /* Is there anything in the memory buffer? */
-        if(!left) {
+        if(!left && !zdrain) {
             goto done;
         }
 
         /* Do a regular write of whatever is left */
 
         /* Log and Encode it */
-        prot_flush_log(s);
+        if (left) prot_flush_log(s);
 
         if(prot_flush_encode(s, &ptr, &left) == EOF) {
             /* s->error set by prot_flush_encode */
@@ -1092,12 +1406,12 @@ int prot_flush_internal(struct protstream *s, int force)
         }
 
         /* If there isn't anything in the memory buffer, we're done now */
-        if(!left) {
+        if(!left && !zdrain) {
             goto done;
         }
 
         /* Prepare the data in the memory buffer */
-        prot_flush_log(s);
+        if (left) prot_flush_log(s);
 
         /* Encode it */
         if(prot_flush_encode(s, &ptr, &left) == EOF) {
@@ -1173,6 +1487,11 @@ int prot_flush_internal(struct protstream *s, int force)
     s->cnt = s->maxplain;
 
  done:
+#ifdef HAVE_ZLIB
+    /* spill mode only ever applies to the one flush it was set for */
+    if (s->zstrm) s->zflush = Z_SYNC_FLUSH;
+#endif
+
     /* are we done with the big buffer? If so, free it. This includes
      * when we exit with error */
     if (s->big_buffer != PROT_NO_FD &&
@@ -1248,6 +1567,12 @@ EXPORTED int prot_write(struct protstream *s, const char *buf, unsigned len)
         buf += s->cnt;
         len -= s->cnt;
         s->cnt = 0;
+#ifdef HAVE_ZLIB
+        /* just spilling a full buffer, not a protocol boundary: let
+         * deflate batch across buffers instead of sync-flushing each
+         * one, which costs CPU and ratio on small blocks */
+        if (s->zstrm) s->zflush = Z_NO_FLUSH;
+#endif
         if (prot_flush_internal(s,0) == EOF) return EOF;
     }
     memcpy(s->ptr, buf, len);
@@ -1260,6 +1585,82 @@ EXPORTED int prot_write(struct protstream *s, const char *buf, unsigned len)
     return 0;
 }
 
+/*
+ * Write a large block of data (typically a mapped message file)
+ * to a protection stream.  On a plain blocking stream the block is
+ * queued by reference rather than chopped into PROT_BUFSIZE memcpys
+ * through the stream buffer; the next flush hands the queued blocks
+ * and the interleaved buffered fragments to writev() in one go, so a
+ * FETCH response goes from map to kernel in one copy and one syscall.
+ * The data at 'buf' must stay valid until the stream is flushed
+ * (mapped message files always do).  Any layered stream (TLS, SASL
+ * security layer, COMPRESS, buffer output) or a short block just
+ * falls through to prot_write.
+ */
+EXPORTED int prot_writemap(struct protstream *s, const char *buf, unsigned len)
+{
+    assert(s->write);
+    if (s->error || s->eof) return EOF;
+    if (len == 0) return 0;
+
+    if (len < PROT_BUFSIZE || s->writetobuf || s->dontblock || s->saslssf ||
+        s->big_buffer != PROT_NO_FD)
+        return prot_write(s, buf, len);
+#ifdef HAVE_ZLIB
+    if (s->zstrm)
+        return prot_write(s, buf, len);
+#endif
+#ifdef HAVE_SSL
+    if (s->tls_conn)
+        return prot_write(s, buf, len);
+#endif
+
+    if (!s->iov)
+        s->iov = (struct iovec *)
+            xmalloc(PROT_IOV_MAX * sizeof(struct iovec));
+
+    /* make room for a buffer extent plus our block */
+    if (s->iov_cnt > PROT_IOV_MAX - 2) {
+        if (prot_flush_internal(s, 1) == EOF) return EOF;
+    }
+
+    /* seal the buffered bytes ahead of us so ordering is preserved */
+    if (s->ptr - s->buf > (ptrdiff_t) s->buf_sealed) {
+        s->iov[s->iov_cnt].iov_base = s->buf + s->buf_sealed;
+        s->iov[s->iov_cnt].iov_len = (s->ptr - s->buf) - s->buf_sealed;
+        s->iov_cnt++;
+        s->buf_sealed = s->ptr - s->buf;
+    }
+
+    s->iov[s->iov_cnt].iov_base = (void *) buf;
+    s->iov[s->iov_cnt].iov_len = len;
+    s->iov_cnt++;
+    s->iov_bytes += len;
+    s->bytes_out += len;
+
+    return 0;
+}
+
+/*
+ * Write an unsigned decimal number to the output stream 's' without
+ * going through the printf machinery.  The per-message items of a
+ * bulk FETCH response are constant fragments plus numbers, so these
+ * keep vsnprintf out of that loop entirely.
+ */
+EXPORTED int prot_putuint32(struct protstream *s, uint32_t num)
+{
+    char buf[11];
+
+    return prot_write(s, buf, uint32_to_dec(num, buf));
+}
+
+EXPORTED int prot_putuint64(struct protstream *s, uint64_t num)
+{
+    char buf[21];
+
+    return prot_write(s, buf, uint64_to_dec(num, buf));
+}
+
 EXPORTED int prot_putbuf(struct protstream *s, struct buf *buf)
 {
     return prot_write(s, buf->s, buf->len);
@@ -1468,9 +1869,11 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
 {
     struct protstream *s, *timeout_prot = NULL;
     struct protgroup *retval = NULL;
-    int max_fd, found_fds = 0;
+    int found_fds = 0;
     unsigned i;
-    fd_set rfds;
+    struct pollfd *pfds;
+    struct protstream **pstreams;
+    nfds_t nfds = 0;
     int have_readtimeout = 0;
     struct timeval my_timeout;
     struct prot_waitevent *event;
@@ -1484,11 +1887,10 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
     /* Initialize things we might use */
     errno = 0;
     found_fds = 0;
-    FD_ZERO(&rfds);
 
-    /* If extra_read_fd is PROT_NO_FD, then the first protstream
-     * will override it */
-    max_fd = extra_read_fd;
+    /* room for every stream plus the extra fd */
+    pfds = xmalloc((readstreams->next_element + 1) * sizeof(struct pollfd));
+    pstreams = xmalloc((readstreams->next_element + 1) * sizeof(struct protstream *));
 
     for(i = 0; i<readstreams->next_element; i++) {
         int have_thistimeout = 0; /* used to compute the minimal timeout for */
@@ -1523,9 +1925,11 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
                 timeout_prot = s;
         }
 
-        FD_SET(s->fd, &rfds);
-        if(s->fd > max_fd)
-            max_fd = s->fd;
+        pfds[nfds].fd = s->fd;
+        pfds[nfds].events = POLLIN;
+        pfds[nfds].revents = 0;
+        pstreams[nfds] = s;
+        nfds++;
 
         /* Is something currently pending in our protstream's buffer? */
         if(s->cnt > 0) {
@@ -1549,15 +1953,18 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
 #endif
     }
 
-    /* xxx we should probably do a nonblocking select on the remaining
+    /* xxx we should probably do a nonblocking poll on the remaining
      * protstreams instead of skipping this part entirely */
     if(!retval) {
         time_t sleepfor;
 
-        /* do a select */
+        /* do a poll */
         if(extra_read_fd != PROT_NO_FD) {
-            /* max_fd started with atleast extra_read_fd */
-            FD_SET(extra_read_fd, &rfds);
+            pfds[nfds].fd = extra_read_fd;
+            pfds[nfds].events = POLLIN;
+            pfds[nfds].revents = 0;
+            pstreams[nfds] = NULL;
+            nfds++;
         }
 
         if(read_timeout < now)
@@ -1575,24 +1982,31 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
             timeout->tv_usec = 0;
         }
 
-        if(signals_select(max_fd + 1, &rfds, NULL, NULL, timeout) == -1)
+        if(signals_ppoll(pfds, nfds, timeout) == -1) {
+            free(pstreams);
+            free(pfds);
             return -1;
+        }
 
         /* Reset now */
         now = time(NULL);
 
-        if(extra_read_fd != PROT_NO_FD && FD_ISSET(extra_read_fd, &rfds)) {
-            *extra_read_flag = 1;
-            found_fds++;
-        } else if(extra_read_flag) {
+        if(extra_read_flag)
             *extra_read_flag = 0;
-        }
 
-        for(i = 0; i<readstreams->next_element; i++) {
-            s = readstreams->group[i];
-            if (!s) continue;
+        for(i = 0; i < nfds; i++) {
+            s = pstreams[i];
+
+            if(!s) {
+                /* the extra_read_fd */
+                if(pfds[i].revents) {
+                    *extra_read_flag = 1;
+                    found_fds++;
+                }
+                continue;
+            }
 
-            if(FD_ISSET(s->fd, &rfds)) {
+            if(pfds[i].revents) {
                 found_fds++;
 
                 if(!retval)
@@ -1612,6 +2026,9 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
         }
     }
 
+    free(pstreams);
+    free(pfds);
+
     *out = retval;
     return found_fds;
 }
@@ -1756,6 +2173,25 @@ EXPORTED inline int prot_getc(struct protstream *s)
     return prot_fill(s);
 }
 
+EXPORTED const char *prot_peek(struct protstream *s, size_t *lenp)
+{
+    assert(!s->write);
+
+    *lenp = s->cnt;
+    return (const char *) s->ptr;
+}
+
+EXPORTED void prot_skip(struct protstream *s, size_t n)
+{
+    assert(!s->write);
+    assert(n <= s->cnt);
+
+    s->ptr += n;
+    s->cnt -= n;
+    s->can_unget += n;
+    s->bytes_in += n;
+}
+
 EXPORTED int prot_ungetc(int c, struct protstream *s)
 {
     assert(!s->write);
@@ -1783,8 +2219,13 @@ EXPORTED int prot_putc(int c, struct protstream *s)
     *s->ptr++ = c;
 
     s->bytes_out++;
-    if (--s->cnt == 0)
+    if (--s->cnt == 0) {
+#ifdef HAVE_ZLIB
+        /* buffer spill, not a boundary - see prot_write */
+        if (s->zstrm) s->zflush = Z_NO_FLUSH;
+#endif
         return prot_flush_internal(s,0);
+    }
 
     return 0;
 }
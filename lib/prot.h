@@ -47,6 +47,7 @@
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 
 #include <sasl/sasl.h>
 #include <config.h>
@@ -64,6 +65,16 @@
 #define PROT_BUFSIZE 4096
 /* #define PROT_BUFSIZE 8192 */
 
+/* TLS write streams coalesce output into full 16K TLS records
+ * (the maximum plaintext per record, RFC 5246) before encrypting,
+ * so pipelined responses don't pay record overhead four times per
+ * buffer.  See prot_settls(). */
+#define PROT_TLSBUFSIZE 16384
+
+/* Largest input buffer prot_setreadahead() will grow a read stream
+ * to while a literal with a known byte count is being ingested */
+#define PROT_READAHEAD_MAX 65536
+
 #define PROT_NO_FD -1
 
 struct protstream;
@@ -71,6 +82,8 @@ struct prot_waitevent;
 
 typedef void prot_readcallback_t(struct protstream *s, void *rock);
 typedef ssize_t prot_fillcallback_t(unsigned char *buf, size_t len, void *rock);
+typedef void prot_logcallback_t(const char *buf, size_t len, int iswrite,
+                                void *rock);
 
 struct protstream {
     /* The Buffer */
@@ -79,11 +92,19 @@ struct protstream {
     unsigned char *ptr; /* The end of data in the buffer */
     unsigned cnt; /* Space Remaining in buffer */
 
+    /* Bulk bytes the parser has told us are coming on a read stream
+     * (see prot_setreadahead); lets prot_fill issue large reads */
+    size_t readahead;
+
     /* File Descriptors */
     int fd;         /* The Socket */
     int logfd;      /* The Telemetry Log (or PROT_NO_FD) */
     int big_buffer; /* The Big Buffer (or PROT_NO_FD) */
 
+    /* Telemetry sink callback; when set it replaces writes to logfd */
+    prot_logcallback_t *logcallback_proc;
+    void *logcallback_rock;
+
     /* SASL / TLS */
     sasl_conn_t *conn;
     int saslssf;
@@ -101,9 +122,22 @@ struct protstream {
     unsigned int zbuf_size;
     /* Compress parameters */
     int zlevel;
-    int zflush;
+    int zflush;          /* deflate flush mode for the next encode:
+                          * Z_NO_FLUSH while merely spilling a full
+                          * buffer, Z_SYNC_FLUSH at real boundaries */
+    unsigned zpending;   /* plaintext bytes fed to deflate but not yet
+                          * sync-flushed onto the wire */
 #endif /* HAVE_ZLIB */
 
+    /* Scatter-gather output queue (write streams, see prot_writemap).
+     * Large blocks are queued here by reference, interleaved with
+     * extents of 'buf', so that a flush can hand the whole response
+     * to writev() in one go instead of copying it all through 'buf' */
+    struct iovec *iov;
+    int iov_cnt;
+    unsigned iov_bytes;  /* total bytes queued by reference */
+    unsigned buf_sealed; /* bytes of 'buf' already captured in iov */
+
     /* Big Buffer Information */
     const char *bigbuf_base;  /* Base Pointer */
     size_t bigbuf_siz; /* Overall Size of Buffer */
@@ -163,6 +197,16 @@ int prot_flush_internal(struct protstream *s, int force);
 struct protgroup; /* Opaque protgroup structure */
 
 extern int prot_getc(struct protstream *s);
+
+/* Peek at the unconsumed bytes already buffered on a read stream
+ * without consuming them.  Returns a pointer into the stream buffer -
+ * only valid until the next fill - and stores the byte count (which
+ * may be zero) in *lenp.  Never blocks.  Parsers use this to take a
+ * run of ordinary characters in one go instead of a getc at a time. */
+extern const char *prot_peek(struct protstream *s, size_t *lenp);
+
+/* Consume 'n' bytes previously returned by prot_peek() */
+extern void prot_skip(struct protstream *s, size_t n);
 extern int prot_ungetc(int c, struct protstream *s);
 extern int prot_putc(int c, struct protstream *s);
 
@@ -193,10 +237,17 @@ extern struct protstream *prot_writebuf(struct buf *buf);
 extern struct protstream *prot_readmap(const char *base, uint32_t len);
 extern struct protstream *prot_readcb(prot_fillcallback_t *proc, void *rock);
 extern int prot_free(struct protstream *s);
+extern int prot_reuse(struct protstream *s, int fd, int write);
 
 /* Set the telemetry logfile for a given protstream */
 extern int prot_setlog(struct protstream *s, int fd);
 
+/* Route telemetry for a given protstream to a callback instead of a
+ * logfile descriptor; the callback gets each raw chunk exactly once.
+ * Pass NULL to revert to logfd-based logging. */
+extern int prot_setlogcb(struct protstream *s,
+                         prot_logcallback_t *proc, void *rock);
+
 /* Get traffic counts */
 extern int prot_bytes_in(struct protstream *s);
 extern int prot_bytes_out(struct protstream *s);
@@ -221,6 +272,20 @@ int prot_setisclient(struct protstream *s, int val);
 #ifdef HAVE_ZLIB
 /* Enable (de)compression for a given protstream */
 int prot_setcompress(struct protstream *s);
+
+/* Like prot_setcompress(), but additionally seed the (de)compressor
+ * with a preset dictionary.  Both ends of the connection MUST use the
+ * identical dictionary bytes (raw deflate carries no dictionary id),
+ * so this is only for links where both peers are known to be Cyrus,
+ * like sync replication - never for client-facing COMPRESS=DEFLATE. */
+int prot_setcompress_dict(struct protstream *s,
+                          const char *dict, unsigned dictlen);
+
+/* The stock preset dictionary: common IMAP/sync protocol response
+ * text.  Bytes are part of the wire protocol - never change them,
+ * negotiate a new token instead. */
+extern const char prot_deflate_dict[];
+extern const unsigned prot_deflate_dict_len;
 #endif /* HAVE_ZLIB */
 
 /* Tell the protstream that the type of data is about to change. */
@@ -253,13 +318,27 @@ extern int prot_rewind(struct protstream *s);
 /* Fill the buffer for a read stream with waiting data (may block) */
 extern int prot_fill(struct protstream *s);
 
+/* Hint that 'size' bytes of bulk data are about to be read */
+extern void prot_setreadahead(struct protstream *s, size_t size);
+
 /* Force a flush of an output stream */
 extern int prot_flush(struct protstream *s);
 
+/* Nonblocking flush of an output stream: write what the socket will
+ * take without blocking and keep the rest buffered.  Only meaningful
+ * after prot_NONBLOCK(); on a blocking stream it's just prot_flush() */
+extern int prot_flush_nb(struct protstream *s);
+
+/* Number of output bytes still queued on a write stream */
+extern size_t prot_outputpending(struct protstream *s);
+
 /* These are protlayer versions of the specified functions */
 extern int prot_write(struct protstream *s, const char *buf, unsigned len);
+extern int prot_writemap(struct protstream *s, const char *buf, unsigned len);
 extern int prot_putbuf(struct protstream *s, struct buf *buf);
 extern int prot_puts(struct protstream *s, const char *str);
+extern int prot_putuint32(struct protstream *s, uint32_t num);
+extern int prot_putuint64(struct protstream *s, uint64_t num);
 extern int prot_vprintf(struct protstream *, const char *, va_list);
 extern int prot_printf(struct protstream *, const char *, ...)
 #ifdef __GNUC__
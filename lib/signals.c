@@ -44,6 +44,7 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <poll.h>
 #include <signal.h>
 #include <syslog.h>
 #include <string.h>
@@ -276,6 +277,69 @@ EXPORTED int signals_select(int nfds, fd_set *rfds, fd_set *wfds,
 #endif
 }
 
+/*
+ * Same interface as poll() but closes the same shutdown race as
+ * signals_select(), and has no FD_SETSIZE limit on descriptor values.
+ */
+EXPORTED int signals_ppoll(struct pollfd *fds, nfds_t nfds,
+                           struct timeval *tout)
+{
+#if HAVE_PPOLL
+    /* ppoll() closes the race between a signal arriving
+     * and poll() sleeping, just like pselect() above. */
+    struct timespec ts, *tsptr = NULL;
+    sigset_t blocked;
+    sigset_t oldmask;
+    int saved_errno;
+    int r;
+
+    /* temporarily block all the signals we want
+     * to be caught reliably */
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    sigaddset(&blocked, SIGALRM);
+    sigaddset(&blocked, SIGQUIT);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    sigprocmask(SIG_BLOCK, &blocked, &oldmask);
+
+    /* Those signals will not arrive now.  Check to see if any
+     * of them arrived before we blocked them */
+    signals_poll_mask(&oldmask);
+
+    if (tout) {
+        ts.tv_sec = tout->tv_sec;
+        ts.tv_nsec = tout->tv_usec * 1000;
+        tsptr = &ts;
+    }
+
+    /* ppoll() allows the restartable signals to arrive */
+    r = ppoll(fds, nfds, tsptr, &oldmask);
+
+    if (r < 0 && (errno == EAGAIN || errno == EINTR))
+        signals_poll_mask(&oldmask);
+
+    /* restore the old signal mask */
+    saved_errno = errno;
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    errno = saved_errno;
+
+    return r;
+#else
+    int timeout_ms = -1;
+    int r;
+
+    if (tout)
+        timeout_ms = tout->tv_sec * 1000 + tout->tv_usec / 1000;
+
+    r = poll(fds, nfds, timeout_ms);
+    if (r < 0 && (errno == EAGAIN || errno == EINTR))
+        signals_poll();
+
+    return r;
+#endif
+}
+
 EXPORTED void signals_clear(int sig)
 {
     if (sig >= 0 && sig < _NSIG)
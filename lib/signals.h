@@ -44,6 +44,7 @@
 #define INCLUDED_SIGNALS_H
 
 #include <sys/select.h>
+#include <poll.h>
 #include <unistd.h>
 
 typedef void shutdownfn(int);
@@ -54,6 +55,8 @@ void signals_set_shutdown(shutdownfn *s);
 int signals_poll(void);
 int signals_select(int nfds, fd_set *rfds, fd_set *wfds,
                    fd_set *efds, struct timeval *tout);
+int signals_ppoll(struct pollfd *fds, nfds_t nfds,
+                  struct timeval *tout);
 void signals_clear(int sig);
 int signals_cancelled();
 
@@ -57,6 +57,14 @@
 #include <sys/capability.h>
 #include <sys/prctl.h>
 #endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+/* reflink clone, as defined in linux/fs.h (which clashes with other
+ * headers, so we don't include it) */
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#endif
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -482,7 +490,27 @@ static int _copyfile_helper(const char *from, const char *to, int flags)
         goto done;
     }
 
-    map_refresh(srcfd, 1, &src_base, &src_size, sbuf.st_size, from, 0);
+#ifdef __linux__
+    /* a reflink clone shares the extents instead of duplicating the
+     * data, which makes copies between mailboxes on the same partition
+     * almost free on filesystems that support it (btrfs, xfs).  Any
+     * failure (different filesystem, no support) just means we copy
+     * the bytes as before */
+    if (ioctl(destfd, FICLONE, srcfd) == 0) {
+        if (fsync(destfd)) {
+            syslog(LOG_ERR, "IOERROR: writing %s: %m", to);
+            r = -1;
+            unlink(to);  /* remove any rubbish we created */
+        }
+        goto done;
+    }
+#endif
+
+    /* the source is read exactly once, straight through: prefault it
+     * going in, and drop the pages afterwards so a big copy doesn't
+     * evict the working set */
+    map_refresh_ex(srcfd, 1, &src_base, &src_size, sbuf.st_size, from, 0,
+                   MAP_POLICY_POPULATE);
 
     n = retry_write(destfd, src_base, src_size);
 
@@ -494,7 +522,7 @@ static int _copyfile_helper(const char *from, const char *to, int flags)
     }
 
 done:
-    map_free(&src_base, &src_size);
+    map_free_ex(&src_base, &src_size, MAP_POLICY_DROPCLEAN);
 
     if (srcfd != -1) close(srcfd);
     if (destfd != -1) close(destfd);
@@ -879,6 +907,96 @@ static inline size_t roundup(size_t size)
     return ((size + 1024) & ~1023);
 }
 
+/*
+ * Small-buffer pool.  Transient bufs churn hard - prot_vprintf alone
+ * allocates and frees one per protocol line - so freed buffer memory
+ * of the small roundup() classes is kept on per-class free lists and
+ * handed straight back to the next buf_ensure() instead of going
+ * through malloc each time.  The freed buffer itself holds the list
+ * link, so the pool costs nothing beyond the retained memory, which
+ * is capped per class.
+ *
+ * The state is process-wide and most cyrus daemons are
+ * single-threaded, but mupdate services each connection on its own
+ * thread and they all churn transient bufs, so the lists need
+ * protecting.  The critical sections are a handful of instructions,
+ * so a spinlock on the gcc atomics does the job without dragging a
+ * pthread dependency into lib.
+ */
+
+#define BUFPOOL_MAXPERCLASS 16
+
+struct bufpool_entry {
+    struct bufpool_entry *next;
+};
+
+/* one list per small roundup() class: 32, 64, 128, 256, 512, 1024 */
+static struct bufpool_entry *bufpool[6];
+static unsigned bufpool_count[6];
+static volatile int bufpool_spinlock = 0;
+
+static inline void bufpool_lock(void)
+{
+    while (__sync_lock_test_and_set(&bufpool_spinlock, 1))
+        ;
+}
+
+static inline void bufpool_unlock(void)
+{
+    __sync_lock_release(&bufpool_spinlock);
+}
+
+static int bufpool_class(size_t alloc)
+{
+    switch (alloc) {
+    case 32:   return 0;
+    case 64:   return 1;
+    case 128:  return 2;
+    case 256:  return 3;
+    case 512:  return 4;
+    case 1024: return 5;
+    }
+    return -1;
+}
+
+static char *bufpool_get(size_t alloc)
+{
+    int class = bufpool_class(alloc);
+    struct bufpool_entry *entry;
+
+    if (class < 0) return NULL;
+
+    bufpool_lock();
+    entry = bufpool[class];
+    if (entry) {
+        bufpool[class] = entry->next;
+        bufpool_count[class]--;
+    }
+    bufpool_unlock();
+
+    return (char *)entry;
+}
+
+static int bufpool_put(char *s, size_t alloc)
+{
+    int class = bufpool_class(alloc);
+    struct bufpool_entry *entry = (struct bufpool_entry *)s;
+    int kept = 0;
+
+    if (class < 0) return 0;
+
+    bufpool_lock();
+    if (bufpool_count[class] < BUFPOOL_MAXPERCLASS) {
+        entry->next = bufpool[class];
+        bufpool[class] = entry;
+        bufpool_count[class]++;
+        kept = 1;
+    }
+    bufpool_unlock();
+
+    return kept;
+}
+
 /* this function has a side-effect of always leaving the buffer writable */
 EXPORTED void _buf_ensure(struct buf *buf, size_t n)
 {
@@ -896,7 +1014,8 @@ EXPORTED void _buf_ensure(struct buf *buf, size_t n)
     }
     else {
         buf->alloc = roundup(newlen);
-        s = xmalloc(buf->alloc);
+        s = bufpool_get(buf->alloc);
+        if (!s) s = xmalloc(buf->alloc);
 
         /* if no allocation, but data exists, it means copy on write.
          * grab a copy of what's there now */
@@ -1060,6 +1179,88 @@ EXPORTED void buf_appendbit64(struct buf *buf, bit64 num)
     buf_appendmap(buf, (char *)&item, 8);
 }
 
+/* two decimal digits per table lookup halves the divisions when
+ * rendering a number */
+static const char dec_digitpairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+EXPORTED int uint32_to_dec(uint32_t num, char *buf)
+{
+    char scratch[10];   /* 4294967295 */
+    char *p = scratch + sizeof(scratch);
+    int len;
+
+    while (num >= 100) {
+        const char *pair = dec_digitpairs + (num % 100) * 2;
+        num /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if (num >= 10) {
+        const char *pair = dec_digitpairs + num * 2;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    else {
+        *--p = '0' + (char)num;
+    }
+
+    len = scratch + sizeof(scratch) - p;
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    return len;
+}
+
+EXPORTED int uint64_to_dec(uint64_t num, char *buf)
+{
+    char scratch[20];   /* 18446744073709551615 */
+    char *p = scratch + sizeof(scratch);
+    int len;
+
+    while (num >= 100) {
+        const char *pair = dec_digitpairs + (num % 100) * 2;
+        num /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if (num >= 10) {
+        const char *pair = dec_digitpairs + num * 2;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    else {
+        *--p = '0' + (char)num;
+    }
+
+    len = scratch + sizeof(scratch) - p;
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    return len;
+}
+
+/* append a decimal rendering of 'num', reserving the worst-case space
+ * up front so the digits land directly in the buffer */
+EXPORTED void buf_appenduint32(struct buf *buf, uint32_t num)
+{
+    buf_ensure(buf, 11);
+    buf->len += uint32_to_dec(num, buf->s + buf->len);
+}
+
+EXPORTED void buf_appenduint64(struct buf *buf, uint64_t num)
+{
+    buf_ensure(buf, 21);
+    buf->len += uint64_to_dec(num, buf->s + buf->len);
+}
+
 EXPORTED void buf_appendmap(struct buf *buf, const char *base, size_t len)
 {
     if (len) {
@@ -1361,16 +1562,27 @@ EXPORTED void buf_init_ro_cstr(struct buf *buf, const char *str)
  */
 EXPORTED void buf_init_mmap(struct buf *buf, int onceonly, int fd,
                             const char *fname, size_t size, const char *mboxname)
+{
+    buf_init_mmap_ex(buf, onceonly, fd, fname, size, mboxname,
+                     MAP_POLICY_NONE);
+}
+
+/* As buf_init_mmap(), with an ORed set of MAP_POLICY_* flags */
+EXPORTED void buf_init_mmap_ex(struct buf *buf, int onceonly, int fd,
+                               const char *fname, size_t size,
+                               const char *mboxname, int policy)
 {
     buf->flags = BUF_MMAP;
-    map_refresh(fd, onceonly, (const char **)&buf->s, &buf->len,
-                size, fname, mboxname);
+    map_refresh_ex(fd, onceonly, (const char **)&buf->s, &buf->len,
+                   size, fname, mboxname, policy);
 }
 
 static void _buf_free_data(struct buf *buf)
 {
-    if (buf->alloc)
-        free(buf->s);
+    if (buf->alloc) {
+        if (!bufpool_put(buf->s, buf->alloc))
+            free(buf->s);
+    }
     else if (buf->flags & BUF_MMAP)
         map_free((const char **)&buf->s, &buf->len);
 }
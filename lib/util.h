@@ -271,6 +271,8 @@ void buf_append(struct buf *dst, const struct buf *src);
 void buf_appendcstr(struct buf *buf, const char *str);
 void buf_appendbit32(struct buf *buf, bit32 num);
 void buf_appendbit64(struct buf *buf, bit64 num);
+void buf_appenduint32(struct buf *buf, uint32_t num);
+void buf_appenduint64(struct buf *buf, uint64_t num);
 void buf_appendmap(struct buf *buf, const char *base, size_t len);
 void buf_cowappendmap(struct buf *buf, const char *base, unsigned int len);
 void buf_cowappendfree(struct buf *buf, char *base, unsigned int len);
@@ -299,6 +301,10 @@ void buf_initm(struct buf *buf, char *base, int len);
 void buf_init_ro_cstr(struct buf *buf, const char *str);
 void buf_init_mmap(struct buf *buf, int onceonly, int fd,
                    const char *fname, size_t size, const char *mboxname);
+/* as buf_init_mmap, with an ORed set of MAP_POLICY_* flags (see map.h) */
+void buf_init_mmap_ex(struct buf *buf, int onceonly, int fd,
+                      const char *fname, size_t size, const char *mboxname,
+                      int policy);
 void buf_free(struct buf *buf);
 void buf_move(struct buf *dst, struct buf *src);
 const char *buf_lcase(struct buf *buf);
@@ -324,6 +330,13 @@ char *strconcat(const char *s1, ...);
 int bin_to_hex(const void *bin, size_t binlen, char *hex, int flags);
 int hex_to_bin(const char *hex, size_t hexlen, void *bin);
 
+/* render 'num' as decimal digits plus a NUL into 'buf', which must
+ * have room for at least 11 (32 bit) or 21 (64 bit) bytes.  Returns
+ * the length, excluding the NUL.  Cheaper than snprintf for the
+ * numbers scattered through protocol responses */
+int uint32_to_dec(uint32_t num, char *buf);
+int uint64_to_dec(uint64_t num, char *buf);
+
 /* use getpassphrase on machines which support it */
 #ifdef HAVE_GETPASSPHRASE
 #define cyrus_getpass getpassphrase
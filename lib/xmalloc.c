@@ -47,6 +47,7 @@
 #include "xmalloc.h"
 
 #include "exitcodes.h"
+#include "mpool.h"
 
 EXPORTED void* xmalloc(size_t size)
 {
@@ -116,3 +117,62 @@ EXPORTED void *xmemdup(const void *ptr, size_t size)
     memcpy(p, ptr, size);
     return p;
 }
+
+/* connection arena - see xmalloc.h.  Lazily created on first use;
+ * the high-water mark survives resets so a server process can report
+ * its largest connection */
+static struct mpool *conn_arena = NULL;
+static size_t conn_arena_used = 0;
+static size_t conn_arena_highwater = 0;
+
+EXPORTED void *xarena_malloc(size_t size)
+{
+    if (!conn_arena) conn_arena = new_mpool(0);
+
+    conn_arena_used += size;
+    if (conn_arena_used > conn_arena_highwater)
+        conn_arena_highwater = conn_arena_used;
+
+    return mpool_malloc(conn_arena, size);
+}
+
+EXPORTED void *xarena_zmalloc(size_t size)
+{
+    void *ret = xarena_malloc(size);
+    memset(ret, 0, size);
+    return ret;
+}
+
+EXPORTED char *xarena_strdup(const char *str)
+{
+    char *p = xarena_malloc(strlen(str)+1);
+    strcpy(p, str);
+    return p;
+}
+
+EXPORTED char *xarena_strndup(const char *str, size_t len)
+{
+    char *p = xarena_malloc(len+1);
+    if (len) strncpy(p, str, len);
+    p[len] = '\0';
+    return p;
+}
+
+EXPORTED void xarena_reset(void)
+{
+    if (conn_arena) {
+        free_mpool(conn_arena);
+        conn_arena = NULL;
+    }
+    conn_arena_used = 0;
+}
+
+EXPORTED size_t xarena_used(void)
+{
+    return conn_arena_used;
+}
+
+EXPORTED size_t xarena_highwater(void)
+{
+    return conn_arena_highwater;
+}
@@ -58,6 +58,21 @@ extern char *xstrdupsafe (const char *str);
 extern char *xstrndup (const char *str, size_t len);
 extern void *xmemdup (const void *ptr, size_t size);
 
+/* Connection arena: allocations whose lifetime matches the current
+ * connection can be tagged in here instead of the general heap, and a
+ * single xarena_reset() at connection end hands the whole lot back as
+ * a few large blocks.  Long-lived server processes otherwise
+ * interleave small allocations from many subsystems and slowly
+ * fragment the heap.  Arena pointers must never be passed to free(),
+ * and are all invalidated by xarena_reset(). */
+extern void *xarena_malloc (size_t size);
+extern void *xarena_zmalloc (size_t size);
+extern char *xarena_strdup (const char *str);
+extern char *xarena_strndup (const char *str, size_t len);
+extern void xarena_reset (void);
+extern size_t xarena_used (void);
+extern size_t xarena_highwater (void);
+
 /* Functions using xmalloc.h must provide a function called fatal() conforming
    to the following: */
 extern void fatal(const char *fatal_message, int fatal_code)
@@ -131,6 +131,7 @@ enum {
 static int verbose = 0;
 static int listen_queue_backlog = 32;
 static int pidfd = -1;
+static int stats_fd = -1;       /* resource usage queries from cyr_info */
 
 static int in_shutdown = 0;
 
@@ -177,6 +178,7 @@ struct centry {
     char *desc;                 /* human readable description for logging */
     struct timeval spawntime;   /* when the centry was allocated */
     time_t sighuptime;          /* when did we send a SIGHUP */;
+    time_t draintime;           /* when we started draining, 0 if not */
     struct centry *next;
 };
 static struct centry *ctable[child_table_size];
@@ -604,6 +606,25 @@ static void service_create(struct service *s)
             syslog(LOG_ERR, "unable to setsocketopt(SO_REUSEADDR) service %s/%s: %m",
                 s->name, s->familyname);
         }
+#ifdef SO_REUSEPORT
+        if (s->reuseport && s->family == AF_UNIX) {
+            syslog(LOG_WARNING,
+                   "reuseport= doesn't apply to unix socket service %s, ignored",
+                   s->name);
+            s->reuseport = 0;
+        }
+        /* every socket bound to this address must carry SO_REUSEPORT,
+         * including this one, even though the children do the listening */
+        if (s->reuseport) {
+            r = setsockopt(s->socket, SOL_SOCKET, SO_REUSEPORT,
+                           (void *) &on, sizeof(on));
+            if (r < 0) {
+                syslog(LOG_ERR, "unable to setsocketopt(SO_REUSEPORT) service %s/%s: %m",
+                    s->name, s->familyname);
+                s->reuseport = 0;
+            }
+        }
+#endif
 #if defined(IPV6_V6ONLY) && !(defined(__FreeBSD__) && __FreeBSD__ < 3)
         if (res->ai_family == AF_INET6) {
             r = setsockopt(s->socket, IPPROTO_IPV6, IPV6_V6ONLY,
@@ -639,19 +660,33 @@ static void service_create(struct service *s)
             continue;
         }
 
+        /* remember the bound address so spawned children can bind their
+         * own SO_REUSEPORT listeners to it */
+        memcpy(&s->addr, res->ai_addr, res->ai_addrlen);
+        s->addrlen = res->ai_addrlen;
+
         if (s->listen[0] == '/') { /* unix socket */
             /* for DUX, where this isn't the default.
                (harmlessly fails on some systems) */
             chmod(s->listen, (mode_t) 0777);
         }
 
-        if ((!strcmp(s->proto, "tcp") || !strcmp(s->proto, "tcp4")
-             || !strcmp(s->proto, "tcp6"))
-            && listen(s->socket, listen_queue_backlog) < 0) {
-            syslog(LOG_ERR, "unable to listen to %s/%s socket: %m",
-                s->name, s->familyname);
-            xclose(s->socket);
-            continue;
+        if (!strcmp(s->proto, "tcp") || !strcmp(s->proto, "tcp4")
+             || !strcmp(s->proto, "tcp6")) {
+            if (s->reuseport) {
+                /* each child listens on its own SO_REUSEPORT socket and
+                 * the kernel balances accepts across them.  Keep this
+                 * socket bound (so the address stays reserved and new
+                 * children can join the group) but NOT listening - a
+                 * listening socket nobody accepts on would blackhole
+                 * its share of incoming connections */
+            }
+            else if (listen(s->socket, listen_queue_backlog) < 0) {
+                syslog(LOG_ERR, "unable to listen to %s/%s socket: %m",
+                    s->name, s->familyname);
+                xclose(s->socket);
+                continue;
+            }
         }
 
         s->ready_workers = 0;
@@ -814,12 +849,123 @@ static int service_is_fork_limited(struct service *s)
     return 0;
 }
 
+/* How much the connection arrival rate estimator decays, as a
+ * proportion, per second.  Decays more slowly than FORKRATE_ALPHA so
+ * a brief lull during a login storm doesn't cool the warm pool */
+#define CONNRATE_ALPHA      0.9     /* per second */
+
+static void service_update_connrate(struct service *s)
+{
+    struct timeval now;
+    double interval;
+
+    gettimeofday(&now, 0);
+    interval = timesub(&s->last_connrate_update, &now);
+
+    if (interval >= 1.0) {
+        double f = pow(CONNRATE_ALPHA, interval);
+        int arrivals = s->nconnections - s->last_nconnections;
+
+        if (arrivals < 0) arrivals = 0; /* counter was reset */
+        s->connrate = f * s->connrate + (1.0-f) * (arrivals/interval);
+        s->last_nconnections = s->nconnections;
+        s->last_connrate_update = now;
+    }
+    else if (interval < 0.0) {
+        /* time of day clock went backwards - restart the estimate */
+        s->last_nconnections = s->nconnections;
+        s->last_connrate_update = now;
+    }
+}
+
+/* How many ready workers we want right now.  With prefork_max set,
+ * the warm pool scales with the recent connection arrival rate, so a
+ * connection storm finds processes already forked and initialised
+ * rather than paying fork+init latency on each new connection */
+static int service_ready_target(struct service *s)
+{
+    int target = s->desired_workers;
+
+    if (s->prefork_max > target) {
+        int want = (int) ceil(s->connrate);
+
+        if (want > s->prefork_max) want = s->prefork_max;
+        if (want > target) target = want;
+    }
+
+    return target;
+}
+
+#ifdef SO_REUSEPORT
+/* create a private listener for one child of a reuseport= service,
+ * bound to the same address as the master's (non-listening) socket.
+ * Runs in the forked child before exec, so the bind happens with the
+ * master's privileges and effective uid - both required for privileged
+ * ports and for joining the SO_REUSEPORT group. */
+static int reuseport_listener(struct service *s)
+{
+    int fd;
+    int on = 1;
+
+    fd = socket(s->family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "unable to open reuseport %s/%s socket: %m",
+            s->name, s->familyname);
+        return -1;
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+                   (void *) &on, sizeof(on)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+                   (void *) &on, sizeof(on)) < 0) {
+        syslog(LOG_ERR, "unable to setsocketopt(SO_REUSEPORT) service %s/%s: %m",
+            s->name, s->familyname);
+        xclose(fd);
+        return -1;
+    }
+#if defined(IPV6_V6ONLY) && !(defined(__FreeBSD__) && __FreeBSD__ < 3)
+    if (s->family == AF_INET6) {
+        if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
+                       (void *) &on, sizeof(on)) < 0) {
+            syslog(LOG_ERR, "unable to setsocketopt(IPV6_V6ONLY) service %s/%s: %m",
+                s->name, s->familyname);
+        }
+    }
+#endif
+#if defined(SOL_IP) && defined(IP_TOS)
+    if (setsockopt(fd, SOL_IP, IP_TOS,
+                   (void *) &config_qosmarking,
+                   sizeof(config_qosmarking)) < 0) {
+        syslog(LOG_WARNING,
+               "unable to setsocketopt(IP_TOS) service %s/%s: %m",
+               s->name, s->familyname);
+    }
+#endif
+
+    if (cap_bind(fd, (struct sockaddr *) &s->addr, s->addrlen) < 0) {
+        syslog(LOG_ERR, "unable to bind reuseport %s/%s socket: %m",
+            s->name, s->familyname);
+        xclose(fd);
+        return -1;
+    }
+
+    if (listen(fd, listen_queue_backlog) < 0) {
+        syslog(LOG_ERR, "unable to listen to reuseport %s/%s socket: %m",
+            s->name, s->familyname);
+        xclose(fd);
+        return -1;
+    }
+
+    return fd;
+}
+#endif /* SO_REUSEPORT */
+
 static void spawn_service(int si)
 {
     pid_t p;
     int i;
     char path[PATH_MAX];
-    static char name_env[100], name_env2[100], name_env3[100];
+    static char name_env[100], name_env2[100], name_env3[100], name_env4[100];
     struct centry *c;
     struct service *s = &Services[si];
 
@@ -853,14 +999,29 @@ static void spawn_service(int si)
         child_sighandler_setup();
 
         if (s->listen) {
+            int listener = s->socket;
+
+#ifdef SO_REUSEPORT
+            if (s->reuseport && s->addrlen) {
+                /* this child accepts on its own listener; the kernel
+                 * load-balances connections across the group */
+                listener = reuseport_listener(s);
+                if (listener < 0) exit(1);
+                snprintf(name_env4, sizeof(name_env4), "CYRUS_REUSEPORT=1");
+                putenv(name_env4);
+            }
+#endif
+
             if (dup2(s->stat[1], STATUS_FD) < 0) {
                 syslog(LOG_ERR, "can't duplicate status fd: %m");
                 exit(1);
             }
-            if (dup2(s->socket, LISTEN_FD) < 0) {
+            if (dup2(listener, LISTEN_FD) < 0) {
                 syslog(LOG_ERR, "can't duplicate listener fd: %m");
                 exit(1);
             }
+            if (listener != s->socket && listener != LISTEN_FD)
+                xclose(listener);
 
             fcntl_unset(STATUS_FD, FD_CLOEXEC);
             fcntl_unset(LISTEN_FD, FD_CLOEXEC);
@@ -1034,15 +1195,49 @@ static void spawn_schedule(struct timeval now)
     }
 }
 
+/* accumulate an exited child's resource usage into its service */
+static void service_add_usage(struct service *s, const struct rusage *ru)
+{
+    s->usage_utime.tv_sec += ru->ru_utime.tv_sec;
+    s->usage_utime.tv_usec += ru->ru_utime.tv_usec;
+    if (s->usage_utime.tv_usec >= 1000000) {
+        s->usage_utime.tv_sec++;
+        s->usage_utime.tv_usec -= 1000000;
+    }
+    s->usage_stime.tv_sec += ru->ru_stime.tv_sec;
+    s->usage_stime.tv_usec += ru->ru_stime.tv_usec;
+    if (s->usage_stime.tv_usec >= 1000000) {
+        s->usage_stime.tv_sec++;
+        s->usage_stime.tv_usec -= 1000000;
+    }
+    if (ru->ru_maxrss > s->usage_maxrss)
+        s->usage_maxrss = ru->ru_maxrss;
+    s->usage_inblock += ru->ru_inblock;
+    s->usage_oublock += ru->ru_oublock;
+    s->usage_nchildren++;
+}
+
+/* waitpid() with per-child resource usage where the platform has wait4() */
+static pid_t reap_one(int *statusp, struct rusage *ru)
+{
+#ifdef HAVE_WAIT4
+    return wait4((pid_t) -1, statusp, WNOHANG, ru);
+#else
+    memset(ru, 0, sizeof(*ru));
+    return waitpid((pid_t) -1, statusp, WNOHANG);
+#endif
+}
+
 static void reap_child(void)
 {
     int status;
     pid_t pid;
+    struct rusage ru;
     struct centry *c;
     struct service *s;
     int failed;
 
-    while ((pid = waitpid((pid_t) -1, &status, WNOHANG)) > 0) {
+    while ((pid = reap_one(&status, &ru)) > 0) {
 
         /* account for the child */
         c = centry_find(pid);
@@ -1127,6 +1322,9 @@ static void reap_child(void)
                     /* Shouldn't get here */
                     break;
                 }
+
+                /* roll its resource usage into the service totals */
+                service_add_usage(s, &ru);
             } else {
                 /* children from spawn_schedule (events) or
                  * children of services removed by reread_conf() */
@@ -1154,6 +1352,84 @@ static void reap_child(void)
     }
 }
 
+/* open the socket on which we answer resource usage queries */
+static void stats_socket_open(void)
+{
+    struct sockaddr_un local;
+    const char *dir = config_getstring(IMAPOPT_CONFIGDIRECTORY);
+    mode_t oldumask;
+    int s, len;
+
+    if (!dir) return;
+
+    memset(&local, 0, sizeof(local));
+    local.sun_family = AF_UNIX;
+    strlcpy(local.sun_path, dir, sizeof(local.sun_path));
+    strlcat(local.sun_path, FNAME_MASTER_STATS_SOCK, sizeof(local.sun_path));
+
+    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        syslog(LOG_ERR, "unable to create statistics socket: %m");
+        return;
+    }
+
+    unlink(local.sun_path);
+    len = sizeof(local.sun_family) + strlen(local.sun_path) + 1;
+
+    oldumask = umask((mode_t) 0); /* for Linux */
+    if (bind(s, (struct sockaddr *)&local, len) == -1) {
+        syslog(LOG_ERR, "unable to bind statistics socket %s: %m",
+               local.sun_path);
+        umask(oldumask);
+        close(s);
+        return;
+    }
+    umask(oldumask); /* for Linux */
+    chmod(local.sun_path, 0700); /* for DUX */
+
+    if (listen(s, listen_queue_backlog) == -1) {
+        syslog(LOG_ERR, "unable to listen on statistics socket: %m");
+        close(s);
+        return;
+    }
+
+    stats_fd = s;
+}
+
+/* answer one cyr_info "master-stats" query: a line per service with the
+ * resource usage its exited children have accumulated */
+static void stats_dump(int fd)
+{
+    FILE *f;
+    int i;
+
+    f = fdopen(fd, "w");
+    if (!f) {
+        close(fd);
+        return;
+    }
+
+    for (i = 0; i < nservices; i++) {
+        struct service *s = &Services[i];
+
+        if (!s->name) continue;
+
+        fprintf(f, "%s/%s children=%lu"
+                " utime=%lu.%06lu stime=%lu.%06lu"
+                " maxrss=%ld inblock=%ld oublock=%ld"
+                " active=%d ready=%d connections=%d forks=%d\n",
+                s->name, SERVICEPARAM(s->familyname),
+                s->usage_nchildren,
+                (unsigned long) s->usage_utime.tv_sec,
+                (unsigned long) s->usage_utime.tv_usec,
+                (unsigned long) s->usage_stime.tv_sec,
+                (unsigned long) s->usage_stime.tv_usec,
+                s->usage_maxrss, s->usage_inblock, s->usage_oublock,
+                s->nactive, s->ready_workers, s->nconnections, s->nforks);
+    }
+
+    fclose(f);
+}
+
 static void init_janitor(struct timeval now)
 {
     struct event *evt = (struct event *) xzmalloc(sizeof(struct event));
@@ -1202,14 +1478,25 @@ static void child_janitor(struct timeval now)
                     p = &((*p)->next);
                 }
             } else {
+                struct service *s = ((c->si) != SERVICE_NONE) ?
+                    &Services[c->si] : NULL;
                 time_t delay = (c->sighuptime != (time_t)-1) ?
                     time(NULL) - c->sighuptime : 0;
 
+                if (c->draintime && s &&
+                    time(NULL) - c->draintime >= s->drain_time) {
+                    /* drain deadline passed, recycle it the hard way */
+                    syslog(LOG_INFO, "service %s/%s pid %d still busy "
+                        "%d seconds after config reload, recycling",
+                        SERVICEPARAM(s->name), SERVICEPARAM(s->familyname),
+                        c->pid, s->drain_time);
+                    kill(c->pid, SIGHUP);
+                    c->sighuptime = time(NULL);
+                    c->draintime = 0;
+                }
+
                 if (delay >= 30) {
                     /* client not yet logged out ? */
-                    struct service *s = ((c->si) != SERVICE_NONE) ?
-                        &Services[c->si] : NULL;
-
                     syslog(LOG_INFO, "service %s/%s pid %d in state %d has not "
                         "yet been recycled since SIGHUP was sent (%ds ago)",
                         s ? SERVICEPARAM(s->name) : "unknown",
@@ -1475,6 +1762,16 @@ static void process_msg(int si, struct notify_message *msg)
                        SERVICEPARAM(s->name), SERVICEPARAM(s->familyname), c->pid);
             centry_set_state(c, SERVICE_STATE_READY);
             s->ready_workers++;
+            if (c->draintime) {
+                /* session over, recycle it onto the new config */
+                syslog(LOG_DEBUG,
+                       "service %s/%s pid %d drained, recycling",
+                       SERVICEPARAM(s->name), SERVICEPARAM(s->familyname),
+                       c->pid);
+                kill(c->pid, SIGHUP);
+                c->sighuptime = time(NULL);
+                c->draintime = 0;
+            }
             break;
 
         case SERVICE_STATE_DEAD:
@@ -1657,6 +1954,10 @@ static void add_daemon(const char *name, struct entry *e, void *rock)
         if (Services[i].associate > 0)
             continue;
 
+        /* skip priority lanes, they are handled with their parent */
+        if (Services[i].prio)
+            continue;
+
         if (!strcmpsafe(Services[i].name, name) && Services[i].exec) {
             /* we have duplicate service names in the config file */
             char buf[256];
@@ -1679,6 +1980,7 @@ static void add_daemon(const char *name, struct entry *e, void *rock)
         /* we don't have an existing one, so create a new service */
         struct service *s = service_add(NULL);
         gettimeofday(&s->last_interval_start, 0);
+        s->last_connrate_update = s->last_interval_start;
     }
     else reconfig = 1;
 
@@ -1717,18 +2019,37 @@ static void add_service(const char *name, struct entry *e, void *rock)
     int ignore_err = rock ? 1 : 0;
     char *cmd = xstrdup(masterconf_getstring(e, "cmd", ""));
     int prefork = masterconf_getint(e, "prefork", 0);
+    int prefork_max = masterconf_getint(e, "prefork_max", 0);
+    int drain_time = masterconf_getint(e, "drain_time", 0);
     int babysit = masterconf_getswitch(e, "babysit", 0);
+    int reuseport = masterconf_getswitch(e, "reuseport", 0);
     int maxforkrate = masterconf_getint(e, "maxforkrate", 0);
     char *listen = xstrdup(masterconf_getstring(e, "listen", ""));
+    char *priolisten = xstrdup(masterconf_getstring(e, "priolisten", ""));
     char *proto = xstrdup(masterconf_getstring(e, "proto", "tcp"));
     char *max = xstrdup(masterconf_getstring(e, "maxchild", "-1"));
     rlim_t maxfds = (rlim_t) masterconf_getint(e, "maxfds", 256);
+    int priomaxchild = masterconf_getint(e, "priomaxchild", 2);
+    int prioprefork = masterconf_getint(e, "prioprefork", 1);
     int reconfig = 0;
     int i, j;
 
     if(babysit && prefork == 0) prefork = 1;
     if(babysit && maxforkrate == 0) maxforkrate = 10; /* reasonable safety */
 
+#ifdef SO_REUSEPORT
+    /* the master's socket doesn't listen in reuseport mode, so demand
+     * can't be noticed until a child exists to accept - always prefork */
+    if (reuseport && prefork == 0) prefork = 1;
+#else
+    if (reuseport) {
+        syslog(LOG_WARNING,
+               "reuseport= not supported on this platform, ignored for service '%s'",
+               name);
+        reuseport = 0;
+    }
+#endif
+
     if (!strcmp(cmd,"") || !strcmp(listen,"")) {
         char buf[256];
         snprintf(buf, sizeof(buf),
@@ -1748,6 +2069,10 @@ static void add_service(const char *name, struct entry *e, void *rock)
         if (Services[i].associate > 0)
             continue;
 
+        /* skip priority lanes, they are handled with their parent */
+        if (Services[i].prio)
+            continue;
+
         if (!strcmpsafe(Services[i].name, name) && Services[i].exec) {
             /* we have duplicate service names in the config file */
             char buf[256];
@@ -1774,6 +2099,7 @@ static void add_service(const char *name, struct entry *e, void *rock)
          */
         struct service *s = service_add(NULL);
         gettimeofday(&s->last_interval_start, 0);
+        s->last_connrate_update = s->last_interval_start;
     }
     else if (Services[i].listen) reconfig = 1;
 
@@ -1802,32 +2128,118 @@ static void add_service(const char *name, struct entry *e, void *rock)
         !strcmp(Services[i].proto, "tcp4") ||
         !strcmp(Services[i].proto, "tcp6")) {
         Services[i].desired_workers = prefork;
+        Services[i].prefork_max = prefork_max;
+        Services[i].drain_time = drain_time;
         Services[i].babysit = babysit;
         Services[i].max_workers = atoi(max);
         if (Services[i].max_workers < 0) {
             Services[i].max_workers = INT_MAX;
         }
+        if (reconfig && Services[i].reuseport != reuseport) {
+            /* the existing socket was bound (and possibly set listening)
+             * under the old mode; switching needs a fresh bind */
+            syslog(LOG_WARNING,
+                   "can't change reuseport= for running service '%s', restart needed",
+                   name);
+        }
+        else Services[i].reuseport = reuseport;
     } else {
         /* udp */
         if (prefork > 1) prefork = 1;
         Services[i].desired_workers = prefork;
+        Services[i].prefork_max = 0;
+        Services[i].drain_time = drain_time;
         Services[i].max_workers = 1;
+        Services[i].reuseport = 0;
     }
 
     if (reconfig) {
         /* reconfiguring an existing service, update any other instances */
         for (j = 0; j < nservices; j++) {
-            if (Services[j].associate > 0 && Services[j].listen &&
+            if (Services[j].associate > 0 && !Services[j].prio &&
+                Services[j].listen &&
                 Services[j].name && !strcmp(Services[j].name, name)) {
                 Services[j].maxforkrate = Services[i].maxforkrate;
                 Services[j].exec = Services[i].exec;
                 Services[j].desired_workers = Services[i].desired_workers;
+                Services[j].prefork_max = Services[i].prefork_max;
+                Services[j].drain_time = Services[i].drain_time;
                 Services[j].babysit = Services[i].babysit;
+                Services[j].reuseport = Services[i].reuseport;
                 Services[j].max_workers = Services[i].max_workers;
             }
         }
     }
 
+    /* a reserved priority lane: the same command on its own listener
+     * with a small dedicated pool.  While the main pool is saturated
+     * and new connections queue in its listen backlog, monitoring
+     * probes and admin connections sent to the lane's port still find
+     * a preforked worker waiting */
+    if (strcmp(priolisten, "") && !strncmp(Services[i].proto, "tcp", 3)) {
+        int k, lane_reconfig = 0;
+
+        /* reuse the lane from a previous config read if there is one */
+        for (k = 0; k < nservices; k++) {
+            if (Services[k].prio && Services[k].associate == 0 &&
+                Services[k].name && !strcmp(Services[k].name, name))
+                break;
+        }
+        if (k == nservices) {
+            struct service *sp = service_add(NULL);
+            gettimeofday(&sp->last_interval_start, 0);
+            sp->last_connrate_update = sp->last_interval_start;
+            sp->prio = 1;
+            k = sp - Services;
+        }
+        else if (Services[k].listen) lane_reconfig = 1;
+
+        if (!Services[k].name) Services[k].name = xstrdup(name);
+        if (Services[k].listen) free(Services[k].listen);
+        Services[k].listen = priolisten;
+        priolisten = NULL; /* avoid freeing it */
+        if (Services[k].proto) free(Services[k].proto);
+        Services[k].proto = xstrdup(Services[i].proto);
+
+        strarray_free(Services[k].exec);
+        Services[k].exec = strarray_split(cmd, NULL, 0);
+
+        Services[k].maxforkrate = Services[i].maxforkrate;
+        Services[k].maxfds = Services[i].maxfds;
+        Services[k].babysit = Services[i].babysit;
+        Services[k].drain_time = Services[i].drain_time;
+        /* always keep at least one worker warm - that's the point */
+        Services[k].desired_workers = (prioprefork > 0) ? prioprefork : 1;
+        Services[k].prefork_max = 0;
+        Services[k].max_workers = (priomaxchild > 0) ? priomaxchild : 1;
+        Services[k].reuseport = 0;
+
+        if (lane_reconfig) {
+            /* update any other instances of the lane */
+            for (j = 0; j < nservices; j++) {
+                if (Services[j].associate > 0 && Services[j].prio &&
+                    Services[j].listen &&
+                    Services[j].name && !strcmp(Services[j].name, name)) {
+                    Services[j].maxforkrate = Services[k].maxforkrate;
+                    Services[j].exec = Services[k].exec;
+                    Services[j].desired_workers = Services[k].desired_workers;
+                    Services[j].prefork_max = 0;
+                    Services[j].drain_time = Services[k].drain_time;
+                    Services[j].babysit = Services[k].babysit;
+                    Services[j].max_workers = Services[k].max_workers;
+                }
+            }
+        }
+
+        if (verbose > 2)
+            syslog(LOG_DEBUG, "%s: priority lane for service '%s' (%s:%s, %d, %d)",
+                   lane_reconfig ? "reconfig" : "add",
+                   Services[k].name,
+                   Services[k].proto, Services[k].listen,
+                   Services[k].desired_workers,
+                   Services[k].max_workers);
+    }
+
     if (verbose > 2)
         syslog(LOG_DEBUG, "%s: service '%s' (%s, %s:%s, %d, %d, %d)",
                reconfig ? "reconfig" : "add",
@@ -1840,6 +2252,7 @@ static void add_service(const char *name, struct entry *e, void *rock)
 done:
     free(cmd);
     free(listen);
+    free(priolisten);
     free(proto);
     free(max);
     return;
@@ -1969,14 +2382,24 @@ static void reread_conf(struct timeval now)
          *  - otherwise (remaining services) we want to recycle children
          * Note that for services being disabled, it is important to first
          * signal them before shutting down their socket.
+         * With drain_time set, busy children of remaining services are
+         * left to finish their current session first: they get the SIGHUP
+         * once they report available again, or when the deadline passes.
          */
         for (j = 0 ; j < child_table_size ; j++ ) {
             c = ctable[j];
             while (c != NULL) {
                 if ((c->si == i) &&
                     (c->service_state != SERVICE_STATE_DEAD)) {
-                    kill(c->pid, SIGHUP);
-                    c->sighuptime = time(NULL);
+                    if (Services[i].exec && Services[i].drain_time > 0 &&
+                        c->service_state == SERVICE_STATE_BUSY) {
+                        if (!c->draintime)
+                            c->draintime = time(NULL);
+                    }
+                    else {
+                        kill(c->pid, SIGHUP);
+                        c->sighuptime = time(NULL);
+                    }
                 }
                 c = c->next;
             }
@@ -2391,6 +2814,9 @@ int main(int argc, char **argv)
     }
 #endif
 
+    /* answer resource usage queries from cyr_info */
+    stats_socket_open();
+
     /* init ctable janitor */
     gettimeofday(&now, 0);
     init_janitor(now);
@@ -2425,12 +2851,21 @@ int main(int argc, char **argv)
         for (i = 0; i < nservices; i++) {
             total_children += Services[i].nactive;
             if (!in_shutdown) {
+                int ready_target;
+
+                if (Services[i].exec && Services[i].prefork_max)
+                    service_update_connrate(&Services[i]);
+                ready_target = service_ready_target(&Services[i]);
+
                 if (Services[i].exec /* enabled */ &&
                     (Services[i].nactive < Services[i].max_workers) &&
-                    (Services[i].ready_workers < Services[i].desired_workers))
+                    (Services[i].ready_workers < ready_target))
                 {
-                    /* bring us up to desired_workers */
-                    int j = Services[i].desired_workers - Services[i].ready_workers;
+                    /* bring us up to the ready target */
+                    int j = ready_target - Services[i].ready_workers;
+
+                    if (j > Services[i].max_workers - Services[i].nactive)
+                        j = Services[i].max_workers - Services[i].nactive;
 
                     if (verbose) {
                         syslog(LOG_DEBUG, "service %s/%s needs %d more ready workers",
@@ -2499,8 +2934,10 @@ int main(int argc, char **argv)
             }
             if (x > maxfd) maxfd = x;
 
-            /* connections */
-            if (y >= 0 && Services[i].ready_workers == 0 &&
+            /* connections (in reuseport mode the socket isn't listening
+             * and demand-spawning falls to the desired_workers top-up) */
+            if (y >= 0 && !Services[i].reuseport &&
+                Services[i].ready_workers == 0 &&
                 Services[i].nactive < Services[i].max_workers &&
                 !service_is_fork_limited(&Services[i])) {
                 if (verbose > 2)
@@ -2516,6 +2953,12 @@ int main(int argc, char **argv)
                        Services[i].familyname, Services[i].ready_workers);
             }
         }
+
+        /* statistics queries */
+        if (stats_fd >= 0) {
+            FD_SET(stats_fd, &rfds);
+            if (stats_fd > maxfd) maxfd = stats_fd;
+        }
         maxfd++;                /* need 1 greater than maxfd */
 
         int interrupted = 0;
@@ -2574,6 +3017,11 @@ int main(int argc, char **argv)
 #endif
 
         if (ready_fds > 0) {
+            if (stats_fd >= 0 && FD_ISSET(stats_fd, &rfds)) {
+                int fd = accept(stats_fd, NULL, NULL);
+                if (fd >= 0) stats_dump(fd);
+            }
+
             for (i = 0; i < nservices; i++) {
                 int x = Services[i].stat[0];
                 int y = Services[i].socket;
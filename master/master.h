@@ -3,6 +3,7 @@
 
 #include <config.h>
 #include <sys/resource.h> /* for rlim_t */
+#include <sys/socket.h> /* for struct sockaddr_storage */
 
 #include "libconfig.h" /* for config_dir and IMAPOPT_SYNC_MACHINEID */
 #include "strarray.h"
@@ -14,18 +15,27 @@ struct service {
     char *proto;                /* protocol to accept */
     strarray_t *exec;           /* command (with args) to execute */
     int babysit;                /* babysit this service? */
+    int reuseport;              /* per-child SO_REUSEPORT listeners? */
 
     /* multiple address family support */
     int associate;              /* are we primary or additional instance? */
+    int prio;                   /* reserved priority lane of another entry,
+                                 * with its own listener and worker pool */
     int family;                 /* address family */
     const char *familyname;     /* address family name */
 
     /* communication info */
     int socket;                 /* client/child communication channel */
     int stat[2];                /* master/child communication channel */
+    struct sockaddr_storage addr; /* address the socket is bound to */
+    socklen_t addrlen;          /* length of addr, 0 if not yet bound */
 
     /* limits */
     int desired_workers;        /* num child processes to have ready */
+    int prefork_max;            /* upper bound on the adaptive warm pool */
+    int drain_time;             /* secs busy children may finish their
+                                 * session after SIGHUP, 0 to recycle
+                                 * them immediately */
     int max_workers;            /* max num child processes to spawn */
     rlim_t maxfds;              /* max num file descriptors to use */
     unsigned int maxforkrate;   /* max rate to spawn children */
@@ -42,6 +52,19 @@ struct service {
     /* fork rate computation */
     struct timeval last_interval_start;
     unsigned int interval_forks;
+
+    /* connection arrival rate computation */
+    struct timeval last_connrate_update;
+    int last_nconnections;      /* nconnections at the last update */
+    double connrate;            /* rate at which connections are arriving */
+
+    /* resource usage aggregated over exited children */
+    struct timeval usage_utime; /* user cpu time */
+    struct timeval usage_stime; /* system cpu time */
+    long usage_maxrss;          /* largest maxrss of any child, in KB */
+    long usage_inblock;         /* block input operations */
+    long usage_oublock;         /* block output operations */
+    unsigned long usage_nchildren; /* num children accounted for */
 };
 
 extern struct service *Services;
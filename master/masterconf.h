@@ -43,6 +43,10 @@
 #ifndef INCLUDED_MASTERCONF_H
 #define INCLUDED_MASTERCONF_H
 
+/* socket (under configdirectory) where master answers
+ * per-service resource usage queries from cyr_info */
+#define FNAME_MASTER_STATS_SOCK "/socket/master.stats"
+
 extern int masterconf_init(const char *ident, const char *alt_config);
 
 struct entry;
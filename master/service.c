@@ -85,6 +85,23 @@ static int verbose = 0;
 static int lockfd = -1;
 static int newfile = 0;
 
+/* zygote mode (-F): this process is a template which completes
+ * initialisation once and then forks an already-initialised worker
+ * for each accepted connection */
+static int fork_workers = 0;
+static int max_workers = 0;     /* 0 = no local limit */
+static volatile sig_atomic_t nworkers = 0;
+
+static void worker_reaper(int sig __attribute__((unused)))
+{
+    int saved_errno = errno;
+
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+        if (nworkers > 0) nworkers--;
+    }
+    errno = saved_errno;
+}
+
 void notify_master(int fd, int msg)
 {
     struct notify_message notifymsg;
@@ -323,7 +340,7 @@ int main(int argc, char **argv, char **envp)
 
     opterr = 0; /* disable error reporting,
                    since we don't know about service-specific options */
-    while ((opt = getopt(argc, argv, "C:U:T:DX")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:FU:T:W:DX")) != EOF) {
         if (argv[optind-1][0] == '-' && strlen(argv[optind-1]) > 2) {
             /* we have merged options */
             syslog(LOG_ERR,
@@ -335,6 +352,13 @@ int main(int argc, char **argv, char **envp)
         case 'C': /* alt config file */
             alt_config = optarg;
             break;
+        case 'F': /* fork a worker per connection (zygote mode) */
+            fork_workers = 1;
+            break;
+        case 'W': /* maximum concurrent forked workers */
+            max_workers = atoi(optarg);
+            if (max_workers < 0) max_workers = 0;
+            break;
         case 'U': /* maximum uses */
             max_use = atoi(optarg);
             if (max_use < 0) max_use = 0;
@@ -461,6 +485,32 @@ int main(int argc, char **argv, char **envp)
         }
     }
 
+    if (fork_workers) {
+        if (debug_stdio || soctype != SOCK_STREAM) {
+            /* no connection to hand a worker in these modes */
+            fork_workers = 0;
+        }
+        else {
+            /* we're the template: initialisation is done, so each
+             * connection from here on can be served by a freshly
+             * forked worker.  Reap them as they finish */
+            struct sigaction action;
+
+            memset(&action, 0, sizeof(action));
+            sigemptyset(&action.sa_mask);
+            action.sa_flags = 0;
+#ifdef SA_RESTART
+            action.sa_flags |= SA_RESTART;
+#endif
+            action.sa_handler = worker_reaper;
+            if (sigaction(SIGCHLD, &action, NULL) < 0) {
+                syslog(LOG_ERR,
+                       "unable to install signal handler for SIGCHLD: %m");
+                fork_workers = 0;
+            }
+        }
+    }
+
     /* determine initial process file inode, size and mtime */
     if (service_argv.data[0][0] == '/')
         strlcpy(path, service_argv.data[0], sizeof(path));
@@ -472,7 +522,10 @@ int main(int argc, char **argv, char **envp)
     start_size = sbuf.st_size;
     start_mtime = sbuf.st_mtime;
 
-    getlockfd(service, id);
+    /* a child with its own SO_REUSEPORT listener is the only accepter
+     * on its socket, so no accept serialization is needed */
+    if (getenv("CYRUS_REUSEPORT") == NULL)
+        getlockfd(service, id);
 
     if (debug_stdio) {
         service_main(service_argv.count, service_argv.data, envp);
@@ -486,8 +539,9 @@ int main(int argc, char **argv, char **envp)
         /* (re)set signal handlers, including SIGALRM */
         signals_add_handlers(SIGALRM);
 
-        if (use_count > 0) {
-            /* we want to time out after 60 seconds, set an alarm */
+        if (use_count > 0 && !fork_workers) {
+            /* we want to time out after 60 seconds, set an alarm
+             * (a template stays warm - that's the whole point) */
             alarm(reuse_timeout);
         }
 
@@ -606,6 +660,71 @@ int main(int argc, char **argv, char **envp)
             tcp_enable_keepalive(fd);
         }
 
+        if (fork_workers) {
+            pid_t pid = -1;
+            sigset_t sigchld_set, oldmask;
+
+            /* the reaper also updates nworkers, so keep SIGCHLD out
+             * of the way while we check the limit and count the fork */
+            sigemptyset(&sigchld_set);
+            sigaddset(&sigchld_set, SIGCHLD);
+            sigprocmask(SIG_BLOCK, &sigchld_set, &oldmask);
+
+            if (!max_workers || nworkers < max_workers) {
+                pid = fork();
+                if (pid < 0)
+                    syslog(LOG_ERR, "can't fork worker, serving inline: %m");
+                else if (pid > 0)
+                    nworkers++;
+            }
+            else if (verbose) {
+                syslog(LOG_DEBUG, "worker limit (%d) reached, serving inline",
+                       max_workers);
+            }
+
+            sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
+            if (pid > 0) {
+                /* template: hand the connection off and go straight
+                 * back to accepting.  The multi-connection message
+                 * counts the connection with master while leaving us
+                 * listed as ready */
+                notify_master(STATUS_FD, MASTER_SERVICE_CONNECTION_MULTI);
+                syslog(LOG_DEBUG, "accepted connection, forked worker %d",
+                       (int) pid);
+                close(fd);
+                use_count++;
+                if (signals_poll() || use_count >= max_use) {
+                    /* caught SIGHUP or exceeded max use count */
+                    break;
+                }
+                continue;
+            }
+            else if (pid == 0) {
+                /* worker: we inherited all the template's initialised
+                 * state, so we're ready to serve immediately.  Leave
+                 * the listener and accept lock behind, and point the
+                 * status channel at /dev/null - master tracks the
+                 * template, and a message with our pid would only
+                 * confuse its accounting */
+                int nullfd = open("/dev/null", O_WRONLY);
+                if (nullfd >= 0 && nullfd != STATUS_FD) {
+                    dup2(nullfd, STATUS_FD);
+                    close(nullfd);
+                }
+                close(LISTEN_FD);
+                if (lockfd != -1) {
+                    close(lockfd);
+                    lockfd = -1;
+                }
+                signal(SIGCHLD, SIG_DFL);
+                fork_workers = 0;
+                use_count = 0;
+                max_use = 1;    /* serve this one connection and exit */
+            }
+            /* else fork failed or at the limit - serve inline */
+        }
+
         notify_master(STATUS_FD, MASTER_SERVICE_UNAVAILABLE);
         syslog(LOG_DEBUG, "accepted connection");
 
@@ -57,12 +57,16 @@
 #endif
 #include <signal.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 
 #include "notifyd.h"
 
+#include "eventio.h"
 #include "exitcodes.h"
 #include "imap/global.h"
 #include "libconfig.h"
+#include "ptrarray.h"
 #include "xmalloc.h"
 #include "strarray.h"
 
@@ -97,93 +101,272 @@ static char *fetch_arg(char *head, char* tail)
 
 #define NOTIFY_MAXSIZE 8192
 
-static int do_notify(void)
-{
-    struct sockaddr_un sun_data;
-    socklen_t sunlen = sizeof(sun_data);
-    char buf[NOTIFY_MAXSIZE+1], *cp, *tail;
-    int r, i;
-    char *method, *class, *priority, *user, *mailbox, *message;
-    strarray_t options = STRARRAY_INITIALIZER;
-    long nopt;
-    char *reply;
+/* how long to sit on a queued notification waiting for further events
+ * to the same destination before dispatching it */
+#define NOTIFY_BATCH_WAIT 1
+
+/* force a flush once this much is queued, whatever its age */
+#define NOTIFY_QUEUE_MAX 1024
+
+/* concurrent dispatch children */
+#define NOTIFY_MAXWORKERS 8
+
+/* a parsed notification, queued until its batch is dispatched */
+struct notify_req {
+    char *method;               /* "" = daemon default */
+    char *class;
+    char *priority;
+    char *user;
+    char *mailbox;
+    strarray_t options;
+    char *message;
     char *fname;
-    notifymethod_t *nmethod;
-
-    while (1) {
-        method = class = priority = user = mailbox = message = reply = NULL;
-        nopt = 0;
-
-        if (signals_poll() == SIGHUP) {
-            /* caught a SIGHUP, return */
-            return 0;
-        }
-        r = recvfrom(soc, buf, NOTIFY_MAXSIZE, 0,
-                     (struct sockaddr *) &sun_data, &sunlen);
-        if (r == -1) {
-            return (errno);
-        }
-        buf[r] = '\0';
+    time_t arrived;
+};
 
-        tail = buf + r - 1;
+static ptrarray_t queue = PTRARRAY_INITIALIZER;
+static int nworkers = 0;
 
-        /*
-         * parse request of the form:
-         *
-         * method NUL class NUL priority NUL user NUL mailbox NUL
-         *   nopt NUL N(option NUL) message NUL
-         */
-        method = (cp = buf);
+static void notify_req_free(struct notify_req *req)
+{
+    free(req->method);
+    free(req->class);
+    free(req->priority);
+    free(req->user);
+    free(req->mailbox);
+    strarray_fini(&req->options);
+    free(req->message);
+    free(req->fname);
+    free(req);
+}
 
-        if (cp) class = (cp = fetch_arg(cp, tail));
-        if (cp) priority = (cp = fetch_arg(cp, tail));
-        if (cp) user = (cp = fetch_arg(cp, tail));
-        if (cp) mailbox = (cp = fetch_arg(cp, tail));
+static void reap_workers(int block)
+{
+    int status;
+    pid_t pid;
+
+    for (;;) {
+        pid = waitpid(-1, &status, block ? 0 : WNOHANG);
+        if (pid <= 0) break;
+        if (nworkers) nworkers--;
+        block = 0;      /* only ever wait for the first one */
+        if (WIFSIGNALED(status) ||
+            (WIFEXITED(status) && WEXITSTATUS(status)))
+            syslog(LOG_WARNING, "notify worker %d exited abnormally",
+                   (int) pid);
+    }
+}
 
-        if (cp) cp = fetch_arg(cp, tail); /* skip to nopt */
-        if (cp) nopt = strtol(cp, NULL, 10);
-        if (nopt < 0 || errno == ERANGE) cp = NULL;
+/* hand one (possibly combined) notification to its method in a child,
+ * so a slow backend never backs up the socket we share with lmtpd */
+static void dispatch_req(notifymethod_t *nmethod, struct notify_req *req,
+                         const char *message)
+{
+    pid_t pid;
 
-        for (i = 0; cp && i < nopt; i++)
-            strarray_append(&options, cp = fetch_arg(cp, tail));
+    if (nworkers >= NOTIFY_MAXWORKERS) reap_workers(/*block*/1);
 
-        if (cp) message = (cp = fetch_arg(cp, tail));
-        if (cp) fname = (cp = fetch_arg(cp, tail));
+    pid = fork();
+    if (pid == 0) {
+        free(nmethod->notify(req->class, req->priority, req->user,
+                             req->mailbox, req->options.count,
+                             req->options.data, message, req->fname));
+        _exit(0);
+    }
+    if (pid == -1) {
+        /* deliver it ourselves; better late than dropped */
+        syslog(LOG_ERR, "fork: %m");
+        free(nmethod->notify(req->class, req->priority, req->user,
+                             req->mailbox, req->options.count,
+                             req->options.data, message, req->fname));
+        return;
+    }
+    nworkers++;
+}
 
-        if (!message) {
-            syslog(LOG_ERR, "malformed notify request");
-            strarray_fini(&options);
-            return 0;
+/* dispatch everything queued, combining events for the same
+ * destination into one notification with the messages joined by
+ * newlines.  'force' skips the batching linger */
+static void flush_queue(int force)
+{
+    time_t now = time(NULL);
+    struct notify_req *req, *other;
+    notifymethod_t *nmethod;
+    int i, j;
+
+    if (!queue.count) return;
+
+    req = ptrarray_nth(&queue, 0);
+    if (!force && queue.count < NOTIFY_QUEUE_MAX &&
+        req->arrived + NOTIFY_BATCH_WAIT > now)
+        return;
+
+    for (i = 0; i < queue.count; i++) {
+        strarray_t msgs = STRARRAY_INITIALIZER;
+        char *message;
+
+        req = ptrarray_nth(&queue, i);
+        if (!req) continue;     /* folded into an earlier batch */
+
+        strarray_append(&msgs, req->message);
+
+        /* fold in later events for the same destination */
+        for (j = i + 1; j < queue.count; j++) {
+            other = ptrarray_nth(&queue, j);
+            if (!other) continue;
+            if (strcmp(req->method, other->method) ||
+                strcmp(req->class, other->class) ||
+                strcmp(req->priority, other->priority) ||
+                strcmp(req->user, other->user) ||
+                strcmp(req->mailbox, other->mailbox))
+                continue;
+            strarray_append(&msgs, other->message);
+            notify_req_free(other);
+            ptrarray_set(&queue, j, NULL);
         }
 
-        if (!*method)
+        if (!*req->method)
             nmethod = default_method;
         else {
             nmethod = methods;
             while (nmethod->name) {
-                if (!strcasecmp(nmethod->name, method)) break;
+                if (!strcasecmp(nmethod->name, req->method)) break;
                 nmethod++;
             }
         }
 
-        syslog(LOG_DEBUG, "do_notify using method '%s'",
-               nmethod->name ? nmethod->name: "unknown");
+        syslog(LOG_DEBUG, "do_notify using method '%s' (%d combined)",
+               nmethod->name ? nmethod->name : "unknown", msgs.count);
 
         if (nmethod->name) {
-            reply = nmethod->notify(class, priority, user, mailbox,
-                                    nopt, options.data, message, fname);
+            message = strarray_join(&msgs, "\n");
+            dispatch_req(nmethod, req, message);
+            free(message);
         }
-#if 0  /* we don't care about responses right now */
-        else {
-            reply = strdup("NO unknown notification method");
-            if (!reply) {
-                fatal("strdup failed", EC_OSERR);
+
+        strarray_fini(&msgs);
+        notify_req_free(req);
+        ptrarray_set(&queue, i, NULL);
+    }
+
+    ptrarray_truncate(&queue, 0);
+}
+
+static int do_notify(void)
+{
+    struct sockaddr_un sun_data;
+    socklen_t sunlen;
+    char buf[NOTIFY_MAXSIZE+1], *cp, *tail;
+    int r, i, fdflags;
+    char *method, *class, *priority, *user, *mailbox, *message;
+    long nopt;
+    char *fname;
+    struct notify_req *req;
+    struct eventio *io;
+    struct eventio_event event;
+    struct timeval linger = { NOTIFY_BATCH_WAIT, 0 };
+
+    /* a non-blocking socket lets us drain every queued datagram per
+     * wakeup, so lmtpd's sendto() never waits on a full buffer while
+     * a method backend is slow */
+    fdflags = fcntl(soc, F_GETFL, 0);
+    if (fdflags != -1)
+        fdflags = fcntl(soc, F_SETFL, O_NONBLOCK | fdflags);
+    if (fdflags == -1) {
+        syslog(LOG_ERR, "unable to set nonblocking: %m");
+        return errno;
+    }
+
+    io = eventio_new();
+    eventio_add(io, soc, NULL);
+
+    while (1) {
+        if (signals_poll() == SIGHUP) {
+            /* caught a SIGHUP, return */
+            flush_queue(1);
+            eventio_free(&io);
+            return 0;
+        }
+
+        reap_workers(0);
+
+        /* sleep only as long as the batching linger allows */
+        r = eventio_wait(io, &event, 1, queue.count ? &linger : NULL);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            flush_queue(1);
+            eventio_free(&io);
+            return errno;
+        }
+
+        while (r > 0) {
+            strarray_t options = STRARRAY_INITIALIZER;
+
+            method = class = priority = user = mailbox = message = NULL;
+            fname = NULL;
+            nopt = 0;
+
+            sunlen = sizeof(sun_data);
+            r = recvfrom(soc, buf, NOTIFY_MAXSIZE, 0,
+                         (struct sockaddr *) &sun_data, &sunlen);
+            if (r == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                if (errno == EINTR) continue;
+                flush_queue(1);
+                eventio_free(&io);
+                return (errno);
             }
+            buf[r] = '\0';
+
+            tail = buf + r - 1;
+
+            /*
+             * parse request of the form:
+             *
+             * method NUL class NUL priority NUL user NUL mailbox NUL
+             *   nopt NUL N(option NUL) message NUL
+             */
+            method = (cp = buf);
+
+            if (cp) class = (cp = fetch_arg(cp, tail));
+            if (cp) priority = (cp = fetch_arg(cp, tail));
+            if (cp) user = (cp = fetch_arg(cp, tail));
+            if (cp) mailbox = (cp = fetch_arg(cp, tail));
+
+            if (cp) cp = fetch_arg(cp, tail); /* skip to nopt */
+            if (cp) nopt = strtol(cp, NULL, 10);
+            if (nopt < 0 || errno == ERANGE) cp = NULL;
+
+            for (i = 0; cp && i < nopt; i++)
+                strarray_append(&options, cp = fetch_arg(cp, tail));
+
+            if (cp) message = (cp = fetch_arg(cp, tail));
+            if (cp) fname = (cp = fetch_arg(cp, tail));
+
+            if (!message) {
+                syslog(LOG_ERR, "malformed notify request");
+                strarray_fini(&options);
+                flush_queue(1);
+                eventio_free(&io);
+                return 0;
+            }
+
+            req = xzmalloc(sizeof(struct notify_req));
+            req->method = xstrdup(method);
+            req->class = xstrdup(class);
+            req->priority = xstrdup(priority);
+            req->user = xstrdup(user);
+            req->mailbox = xstrdup(mailbox);
+            req->options = options;     /* takes over the contents */
+            req->message = xstrdup(message);
+            req->fname = fname ? xstrdup(fname) : NULL;
+            req->arrived = time(NULL);
+
+            ptrarray_append(&queue, req);
+            r = 1;
         }
-#endif
 
-        free(reply);
-        strarray_fini(&options);
+        flush_queue(queue.count >= NOTIFY_QUEUE_MAX);
     }
 
     /* never reached */
@@ -61,12 +61,18 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <syslog.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
 
 #include "auth_pts.h"
+#include "cyr_lock.h"
 #include "cyrusdb.h"
 #include "exitcodes.h"
 #include "imap/global.h"
 #include "libconfig.h"
+#include "retry.h"
+#include "strarray.h"
 #include "xmalloc.h"
 
 /* global */
@@ -99,6 +105,120 @@ static int expire_cb(void *rockp,
     return 0;
 }
 
+/* refresh one entry over an established ptloader connection */
+static int refresh_one(int s, const char *identifier)
+{
+    char response[1024];
+    struct iovec iov[10];
+    size_t id_len = strlen(identifier);
+    int niov, n;
+    unsigned int start;
+
+    niov = 0;
+    WRITEV_ADD_TO_IOVEC(iov, niov, (char *) &id_len, sizeof(id_len));
+    WRITEV_ADD_TO_IOVEC(iov, niov, (char *) identifier, id_len);
+    if (retry_writev(s, iov, niov) < 0) {
+        syslog(LOG_ERR, "refresh of %s: write: %m", identifier);
+        return -1;
+    }
+
+    /* read the NUL-terminated reply; unlike auth_pts we can't wait for
+       EOF, since the connection stays open for the next entry */
+    start = 0;
+    while (start < sizeof(response) - 1) {
+        n = read(s, response+start, sizeof(response) - 1 - start);
+        if (n < 1) break;
+        start += n;
+        if (memchr(response, '\0', start)) break;
+    }
+    response[start] = '\0';
+
+    if (start < 2 || strncmp(response, "OK", 2)) {
+        syslog(LOG_WARNING, "refresh of %s failed: %s", identifier,
+               start ? response : "no response");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* refresh the entries queued by auth_pts since the last run, in one
+ * batch over a single ptloader connection.  the queue is emptied up
+ * front: a lost entry only means it expires normally later on */
+static void process_refresh_queue(void)
+{
+    strarray_t ids = STRARRAY_INITIALIZER;
+    char fnamebuf[MAXPATHLEN];
+    char buf[PTS_DB_KEYSIZE+2];
+    const char *fname;
+    char *tofree = NULL;
+    struct sockaddr_un srvaddr;
+    FILE *qfile;
+    int qfd, s, i, refreshed = 0;
+
+    snprintf(fnamebuf, sizeof(fnamebuf), "%s%s",
+             config_dir, PTS_REFRESH_QUEUE);
+    qfd = open(fnamebuf, O_RDWR, 0);
+    if (qfd == -1) return; /* nothing queued */
+
+    if (lock_blocking(qfd, fnamebuf) == -1) {
+        syslog(LOG_ERR, "cannot lock %s: %m", fnamebuf);
+        close(qfd);
+        return;
+    }
+
+    qfile = fdopen(qfd, "r+");
+    while (qfile && fgets(buf, sizeof(buf), qfile)) {
+        buf[strcspn(buf, "\r\n")] = '\0';
+        if (!buf[0]) continue;
+
+        /* hot entries get queued once per lookup; weed out the dups */
+        if (strarray_find(&ids, buf, 0) < 0)
+            strarray_append(&ids, buf);
+    }
+    ftruncate(qfd, 0);
+    if (qfile) fclose(qfile); /* drops the lock */
+    else close(qfd);
+
+    if (!ids.count) goto done;
+
+    /* connect to ptloader */
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1) {
+        syslog(LOG_ERR, "cannot create socket for ptloader: %m");
+        goto done;
+    }
+
+    fname = config_getstring(IMAPOPT_PTLOADER_SOCK);
+    if (!fname) {
+        tofree = strconcat(config_dir, PTS_DBSOCKET, (char *)NULL);
+        fname = tofree;
+    }
+    memset((char *)&srvaddr, 0, sizeof(srvaddr));
+    srvaddr.sun_family = AF_UNIX;
+    strlcpy(srvaddr.sun_path, fname, sizeof(srvaddr.sun_path));
+    if (connect(s, (struct sockaddr *)&srvaddr, sizeof(srvaddr)) == -1) {
+        syslog(LOG_ERR, "cannot connect to ptloader server: %m");
+        close(s);
+        goto done;
+    }
+
+    for (i = 0; i < ids.count; i++) {
+        /* a failure leaves the stream in an unknown state, so give up
+           on the rest of the batch */
+        if (refresh_one(s, ids.data[i])) break;
+        refreshed++;
+    }
+    close(s);
+
+    syslog(LOG_INFO, "refreshed %d of %d queued entries",
+           refreshed, ids.count);
+
+ done:
+    free(tofree);
+    strarray_fini(&ids);
+}
+
 int main(int argc, char *argv[])
 {
     struct db *ptdb;
@@ -156,6 +276,9 @@ int main(int argc, char *argv[])
 
     cyrusdb_close(ptdb);
 
+    /* prefetch the soon-to-expire entries auth_pts has queued */
+    process_refresh_queue();
+
     cyrus_done();
 
     syslog(LOG_INFO, "finished");
@@ -193,12 +193,24 @@ int service_main_fd(int c, int argc __attribute__((unused)),
 {
     const char *reply = NULL;
     char user[PTS_DB_KEYSIZE];
-    int rc, dsize;
+    int rc, dsize, n;
     size_t size;
     struct auth_state *newstate;
 
+    /* keep servicing requests until the client closes the connection,
+       so that ptexpire(8) can refresh a whole batch of entries over a
+       single socket.  old clients just close after the first reply */
+  nextreq:
+    reply = NULL;
+
     (void)memset(&size, 0, sizeof(size));
-    if (read(c, &size, sizeof(size_t)) < 0) {
+    n = read(c, &size, sizeof(size_t));
+    if (n == 0) {
+        /* client is done */
+        close(c);
+        return 0;
+    }
+    if (n < 0) {
         syslog(LOG_ERR, "socket (size): %m");
         reply = "Error reading request (size)";
         goto sendreply;
@@ -249,6 +261,11 @@ int service_main_fd(int c, int argc __attribute__((unused)),
     if (retry_write(c, reply, strlen(reply) + 1) <0) {
         syslog(LOG_WARNING, "retry_write: %m");
     }
+    else if (!strncmp(reply, "OK", 2)) {
+        /* the stream is still in a known state; see if the client
+           has another request for us */
+        goto nextreq;
+    }
     close(c);
 
     return 0;
@@ -55,6 +55,7 @@
 #include "bytecode.h"
 
 #include "charset.h"
+#include "hash.h"
 #include "xmalloc.h"
 #include "xstrlcpy.h"
 #include "util.h"
@@ -119,23 +120,71 @@ static const char ** bc_makeArray(bytecode_input_t *bc, int *pos)
     return array;
 }
 
-/* Compile a regular expression for use during parsing */
+/*
+ * Cache of compiled :regex patterns, keyed on the compile flags and
+ * the (variable-expanded) pattern text.  Regex-heavy scripts used to
+ * pay a regcomp() per pattern per message; the cache persists across
+ * deliveries in a long-running lmtpd, so each pattern is compiled
+ * once per process.  Entries are owned by the cache - callers of
+ * bc_compile_regex() must NOT free the result - and the table is
+ * emptied and rebuilt if it ever grows past a sane bound.
+ */
+#define REGCACHE_BUCKETS        64
+#define REGCACHE_MAXENTRIES     512
+
+static struct hash_table regcache;
+static unsigned regcache_nentries = 0;
+
+static void regcache_freeentry(void *data)
+{
+    regex_t *reg = (regex_t *) data;
+
+    regfree(reg);
+    free(reg);
+}
+
+/* Compile a regular expression for use during parsing, or return the
+ * cached result of an earlier compile */
 static regex_t * bc_compile_regex(const char *s, int ctag,
                                   char *errmsg, size_t errsiz)
 {
     int ret;
-    regex_t *reg = (regex_t *) xmalloc(sizeof(regex_t));
+    regex_t *reg;
+    struct buf key = BUF_INITIALIZER;
 
 #ifdef HAVE_PCREPOSIX_H
     /* support UTF8 comparisons */
     ctag |= REG_UTF8;
 #endif
+
+    if (!regcache.size)
+        construct_hash_table(&regcache, REGCACHE_BUCKETS, 0);
+
+    buf_printf(&key, "%d:%s", ctag, s);
+    reg = hash_lookup(buf_cstring(&key), &regcache);
+    if (reg) {
+        buf_free(&key);
+        return reg;
+    }
+
+    reg = (regex_t *) xmalloc(sizeof(regex_t));
     if ( (ret=regcomp(reg, s, ctag)) != 0)
     {
         (void) regerror(ret, reg, errmsg, errsiz);
         free(reg);
+        buf_free(&key);
         return NULL;
     }
+
+    if (regcache_nentries >= REGCACHE_MAXENTRIES) {
+        free_hash_table(&regcache, regcache_freeentry);
+        construct_hash_table(&regcache, REGCACHE_BUCKETS, 0);
+        regcache_nentries = 0;
+    }
+    hash_insert(buf_cstring(&key), reg, &regcache);
+    regcache_nentries++;
+    buf_free(&key);
+
     return reg;
 }
 
@@ -691,7 +740,6 @@ static int eval_bc_test(sieve_interp_t *interp, void* m, void *sc,
                                 res |= comp(addr, strlen(addr),
                                             (const char *)reg,
                                             match_vars, comprock);
-                                free(reg);
                             } else {
 #if VERBOSE
                                 printf("%s compared to %s(from script)\n",
@@ -875,7 +923,6 @@ envelope_err:
 
                             res |= comp(decoded_header, strlen(decoded_header),
                                         (const char *)reg, match_vars, comprock);
-                            free(reg);
                         } else {
                             res |= comp(decoded_header, strlen(decoded_header),
                                         data_val, match_vars, comprock);
@@ -1051,7 +1098,6 @@ envelope_err:
 
                             res |= comp(this_haystack, strlen(this_haystack),
                                         (const char *)reg, match_vars, comprock);
-                            free(reg);
                         } else {
                             res |= comp(this_haystack, strlen(this_haystack),
                                         this_needle, match_vars, comprock);
@@ -1078,7 +1124,6 @@ envelope_err:
                                     res |= comp(active_flag, strlen(active_flag),
                                                 (const char *)reg,
                                                 match_vars, comprock);
-                                    free(reg);
                                 } else {
                                     res |= comp(active_flag, strlen(active_flag),
                                                 this_needle, match_vars, comprock);
@@ -1205,7 +1250,6 @@ envelope_err:
 
                         res |= comp(content, strlen(content), (const char *)reg,
                                     match_vars, comprock);
-                        free(reg);
                     } else {
                         res |= comp(content, strlen(content), data_val,
                                     match_vars, comprock);
@@ -1643,7 +1687,6 @@ envelope_err:
 
                 res |= comp(val, strlen(val),
                             (const char *)reg, match_vars, comprock);
-                free(reg);
             } else {
 #if VERBOSE
                 printf("%s compared to %s(from script)\n",
@@ -1742,7 +1785,6 @@ envelope_err:
 
                 res |= comp(val, strlen(val),
                             (const char *)reg, match_vars, comprock);
-                free(reg);
             } else {
 #if VERBOSE
                 printf("%s compared to %s(from script)\n",
@@ -2470,7 +2512,6 @@ int sieve_eval_bc(sieve_execute_t *exe, int is_incl, sieve_interp_t *i,
                 } else {
                     res = do_denotify(notify_list, comp, reg,
                                       match_vars, comprock, priority);
-                    free(reg);
                 }
             } else {
                 res = do_denotify(notify_list, comp, pattern,
@@ -2833,11 +2874,6 @@ int sieve_eval_bc(sieve_execute_t *exe, int is_incl, sieve_interp_t *i,
                                 /* flag the header for deletion */
                                 delete_mask |= (1<<v);
                             }
-
-                            if (reg) {
-                                regfree(reg);
-                                free(reg);
-                            }
                         }
                     }
                 }
@@ -484,6 +484,132 @@ EXPORTED int sieve_script_load(const char *fname, sieve_execute_t **ret)
 
 
 
+/*
+ * Cache of loaded scripts, kept mapped across deliveries.
+ *
+ * A long-running lmtpd used to stat, open, mmap and munmap the same
+ * .bc file for every message it delivered, which is pure overhead on
+ * high-fan-out deliveries that run the same few scripts over and
+ * over.  The cache keys on the script path and revalidates with a
+ * single stat() against (inode, mtime, size), so an upload through
+ * timsieved - which renames a fresh file into place - is picked up on
+ * the very next delivery.
+ *
+ * Only single-script executes are cached: once an execute has pulled
+ * in :include scripts, a change to an included file can't be detected
+ * from the outer script's stat data, so such executes are unloaded at
+ * release time like before.
+ */
+
+#define SCRIPT_CACHE_SIZE 8
+
+static struct script_cache_entry {
+    char *fname;
+    ino_t inode;
+    time_t mtime;
+    off_t size;
+    sieve_execute_t *exe;
+} script_cache[SCRIPT_CACHE_SIZE];
+
+static unsigned script_cache_victim = 0;
+
+static void script_cache_clear(struct script_cache_entry *sce)
+{
+    sieve_script_unload(&sce->exe);
+    free(sce->fname);
+    sce->fname = NULL;
+}
+
+/* Like sieve_script_load(), but the returned execute stays mapped
+ * across calls and MUST be handed back with sieve_script_release(),
+ * not sieve_script_unload() */
+EXPORTED int sieve_script_load_cached(const char *fname, sieve_execute_t **ret)
+{
+    struct stat sbuf;
+    struct script_cache_entry *sce = NULL;
+    int i, r;
+
+    if (!fname || !ret) return SIEVE_FAIL;
+
+    /* an execute passed in for INCLUDE chaining can't be cached */
+    if (*ret) return sieve_script_load(fname, ret);
+
+    if (stat(fname, &sbuf) == -1) {
+        if (errno == ENOENT) {
+            syslog(LOG_DEBUG, "WARNING: sieve script %s doesn't exist: %m",
+                   fname);
+        } else {
+            syslog(LOG_DEBUG, "IOERROR: fstating sieve script %s: %m", fname);
+        }
+        return SIEVE_FAIL;
+    }
+
+    for (i = 0; i < SCRIPT_CACHE_SIZE; i++) {
+        if (!script_cache[i].fname) continue;
+        if (strcmp(script_cache[i].fname, fname)) continue;
+
+        sce = &script_cache[i];
+        if (sce->inode == sbuf.st_ino &&
+            sce->mtime == sbuf.st_mtime &&
+            sce->size == sbuf.st_size) {
+            /* still current - hand it straight out */
+            sce->exe->bc_cur = sce->exe->bc_list;
+            *ret = sce->exe;
+            return SIEVE_OK;
+        }
+
+        /* the script changed underneath us - reload below */
+        script_cache_clear(sce);
+        break;
+    }
+
+    r = sieve_script_load(fname, ret);
+    if (r != SIEVE_OK) return r;
+
+    if (!sce) {
+        /* find a free slot, or evict round-robin */
+        for (i = 0; i < SCRIPT_CACHE_SIZE; i++) {
+            if (!script_cache[i].fname) break;
+        }
+        if (i == SCRIPT_CACHE_SIZE) {
+            i = script_cache_victim++ % SCRIPT_CACHE_SIZE;
+            script_cache_clear(&script_cache[i]);
+        }
+        sce = &script_cache[i];
+    }
+
+    sce->fname = xstrdup(fname);
+    sce->inode = sbuf.st_ino;
+    sce->mtime = sbuf.st_mtime;
+    sce->size = sbuf.st_size;
+    sce->exe = *ret;
+
+    return SIEVE_OK;
+}
+
+/* Hand back an execute obtained from sieve_script_load_cached() */
+EXPORTED int sieve_script_release(sieve_execute_t **s)
+{
+    int i;
+
+    if (!s || !*s) return SIEVE_FAIL;
+
+    for (i = 0; i < SCRIPT_CACHE_SIZE; i++) {
+        if (script_cache[i].exe != *s) continue;
+
+        if ((*s)->bc_list && (*s)->bc_list->next) {
+            /* execution pulled in :include scripts, which the cache
+             * can't revalidate - drop the whole execute */
+            script_cache_clear(&script_cache[i]);
+        }
+        *s = NULL;
+        return SIEVE_OK;
+    }
+
+    /* never made it into the cache */
+    return sieve_script_unload(s);
+}
+
 EXPORTED int sieve_script_unload(sieve_execute_t **s)
 {
     if(s && *s) {
@@ -224,6 +224,12 @@ int sieve_script_load(const char *fpath, sieve_execute_t **ret);
 /* Unload a sieve_bytecode_t */
 int sieve_script_unload(sieve_execute_t **s);
 
+/* like sieve_script_load(), but keeps the script mapped and validated
+ * across calls, revalidating with a single stat(); hand the execute
+ * back with sieve_script_release() */
+int sieve_script_load_cached(const char *fpath, sieve_execute_t **ret);
+int sieve_script_release(sieve_execute_t **s);
+
 /* Free a sieve_script_t */
 void sieve_script_free(sieve_script_t **s);
 
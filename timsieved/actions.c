@@ -322,6 +322,34 @@ static int countscripts(char *name)
 }
 
 
+/* is the stored script byte-identical to the new (normalized) content,
+   with its compiled bytecode already present alongside? */
+static int script_unchanged(const char *path, const char *bc_path,
+                            const struct buf *data)
+{
+    struct stat sbuf;
+    FILE *stream;
+    char *old;
+    int r = 0;
+
+    if (stat(bc_path, &sbuf) != 0) return 0;
+    if (stat(path, &sbuf) != 0) return 0;
+    if ((size_t) sbuf.st_size != data->len) return 0;
+
+    stream = fopen(path, "r");
+    if (!stream) return 0;
+
+    old = xmalloc(data->len + 1);
+    if (fread(old, 1, data->len, stream) == data->len &&
+        !memcmp(old, data->s, data->len))
+        r = 1;
+
+    fclose(stream);
+    free(old);
+
+    return r;
+}
+
 /* save name as a sieve script */
 int putscript(struct protstream *conn, const struct buf *name,
               const struct buf *data, int verify_only)
@@ -329,6 +357,7 @@ int putscript(struct protstream *conn, const struct buf *name,
   FILE *stream;
   const char *dataptr;
   struct buf errors = BUF_INITIALIZER;
+  struct buf normalized = BUF_INITIALIZER;
   unsigned int i;
   int last_was_r = 0;
   int result;
@@ -344,6 +373,37 @@ int putscript(struct protstream *conn, const struct buf *name,
       return result;
   }
 
+  /* normalize the data up front - replacing any lone \r or \n with the
+   * \r\n pair so notify messages are SMTP compatible */
+  dataptr = data->s;
+  for (i = 0; i < data->len; i++) {
+      if (last_was_r) {
+          if (dataptr[i] != '\n')
+              buf_putc(&normalized, '\n');
+      }
+      else {
+          if (dataptr[i] == '\n')
+              buf_putc(&normalized, '\r');
+      }
+      buf_putc(&normalized, dataptr[i]);
+      last_was_r = (dataptr[i] == '\r');
+  }
+  if (last_was_r)
+      buf_putc(&normalized, '\n');
+
+  if (!verify_only) {
+      /* provisioning systems re-PUT unchanged scripts on every sync:
+         when the stored script is byte-identical and its bytecode is
+         already compiled, there is nothing to parse or generate */
+      snprintf(p2, 1023, "%s.script", name->s);
+      snprintf(bc_p2, 1023, "%s.bc", name->s);
+      if (script_unchanged(p2, bc_p2, &normalized)) {
+          buf_free(&normalized);
+          prot_printf(conn, "OK\r\n");
+          return TIMSIEVE_OK;
+      }
+  }
+
   if (verify_only)
       stream = tmpfile();
 
@@ -356,6 +416,7 @@ int putscript(struct protstream *conn, const struct buf *name,
           prot_printf(conn,
                       "NO (QUOTA/MAXSCRIPTS) \"You are only allowed %d scripts on this server\"\r\n",
                       maxscripts);
+          buf_free(&normalized);
           return TIMSIEVE_FAIL;
       }
 
@@ -368,27 +429,14 @@ int putscript(struct protstream *conn, const struct buf *name,
   if (stream == NULL) {
       prot_printf(conn, "NO \"Unable to open script for writing (%s)\"\r\n",
                   path);
+      buf_free(&normalized);
       return TIMSIEVE_NOEXIST;
   }
 
-  dataptr = data->s;
-
-  /* copy data to file - replacing any lone \r or \n with the
-   * \r\n pair so notify messages are SMTP compatible */
-  for (i = 0; i < data->len; i++) {
-      if (last_was_r) {
-          if (dataptr[i] != '\n')
-              putc('\n', stream);
-      }
-      else {
-          if (dataptr[i] == '\n')
-              putc('\r', stream);
-      }
-      putc(dataptr[i], stream);
-      last_was_r = (dataptr[i] == '\r');
-  }
-  if (last_was_r)
-      putc('\n', stream);
+  /* copy the normalized data to the file */
+  if (normalized.len)
+      fwrite(normalized.s, 1, normalized.len, stream);
+  buf_free(&normalized);
 
   rewind(stream);
 
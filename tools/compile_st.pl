@@ -216,6 +216,10 @@ if ($h_flag)
         printf "};\n";
     }
 
+    printf "\n";
+    printf "#define %s_NUM_STRINGS %d\n", uc($name), $next_known;
+    printf "\n";
+
     printf "extern %s %s_from_string(const char *s);\n", $type, $name;
     printf "extern %s %s_from_string_len(const char *s, size_t len);\n", $type, $name;
     if (!$nliterals)